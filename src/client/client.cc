@@ -0,0 +1,447 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include <chrono>
+#include <random>
+
+#include "utils/log.h"
+#include "coap/header.h"
+#include "coap/view.h"
+#include "client/uri.h"
+#include "client/client.h"
+
+namespace client {
+
+namespace {
+
+uint64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool SamePeer(const sockaddr_storage& a, socklen_t a_len,
+              const sockaddr* b, socklen_t b_len) {
+  return a_len == b_len && memcmp(&a, b, a_len) == 0;
+}
+
+}   // namespace
+
+//
+// class Request
+//
+bool Request::await_suspend(std::coroutine_handle<> h) {
+  // If the request can't even be submitted, don't suspend: the
+  // coroutine goes on straight away with Status::error.
+  return client_->Submit(this, h);
+}
+
+//
+// class Client
+//
+Client::Client(net::Transport* transport, size_t max_peers)
+  : transport_(transport)
+  , peers_(max_peers)
+  , send_budget_(256) {
+  std::random_device rd;
+  token_salt_ = rd();
+}
+
+Request Client::MakeRequest(coap::Code code, const std::string& uri,
+                            const std::vector<uint8_t>& payload,
+                            coap::Type type, int timeout_ms) {
+  return Request(this, code, uri, payload, type, timeout_ms);
+}
+
+Request Client::Get(const std::string& uri, coap::Type type,
+                    int timeout_ms) {
+  return MakeRequest(coap::Code::GET, uri, { }, type, timeout_ms);
+}
+
+Request Client::Delete(const std::string& uri, coap::Type type,
+                       int timeout_ms) {
+  return MakeRequest(coap::Code::DELETE, uri, { }, type, timeout_ms);
+}
+
+Request Client::Post(const std::string& uri,
+                     const std::vector<uint8_t>& payload,
+                     coap::Type type, int timeout_ms) {
+  return MakeRequest(coap::Code::POST, uri, payload, type, timeout_ms);
+}
+
+Request Client::Put(const std::string& uri,
+                    const std::vector<uint8_t>& payload,
+                    coap::Type type, int timeout_ms) {
+  return MakeRequest(coap::Code::PUT, uri, payload, type, timeout_ms);
+}
+
+uint32_t Client::AllocSlot() {
+  if (free_.empty()) {
+    Exchange ex{};
+    ex.generation = 0;
+    ex.state = State::free;
+    slots_.push_back(ex);
+    return slots_.size() - 1;
+  }
+
+  uint32_t slot = free_.back();
+  free_.pop_back();
+  return slot;
+}
+
+bool Client::Submit(Request* req, std::coroutine_handle<> h) {
+  utils::Log* L = utils::Log::Instance();
+
+  sockaddr_storage peer;
+  socklen_t peer_len;
+  coap::Options opts;
+
+  if (!ParseUri(req->uri_, peer, peer_len, opts)) {
+    L->Debug("bad request URI: %s", req->uri_.c_str());
+    return false;
+  }
+
+  uint64_t now = NowMs();
+  const sockaddr* addr = reinterpret_cast<const sockaddr*>(&peer);
+  net::Peer* p = peers_.Lookup(addr, peer_len, now);
+  uint16_t mid;
+
+  if (!p) {
+    L->Debug("peer table full");
+    return false;
+  }
+
+  if (!peers_.NextMessageId(p, now, mid)) {
+    L->Debug("out of message IDs for %s", req->uri_.c_str());
+    return false;
+  }
+
+  uint32_t slot = AllocSlot();
+  Exchange& ex = slots_[slot];
+
+  // token := slot (4 bytes) | salted generation (4 bytes)
+  uint32_t gen = ex.generation ^ token_salt_;
+  std::vector<uint8_t> token {
+    uint8_t(slot >> 24), uint8_t(slot >> 16), uint8_t(slot >> 8),
+    uint8_t(slot), uint8_t(gen >> 24), uint8_t(gen >> 16),
+    uint8_t(gen >> 8), uint8_t(gen)
+  };
+
+  coap::PDU pdu;
+  pdu.set_type(req->type_);
+  pdu.set_code(req->code_);
+  pdu.set_message_id(mid);
+  pdu.set_token(token);
+  pdu.set_options(opts);
+  pdu.set_payload(req->payload_);
+
+  ex.wire.clear();
+  if (!pdu.Encode(ex.wire)) {
+    free_.push_back(slot);
+    return false;
+  }
+
+  ex.state = State::queued;
+  ex.req = req;
+  ex.waiter = h;
+  ex.peer = peer;
+  ex.peer_len = peer_len;
+  ex.peer_hash = peers_.Hash(addr, peer_len);
+  ex.type = req->type_;
+  ex.message_id = mid;
+  ex.retransmits = 0;
+  ex.deadline = now + req->timeout_ms_;
+  ex.retransmit_at = ex.deadline;
+
+  req->slot_ = slot;
+  req->generation_ = ex.generation;
+
+  Schedule(slot);
+  queue_.push_back(slot);
+
+  return true;
+}
+
+// (Re)arm the exchange timer for the earliest of its deadlines.
+void Client::Schedule(uint32_t slot) {
+  Exchange& ex = slots_[slot];
+
+  ex.next_event = std::min(ex.retransmit_at, ex.deadline);
+
+  Timer t;
+  t.when = ex.next_event;
+  t.slot = slot;
+  t.generation = ex.generation;
+  timers_.push(t);
+}
+
+void Client::Complete(uint32_t slot, Status status) {
+  Exchange& ex = slots_[slot];
+
+  ex.req->response_.status = status;
+  ready_.push_back(ex.waiter);
+
+  if (ex.type == coap::Type::CON) {
+    auto it = con_slots_.find(ConKey(ex.peer_hash, ex.message_id));
+    if (it != con_slots_.end() && it->second == slot)
+      con_slots_.erase(it);
+  }
+
+  // Stale timers and tokens are told apart by the generation.
+  ex.state = State::free;
+  ++ex.generation;
+  free_.push_back(slot);
+}
+
+bool Client::Cancel(const Request& req) {
+  if (req.slot_ >= slots_.size())
+    return false;
+
+  Exchange& ex = slots_[req.slot_];
+
+  if (ex.state == State::free || ex.generation != req.generation_)
+    return false;
+
+  // If still queued, it is skipped by SendQueued.
+  Complete(req.slot_, Status::cancelled);
+  return true;
+}
+
+bool Client::MatchToken(const uint8_t* token, size_t length,
+                        uint32_t& slot) const {
+  if (length != 8)
+    return false;
+
+  slot = (token[0] << 24) | (token[1] << 16) | (token[2] << 8) | token[3];
+  uint32_t gen = (token[4] << 24) | (token[5] << 16) | (token[6] << 8) |
+                 token[7];
+
+  return slot < slots_.size() &&
+         slots_[slot].state != State::free &&
+         slots_[slot].generation == (gen ^ token_salt_);
+}
+
+void Client::SendEmpty(coap::Type type, uint16_t message_id,
+                       const sockaddr* peer, socklen_t peer_len) {
+  uint8_t msg[4] = {
+    uint8_t((coap::Version::v1 << 6) | (type << 4)),
+    coap::Code::Empty,
+    uint8_t(message_id >> 8),
+    uint8_t(message_id & 0xFF)
+  };
+  transport_->Send(msg, sizeof msg, peer, peer_len);
+}
+
+// Feed the peer's RTO estimator, if ex was confirmable and is still
+// waiting for its first answer.
+void Client::SampleRtt(const Exchange& ex, uint64_t now) {
+  if (ex.type != coap::Type::CON || ex.state != State::sent)
+    return;
+
+  net::Peer* p = peers_.Find(reinterpret_cast<const sockaddr*>(&ex.peer),
+                             ex.peer_len);
+  if (p)
+    peers_.OnRtt(p, now - ex.sent_at, ex.retransmits, now);
+}
+
+void Client::OnEmpty(coap::EmptyKind kind, const net::Datagram& dgram) {
+  uint16_t mid = coap::HeaderMessageId(dgram.data);
+
+  if (kind == coap::EmptyKind::ping) {
+    uint8_t rst[4];
+    coap::ResetFor(dgram.data, rst);
+    transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+    return;
+  }
+
+  if (kind != coap::EmptyKind::ack && kind != coap::EmptyKind::reset)
+    return;
+
+  auto it = con_slots_.find(
+      ConKey(peers_.Hash(dgram.peer, dgram.peer_len), mid));
+
+  if (it == con_slots_.end())
+    return;
+
+  uint32_t slot = it->second;
+
+  if (slots_[slot].message_id != mid ||
+      slots_[slot].state != State::sent ||
+      !SamePeer(slots_[slot].peer, slots_[slot].peer_len,
+                dgram.peer, dgram.peer_len))
+    return;
+
+  if (kind == coap::EmptyKind::reset) {
+    Complete(slot, Status::reset);
+  } else {
+    // Separate response to follow: stop retransmitting, but keep
+    // the overall deadline.
+    SampleRtt(slots_[slot], NowMs());
+    slots_[slot].state = State::acked;
+    slots_[slot].retransmit_at = slots_[slot].deadline;
+    con_slots_.erase(it);
+    Schedule(slot);
+  }
+}
+
+void Client::OnDatagram(const net::Datagram& dgram) {
+  // Pings, empty ACKs and RSTs go by their header: no decoding.
+  coap::EmptyKind kind = coap::ClassifyEmpty(dgram.data, dgram.size);
+
+  if (kind != coap::EmptyKind::other) {
+    OnEmpty(kind, dgram);
+    return;
+  }
+
+  coap::PDUView view;
+
+  if (!view.Decode(dgram.data, dgram.size))
+    return;
+
+  uint16_t mid = view.message_id();
+
+  // We don't serve requests.
+  if (static_cast<int>(view.code()) <= coap::CodeBlocks::ReqMethodMax)
+    return;
+
+  uint32_t slot;
+
+  if (!MatchToken(view.token(), view.token_length(), slot) ||
+      !SamePeer(slots_[slot].peer, slots_[slot].peer_len,
+                dgram.peer, dgram.peer_len)) {
+    // A response we can't match (late, cancelled, bogus) is rejected
+    // with a RST, which also tells an observing server to stop.
+    if (view.type() != coap::Type::ACK)
+      SendEmpty(coap::Type::RST, mid, dgram.peer, dgram.peer_len);
+    return;
+  }
+
+  if (view.type() == coap::Type::CON)
+    SendEmpty(coap::Type::ACK, mid, dgram.peer, dgram.peer_len);
+
+  Exchange& ex = slots_[slot];
+
+  SampleRtt(ex, NowMs());
+
+  if (!ex.req->response_.pdu.Decode(
+          std::vector<uint8_t>(dgram.data, dgram.data + dgram.size))) {
+    Complete(slot, Status::error);
+    return;
+  }
+
+  Complete(slot, Status::ok);
+}
+
+void Client::SendQueued() {
+  uint64_t now = NowMs();
+
+  // Initial RTO is random in [RTO, RTO * ACK_RANDOM_FACTOR], where RTO
+  // is the peer's estimate (ACK_TIMEOUT until there is one).
+  static thread_local std::minstd_rand rng(std::random_device{ }());
+  std::uniform_real_distribution<double> factor(1, kAckRandomFactor);
+
+  for (size_t n = 0; n < send_budget_ && !queue_.empty(); ) {
+    uint32_t slot = queue_.front();
+    queue_.pop_front();
+
+    Exchange& ex = slots_[slot];
+
+    // Cancelled (or even reused) while it was waiting.
+    if (ex.state != State::queued)
+      continue;
+
+    transport_->Send(ex.wire.data(), ex.wire.size(),
+                     reinterpret_cast<const sockaddr*>(&ex.peer),
+                     ex.peer_len);
+    ex.state = State::sent;
+    ++n;
+
+    if (ex.type == coap::Type::CON) {
+      net::Peer* p = peers_.Find(reinterpret_cast<const sockaddr*>(&ex.peer),
+                                 ex.peer_len);
+      uint32_t rto = p ? peers_.Rto(p, now) : kAckTimeoutMs;
+
+      con_slots_[ConKey(ex.peer_hash, ex.message_id)] = slot;
+      ex.rto = rto * factor(rng);
+      ex.backoff = p ? p->backoff() : 2;
+      ex.sent_at = now;
+      ex.retransmit_at = now + ex.rto;
+      Schedule(slot);
+    }
+  }
+}
+
+void Client::FireTimers(uint64_t now) {
+  while (!timers_.empty() && timers_.top().when <= now) {
+    Timer t = timers_.top();
+    timers_.pop();
+
+    Exchange& ex = slots_[t.slot];
+
+    // Superseded by a later Schedule, or the exchange is over.
+    if (ex.state == State::free || ex.generation != t.generation ||
+        ex.next_event != t.when)
+      continue;
+
+    if (now >= ex.deadline) {
+      Complete(t.slot, Status::timeout);
+      continue;
+    }
+
+    if (ex.state != State::sent)
+      continue;
+
+    if (ex.retransmits == kMaxRetransmit) {
+      Complete(t.slot, Status::timeout);
+      continue;
+    }
+
+    transport_->Send(ex.wire.data(), ex.wire.size(),
+                     reinterpret_cast<const sockaddr*>(&ex.peer),
+                     ex.peer_len);
+    ++ex.retransmits;
+    ex.rto *= ex.backoff;
+    ex.retransmit_at = now + ex.rto;
+    Schedule(t.slot);
+  }
+}
+
+void Client::ResumeReady() {
+  // Resumed coroutines may issue (and complete) new requests.
+  while (!ready_.empty()) {
+    resuming_.swap(ready_);
+    for (auto h : resuming_)
+      h.resume();
+    resuming_.clear();
+  }
+}
+
+void Client::RunOnce(int timeout_ms) {
+  SendQueued();
+  transport_->Flush();
+
+  int wait = timeout_ms;
+
+  if (!queue_.empty() || !ready_.empty()) {
+    wait = 0;
+  } else if (!timers_.empty()) {
+    uint64_t now = NowMs();
+    uint64_t next = timers_.top().when;
+    int until = next > now ? next - now : 0;
+    if (wait < 0 || until < wait)
+      wait = until;
+  }
+
+  transport_->Poll(this, wait);
+
+  uint64_t now = NowMs();
+  FireTimers(now);
+  transport_->Flush();
+
+  // Forget about peers we haven't talked to in a while, a bit at a time.
+  peers_.EvictIdle(now, kEvictBudget);
+
+  ResumeReady();
+}
+
+}   // namespace client
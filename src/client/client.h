@@ -0,0 +1,233 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef CLIENT_CLIENT_H_
+#define CLIENT_CLIENT_H_
+
+#include <sys/socket.h>
+
+#include <coroutine>
+#include <deque>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "coap/header.h"
+#include "coap/proto.h"
+#include "coap/pdu.h"
+#include "net/peer_table.h"
+#include "net/transport.h"
+#include "client/task.h"
+
+namespace client {
+
+// Message transmission parameters (RFC 7252, 4.8)
+const int kAckTimeoutMs = 2000;
+const double kAckRandomFactor = 1.5;
+const unsigned kMaxRetransmit = 4;
+
+// MAX_TRANSMIT_WAIT: give up on a request after this long.
+const int kDefaultTimeoutMs = 93000;
+
+// Default size of the peer table.
+const size_t kMaxPeers = 65536;
+
+enum class Status {
+  ok,         // response is in pdu
+  timeout,    // no response in time (or all retransmissions lost)
+  cancelled,  // Client::Cancel()
+  reset,      // peer answered with RST
+  error       // bad URI, encoding failure, ...
+};
+
+struct Response {
+  Status status;
+  coap::PDU pdu;
+};
+
+class Client;
+
+// What Client::Get() and friends return: co_await it to send the
+// request and get the Response.  Nothing goes on the wire until then.
+class Request {
+ public:
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> h);
+  Response await_resume() { return response_; }
+
+ private:
+  friend class Client;
+
+  Request(Client* client, coap::Code code, const std::string& uri,
+          const std::vector<uint8_t>& payload, coap::Type type,
+          int timeout_ms)
+    : client_(client)
+    , code_(code)
+    , type_(type)
+    , uri_(uri)
+    , payload_(payload)
+    , timeout_ms_(timeout_ms)
+    , slot_(0)
+    , generation_(0)
+  { response_.status = Status::error; }
+
+ private:
+  Client* client_;
+  coap::Code code_;
+  coap::Type type_;
+  std::string uri_;
+  std::vector<uint8_t> payload_;
+  int timeout_ms_;
+
+  // Exchange this request is bound to, once submitted.
+  uint32_t slot_;
+  uint32_t generation_;
+
+  Response response_;
+};
+
+// Asynchronous CoAP client, to be driven by a single (I/O) thread:
+//
+//   Task<void> Fetch(Client& c) {
+//     Response r = co_await c.Get("coap://192.0.2.1/temp");
+//     ...
+//   }
+//
+//   Spawn(Fetch(c));
+//   while (...)
+//     c.RunOnce(100);
+//
+// Responses are matched to requests by token: a token encodes the
+// slot of its exchange in the table, so matching is a bounds and
+// generation check rather than a lookup.  A coroutine waiting on a
+// request is resumed from RunOnce() when the response arrives, the
+// request times out or it is cancelled.
+//
+// Message IDs are allocated per peer, from a net::PeerTable that also
+// keeps an RTT estimate for each peer: confirmable requests start with
+// the peer's RTO and are retransmitted with its back-off factor.
+// Responses to unknown (e.g. cancelled) exchanges are answered with a
+// RST, so that the server stops sending them.
+class Client : public net::Handler {
+ public:
+  // transport must be open, and outlive the client.  State is kept
+  // for up to max_peers servers.
+  explicit Client(net::Transport* transport, size_t max_peers = kMaxPeers);
+
+  Request Get(const std::string& uri,
+              coap::Type type = coap::Type::CON,
+              int timeout_ms = kDefaultTimeoutMs);
+  Request Delete(const std::string& uri,
+                 coap::Type type = coap::Type::CON,
+                 int timeout_ms = kDefaultTimeoutMs);
+  Request Post(const std::string& uri, const std::vector<uint8_t>& payload,
+               coap::Type type = coap::Type::CON,
+               int timeout_ms = kDefaultTimeoutMs);
+  Request Put(const std::string& uri, const std::vector<uint8_t>& payload,
+              coap::Type type = coap::Type::CON,
+              int timeout_ms = kDefaultTimeoutMs);
+
+  // Abandon a request that is being awaited: its coroutine is resumed
+  // with Status::cancelled.  Return false if it is already done.
+  bool Cancel(const Request& req);
+
+  // Send what is queued, wait up to timeout_ms for datagrams, fire
+  // expired timers and resume the coroutines whose request is done.
+  void RunOnce(int timeout_ms);
+
+  size_t in_flight() const { return slots_.size() - free_.size(); }
+
+  // Max number of new requests put on the wire per RunOnce, so that a
+  // burst of submissions doesn't overrun the peers' socket buffers.
+  void set_send_budget(size_t n) { send_budget_ = n; }
+
+  void OnDatagram(const net::Datagram& dgram);
+
+ private:
+  friend class Request;
+
+  enum class State {
+    free,
+    queued,     // waiting for its turn to be sent
+    sent,       // waiting for ACK (CON) or response
+    acked       // empty ACK seen, waiting for a separate response
+  };
+
+  struct Exchange {
+    uint32_t generation;
+    State state;
+    Request* req;
+    std::coroutine_handle<> waiter;
+    std::vector<uint8_t> wire;
+    sockaddr_storage peer;
+    socklen_t peer_len;
+    uint32_t peer_hash;
+    coap::Type type;
+    uint16_t message_id;
+    unsigned retransmits;
+    uint64_t rto;
+    double backoff;
+    uint64_t sent_at;
+    uint64_t retransmit_at;
+    uint64_t deadline;
+    uint64_t next_event;
+  };
+
+  struct Timer {
+    uint64_t when;
+    uint32_t slot;
+    uint32_t generation;
+
+    bool operator> (const Timer& other) const { return when > other.when; }
+  };
+
+  Request MakeRequest(coap::Code code, const std::string& uri,
+                      const std::vector<uint8_t>& payload, coap::Type type,
+                      int timeout_ms);
+  bool Submit(Request* req, std::coroutine_handle<> h);
+  uint32_t AllocSlot();
+  void Schedule(uint32_t slot);
+  void Complete(uint32_t slot, Status status);
+  bool MatchToken(const uint8_t* token, size_t length, uint32_t& slot) const;
+  void SendQueued();
+  void FireTimers(uint64_t now);
+  void ResumeReady();
+  void SendEmpty(coap::Type type, uint16_t message_id,
+                 const sockaddr* peer, socklen_t peer_len);
+  void SampleRtt(const Exchange& ex, uint64_t now);
+  void OnEmpty(coap::EmptyKind kind, const net::Datagram& dgram);
+
+  static uint64_t ConKey(uint32_t peer_hash, uint16_t message_id) {
+    return (static_cast<uint64_t>(peer_hash) << 16) | message_id;
+  }
+
+ private:
+  // Peer table slots looked at for idle peers per RunOnce.
+  static constexpr size_t kEvictBudget = 64;
+
+  net::Transport* transport_;
+
+  std::vector<Exchange> slots_;
+  std::vector<uint32_t> free_;
+  std::deque<uint32_t> queue_;
+
+  net::PeerTable peers_;
+
+  // Confirmable exchanges on the wire by peer hash and message ID, for
+  // empty ACKs and RSTs.  Two peers whose hashes collide may clash on
+  // a message ID: the older exchange then just can't be ACKed early.
+  std::unordered_map<uint64_t, uint32_t> con_slots_;
+  uint32_t token_salt_;
+
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>>
+      timers_;
+
+  std::vector<std::coroutine_handle<>> ready_;
+  std::vector<std::coroutine_handle<>> resuming_;
+
+  size_t send_budget_;
+};
+
+}   // namespace client
+
+#endif  // CLIENT_CLIENT_H_
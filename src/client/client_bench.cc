@@ -0,0 +1,140 @@
+// Copyleft 2013 tho@autistici.org
+
+// 100k concurrent requests from a single thread.
+//
+// Each request is a coroutine doing co_await client.Get(); they are
+// all started up front, so that they are in flight at the same time,
+// and then loopback servers running in the same thread answer them.
+// Requests are spread over kServers server sockets, as a peer only
+// gets 3-4 x 16384 message IDs per EXCHANGE_LIFETIME.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "coap/view.h"
+#include "client/client.h"
+
+using namespace client;
+
+const size_t kServers = 8;
+
+class Server : public net::Handler {
+ public:
+  explicit Server(net::Transport* t) : t_(t) { }
+
+  void OnDatagram(const net::Datagram& dgram) {
+    coap::PDUView req;
+    if (!req.Decode(dgram.data, dgram.size) ||
+        req.code() != coap::Code::GET)
+      return;
+
+    // NON 2.05 echoing the token, no options, 2 bytes of payload.
+    uint8_t rsp[4 + 8 + 3];
+    size_t tkl = req.token_length();
+    rsp[0] = 0x50 | tkl;
+    rsp[1] = coap::Code::Content;
+    rsp[2] = dgram.data[2];
+    rsp[3] = dgram.data[3];
+    memcpy(rsp + 4, req.token(), tkl);
+    rsp[4 + tkl] = 0xFF;
+    rsp[5 + tkl] = 'o';
+    rsp[6 + tkl] = 'k';
+
+    t_->Send(rsp, 7 + tkl, dgram.peer, dgram.peer_len);
+  }
+
+ private:
+  net::Transport* t_;
+};
+
+struct Stats {
+  size_t ok;
+  size_t failed;
+};
+
+Task<void> fetch(Client& c, const std::string& uri, Stats* stats) {
+  Response r = co_await c.Get(uri, coap::Type::NON, 30000);
+  if (r.status == Status::ok)
+    ++stats->ok;
+  else
+    ++stats->failed;
+}
+
+std::unique_ptr<net::Transport> open_loopback(sockaddr_in& sin) {
+  std::unique_ptr<net::Transport> t = net::NewTransport(net::Backend::any);
+
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&sin), sizeof sin));
+
+  socklen_t len = sizeof sin;
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&sin), &len) == 0);
+
+  return t;
+}
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+
+  sockaddr_in sin;
+  auto ct = open_loopback(sin);
+
+  std::vector<std::unique_ptr<net::Transport>> sts;
+  std::vector<std::unique_ptr<Server>> servers;
+  std::vector<std::string> uris;
+
+  for (size_t i = 0; i < kServers; ++i) {
+    sts.push_back(open_loopback(sin));
+    servers.push_back(std::unique_ptr<Server>(new Server(sts.back().get())));
+    uris.push_back("coap://127.0.0.1:" + std::to_string(ntohs(sin.sin_port)) +
+                   "/sensors/temp");
+  }
+
+  Client c(ct.get());
+  c.set_send_budget(128);
+  Stats stats = { 0, 0 };
+
+  FramePool* pool = FramePool::Instance();
+  pool->Reserve(2 * n);
+  size_t chunks = pool->chunks();
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < n; ++i)
+    Spawn(fetch(c, uris[i % kServers], &stats));
+
+  size_t peak = c.in_flight();
+
+  auto submitted = std::chrono::steady_clock::now();
+
+  while (stats.ok + stats.failed < n) {
+    c.RunOnce(0);
+    for (size_t i = 0; i < kServers; ++i) {
+      sts[i]->Poll(servers[i].get(), 0);
+      sts[i]->Flush();
+    }
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> spawn_time = submitted - start;
+  std::chrono::duration<double> total = end - start;
+
+  printf("backend:          %s\n", net::BackendName(ct->backend()));
+  printf("requests:         %zu (%zu ok, %zu failed)\n",
+         n, stats.ok, stats.failed);
+  printf("peak in flight:   %zu\n", peak);
+  printf("spawn:            %.3f s (%.0f ns/request)\n",
+         spawn_time.count(), 1e9 * spawn_time.count() / n);
+  printf("total:            %.3f s (%.0f requests/s)\n",
+         total.count(), n / total.count());
+  printf("frame pool:       %zu chunk(s) reserved, %zu grown, "
+         "%zu heap fallback(s)\n",
+         chunks, pool->chunks() - chunks, pool->fallbacks());
+}
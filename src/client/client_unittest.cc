@@ -0,0 +1,229 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include "coap/view.h"
+#include "client/client.h"
+#include "client/uri.h"
+
+using namespace client;
+
+void init_log() {
+  utils::Log::Instance()->Open("client_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+std::unique_ptr<net::Transport> open_loopback(std::string& uri_base) {
+  std::unique_ptr<net::Transport> t = net::NewTransport(net::Backend::epoll);
+
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&sin), sizeof sin));
+
+  socklen_t len = sizeof sin;
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&sin), &len) == 0);
+  uri_base = "coap://127.0.0.1:" + std::to_string(ntohs(sin.sin_port));
+
+  return t;
+}
+
+// A server that can answer piggybacked, separately, or not at all.
+class Server : public net::Handler {
+ public:
+  enum Mode { piggyback, separate, silent };
+
+  explicit Server(net::Transport* t) : t_(t), mode_(piggyback), rsts_(0) { }
+
+  void OnDatagram(const net::Datagram& dgram) {
+    coap::PDUView req;
+    assert(req.Decode(dgram.data, dgram.size));
+
+    if (req.type() == coap::Type::RST) {
+      ++rsts_;
+      return;
+    }
+
+    if (mode_ == silent || req.code() == coap::Code::Empty)
+      return;
+
+    coap::PDU rsp;
+    rsp.set_code(coap::Code::Content);
+    rsp.set_token(std::vector<uint8_t>(req.token(),
+                                       req.token() + req.token_length()));
+    rsp.set_payload({ 'o', 'k' });
+
+    if (mode_ == piggyback) {
+      rsp.set_type(coap::Type::ACK);
+      rsp.set_message_id(req.message_id());
+    } else {
+      uint8_t ack[4] = { 0x60, 0x00, dgram.data[2], dgram.data[3] };
+      t_->Send(ack, sizeof ack, dgram.peer, dgram.peer_len);
+      rsp.set_type(coap::Type::CON);
+      rsp.set_message_id(0x4242);
+    }
+
+    std::vector<uint8_t> buf;
+    assert(rsp.Encode(buf));
+    t_->Send(buf.data(), buf.size(), dgram.peer, dgram.peer_len);
+  }
+
+  net::Transport* t_;
+  Mode mode_;
+  size_t rsts_;
+};
+
+Task<void> fetch(Client& c, std::string uri, Status expect, int* done) {
+  Response r = co_await c.Get(uri, coap::Type::CON, 300);
+  assert(r.status == expect);
+  if (expect == Status::ok)
+    assert((r.pdu.payload() == std::vector<uint8_t>{ 'o', 'k' }));
+  ++*done;
+}
+
+void run(Client& c, net::Transport* st, Server& server, int* done, int n) {
+  for (int i = 0; i < 200 && *done < n; ++i) {
+    c.RunOnce(5);
+    st->Poll(&server, 0);
+    st->Flush();
+  }
+  assert(*done == n);
+}
+
+void test_ok_uri() {
+  sockaddr_storage peer;
+  socklen_t len;
+  coap::Options opts;
+  assert(ParseUri("coap://[::1]:1234/a/b?x=1&y", peer, len, opts));
+  assert(peer.ss_family == AF_INET6);
+  std::vector<coap::Option> res;
+  assert(opts.LookUp(coap::Uri_Path, res) && res.size() == 2);
+  assert(opts.LookUp(coap::Uri_Query, res) && res.size() == 2);
+
+  coap::Options none;
+  assert(ParseUri("coap://10.0.0.1", peer, len, none));
+  assert(none.count() == 0);
+
+  assert(!ParseUri("http://10.0.0.1/", peer, len, none));
+  assert(!ParseUri("coap://example.org/", peer, len, none));
+}
+
+void test_ok_piggybacked_and_separate() {
+  std::string base;
+  auto ct = open_loopback(base);
+  auto st = open_loopback(base);
+  Client c(ct.get());
+  Server server(st.get());
+  int done = 0;
+
+  Spawn(fetch(c, base + "/a", Status::ok, &done));
+  run(c, st.get(), server, &done, 1);
+
+  server.mode_ = Server::separate;
+  Spawn(fetch(c, base + "/b", Status::ok, &done));
+  run(c, st.get(), server, &done, 2);
+
+  assert(c.in_flight() == 0);
+}
+
+void test_ok_timeout() {
+  std::string base;
+  auto ct = open_loopback(base);
+  auto st = open_loopback(base);
+  Client c(ct.get());
+  Server server(st.get());
+  server.mode_ = Server::silent;
+  int done = 0;
+
+  Spawn(fetch(c, base + "/slow", Status::timeout, &done));
+  run(c, st.get(), server, &done, 1);
+}
+
+Task<void> cancelled(Client& c, std::string uri, Request** slot, int* done) {
+  Request req = c.Get(uri, coap::Type::CON, 5000);
+  *slot = &req;
+  Response r = co_await req;
+  assert(r.status == Status::cancelled);
+  ++*done;
+}
+
+void test_ok_cancel_then_rst() {
+  std::string base;
+  auto ct = open_loopback(base);
+  auto st = open_loopback(base);
+  Client c(ct.get());
+  Server server(st.get());
+  server.mode_ = Server::silent;
+  int done = 0;
+  Request* req = nullptr;
+
+  Spawn(cancelled(c, base + "/x", &req, &done));
+  c.RunOnce(0);   // request on the wire, server drops it
+  st->Poll(&server, 10);
+  assert(c.Cancel(*req));
+  run(c, st.get(), server, &done, 1);
+  assert(c.in_flight() == 0);
+
+  // The request now shows up late (e.g. a retransmission), and gets
+  // answered: the client rejects the response.
+  server.mode_ = Server::separate;
+  Spawn(fetch(c, base + "/y", Status::ok, &done));
+  run(c, st.get(), server, &done, 2);
+  assert(server.rsts_ == 0);
+
+  coap::PDU late;
+  late.set_type(coap::Type::NON);
+  late.set_code(coap::Code::Content);
+  late.set_token({ 0, 0, 0, 0, 1, 2, 3, 4 });
+  std::vector<uint8_t> buf;
+  assert(late.Encode(buf));
+
+  sockaddr_in sin;
+  socklen_t len = sizeof sin;
+  getsockname(ct->fd(), reinterpret_cast<sockaddr*>(&sin), &len);
+  st->Send(buf.data(), buf.size(), reinterpret_cast<sockaddr*>(&sin), len);
+  st->Flush();
+  for (int i = 0; i < 20 && server.rsts_ == 0; ++i) {
+    c.RunOnce(5);
+    st->Poll(&server, 5);
+  }
+  assert(server.rsts_ == 1);
+}
+
+void test_ok_bad_uri() {
+  std::string base;
+  auto ct = open_loopback(base);
+  Client c(ct.get());
+  int done = 0;
+
+  // Fails without suspending.
+  Spawn(fetch(c, "coap://nowhere/", Status::error, &done));
+  assert(done == 1);
+}
+
+void test_ok_frames_pooled() {
+  FramePool* pool = FramePool::Instance();
+  size_t fallbacks = pool->fallbacks();
+  size_t in_use = pool->in_use();
+
+  test_ok_piggybacked_and_separate();
+
+  assert(pool->fallbacks() == fallbacks);
+  assert(pool->in_use() == in_use);
+}
+
+int main() {
+  init_log();
+
+  test_ok_uri();
+  test_ok_piggybacked_and_separate();
+  test_ok_timeout();
+  test_ok_cancel_then_rst();
+  test_ok_bad_uri();
+  test_ok_frames_pooled();
+}
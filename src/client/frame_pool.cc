@@ -0,0 +1,59 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <new>
+
+#include "client/frame_pool.h"
+
+namespace client {
+
+FramePool* FramePool::Instance() {
+  static thread_local FramePool pool;
+  return &pool;
+}
+
+void* FramePool::Allocate(size_t size) {
+  if (size > kBlockSize) {
+    ++fallbacks_;
+    return ::operator new(size);
+  }
+
+  if (!free_)
+    Grow();
+
+  Block* b = free_;
+  free_ = b->next;
+  ++in_use_;
+
+  return b;
+}
+
+void FramePool::Free(void* p, size_t size) {
+  if (size > kBlockSize) {
+    ::operator delete(p);
+    return;
+  }
+
+  Block* b = static_cast<Block*>(p);
+  b->next = free_;
+  free_ = b;
+  --in_use_;
+}
+
+void FramePool::Reserve(size_t n) {
+  while (chunks_.size() * kBlocksPerChunk < in_use_ + n)
+    Grow();
+}
+
+void FramePool::Grow() {
+  uint8_t* chunk = new uint8_t[kBlockSize * kBlocksPerChunk];
+  chunks_.emplace_back(chunk);
+
+  // Thread the new blocks onto the free list.
+  for (size_t i = kBlocksPerChunk; i > 0; --i) {
+    Block* b = reinterpret_cast<Block*>(chunk + (i - 1) * kBlockSize);
+    b->next = free_;
+    free_ = b;
+  }
+}
+
+}   // namespace client
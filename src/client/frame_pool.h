@@ -0,0 +1,59 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef CLIENT_FRAME_POOL_H_
+#define CLIENT_FRAME_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+namespace client {
+
+// Free-list allocator for coroutine frames.  Frames are carved out of
+// big chunks in fixed size blocks and recycled, so that issuing a
+// request doesn't go to the heap once the pool is warm.  Frames that
+// don't fit a block fall back to ::operator new (see fallbacks()).
+//
+// Not thread safe: there is one pool per (I/O) thread.
+class FramePool {
+ public:
+  FramePool(FramePool const&) = delete;
+  FramePool& operator= (FramePool const&) = delete;
+
+ public:
+  static FramePool* Instance();
+
+ public:
+  void* Allocate(size_t size);
+  void Free(void* p, size_t size);
+
+  // Pre-allocate room for n frames.
+  void Reserve(size_t n);
+
+  size_t chunks() const { return chunks_.size(); }
+  size_t in_use() const { return in_use_; }
+  size_t fallbacks() const { return fallbacks_; }
+
+  static const size_t kBlockSize = 512;
+  static const size_t kBlocksPerChunk = 1024;
+
+ private:
+  FramePool() : free_(nullptr), in_use_(0), fallbacks_(0) { }
+  void Grow();
+
+ private:
+  struct Block {
+    Block* next;
+  };
+
+  Block* free_;
+  std::vector<std::unique_ptr<uint8_t[]>> chunks_;
+  size_t in_use_;
+  size_t fallbacks_;
+};
+
+}   // namespace client
+
+#endif  // CLIENT_FRAME_POOL_H_
@@ -0,0 +1,146 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef CLIENT_TASK_H_
+#define CLIENT_TASK_H_
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "client/frame_pool.h"
+
+namespace client {
+
+// Coroutine frames of every promise type below come from the
+// per-thread FramePool instead of the heap.
+struct PooledFrame {
+  static void* operator new(size_t size) {
+    return FramePool::Instance()->Allocate(size);
+  }
+  static void operator delete(void* p, size_t size) {
+    FramePool::Instance()->Free(p, size);
+  }
+};
+
+template <typename Tp> class Task;
+
+namespace detail {
+
+// Resume whoever co_await-ed the finished task.
+struct FinalAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> h) noexcept {
+    std::coroutine_handle<> next = h.promise().continuation_;
+    return next ? next : std::noop_coroutine();
+  }
+
+  void await_resume() const noexcept { }
+};
+
+struct PromiseBase : PooledFrame {
+  std::suspend_always initial_suspend() const noexcept { return { }; }
+  FinalAwaiter final_suspend() const noexcept { return { }; }
+  void unhandled_exception() const { std::terminate(); }
+
+  std::coroutine_handle<> continuation_;
+};
+
+}   // namespace detail
+
+// A lazily started coroutine producing a Tp.  It runs when awaited
+// and resumes the awaiting coroutine when done (symmetric transfer,
+// so long chains don't grow the stack).
+template <typename Tp>
+class Task {
+ public:
+  struct promise_type : detail::PromiseBase {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    void return_value(Tp v) { value_ = std::move(v); }
+
+    Tp value_;
+  };
+
+  Task(Task&& other) noexcept : h_(std::exchange(other.h_, nullptr)) { }
+  Task(const Task&) = delete;
+  Task& operator= (const Task&) = delete;
+
+  ~Task() {
+    if (h_)
+      h_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+    h_.promise().continuation_ = h;
+    return h_;
+  }
+
+  Tp await_resume() { return std::move(h_.promise().value_); }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) { }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class Task<void> {
+ public:
+  struct promise_type : detail::PromiseBase {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    void return_void() const { }
+  };
+
+  Task(Task&& other) noexcept : h_(std::exchange(other.h_, nullptr)) { }
+  Task(const Task&) = delete;
+  Task& operator= (const Task&) = delete;
+
+  ~Task() {
+    if (h_)
+      h_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+    h_.promise().continuation_ = h;
+    return h_;
+  }
+
+  void await_resume() const { }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) { }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+// Run task to completion without anybody waiting for it.  The frame
+// (and the task's) is released when it finishes.
+struct Detached {
+  struct promise_type : PooledFrame {
+    Detached get_return_object() const { return { }; }
+    std::suspend_never initial_suspend() const noexcept { return { }; }
+    std::suspend_never final_suspend() const noexcept { return { }; }
+    void return_void() const { }
+    void unhandled_exception() const { std::terminate(); }
+  };
+};
+
+inline Detached Spawn(Task<void> task) {
+  co_await task;
+}
+
+}   // namespace client
+
+#endif  // CLIENT_TASK_H_
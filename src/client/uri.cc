@@ -0,0 +1,117 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utils/log.h"
+#include "client/uri.h"
+
+namespace client {
+
+namespace {
+
+// Add each sep-separated component of s as an option through add.
+template <typename Add>
+bool AddSplit(const std::string& s, char sep, Add add) {
+  size_t start = 0;
+
+  while (start <= s.size()) {
+    size_t end = s.find(sep, start);
+    if (end == std::string::npos)
+      end = s.size();
+    if (!add(s.substr(start, end - start)))
+      return false;
+    start = end + 1;
+  }
+
+  return true;
+}
+
+}   // namespace
+
+bool ParseUri(const std::string& uri, sockaddr_storage& peer,
+              socklen_t& peer_len, coap::Options& opts) {
+  utils::Log* L = utils::Log::Instance();
+
+  const std::string scheme = "coap://";
+
+  if (uri.compare(0, scheme.size(), scheme) != 0) {
+    L->Debug("unsupported URI scheme: %s", uri.c_str());
+    return false;
+  }
+
+  size_t host_start = scheme.size();
+  size_t host_end, port_start;
+
+  if (uri[host_start] == '[') {
+    host_end = uri.find(']', host_start);
+    if (host_end == std::string::npos)
+      return false;
+    port_start = host_end + 1;
+    ++host_start;
+  } else {
+    host_end = uri.find_first_of(":/?", host_start);
+    if (host_end == std::string::npos)
+      host_end = uri.size();
+    port_start = host_end;
+  }
+
+  std::string host = uri.substr(host_start, host_end - host_start);
+
+  unsigned long port = kDefaultPort;
+  size_t path_start = port_start;
+
+  if (port_start < uri.size() && uri[port_start] == ':') {
+    char* end;
+    port = strtoul(uri.c_str() + port_start + 1, &end, 10);
+    path_start = end - uri.c_str();
+    if (port == 0 || port > 65535) {
+      L->Debug("bad port in URI: %s", uri.c_str());
+      return false;
+    }
+  }
+
+  memset(&peer, 0, sizeof peer);
+
+  sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&peer);
+  sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&peer);
+
+  if (inet_pton(AF_INET, host.c_str(), &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    peer_len = sizeof *sin;
+  } else if (inet_pton(AF_INET6, host.c_str(), &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    peer_len = sizeof *sin6;
+  } else {
+    L->Debug("host is not an IP literal: %s", host.c_str());
+    return false;
+  }
+
+  size_t query_start = uri.find('?', path_start);
+  std::string path = uri.substr(path_start, query_start - path_start);
+
+  // "/" (or nothing) is the root resource: no Uri-Path at all.
+  if (path.size() > 1) {
+    if (path[0] != '/')
+      return false;
+    if (!AddSplit(path.substr(1), '/', [&opts] (const std::string& seg) {
+          return opts.AddUriPath(seg);
+        }))
+      return false;
+  }
+
+  if (query_start != std::string::npos &&
+      !AddSplit(uri.substr(query_start + 1), '&',
+                [&opts] (const std::string& arg) {
+                  return opts.AddUriQuery(arg);
+                }))
+    return false;
+
+  return true;
+}
+
+}   // namespace client
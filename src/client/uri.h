@@ -0,0 +1,25 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef CLIENT_URI_H_
+#define CLIENT_URI_H_
+
+#include <sys/socket.h>
+
+#include <string>
+
+#include "coap/options.h"
+
+namespace client {
+
+const uint16_t kDefaultPort = 5683;
+
+// Split a "coap://host[:port][/path][?query]" URI into the peer
+// address and the Uri-Path / Uri-Query options to send to it.
+// host must be a literal IPv4 address or a bracketed IPv6 one: name
+// resolution is a blocking affair and is left to the caller.
+bool ParseUri(const std::string& uri, sockaddr_storage& peer,
+              socklen_t& peer_len, coap::Options& opts);
+
+}   // namespace client
+
+#endif  // CLIENT_URI_H_
@@ -0,0 +1,58 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_BLOCK_H_
+#define COAP_BLOCK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace coap {
+
+// The value of a Block2 (or Block1) option, RFC 7959 2.2:
+//
+//   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3
+//  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  |                 NUM                   |M| SZX |
+//  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+struct Block {
+  uint32_t num;
+  bool more;
+  uint8_t szx;              // size is 2^(szx + 4)
+
+  size_t size() const { return size_t(16) << szx; }
+  size_t offset() const { return num * size(); }
+};
+
+const uint8_t kMaxSzx = 6;  // 1024 bytes; 7 is reserved
+const uint32_t kMaxBlockNum = (1 << 20) - 1;
+
+// Decode an option value (the uint bytes as they are on the wire).
+inline bool DecodeBlock(const uint8_t* value, size_t length, Block& block) {
+  if (length > 3)
+    return false;
+
+  uint32_t v = 0;
+  for (size_t i = 0; i < length; ++i)
+    v = (v << 8) | value[i];
+
+  block.num = v >> 4;
+  block.more = v & 0x08;
+  block.szx = v & 0x07;
+  return block.szx <= kMaxSzx;
+}
+
+inline uint32_t EncodeBlock(const Block& block) {
+  return (block.num << 4) | (block.more ? 0x08 : 0) | block.szx;
+}
+
+// The largest SZX whose blocks fit in size bytes (0 if none does).
+inline uint8_t SzxFor(size_t size) {
+  uint8_t szx = kMaxSzx;
+  while (szx > 0 && (size_t(16) << szx) > size)
+    --szx;
+  return szx;
+}
+
+}   // namespace coap
+
+#endif  // COAP_BLOCK_H_
@@ -0,0 +1,77 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_CACHE_KEY_H_
+#define COAP_CACHE_KEY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "coap/optstore.h"
+
+namespace coap {
+
+// A 64-bit hash of the cache-key options of a message: all but the
+// NoCacheKey ones (RFC 7252, 5.4.2), numbers and values, folded in as
+// they come in encoding order.  The decoders work it out on their way
+// through the options, for caches, deduplication and coalescing tables
+// to index by; the method, and a comparison of the options themselves
+// on a match, are up to them.
+class CacheKey {
+ public:
+  CacheKey() : h_(0x243F6A8885A308D3ULL) { }
+
+  void Add(size_t num, const uint8_t* value, size_t length) {
+    if (IsNoCacheKey(num))
+      return;
+
+    // Tails are read as (overlapping) whole words, as in wyhash: the
+    // length, folded in first, tells them apart.
+    h_ = Fold(h_, (static_cast<uint64_t>(num) << 32) | length);
+    if (length > 8) {
+      const uint8_t* last = value + length - 8;
+      for (; value < last; value += 8)
+        h_ = Fold(h_, Load64(value));
+      h_ = Fold(h_, Load64(last));
+    } else if (length >= 4) {
+      h_ = Fold(h_, (static_cast<uint64_t>(Load32(value)) << 32) |
+                    Load32(value + length - 4));
+    } else if (length) {
+      h_ = Fold(h_, (value[0] << 16) | (value[length / 2] << 8) |
+                    value[length - 1]);
+    }
+  }
+
+  // (The splitmix64 finalizer, for the low bits tables index by.)
+  uint64_t value() const {
+    uint64_t z = h_;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+ private:
+  static uint64_t Load64(const uint8_t* p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof w);
+    return w;
+  }
+
+  static uint32_t Load32(const uint8_t* p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof w);
+    return w;
+  }
+
+  static uint64_t Fold(uint64_t h, uint64_t w) {
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+  }
+
+ private:
+  uint64_t h_;
+};
+
+}   // namespace coap
+
+#endif  // COAP_CACHE_KEY_H_
@@ -0,0 +1,61 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_HEADER_H_
+#define COAP_HEADER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "coap/proto.h"
+
+namespace coap {
+
+// What the 4 fixed header bytes alone say about a datagram, for the
+// receive paths that can do without decoding.
+enum class EmptyKind : uint8_t {
+  other,    // not an Empty message: decode it
+  ping,     // Empty CON
+  ack,      // Empty ACK
+  reset,    // RST
+  bad       // code 0.00, but not a well-formed Empty message
+};
+
+// "An Empty message has the Code field set to 0.00.  The Token Length
+//  field MUST be set to 0 and bytes of data MUST NOT be present after
+//  the Message ID field."  A NON can't be Empty either.
+inline EmptyKind ClassifyEmpty(const uint8_t* buf, size_t size) {
+  if (size < 4 || buf[1] != Code::Empty)
+    return EmptyKind::other;
+
+  // Version 1 and TKL 0 leave only the type bits free.
+  if (size != 4 || (buf[0] & 0xCF) != (Version::v1 << 6))
+    return EmptyKind::bad;
+
+  switch ((buf[0] >> 4) & 0x03) {
+    case Type::CON:
+      return EmptyKind::ping;
+    case Type::ACK:
+      return EmptyKind::ack;
+    case Type::RST:
+      return EmptyKind::reset;
+    default:
+      return EmptyKind::bad;
+  }
+}
+
+inline uint16_t HeaderMessageId(const uint8_t* buf) {
+  return (buf[2] << 8) | buf[3];
+}
+
+// Write the RST answering ping (an EmptyKind::ping) to rst: same
+// message ID, only the type changes.
+inline void ResetFor(const uint8_t* ping, uint8_t* rst) {
+  rst[0] = (ping[0] & 0xCF) | (Type::RST << 4);
+  rst[1] = Code::Empty;
+  rst[2] = ping[2];
+  rst[3] = ping[3];
+}
+
+}   // namespace coap
+
+#endif  // COAP_HEADER_H_
@@ -0,0 +1,65 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include "utils/log.h"
+#include "coap/header.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("header_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+void test_ok_classify() {
+  const uint8_t ping[] = { 0x40, 0x00, 0x12, 0x34 };
+  const uint8_t ack[] = { 0x60, 0x00, 0x12, 0x34 };
+  const uint8_t rst[] = { 0x70, 0x00, 0x12, 0x34 };
+  const uint8_t get[] = { 0x40, 0x01, 0x12, 0x34 };
+
+  assert(ClassifyEmpty(ping, sizeof ping) == EmptyKind::ping);
+  assert(ClassifyEmpty(ack, sizeof ack) == EmptyKind::ack);
+  assert(ClassifyEmpty(rst, sizeof rst) == EmptyKind::reset);
+  assert(ClassifyEmpty(get, sizeof get) == EmptyKind::other);
+  assert(HeaderMessageId(ping) == 0x1234);
+}
+
+void test_ko_classify() {
+  // NON can't be Empty.
+  const uint8_t non[] = { 0x50, 0x00, 0x12, 0x34 };
+  assert(ClassifyEmpty(non, sizeof non) == EmptyKind::bad);
+
+  // Token on an Empty message.
+  const uint8_t tkl[] = { 0x41, 0x00, 0x12, 0x34, 0xAA };
+  assert(ClassifyEmpty(tkl, sizeof tkl) == EmptyKind::bad);
+
+  // Trailing bytes.
+  const uint8_t trailing[] = { 0x60, 0x00, 0x12, 0x34, 0xFF };
+  assert(ClassifyEmpty(trailing, sizeof trailing) == EmptyKind::bad);
+
+  // Wrong version.
+  const uint8_t v2[] = { 0x80, 0x00, 0x12, 0x34 };
+  assert(ClassifyEmpty(v2, sizeof v2) == EmptyKind::bad);
+
+  // Too short to say.
+  assert(ClassifyEmpty(non, 3) == EmptyKind::other);
+}
+
+void test_ok_reset_for() {
+  const uint8_t ping[] = { 0x40, 0x00, 0xBE, 0xEF };
+  uint8_t rst[4];
+  ResetFor(ping, rst);
+
+  assert(rst[0] == 0x70 && rst[1] == 0x00);
+  assert(rst[2] == 0xBE && rst[3] == 0xEF);
+  assert(ClassifyEmpty(rst, sizeof rst) == EmptyKind::reset);
+}
+
+int main() {
+  init_log();
+
+  test_ok_classify();
+  test_ko_classify();
+  test_ok_reset_for();
+}
@@ -0,0 +1,151 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include "coap/link_format.h"
+
+namespace coap {
+
+namespace {
+
+// What can't appear in a parmname or a ptoken.
+bool IsDelimiter(char c) {
+  return c == ';' || c == ',' || c == '=' || c == '"' || c == '<' ||
+         c == '>' || c == ' ' || c == '\\' || c < 0x21 || c == 0x7F;
+}
+
+bool Equal(const char* a, size_t a_length, const char* b, size_t b_length) {
+  return a_length == b_length && memcmp(a, b, a_length) == 0;
+}
+
+bool MatchOne(const char* value, size_t value_length,
+              const char* filter, size_t filter_length) {
+  if (filter_length > 0 && filter[filter_length - 1] == '*')
+    return value_length >= filter_length - 1 &&
+           memcmp(value, filter, filter_length - 1) == 0;
+  return Equal(value, value_length, filter, filter_length);
+}
+
+}   // namespace
+
+bool LinkCursor::NextLink(const char*& target, size_t& length) {
+  if (failed_)
+    return false;
+
+  if (in_link_) {
+    const char* name;
+    const char* value;
+    size_t name_length, value_length;
+    while (NextParam(name, name_length, value, value_length)) { }
+    if (failed_)
+      return false;
+  }
+
+  if (pos_ == end_)
+    return false;
+
+  if (!first_ && *pos_++ != ',')
+    return Fail();
+  first_ = false;
+
+  if (pos_ == end_ || *pos_ != '<')
+    return Fail();
+  const char* close = static_cast<const char*>(
+      memchr(pos_ + 1, '>', end_ - pos_ - 1));
+  if (!close)
+    return Fail();
+
+  target = pos_ + 1;
+  length = close - target;
+  pos_ = close + 1;
+  in_link_ = true;
+  return true;
+}
+
+bool LinkCursor::NextParam(const char*& name, size_t& name_length,
+                           const char*& value, size_t& value_length) {
+  if (!in_link_ || failed_)
+    return false;
+
+  if (pos_ == end_ || *pos_ == ',') {
+    in_link_ = false;
+    return false;
+  }
+  if (*pos_++ != ';')
+    return Fail();
+
+  name = pos_;
+  while (pos_ != end_ && !IsDelimiter(*pos_))
+    ++pos_;
+  name_length = pos_ - name;
+  if (name_length == 0)
+    return Fail();
+
+  value = nullptr;
+  value_length = 0;
+  if (pos_ == end_ || *pos_ != '=')
+    return true;
+  ++pos_;
+
+  if (pos_ != end_ && *pos_ == '"') {
+    value = ++pos_;
+    for (; pos_ != end_ && *pos_ != '"'; ++pos_)
+      if (*pos_ == '\\' && ++pos_ == end_)
+        break;
+    if (pos_ == end_)
+      return Fail();
+    value_length = pos_++ - value;
+    return true;
+  }
+
+  value = pos_;
+  while (pos_ != end_ && !IsDelimiter(*pos_))
+    ++pos_;
+  value_length = pos_ - value;
+  return value_length > 0 || Fail();
+}
+
+void AppendLinkParam(std::string& out, const char* name, size_t name_length,
+                     const char* value, size_t value_length) {
+  out += ';';
+  out.append(name, name_length);
+  if (!value)
+    return;
+
+  bool digits = value_length > 0;
+  for (size_t i = 0; i < value_length && digits; ++i)
+    digits = value[i] >= '0' && value[i] <= '9';
+
+  out += '=';
+  if (!digits)
+    out += '"';
+  out.append(value, value_length);
+  if (!digits)
+    out += '"';
+}
+
+bool IsMultiValueParam(const char* name, size_t name_length) {
+  return Equal(name, name_length, "rt", 2) ||
+         Equal(name, name_length, "if", 2) ||
+         Equal(name, name_length, "rel", 3);
+}
+
+bool MatchLinkParam(const char* name, size_t name_length,
+                    const char* value, size_t value_length,
+                    const char* filter, size_t filter_length) {
+  if (!IsMultiValueParam(name, name_length))
+    return MatchOne(value, value_length, filter, filter_length);
+
+  const char* end = value + value_length;
+  for (const char* p = value; p <= end; ) {
+    const char* space = static_cast<const char*>(memchr(p, ' ', end - p));
+    if (!space)
+      space = end;
+    if (MatchOne(p, space - p, filter, filter_length))
+      return true;
+    p = space + 1;
+  }
+  return false;
+}
+
+}   // namespace coap
@@ -0,0 +1,84 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_LINK_FORMAT_H_
+#define COAP_LINK_FORMAT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+namespace coap {
+
+// application/link-format
+const int kLinkFormat = 40;
+
+// Walks a CoRE Link Format document (RFC 6690) in place:
+//
+//   </sensors/temp>;rt="temperature-c";if="sensor",</sensors/light>;ct=0
+//
+//   LinkCursor cursor(data, size);
+//   while (cursor.NextLink(target, length))
+//     while (cursor.NextParam(name, name_length, value, value_length))
+//       ...
+//   if (cursor.failed())
+//     ...
+//
+// Pointers are into data.  No whitespace is allowed between links or
+// parameters (RFC 6690 has none, unlike RFC 5988).
+class LinkCursor {
+ public:
+  LinkCursor(const uint8_t* data, size_t size)
+    : pos_(reinterpret_cast<const char*>(data))
+    , end_(pos_ + size)
+    , first_(true)
+    , in_link_(false)
+    , failed_(false)
+  { }
+
+  // Move to the next link, past the parameters of this one left
+  // unread.  target is the URI-Reference between < and >.
+  bool NextLink(const char*& target, size_t& length);
+
+  // The next parameter of the current link.  value is nullptr if the
+  // parameter has none; a quoted-string comes without its quotes, its
+  // escapes left as they are.
+  bool NextParam(const char*& name, size_t& name_length,
+                 const char*& value, size_t& value_length);
+
+  bool failed() const { return failed_; }
+
+ private:
+  bool Fail() {
+    failed_ = true;
+    in_link_ = false;
+    return false;
+  }
+
+ private:
+  const char* pos_;
+  const char* end_;
+  bool first_;
+  bool in_link_;
+  bool failed_;
+};
+
+// Append ;name=value (or ;name if value is nullptr) to out.  Values
+// are quoted unless they are all digits, as ct and sz usually are.
+void AppendLinkParam(std::string& out, const char* name, size_t name_length,
+                     const char* value, size_t value_length);
+
+// Whether value matches a query filter value (RFC 6690 4.1): equal, or
+// if filter ends in '*', starting with what comes before it.  The
+// relation type like attributes (rt, if and rel) hold space separated
+// values, each of which is matched on its own.
+bool MatchLinkParam(const char* name, size_t name_length,
+                    const char* value, size_t value_length,
+                    const char* filter, size_t filter_length);
+
+// Whether the attribute holds space separated values.
+bool IsMultiValueParam(const char* name, size_t name_length);
+
+}   // namespace coap
+
+#endif  // COAP_LINK_FORMAT_H_
@@ -0,0 +1,174 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "utils/log.h"
+#include "coap/block.h"
+#include "coap/link_format.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("link_format_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// Flatten a document to "target|name=value|name,target|..." (a value
+// of nullptr has no '=').
+std::string walk(const std::string& doc, bool* failed = nullptr) {
+  LinkCursor cursor(reinterpret_cast<const uint8_t*>(doc.data()),
+                    doc.size());
+  std::string out;
+  const char* target;
+  size_t length;
+
+  while (cursor.NextLink(target, length)) {
+    if (!out.empty())
+      out += ',';
+    out.append(target, length);
+
+    const char* name;
+    const char* value;
+    size_t name_length, value_length;
+    while (cursor.NextParam(name, name_length, value, value_length)) {
+      out += '|';
+      out.append(name, name_length);
+      if (value) {
+        out += '=';
+        out.append(value, value_length);
+      }
+    }
+  }
+
+  if (failed)
+    *failed = cursor.failed();
+  else
+    assert(!cursor.failed());
+  return out;
+}
+
+void test_ok_parse() {
+  assert(walk("") == "");
+  assert(walk("</a>") == "/a");
+  assert(walk("</sensors/temp>;rt=\"temperature-c\";if=\"sensor\","
+              "</sensors/light>;ct=0;obs") ==
+         "/sensors/temp|rt=temperature-c|if=sensor,"
+         "/sensors/light|ct=0|obs");
+
+  // Quoted: separators, spaces and escaped quotes inside.
+  assert(walk("<x>;title=\"a, b; \\\"c\\\"\";rt=\"one two\"") ==
+         "x|title=a, b; \\\"c\\\"|rt=one two");
+
+  // Empty quoted value, empty target.
+  assert(walk("<>;title=\"\"") == "|title=");
+}
+
+void test_ok_skip_params() {
+  std::string doc = "</a>;rt=\"x\";ct=40,</b>;if=\"y\"";
+  LinkCursor cursor(reinterpret_cast<const uint8_t*>(doc.data()),
+                    doc.size());
+  const char* target;
+  size_t length;
+
+  assert(cursor.NextLink(target, length) && length == 2);
+  assert(cursor.NextLink(target, length));
+  assert(std::string(target, length) == "/b");
+  assert(!cursor.NextLink(target, length));
+  assert(!cursor.failed());
+}
+
+void test_ko_parse() {
+  const char* bad[] = {
+    "/a",                     // no brackets
+    "</a",                    // unclosed
+    "</a>,",                  // nothing after the comma
+    "</a> ,</b>",             // whitespace
+    "</a>;",                  // empty parameter name
+    "</a>;rt=",               // empty ptoken
+    "</a>;rt=\"x",            // unterminated quoted-string
+    "</a>;rt=\"x\\",          // escape at the end
+    "</a>;rt=\"x\"y",         // junk after the quotes
+    "</a></b>",               // no comma
+  };
+
+  for (const char* doc : bad) {
+    bool failed = false;
+    walk(doc, &failed);
+    assert(failed);
+  }
+}
+
+void test_ok_append_param() {
+  std::string out;
+  AppendLinkParam(out, "rt", 2, "temperature", 11);
+  AppendLinkParam(out, "ct", 2, "40", 2);
+  AppendLinkParam(out, "obs", 3, nullptr, 0);
+  AppendLinkParam(out, "title", 5, "", 0);
+  assert(out == ";rt=\"temperature\";ct=40;obs;title=\"\"");
+  assert(walk("<x>" + out) == "x|rt=temperature|ct=40|obs|title=");
+}
+
+bool match(const char* name, const char* value, const char* filter) {
+  return MatchLinkParam(name, strlen(name), value, strlen(value), filter,
+                        strlen(filter));
+}
+
+void test_ok_match() {
+  assert(match("ct", "40", "40"));
+  assert(!match("ct", "40", "4"));
+  assert(match("ct", "40", "4*"));
+  assert(match("title", "Kitchen", "*"));
+  assert(match("title", "", "*"));
+
+  // One of several values.
+  assert(match("rt", "temperature humidity", "humidity"));
+  assert(match("rt", "temperature humidity", "temp*"));
+  assert(!match("rt", "temperature humidity", "temperature humidity"));
+  assert(!match("title", "temperature humidity", "humidity"));
+  assert(match("title", "temperature humidity", "temperature humidity"));
+}
+
+void test_ok_block() {
+  // NUM 5, M, SZX 2 (64 bytes)
+  const uint8_t value[] = { 0x5A };
+  Block block;
+  assert(DecodeBlock(value, sizeof value, block));
+  assert(block.num == 5 && block.more && block.szx == 2);
+  assert(block.size() == 64 && block.offset() == 320);
+  assert(EncodeBlock(block) == 0x5A);
+
+  const uint8_t big[] = { 0x12, 0x34, 0x56 };
+  assert(DecodeBlock(big, sizeof big, block));
+  assert(block.num == 0x12345 && !block.more && block.szx == 6);
+  assert(EncodeBlock(block) == 0x123456);
+
+  // An empty value is block 0 of 16 bytes.
+  assert(DecodeBlock(value, 0, block));
+  assert(block.num == 0 && !block.more && block.size() == 16);
+
+  assert(SzxFor(1024) == 6 && SzxFor(5000) == 6);
+  assert(SzxFor(1023) == 5 && SzxFor(16) == 0 && SzxFor(0) == 0);
+}
+
+void test_ko_block() {
+  Block block;
+  const uint8_t reserved[] = { 0x07 };
+  assert(!DecodeBlock(reserved, sizeof reserved, block));
+  const uint8_t too_long[] = { 0, 0, 0, 0x10 };
+  assert(!DecodeBlock(too_long, sizeof too_long, block));
+}
+
+int main() {
+  init_log();
+
+  test_ok_parse();
+  test_ok_skip_params();
+  test_ko_parse();
+  test_ok_append_param();
+  test_ok_match();
+  test_ok_block();
+  test_ko_block();
+}
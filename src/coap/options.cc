@@ -2,6 +2,7 @@
 
 #include "utils/log.h"
 #include "coap/options.h"
+#include "coap/registry.h"
 
 #include <cassert>
 
@@ -68,7 +69,8 @@ bool Option::Encode(size_t& option_base, std::vector<uint8_t>& buf) const {
     buf.push_back(delta - 13);
   } else if (delta >= 269 && delta <= (65535 + 269)) {
     buf.push_back(14UL << 4);
-    buf.push_back(delta - 269);
+    buf.push_back(((delta - 269) & 0xFF00) >> 8);
+    buf.push_back((delta - 269) & 0x00FF);
   } else {
     L->Debug("encoding failed: delta is out-of-range (%zu)", delta);
     return false;
@@ -82,7 +84,8 @@ bool Option::Encode(size_t& option_base, std::vector<uint8_t>& buf) const {
     buf.push_back(length - 13);
   } else if (length >= 269 && length <= (65535 + 269)) {
     buf[base] |= 14UL;
-    buf.push_back(length - 269);
+    buf.push_back(((length - 269) & 0xFF00) >> 8);
+    buf.push_back((length - 269) & 0x00FF);
   } else {
     L->Debug("encoding failed: length is out-of-range (%zu)", length);
     return false;
@@ -98,8 +101,12 @@ bool Option::Encode(size_t& option_base, std::vector<uint8_t>& buf) const {
 // Decode option starting at offset in buf.  The absolute option number is
 // computed by adding the decoded delta to option_base.
 // On success offset is updated to point to the first undecoded byte.
+// With StringCheck::utf8, string values must also be well-formed UTF-8.
+// With UnknownOption::keep, elective options not registered are
+// taken as opaque, of any length.
 bool Option::Decode(size_t& option_base, const std::vector<uint8_t>& buf,
-                    size_t& offset) {
+                    size_t& offset, StringCheck check,
+                    UnknownOption unknown) {
   utils::Log* L = utils::Log::Instance();
 
   try {
@@ -138,13 +145,19 @@ bool Option::Decode(size_t& option_base, const std::vector<uint8_t>& buf,
     // Update option base and set option number.
     option_base += delta;
     num_ = option_base;
+    if (num_ > UINT16_MAX) {
+      L->Debug("option number out of range (%zu)", num_);
+      return false;
+    }
 
     // Look up option properties.
-    auto prop_it = OptStore.find(static_cast<OptionNumber>(num_));
+    const OptProp* prop = FindOption(num_);
 
-    // Handle unknown options.
-    if (prop_it == OptStore.end()) {
-      L->Debug("unknown option number (%d)", num_);
+    // Handle unknown options: "Unrecognized options of class
+    // "elective" MUST be silently ignored", or passed on as they are.
+    unknown_ = prop == nullptr;
+    if (unknown_ && (unknown == UnknownOption::reject || (num_ & 1))) {
+      L->Debug("unknown option number (%zu)", num_);
       return false;
     }
 
@@ -153,15 +166,18 @@ bool Option::Decode(size_t& option_base, const std::vector<uint8_t>& buf,
       if (!DecodeExtended(buf, offset, length))
         return false;
 
-    // Check given length bounds against Option properties.
-    auto prop = prop_it->second;
-    if (length > prop.max_length() || length < prop.min_length()) {
-      L->Debug("%s length out of range: %zu", prop.name(), length);
-      return false;
-    }
+    if (unknown_) {
+      format_ = OptionFormat::opaque;
+    } else {
+      // Check given length bounds against Option properties.
+      if (length > prop->max_length() || length < prop->min_length()) {
+        L->Debug("%s length out of range: %zu", prop->name(), length);
+        return false;
+      }
 
-    // Set Option format based on stored info.
-    format_ = prop.format();
+      // Set Option format based on stored info.
+      format_ = prop->format();
+    }
 
     //    +-------------------------------+
     //    \                               \
@@ -181,6 +197,11 @@ bool Option::Decode(size_t& option_base, const std::vector<uint8_t>& buf,
                  length, buf.size() - offset);
         return false;
       }
+      if (check == StringCheck::utf8 && format_ == OptionFormat::string &&
+          !IsValidUtf8(&buf[offset], length)) {
+        L->Debug("%s is not valid UTF-8", prop->name());
+        return false;
+      }
       std::copy(&buf[offset], &buf[offset + length],
                 std::back_inserter(raw_));
       offset += length;
@@ -212,7 +233,7 @@ bool Option::DecodeExtended(const std::vector<uint8_t>& buf, size_t& offset,
       offset += 1;
       break;
     case 14:  // extended format: 2 bytes
-      dl = ntohs((buf.at(offset) << 8) | buf.at(offset + 1)) + 269;
+      dl = ((buf.at(offset) << 8) | buf.at(offset + 1)) + 269;
       offset += 2;
       break;
     default:
@@ -232,7 +253,7 @@ void Option::set_format(OptionFormat format) {
 
 bool Option::set_num(OptionNumber num) {
   // Look up option properties.
-  if (OptStore.find(num) == OptStore.end()) {
+  if (!FindOption(num)) {
     utils::Log::Instance()->Debug("option number (%d) not known", num);
     return false;
   }
@@ -351,6 +372,8 @@ std::ostream& operator<< (std::ostream& out, const Option& opt) {
 // class Options
 //
 bool Options::DoAdd(const Option& opt) {
+  cache_key_ = 0;
+
   // Assume the given option has been validated.
   return map_.insert(std::make_pair(opt.num(), opt)) != map_.end();
 }
@@ -361,10 +384,8 @@ bool Options::Encode(std::vector<uint8_t>& buf) const {
   size_t obase = 0;
 
   // Encode options on order.
-  for (auto it : map_) {
-    auto opt = it.second; 
-
-    if (!opt.Encode(obase, buf)) {
+  for (const auto& it : map_) {
+    if (!it.second.Encode(obase, buf)) {
       L->Debug("Options encoding failed at base %zu", obase);
       return false;
     }
@@ -373,16 +394,21 @@ bool Options::Encode(std::vector<uint8_t>& buf) const {
   return true;
 }
 
-bool Options::Decode(const std::vector<uint8_t>& buf, size_t& offset) {
+bool Options::Decode(const std::vector<uint8_t>& buf, size_t& offset,
+                     StringCheck check, UnknownOption unknown) {
   utils::Log* L = utils::Log::Instance();
 
   size_t obase = 0;
   size_t buf_size = buf.size();
 
+  // Hash the cache key on the way, if these are all the options.
+  bool fresh = map_.empty();
+  CacheKey key;
+
   while (offset < buf_size) {
     Option opt;
 
-    if (!opt.Decode(obase, buf, offset)) {
+    if (!opt.Decode(obase, buf, offset, check, unknown)) {
       L->Debug("Options decoding failed at (offset, base) = (%zu, %zu)",
                offset, obase);
       return false; 
@@ -390,59 +416,98 @@ bool Options::Decode(const std::vector<uint8_t>& buf, size_t& offset) {
 
     // When the payload marker is seen, we're done.
     if (opt.IsPayloadMarker())
-      return true;
+      break;
+
+    key.Add(obase, opt.raw().data(), opt.raw().size());
 
     // Insert decoded Option in the store.
     if (!DoAdd(opt))
       return false;
   }
 
-  // We reach here only if we've gone through the whole buffer
-  // without stumbling upon the payload marker.
-  return false;
+  // We also reach here if we've gone through the whole buffer without
+  // stumbling upon the payload marker, i.e. there is no payload.
+  if (fresh)
+    cache_key_ = key.value();
+  return true;
+}
+
+uint64_t Options::cache_key() const {
+  if (cache_key_)
+    return cache_key_;
+
+  // In number order, repeated ones in the order they were added: as
+  // they are encoded.
+  CacheKey key;
+  for (const auto& it : map_)
+    key.Add(it.first, it.second.raw().data(), it.second.raw().size());
+  return key.value();
 }
 
 template <typename Tp>
-bool Options::Add(OptionNumber opt_num, const Tp& val) {
+bool Options::AddValue(OptionNumber opt_num, const Tp& val) {
   utils::Log* L = utils::Log::Instance();
 
   size_t needed_bytes = bytes_when_encoded(val);
 
-  auto prop = OptStore.find(opt_num)->second;
+  const OptProp* prop = FindOption(opt_num);
+  if (!prop) {
+    L->Debug("option number (%d) not known", opt_num);
+    return false;
+  }
 
   // Check value length against Option allowed range.
-  if (needed_bytes > prop.max_length() || needed_bytes < prop.min_length()) {
-    L->Debug("out-of-range value size %zu for %s", needed_bytes, prop.name());
+  if (needed_bytes > prop->max_length() ||
+      needed_bytes < prop->min_length()) {
+    L->Debug("out-of-range value size %zu for %s", needed_bytes,
+             prop->name());
     return false;
   }
 
   // Check repeatable flag.
-  if (!prop.repeatable()) {
+  if (!prop->repeatable()) {
     std::vector<Option> dummy;
     if (LookUp(opt_num, dummy)) {
-      L->Debug("trying to add non-repeatable Option %s twice", prop.name());
+      L->Debug("trying to add non-repeatable Option %s twice", prop->name());
       return false;
     }
   }
 
   Option opt;
   opt.set_num(opt_num);
-  opt.set_format(prop.format());
   opt.set_value(val);
 
+  // The value must be of the option's format.
+  if (opt.format() != prop->format()) {
+    L->Debug("wrong value format for %s", prop->name());
+    return false;
+  }
+
   return DoAdd(opt);
 }
 
+bool Options::Add(OptionNumber num, uint64_t v) {
+  return AddValue(num, v);
+}
+
+bool Options::Add(OptionNumber num, const std::string& v) {
+  return AddValue(num, v);
+}
+
+bool Options::Add(OptionNumber num, const std::vector<uint8_t>& v) {
+  return AddValue(num, v);
+}
+
 bool Options::AddIfMatch(const std::vector<uint8_t>& etag) {
-  return Add(If_Match, etag);
+  return AddValue(If_Match, etag);
 }
 
 bool Options::AddUriHost(const std::string& uri_host) {
-  return Add(Uri_Host, uri_host);
+  return AddValue(Uri_Host, uri_host);
 }
 
 bool Options::AddETag(const std::vector<uint8_t>& etag) {
-  return Add(ETag, etag);
+  return AddValue(ETag, etag);
 }
 
 #if TODO
@@ -450,48 +515,56 @@ bool Options::AddIfNoneMatch() {
 }
 #endif
 
+bool Options::AddObserve(uint64_t observe) {
+  return AddValue(Observe, observe);
+}
+
 bool Options::AddUriPort(uint64_t uri_port) {
-  return Add(Uri_Port, uri_port);
+  return AddValue(Uri_Port, uri_port);
 }
 
 bool Options::AddLocationPath(const std::string& location_path) {
-  return Add(Location_Path, location_path);
+  return AddValue(Location_Path, location_path);
 }
 
 bool Options::AddUriPath(const std::string& uri_path) {
-  return Add(Uri_Path, uri_path);
+  return AddValue(Uri_Path, uri_path);
 }
 
 bool Options::AddContentFormat(uint64_t content_format) {
-  return Add(Content_Format, content_format);
+  return AddValue(Content_Format, content_format);
 }
 
 bool Options::AddMaxAge(uint64_t max_age) {
-  return Add(Max_Age, max_age);
+  return AddValue(Max_Age, max_age);
 }
 
 bool Options::AddUriQuery(const std::string& uri_query) {
-  return Add(Uri_Query, uri_query);
+  return AddValue(Uri_Query, uri_query);
 }
 
 bool Options::AddAccept(uint64_t content_format) {
-  return Add(Accept, content_format);
+  return AddValue(Accept, content_format);
 }
 
 bool Options::AddLocationQuery(const std::string& location_query) {
-  return Add(Location_Query, location_query);
+  return AddValue(Location_Query, location_query);
+}
+
+bool Options::AddBlock2(uint64_t block2) {
+  return AddValue(Block2, block2);
 }
 
 bool Options::AddProxyUri(const std::string& proxy_uri) {
-  return Add(Proxy_Uri, proxy_uri);
+  return AddValue(Proxy_Uri, proxy_uri);
 }
 
 bool Options::AddProxyScheme(const std::string& proxy_scheme) {
-  return Add(Proxy_Scheme, proxy_scheme);
+  return AddValue(Proxy_Scheme, proxy_scheme);
 }
 
 bool Options::AddSize1(uint64_t sz) {
-  return Add(Size1, sz);
+  return AddValue(Size1, sz);
 }
 
 Options::iterator Options::begin() {
@@ -509,7 +582,7 @@ size_t Options::count() const {
 bool Options::LookUp(OptionNumber num, std::vector<Option>& res) const {
   auto it_pair = map_.equal_range(num);
 
-  if (it_pair.first == map_.end())
+  if (it_pair.first == it_pair.second)
     return false;
 
   res.clear();
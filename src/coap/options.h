@@ -15,6 +15,8 @@
 #include "utils/log.h"
 #include "coap/proto.h"
 #include "coap/optstore.h"
+#include "coap/cache_key.h"
+#include "coap/utf8.h"
 
 namespace coap {
 
@@ -22,6 +24,7 @@ class Option {
  public:
   Option()
     : format_(OptionFormat::unset)
+    , unknown_(false)
   { }
 
   ~Option() = default;
@@ -44,13 +47,20 @@ class Option {
   bool value_uint(uint64_t& v);
   bool value_opaque(std::vector<uint8_t>& v);
   void value(std::vector<uint8_t>& v);
+  const std::vector<uint8_t>& raw() const { return raw_; }
 
   OptionNumber num() const;
   OptionFormat format() const;
 
-  bool Decode(size_t&obase, const std::vector<uint8_t>& buf, size_t& offset);
+  bool Decode(size_t&obase, const std::vector<uint8_t>& buf, size_t& offset,
+              StringCheck check = StringCheck::length,
+              UnknownOption unknown = UnknownOption::reject);
   bool Encode(size_t&obase, std::vector<uint8_t>& buf) const;
 
+  // Whether it was decoded with UnknownOption::keep from a number not
+  // registered: its value is opaque, and encoded back as it came.
+  bool unknown() const { return unknown_; }
+
   friend std::ostream& operator<< (std::ostream&, const Option&);
 
  private:
@@ -59,6 +69,7 @@ class Option {
  private:
   size_t num_;
   OptionFormat format_;
+  bool unknown_;
   std::vector<uint8_t> raw_;
 };
 
@@ -68,7 +79,9 @@ class Options {
   typedef std::multimap<OptionNumber, Option> OptionMap;
 
  public:
-  Options() = default;
+  Options()
+    : cache_key_(0)
+  { }
   ~Options() = default;
   Options (const Options&) = default;
   Options& operator= (const Options&) = default;	
@@ -80,6 +93,7 @@ class Options {
 #if TODO_EMPTY_VALUE_SETTER
   bool AddIfNoneMatch();
 #endif
+  bool AddObserve(uint64_t observe);
   bool AddUriPort(uint64_t uri_port);
   bool AddLocationPath(const std::string& location_path);
   bool AddUriPath(const std::string& uri_path);
@@ -88,25 +102,44 @@ class Options {
   bool AddUriQuery(const std::string& uri_query);
   bool AddAccept(uint64_t content_format);
   bool AddLocationQuery(const std::string& location_query);
+  bool AddBlock2(uint64_t block2);
   bool AddProxyUri(const std::string& proxy_uri);
   bool AddProxyScheme(const std::string& proxy_scheme);
   bool AddSize1(uint64_t sz);
 
+  // Any option known to the OptionRegistry, custom ones included: the
+  // value must be of its format.
+  bool Add(OptionNumber num, uint64_t v);
+  bool Add(OptionNumber num, const std::string& v);
+  bool Add(OptionNumber num, const std::vector<uint8_t>& v);
+
  public:
   bool LookUp(OptionNumber opt_num, std::vector<Option>& res_set) const;
 
+  // Hash of the cache-key options (see CacheKey).  Decode() works it out
+  // as it goes; otherwise it takes a walk over the options.
+  uint64_t cache_key() const;
+
  public:
   bool Encode(std::vector<uint8_t>& buf) const;
-  bool Decode(const std::vector<uint8_t>& buf, size_t& offset);
+  bool Decode(const std::vector<uint8_t>& buf, size_t& offset,
+              StringCheck check = StringCheck::length,
+              UnknownOption unknown = UnknownOption::reject);
 
  private:
   template <typename Tp>
-  bool Add(OptionNumber opt_num, const Tp& val);
+  bool AddValue(OptionNumber opt_num, const Tp& val);
   bool DoAdd(const Option& opt);
 
  public:
-  class iterator
-    : public std::iterator<std::input_iterator_tag, Option> {
+  class iterator {
+   public:
+    // (Spelled out: std::iterator is deprecated as of C++17.)
+    typedef std::input_iterator_tag iterator_category;
+    typedef Option value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Option* pointer;
+    typedef Option& reference;
 
    private:
     bool at_end() const;
@@ -131,6 +164,7 @@ class Options {
 
  private:
   OptionMap map_;
+  uint64_t cache_key_;  // 0 until Decode(), and once added to
 };
 
 }   // namespace coap
@@ -153,6 +153,17 @@ void test_ko_decode_unknown_option() {
   assert(!opt.Decode(opt_base, buf, offset));
 }
 
+void test_ko_decode_unknown_critical() {
+  std::vector<uint8_t> buf {
+    0xE3, 0x06, 0xC4,       // delta=2001 (option 2001), length=3
+    0x01, 0x02, 0x03
+  };
+
+  Options opts;
+  size_t offset = 0;
+  assert(!opts.Decode(buf, offset, StringCheck::length, UnknownOption::keep));
+}
+
 void test_ko_decode_out_of_range_length() {
   // Uri-Port with a length of 3
   std::vector<uint8_t> buf {
@@ -220,6 +231,55 @@ void test_ok_codec_multi() {
   }
 }
 
+void test_ko_lookup_absent() {
+  Options opts;
+  assert(opts.AddUriHost("s.example.org"));
+  assert(opts.AddUriPath("dir"));
+  assert(opts.AddUriQuery("q=val"));
+
+  // Absent, whether other options come before it, after it or both.
+  std::vector<Option> optv;
+  assert(!opts.LookUp(If_Match, optv));
+  assert(!opts.LookUp(Uri_Port, optv));
+  assert(!opts.LookUp(Content_Format, optv));
+  assert(!opts.LookUp(Size1, optv));
+  assert(optv.empty());
+}
+
+void test_ok_keep_unknown_elective() {
+  std::vector<uint8_t> buf {
+    0xB1, 'a',              // Uri-Path "a"
+    0xE3, 0x06, 0xB8,       // delta=1989 (option 2000), length=3
+    0x01, 0x02, 0x03,
+    0xE0, 0x00, 0x01        // delta=270 (option 2270), empty
+  };
+
+  // Elective, but unknown: a format error by default.
+  Options strict;
+  size_t offset = 0;
+  assert(!strict.Decode(buf, offset));
+
+  Options opts;
+  offset = 0;
+  assert(opts.Decode(buf, offset, StringCheck::length, UnknownOption::keep));
+  assert(offset == buf.size());
+  assert(opts.count() == 3);
+
+  std::vector<Option> optv;
+  assert(opts.LookUp(static_cast<OptionNumber>(2000), optv));
+  assert(optv.size() == 1 && optv[0].unknown());
+  assert(optv[0].format() == OptionFormat::opaque);
+  std::vector<uint8_t> value;
+  assert(optv[0].value_opaque(value));
+  assert((value == std::vector<uint8_t>{ 1, 2, 3 }));
+  assert(opts.LookUp(Uri_Path, optv) && !optv[0].unknown());
+
+  // Encoded back as it came.
+  std::vector<uint8_t> out;
+  assert(opts.Encode(out));
+  assert(out == buf);
+}
+
 void test_ok_add_multi_repeatable() {
   Options opts;
   assert(opts.AddUriPath("d1"));
@@ -238,6 +298,37 @@ void test_ko_add_multi_non_repeatable() {
 void test_ko_add_out_of_range_size() {
   Options opts;
   assert(!opts.AddAccept(UINT64_MAX));
+  assert(!opts.AddObserve(1 << 24));       // 3 bytes at most
+  assert(!opts.AddBlock2(1 << 24));
+}
+
+void test_ok_observe() {
+  Options opts;
+  assert(opts.AddObserve(0x123456));
+  assert(opts.AddContentFormat(50));
+
+  std::vector<uint8_t> buf;
+  assert(opts.Encode(buf));
+  assert((buf == std::vector<uint8_t>{ 0x63, 0x12, 0x34, 0x56, 0x61, 50 }));
+
+  Options decoded;
+  size_t offset = 0;
+  assert(decoded.Decode(buf, offset));
+
+  std::vector<Option> observe;
+  uint64_t v;
+  assert(decoded.LookUp(Observe, observe) && observe.size() == 1);
+  assert(observe[0].value_uint(v) && v == 0x123456);
+}
+
+void test_ok_block2() {
+  Options opts;
+  assert(opts.AddBlock2(0x5A));
+  assert(!opts.AddBlock2(0x6A));            // not repeatable
+
+  std::vector<uint8_t> buf;
+  assert(opts.Encode(buf));
+  assert((buf == std::vector<uint8_t>{ 0xD1, 23 - 13, 0x5A }));
 }
 
 int main() {
@@ -249,11 +340,16 @@ int main() {
   test_ok_codec();
   test_ok_codec_multi();
   test_ok_add_multi_repeatable();
+  test_ok_observe();
+  test_ok_block2();
+  test_ok_keep_unknown_elective();
 
   test_ko_decode_bad_length();
   test_ko_decode_bad_payload_marker();
   test_ko_decode_unknown_option();
+  test_ko_decode_unknown_critical();
   test_ko_decode_out_of_range_length();
   test_ko_add_multi_non_repeatable();
   test_ko_add_out_of_range_size();
+  test_ko_lookup_absent();
 }
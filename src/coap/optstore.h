@@ -3,6 +3,9 @@
 #ifndef COAP_OPTSTORE_H_
 #define COAP_OPTSTORE_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <map>
 #include <vector>
 
@@ -16,6 +19,7 @@ namespace coap {
 // |     |    |   |   |   |                |        |        | below)  |
 // |   4 |    |   |   | x | ETag           | opaque | 1-8    | (none)  |
 // |   5 | x  |   |   |   | If-None-Match  | empty  | 0      | (none)  |
+// |   6 |    | x | - |   | Observe        | uint   | 0-3    | (none)  |
 // |   7 | x  | x | - |   | Uri-Port       | uint   | 0-2    | (see    |
 // |     |    |   |   |   |                |        |        | below)  |
 // |   8 |    |   |   | x | Location-Path  | string | 0-255  | (none)  |
@@ -25,6 +29,7 @@ namespace coap {
 // |  15 | x  | x | - | x | Uri-Query      | string | 0-255  | (none)  |
 // |  17 | x  |   |   |   | Accept         | uint   | 0-2    | (none)  |
 // |  20 |    |   |   | x | Location-Query | string | 0-255  | (none)  |
+// |  23 | x  | x | - |   | Block2         | uint   | 0-3    | (none)  |
 // |  35 | x  | x | - |   | Proxy-Uri      | string | 1-1034 | (none)  |
 // |  39 | x  | x | - |   | Proxy-Scheme   | string | 1-255  | (none)  |
 // |  60 |    |   | x |   | Size1          | uint   | 0-4    | (none)  |
@@ -38,11 +43,14 @@ enum class OptionFormat {
   empty
 };
 
-enum OptionNumber {
+// A fixed underlying type: numbers missing below can be decoded too
+// (UnknownOption::keep).
+enum OptionNumber : uint16_t {
   If_Match = 1,
   Uri_Host = 3,
   ETag = 4,
   If_None_Match = 5,
+  Observe = 6,                // RFC 7641
   Uri_Port = 7,
   Location_Path = 8,
   Uri_Path = 11,
@@ -51,11 +59,36 @@ enum OptionNumber {
   Uri_Query = 15,
   Accept = 17,
   Location_Query = 20,
+  Block2 = 23,                // RFC 7959
   Proxy_Uri = 35,
   Proxy_Scheme = 39,
   Size1 = 60
 };
 
+// Numbers of the string-format options, as a bitmask: for hot paths
+// that can't afford an OptStore lookup.  MUST be kept in sync with
+// OptStore.  (Options registered at run time are not in it.)
+const uint64_t kStringOptions =
+    (1ULL << Uri_Host) | (1ULL << Location_Path) | (1ULL << Uri_Path) |
+    (1ULL << Uri_Query) | (1ULL << Location_Query) | (1ULL << Proxy_Uri) |
+    (1ULL << Proxy_Scheme);
+
+inline bool IsStringOption(size_t num) {
+  return num < 64 && ((kStringOptions >> num) & 1);
+}
+
+// What decoding does with option numbers missing from OptStore.
+enum class UnknownOption {
+  reject,   // a message format error, whichever they are
+  keep      // elective (even) ones kept as opaque values, as received;
+            // critical (odd) ones still rejected (RFC 7252, 5.4.1)
+};
+
+// NoCacheKey options (RFC 7252, 5.4.2): left out of the cache key.
+inline bool IsNoCacheKey(size_t num) {
+  return (num & 0x1E) == 0x1C;
+}
+
 //
 // Per-option attributes.
 //
@@ -76,7 +109,7 @@ class OptProp {
   OptionNumber code() const { return code_; }
   bool critical() const { return (code_ & 1); }
   bool unsafe() const { return (code_ & 2); }
-  bool no_cache_key() const { return (code_ & 0x1E) == 0x1C; }
+  bool no_cache_key() const { return IsNoCacheKey(code_); }
   bool repeatable() const { return repeatable_; }
   const char* name() const { return name_; }
   OptionFormat format() const { return format_; }
@@ -147,6 +180,19 @@ const std::map<OptionNumber, OptProp> OptStore {
     }
   },
 
+  {
+    OptionNumber::Observe,
+    {
+      OptionNumber::Observe,        // No.
+      false,                        // Repeatable
+      "Observe",                    // mnemonic
+      OptionFormat::uint,           // Format
+      0,                            // min-length
+      3,                            // max-length
+      nullptr                       // Default
+    }
+  },
+
   {
     OptionNumber::Uri_Port,
     {
@@ -251,6 +297,19 @@ const std::map<OptionNumber, OptProp> OptStore {
     }
   },
 
+  {
+    OptionNumber::Block2,
+    {
+      OptionNumber::Block2,         // No.
+      false,                        // Repeatable
+      "Block2",                     // mnemonic
+      OptionFormat::uint,           // Format
+      0,                            // min-length
+      3,                            // max-length
+      nullptr                       // Default
+    }
+  },
+
   {
     OptionNumber::Proxy_Uri,
     {
@@ -289,8 +348,6 @@ const std::map<OptionNumber, OptProp> OptStore {
       nullptr                       // Default
     }
   },
-
-  // TODO(tho) allocate Publish
 };
 
 }   // namespace coap
@@ -31,6 +31,15 @@ void test_print() {
   }
 }
 
+void test_ok_string_options() {
+  for (const auto& it : OptStore)
+    assert(IsStringOption(it.first) ==
+           (it.second.format() == OptionFormat::string));
+  assert(!IsStringOption(0));
+  assert(!IsStringOption(1000));
+}
+
 int main() {
   test_print();
+  test_ok_string_options();
 }
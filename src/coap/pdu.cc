@@ -16,8 +16,11 @@ bool PDU::PayloadFits(size_t heading_size, size_t payload_size) const {
   return payload_size < (max_message_size_ - heading_size);
 }
 
+// Append to buf: what is there already (other messages, say) is left
+// alone and doesn't count against the message size limit.
 bool PDU::Encode(std::vector<uint8_t>& buf) const {
   utils::Log* L = utils::Log::Instance();
+  size_t start = buf.size();
 
   // Mandatory header
   if (!EncodeHeader(buf))
@@ -30,7 +33,7 @@ bool PDU::Encode(std::vector<uint8_t>& buf) const {
   // Optional payload
   if (payload_.size() > 0) {
     // Must fit the currently set message limit.
-    if (PayloadFits(buf.size(), payload_.size())) {
+    if (PayloadFits(buf.size() - start, payload_.size())) {
       // Add payload marker followed by payload bytes.
       buf.push_back(0xFF);
       std::copy(payload_.begin(), payload_.end(), std::back_inserter(buf));
@@ -43,7 +46,8 @@ bool PDU::Encode(std::vector<uint8_t>& buf) const {
   return true;
 }
 
-bool PDU::Decode(const std::vector<uint8_t>& buf) {
+bool PDU::Decode(const std::vector<uint8_t>& buf, StringCheck check,
+                 UnknownOption unknown) {
   size_t offset = 0;
 
   if (!DecodeHeader(buf, offset))
@@ -54,7 +58,7 @@ bool PDU::Decode(const std::vector<uint8_t>& buf) {
     return true;
   }
 
-  if (!options_.Decode(buf, offset))
+  if (!options_.Decode(buf, offset, check, unknown))
     return false;
 
   if (offset >= buf.size()) {
@@ -78,7 +82,7 @@ bool PDU::EncodeHeader(std::vector<uint8_t>& buf) const {
   // +-+-+-+-+-+-+-+-+
   buf.push_back(
     ((static_cast<uint8_t>(version_) & 0x03) << 6) |
-    ((static_cast<uint8_t>(code_) & 0x03) << 4) |
+    ((static_cast<uint8_t>(type_) & 0x03) << 4) |
     (token_.size() & 0x0F));
 
   //  8 9 0 1 2 3 4 5
@@ -91,8 +95,9 @@ bool PDU::EncodeHeader(std::vector<uint8_t>& buf) const {
   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
   // |          Message ID           |
   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-  buf.push_back((htons(message_id_) & 0xFF00) >> 8);
-  buf.push_back((htons(message_id_) & 0x00FF));
+  // (Network byte order.)
+  buf.push_back((message_id_ & 0xFF00) >> 8);
+  buf.push_back((message_id_ & 0x00FF));
 
   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
   // |   Token (if any, TKL bytes) ...
@@ -138,9 +143,14 @@ bool PDU::DecodeHeader(const std::vector<uint8_t>& buf, size_t& offset) {
     code_ = static_cast<Code>(buf.at(1));
 
     // Message Id.
-    message_id_ = ntohs((buf.at(2) << 8) | buf.at(3));
+    message_id_ = (buf.at(2) << 8) | buf.at(3);
+
+    // Make sure buf is at least 4 + token_length.
+    if (buf.size() < 4U + token_length_) {
+      L->Debug("truncated token (%zu byte(s) left)", buf.size() - 4);
+      return false;
+    }
 
-    // We've already checked that buf is at least 4 + token_length.
     if (token_length_ > 0)
       std::copy(&buf[4], &buf[4 + token_length_],
                 std::back_inserter(token_));
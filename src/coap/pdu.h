@@ -50,6 +50,10 @@ class PDU {
   std::vector<uint8_t> token() const { return token_; }
   std::vector<uint8_t> payload() const { return payload_; }
 
+  // Hash of the cache-key options, for tables to index by (see
+  // CacheKey).
+  uint64_t cache_key() const { return options_.cache_key(); }
+
   // Header fields setter's
   void set_version(Version v) { version_ = v; }
   void set_type(Type v) { type_ = v; }
@@ -65,7 +69,9 @@ class PDU {
   void set_payload(const std::vector<uint8_t>& payload) { payload_ = payload; }
 
   bool Encode(std::vector<uint8_t>& buf) const;
-  bool Decode(const std::vector<uint8_t>& buf);
+  bool Decode(const std::vector<uint8_t>& buf,
+              StringCheck check = StringCheck::length,
+              UnknownOption unknown = UnknownOption::reject);
 
   // Serialise header to the end of the given unsigned char buffer
   // (Also add Token which is not strictly header.)
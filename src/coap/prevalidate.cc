@@ -0,0 +1,213 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "coap/proto.h"
+#include "coap/prevalidate.h"
+
+#ifdef COAP_X86
+#include <immintrin.h>
+#endif
+
+namespace coap {
+
+namespace {
+
+// Header byte planes for a batch, padded to a whole number of AVX2
+// steps.  Datagrams shorter than a header get an all-zero one, whose
+// version (0) fails.
+struct Planes {
+  uint8_t first[kMaxPrevalidateBatch];    // Ver | T | TKL
+  uint8_t code[kMaxPrevalidateBatch];
+  uint8_t size[kMaxPrevalidateBatch];     // clamped to 255
+};
+
+void Gather(const uint8_t* const* bufs, const size_t* sizes, size_t n,
+            Planes& p) {
+  memset(&p, 0, sizeof p);
+
+  for (size_t i = 0; i < n; ++i) {
+    if (sizes[i] < 4)
+      continue;
+    p.first[i] = bufs[i][0];
+    p.code[i] = bufs[i][1];
+    p.size[i] = std::min<size_t>(sizes[i], 255);
+  }
+}
+
+uint64_t Scalar(const Planes& p, size_t n) {
+  uint64_t mask = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    unsigned tkl = p.first[i] & 0x0F;
+
+    if ((p.first[i] & 0xC0) == (Version::v1 << 6) && tkl <= 8 &&
+        kValidCode[p.code[i]] && p.size[i] >= 4 + tkl)
+      mask |= 1ULL << i;
+  }
+
+  return mask;
+}
+
+#ifdef COAP_X86
+
+// kValidCode as a bitmap: bit (code & 7) of byte (code >> 3).
+struct CodeBitmap {
+  CodeBitmap() {
+    memset(bytes, 0, sizeof bytes);
+    for (unsigned c = 0; c < 256; ++c)
+      if (kValidCode[c])
+        bytes[c >> 3] |= 1 << (c & 7);
+  }
+
+  uint8_t bytes[32];
+};
+
+const CodeBitmap& Bitmap() {
+  static const CodeBitmap bitmap;
+  return bitmap;
+}
+
+// 16 headers: the same checks as Scalar(), a byte lane each.
+__attribute__((target("sse4.1")))
+unsigned Check16(const uint8_t* first, const uint8_t* code,
+                 const uint8_t* size, __m128i bm_lo, __m128i bm_hi) {
+  const __m128i bit_of = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128);
+
+  __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+  __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(code));
+  __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(size));
+
+  __m128i version = _mm_cmpeq_epi8(_mm_and_si128(f, _mm_set1_epi8(0xC0)),
+                                   _mm_set1_epi8(0x40));
+
+  __m128i tkl = _mm_and_si128(f, _mm_set1_epi8(0x0F));
+  __m128i tkl_ok = _mm_cmpeq_epi8(_mm_min_epu8(tkl, _mm_set1_epi8(8)), tkl);
+
+  __m128i need = _mm_add_epi8(tkl, _mm_set1_epi8(4));
+  __m128i size_ok = _mm_cmpeq_epi8(_mm_max_epu8(s, need), s);
+
+  // Bitmap byte code >> 3 (0-31) out of two 16-byte tables: pshufb
+  // zeroes lanes whose index has the top bit set, so bias the index
+  // to pick one table or the other.
+  __m128i idx = _mm_and_si128(_mm_srli_epi16(c, 3), _mm_set1_epi8(0x1F));
+  __m128i lo = _mm_shuffle_epi8(bm_lo,
+                                _mm_adds_epu8(idx, _mm_set1_epi8(0x70)));
+  __m128i hi = _mm_shuffle_epi8(bm_hi,
+                                _mm_sub_epi8(idx, _mm_set1_epi8(16)));
+  __m128i byte = _mm_or_si128(lo, hi);
+  __m128i bit = _mm_shuffle_epi8(bit_of,
+                                 _mm_and_si128(c, _mm_set1_epi8(7)));
+  __m128i code_ok = _mm_cmpeq_epi8(_mm_and_si128(byte, bit), bit);
+
+  __m128i ok = _mm_and_si128(_mm_and_si128(version, tkl_ok),
+                             _mm_and_si128(size_ok, code_ok));
+
+  return _mm_movemask_epi8(ok) & 0xFFFF;
+}
+
+__attribute__((target("sse4.1")))
+uint64_t Sse4(const Planes& p, size_t n) {
+  const CodeBitmap& bm = Bitmap();
+  __m128i bm_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bm.bytes));
+  __m128i bm_hi = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(bm.bytes + 16));
+
+  uint64_t mask = 0;
+
+  for (size_t i = 0; i < n; i += 16)
+    mask |= static_cast<uint64_t>(
+        Check16(p.first + i, p.code + i, p.size + i, bm_lo, bm_hi)) << i;
+
+  return n == 64 ? mask : mask & ((1ULL << n) - 1);
+}
+
+// 32 headers.  pshufb works within 128-bit lanes, so the tables are
+// simply repeated in both.
+__attribute__((target("avx2")))
+uint32_t Check32(const uint8_t* first, const uint8_t* code,
+                 const uint8_t* size, __m256i bm_lo, __m256i bm_hi) {
+  const __m256i bit_of = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+      1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+
+  __m256i f = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+  __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(code));
+  __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(size));
+
+  __m256i version = _mm256_cmpeq_epi8(
+      _mm256_and_si256(f, _mm256_set1_epi8(0xC0)), _mm256_set1_epi8(0x40));
+
+  __m256i tkl = _mm256_and_si256(f, _mm256_set1_epi8(0x0F));
+  __m256i tkl_ok = _mm256_cmpeq_epi8(
+      _mm256_min_epu8(tkl, _mm256_set1_epi8(8)), tkl);
+
+  __m256i need = _mm256_add_epi8(tkl, _mm256_set1_epi8(4));
+  __m256i size_ok = _mm256_cmpeq_epi8(_mm256_max_epu8(s, need), s);
+
+  __m256i idx = _mm256_and_si256(_mm256_srli_epi16(c, 3),
+                                 _mm256_set1_epi8(0x1F));
+  __m256i lo = _mm256_shuffle_epi8(
+      bm_lo, _mm256_adds_epu8(idx, _mm256_set1_epi8(0x70)));
+  __m256i hi = _mm256_shuffle_epi8(
+      bm_hi, _mm256_sub_epi8(idx, _mm256_set1_epi8(16)));
+  __m256i byte = _mm256_or_si256(lo, hi);
+  __m256i bit = _mm256_shuffle_epi8(
+      bit_of, _mm256_and_si256(c, _mm256_set1_epi8(7)));
+  __m256i code_ok = _mm256_cmpeq_epi8(_mm256_and_si256(byte, bit), bit);
+
+  __m256i ok = _mm256_and_si256(_mm256_and_si256(version, tkl_ok),
+                                _mm256_and_si256(size_ok, code_ok));
+
+  return _mm256_movemask_epi8(ok);
+}
+
+__attribute__((target("avx2")))
+uint64_t Avx2(const Planes& p, size_t n) {
+  const CodeBitmap& bm = Bitmap();
+  __m256i bm_lo = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(bm.bytes)));
+  __m256i bm_hi = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(bm.bytes + 16)));
+
+  uint64_t mask = 0;
+
+  for (size_t i = 0; i < n; i += 32)
+    mask |= static_cast<uint64_t>(
+        Check32(p.first + i, p.code + i, p.size + i, bm_lo, bm_hi)) << i;
+
+  return n == 64 ? mask : mask & ((1ULL << n) - 1);
+}
+
+#endif  // COAP_X86
+
+}   // namespace
+
+uint64_t PrevalidateHeaders(const uint8_t* const* bufs, const size_t* sizes,
+                            size_t n, SimdLevel level) {
+  n = std::min(n, kMaxPrevalidateBatch);
+
+  Planes p;
+  Gather(bufs, sizes, n, p);
+
+  switch (level) {
+#ifdef COAP_X86
+    case SimdLevel::avx2:
+      return Avx2(p, n);
+    case SimdLevel::sse4:
+      return Sse4(p, n);
+#endif
+    default:
+      return Scalar(p, n);
+  }
+}
+
+uint64_t PrevalidateHeaders(const uint8_t* const* bufs, const size_t* sizes,
+                            size_t n) {
+  return PrevalidateHeaders(bufs, sizes, n, BestSimdLevel());
+}
+
+}   // namespace coap
@@ -0,0 +1,35 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_PREVALIDATE_H_
+#define COAP_PREVALIDATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "coap/simd.h"
+
+namespace coap {
+
+// Max number of datagrams per PrevalidateHeaders call.
+const size_t kMaxPrevalidateBatch = 64;
+
+// Cheap checks on a batch of received datagrams, before any of them is
+// decoded: version 1, TKL at most 8, a known code and a size that
+// covers header and token.  Bit i of the result is set if datagram i
+// (bufs[i], sizes[i]) passes and is worth a full decode; the others
+// can't possibly be valid CoAP messages.
+//
+// The first 4 bytes of each datagram are gathered into byte planes and
+// checked all at once; the code is looked up in a 256-bit bitmap built
+// from kValidCode.  n must be at most kMaxPrevalidateBatch.
+uint64_t PrevalidateHeaders(const uint8_t* const* bufs, const size_t* sizes,
+                            size_t n);
+
+// Same, with the given implementation (for tests and benchmarks; the
+// level must be supported by the CPU).
+uint64_t PrevalidateHeaders(const uint8_t* const* bufs, const size_t* sizes,
+                            size_t n, SimdLevel level);
+
+}   // namespace coap
+
+#endif  // COAP_PREVALIDATE_H_
@@ -0,0 +1,95 @@
+// Copyleft 2013 tho@autistici.org
+
+// A flood of mostly garbage datagrams, in batches of 64 as a receive
+// round hands them over: full decode of each against header
+// pre-validation of the batch (at each SIMD level) and a decode of
+// the survivors only.
+//
+// Usage: prevalidate_bench [messages] [garbage percentage]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "coap/prevalidate.h"
+#include "coap/view.h"
+
+using namespace coap;
+
+typedef std::chrono::steady_clock Clock;
+
+double mpps(Clock::time_point start, size_t n) {
+  return n / std::chrono::duration<double, std::micro>(
+      Clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+  unsigned garbage = argc > 2 ? atoi(argv[2]) : 90;
+
+  // Random bytes, or a GET with a token and a couple of options.
+  const size_t kDistinct = 4096;
+  const uint8_t get[] = { 0x44, 0x01, 0x12, 0x34, 1, 2, 3, 4,
+                          0xB4, 't', 'e', 'm', 'p', 0x41, 'x' };
+  std::vector<std::vector<uint8_t>> msgs(kDistinct);
+
+  srand(42);
+  for (auto& m : msgs) {
+    if (static_cast<unsigned>(rand() % 100) < garbage) {
+      m.resize(16 + rand() % 64);
+      for (auto& byte : m)
+        byte = rand();
+    } else {
+      m.assign(get, get + sizeof get);
+    }
+  }
+
+  std::vector<const uint8_t*> bufs(kDistinct);
+  std::vector<size_t> sizes(kDistinct);
+  for (size_t i = 0; i < kDistinct; ++i) {
+    bufs[i] = msgs[i].data();
+    sizes[i] = msgs[i].size();
+  }
+
+  const size_t kBatch = kMaxPrevalidateBatch;
+  n -= n % kBatch;
+  uint64_t sink = 0;
+
+  Clock::time_point start = Clock::now();
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = k % kDistinct;
+    PDUView v;
+    if (v.Decode(bufs[i], sizes[i]))
+      sink += v.message_id();
+  }
+  printf("decode all:     %7.2f Mpps\n", mpps(start, n));
+
+  const SimdLevel levels[] = {
+    SimdLevel::scalar, SimdLevel::sse4, SimdLevel::avx2
+  };
+
+  for (SimdLevel level : levels) {
+    if (level > BestSimdLevel())
+      break;
+
+    size_t survivors = 0;
+    start = Clock::now();
+    for (size_t k = 0; k < n; k += kBatch) {
+      size_t i = k % kDistinct;
+      uint64_t mask = PrevalidateHeaders(&bufs[i], &sizes[i], kBatch, level);
+      survivors += __builtin_popcountll(mask);
+      while (mask) {
+        size_t j = i + __builtin_ctzll(mask);
+        mask &= mask - 1;
+        PDUView v;
+        if (v.Decode(bufs[j], sizes[j]))
+          sink += v.message_id();
+      }
+    }
+    printf("prevalidate %-6s %5.2f Mpps (%.1f%% decoded)\n",
+           SimdLevelName(level), mpps(start, n), 100.0 * survivors / n);
+  }
+
+  return sink == 42;
+}
@@ -0,0 +1,129 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+#include "utils/log.h"
+#include "coap/prevalidate.h"
+#include "coap/proto.h"
+#include "coap/view.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("prevalidate_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+std::vector<SimdLevel> levels() {
+  std::vector<SimdLevel> v = { SimdLevel::scalar };
+  if (BestSimdLevel() != SimdLevel::scalar)
+    v.push_back(SimdLevel::sse4);
+  if (BestSimdLevel() == SimdLevel::avx2)
+    v.push_back(SimdLevel::avx2);
+  return v;
+}
+
+struct Batch {
+  std::vector<std::vector<uint8_t>> msgs;
+  std::vector<const uint8_t*> bufs;
+  std::vector<size_t> sizes;
+
+  void Add(const std::vector<uint8_t>& m) { msgs.push_back(m); }
+
+  uint64_t Check(SimdLevel level) {
+    bufs.clear();
+    sizes.clear();
+    for (const auto& m : msgs) {
+      bufs.push_back(m.data());
+      sizes.push_back(m.size());
+    }
+    return PrevalidateHeaders(bufs.data(), sizes.data(), msgs.size(), level);
+  }
+};
+
+void test_ok_valid() {
+  Batch b;
+  b.Add({ 0x40, 0x01, 0x12, 0x34 });                      // CON GET
+  b.Add({ 0x58, 0x45, 0, 1, 1, 2, 3, 4, 5, 6, 7, 8 });    // NON 2.05, TKL 8
+  b.Add({ 0x60, 0x00, 0, 2 });                            // empty ACK
+  b.Add({ 0x70, 0x00, 0, 3 });                            // RST
+  b.Add({ 0x42, 0xA5, 0, 4, 0xAA, 0xBB, 0xFF, 'x' });     // 5.05
+
+  for (SimdLevel level : levels())
+    assert(b.Check(level) == 0x1F);
+}
+
+void test_ko_invalid() {
+  Batch b;
+  b.Add({ 0x40, 0x01, 0x12 });                    // too short
+  b.Add({ 0x80, 0x01, 0x12, 0x34 });              // version 2
+  b.Add({ 0x49, 0x01, 0x12, 0x34, 1, 2, 3, 4,
+          5, 6, 7, 8, 9 });                       // TKL 9
+  b.Add({ 0x44, 0x01, 0x12, 0x34, 1, 2, 3 });     // token truncated
+  b.Add({ 0x40, 0x05, 0x12, 0x34 });              // 0.05
+  b.Add({ 0x40, 0x46, 0x12, 0x34 });              // 2.06
+  b.Add({ 0x40, 0xFF, 0x12, 0x34 });              // 7.31
+  b.Add({ 0x40, 0x8E, 0x12, 0x34 });              // 4.14
+
+  for (SimdLevel level : levels())
+    assert(b.Check(level) == 0);
+}
+
+void test_ok_every_code() {
+  for (SimdLevel level : levels()) {
+    for (unsigned base = 0; base < 256; base += 64) {
+      Batch b;
+      for (unsigned c = base; c < base + 64; ++c)
+        b.Add({ 0x40, static_cast<uint8_t>(c), 0, 0 });
+
+      uint64_t mask = b.Check(level);
+      for (unsigned c = base; c < base + 64; ++c)
+        assert(((mask >> (c - base)) & 1) == IsValidCode(c));
+    }
+  }
+}
+
+// Every level agrees with the others and with a full decode (a message
+// that decodes must pass), on random and nearly valid headers.
+void test_ok_random() {
+  srand(42);
+
+  for (int round = 0; round < 2000; ++round) {
+    Batch b;
+    size_t n = 1 + rand() % kMaxPrevalidateBatch;
+
+    for (size_t i = 0; i < n; ++i) {
+      std::vector<uint8_t> m(rand() % 16);
+      for (auto& byte : m)
+        byte = rand();
+      if (m.size() > 0 && rand() % 2)
+        m[0] = 0x40 | (m[0] & 0x3F);
+      if (m.size() > 1 && rand() % 2)
+        m[1] = Code::Content;
+      b.Add(m);
+    }
+
+    uint64_t scalar = b.Check(SimdLevel::scalar);
+    for (SimdLevel level : levels())
+      assert(b.Check(level) == scalar);
+
+    if (round >= 100)   // decode failures are logged: keep it short
+      continue;
+    for (size_t i = 0; i < n; ++i) {
+      PDUView v;
+      if (v.Decode(b.msgs[i].data(), b.msgs[i].size()))
+        assert((scalar >> i) & 1);
+    }
+  }
+}
+
+int main() {
+  init_log();
+
+  test_ok_valid();
+  test_ko_invalid();
+  test_ok_every_code();
+  test_ok_random();
+}
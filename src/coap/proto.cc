@@ -4,37 +4,24 @@
 
 namespace coap {
 
-bool IsValidCode(uint8_t code) {
-  switch (code) {
-    case Code::Empty:
-    case Code::GET:
-    case Code::POST:
-    case Code::PUT:
-    case Code::DELETE:
-    case Code::Created:
-    case Code::Deleted:
-    case Code::Valid:
-    case Code::Changed:
-    case Code::Content:
-    case Code::BadRequest:
-    case Code::Unauthorized:
-    case Code::BadOption:
-    case Code::Forbidden:
-    case Code::NotFound:
-    case Code::MethodNotAllowed:
-    case Code::NotAcceptable:
-    case Code::PreconditionFailed:
-    case Code::RequestEntityTooLarge:
-    case Code::UnsupportedContentFormat:
-    case Code::InternalServerError:
-    case Code::NotImplemented:
-    case Code::BadGateway:
-    case Code::ServiceUnavailable:
-    case Code::GatewayTimeout:
-    case Code::ProxyingNotSupported:
-      return true;
-  }
-  return false;
-}
+// One entry per code byte, indexed by class * 32 + detail.
+const uint8_t kValidCode[256] = {
+  1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0.00 - 0.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0.16 - 0.31
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 1.00 - 1.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 1.16 - 1.31
+  0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 2.00 - 2.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 2.16 - 2.31
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 3.00 - 3.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 3.16 - 3.31
+  1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 0, 1,  // 4.00 - 4.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 4.16 - 4.31
+  1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 5.00 - 5.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 5.16 - 5.31
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 6.00 - 6.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 6.16 - 6.31
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 7.00 - 7.15
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 7.16 - 7.31
+};
 
 }  // namespace coap
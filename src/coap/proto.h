@@ -39,7 +39,7 @@ enum CodeBlocks {
   RespServerErrorMax = RespServerErrorMin + 31
 };
 
-// MUST be kept in sync with IsValidCode().
+// MUST be kept in sync with kValidCode (proto.cc).
 enum Code {
   // Empty message code
   Empty                     = 0,          // 0.00
@@ -78,7 +78,12 @@ enum Code {
   ProxyingNotSupported      = 160 + 5,    // 5.05
 };
 
-bool IsValidCode(uint8_t code);
+// Non-zero for the codes above.
+extern const uint8_t kValidCode[256];
+
+inline bool IsValidCode(uint8_t code) {
+  return kValidCode[code];
+}
 
 }  // namespace coap
 
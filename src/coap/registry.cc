@@ -0,0 +1,111 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cstring>
+#include "utils/log.h"
+#include "coap/registry.h"
+
+namespace coap {
+
+OptionRegistry* OptionRegistry::instance_ = nullptr;
+
+OptionRegistry* OptionRegistry::Instance() {
+  if (!instance_)
+    instance_ = new OptionRegistry;
+
+  return instance_;
+}
+
+OptionRegistry::OptionRegistry()
+  : frozen_(false) {
+  memset(direct_, 0, sizeof direct_);
+
+  // Find() hands out pointers into props_: they must stay put.
+  props_.reserve(kMaxOptions);
+
+  Rehash();
+  for (const auto& it : OptStore)
+    Register(it.second);
+}
+
+bool OptionRegistry::Register(const OptProp& prop) {
+  utils::Log* L = utils::Log::Instance();
+
+  if (frozen_) {
+    L->Debug("option registry frozen, can't add %s", prop.name());
+    return false;
+  }
+
+  // 0 is reserved (RFC 7252, 12.2).
+  if (prop.code() == 0 || Find(prop.code())) {
+    L->Debug("option number %u not available for %s", prop.code(),
+             prop.name());
+    return false;
+  }
+
+  if (props_.size() == kMaxOptions) {
+    L->Debug("option registry full, can't add %s", prop.name());
+    return false;
+  }
+
+  size_t max_length = 1034;
+  switch (prop.format()) {
+    case OptionFormat::empty:
+      max_length = 0;
+      break;
+    case OptionFormat::uint:
+      max_length = 8;
+      break;
+    case OptionFormat::string:
+    case OptionFormat::opaque:
+      break;
+    default:
+      L->Debug("%s has no value format", prop.name());
+      return false;
+  }
+
+  if (prop.min_length() > prop.max_length() ||
+      prop.max_length() > max_length) {
+    L->Debug("%s length range %zu-%zu not valid", prop.name(),
+             prop.min_length(), prop.max_length());
+    return false;
+  }
+
+  props_.push_back(prop);
+
+  if (prop.code() < kDirect)
+    direct_[prop.code()] = props_.size();
+  else
+    Rehash();
+
+  return true;
+}
+
+// Rebuild the table of numbers above kDirect, at most half full.
+void OptionRegistry::Rehash() {
+  size_t wanted = 0;
+  for (const OptProp& prop : props_)
+    wanted += prop.code() >= kDirect;
+
+  size_t size = 4;
+  shift_ = 30;
+  while (size < 2 * wanted) {
+    size *= 2;
+    --shift_;
+  }
+
+  slots_.assign(size, Entry{ 0, 0 });
+  mask_ = size - 1;
+
+  for (size_t i = 0; i < props_.size(); ++i) {
+    size_t num = props_[i].code();
+    if (num < kDirect)
+      continue;
+    size_t j = Slot(num);
+    while (slots_[j].index)
+      j = (j + 1) & mask_;
+    slots_[j] = Entry{ static_cast<uint16_t>(num),
+                       static_cast<uint8_t>(i + 1) };
+  }
+}
+
+}   // namespace coap
@@ -0,0 +1,89 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_REGISTRY_H_
+#define COAP_REGISTRY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "coap/optstore.h"
+
+namespace coap {
+
+//
+// The options decoding and Options::Add know about: those in OptStore,
+// and any the application registers at startup (Block1, Size2,
+// No-Response, OSCORE, private ones).  Register before serving, then
+// Freeze(): from there on the registry is read-only, so threads can share
+// it without locking.  Not to be used before main(): it is filled from
+// OptStore, which may not be initialized yet.
+//
+// Lookups are O(1) for any number.  Properties sit in a dense array; a
+// byte per number below 256 indexes it, and the few numbers above that
+// go through a small open-addressed table.  A few cache lines in all.
+//
+class OptionRegistry {
+ public:
+  OptionRegistry(OptionRegistry const&) = delete;
+  OptionRegistry& operator= (OptionRegistry const&) = delete;
+
+ public:
+  static OptionRegistry* Instance();
+
+ public:
+  // Fails if frozen, if prop.code() is taken, or if its lengths don't
+  // make sense for its format.  prop.name() must outlive the registry.
+  bool Register(const OptProp& prop);
+  void Freeze() { frozen_ = true; }
+  bool frozen() const { return frozen_; }
+
+  // Properties of option num, nullptr if not known.
+  const OptProp* Find(size_t num) const {
+    if (num < kDirect)
+      return direct_[num] ? &props_[direct_[num] - 1] : nullptr;
+    for (size_t i = Slot(num); slots_[i].index; i = (i + 1) & mask_)
+      if (slots_[i].num == num)
+        return &props_[slots_[i].index - 1];
+    return nullptr;
+  }
+
+  size_t size() const { return props_.size(); }
+
+ private:
+  OptionRegistry();
+
+  void Rehash();
+
+  // Fibonacci hashing: numbers alike in their low bits are common.
+  size_t Slot(size_t num) const {
+    return static_cast<uint32_t>(num * 0x9E3779B1u) >> shift_;
+  }
+
+ private:
+  static const size_t kDirect = 256;
+  static const size_t kMaxOptions = 255;   // what fits an index byte
+
+  struct Entry {
+    uint16_t num;
+    uint8_t index;    // into props_, plus one; 0 for an empty slot
+  };
+
+  static OptionRegistry* instance_;
+
+  std::vector<OptProp> props_;
+  uint8_t direct_[kDirect];
+  std::vector<Entry> slots_;  // a power of two, at most half full
+  size_t mask_;
+  int shift_;
+  bool frozen_;
+};
+
+inline const OptProp* FindOption(size_t num) {
+  return OptionRegistry::Instance()->Find(num);
+}
+
+}   // namespace coap
+
+#endif  // COAP_REGISTRY_H_
@@ -0,0 +1,140 @@
+// Copyleft 2013 tho@autistici.org
+
+// Option property lookups: the OptStore map against the registry, for
+// built-in numbers, custom ones (below 256 and above), and misses; then
+// PDUView::Decode of a request with built-in options only against one
+// with as many custom ones.  The registry should cost the same for all.
+//
+// Usage: registry_bench [lookups]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "coap/registry.h"
+
+using namespace coap;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const OptionNumber Block1 = static_cast<OptionNumber>(27);
+const OptionNumber Size2 = static_cast<OptionNumber>(28);
+const OptionNumber No_Response = static_cast<OptionNumber>(258);
+const OptionNumber Tenant = static_cast<OptionNumber>(65001);
+
+double ns(Clock::time_point start, size_t n) {
+  return std::chrono::duration<double, std::nano>(
+      Clock::now() - start).count() / n;
+}
+
+// The numbers to look up, n of them, cycling through nums.
+std::vector<uint16_t> spread(const std::vector<uint16_t>& nums, size_t n) {
+  std::vector<uint16_t> out(n);
+  for (size_t i = 0; i < n; ++i)
+    out[i] = nums[(i * 7919) % nums.size()];
+  return out;
+}
+
+void lookups(const char* label, const std::vector<uint16_t>& nums) {
+  uint64_t sink = 0;
+
+  Clock::time_point start = Clock::now();
+  for (uint16_t num : nums) {
+    auto it = OptStore.find(static_cast<OptionNumber>(num));
+    if (it != OptStore.end())
+      sink += it->second.max_length();
+  }
+  double map_ns = ns(start, nums.size());
+
+  OptionRegistry* R = OptionRegistry::Instance();
+  start = Clock::now();
+  for (uint16_t num : nums) {
+    const OptProp* prop = R->Find(num);
+    if (prop)
+      sink += prop->max_length();
+  }
+  double reg_ns = ns(start, nums.size());
+
+  printf("%s map %6.2f ns, registry %6.2f ns (%llu)\n", label, map_ns,
+         reg_ns, static_cast<unsigned long long>(sink));
+}
+
+std::vector<uint8_t> request(bool custom) {
+  PDU pdu;
+  pdu.set_type(Type::CON);
+  pdu.set_code(Code::GET);
+  pdu.set_message_id(1);
+  pdu.set_token({ 1, 2, 3, 4 });
+
+  Options opts;
+  assert(opts.AddUriPath("sensors"));
+  assert(opts.AddUriPath("temp"));
+  if (custom) {
+    assert(opts.Add(Block1, 0x16));
+    assert(opts.Add(Size2, 0));
+    assert(opts.Add(No_Response, 2));
+    assert(opts.Add(Tenant, std::string("acme")));
+  } else {
+    assert(opts.AddUriHost("example.org"));
+    assert(opts.AddUriPort(5683));
+    assert(opts.AddAccept(50));
+    assert(opts.AddUriQuery("unit=c"));
+  }
+  pdu.set_options(opts);
+
+  std::vector<uint8_t> pkt;
+  assert(pdu.Encode(pkt));
+  return pkt;
+}
+
+void decodes(const char* label, const std::vector<uint8_t>& pkt, size_t n) {
+  PDUView view;
+  uint64_t sink = 0;
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    assert(view.Decode(pkt.data(), pkt.size()));
+    sink += view.payload_size();
+  }
+  printf("%s %6.2f ns/decode (%llu)\n", label, ns(start, n),
+         static_cast<unsigned long long>(sink));
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+
+  OptionRegistry* R = OptionRegistry::Instance();
+  assert(R->Register({ Block1, false, "Block1", OptionFormat::uint,
+                       0, 3, nullptr }));
+  assert(R->Register({ Size2, false, "Size2", OptionFormat::uint,
+                       0, 4, nullptr }));
+  assert(R->Register({ No_Response, false, "No-Response", OptionFormat::uint,
+                       0, 1, nullptr }));
+  assert(R->Register({ Tenant, false, "Tenant", OptionFormat::string,
+                       1, 16, nullptr }));
+  // A few more private ones, so the large numbers don't have it easy.
+  for (uint16_t num = 65100; num < 65164; num += 2)
+    assert(R->Register({ static_cast<OptionNumber>(num), false, "Private",
+                         OptionFormat::opaque, 0, 8, nullptr }));
+  R->Freeze();
+
+  std::vector<uint16_t> builtin;
+  for (const auto& it : OptStore)
+    builtin.push_back(it.first);
+
+  printf("%zu lookups, %zu options registered\n", n, R->size());
+  lookups("built-in:   ", spread(builtin, n));
+  lookups("custom <256:", spread({ Block1, Size2 }, n));
+  lookups("custom >256:", spread({ No_Response, Tenant, 65130 }, n));
+  lookups("unknown:    ", spread({ 2, 100, 1000, 65535 }, n));
+
+  decodes("built-in options:", request(false), n / 10);
+  decodes("custom options:  ", request(true), n / 10);
+}
@@ -0,0 +1,218 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "coap/registry.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("registry_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+const OptionNumber Oscore = static_cast<OptionNumber>(9);     // RFC 8613
+const OptionNumber Block1 = static_cast<OptionNumber>(27);    // RFC 7959
+const OptionNumber Size2 = static_cast<OptionNumber>(28);     // RFC 7959
+const OptionNumber No_Response = static_cast<OptionNumber>(258);
+const OptionNumber Tenant = static_cast<OptionNumber>(65001);  // private
+const OptionNumber Trace = static_cast<OptionNumber>(65004);   // private
+
+OptionRegistry* R;
+
+void test_ok_builtins() {
+  assert(R->size() == OptStore.size());
+  for (const auto& it : OptStore) {
+    const OptProp* prop = R->Find(it.first);
+    assert(prop && prop->code() == it.first);
+    assert(strcmp(prop->name(), it.second.name()) == 0);
+  }
+  assert(!R->Find(0) && !R->Find(2) && !R->Find(1000) && !R->Find(65535));
+}
+
+void test_ok_register() {
+  assert(R->Register({ Oscore, false, "OSCORE", OptionFormat::opaque,
+                       0, 255, nullptr }));
+  assert(R->Register({ Block1, false, "Block1", OptionFormat::uint,
+                       0, 3, nullptr }));
+  assert(R->Register({ Size2, false, "Size2", OptionFormat::uint,
+                       0, 4, nullptr }));
+  assert(R->Register({ No_Response, false, "No-Response", OptionFormat::uint,
+                       0, 1, nullptr }));
+  assert(R->Register({ Tenant, false, "Tenant", OptionFormat::string,
+                       1, 16, nullptr }));
+  assert(R->Register({ Trace, true, "Trace", OptionFormat::opaque,
+                       1, 8, nullptr }));
+  assert(R->size() == OptStore.size() + 6);
+
+  assert(strcmp(R->Find(No_Response)->name(), "No-Response") == 0);
+  assert(strcmp(R->Find(Tenant)->name(), "Tenant") == 0);
+  assert(R->Find(Trace)->repeatable());
+  assert(!R->Find(65000) && !R->Find(259));
+}
+
+void test_ok_round_trip() {
+  PDU pdu;
+  pdu.set_type(Type::CON);
+  pdu.set_code(Code::POST);
+  pdu.set_message_id(7);
+
+  Options opts;
+  assert(opts.AddUriPath("fw"));
+  assert(opts.Add(Oscore, std::vector<uint8_t>{ 0x09, 0x01 }));
+  assert(opts.Add(Block1, 0x0E));
+  assert(opts.Add(No_Response, 2));
+  assert(opts.Add(Tenant, std::string("acme")));
+  assert(opts.Add(Trace, std::vector<uint8_t>{ 1 }));
+  assert(opts.Add(Trace, std::vector<uint8_t>{ 2, 3 }));
+  pdu.set_options(opts);
+  pdu.set_payload({ 'x' });
+
+  std::vector<uint8_t> pkt;
+  assert(pdu.Encode(pkt));
+
+  // Critical ones (OSCORE, Block1) included: they are known now.
+  PDUView view;
+  assert(view.Decode(pkt.data(), pkt.size()));
+
+  std::vector<size_t> nums;
+  size_t num, length;
+  const uint8_t* value;
+  OptionCursor cursor = view.options(StringCheck::utf8);
+  while (cursor.Next(num, value, length))
+    nums.push_back(num);
+  assert(!cursor.failed());
+  assert((nums == std::vector<size_t>{ Oscore, Uri_Path, Block1,
+                                       No_Response, Tenant, Trace, Trace }));
+
+  PDU back;
+  assert(back.Decode(pkt));
+  Options got = back.options();
+  std::vector<Option> optv;
+  assert(got.LookUp(Tenant, optv) && optv.size() == 1);
+  assert(!optv[0].unknown());
+  std::string s;
+  assert(optv[0].value_string(s) && s == "acme");
+  assert(got.LookUp(Block1, optv));
+  uint64_t v;
+  assert(optv[0].value_uint(v) && v == 0x0E);
+  assert(got.LookUp(Trace, optv) && optv.size() == 2);
+
+  std::vector<uint8_t> again;
+  assert(back.Encode(again));
+  assert(again == pkt);
+}
+
+void test_ko_decode_bounds() {
+  // GET, No-Response with 2 bytes (at most 1).
+  std::vector<uint8_t> pkt {
+    0x40, 0x01, 0x00, 0x01,
+    0xD2, 0xF5, 0x01, 0x02
+  };
+
+  PDUView view;
+  assert(!view.Decode(pkt.data(), pkt.size()));
+  PDU pdu;
+  assert(!pdu.Decode(pkt));
+
+  pkt.pop_back();
+  pkt[4] = 0xD1;
+  assert(view.Decode(pkt.data(), pkt.size()));
+  assert(pdu.Decode(pkt));
+
+  // Tenant, a custom string option, is checked for UTF-8 too.
+  std::vector<uint8_t> bad {
+    0x40, 0x01, 0x00, 0x01,
+    0xE2, 0xFC, 0xDC, 0xC3, 0x28
+  };
+  assert(pdu.Decode(bad));
+  assert(!pdu.Decode(bad, StringCheck::utf8));
+  size_t num, length;
+  const uint8_t* value;
+  assert(view.Decode(bad.data(), bad.size()));
+  OptionCursor cursor = view.options(StringCheck::utf8);
+  while (cursor.Next(num, value, length))
+    ;
+  assert(cursor.failed());
+}
+
+void test_ko_add() {
+  Options opts;
+  assert(!opts.Add(Tenant, std::string()));               // too short
+  assert(!opts.Add(Tenant, std::string(17, 't')));        // too long
+  assert(!opts.Add(Tenant, std::vector<uint8_t>{ 'a' })); // wrong format
+  assert(!opts.Add(Block1, std::string("a")));
+  assert(!opts.Add(No_Response, 256));
+  assert(opts.Add(No_Response, 255));
+  assert(!opts.Add(No_Response, 0));                      // not repeatable
+  assert(!opts.Add(static_cast<OptionNumber>(65000), 1)); // not known
+  assert(opts.count() == 1);
+}
+
+void test_ko_register() {
+  size_t size = R->size();
+
+  // Taken, reserved, or lengths not fitting the format.
+  assert(!R->Register({ Uri_Path, true, "Path", OptionFormat::string,
+                        0, 255, nullptr }));
+  assert(!R->Register({ Tenant, true, "Tenant", OptionFormat::string,
+                        0, 255, nullptr }));
+  assert(!R->Register({ static_cast<OptionNumber>(0), false, "Zero",
+                        OptionFormat::uint, 0, 1, nullptr }));
+  assert(!R->Register({ static_cast<OptionNumber>(300), false, "Backwards",
+                        OptionFormat::opaque, 4, 2, nullptr }));
+  assert(!R->Register({ static_cast<OptionNumber>(302), false, "Wide",
+                        OptionFormat::uint, 0, 9, nullptr }));
+  assert(!R->Register({ static_cast<OptionNumber>(304), false, "Flag",
+                        OptionFormat::empty, 0, 1, nullptr }));
+  assert(!R->Register({ static_cast<OptionNumber>(306), false, "Unset",
+                        OptionFormat::unset, 0, 1, nullptr }));
+
+  assert(R->size() == size);
+}
+
+void test_ok_many_large() {
+  // Numbers above 256 all alike in their low bits, up to the limit.
+  std::vector<OptionNumber> nums;
+  for (size_t n = 512; R->size() < 255; n += 256) {
+    OptionNumber num = static_cast<OptionNumber>(n);
+    assert(R->Register({ num, false, "Bulk", OptionFormat::opaque,
+                         0, 8, nullptr }));
+    nums.push_back(num);
+  }
+  assert(!R->Register({ static_cast<OptionNumber>(65002), false, "Full",
+                        OptionFormat::opaque, 0, 8, nullptr }));
+
+  for (OptionNumber num : nums)
+    assert(R->Find(num) && R->Find(num)->code() == num);
+  assert(R->Find(No_Response) && R->Find(Tenant) && R->Find(Trace));
+  assert(!R->Find(513) && !R->Find(65002) && !R->Find(65535));
+}
+
+void test_ko_frozen() {
+  R->Freeze();
+  assert(R->frozen());
+  assert(!R->Register({ static_cast<OptionNumber>(65100), false, "Late",
+                        OptionFormat::opaque, 0, 8, nullptr }));
+  assert(!R->Find(65100));
+  assert(R->Find(Uri_Path) && R->Find(Tenant));
+}
+
+int main() {
+  init_log();
+
+  R = OptionRegistry::Instance();
+  test_ok_builtins();
+  test_ok_register();
+  test_ok_round_trip();
+  test_ko_decode_bounds();
+  test_ko_add();
+  test_ko_register();
+  test_ok_many_large();
+  test_ko_frozen();
+}
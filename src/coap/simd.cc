@@ -0,0 +1,31 @@
+// Copyleft 2013 tho@autistici.org
+
+#include "coap/simd.h"
+
+namespace coap {
+
+SimdLevel BestSimdLevel() {
+#ifdef COAP_X86
+  static const SimdLevel best =
+      __builtin_cpu_supports("avx2") ? SimdLevel::avx2 :
+      __builtin_cpu_supports("sse4.1") ? SimdLevel::sse4 :
+      SimdLevel::scalar;
+  return best;
+#else
+  return SimdLevel::scalar;
+#endif
+}
+
+const char* SimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::scalar:
+      return "scalar";
+    case SimdLevel::sse4:
+      return "sse4";
+    case SimdLevel::avx2:
+      return "avx2";
+  }
+  return "?";
+}
+
+}   // namespace coap
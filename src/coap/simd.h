@@ -0,0 +1,28 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_SIMD_H_
+#define COAP_SIMD_H_
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COAP_X86 1
+#endif
+
+namespace coap {
+
+// Instruction sets the vectorised checks (PrevalidateHeaders,
+// IsValidUtf8) come in.  They are compiled in regardless of the build
+// flags and picked at run time.
+enum class SimdLevel {
+  scalar,
+  sse4,     // SSE4.1 (with SSSE3's pshufb): 16 bytes per step
+  avx2      // 32 bytes per step
+};
+
+// The best level this CPU supports.
+SimdLevel BestSimdLevel();
+
+const char* SimdLevelName(SimdLevel level);
+
+}   // namespace coap
+
+#endif  // COAP_SIMD_H_
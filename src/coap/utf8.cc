@@ -0,0 +1,332 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include "coap/utf8.h"
+
+#ifdef COAP_X86
+#include <immintrin.h>
+#endif
+
+namespace coap {
+
+namespace {
+
+bool Scalar(const uint8_t* s, size_t n) {
+  size_t i = 0;
+
+  while (i < n) {
+    // Skip ASCII 8 bytes at a time.
+    if (i + 8 <= n) {
+      uint64_t word;
+      memcpy(&word, s + i, sizeof word);
+      if ((word & 0x8080808080808080ULL) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+
+    uint8_t c = s[i];
+
+    if (c < 0x80) {
+      ++i;
+      continue;
+    }
+
+    // Sequence length, and the range of the 2nd byte, which is where
+    // overlong forms, surrogates and code points past U+10FFFF show.
+    size_t len;
+    uint8_t lo = 0x80, hi = 0xBF;
+
+    if (c >= 0xC2 && c <= 0xDF) {
+      len = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      len = 3;
+      if (c == 0xE0)
+        lo = 0xA0;
+      else if (c == 0xED)
+        hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      len = 4;
+      if (c == 0xF0)
+        lo = 0x90;
+      else if (c == 0xF4)
+        hi = 0x8F;
+    } else {
+      return false;
+    }
+
+    if (n - i < len || s[i + 1] < lo || s[i + 1] > hi)
+      return false;
+
+    for (size_t k = 2; k < len; ++k)
+      if ((s[i + k] & 0xC0) != 0x80)
+        return false;
+
+    i += len;
+  }
+
+  return true;
+}
+
+#ifdef COAP_X86
+
+// Error bits for a byte and the one before it.
+const uint8_t kTooShort = 1 << 0;     // 11______ 0_______
+                                      // 11______ 11______
+const uint8_t kTooLong = 1 << 1;      // 0_______ 10______
+const uint8_t kOverlong3 = 1 << 2;    // 11100000 100_____
+const uint8_t kTooLarge = 1 << 3;     // 11110100 1001____ and up
+const uint8_t kSurrogate = 1 << 4;    // 11101101 101_____
+const uint8_t kOverlong2 = 1 << 5;    // 1100000_ 10______
+const uint8_t kTooLarge1000 = 1 << 6; // 11110101 1000____ and up
+const uint8_t kOverlong4 = 1 << 6;    // 11110000 1000____
+const uint8_t kTwoConts = 1 << 7;     // 10______ 10______
+const uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+// By high nibble of the previous byte.
+const uint8_t kByte1High[16] = {
+  // 0_______ (ASCII)
+  kTooLong, kTooLong, kTooLong, kTooLong,
+  kTooLong, kTooLong, kTooLong, kTooLong,
+  // 10______ (continuation)
+  kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+  // 1100____
+  kTooShort | kOverlong2,
+  // 1101____
+  kTooShort,
+  // 1110____
+  kTooShort | kOverlong3 | kSurrogate,
+  // 1111____
+  kTooShort | kTooLarge | kTooLarge1000 | kOverlong4
+};
+
+// By low nibble of the previous byte.
+const uint8_t kByte1Low[16] = {
+  kCarry | kOverlong3 | kOverlong2 | kOverlong4,    // ____0000
+  kCarry | kOverlong2,                              // ____0001
+  kCarry,                                           // ____001_
+  kCarry,
+  kCarry | kTooLarge,                               // ____0100
+  kCarry | kTooLarge | kTooLarge1000,               // ____0101
+  kCarry | kTooLarge | kTooLarge1000,               // ____011_
+  kCarry | kTooLarge | kTooLarge1000,
+  kCarry | kTooLarge | kTooLarge1000,               // ____1___
+  kCarry | kTooLarge | kTooLarge1000,
+  kCarry | kTooLarge | kTooLarge1000,
+  kCarry | kTooLarge | kTooLarge1000,
+  kCarry | kTooLarge | kTooLarge1000,
+  kCarry | kTooLarge | kTooLarge1000 | kSurrogate,  // ____1101
+  kCarry | kTooLarge | kTooLarge1000,
+  kCarry | kTooLarge | kTooLarge1000
+};
+
+// By high nibble of the current byte.
+const uint8_t kByte2High[16] = {
+  // 0_______ (ASCII)
+  kTooShort, kTooShort, kTooShort, kTooShort,
+  kTooShort, kTooShort, kTooShort, kTooShort,
+  // 1000____
+  kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+  // 1001____
+  kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+  // 101_____
+  kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+  kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+  // 11______
+  kTooShort, kTooShort, kTooShort, kTooShort
+};
+
+// A block ending with any byte above these still needs continuations.
+const uint8_t kIncomplete[32] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+struct Sse4State {
+  __m128i error;
+  __m128i prev;
+  __m128i incomplete;
+};
+
+__attribute__((target("sse4.1")))
+void Sse4Block(__m128i input, Sse4State& st) {
+  if (_mm_movemask_epi8(input) == 0) {
+    // All ASCII: only a sequence cut short by the block boundary can
+    // be wrong.
+    st.error = _mm_or_si128(st.error, st.incomplete);
+    st.prev = input;
+    return;
+  }
+
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i byte_1_high = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(kByte1High));
+  const __m128i byte_1_low = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(kByte1Low));
+  const __m128i byte_2_high = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(kByte2High));
+
+  __m128i prev1 = _mm_alignr_epi8(input, st.prev, 15);
+  __m128i special = _mm_and_si128(
+      _mm_and_si128(
+          _mm_shuffle_epi8(byte_1_high,
+                           _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+          _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+      _mm_shuffle_epi8(byte_2_high,
+                       _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+  // Bytes 2 and 3 after a 3 or 4 byte lead must be continuations: the
+  // kTwoConts bit says they are, so the two cancel out.
+  __m128i prev2 = _mm_alignr_epi8(input, st.prev, 14);
+  __m128i prev3 = _mm_alignr_epi8(input, st.prev, 13);
+  __m128i must23 = _mm_or_si128(
+      _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80)),
+      _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80)));
+  __m128i must23_80 = _mm_and_si128(must23, _mm_set1_epi8(0x80));
+
+  st.error = _mm_or_si128(st.error, _mm_xor_si128(must23_80, special));
+  st.incomplete = _mm_subs_epu8(input, _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(kIncomplete + 16)));
+  st.prev = input;
+}
+
+__attribute__((target("sse4.1"), noinline))
+bool Sse4(const uint8_t* s, size_t n) {
+  Sse4State st;
+  st.error = _mm_setzero_si128();
+  st.prev = _mm_setzero_si128();
+  st.incomplete = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    Sse4Block(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)), st);
+
+  // The tail, padded with ASCII.
+  if (i < n) {
+    uint8_t tail[16] = { 0 };
+    memcpy(tail, s + i, n - i);
+    Sse4Block(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tail)), st);
+  }
+
+  st.error = _mm_or_si128(st.error, st.incomplete);
+  return _mm_testz_si128(st.error, st.error);
+}
+
+struct Avx2State {
+  __m256i error;
+  __m256i prev;
+  __m256i incomplete;
+};
+
+__attribute__((target("avx2")))
+void Avx2Block(__m256i input, Avx2State& st) {
+  if (_mm256_movemask_epi8(input) == 0) {
+    st.error = _mm256_or_si256(st.error, st.incomplete);
+    st.prev = input;
+    return;
+  }
+
+  // pshufb and palignr work within 128-bit lanes: tables are repeated
+  // in both, and the bytes before each lane come from a lane shifted
+  // in from the previous block.
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i byte_1_high = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kByte1High)));
+  const __m256i byte_1_low = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kByte1Low)));
+  const __m256i byte_2_high = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kByte2High)));
+
+  __m256i before = _mm256_permute2x128_si256(st.prev, input, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(input, before, 15);
+  __m256i special = _mm256_and_si256(
+      _mm256_and_si256(
+          _mm256_shuffle_epi8(
+              byte_1_high,
+              _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+          _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+      _mm256_shuffle_epi8(
+          byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+  __m256i prev2 = _mm256_alignr_epi8(input, before, 14);
+  __m256i prev3 = _mm256_alignr_epi8(input, before, 13);
+  __m256i must23 = _mm256_or_si256(
+      _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+      _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80)));
+  __m256i must23_80 = _mm256_and_si256(must23, _mm256_set1_epi8(0x80));
+
+  st.error = _mm256_or_si256(st.error, _mm256_xor_si256(must23_80, special));
+  st.incomplete = _mm256_subs_epu8(input, _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(kIncomplete)));
+  st.prev = input;
+}
+
+__attribute__((target("avx2"), noinline))
+bool Avx2(const uint8_t* s, size_t n) {
+  Avx2State st;
+  st.error = _mm256_setzero_si256();
+  st.prev = _mm256_setzero_si256();
+  st.incomplete = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+    Avx2Block(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i)), st);
+
+  if (i < n) {
+    uint8_t tail[32] = { 0 };
+    memcpy(tail, s + i, n - i);
+    Avx2Block(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail)), st);
+  }
+
+  st.error = _mm256_or_si256(st.error, st.incomplete);
+  return _mm256_testz_si256(st.error, st.error);
+}
+
+#endif  // COAP_X86
+
+}   // namespace
+
+bool IsValidUtf8(const uint8_t* s, size_t n, SimdLevel level) {
+  switch (level) {
+#ifdef COAP_X86
+    case SimdLevel::avx2:
+      return Avx2(s, n);
+    case SimdLevel::sse4:
+      return Sse4(s, n);
+#endif
+    default:
+      return Scalar(s, n);
+  }
+}
+
+namespace detail {
+
+// Past IsValidUtf8()'s check for short ASCII strings.
+bool IsValidUtf8(const uint8_t* s, size_t n) {
+  static const SimdLevel level = BestSimdLevel();
+
+  // Get past the ASCII prefix before picking an implementation: it
+  // can't affect what comes after.
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof word);
+    if (word & 0x8080808080808080ULL)
+      break;
+  }
+  while (i < n && s[i] < 0x80)
+    ++i;
+
+  if (i == n)
+    return true;
+  if (n - i < 16)
+    return Scalar(s + i, n - i);
+  return coap::IsValidUtf8(s + i, n - i, level);
+}
+
+}   // namespace detail
+
+}   // namespace coap
@@ -0,0 +1,64 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_UTF8_H_
+#define COAP_UTF8_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "coap/simd.h"
+
+namespace coap {
+
+// How string-format options (Uri-Host, Uri-Path, Uri-Query, ...) are
+// checked on decode.
+enum class StringCheck {
+  length,   // against the option's length bounds only
+  utf8      // and for being well-formed UTF-8 (RFC 7252, 3.2)
+};
+
+namespace detail {
+
+bool IsValidUtf8(const uint8_t* s, size_t n);
+
+}   // namespace detail
+
+// Return true if the n bytes at s are well-formed UTF-8 (RFC 3629): no
+// overlong forms, no surrogates, nothing above U+10FFFF, no truncated
+// sequences.
+//
+// Short ASCII strings, the bulk of option values, are told apart with
+// two overlapping loads here.  The rest go to the best implementation
+// for the CPU; the vectorised ones are the "lookup" algorithm by
+// Keiser and Lemire: three 16-entry nibble tables classify each pair
+// of adjacent bytes, and a saturating subtraction says which bytes
+// must be the 2nd or 3rd continuation of a sequence.
+inline bool IsValidUtf8(const uint8_t* s, size_t n) {
+  uint64_t any;
+
+  if (n >= 8 && n <= 16) {
+    uint64_t a, b;
+    memcpy(&a, s, 8);
+    memcpy(&b, s + n - 8, 8);
+    any = a | b;
+  } else if (n >= 4 && n < 8) {
+    uint32_t a, b;
+    memcpy(&a, s, 4);
+    memcpy(&b, s + n - 4, 4);
+    any = a | b;
+  } else if (n < 4) {
+    any = n ? s[0] | s[n / 2] | s[n - 1] : 0;
+  } else {
+    return detail::IsValidUtf8(s, n);
+  }
+
+  return (any & 0x8080808080808080ULL) == 0 || detail::IsValidUtf8(s, n);
+}
+
+// Same, with the given implementation (the CPU must support it).
+bool IsValidUtf8(const uint8_t* s, size_t n, SimdLevel level);
+
+}   // namespace coap
+
+#endif  // COAP_UTF8_H_
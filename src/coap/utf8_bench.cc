@@ -0,0 +1,187 @@
+// Copyleft 2013 tho@autistici.org
+
+// UTF-8 validation: raw throughput at each SIMD level over strings of
+// option-like lengths, and what it adds to decoding a corpus of typical
+// requests (StringCheck::utf8 on PDU decode, and on the OptionCursor
+// that walks a PDUView's Uri-Path).
+//
+// Usage: utf8_bench [messages]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/utf8.h"
+#include "coap/view.h"
+
+using namespace coap;
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ns(Clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// GETs and POSTs with a Uri-Host, a few path segments and queries;
+// one string in 4 to 8 isn't ASCII.
+std::vector<std::vector<uint8_t>> corpus(size_t n) {
+  const char* hosts[] = {
+    "sensor.example.org", "gw-17.local", "coap.me", "ex\xC3\xA4mple.org"
+  };
+  const char* segments[] = {
+    "sensors", "temp", "rooms", "kitchen", "3", "battery-level",
+    "0123456789abcdef", "k\xC3\xBC" "che"
+  };
+  const char* queries[] = {
+    "unit=celsius", "if=sensor", "rt=temperature-c", "name=caf\xC3\xA9"
+  };
+
+  std::vector<std::vector<uint8_t>> msgs;
+  srand(42);
+
+  for (size_t i = 0; i < n; ++i) {
+    PDU pdu;
+    pdu.set_code(i % 4 ? Code::GET : Code::POST);
+    pdu.set_message_id(i);
+    pdu.set_token({ uint8_t(i), uint8_t(i >> 8), 0xAA, 0xBB });
+
+    Options opts;
+    opts.AddUriHost(hosts[rand() % (sizeof hosts / sizeof *hosts)]);
+    for (int k = 1 + rand() % 3; k > 0; --k)
+      opts.AddUriPath(
+          segments[rand() % (sizeof segments / sizeof *segments)]);
+    for (int k = rand() % 3; k > 0; --k)
+      opts.AddUriQuery(
+          queries[rand() % (sizeof queries / sizeof *queries)]);
+    pdu.set_options(opts);
+    if (pdu.code() == Code::POST)
+      pdu.set_payload({ '2', '1', '.', '5' });
+
+    msgs.push_back(std::vector<uint8_t>());
+    assert(pdu.Encode(msgs.back()));
+  }
+
+  return msgs;
+}
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000000;
+  const int kRounds = 5;
+
+  const SimdLevel levels[] = {
+    SimdLevel::scalar, SimdLevel::sse4, SimdLevel::avx2
+  };
+  const size_t lengths[] = { 8, 32, 255, 1034 };
+  size_t sink = 0;
+
+  printf("validation (ns/string):\n");
+  for (size_t len : lengths) {
+    // Mostly ASCII with a few multibyte characters, like a path.
+    std::string s;
+    while (s.size() < len)
+      s += s.size() % 16 == 8 ? "\xC3\xA9" : "a";
+    s.resize(len);
+    if (static_cast<uint8_t>(s.back()) == 0xC3)
+      s.back() = 'a';
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(s.data());
+    size_t reps = n * 8 / len + 1;
+
+    printf("  %4zu bytes:", len);
+    for (SimdLevel level : levels) {
+      if (level > BestSimdLevel())
+        break;
+      Clock::time_point start = Clock::now();
+      for (size_t k = 0; k < reps; ++k)
+        sink += IsValidUtf8(p, s.size(), level);
+      printf("  %s %6.1f", SimdLevelName(level), elapsed_ns(start) / reps);
+    }
+    printf("\n");
+  }
+
+  std::vector<std::vector<uint8_t>> msgs = corpus(4096);
+
+  printf("decode (ns/message, %s, best of %d):\n",
+         SimdLevelName(BestSimdLevel()), kRounds);
+
+  // Rounds with and without the check alternate, and the best of each
+  // is kept: the difference is small next to run to run noise.
+  const StringCheck checks[] = { StringCheck::length, StringCheck::utf8 };
+  double pdu_ns[2] = { 1e9, 1e9 };
+  double view_ns[2] = { 1e9, 1e9 };
+  std::string path;
+
+  for (int round = 0; round < 2 * kRounds; ++round) {
+    int c = round % 2;
+
+    // PDU: validated as options are copied in.
+    size_t pdus = n / 8;
+    Clock::time_point start = Clock::now();
+    for (size_t k = 0; k < pdus; ++k) {
+      PDU pdu;
+      sink += pdu.Decode(msgs[k % msgs.size()], checks[c]);
+    }
+    pdu_ns[c] = std::min(pdu_ns[c], elapsed_ns(start) / pdus);
+
+    // PDUView: decode and join the Uri-Path, as a server does to find
+    // the resource; strings are validated on the way if asked.
+    start = Clock::now();
+    for (size_t k = 0; k < n; ++k) {
+      const std::vector<uint8_t>& m = msgs[k % msgs.size()];
+      PDUView v;
+      if (!v.Decode(m.data(), m.size()))
+        continue;
+
+      path.clear();
+      OptionCursor cursor = v.options(checks[c]);
+      size_t num, length;
+      const uint8_t* value;
+      while (cursor.Next(num, value, length)) {
+        if (num == Uri_Path) {
+          path += '/';
+          path.append(reinterpret_cast<const char*>(value), length);
+        }
+      }
+      sink += path.size();
+    }
+    view_ns[c] = std::min(view_ns[c], elapsed_ns(start) / n);
+  }
+
+  // The string values alone, as a share of the decodes above.
+  std::vector<std::pair<const uint8_t*, size_t>> strings;
+  for (const auto& m : msgs) {
+    PDUView v;
+    assert(v.Decode(m.data(), m.size()));
+    OptionCursor cursor = v.options();
+    size_t num, length;
+    const uint8_t* value;
+    while (cursor.Next(num, value, length))
+      if (IsStringOption(num))
+        strings.push_back(std::make_pair(value, length));
+  }
+
+  double check_ns = 1e9;
+  size_t reps = n / msgs.size() + 1;
+  for (int round = 0; round < kRounds; ++round) {
+    Clock::time_point start = Clock::now();
+    for (size_t r = 0; r < reps; ++r)
+      for (const auto& str : strings)
+        sink += IsValidUtf8(str.first, str.second);
+    check_ns = std::min(check_ns, elapsed_ns(start) / (reps * msgs.size()));
+  }
+
+  printf("  strings: %6.1f (%.1f string(s)/message)\n", check_ns,
+         static_cast<double>(strings.size()) / msgs.size());
+  printf("  PDU:     %6.1f -> %6.1f (%+.1f%%; strings alone %.1f%%)\n",
+         pdu_ns[0], pdu_ns[1], 100 * (pdu_ns[1] / pdu_ns[0] - 1),
+         100 * check_ns / pdu_ns[0]);
+  printf("  PDUView: %6.1f -> %6.1f (%+.1f%%; strings alone %.1f%%)\n",
+         view_ns[0], view_ns[1], 100 * (view_ns[1] / view_ns[0] - 1),
+         100 * check_ns / view_ns[0]);
+
+  return sink == 42;
+}
@@ -0,0 +1,159 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "utils/log.h"
+#include "coap/pdu.h"
+#include "coap/utf8.h"
+#include "coap/view.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("utf8_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+std::vector<SimdLevel> levels() {
+  std::vector<SimdLevel> v = { SimdLevel::scalar };
+  if (BestSimdLevel() != SimdLevel::scalar)
+    v.push_back(SimdLevel::sse4);
+  if (BestSimdLevel() == SimdLevel::avx2)
+    v.push_back(SimdLevel::avx2);
+  return v;
+}
+
+// Check s at every level, at all offsets across a couple of blocks
+// and with ASCII after it.
+void check(const std::string& s, bool valid) {
+  for (SimdLevel level : levels()) {
+    for (size_t pad = 0; pad < 70; ++pad) {
+      std::string t = std::string(pad, 'a') + s;
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(t.data());
+      assert(IsValidUtf8(p, t.size(), level) == valid);
+
+      t += "bc";
+      p = reinterpret_cast<const uint8_t*>(t.data());
+      assert(IsValidUtf8(p, t.size(), level) == valid);
+    }
+  }
+}
+
+void test_ok_valid() {
+  check("", true);
+  check("sensors", true);
+  check("\xC3\xBC", true);                // U+00FC
+  check("\xE2\x82\xAC", true);            // U+20AC
+  check("\xED\x9F\xBF", true);            // U+D7FF, last before surrogates
+  check("\xEE\x80\x80", true);            // U+E000, first after
+  check("\xF0\x9D\x84\x9E", true);        // U+1D11E
+  check("\xF4\x8F\xBF\xBF", true);        // U+10FFFF
+  check("t\xC3\xA9l\xC3\xA9phone/\xE2\x82\xAC", true);
+}
+
+void test_ko_invalid() {
+  check("\x80", false);                   // stray continuation
+  check("\xC3", false);                   // truncated
+  check("\xE2\x82", false);
+  check("\xF0\x9D\x84", false);
+  check("\xC3\x41", false);               // lead followed by ASCII
+  check("\xC3\xC3\xBC", false);           // lead followed by lead
+  check("\xC0\x80", false);               // overlong U+0000
+  check("\xC1\xBF", false);
+  check("\xE0\x9F\xBF", false);           // overlong 3 bytes
+  check("\xF0\x8F\xBF\xBF", false);       // overlong 4 bytes
+  check("\xED\xA0\x80", false);           // U+D800
+  check("\xED\xBF\xBF", false);           // U+DFFF
+  check("\xF4\x90\x80\x80", false);       // U+110000
+  check("\xF5\x80\x80\x80", false);
+  check("\xF8\x88\x80\x80\x80", false);   // 5 bytes
+  check("\xFF", false);
+  check("\xE2\x82\xAC\xAC", false);       // one continuation too many
+}
+
+// Every level agrees with the scalar one on random, mostly valid
+// strings with a byte or two changed.
+void test_ok_random() {
+  const char* pieces[] = {
+    "a", "/", "\xC3\xBC", "\xE2\x82\xAC", "\xF0\x9D\x84\x9E", "\xED\x9F\xBF"
+  };
+
+  srand(42);
+
+  for (int round = 0; round < 20000; ++round) {
+    std::string s;
+    size_t n = rand() % 40;
+    for (size_t i = 0; i < n; ++i)
+      s += pieces[rand() % 6];
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(s.data());
+    for (SimdLevel level : levels())
+      assert(IsValidUtf8(p, s.size(), level));
+
+    for (int k = rand() % 3; k > 0 && !s.empty(); --k)
+      s[rand() % s.size()] = rand();
+
+    p = reinterpret_cast<const uint8_t*>(s.data());
+    bool expect = IsValidUtf8(p, s.size(), SimdLevel::scalar);
+    for (SimdLevel level : levels())
+      assert(IsValidUtf8(p, s.size(), level) == expect);
+  }
+}
+
+void test_ok_strict_decode() {
+  coap::PDU pdu;
+  pdu.set_code(Code::GET);
+  Options opts;
+  assert(opts.AddUriPath("caf\xC3\xA9"));
+  pdu.set_options(opts);
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+
+  PDU out;
+  assert(out.Decode(buf, StringCheck::utf8));
+  PDUView view;
+  assert(view.Decode(buf.data(), buf.size()));
+  OptionCursor cursor = view.options(StringCheck::utf8);
+  size_t num, length;
+  const uint8_t* value;
+  assert(cursor.Next(num, value, length) && num == Uri_Path);
+  assert(!cursor.Next(num, value, length) && !cursor.failed());
+}
+
+void test_ko_strict_decode() {
+  coap::PDU pdu;
+  pdu.set_code(Code::GET);
+  Options opts;
+  assert(opts.AddUriPath("caf\xE9"));     // Latin-1
+  pdu.set_options(opts);
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+
+  // Only rejected if asked to.
+  PDU lenient;
+  assert(lenient.Decode(buf));
+  PDU strict;
+  assert(!strict.Decode(buf, StringCheck::utf8));
+
+  PDUView view;
+  assert(view.Decode(buf.data(), buf.size()));
+  size_t num, length;
+  const uint8_t* value;
+  OptionCursor lenient_cursor = view.options();
+  assert(lenient_cursor.Next(num, value, length));
+  OptionCursor strict_cursor = view.options(StringCheck::utf8);
+  assert(!strict_cursor.Next(num, value, length) && strict_cursor.failed());
+}
+
+int main() {
+  init_log();
+
+  test_ok_valid();
+  test_ko_invalid();
+  test_ok_random();
+  test_ok_strict_decode();
+  test_ko_strict_decode();
+}
@@ -0,0 +1,172 @@
+// Copyleft 2013 tho@autistici.org
+
+#include "utils/log.h"
+#include "coap/view.h"
+#include "coap/registry.h"
+
+namespace coap {
+
+namespace {
+
+// Registered ones included.
+bool IsString(size_t num) {
+  const OptProp* prop = FindOption(num);
+  return prop && prop->format() == OptionFormat::string;
+}
+
+}   // namespace
+
+//
+// class OptionCursor
+//
+bool OptionCursor::Next(size_t& num, const uint8_t*& value, size_t& length) {
+  if (cur_ >= end_)
+    return false;
+
+  // (See Option::Decode for pics.)
+  uint8_t dl = *cur_++;
+
+  if (dl == 0xFF) {
+    marker_ = true;
+    return false;
+  }
+
+  size_t delta = (dl & 0xF0) >> 4;
+  length = dl & 0x0F;
+
+  // 15 is reserved for the payload marker in both nibbles.
+  if (delta == 0xF || length == 0xF || !Extend(delta) || !Extend(length)) {
+    failed_ = true;
+    return false;
+  }
+
+  if (static_cast<size_t>(end_ - cur_) < length) {
+    failed_ = true;
+    return false;
+  }
+
+  if (check_ == StringCheck::utf8 && IsString(base_ + delta) &&
+      !IsValidUtf8(cur_, length)) {
+    failed_ = true;
+    return false;
+  }
+
+  base_ += delta;
+  num = base_;
+  value = cur_;
+  cur_ += length;
+
+  return true;
+}
+
+// Overwrite a 13 or 14 delta/length nibble with its extended value.
+bool OptionCursor::Extend(size_t& dl) {
+  switch (dl) {
+    case 13:  // extended format: 1 byte
+      if (cur_ >= end_)
+        return false;
+      dl = *cur_ + 13;
+      cur_ += 1;
+      break;
+    case 14:  // extended format: 2 bytes
+      if (end_ - cur_ < 2)
+        return false;
+      dl = ((cur_[0] << 8) | cur_[1]) + 269;
+      cur_ += 2;
+      break;
+  }
+
+  return true;
+}
+
+//
+// class PDUView
+//
+bool PDUView::Decode(const uint8_t* buf, size_t size,
+                     UnknownOption unknown) {
+  utils::Log* L = utils::Log::Instance();
+
+  // (See PDU::EncodeHeader for pics.)
+  if (size < 4) {
+    L->Debug("PDU too short (%zu byte(s))", size);
+    return false;
+  }
+
+  if (((buf[0] & 0xC0) >> 6) != Version::v1) {
+    L->Debug("PDU carries an unknown version");
+    return false;
+  }
+
+  uint8_t token_length = buf[0] & 0x0F;
+
+  if (token_length > 8) {
+    L->Debug("invalid token length (%u)", token_length);
+    return false;
+  }
+
+  if (!IsValidCode(buf[1])) {
+    L->Debug("unknown code (%u)", buf[1]);
+    return false;
+  }
+
+  if (size < 4U + token_length) {
+    L->Debug("truncated token (%zu byte(s) left)", size - 4);
+    return false;
+  }
+
+  // Validate options against the store and locate the payload,
+  // hashing the cache key on the way.
+  OptionCursor cursor(buf + 4 + token_length, buf + size);
+  CacheKey key;
+  size_t num, length;
+  const uint8_t* value;
+
+  while (cursor.Next(num, value, length)) {
+    if (num > UINT16_MAX) {
+      L->Debug("option number out of range (%zu)", num);
+      return false;
+    }
+
+    key.Add(num, value, length);
+    const OptProp* prop = FindOption(num);
+
+    if (!prop) {
+      if (unknown == UnknownOption::keep && !(num & 1))
+        continue;
+      L->Debug("unknown option number (%zu)", num);
+      return false;
+    }
+
+    if (length > prop->max_length() || length < prop->min_length()) {
+      L->Debug("%s length out of range: %zu", prop->name(), length);
+      return false;
+    }
+  }
+
+  if (cursor.failed()) {
+    L->Debug("badly formatted option at offset %zu", cursor.position() - buf);
+    return false;
+  }
+
+  size_t payload_offset = cursor.position() - buf;
+
+  // "The presence of a marker followed by a zero-length payload MUST be
+  //  processed as a message format error."
+  if (cursor.marker() && payload_offset == size) {
+    L->Debug("payload marker followed by an empty payload");
+    return false;
+  }
+
+  buf_ = buf;
+  size_ = size;
+  type_ = static_cast<Type>((buf[0] & 0x30) >> 4);
+  code_ = static_cast<Code>(buf[1]);
+  message_id_ = (buf[2] << 8) | buf[3];
+  token_length_ = token_length;
+  payload_offset_ = payload_offset;
+  cache_key_ = key.value();
+
+  return true;
+}
+
+}   // namespace coap
@@ -0,0 +1,122 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_VIEW_H_
+#define COAP_VIEW_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "coap/proto.h"
+#include "coap/optstore.h"
+#include "coap/cache_key.h"
+#include "coap/utf8.h"
+
+namespace coap {
+
+// Walk the options area of an encoded PDU without copying.  Each call
+// to Next() yields the absolute option number and a pointer to the
+// option value bytes, which are left where they are.
+//
+// With StringCheck::utf8, string-format values are checked for UTF-8
+// as they are walked over.  PDUView::Decode() doesn't check them: at
+// about a fifth of its cost, that is left to whoever looks at them.
+class OptionCursor {
+ public:
+  OptionCursor(const uint8_t* begin, const uint8_t* end,
+               StringCheck check = StringCheck::length)
+    : cur_(begin)
+    , end_(end)
+    , base_(0)
+    , check_(check)
+    , marker_(false)
+    , failed_(false)
+  { }
+
+  // Return false when the options area is exhausted (end of buffer
+  // or payload marker), on a framing error or on a string that isn't
+  // UTF-8 (if asked), in which case failed() is set.
+  bool Next(size_t& num, const uint8_t*& value, size_t& length);
+
+  // Pointer to the first byte not consumed yet.
+  const uint8_t* position() const { return cur_; }
+  bool marker() const { return marker_; }
+  bool failed() const { return failed_; }
+
+ private:
+  bool Extend(size_t& dl);
+
+ private:
+  const uint8_t* cur_;
+  const uint8_t* end_;
+  size_t base_;
+  StringCheck check_;
+  bool marker_;
+  bool failed_;
+};
+
+// A read-only, non-owning decoded PDU.  Decode() validates the whole
+// message like PDU::Decode() does, but only records offsets into the
+// given buffer: nothing is allocated and nothing is copied.  The
+// buffer must outlive the view.
+class PDUView {
+ public:
+  PDUView()
+    : buf_(nullptr)
+    , size_(0)
+    , type_(Type::CON)
+    , code_(Code::Empty)
+    , message_id_(0)
+    , token_length_(0)
+    , payload_offset_(0)
+    , cache_key_(0)
+  { }
+
+  // With UnknownOption::keep, unknown elective options are let through:
+  // their bytes stay where they are, for a proxy to pass on.
+  bool Decode(const uint8_t* buf, size_t size,
+              UnknownOption unknown = UnknownOption::reject);
+
+  // Header fields getter's
+  Type type() const { return type_; }
+  Code code() const { return code_; }
+  uint16_t message_id() const { return message_id_; }
+  uint8_t token_length() const { return token_length_; }
+  const uint8_t* token() const { return buf_ + 4; }
+
+  OptionCursor options(StringCheck check = StringCheck::length) const {
+    return OptionCursor(buf_ + 4 + token_length_, buf_ + options_end(),
+                        check);
+  }
+
+  // Hash of the cache-key options (see CacheKey), unknown ones kept
+  // included.
+  uint64_t cache_key() const { return cache_key_; }
+
+  const uint8_t* payload() const { return buf_ + payload_offset_; }
+  size_t payload_size() const { return size_ - payload_offset_; }
+
+  // The whole encoded message.
+  const uint8_t* data() const { return buf_; }
+  size_t size() const { return size_; }
+
+ private:
+  size_t options_end() const {
+    // Step back over the payload marker, if any.
+    return payload_offset_ < size_ ? payload_offset_ - 1 : size_;
+  }
+
+ private:
+  const uint8_t* buf_;
+  size_t size_;
+
+  Type type_;
+  Code code_;
+  uint16_t message_id_;
+  uint8_t token_length_;
+  size_t payload_offset_;
+  uint64_t cache_key_;
+};
+
+}   // namespace coap
+
+#endif  // COAP_VIEW_H_
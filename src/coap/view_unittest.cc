@@ -0,0 +1,196 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/view.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("view_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+void test_ok_view_matches_pdu() {
+  PDU pdu;
+  pdu.set_type(Type::NON);
+  pdu.set_code(Code::GET);
+  pdu.set_message_id(0x1234);
+  pdu.set_token({ 't', 'o', 'k' });
+
+  Options opts;
+  assert(opts.AddUriHost("s.example.org"));
+  assert(opts.AddUriPath("dir"));
+  assert(opts.AddUriPath("file"));
+  assert(opts.AddProxyUri(std::string(300, 'x')));   // 2-byte ext. length
+  pdu.set_options(opts);
+  pdu.set_payload({ 'p', 'l', 'o', 'a', 'd' });
+
+  std::vector<uint8_t> pkt;
+  assert(pdu.Encode(pkt));
+
+  PDUView view;
+  assert(view.Decode(pkt.data(), pkt.size()));
+  assert(view.type() == Type::NON);
+  assert(view.code() == Code::GET);
+  assert(view.message_id() == 0x1234);
+  assert(view.token_length() == 3);
+  assert(memcmp(view.token(), "tok", 3) == 0);
+  assert(view.payload_size() == 5);
+  assert(memcmp(view.payload(), "pload", 5) == 0);
+
+  // Options come out in order, values point into pkt.
+  std::vector<size_t> nums;
+  size_t num, length;
+  const uint8_t* value;
+  OptionCursor cursor = view.options();
+  while (cursor.Next(num, value, length)) {
+    assert(value > pkt.data() && value + length <= pkt.data() + pkt.size());
+    nums.push_back(num);
+  }
+  assert(!cursor.failed());
+  assert((nums == std::vector<size_t>{ Uri_Host, Uri_Path, Uri_Path,
+                                       Proxy_Uri }));
+}
+
+void test_ok_empty_message() {
+  // CON, Empty, MID 0xBEEF
+  std::vector<uint8_t> pkt { 0x40, 0x00, 0xBE, 0xEF };
+
+  PDUView view;
+  assert(view.Decode(pkt.data(), pkt.size()));
+  assert(view.type() == Type::CON);
+  assert(view.code() == Code::Empty);
+  assert(view.message_id() == 0xBEEF);
+  assert(view.payload_size() == 0);
+
+  PDU pdu;
+  assert(pdu.Decode(pkt));
+  assert(pdu.message_id() == 0xBEEF);
+}
+
+void test_ok_keep_unknown_elective() {
+  // GET, Uri-Path "a", option 2000 = { 1, 2 }, payload "x".
+  std::vector<uint8_t> pkt {
+    0x40, 0x01, 0x00, 0x01,
+    0xB1, 'a',
+    0xE2, 0x06, 0xB8, 0x01, 0x02,
+    0xFF, 'x'
+  };
+
+  PDUView view;
+  assert(!view.Decode(pkt.data(), pkt.size()));
+  assert(view.Decode(pkt.data(), pkt.size(), UnknownOption::keep));
+  assert(view.payload_size() == 1 && view.payload()[0] == 'x');
+
+  std::vector<size_t> nums;
+  size_t num, length;
+  const uint8_t* value;
+  OptionCursor cursor = view.options();
+  while (cursor.Next(num, value, length))
+    nums.push_back(num);
+  assert((nums == std::vector<size_t>{ Uri_Path, 2000 }));
+
+  // Critical (odd): rejected all the same.
+  pkt[8] = 0xB9;
+  assert(!view.Decode(pkt.data(), pkt.size(), UnknownOption::keep));
+}
+
+void test_ko_malformed() {
+  std::vector<std::vector<uint8_t>> bins {
+    { 0x40, 0x00, 0x00 },                     // short header
+    { 0x80, 0x00, 0x00, 0x00 },               // version 2
+    { 0x49, 0x00, 0x00, 0x00 },               // TKL 9
+    { 0x40, 0x05, 0x00, 0x00 },               // code 0.05
+    { 0x42, 0x01, 0x00, 0x00, 'a' },          // truncated token
+    { 0x40, 0x01, 0x00, 0x00, 0x22, 0xFF },   // unknown option 2
+    { 0x40, 0x01, 0x00, 0x00, 0x33, 'a' },    // truncated Uri-Host
+    { 0x40, 0x01, 0x00, 0x00, 0xD0 },         // missing extended delta
+    { 0x40, 0x01, 0x00, 0x00, 0xFF },         // empty payload
+  };
+
+  for (auto bin : bins) {
+    PDUView view;
+    assert(!view.Decode(bin.data(), bin.size()));
+  }
+}
+
+// A GET for path, with its own message ID and token, and a Size1
+// (NoCacheKey) value.
+std::vector<uint8_t> get(const std::vector<std::string>& path,
+                         uint16_t mid, uint64_t size1) {
+  PDU pdu;
+  pdu.set_type(Type::CON);
+  pdu.set_code(Code::GET);
+  pdu.set_message_id(mid);
+  pdu.set_token({ static_cast<uint8_t>(mid) });
+
+  Options opts;
+  for (const std::string& segment : path)
+    assert(opts.AddUriPath(segment));
+  assert(opts.AddUriQuery("a-rather-long-query=with-a-tail"));
+  assert(opts.AddSize1(size1));
+  pdu.set_options(opts);
+
+  std::vector<uint8_t> pkt;
+  assert(pdu.Encode(pkt));
+  return pkt;
+}
+
+uint64_t view_key(const std::vector<uint8_t>& pkt) {
+  PDUView view;
+  assert(view.Decode(pkt.data(), pkt.size()));
+  return view.cache_key();
+}
+
+uint64_t pdu_key(const std::vector<uint8_t>& pkt) {
+  PDU pdu;
+  assert(pdu.Decode(pkt));
+  return pdu.cache_key();
+}
+
+void test_ok_cache_key() {
+  std::vector<uint8_t> a = get({ "s", "t" }, 1, 10);
+  std::vector<uint8_t> b = get({ "s", "t" }, 2, 20);
+  uint64_t key = view_key(a);
+
+  // Message ID, token and NoCacheKey options don't count.
+  assert(view_key(b) == key);
+  assert(pdu_key(a) == key && pdu_key(b) == key);
+
+  // Options built rather than decoded hash the same.
+  Options opts;
+  assert(opts.AddSize1(30));
+  assert(opts.AddUriQuery("a-rather-long-query=with-a-tail"));
+  assert(opts.AddUriPath("s"));
+  assert(opts.AddUriPath("t"));
+  assert(opts.cache_key() == key);
+
+  // Added to after decoding: worked out again.
+  PDU pdu;
+  assert(pdu.Decode(a));
+  Options more = pdu.options();
+  assert(more.AddUriPath("u"));
+  assert(more.cache_key() == view_key(get({ "s", "t", "u" }, 3, 10)));
+
+  // Values, and their order, do.
+  assert(view_key(get({ "s", "u" }, 1, 10)) != key);
+  assert(view_key(get({ "t", "s" }, 1, 10)) != key);
+  assert(view_key(get({ "st" }, 1, 10)) != key);
+  assert(view_key(get({ "s", "t", "" }, 1, 10)) != key);
+}
+
+int main() {
+  init_log();
+
+  test_ok_view_matches_pdu();
+  test_ok_empty_message();
+  test_ok_keep_unknown_elective();
+  test_ok_cache_key();
+
+  test_ko_malformed();
+}
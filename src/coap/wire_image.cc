@@ -0,0 +1,244 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cstring>
+#include "utils/log.h"
+#include "coap/registry.h"
+#include "coap/wire_image.h"
+
+namespace coap {
+
+namespace {
+
+// Extended bytes needed by an option delta or length.
+size_t Extended(size_t v) {
+  return v < 13 ? 0 : v < 269 ? 1 : 2;
+}
+
+size_t HeaderSize(size_t delta, size_t length) {
+  return 1 + Extended(delta) + Extended(length);
+}
+
+uint8_t Nibble(size_t v) {
+  return v < 13 ? v : v < 269 ? 13 : 14;
+}
+
+uint8_t* PutExtended(uint8_t* p, size_t v) {
+  if (v >= 269) {
+    *p++ = (v - 269) >> 8;
+    *p++ = (v - 269) & 0xFF;
+  } else if (v >= 13) {
+    *p++ = v - 13;
+  }
+  return p;
+}
+
+// (See Option::Decode for pics.)
+uint8_t* PutHeader(uint8_t* p, size_t delta, size_t length) {
+  *p++ = (Nibble(delta) << 4) | Nibble(length);
+  p = PutExtended(p, delta);
+  return PutExtended(p, length);
+}
+
+// Minimal big-endian bytes of v (none for 0).
+size_t PutUint(uint8_t* p, uint64_t v) {
+  size_t n = 0;
+  for (uint64_t x = v; x; x >>= 8)
+    ++n;
+  for (size_t i = 0; i < n; ++i)
+    p[i] = v >> (8 * (n - 1 - i));
+  return n;
+}
+
+}   // namespace
+
+bool WireImage::Attach(uint8_t* buf, size_t size, size_t capacity,
+                       UnknownOption unknown) {
+  PDUView view;
+  if (capacity < size || !view.Decode(buf, size, unknown))
+    return false;
+
+  buf_ = buf;
+  size_ = size;
+  capacity_ = capacity;
+  options_end_ = view.payload_size() ? size - view.payload_size() - 1 : size;
+  return true;
+}
+
+bool WireImage::set_token(const uint8_t* token, size_t length) {
+  if (length > 8) {
+    utils::Log::Instance()->Debug("invalid token length (%zu)", length);
+    return false;
+  }
+
+  if (!Resize(4, 4 + token_length(), length))
+    return false;
+
+  if (length)
+    memcpy(buf_ + 4, token, length);
+  buf_[0] = (buf_[0] & 0xF0) | length;
+  return true;
+}
+
+bool WireImage::Set(size_t num, const uint8_t* value, size_t length) {
+  if (!Check(num, length))
+    return false;
+
+  // Replace the first one, or else go where it would be.
+  Place place;
+  Locate(num, false, place);
+  return Write(place, num, value, length);
+}
+
+bool WireImage::SetUint(size_t num, uint64_t value) {
+  uint8_t bytes[8];
+  return Set(num, bytes, PutUint(bytes, value));
+}
+
+bool WireImage::Insert(size_t num, const uint8_t* value, size_t length) {
+  if (!Check(num, length))
+    return false;
+
+  Place place;
+  if (Locate(num, true, place) && !FindOption(num)->repeatable()) {
+    utils::Log::Instance()->Debug("trying to add non-repeatable Option %s "
+                                  "twice", FindOption(num)->name());
+    return false;
+  }
+  return Write(place, num, value, length);
+}
+
+bool WireImage::InsertUint(size_t num, uint64_t value) {
+  uint8_t bytes[8];
+  return Insert(num, bytes, PutUint(bytes, value));
+}
+
+size_t WireImage::Remove(size_t num) {
+  size_t removed = 0;
+  Place place;
+
+  while (Locate(num, false, place)) {
+    // The one after takes over its base.
+    if (place.next) {
+      size_t delta = place.next - place.base;
+      if (!Resize(place.at, place.next_value,
+                  HeaderSize(delta, place.next_length)))
+        break;
+      PutHeader(buf_ + place.at, delta, place.next_length);
+    } else if (!Resize(place.at, place.end, 0)) {
+      break;
+    }
+    ++removed;
+  }
+
+  return removed;
+}
+
+// Find the first num option (or, with after, the end of the last one)
+// and say whether there is any.
+bool WireImage::Locate(size_t num, bool after, Place& place) const {
+  OptionCursor cursor = options();
+  bool found = false;
+  size_t base = 0;
+
+  place.next = 0;
+
+  for (;;) {
+    const uint8_t* at = cursor.position();
+    size_t n, length;
+    const uint8_t* value;
+
+    if (!cursor.Next(n, value, length)) {
+      if (!found || after) {
+        place.at = place.end = at - buf_;
+        place.base = base;
+      }
+      return found;
+    }
+
+    if (n == num && !found && !after) {
+      place.at = at - buf_;
+      place.end = value + length - buf_;
+      place.base = base;
+      found = true;
+      continue;   // on to the next one
+    }
+
+    if (found && !after) {
+      place.next = n;
+      place.next_value = value - buf_;
+      place.next_length = length;
+      return true;
+    }
+
+    if (n > num) {
+      place.at = place.end = at - buf_;
+      place.base = base;
+      place.next = n;
+      place.next_value = value - buf_;
+      place.next_length = length;
+      return found;
+    }
+
+    found = found || n == num;
+    base = n;
+  }
+}
+
+bool WireImage::Check(size_t num, size_t length) const {
+  utils::Log* L = utils::Log::Instance();
+
+  const OptProp* prop = FindOption(num);
+  if (!prop) {
+    L->Debug("option number (%zu) not known", num);
+    return false;
+  }
+
+  if (length > prop->max_length() || length < prop->min_length()) {
+    L->Debug("out-of-range value size %zu for %s", length, prop->name());
+    return false;
+  }
+
+  return true;
+}
+
+// Put the num option in place, and re-encode the header of the one
+// after it for its new delta.
+bool WireImage::Write(const Place& place, size_t num, const uint8_t* value,
+                      size_t length) {
+  size_t delta = num - place.base;
+  size_t size = HeaderSize(delta, length) + length;
+  size_t to = place.end;
+
+  if (place.next) {
+    size += HeaderSize(place.next - num, place.next_length);
+    to = place.next_value;
+  }
+
+  if (!Resize(place.at, to, size))
+    return false;
+
+  uint8_t* p = PutHeader(buf_ + place.at, delta, length);
+  if (length)
+    memcpy(p, value, length);
+  if (place.next)
+    PutHeader(p + length, place.next - num, place.next_length);
+
+  return true;
+}
+
+// Make the bytes [from, to) length bytes long, moving the rest.
+bool WireImage::Resize(size_t from, size_t to, size_t length) {
+  size_t size = size_ - (to - from) + length;
+  if (size > capacity_) {
+    utils::Log::Instance()->Debug("edit needs %zu bytes, capacity is %zu",
+                                  size, capacity_);
+    return false;
+  }
+
+  memmove(buf_ + from + length, buf_ + to, size_ - to);
+  options_end_ = options_end_ - (to - from) + length;
+  size_ = size;
+  return true;
+}
+
+}   // namespace coap
@@ -0,0 +1,107 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef COAP_WIRE_IMAGE_H_
+#define COAP_WIRE_IMAGE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#include "coap/proto.h"
+#include "coap/optstore.h"
+#include "coap/view.h"
+
+namespace coap {
+
+// An encoded PDU edited where it lies: the mutable sibling of PDUView,
+// for proxies and middleboxes that change a message ID, a token or an
+// option or two and send the rest on as it came.
+//
+// Header fields are patched in place.  An option edit moves the bytes
+// after it by the size difference, and re-encodes the delta (and so the
+// extended delta bytes) of the option that follows, which is the only
+// other one affected.  The buffer is the caller's, and edits may grow
+// the message up to the capacity given to Attach().
+//
+// Option values are checked against the OptionRegistry, like
+// Options::Add does.
+class WireImage {
+ public:
+  WireImage()
+    : buf_(nullptr)
+    , size_(0)
+    , capacity_(0)
+    , options_end_(0)
+  { }
+
+  // Take the size bytes at buf as a message, validated like
+  // PDUView::Decode() does.
+  bool Attach(uint8_t* buf, size_t size, size_t capacity,
+              UnknownOption unknown = UnknownOption::reject);
+
+  void set_type(Type type) { buf_[0] = (buf_[0] & 0xCF) | (type << 4); }
+  void set_code(Code code) { buf_[1] = code; }
+  void set_message_id(uint16_t mid) {
+    buf_[2] = mid >> 8;
+    buf_[3] = mid & 0xFF;
+  }
+  bool set_token(const uint8_t* token, size_t length);
+
+  // Replace the value of the first num option, or insert one if there
+  // is none.
+  bool Set(size_t num, const uint8_t* value, size_t length);
+  bool Set(size_t num, const std::string& value) {
+    return Set(num, reinterpret_cast<const uint8_t*>(value.data()),
+               value.size());
+  }
+  bool SetUint(size_t num, uint64_t value);
+
+  // Add a num option after those already there.
+  bool Insert(size_t num, const uint8_t* value, size_t length);
+  bool Insert(size_t num, const std::string& value) {
+    return Insert(num, reinterpret_cast<const uint8_t*>(value.data()),
+                  value.size());
+  }
+  bool InsertUint(size_t num, uint64_t value);
+
+  // Remove all the num options; return how many there were.
+  size_t Remove(size_t num);
+
+  uint8_t token_length() const { return buf_[0] & 0x0F; }
+  OptionCursor options() const {
+    return OptionCursor(buf_ + 4 + token_length(), buf_ + options_end_);
+  }
+
+  // The whole encoded message.
+  const uint8_t* data() const { return buf_; }
+  size_t size() const { return size_; }
+
+ private:
+  // Where an option is, or goes (then at == end).  The option after
+  // it starts at end.
+  struct Place {
+    size_t at;          // first byte of its header
+    size_t end;         // one past its value
+    size_t base;        // number of the option before it (0 if none)
+    size_t next;        // number of the option after it (0 if none)
+    size_t next_value;  // first byte of that one's value
+    size_t next_length;
+  };
+
+  bool Locate(size_t num, bool after, Place& place) const;
+  bool Check(size_t num, size_t length) const;
+  bool Write(const Place& place, size_t num, const uint8_t* value,
+             size_t length);
+  bool Resize(size_t from, size_t to, size_t length);
+
+ private:
+  uint8_t* buf_;
+  size_t size_;
+  size_t capacity_;
+  size_t options_end_;  // the payload marker, or size_ if none
+};
+
+}   // namespace coap
+
+#endif  // COAP_WIRE_IMAGE_H_
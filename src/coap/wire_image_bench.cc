@@ -0,0 +1,137 @@
+// Copyleft 2013 tho@autistici.org
+
+// What a proxy does to a response on its way back: a new message ID and
+// token, a lowered Max-Age, an extra Location-Path.  Edited in place
+// with WireImage (Attach() validating it first) against PDU::Decode,
+// the setters and PDU::Encode.
+//
+// Usage: wire_image_bench [messages]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/wire_image.h"
+
+using namespace coap;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double ns(Clock::time_point start, size_t n) {
+  return std::chrono::duration<double, std::nano>(
+      Clock::now() - start).count() / n;
+}
+
+std::vector<uint8_t> response() {
+  PDU pdu;
+  pdu.set_type(Type::ACK);
+  pdu.set_code(Code::Content);
+  pdu.set_message_id(0x1234);
+  pdu.set_token({ 1, 2, 3, 4 });
+
+  Options opts;
+  assert(opts.AddETag({ 0xCA, 0xFE, 0xBA, 0xBE }));
+  assert(opts.AddLocationPath("sensors"));
+  assert(opts.AddContentFormat(50));
+  assert(opts.AddMaxAge(3600));
+  pdu.set_options(opts);
+  pdu.set_payload(std::vector<uint8_t>(64, 'x'));
+
+  std::vector<uint8_t> pkt;
+  assert(pdu.Encode(pkt));
+  return pkt;
+}
+
+const uint8_t kToken[] = { 9, 8, 7, 6, 5, 4, 3, 2 };
+
+// The options, but for Max-Age, come back as they are.
+void pdu_rewrite(const std::vector<uint8_t>& pkt, std::vector<uint8_t>& out,
+                 uint16_t mid) {
+  PDU pdu;
+  assert(pdu.Decode(pkt));
+
+  Options opts;
+  for (Option& opt : pdu.options()) {
+    if (opt.num() == Max_Age)
+      continue;
+    std::vector<uint8_t> v;
+    opt.value(v);
+    switch (opt.format()) {
+      case OptionFormat::string:
+        assert(opts.Add(opt.num(), std::string(v.begin(), v.end())));
+        break;
+      case OptionFormat::uint: {
+        uint64_t u;
+        assert(opt.value_uint(u) && opts.Add(opt.num(), u));
+        break;
+      }
+      default:
+        assert(opts.Add(opt.num(), v));
+    }
+  }
+  assert(opts.AddMaxAge(60));
+  assert(opts.AddLocationPath("1"));
+
+  PDU rsp;
+  rsp.set_type(pdu.type());
+  rsp.set_code(pdu.code());
+  rsp.set_message_id(mid);
+  rsp.set_token(std::vector<uint8_t>(kToken, kToken + 8));
+  rsp.set_options(opts);
+  rsp.set_payload(pdu.payload());
+
+  out.clear();
+  assert(rsp.Encode(out));
+}
+
+void wire_rewrite(const std::vector<uint8_t>& pkt, uint8_t* buf,
+                  size_t capacity, size_t& size, uint16_t mid) {
+  memcpy(buf, pkt.data(), pkt.size());
+
+  WireImage wire;
+  assert(wire.Attach(buf, pkt.size(), capacity));
+  wire.set_message_id(mid);
+  assert(wire.set_token(kToken, sizeof kToken));
+  assert(wire.SetUint(Max_Age, 60));
+  assert(wire.Insert(Location_Path, "1"));
+  size = wire.size();
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+
+  std::vector<uint8_t> pkt = response();
+  std::vector<uint8_t> out;
+  uint8_t buf[1152];
+  size_t size = 0;
+
+  // Both ways come to the same bytes.
+  pdu_rewrite(pkt, out, 1);
+  wire_rewrite(pkt, buf, sizeof buf, size, 1);
+  assert(out == std::vector<uint8_t>(buf, buf + size));
+
+  printf("%zu rewrites of a %zu byte response\n", n, pkt.size());
+
+  uint64_t sink = 0;
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    pdu_rewrite(pkt, out, i);
+    sink += out[3];
+  }
+  printf("decode + encode: %8.1f ns/message\n", ns(start, n));
+
+  start = Clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    wire_rewrite(pkt, buf, sizeof buf, size, i);
+    sink += buf[3];
+  }
+  printf("in place:        %8.1f ns/message (%llu)\n", ns(start, n),
+         static_cast<unsigned long long>(sink));
+}
@@ -0,0 +1,246 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/registry.h"
+#include "coap/wire_image.h"
+
+using namespace coap;
+
+void init_log() {
+  utils::Log::Instance()->Open("wire_image_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+const OptionNumber No_Response = static_cast<OptionNumber>(258);
+const OptionNumber Tenant = static_cast<OptionNumber>(65001);
+
+// Every edit is checked against the same message encoded from scratch.
+std::vector<uint8_t> encode(const Options& opts,
+                            const std::vector<uint8_t>& token = { 0xAB },
+                            uint16_t mid = 0x1234,
+                            const std::vector<uint8_t>& payload = { 'p' }) {
+  PDU pdu;
+  pdu.set_type(Type::ACK);
+  pdu.set_code(Code::Content);
+  pdu.set_message_id(mid);
+  pdu.set_token(token);
+  pdu.set_options(opts);
+  pdu.set_payload(payload);
+
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+// A copy of pkt in a buffer with room to grow, attached.
+struct Image {
+  explicit Image(const std::vector<uint8_t>& pkt, size_t room = 64)
+    : buf(pkt.size() + room) {
+    memcpy(buf.data(), pkt.data(), pkt.size());
+    assert(wire.Attach(buf.data(), pkt.size(), buf.size()));
+  }
+
+  std::vector<uint8_t> bytes() const {
+    return std::vector<uint8_t>(wire.data(), wire.data() + wire.size());
+  }
+
+  std::vector<uint8_t> buf;
+  WireImage wire;
+};
+
+void test_ok_header() {
+  Options opts;
+  assert(opts.AddUriPath("a"));
+  Image image(encode(opts));
+
+  image.wire.set_message_id(0xBEEF);
+  assert(image.bytes() == encode(opts, { 0xAB }, 0xBEEF));
+
+  assert(image.wire.set_token((const uint8_t*) "\x01\x02\x03\x04", 4));
+  assert(image.bytes() == encode(opts, { 1, 2, 3, 4 }, 0xBEEF));
+
+  assert(image.wire.set_token(nullptr, 0));
+  assert(image.bytes() == encode(opts, {}, 0xBEEF));
+
+  image.wire.set_type(Type::CON);
+  image.wire.set_code(Code::GET);
+  assert(image.bytes()[0] == 0x40 && image.bytes()[1] == Code::GET);
+}
+
+void test_ok_replace() {
+  Options before, after;
+  assert(before.AddContentFormat(0));
+  assert(before.AddMaxAge(60));
+  assert(before.AddSize1(1024));
+  assert(after.AddContentFormat(0));
+  assert(after.AddMaxAge(86400));
+  assert(after.AddSize1(1024));
+
+  Image image(encode(before));
+  assert(image.wire.SetUint(Max_Age, 86400));
+  assert(image.bytes() == encode(after));
+
+  // Shorter again, down to nothing.
+  Options zero;
+  assert(zero.AddContentFormat(0));
+  assert(zero.AddMaxAge(0));
+  assert(zero.AddSize1(1024));
+  assert(image.wire.SetUint(Max_Age, 0));
+  assert(image.bytes() == encode(zero));
+}
+
+void test_ok_insert() {
+  Options before, after;
+  assert(before.AddLocationPath("a"));
+  assert(before.AddContentFormat(0));
+  assert(after.AddLocationPath("a"));
+  assert(after.AddLocationPath("bc"));
+  assert(after.AddContentFormat(0));
+
+  Image image(encode(before));
+  assert(image.wire.Insert(Location_Path, "bc"));
+  assert(image.bytes() == encode(after));
+
+  // Set inserts when there is none, first and last too.
+  assert(after.AddETag({ 1, 2 }));
+  assert(image.wire.Set(ETag, (const uint8_t*) "\x01\x02", 2));
+  assert(image.bytes() == encode(after));
+  assert(after.AddIfMatch({}));
+  assert(image.wire.Insert(If_Match, nullptr, 0));
+  assert(image.bytes() == encode(after));
+  assert(after.AddSize1(5));
+  assert(image.wire.InsertUint(Size1, 5));
+  assert(image.bytes() == encode(after));
+}
+
+void test_ok_extended_deltas() {
+  // Uri-Host (3), Proxy-Scheme (39): a 1-byte extended delta, 36, that
+  // goes when Uri-Path (11) comes in between (28 and 8 both extended or
+  // not).  Then Uri-Host goes and Uri-Path's delta gets extended.
+  Options before, middle, after;
+  assert(before.AddUriHost("h"));
+  assert(before.AddProxyScheme("coap"));
+  assert(middle.AddUriHost("h"));
+  assert(middle.AddUriPath("p"));
+  assert(middle.AddProxyScheme("coap"));
+  assert(after.AddUriPath("p"));
+  assert(after.AddProxyScheme("coap"));
+
+  Image image(encode(before));
+  assert(image.wire.Insert(Uri_Path, "p"));
+  assert(image.bytes() == encode(middle));
+  assert(image.wire.Remove(Uri_Host) == 1);
+  assert(image.bytes() == encode(after));
+
+  // Block2 (23) after Uri-Path: delta 12, not extended; 23 once Uri-Path
+  // is gone.
+  Options b2, b2_alone;
+  assert(b2.AddUriPath("p"));
+  assert(b2.AddBlock2(0x16));
+  assert(b2_alone.AddBlock2(0x16));
+  Image image2(encode(b2));
+  assert(image2.wire.Remove(Uri_Path) == 1);
+  assert(image2.bytes() == encode(b2_alone));
+
+  // 2-byte extended deltas and lengths.
+  Options big;
+  assert(big.AddUriPath("p"));
+  assert(big.AddProxyUri(std::string(300, 'x')));
+  assert(big.Add(Tenant, std::string("acme")));
+  Options bigger = big;
+  assert(bigger.Add(No_Response, 2));
+  Image image3(encode(big));
+  assert(image3.wire.InsertUint(No_Response, 2));
+  assert(image3.bytes() == encode(bigger));
+  assert(image3.wire.Remove(No_Response) == 1);
+  assert(image3.bytes() == encode(big));
+}
+
+void test_ok_remove_all() {
+  Options before, after;
+  assert(before.AddUriPath("a"));
+  assert(before.AddUriPath("b"));
+  assert(before.AddUriPath("c"));
+  assert(before.AddUriQuery("q"));
+  assert(after.AddUriQuery("q"));
+
+  Image image(encode(before));
+  assert(image.wire.Remove(Uri_Path) == 3);
+  assert(image.bytes() == encode(after));
+  assert(image.wire.Remove(Uri_Path) == 0);
+
+  // The last one, with no payload after it either.
+  Image image2(encode(after, { 0xAB }, 0x1234, {}));
+  assert(image2.wire.Remove(Uri_Query) == 1);
+  assert(image2.bytes() == encode(Options(), { 0xAB }, 0x1234, {}));
+
+  // And back.
+  assert(image2.wire.Insert(Uri_Query, "q"));
+  assert(image2.bytes() == encode(after, { 0xAB }, 0x1234, {}));
+}
+
+void test_ok_replace_first_of_many() {
+  Options before, after;
+  assert(before.AddLocationPath("a"));
+  assert(before.AddLocationPath("b"));
+  assert(after.AddLocationPath("xyz"));
+  assert(after.AddLocationPath("b"));
+
+  Image image(encode(before));
+  assert(image.wire.Set(Location_Path, "xyz"));
+  assert(image.bytes() == encode(after));
+
+  // The result reads back as it should.
+  PDUView view;
+  assert(view.Decode(image.wire.data(), image.wire.size()));
+  assert(view.payload_size() == 1 && view.payload()[0] == 'p');
+}
+
+void test_ko_edits() {
+  Options opts;
+  assert(opts.AddUriPath("a"));
+  assert(opts.AddMaxAge(60));
+  std::vector<uint8_t> pkt = encode(opts);
+  Image image(pkt, 2);
+
+  assert(!image.wire.Insert(Max_Age, nullptr, 0));         // not repeatable
+  assert(!image.wire.SetUint(Max_Age, 1ULL << 32));        // too long
+  assert(!image.wire.Insert(2, nullptr, 0));               // not known
+  assert(!image.wire.Insert(Uri_Path, "abc"));             // no room
+  assert(!image.wire.set_token((const uint8_t*) "123456789", 9));
+  assert(!image.wire.set_token((const uint8_t*) "1234", 4));
+  assert(image.bytes() == pkt);
+
+  assert(image.wire.Insert(Uri_Path, "b"));                // just fits
+  assert(image.wire.size() == pkt.size() + 2);
+
+  // Not a message.
+  uint8_t junk[] = { 0x40, 0x01, 0x00 };
+  WireImage wire;
+  assert(!wire.Attach(junk, sizeof junk, sizeof junk));
+  assert(!wire.Attach(pkt.data(), pkt.size(), pkt.size() - 1));
+}
+
+int main() {
+  init_log();
+
+  OptionRegistry* R = OptionRegistry::Instance();
+  assert(R->Register({ No_Response, false, "No-Response", OptionFormat::uint,
+                       0, 1, nullptr }));
+  assert(R->Register({ Tenant, false, "Tenant", OptionFormat::string,
+                       1, 16, nullptr }));
+  R->Freeze();
+
+  test_ok_header();
+  test_ok_replace();
+  test_ok_insert();
+  test_ok_extended_deltas();
+  test_ok_remove_all();
+  test_ok_replace_first_of_many();
+  test_ko_edits();
+}
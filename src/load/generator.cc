@@ -0,0 +1,446 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "coap/header.h"
+#include "utils/log.h"
+#include "load/generator.h"
+
+namespace load {
+
+namespace {
+
+const uint32_t kNoSlot = ~0U;
+const uint16_t kGenerationMask = 0xFFF;
+
+uint64_t Now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+}   // namespace
+
+//
+// struct LoadStats
+//
+LoadStats::LoadStats()
+  : sent(0)
+  , completed(0)
+  , success(0)
+  , client_errors(0)
+  , server_errors(0)
+  , timeouts(0)
+  , resets(0)
+  , retransmits(0)
+  , overflows(0)
+  , unexpected(0)
+  , send_errors(0)
+  , elapsed_ns(0)
+{ }
+
+void LoadStats::Merge(const LoadStats& other) {
+  latency.Merge(other.latency);
+  sent += other.sent;
+  completed += other.completed;
+  success += other.success;
+  client_errors += other.client_errors;
+  server_errors += other.server_errors;
+  timeouts += other.timeouts;
+  resets += other.resets;
+  retransmits += other.retransmits;
+  overflows += other.overflows;
+  unexpected += other.unexpected;
+  send_errors += other.send_errors;
+  elapsed_ns = std::max(elapsed_ns, other.elapsed_ns);
+}
+
+//
+// class Worker
+//
+Worker::Worker(const LoadConfig& config, const Mix& mix, uint32_t seed)
+  : config_(config)
+  , mix_(mix)
+  , wheel_(kWheelSize, kNoSlot)
+  , wheel_tick_(Now() / kTickNs)
+  , polling_(0)
+  , now_(0)
+  , random_(seed * 2654435761U + 1) {
+  size_t n = config_.rate > 0 ? config_.max_in_flight : config_.concurrency;
+  n = std::min<size_t>(std::max<size_t>(n, 1), kSlotMask + 1);
+
+  slots_.resize(n);
+  for (size_t i = n; i > 0; --i) {
+    slots_[i - 1].busy = false;
+    slots_[i - 1].generation = 0;
+    free_.push_back(i - 1);
+  }
+}
+
+bool Worker::Open() {
+  size_t n = std::min<size_t>(std::max<size_t>(config_.sockets, 1), 256);
+
+  if (config_.targets.empty()) {
+    utils::Log::Instance()->Debug("no targets");
+    return false;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    // Spread workers and their sockets over the targets.
+    const sockaddr_storage& target =
+        config_.targets[(random_ + i) % config_.targets.size()];
+
+    sockaddr_storage local;
+    socklen_t len;
+    memset(&local, 0, sizeof local);
+    local.ss_family = target.ss_family;
+    len = target.ss_family == AF_INET6 ? sizeof(sockaddr_in6)
+                                       : sizeof(sockaddr_in);
+
+    std::unique_ptr<net::Transport> t =
+        net::NewTransport(net::Backend::epoll);
+    if (!t || !t->Open(reinterpret_cast<sockaddr*>(&local), len))
+      return false;
+
+    sockets_.push_back(std::move(t));
+    targets_.push_back(reinterpret_cast<const sockaddr*>(&target));
+    target_lens_.push_back(len);
+    next_mids_.push_back(Random());
+    mids_.push_back(std::vector<uint32_t>(1 << 16, kNoSlot));
+  }
+
+  return true;
+}
+
+uint32_t Worker::Random() {
+  // xorshift32
+  random_ ^= random_ << 13;
+  random_ ^= random_ >> 17;
+  random_ ^= random_ << 5;
+  return random_;
+}
+
+// Start a request, due at start.
+bool Worker::Send(uint64_t start) {
+  if (free_.empty()) {
+    ++stats_.overflows;
+    return false;
+  }
+
+  uint32_t slot = free_.back();
+  free_.pop_back();
+
+  Slot& s = slots_[slot];
+  s.tmpl = &mix_.Pick(Random());
+  s.start = start;
+  s.deadline = now_ + config_.timeout_ms * 1000000ULL;
+  s.generation = (s.generation + 1) & kGenerationMask;
+  s.socket = stats_.sent % sockets_.size();
+  s.message_id = next_mids_[s.socket]++;
+  s.retransmits = 0;
+  s.busy = true;
+  s.acked = false;
+
+  if (s.tmpl->type == coap::Type::CON) {
+    mids_[s.socket][s.message_id] = slot;
+
+    // ACK_TIMEOUT * [1, ACK_RANDOM_FACTOR)
+    s.rto_ms = config_.ack_timeout_ms +
+               (static_cast<uint64_t>(config_.ack_timeout_ms) *
+                (Random() >> 1)) / 0xFFFFFFFFULL;
+    s.retransmit_at = now_ + s.rto_ms * 1000000ULL;
+  }
+
+  ++stats_.sent;
+  Transmit(slot);
+  Schedule(slot);
+
+  return true;
+}
+
+void Worker::Transmit(uint32_t slot) {
+  const Slot& s = slots_[slot];
+  const std::vector<uint8_t>& wire = s.tmpl->wire;
+
+  memcpy(scratch_, wire.data(), wire.size());
+  Stamp(scratch_, s.message_id, Token(slot, s.generation));
+
+  if (!sockets_[s.socket]->Send(scratch_, wire.size(), targets_[s.socket],
+                                target_lens_[s.socket]))
+    ++stats_.send_errors;
+}
+
+void Worker::Schedule(uint32_t slot) {
+  const Slot& s = slots_[slot];
+  uint64_t when = s.deadline;
+
+  if (s.tmpl->type == coap::Type::CON && !s.acked &&
+      s.retransmits < config_.max_retransmit)
+    when = std::min(when, s.retransmit_at);
+
+  Link(slot, when);
+}
+
+void Worker::Link(uint32_t slot, uint64_t when) {
+  // Not in a bucket already passed, or it would wait a whole turn.
+  uint64_t tick = std::max(when / kTickNs, wheel_tick_);
+  Slot& s = slots_[slot];
+
+  s.timer_at = when;
+  s.bucket = tick & (kWheelSize - 1);
+  s.prev = kNoSlot;
+  s.next = wheel_[s.bucket];
+  if (s.next != kNoSlot)
+    slots_[s.next].prev = slot;
+  wheel_[s.bucket] = slot;
+}
+
+void Worker::Unlink(uint32_t slot) {
+  Slot& s = slots_[slot];
+
+  if (s.prev != kNoSlot)
+    slots_[s.prev].next = s.next;
+  else
+    wheel_[s.bucket] = s.next;
+
+  if (s.next != kNoSlot)
+    slots_[s.next].prev = s.prev;
+}
+
+void Worker::Complete(uint32_t slot, uint64_t now) {
+  stats_.latency.Record(now > slots_[slot].start ? now - slots_[slot].start
+                                                 : 0);
+  ++stats_.completed;
+  Free(slot);
+}
+
+void Worker::Free(uint32_t slot) {
+  Unlink(slot);
+  slots_[slot].busy = false;
+  free_.push_back(slot);
+}
+
+void Worker::FireTimers(uint64_t now) {
+  uint64_t tick = now / kTickNs;
+  uint64_t first = wheel_tick_;
+
+  if (tick - first > kWheelSize)
+    first = tick - kWheelSize;
+
+  for (uint64_t t = first; t < tick; ++t) {
+    uint32_t slot = wheel_[t & (kWheelSize - 1)];
+
+    while (slot != kNoSlot) {
+      Slot& s = slots_[slot];
+      uint32_t next = s.next;
+
+      if (s.timer_at <= now) {
+        if (now >= s.deadline) {
+          ++stats_.timeouts;
+          Free(slot);
+        } else {
+          Unlink(slot);
+          if (s.tmpl->type == coap::Type::CON && !s.acked &&
+              s.retransmits < config_.max_retransmit &&
+              now >= s.retransmit_at) {
+            ++s.retransmits;
+            ++stats_.retransmits;
+            s.rto_ms *= 2;
+            s.retransmit_at = now + s.rto_ms * 1000000ULL;
+            Transmit(slot);
+          }
+          Schedule(slot);
+        }
+      }
+
+      slot = next;
+    }
+  }
+
+  wheel_tick_ = tick;
+}
+
+void Worker::Run(const std::atomic<bool>* stop) {
+  const size_t burst = net::kMaxBatch * sockets_.size();
+  const uint64_t start = Now();
+  const uint64_t end = start + config_.duration_ms * 1000000ULL;
+  const double interval = config_.rate > 0 ? 1e9 / config_.rate : 0;
+  double next_due = start;
+
+  std::vector<pollfd> pfds;
+  for (const auto& socket : sockets_) {
+    pollfd pfd = { socket->fd(), POLLIN, 0 };
+    pfds.push_back(pfd);
+  }
+
+  for (;;) {
+    now_ = Now();
+
+    bool sending = now_ < end && !(stop && *stop);
+    size_t in_flight = slots_.size() - free_.size();
+
+    if (sending) {
+      // In open loop, catch up with what is due, a burst at a time.
+      for (size_t n = 0; n < burst; ++n) {
+        if (interval > 0 ? next_due > now_ : in_flight >= config_.concurrency)
+          break;
+
+        if (Send(interval > 0 ? static_cast<uint64_t>(next_due) : now_))
+          ++in_flight;
+        next_due += interval;
+      }
+    } else {
+      if (stats_.elapsed_ns == 0)
+        stats_.elapsed_ns = now_ - start;
+    }
+
+    for (const auto& socket : sockets_)
+      socket->Flush();
+
+    if (!sending && in_flight == 0)
+      break;
+
+    FireTimers(now_);
+
+    int got = 0;
+    for (polling_ = 0; polling_ < sockets_.size(); ++polling_)
+      got += std::max(0, sockets_[polling_]->Poll(this, 0));
+
+    if (got > 0)
+      continue;
+
+    // Nothing came in: wait for a response, or until something is due.
+    uint64_t wake = sending ? end : now_ + 10000000;
+    if (sending && interval > 0)
+      wake = std::min(wake, static_cast<uint64_t>(next_due));
+    if (slots_.size() > free_.size())
+      wake = std::min(wake, (now_ / kTickNs + 1) * kTickNs);
+
+    now_ = Now();
+    if (wake > now_) {
+      timespec ts = { static_cast<time_t>((wake - now_) / 1000000000),
+                      static_cast<long>((wake - now_) % 1000000000) };
+      ppoll(pfds.data(), pfds.size(), &ts, nullptr);
+    }
+  }
+}
+
+void Worker::OnBatch(const net::Datagram* dgrams, size_t n) {
+  now_ = Now();
+  for (size_t i = 0; i < n; ++i)
+    OnDatagram(dgrams[i]);
+}
+
+void Worker::OnDatagram(const net::Datagram& dgram) {
+  const uint8_t* p = dgram.data;
+
+  if (dgram.size < 4 || (p[0] >> 6) != coap::Version::v1) {
+    ++stats_.unexpected;
+    return;
+  }
+
+  int type = (p[0] >> 4) & 0x03;
+  size_t tkl = p[0] & 0x0F;
+  uint8_t code = p[1];
+  uint16_t mid = coap::HeaderMessageId(p);
+
+  if (code == coap::Code::Empty) {
+    uint32_t slot = mids_[polling_][mid];
+    Slot* s = slot == kNoSlot ? nullptr : &slots_[slot];
+
+    if (!s || !s->busy || s->socket != polling_ || s->message_id != mid ||
+        (type != coap::Type::ACK && type != coap::Type::RST)) {
+      ++stats_.unexpected;
+      return;
+    }
+
+    if (type == coap::Type::RST) {
+      ++stats_.resets;
+      Free(slot);
+    } else {
+      s->acked = true;
+    }
+    return;
+  }
+
+  if (tkl != kTokenLength || dgram.size < 4 + kTokenLength) {
+    ++stats_.unexpected;
+    return;
+  }
+
+  uint32_t token = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+  uint32_t slot = token & kSlotMask;
+
+  if (slot >= slots_.size() || !slots_[slot].busy ||
+      slots_[slot].generation != token >> kSlotBits) {
+    ++stats_.unexpected;
+    return;
+  }
+
+  // Separate response: acknowledge it.
+  if (type == coap::Type::CON) {
+    uint8_t ack[4] = { static_cast<uint8_t>((coap::Version::v1 << 6) |
+                                            (coap::Type::ACK << 4)),
+                       coap::Code::Empty, p[2], p[3] };
+    sockets_[polling_]->Send(ack, sizeof ack, dgram.peer, dgram.peer_len);
+  }
+
+  switch (code >> 5) {
+    case 2: ++stats_.success; break;
+    case 4: ++stats_.client_errors; break;
+    case 5: ++stats_.server_errors; break;
+  }
+
+  Complete(slot, now_);
+}
+
+//
+// class Echo
+//
+void Echo::Run(const std::atomic<bool>& stop) {
+  while (!stop) {
+    transport_->Poll(this, 10);
+    transport_->Flush();
+  }
+}
+
+void Echo::OnDatagram(const net::Datagram& dgram) {
+  const uint8_t* p = dgram.data;
+
+  if (coap::ClassifyEmpty(p, dgram.size) == coap::EmptyKind::ping) {
+    uint8_t rst[4];
+    coap::ResetFor(p, rst);
+    transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+    return;
+  }
+
+  if (dgram.size < 4)
+    return;
+
+  size_t tkl = p[0] & 0x0F;
+  int type = (p[0] >> 4) & 0x03;
+
+  if (dgram.size < 4 + tkl || tkl > 8 ||
+      (p[0] >> 6) != coap::Version::v1 || p[1] == coap::Code::Empty ||
+      p[1] > coap::CodeBlocks::ReqMethodMax ||
+      (type != coap::Type::CON && type != coap::Type::NON))
+    return;
+
+  uint8_t rsp[4 + 8];
+  rsp[0] = (coap::Version::v1 << 6) |
+           ((type == coap::Type::CON ? coap::Type::ACK : coap::Type::NON) << 4) |
+           tkl;
+  rsp[1] = coap::Code::Content;
+  rsp[2] = p[2];
+  rsp[3] = p[3];
+  memcpy(rsp + 4, p + 4, tkl);
+
+  transport_->Send(rsp, 4 + tkl, dgram.peer, dgram.peer_len);
+}
+
+}   // namespace load
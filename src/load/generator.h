@@ -0,0 +1,193 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef LOAD_GENERATOR_H_
+#define LOAD_GENERATOR_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "net/transport.h"
+#include "utils/histogram.h"
+#include "load/mix.h"
+
+namespace load {
+
+struct LoadConfig {
+  // Servers, spread over the sockets.
+  std::vector<sockaddr_storage> targets;
+
+  size_t sockets;             // per worker
+
+  // Open loop: send rate requests/s whatever happens to the previous
+  // ones.  Closed loop (rate 0): keep concurrency requests in flight.
+  double rate;
+  size_t concurrency;
+
+  uint64_t duration_ms;
+
+  // A request that has no response after timeout_ms is given up on.
+  // CONs are retransmitted after ack_timeout_ms (randomised as in RFC
+  // 7252, 4.2), doubling each time, up to max_retransmit times.
+  uint32_t timeout_ms;
+  uint32_t ack_timeout_ms;
+  unsigned max_retransmit;
+
+  // Most requests in flight in open loop.  Requests that would go
+  // beyond are not sent, and counted as overflows.
+  size_t max_in_flight;
+};
+
+const LoadConfig kDefaultLoadConfig = {
+  {}, 1, 0, 64, 10000, 5000, 2000, 4, 65536
+};
+
+struct LoadStats {
+  LoadStats();
+
+  void Merge(const LoadStats& other);
+
+  // Request start to response.  In open loop a request starts when it
+  // was due, not when it was sent, so that a stalled generator or
+  // server shows up in the latencies rather than in fewer samples.
+  utils::Histogram latency;
+
+  uint64_t sent;              // requests, not counting retransmissions
+  uint64_t completed;         // with a response
+  uint64_t success;           // 2.xx
+  uint64_t client_errors;     // 4.xx
+  uint64_t server_errors;     // 5.xx
+  uint64_t timeouts;
+  uint64_t resets;            // RST from the server
+  uint64_t retransmits;
+  uint64_t overflows;         // not sent: too many in flight
+  uint64_t unexpected;        // datagrams matching no request
+  uint64_t send_errors;
+  uint64_t elapsed_ns;        // sending time
+};
+
+// One load generating thread: sends requests from mix to the targets
+// over its own sockets, and times the responses.
+//
+// Requests are matched to responses by token, which holds the index
+// of the request's slot and a generation number, and to empty ACKs and
+// RSTs by message ID.  Sockets are net::Transports, so sends and
+// receives go in batches, and the clock is read once per batch.
+//
+// Message IDs go round per socket: at high rates they come back well
+// within EXCHANGE_LIFETIME, and a server that deduplicates will take
+// fresh requests for retransmissions.  Use more sockets.
+class Worker : public net::Handler {
+ public:
+  Worker(const LoadConfig& config, const Mix& mix, uint32_t seed);
+
+  // Open the sockets (bound to an ephemeral port).
+  bool Open();
+
+  // Generate load for config.duration_ms, or until *stop, then wait
+  // for the requests in flight to complete or time out.
+  void Run(const std::atomic<bool>* stop = nullptr);
+
+  const LoadStats& stats() const { return stats_; }
+
+  void OnBatch(const net::Datagram* dgrams, size_t n);
+  void OnDatagram(const net::Datagram& dgram);
+
+ private:
+  struct Slot {
+    uint64_t start;           // ns
+    uint64_t deadline;
+    uint64_t retransmit_at;
+    uint32_t rto_ms;
+    uint16_t generation;
+    uint16_t message_id;
+    uint8_t socket;
+    uint8_t retransmits;
+    bool busy;
+    bool acked;               // empty ACK seen: stop retransmitting
+    const Template* tmpl;
+
+    // Timer wheel bucket list
+    uint64_t timer_at;
+    uint32_t bucket;
+    uint32_t next;
+    uint32_t prev;
+  };
+
+  bool Send(uint64_t start);
+  void Transmit(uint32_t slot);
+  void Complete(uint32_t slot, uint64_t now);
+  void Free(uint32_t slot);
+  void FireTimers(uint64_t now);
+  void Schedule(uint32_t slot);
+  void Link(uint32_t slot, uint64_t when);
+  void Unlink(uint32_t slot);
+  uint32_t Random();
+
+  static uint32_t Token(uint32_t slot, uint16_t generation) {
+    return (static_cast<uint32_t>(generation) << kSlotBits) | slot;
+  }
+
+ private:
+  // Token: generation in the high bits, slot in the low ones.
+  static constexpr unsigned kSlotBits = 20;
+  static constexpr uint32_t kSlotMask = (1 << kSlotBits) - 1;
+
+  // Timer wheel: 1 ms ticks, 8192 buckets.  A bucket is looked at
+  // once its tick is over, so timers fire up to 1 ms late; those
+  // further out than a turn wait in their bucket for the next one.
+  static constexpr uint64_t kTickNs = 1000000;
+  static constexpr size_t kWheelSize = 8192;
+
+  const LoadConfig config_;
+  const Mix& mix_;
+
+  std::vector<std::unique_ptr<net::Transport>> sockets_;
+  std::vector<const sockaddr*> targets_;      // per socket
+  std::vector<socklen_t> target_lens_;
+  std::vector<uint16_t> next_mids_;
+
+  // Slot of the CON last sent with each message ID, per socket.
+  std::vector<std::vector<uint32_t>> mids_;
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_;
+
+  // Each request in flight has one timer, for its next retransmission
+  // or its deadline.  At a million requests a second a heap with lazy
+  // deletion (see client::Client) would hold millions of stale
+  // entries; slots are linked in and out of the wheel instead.
+  std::vector<uint32_t> wheel_;
+  uint64_t wheel_tick_;
+
+  size_t polling_;            // socket being polled
+  uint64_t now_;              // ns, as of the current batch
+  uint32_t random_;
+
+  uint8_t scratch_[net::kMaxDatagramSize];
+
+  LoadStats stats_;
+};
+
+// Answers every request with a piggybacked (CON) or NON 2.05 echoing
+// the token, with no options or payload: a server that costs as little
+// as possible, to measure the generator itself.
+class Echo : public net::Handler {
+ public:
+  explicit Echo(net::Transport* transport) : transport_(transport) { }
+
+  // Serve until *stop.
+  void Run(const std::atomic<bool>& stop);
+
+  void OnDatagram(const net::Datagram& dgram);
+
+ private:
+  net::Transport* transport_;
+};
+
+}   // namespace load
+
+#endif  // LOAD_GENERATOR_H_
@@ -0,0 +1,269 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstring>
+#include <atomic>
+#include <set>
+#include <thread>
+#include "coap/header.h"
+#include "utils/log.h"
+#include "load/generator.h"
+
+using namespace load;
+
+void init_log() {
+  utils::Log::Instance()->Open("generator_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// A server on loopback, run in its own thread.
+struct Server : public net::Handler {
+  enum class Mode {
+    echo,         // load::Echo
+    lossy,        // ignores the first transmission of each message
+    reset,        // RSTs everything
+    separate,     // empty ACK, then a separate CON response
+    silent        // never answers
+  };
+
+  explicit Server(Mode mode)
+    : mode(mode)
+    , transport(net::NewTransport(net::Backend::epoll))
+    , echo(transport.get())
+    , acks(0)
+    , stop(false) {
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(transport->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+
+    socklen_t len = sizeof addr;
+    assert(getsockname(transport->fd(), reinterpret_cast<sockaddr*>(&addr),
+                       &len) == 0);
+
+    thread = std::thread([this] {
+      while (!stop) {
+        transport->Poll(this, 5);
+        transport->Flush();
+      }
+    });
+  }
+
+  ~Server() {
+    stop = true;
+    thread.join();
+  }
+
+  void OnDatagram(const net::Datagram& dgram) {
+    const uint8_t* p = dgram.data;
+    uint16_t mid = coap::HeaderMessageId(p);
+
+    switch (mode) {
+      case Mode::echo:
+        echo.OnDatagram(dgram);
+        break;
+
+      case Mode::lossy:
+        if (seen.insert(mid).second)
+          return;
+        echo.OnDatagram(dgram);
+        break;
+
+      case Mode::reset: {
+        uint8_t rst[4] = { 0x70, 0, p[2], p[3] };
+        transport->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+        break;
+      }
+
+      case Mode::separate: {
+        if (p[1] == coap::Code::Empty) {
+          ++acks;
+          return;
+        }
+        uint8_t ack[4] = { 0x60, 0, p[2], p[3] };
+        transport->Send(ack, sizeof ack, dgram.peer, dgram.peer_len);
+
+        size_t tkl = p[0] & 0x0F;
+        uint8_t rsp[4 + 8] = { uint8_t(0x40 | tkl), coap::Code::Content,
+                               uint8_t(~p[2]), p[3] };
+        memcpy(rsp + 4, p + 4, tkl);
+        transport->Send(rsp, 4 + tkl, dgram.peer, dgram.peer_len);
+        break;
+      }
+
+      case Mode::silent:
+        break;
+    }
+  }
+
+  sockaddr_storage target() const {
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof ss);
+    memcpy(&ss, &addr, sizeof addr);
+    return ss;
+  }
+
+  Mode mode;
+  std::unique_ptr<net::Transport> transport;
+  Echo echo;
+  std::set<uint16_t> seen;
+  std::atomic<size_t> acks;
+  sockaddr_in addr;
+  std::atomic<bool> stop;
+  std::thread thread;
+};
+
+LoadConfig config_for(const Server& server) {
+  LoadConfig config = kDefaultLoadConfig;
+  config.targets.push_back(server.target());
+  config.duration_ms = 200;
+  config.concurrency = 8;
+  config.timeout_ms = 500;
+  config.ack_timeout_ms = 20;
+  return config;
+}
+
+Mix default_mix() {
+  Mix mix;
+  assert(mix.Init(kDefaultMixSpec));
+  return mix;
+}
+
+void test_ok_closed_loop() {
+  Server server(Server::Mode::echo);
+  LoadConfig config = config_for(server);
+  config.sockets = 3;
+  Mix mix = default_mix();
+
+  Worker worker(config, mix, 1);
+  assert(worker.Open());
+  worker.Run();
+
+  const LoadStats& stats = worker.stats();
+  assert(stats.sent > 0);
+  assert(stats.completed == stats.sent);
+  assert(stats.success == stats.sent);
+  assert(stats.latency.count() == stats.completed);
+  assert(stats.timeouts == 0 && stats.retransmits == 0);
+  assert(stats.unexpected == 0 && stats.overflows == 0);
+  assert(stats.elapsed_ns >= 200000000);
+}
+
+void test_ok_open_loop() {
+  Server server(Server::Mode::echo);
+  LoadConfig config = config_for(server);
+  config.rate = 2000;
+  config.duration_ms = 250;
+
+  MixSpec spec = { "GET,POST:2", "a,b/c", "0,64", 0.5 };
+  Mix mix;
+  assert(mix.Init(spec));
+
+  Worker worker(config, mix, 2);
+  assert(worker.Open());
+  worker.Run();
+
+  // 500 due in the 250 ms.
+  const LoadStats& stats = worker.stats();
+  assert(stats.sent >= 495 && stats.sent <= 501);
+  assert(stats.completed == stats.sent);
+  assert(stats.timeouts == 0);
+}
+
+void test_ok_retransmit() {
+  Server server(Server::Mode::lossy);
+  LoadConfig config = config_for(server);
+  config.duration_ms = 100;
+  Mix mix = default_mix();
+
+  Worker worker(config, mix, 3);
+  assert(worker.Open());
+  worker.Run();
+
+  // Every request is answered on its first retransmission.
+  const LoadStats& stats = worker.stats();
+  assert(stats.sent > 0);
+  assert(stats.retransmits == stats.sent);
+  assert(stats.completed == stats.sent);
+  assert(stats.latency.min() >= 20000000);
+}
+
+void test_ok_timeout() {
+  Server server(Server::Mode::silent);
+  LoadConfig config = config_for(server);
+  config.duration_ms = 50;
+  config.timeout_ms = 100;
+  config.max_retransmit = 2;
+
+  Mix mix = default_mix();
+
+  Worker worker(config, mix, 4);
+  assert(worker.Open());
+  worker.Run();
+
+  // Retransmitted twice (after 20-30 and 40-60 ms more), then given up.
+  const LoadStats& stats = worker.stats();
+  assert(stats.sent == config.concurrency);
+  assert(stats.timeouts == stats.sent);
+  assert(stats.retransmits == 2 * stats.sent);
+  assert(stats.completed == 0);
+}
+
+void test_ok_reset() {
+  Server server(Server::Mode::reset);
+  LoadConfig config = config_for(server);
+  config.duration_ms = 50;
+  Mix mix = default_mix();
+
+  Worker worker(config, mix, 5);
+  assert(worker.Open());
+  worker.Run();
+
+  const LoadStats& stats = worker.stats();
+  assert(stats.sent > 0);
+  assert(stats.resets == stats.sent);
+  assert(stats.completed == 0 && stats.timeouts == 0);
+}
+
+void test_ok_separate_response() {
+  Server server(Server::Mode::separate);
+  LoadConfig config = config_for(server);
+  config.duration_ms = 50;
+  Mix mix = default_mix();
+
+  Worker worker(config, mix, 6);
+  assert(worker.Open());
+  worker.Run();
+
+  const LoadStats& stats = worker.stats();
+  assert(stats.sent > 0);
+  assert(stats.completed == stats.sent);
+  assert(stats.retransmits == 0);
+
+  // The CON responses were acknowledged.
+  for (int i = 0; i < 100 && server.acks < stats.sent; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  assert(server.acks == stats.sent);
+}
+
+void test_ko_open() {
+  LoadConfig config = kDefaultLoadConfig;
+  Mix mix = default_mix();
+  Worker worker(config, mix, 7);
+  assert(!worker.Open());
+}
+
+int main() {
+  init_log();
+
+  test_ok_closed_loop();
+  test_ok_open_loop();
+  test_ok_retransmit();
+  test_ok_timeout();
+  test_ok_reset();
+  test_ok_separate_response();
+  test_ko_open();
+}
@@ -0,0 +1,243 @@
+// Copyleft 2013 tho@autistici.org
+
+// CoAP load generator.
+//
+//   loadgen [options] HOST:PORT...
+//
+//   --threads N          worker threads, each with its own sockets (1)
+//   --sockets N          sockets per thread (1)
+//   --rate R             open loop: R requests/s in all
+//   --concurrency C      closed loop: C requests in flight per thread (64)
+//   --duration S         seconds of load (10)
+//   --methods LIST       e.g. GET:8,POST:1,PUT:1 (GET)
+//   --paths LIST         e.g. sensors/temp:3,actuators/led (none)
+//   --payloads LIST      payload sizes, e.g. 0:9,512:1 (0)
+//   --con RATIO          share of confirmable requests (1)
+//   --timeout-ms MS      give up on a request after MS (5000)
+//   --ack-timeout-ms MS  first CON retransmission after MS (2000)
+//   --max-retransmit N   (4)
+//   --echo N             also load N echo servers run in this process
+//                        on loopback, to measure the generator itself
+//
+// IPv6 addresses go in brackets: [::1]:5683.
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils/log.h"
+#include "load/generator.h"
+
+namespace {
+
+void Usage() {
+  fprintf(stderr,
+          "usage: loadgen [--threads N] [--sockets N] [--rate R | "
+          "--concurrency C]\n"
+          "               [--duration S] [--methods LIST] [--paths LIST] "
+          "[--payloads LIST]\n"
+          "               [--con RATIO] [--timeout-ms MS] "
+          "[--ack-timeout-ms MS]\n"
+          "               [--max-retransmit N] [--echo N] HOST:PORT...\n");
+  exit(2);
+}
+
+bool Resolve(const std::string& target, sockaddr_storage& addr) {
+  size_t colon = target.rfind(':');
+  if (colon == std::string::npos)
+    return false;
+
+  std::string host = target.substr(0, colon);
+  std::string port = target.substr(colon + 1);
+  if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICSERV;
+
+  addrinfo* res;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+    return false;
+
+  memset(&addr, 0, sizeof addr);
+  memcpy(&addr, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+
+  return true;
+}
+
+struct EchoServer {
+  std::unique_ptr<net::Transport> transport;
+  std::unique_ptr<load::Echo> echo;
+  std::thread thread;
+};
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  load::LoadConfig config = load::kDefaultLoadConfig;
+  load::MixSpec spec = load::kDefaultMixSpec;
+  size_t threads = 1, echoes = 0;
+  double rate = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg.compare(0, 2, "--") != 0) {
+      sockaddr_storage addr;
+      if (!Resolve(arg, addr)) {
+        fprintf(stderr, "can't resolve %s\n", arg.c_str());
+        return 1;
+      }
+      config.targets.push_back(addr);
+      continue;
+    }
+
+    if (i + 1 == argc)
+      Usage();
+    const char* value = argv[++i];
+
+    if (arg == "--threads")
+      threads = strtoul(value, nullptr, 10);
+    else if (arg == "--sockets")
+      config.sockets = strtoul(value, nullptr, 10);
+    else if (arg == "--rate")
+      rate = strtod(value, nullptr);
+    else if (arg == "--concurrency")
+      config.concurrency = strtoul(value, nullptr, 10);
+    else if (arg == "--duration")
+      config.duration_ms = strtod(value, nullptr) * 1000;
+    else if (arg == "--methods")
+      spec.methods = value;
+    else if (arg == "--paths")
+      spec.paths = value;
+    else if (arg == "--payloads")
+      spec.payloads = value;
+    else if (arg == "--con")
+      spec.con_ratio = strtod(value, nullptr);
+    else if (arg == "--timeout-ms")
+      config.timeout_ms = strtoul(value, nullptr, 10);
+    else if (arg == "--ack-timeout-ms")
+      config.ack_timeout_ms = strtoul(value, nullptr, 10);
+    else if (arg == "--max-retransmit")
+      config.max_retransmit = strtoul(value, nullptr, 10);
+    else if (arg == "--echo")
+      echoes = strtoul(value, nullptr, 10);
+    else
+      Usage();
+  }
+
+  if (threads == 0 || (config.targets.empty() && echoes == 0))
+    Usage();
+
+  utils::Log::Instance()->Open("loadgen", LOG_PERROR, LOG_USER);
+
+  load::Mix mix;
+  if (!mix.Init(spec)) {
+    fprintf(stderr, "bad request mix\n");
+    return 1;
+  }
+
+  std::atomic<bool> stop(false);
+  std::vector<std::unique_ptr<EchoServer>> servers;
+
+  for (size_t i = 0; i < echoes; ++i) {
+    std::unique_ptr<EchoServer> server(new EchoServer);
+    server->transport = net::NewTransport(net::Backend::any);
+
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof sin;
+
+    if (!server->transport->Open(reinterpret_cast<sockaddr*>(&sin),
+                                 sizeof sin) ||
+        getsockname(server->transport->fd(),
+                    reinterpret_cast<sockaddr*>(&sin), &len) == -1) {
+      fprintf(stderr, "can't start echo server\n");
+      return 1;
+    }
+
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof addr);
+    memcpy(&addr, &sin, sizeof sin);
+    config.targets.push_back(addr);
+
+    server->echo.reset(new load::Echo(server->transport.get()));
+    EchoServer* s = server.get();
+    server->thread = std::thread([s, &stop] { s->echo->Run(stop); });
+    servers.push_back(std::move(server));
+  }
+
+  config.rate = rate / threads;
+
+  std::vector<std::unique_ptr<load::Worker>> workers;
+  for (size_t i = 0; i < threads; ++i) {
+    workers.push_back(std::unique_ptr<load::Worker>(
+        new load::Worker(config, mix, i)));
+    if (!workers.back()->Open()) {
+      fprintf(stderr, "can't open sockets\n");
+      return 1;
+    }
+  }
+
+  std::vector<std::thread> running;
+  for (auto& worker : workers) {
+    load::Worker* w = worker.get();
+    running.push_back(std::thread([w] { w->Run(); }));
+  }
+  for (auto& t : running)
+    t.join();
+
+  stop = true;
+  for (auto& server : servers)
+    server->thread.join();
+
+  load::LoadStats stats;
+  for (auto& worker : workers)
+    stats.Merge(worker->stats());
+
+  double elapsed = stats.elapsed_ns / 1e9;
+
+  if (rate > 0)
+    printf("load:        open loop, %.0f requests/s", rate);
+  else
+    printf("load:        closed loop, %zu in flight",
+           threads * config.concurrency);
+  printf(" from %zu thread(s) x %zu socket(s), %zu kind(s) of requests\n",
+         threads, config.sockets, mix.templates().size());
+
+  printf("sent:        %llu in %.3f s (%.0f requests/s)\n",
+         static_cast<unsigned long long>(stats.sent), elapsed,
+         stats.sent / elapsed);
+  printf("completed:   %llu (%.0f/s): %llu 2.xx, %llu 4.xx, %llu 5.xx\n",
+         static_cast<unsigned long long>(stats.completed),
+         stats.completed / elapsed,
+         static_cast<unsigned long long>(stats.success),
+         static_cast<unsigned long long>(stats.client_errors),
+         static_cast<unsigned long long>(stats.server_errors));
+  printf("failed:      %llu timeouts, %llu resets\n",
+         static_cast<unsigned long long>(stats.timeouts),
+         static_cast<unsigned long long>(stats.resets));
+  printf("other:       %llu retransmits, %llu overflows, %llu unexpected, "
+         "%llu send errors\n",
+         static_cast<unsigned long long>(stats.retransmits),
+         static_cast<unsigned long long>(stats.overflows),
+         static_cast<unsigned long long>(stats.unexpected),
+         static_cast<unsigned long long>(stats.send_errors));
+  stats.latency.Print(stdout, "latency", 1000, "us");
+
+  return 0;
+}
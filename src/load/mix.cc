@@ -0,0 +1,179 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <stdlib.h>
+
+#include <utility>
+
+#include "coap/options.h"
+#include "coap/pdu.h"
+#include "utils/log.h"
+#include "load/mix.h"
+
+namespace load {
+
+namespace {
+
+// Split "a:3,b,c:0.5" into (entry, weight) pairs.
+bool ParseList(const std::string& list,
+               std::vector<std::pair<std::string, double>>& out) {
+  size_t start = 0;
+
+  while (start <= list.size()) {
+    size_t comma = list.find(',', start);
+    if (comma == std::string::npos)
+      comma = list.size();
+
+    std::string entry = list.substr(start, comma - start);
+    double weight = 1;
+
+    size_t colon = entry.rfind(':');
+    if (colon != std::string::npos) {
+      const char* w = entry.c_str() + colon + 1;
+      char* end;
+      weight = strtod(w, &end);
+      if (*w == '\0' || *end != '\0' || weight < 0) {
+        utils::Log::Instance()->Debug("bad weight in '%s'", entry.c_str());
+        return false;
+      }
+      entry.resize(colon);
+    }
+
+    out.push_back(std::make_pair(entry, weight));
+    start = comma + 1;
+  }
+
+  return true;
+}
+
+bool ParseMethod(const std::string& name, coap::Code& code) {
+  if (name == "GET")
+    code = coap::Code::GET;
+  else if (name == "POST")
+    code = coap::Code::POST;
+  else if (name == "PUT")
+    code = coap::Code::PUT;
+  else if (name == "DELETE")
+    code = coap::Code::DELETE;
+  else
+    return false;
+
+  return true;
+}
+
+bool AddPath(const std::string& path, coap::Options& opts) {
+  size_t start = 0;
+
+  while (!path.empty() && start <= path.size()) {
+    size_t slash = path.find('/', start);
+    if (slash == std::string::npos)
+      slash = path.size();
+    if (!opts.AddUriPath(path.substr(start, slash - start)))
+      return false;
+    start = slash + 1;
+  }
+
+  return true;
+}
+
+}   // namespace
+
+bool Mix::Init(const MixSpec& spec) {
+  utils::Log* L = utils::Log::Instance();
+
+  std::vector<std::pair<std::string, double>> methods, paths, payloads;
+
+  if (!ParseList(spec.methods, methods) || !ParseList(spec.paths, paths) ||
+      !ParseList(spec.payloads, payloads))
+    return false;
+
+  if (spec.con_ratio < 0 || spec.con_ratio > 1) {
+    L->Debug("CON ratio %f not in [0, 1]", spec.con_ratio);
+    return false;
+  }
+
+  std::vector<std::pair<coap::Type, double>> types;
+  if (spec.con_ratio > 0)
+    types.push_back(std::make_pair(coap::Type::CON, spec.con_ratio));
+  if (spec.con_ratio < 1)
+    types.push_back(std::make_pair(coap::Type::NON, 1 - spec.con_ratio));
+
+  templates_.clear();
+  picks_.clear();
+
+  double total = 0;
+
+  for (const auto& method : methods) {
+    coap::Code code;
+    if (!ParseMethod(method.first, code)) {
+      L->Debug("unknown method '%s'", method.first.c_str());
+      return false;
+    }
+
+    for (const auto& path : paths) {
+      coap::Options opts;
+      if (!AddPath(path.first, opts)) {
+        L->Debug("bad path '%s'", path.first.c_str());
+        return false;
+      }
+
+      for (const auto& payload : payloads) {
+        char* end;
+        size_t size = strtoul(payload.first.c_str(), &end, 10);
+        if (payload.first.empty() || *end != '\0') {
+          L->Debug("bad payload size '%s'", payload.first.c_str());
+          return false;
+        }
+
+        for (const auto& type : types) {
+          Template t;
+          t.code = code;
+          t.type = type.first;
+          t.path = path.first;
+          t.payload_size = size;
+          t.weight = method.second * path.second * payload.second *
+                     type.second;
+
+          coap::PDU pdu;
+          pdu.set_type(t.type);
+          pdu.set_code(t.code);
+          pdu.set_token(std::vector<uint8_t>(kTokenLength, 0));
+          pdu.set_options(opts);
+          pdu.set_payload(std::vector<uint8_t>(size, 'x'));
+
+          if (!pdu.Encode(t.wire)) {
+            L->Debug("can't encode %s /%s with %zu bytes of payload",
+                     method.first.c_str(), path.first.c_str(), size);
+            return false;
+          }
+
+          if (t.weight > 0) {
+            templates_.push_back(t);
+            total += t.weight;
+          }
+        }
+      }
+    }
+  }
+
+  if (templates_.empty() || templates_.size() > kPicks) {
+    L->Debug("%zu kinds of requests: need 1 to %zu", templates_.size(),
+             kPicks);
+    return false;
+  }
+
+  // Slot i goes to the template whose share of the cumulative weight
+  // covers the middle of the slot.
+  size_t t = 0;
+  double cumulative = templates_[0].weight;
+
+  for (size_t i = 0; i < kPicks; ++i) {
+    double mid = (i + 0.5) * total / kPicks;
+    while (cumulative < mid && t + 1 < templates_.size())
+      cumulative += templates_[++t].weight;
+    picks_.push_back(t);
+  }
+
+  return true;
+}
+
+}   // namespace load
@@ -0,0 +1,86 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef LOAD_MIX_H_
+#define LOAD_MIX_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "coap/proto.h"
+
+namespace load {
+
+// Requests carry a token of this many bytes, which the generator
+// rewrites for each request.
+const size_t kTokenLength = 4;
+
+// What requests look like.  Each list is comma separated, with an
+// optional ":weight" after each entry (1 by default):
+//
+//   methods   "GET:8,POST:1,PUT:1"
+//   paths     "sensors/temp:3,actuators/led"   (Uri-Path segments)
+//   payloads  "0:9,1024:1"                     (payload bytes)
+//
+// and con_ratio is the share of confirmable requests, in [0, 1].
+struct MixSpec {
+  std::string methods;
+  std::string paths;
+  std::string payloads;
+  double con_ratio;
+};
+
+const MixSpec kDefaultMixSpec = { "GET", "", "0", 1.0 };
+
+// A request, encoded once with coap::PDU: message ID and token are
+// placeholders (bytes 2-3 and 4-7 of wire).
+struct Template {
+  std::vector<uint8_t> wire;
+  coap::Code code;
+  coap::Type type;
+  std::string path;
+  size_t payload_size;
+  double weight;
+};
+
+// The request mix: every combination of method, path, payload size and
+// type, encoded up front, so that generating a request is a pick from
+// a table and two patches.
+class Mix {
+ public:
+  Mix() { }
+
+  // Return false (and log why) if spec doesn't parse, or a request
+  // doesn't encode.
+  bool Init(const MixSpec& spec);
+
+  // A template picked according to the weights, from a random number.
+  const Template& Pick(uint32_t r) const {
+    return templates_[picks_[r & (kPicks - 1)]];
+  }
+
+  const std::vector<Template>& templates() const { return templates_; }
+
+ private:
+  // Resolution of the weights: a template with weight w is picked
+  // about w * kPicks times in kPicks.
+  static const size_t kPicks = 4096;
+
+  std::vector<Template> templates_;
+  std::vector<uint16_t> picks_;
+};
+
+// Fill in message ID and token of a copy of Template::wire.
+inline void Stamp(uint8_t* wire, uint16_t message_id, uint32_t token) {
+  wire[2] = message_id >> 8;
+  wire[3] = message_id;
+  wire[4] = token >> 24;
+  wire[5] = token >> 16;
+  wire[6] = token >> 8;
+  wire[7] = token;
+}
+
+}   // namespace load
+
+#endif  // LOAD_MIX_H_
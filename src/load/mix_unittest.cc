@@ -0,0 +1,103 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <map>
+#include <string>
+#include <vector>
+#include "coap/pdu.h"
+#include "utils/log.h"
+#include "load/mix.h"
+
+using namespace load;
+
+void init_log() {
+  utils::Log::Instance()->Open("mix_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+void test_ok_default() {
+  Mix mix;
+  assert(mix.Init(kDefaultMixSpec));
+  assert(mix.templates().size() == 1);
+
+  const Template& t = mix.Pick(12345);
+  assert(t.code == coap::Code::GET && t.type == coap::Type::CON);
+  assert(t.wire.size() == 4 + kTokenLength);
+}
+
+void test_ok_templates_decode() {
+  MixSpec spec = { "GET,POST", "sensors/temp,a", "0,100", 0.5 };
+  Mix mix;
+  assert(mix.Init(spec));
+  assert(mix.templates().size() == 2 * 2 * 2 * 2);
+
+  for (const Template& t : mix.templates()) {
+    std::vector<uint8_t> wire = t.wire;
+    Stamp(wire.data(), 0xBEEF, 0x01020304);
+
+    coap::PDU pdu;
+    assert(pdu.Decode(wire));
+    assert(pdu.code() == t.code);
+    assert(pdu.type() == t.type);
+    assert(pdu.message_id() == 0xBEEF);
+    assert((pdu.token() == std::vector<uint8_t>{ 1, 2, 3, 4 }));
+    assert(pdu.payload().size() == t.payload_size);
+  }
+}
+
+void test_ok_weights() {
+  MixSpec spec = { "GET:3,PUT:1", "", "0", 0.25 };
+  Mix mix;
+  assert(mix.Init(spec));
+
+  std::map<std::pair<int, int>, size_t> seen;
+  for (uint32_t r = 0; r < 4096; ++r) {
+    const Template& t = mix.Pick(r);
+    ++seen[std::make_pair(t.code, t.type)];
+  }
+
+  // 3/4 GET, 1/4 CON, exactly to within a pick.
+  auto near = [](size_t n, size_t expected) {
+    return n + 1 >= expected && n <= expected + 1;
+  };
+  assert(near(seen[std::make_pair(coap::Code::GET, coap::Type::CON)], 768));
+  assert(near(seen[std::make_pair(coap::Code::GET, coap::Type::NON)], 2304));
+  assert(near(seen[std::make_pair(coap::Code::PUT, coap::Type::CON)], 256));
+  assert(near(seen[std::make_pair(coap::Code::PUT, coap::Type::NON)], 768));
+}
+
+void test_ok_zero_weight() {
+  MixSpec spec = { "GET:1,DELETE:0", "", "0", 1 };
+  Mix mix;
+  assert(mix.Init(spec));
+  assert(mix.templates().size() == 1);
+  assert(mix.templates()[0].code == coap::Code::GET);
+}
+
+void test_ko_spec() {
+  Mix mix;
+  MixSpec specs[] = {
+    { "FETCH", "", "0", 1 },          // not supported
+    { "GET:x", "", "0", 1 },
+    { "GET:-1", "", "0", 1 },
+    { "GET", "", "", 1 },
+    { "GET", "", "12b", 1 },
+    { "GET", "", "2000", 1 },         // doesn't fit a datagram
+    { "GET", "", "0", 1.5 },
+    { "GET:0", "", "0", 1 },          // nothing to send
+  };
+
+  for (const MixSpec& spec : specs)
+    assert(!mix.Init(spec));
+}
+
+int main() {
+  init_log();
+
+  test_ok_default();
+  test_ok_templates_decode();
+  test_ok_weights();
+  test_ok_zero_weight();
+  test_ko_spec();
+}
@@ -4,8 +4,13 @@ unittest: $(UNITTESTS)
 		do ./$$f && echo "$$f: OK" || echo "$$f: KO"; \
 	done
 
+bench: $(BENCHMARKS)
+	@for f in $(BENCHMARKS) ; \
+		do ./$$f ; \
+	done
+
 clean: ; $(RM) $(CLEANFILES)
 
 lint: ; cpplint.py $(CPPLINT_FLAGS) $(wildcard *.cc) $(wildcard *.h)
 
-.PHONY: clean lint
+.PHONY: unittest bench clean lint
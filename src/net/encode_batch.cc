@@ -0,0 +1,100 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <errno.h>
+#include <string.h>
+#include "utils/log.h"
+#include "net/encode_batch.h"
+
+namespace net {
+
+EncodeBatch::EncodeBatch(size_t max_messages, size_t max_size)
+  : max_size_(max_size)
+  , msgs_(max_messages)
+  , iov_(max_messages)
+  , peers_(max_messages)
+  , count_(0)
+  , oversize_(0) {
+  slab_.reserve(max_messages * max_size);
+
+  memset(msgs_.data(), 0, msgs_.size() * sizeof msgs_[0]);
+  for (size_t i = 0; i < max_messages; ++i) {
+    msgs_[i].msg_hdr.msg_iov = &iov_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+    msgs_[i].msg_hdr.msg_name = &peers_[i];
+  }
+}
+
+Encoded EncodeBatch::Add(const coap::PDU& pdu, const sockaddr* peer,
+                         socklen_t peer_len) {
+  utils::Log* L = utils::Log::Instance();
+
+  if (peer_len > sizeof(sockaddr_storage)) {
+    L->Debug("peer address too long (%u)", peer_len);
+    return Encoded::failed;
+  }
+
+  // With room for a whole max_size message left, the slab never moves
+  // under the iovecs of those already in (if this one turns out bigger
+  // than that, it is taken out again).
+  if (count_ == msgs_.size() || slab_.capacity() - slab_.size() < max_size_)
+    return Encoded::full;
+
+  size_t start = slab_.size();
+  const uint8_t* base = slab_.data();
+
+  bool encoded = pdu.Encode(slab_);
+  size_t size = slab_.size() - start;
+
+  if (!encoded || size > max_size_) {
+    slab_.resize(start);
+    if (slab_.data() != base) {
+      // It made the slab grow: the others moved with it.
+      for (size_t i = 0; i < count_; ++i)
+        iov_[i].iov_base = slab_.data() + (static_cast<uint8_t*>(
+            iov_[i].iov_base) - base);
+    }
+    if (!encoded)
+      return Encoded::failed;
+    L->Debug("response of %zu bytes over the %zu limit", size, max_size_);
+    ++oversize_;
+    return Encoded::oversize;
+  }
+
+  iov_[count_].iov_base = slab_.data() + start;
+  iov_[count_].iov_len = size;
+  memcpy(&peers_[count_], peer, peer_len);
+  msgs_[count_].msg_hdr.msg_namelen = peer_len;
+  ++count_;
+
+  return Encoded::ok;
+}
+
+bool EncodeBatch::Send(int fd) {
+  size_t sent = 0;
+  bool ok = true;
+
+  while (sent < count_) {
+    int n = sendmmsg(fd, msgs_.data() + sent, count_ - sent, 0);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      utils::Log::Instance()->Debug("sendmmsg: %s (%zu dropped)",
+                                    strerror(errno), count_ - sent);
+      ok = false;
+      break;
+    }
+
+    sent += n;
+  }
+
+  Clear();
+  return ok;
+}
+
+void EncodeBatch::Clear() {
+  slab_.clear();
+  count_ = 0;
+}
+
+}   // namespace net
@@ -0,0 +1,60 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_ENCODE_BATCH_H_
+#define NET_ENCODE_BATCH_H_
+
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "coap/pdu.h"
+#include "net/transport.h"
+
+namespace net {
+
+// What became of a message given to EncodeBatch::Add().
+enum class Encoded {
+  ok,
+  oversize,   // encodes bigger than the datagram limit: dropped
+  full,       // no room left in the batch or the slab: send, then retry
+  failed      // PDU::Encode() failed
+};
+
+// The responses of a batched server loop round, encoded back to back
+// into one slab allocated up front, with the mmsghdr/iovec arrays that
+// sendmmsg(2) wants filled in as they go: no vector per message, no
+// copy on the way out.  Clear() (or Send()) makes it ready for the next
+// round, keeping the slab.
+class EncodeBatch {
+ public:
+  explicit EncodeBatch(size_t max_messages = kMaxBatch,
+                       size_t max_size = kMaxDatagramSize);
+
+  Encoded Add(const coap::PDU& pdu, const sockaddr* peer,
+              socklen_t peer_len);
+
+  // sendmmsg(2) all of it on fd, then Clear().  Whatever the socket
+  // doesn't take is dropped, as the network would do: false then.
+  bool Send(int fd);
+  void Clear();
+
+  mmsghdr* msgs() { return msgs_.data(); }
+  size_t size() const { return count_; }
+  size_t bytes() const { return slab_.size(); }
+
+  // Messages Add() dropped for being too big, since construction.
+  uint64_t oversize() const { return oversize_; }
+
+ private:
+  size_t max_size_;
+  std::vector<uint8_t> slab_;     // max_messages * max_size reserved
+  std::vector<mmsghdr> msgs_;
+  std::vector<iovec> iov_;
+  std::vector<sockaddr_storage> peers_;
+  size_t count_;
+  uint64_t oversize_;
+};
+
+}   // namespace net
+
+#endif  // NET_ENCODE_BATCH_H_
@@ -0,0 +1,124 @@
+// Copyleft 2013 tho@autistici.org
+
+// Rounds of kMaxBatch responses, as a batched server loop makes them:
+// each encoded into its own vector and queued on the epoll transport
+// (which copies it), against EncodeBatch's one slab handed straight to
+// sendmmsg(2).  First the encoding alone, then with the send.  The
+// datagrams go to a loopback socket nobody reads.
+//
+// Usage: encode_batch_bench [rounds]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "net/encode_batch.h"
+
+using namespace net;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double ns(Clock::time_point start, size_t n) {
+  return std::chrono::duration<double, std::nano>(
+      Clock::now() - start).count() / n;
+}
+
+std::vector<coap::PDU> responses() {
+  std::vector<coap::PDU> pdus(kMaxBatch);
+  for (size_t i = 0; i < pdus.size(); ++i) {
+    coap::PDU& pdu = pdus[i];
+    pdu.set_type(coap::Type::ACK);
+    pdu.set_code(coap::Code::Content);
+    pdu.set_message_id(i);
+    pdu.set_token({ 1, 2, 3, uint8_t(i) });
+    coap::Options opts;
+    assert(opts.AddETag({ 0xCA, 0xFE, uint8_t(i) }));
+    assert(opts.AddContentFormat(50));
+    assert(opts.AddMaxAge(60));
+    pdu.set_options(opts);
+    pdu.set_payload(std::vector<uint8_t>(64 + i, 'x'));
+  }
+  return pdus;
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t rounds = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+  size_t n = rounds * kMaxBatch;
+
+  std::vector<coap::PDU> pdus = responses();
+
+  // Where it all goes.
+  int sink = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in peer;
+  memset(&peer, 0, sizeof peer);
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(bind(sink, reinterpret_cast<sockaddr*>(&peer), sizeof peer) == 0);
+  socklen_t len = sizeof peer;
+  assert(getsockname(sink, reinterpret_cast<sockaddr*>(&peer), &len) == 0);
+  const sockaddr* to = reinterpret_cast<const sockaddr*>(&peer);
+
+  std::unique_ptr<Transport> t = NewTransport(Backend::epoll);
+  sockaddr_in any;
+  memset(&any, 0, sizeof any);
+  any.sin_family = AF_INET;
+  any.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&any), sizeof any));
+
+  EncodeBatch batch;
+  uint64_t sink_bytes = 0;
+
+  printf("%zu rounds of %zu responses\n", rounds, kMaxBatch);
+
+  Clock::time_point start = Clock::now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (const coap::PDU& pdu : pdus) {
+      std::vector<uint8_t> out;
+      assert(pdu.Encode(out));
+      sink_bytes += out.size();
+    }
+  }
+  printf("encode, a vector each:  %7.1f ns/response\n", ns(start, n));
+
+  start = Clock::now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (const coap::PDU& pdu : pdus)
+      assert(batch.Add(pdu, to, sizeof peer) == Encoded::ok);
+    sink_bytes += batch.bytes();
+    batch.Clear();
+  }
+  printf("encode, one slab:       %7.1f ns/response\n", ns(start, n));
+
+  start = Clock::now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (const coap::PDU& pdu : pdus) {
+      std::vector<uint8_t> out;
+      assert(pdu.Encode(out));
+      t->Send(out.data(), out.size(), to, sizeof peer);
+    }
+    t->Flush();
+  }
+  printf("+ transport Send/Flush: %7.1f ns/response\n", ns(start, n));
+
+  start = Clock::now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (const coap::PDU& pdu : pdus)
+      assert(batch.Add(pdu, to, sizeof peer) == Encoded::ok);
+    batch.Send(t->fd());
+  }
+  printf("+ sendmmsg of the slab: %7.1f ns/response (%llu)\n", ns(start, n),
+         static_cast<unsigned long long>(sink_bytes));
+
+  close(sink);
+}
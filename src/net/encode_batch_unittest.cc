@@ -0,0 +1,169 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "utils/log.h"
+#include "net/encode_batch.h"
+
+using namespace net;
+
+void init_log() {
+  utils::Log::Instance()->Open("encode_batch_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+coap::PDU response(uint16_t mid, size_t payload) {
+  coap::PDU pdu;
+  pdu.set_type(coap::Type::ACK);
+  pdu.set_code(coap::Code::Content);
+  pdu.set_message_id(mid);
+  pdu.set_token({ uint8_t(mid >> 8), uint8_t(mid) });
+  coap::Options opts;
+  assert(opts.AddContentFormat(50));
+  assert(opts.AddMaxAge(mid));
+  pdu.set_options(opts);
+  if (payload)
+    pdu.set_payload(std::vector<uint8_t>(payload, 'x'));
+  return pdu;
+}
+
+std::vector<uint8_t> encode(const coap::PDU& pdu) {
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+sockaddr_in loopback(uint16_t port) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(port);
+  return sin;
+}
+
+const sockaddr* sa(const sockaddr_in& sin) {
+  return reinterpret_cast<const sockaddr*>(&sin);
+}
+
+void test_ok_back_to_back() {
+  EncodeBatch batch(8);
+  sockaddr_in peer = loopback(5683);
+
+  size_t bytes = 0;
+  for (uint16_t i = 0; i < 5; ++i) {
+    assert(batch.Add(response(i, 10 * i), sa(peer), sizeof peer) ==
+           Encoded::ok);
+    bytes += encode(response(i, 10 * i)).size();
+  }
+  assert(batch.size() == 5 && batch.bytes() == bytes);
+
+  // Each iovec has its message, right after the one before.
+  mmsghdr* msgs = batch.msgs();
+  const uint8_t* next =
+      static_cast<uint8_t*>(msgs[0].msg_hdr.msg_iov->iov_base);
+  for (uint16_t i = 0; i < 5; ++i) {
+    const iovec* iov = msgs[i].msg_hdr.msg_iov;
+    std::vector<uint8_t> want = encode(response(i, 10 * i));
+    assert(iov->iov_base == next);
+    assert(iov->iov_len == want.size());
+    assert(memcmp(iov->iov_base, want.data(), want.size()) == 0);
+    assert(msgs[i].msg_hdr.msg_namelen == sizeof peer);
+    assert(memcmp(msgs[i].msg_hdr.msg_name, &peer, sizeof peer) == 0);
+    next += iov->iov_len;
+  }
+}
+
+void test_ok_slab_reused() {
+  EncodeBatch batch(4);
+  sockaddr_in peer = loopback(5683);
+
+  assert(batch.Add(response(1, 100), sa(peer), sizeof peer) == Encoded::ok);
+  const void* slab = batch.msgs()[0].msg_hdr.msg_iov->iov_base;
+
+  for (int round = 0; round < 3; ++round) {
+    batch.Clear();
+    assert(batch.size() == 0 && batch.bytes() == 0);
+    for (uint16_t i = 0; i < 4; ++i)
+      assert(batch.Add(response(i, 1000), sa(peer), sizeof peer) ==
+             Encoded::ok);
+    assert(batch.msgs()[0].msg_hdr.msg_iov->iov_base == slab);
+  }
+}
+
+void test_ko_overflow() {
+  EncodeBatch batch(3, 200);
+  sockaddr_in peer = loopback(5683);
+
+  assert(batch.Add(response(1, 50), sa(peer), sizeof peer) == Encoded::ok);
+  std::vector<uint8_t> first = encode(response(1, 50));
+
+  // Too big: dropped, the others untouched.
+  assert(batch.Add(response(2, 500), sa(peer), sizeof peer) ==
+         Encoded::oversize);
+  assert(batch.oversize() == 1);
+  assert(batch.size() == 1 && batch.bytes() == first.size());
+
+  // Too big for the slab too: it grows, the first one with it.
+  coap::PDU huge = response(3, 0);
+  coap::Options opts;
+  assert(opts.AddProxyUri(std::string(1000, 'u')));
+  assert(opts.AddUriPath(std::string(255, 'p')));
+  huge.set_options(opts);
+  assert(batch.Add(huge, sa(peer), sizeof peer) == Encoded::oversize);
+  const iovec* iov = batch.msgs()[0].msg_hdr.msg_iov;
+  assert(iov->iov_len == first.size() &&
+         memcmp(iov->iov_base, first.data(), first.size()) == 0);
+
+  // Not encodable, or no room left.
+  assert(batch.Add(response(4, 2000), sa(peer), sizeof peer) ==
+         Encoded::failed);
+  assert(batch.Add(response(5, 10), sa(peer), sizeof peer) == Encoded::ok);
+  assert(batch.Add(response(6, 10), sa(peer), sizeof peer) == Encoded::ok);
+  assert(batch.Add(response(7, 10), sa(peer), sizeof peer) == Encoded::full);
+  assert(batch.size() == 3);
+}
+
+void test_ok_send() {
+  int rx = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr = loopback(0);
+  assert(bind(rx, sa(addr), sizeof addr) == 0);
+  socklen_t len = sizeof addr;
+  assert(getsockname(rx, reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+  timeval tv = { 1, 0 };
+  setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+  int tx = socket(AF_INET, SOCK_DGRAM, 0);
+  EncodeBatch batch;
+  for (uint16_t i = 0; i < 10; ++i)
+    assert(batch.Add(response(i, i), sa(addr), sizeof addr) == Encoded::ok);
+  assert(batch.Send(tx));
+  assert(batch.size() == 0);
+
+  for (uint16_t i = 0; i < 10; ++i) {
+    uint8_t buf[kMaxDatagramSize];
+    ssize_t n = recv(rx, buf, sizeof buf, 0);
+    std::vector<uint8_t> want = encode(response(i, i));
+    assert(n == static_cast<ssize_t>(want.size()));
+    assert(memcmp(buf, want.data(), n) == 0);
+  }
+
+  close(tx);
+  close(rx);
+}
+
+int main() {
+  init_log();
+
+  test_ok_back_to_back();
+  test_ok_slab_reused();
+  test_ko_overflow();
+  test_ok_send();
+}
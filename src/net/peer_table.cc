@@ -0,0 +1,304 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <netinet/in.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+
+#include "net/peer_table.h"
+
+namespace net {
+
+static_assert(sizeof(Peer) == 64, "a Peer should fit a cache line");
+
+namespace {
+
+const size_t kInitialCapacity = 1024;
+const uint32_t kMaxRtoMs = 60000;
+
+// Table time, in seconds.  Never 0, so that 0 can mean "never".
+uint32_t Seconds(uint64_t now_ms) {
+  return now_ms / 1000 + 1;
+}
+
+size_t RoundUp(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+// Feed sample r into the RFC 6298 estimator e, return its RTO for
+// the given K.
+uint32_t Estimate(uint16_t& srtt, uint16_t& rttvar, uint32_t r, unsigned k) {
+  r = std::max<uint32_t>(1, std::min(r, kMaxRtoMs));
+
+  if (srtt == 0) {
+    srtt = r;
+    rttvar = r / 2;
+  } else {
+    uint32_t delta = srtt > r ? srtt - r : r - srtt;
+    rttvar = (3 * rttvar + delta) / 4;
+    srtt = (7 * srtt + r) / 8;
+  }
+
+  return std::min<uint32_t>(srtt + k * rttvar, kMaxRtoMs);
+}
+
+}   // namespace
+
+PeerTable::PeerTable(size_t max_peers, uint32_t idle_timeout_sec)
+  : slots_(std::min(kInitialCapacity, RoundUp(max_peers * 4 / 3 + 1)))
+  , mask_(slots_.size() - 1)
+  , size_(0)
+  , max_capacity_(RoundUp(max_peers * 4 / 3 + 1))
+  , idle_timeout_(idle_timeout_sec)
+  , sweep_(0) {
+  std::random_device rd;
+  seed_ = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+  for (auto& p : slots_)
+    p.key_.used = 0;
+}
+
+bool PeerTable::MakeKey(const sockaddr* addr, socklen_t addr_len,
+                        Peer::Key& key) {
+  memset(&key, 0, sizeof key);
+  key.used = 1;
+
+  if (addr->sa_family == AF_INET && addr_len >= sizeof(sockaddr_in)) {
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(addr);
+    memcpy(key.addr, &sin->sin_addr, sizeof sin->sin_addr);
+    key.port = sin->sin_port;
+    key.family = AF_INET;
+    return true;
+  }
+
+  if (addr->sa_family == AF_INET6 && addr_len >= sizeof(sockaddr_in6)) {
+    const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(addr);
+    memcpy(key.addr, &sin6->sin6_addr, sizeof sin6->sin6_addr);
+    key.port = sin6->sin6_port;
+    key.family = AF_INET6;
+    return true;
+  }
+
+  return false;
+}
+
+uint32_t PeerTable::HashKey(const Peer::Key& key) const {
+  uint64_t a, b;
+  memcpy(&a, key.addr, 8);
+  memcpy(&b, key.addr + 8, 8);
+  uint64_t c = key.port | (static_cast<uint64_t>(key.family) << 16);
+
+  uint64_t h = (seed_ ^ c) * 0x9E3779B97F4A7C15ULL;
+  h ^= a;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 31;
+  h ^= b;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 29;
+
+  return h ^ (h >> 32);
+}
+
+uint32_t PeerTable::Hash(const sockaddr* addr, socklen_t addr_len) const {
+  Peer::Key key;
+  return MakeKey(addr, addr_len, key) ? HashKey(key) : 0;
+}
+
+// Index of the entry with key, or of the empty slot where it would go.
+size_t PeerTable::Probe(const Peer::Key& key, uint32_t hash) const {
+  size_t i = hash & mask_;
+
+  for (;;) {
+    const Peer& p = slots_[i];
+
+    if (!p.key_.used ||
+        (p.hash_ == hash && memcmp(&p.key_, &key, sizeof key) == 0))
+      return i;
+
+    i = (i + 1) & mask_;
+  }
+}
+
+void PeerTable::Init(Peer& peer, const Peer::Key& key, uint32_t hash,
+                     uint32_t now) {
+  memset(&peer, 0, sizeof peer);
+  peer.key_ = key;
+  peer.hash_ = hash;
+  // Don't start every peer at the same message ID.
+  peer.next_mid_ = (hash ^ (seed_ >> 32)) & 0xFFFF;
+  peer.last_seen_ = now;
+  peer.rto_updated_ = now;
+  peer.rto_ = kDefaultRtoMs;
+}
+
+bool PeerTable::Grow() {
+  if (slots_.size() >= max_capacity_)
+    return false;
+
+  std::vector<Peer> old(slots_.size() * 2);
+  old.swap(slots_);
+  mask_ = slots_.size() - 1;
+
+  for (auto& p : slots_)
+    p.key_.used = 0;
+
+  for (const auto& p : old) {
+    if (!p.key_.used)
+      continue;
+
+    size_t i = p.hash_ & mask_;
+    while (slots_[i].key_.used)
+      i = (i + 1) & mask_;
+    slots_[i] = p;
+  }
+
+  sweep_ = 0;
+
+  return true;
+}
+
+Peer* PeerTable::Lookup(const sockaddr* addr, socklen_t addr_len,
+                        uint64_t now_ms) {
+  Peer::Key key;
+
+  if (!MakeKey(addr, addr_len, key))
+    return nullptr;
+
+  uint32_t hash = HashKey(key);
+  uint32_t now = Seconds(now_ms);
+  size_t i = Probe(key, hash);
+
+  if (slots_[i].key_.used) {
+    slots_[i].last_seen_ = now;
+    return &slots_[i];
+  }
+
+  // Keep the load factor under 3/4.
+  if (4 * (size_ + 1) > 3 * slots_.size()) {
+    if (!Grow())
+      return nullptr;
+    i = Probe(key, hash);
+  }
+
+  Init(slots_[i], key, hash, now);
+  ++size_;
+
+  return &slots_[i];
+}
+
+Peer* PeerTable::Find(const sockaddr* addr, socklen_t addr_len) {
+  Peer::Key key;
+
+  if (!MakeKey(addr, addr_len, key))
+    return nullptr;
+
+  size_t i = Probe(key, HashKey(key));
+
+  return slots_[i].key_.used ? &slots_[i] : nullptr;
+}
+
+bool PeerTable::NextMessageId(Peer* peer, uint64_t now_ms, uint16_t& mid) {
+  uint32_t now = Seconds(now_ms);
+  uint16_t next = peer->next_mid_;
+  unsigned block = next >> 14;
+
+  // Entering a block: all of its IDs must be past EXCHANGE_LIFETIME.
+  if ((next & 0x3FFF) == 0 && peer->block_used_[block] != 0 &&
+      now - peer->block_used_[block] < kExchangeLifetimeSec)
+    return false;
+
+  peer->block_used_[block] = now;
+  mid = next;
+  peer->next_mid_ = next + 1;
+
+  return true;
+}
+
+uint32_t PeerTable::Rto(Peer* peer, uint64_t now_ms) {
+  uint32_t now = Seconds(now_ms);
+  uint32_t rto = peer->rto_;
+  uint32_t stale = now - peer->rto_updated_;
+
+  // An estimate nobody has refreshed for a while says little about the
+  // path now: pull it back towards the default, a step at a time.
+  if (rto < 1000 && stale * 1000 >= 16 * rto) {
+    peer->rto_ = std::min<uint32_t>(2 * rto, 1000);
+    peer->rto_updated_ = now;
+  } else if (rto > 3000 && stale * 1000 >= 4 * rto) {
+    peer->rto_ = (rto + kDefaultRtoMs) / 2;
+    peer->rto_updated_ = now;
+  }
+
+  return peer->rto_;
+}
+
+void PeerTable::OnRtt(Peer* peer, uint32_t rtt_ms, unsigned retransmits,
+                      uint64_t now_ms) {
+  uint32_t rto = peer->rto_;
+
+  // Strong samples weigh 1/2, weak ones (ambiguous: which transmission
+  // is being answered?) 1/4.
+  if (retransmits == 0) {
+    uint32_t e = Estimate(peer->strong_.srtt, peer->strong_.rttvar,
+                          rtt_ms, 4);
+    rto = (e + rto) / 2;
+  } else if (retransmits <= 2) {
+    uint32_t e = Estimate(peer->weak_.srtt, peer->weak_.rttvar, rtt_ms, 1);
+    rto = (e + 3 * rto) / 4;
+  } else {
+    return;
+  }
+
+  peer->rto_ = std::max<uint32_t>(1, std::min(rto, kMaxRtoMs));
+  peer->rto_updated_ = Seconds(now_ms);
+}
+
+// Backward shift deletion: pull the entries that follow (up to the
+// next hole) into the hole, unless they would land before their home
+// slot.
+void PeerTable::Erase(size_t i) {
+  size_t j = i;
+
+  for (;;) {
+    j = (j + 1) & mask_;
+
+    if (!slots_[j].key_.used)
+      break;
+
+    size_t home = slots_[j].hash_ & mask_;
+
+    if (((j - home) & mask_) >= ((j - i) & mask_)) {
+      slots_[i] = slots_[j];
+      i = j;
+    }
+  }
+
+  slots_[i].key_.used = 0;
+  --size_;
+}
+
+size_t PeerTable::EvictIdle(uint64_t now_ms, size_t budget) {
+  uint32_t now = Seconds(now_ms);
+  size_t evicted = 0;
+
+  for (size_t n = 0; n < budget && size_ > 0; ++n) {
+    Peer& p = slots_[sweep_];
+
+    if (p.key_.used && now - p.last_seen_ >= idle_timeout_) {
+      // Something may have been shifted into this slot: look again.
+      Erase(sweep_);
+      ++evicted;
+      continue;
+    }
+
+    sweep_ = (sweep_ + 1) & mask_;
+  }
+
+  return evicted;
+}
+
+}   // namespace net
@@ -0,0 +1,143 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_PEER_TABLE_H_
+#define NET_PEER_TABLE_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+namespace net {
+
+// Transmission parameters (RFC 7252, 4.8)
+const uint32_t kDefaultRtoMs = 2000;            // ACK_TIMEOUT
+const uint32_t kExchangeLifetimeSec = 247;      // EXCHANGE_LIFETIME
+
+// Per-peer protocol state, for endpoints that talk to lots of peers.
+class Peer {
+ public:
+  // Current overall RTO estimate (ms), to be randomised by the caller.
+  uint32_t rto() const { return rto_; }
+
+  // Smoothed RTT from exchanges with no retransmissions (ms), 0 if
+  // there has been none yet.
+  uint32_t srtt() const { return strong_.srtt; }
+
+  // Factor to multiply the RTO by at each retransmission: CoCoA's
+  // variable back-off, so that a short RTO backs off faster and a long
+  // one doesn't balloon.
+  double backoff() const {
+    return rto_ < 1000 ? 3 : rto_ > 3000 ? 1.5 : 2;
+  }
+
+ private:
+  friend class PeerTable;
+
+  struct Key {
+    uint8_t addr[16];
+    uint16_t port;
+    uint8_t family;
+    uint8_t used;       // never set in an empty slot: keys don't match
+  };
+
+  // RFC 6298 state, in ms.
+  struct Estimator {
+    uint16_t srtt;
+    uint16_t rttvar;
+  };
+
+  Key key_;
+  uint32_t hash_;
+  uint16_t next_mid_;
+  uint16_t pad_;
+  uint32_t last_seen_;            // s
+  uint32_t rto_updated_;          // s
+
+  // Message IDs come from 4 blocks of 16384; a block is not entered
+  // again before EXCHANGE_LIFETIME has passed since its last use.
+  uint32_t block_used_[4];        // s
+
+  Estimator strong_;              // exchanges without retransmissions
+  Estimator weak_;                // exchanges with 1 or 2 of them
+  uint16_t rto_;
+  uint16_t pad2_;
+};
+
+// Open addressing table of Peer, keyed by address and port.
+//
+// Entries are 64 bytes (one cache line) stored inline in a single
+// array with linear probing, so a lookup usually costs one or two
+// cache misses whatever the number of peers.  Deletion shifts the
+// following entries back instead of leaving tombstones.
+//
+// Times are passed in by the caller (a monotonic clock, in ms), so the
+// table can run on virtual time too.
+//
+// Peer pointers stay valid until the next call to Lookup() or
+// EvictIdle(), which may move entries around.
+class PeerTable {
+ public:
+  // Hold up to max_peers peers; peers not seen for idle_timeout_sec
+  // go on the next EvictIdle() sweep.
+  explicit PeerTable(size_t max_peers,
+                     uint32_t idle_timeout_sec = 2 * kExchangeLifetimeSec);
+
+  // Return the state for addr, creating it if needed, and mark it as
+  // seen.  Return nullptr if the table is full or addr is not an
+  // AF_INET or AF_INET6 address.
+  Peer* Lookup(const sockaddr* addr, socklen_t addr_len, uint64_t now_ms);
+
+  // Same as Lookup, but never creates.
+  Peer* Find(const sockaddr* addr, socklen_t addr_len);
+
+  // Pick the next message ID for peer.  Return false if that would
+  // reuse an ID within EXCHANGE_LIFETIME: the caller has to wait (more
+  // than 16384 IDs in 247 s to the same peer).
+  bool NextMessageId(Peer* peer, uint64_t now_ms, uint16_t& mid);
+
+  // Initial RTO for a new exchange with peer (ms), after aging a
+  // stale estimate back towards the default.
+  uint32_t Rto(Peer* peer, uint64_t now_ms);
+
+  // Feed in the RTT of an exchange with peer, measured from its first
+  // transmission, and how many times it was retransmitted.  Samples
+  // from exchanges retransmitted more than twice are ignored.
+  void OnRtt(Peer* peer, uint32_t rtt_ms, unsigned retransmits,
+             uint64_t now_ms);
+
+  // Look at up to budget slots, carrying on from where the previous
+  // call stopped, and drop the idle peers.  Return how many went.
+  size_t EvictIdle(uint64_t now_ms, size_t budget);
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return slots_.size(); }
+
+  // The hash the table uses for addr (0 for unsupported families).
+  // It is seeded at random, so that peers can't pick colliding
+  // addresses to make probe sequences long.
+  uint32_t Hash(const sockaddr* addr, socklen_t addr_len) const;
+
+ private:
+  static bool MakeKey(const sockaddr* addr, socklen_t addr_len,
+                      Peer::Key& key);
+  uint32_t HashKey(const Peer::Key& key) const;
+
+  size_t Probe(const Peer::Key& key, uint32_t hash) const;
+  void Init(Peer& peer, const Peer::Key& key, uint32_t hash, uint32_t now);
+  void Erase(size_t i);
+  bool Grow();
+
+ private:
+  std::vector<Peer> slots_;
+  size_t mask_;
+  size_t size_;
+  size_t max_capacity_;
+  uint32_t idle_timeout_;
+  size_t sweep_;
+  uint64_t seed_;
+};
+
+}   // namespace net
+
+#endif  // NET_PEER_TABLE_H_
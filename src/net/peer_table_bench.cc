@@ -0,0 +1,166 @@
+// Copyleft 2013 tho@autistici.org
+
+// PeerTable at 1M peers: insertion, hits, misses, a full exchange's
+// worth of bookkeeping (message ID, RTO, RTT sample), and an idle
+// sweep.  std::unordered_map keyed by IPv4 address and port is run on
+// the same lookups for reference.
+//
+// Usage: peer_table_bench [peers [lookups]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "net/peer_table.h"
+
+using namespace net;
+
+typedef std::chrono::steady_clock Clock;
+
+double ns_per(Clock::time_point start, size_t n) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count() / n;
+}
+
+sockaddr_storage make_peer(std::mt19937_64& rng, bool v6) {
+  sockaddr_storage ss;
+  memset(&ss, 0, sizeof ss);
+  uint64_t r = rng();
+
+  if (v6) {
+    sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(5683 + (r & 0xFF));
+    sin6->sin6_addr.s6_addr[0] = 0x20;
+    sin6->sin6_addr.s6_addr[1] = 0x01;
+    memcpy(sin6->sin6_addr.s6_addr + 8, &r, 8);
+  } else {
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(5683 + (r & 0xFF));
+    sin->sin_addr.s_addr = r >> 32;
+  }
+
+  return ss;
+}
+
+socklen_t len(const sockaddr_storage& ss) {
+  return ss.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+}
+
+const sockaddr* sa(const sockaddr_storage& ss) {
+  return reinterpret_cast<const sockaddr*>(&ss);
+}
+
+struct State {
+  uint16_t next_mid;
+  uint32_t last_seen;
+  uint16_t srtt, rttvar, rto;
+};
+
+uint64_t v4_key(const sockaddr_storage& ss) {
+  const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(&ss);
+  return (static_cast<uint64_t>(sin->sin_addr.s_addr) << 16) | sin->sin_port;
+}
+
+int main(int argc, char* argv[]) {
+  size_t npeers = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t nlookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000000;
+
+  std::mt19937_64 rng(42);
+  std::vector<sockaddr_storage> peers;
+  std::vector<sockaddr_storage> strangers;
+
+  // A quarter of them on IPv6.
+  for (size_t i = 0; i < npeers; ++i)
+    peers.push_back(make_peer(rng, i % 4 == 0));
+  for (size_t i = 0; i < npeers; ++i)
+    strangers.push_back(make_peer(rng, i % 4 == 0));
+
+  std::vector<uint32_t> order(nlookups);
+  for (auto& i : order)
+    i = rng() % npeers;
+
+  PeerTable table(npeers, 60);
+  uint64_t now = 0;
+
+  Clock::time_point start = Clock::now();
+  for (auto& p : peers)
+    assert(table.Lookup(sa(p), len(p), now));
+  printf("insert:          %6.1f ns/peer (%zu peers, %zu MB)\n",
+         ns_per(start, npeers), table.size(),
+         table.capacity() * sizeof(Peer) >> 20);
+
+  start = Clock::now();
+  size_t found = 0;
+  for (auto i : order)
+    found += table.Find(sa(peers[i]), len(peers[i])) != nullptr;
+  printf("hit:             %6.1f ns/lookup\n", ns_per(start, nlookups));
+  assert(found == nlookups);
+
+  start = Clock::now();
+  found = 0;
+  for (auto i : order)
+    found += table.Find(sa(strangers[i]), len(strangers[i])) != nullptr;
+  printf("miss:            %6.1f ns/lookup\n", ns_per(start, nlookups));
+
+  // What a client does per exchange.
+  start = Clock::now();
+  for (size_t n = 0; n < nlookups; ++n) {
+    const sockaddr_storage& p = peers[order[n]];
+    now = n / 1000;
+    Peer* peer = table.Lookup(sa(p), len(p), now);
+    uint16_t mid;
+    table.NextMessageId(peer, now, mid);
+    uint32_t rto = table.Rto(peer, now);
+    table.OnRtt(peer, 20 + (mid & 0x3F), 0, now);
+    found += rto;
+  }
+  printf("exchange:        %6.1f ns/exchange\n", ns_per(start, nlookups));
+
+  // Half the peers go quiet; sweep them all out.
+  now += 61000;
+  for (size_t i = 0; i < npeers; i += 2)
+    table.Lookup(sa(peers[i]), len(peers[i]), now);
+
+  start = Clock::now();
+  size_t evicted = 0;
+  for (size_t n = 0; n < 2 * table.capacity(); n += 4096)
+    evicted += table.EvictIdle(now, 4096);
+  printf("idle sweep:      %6.1f ns/slot (%zu evicted, %zu left)\n",
+         ns_per(start, 2 * table.capacity()), evicted, table.size());
+
+  // Reference: std::unordered_map, IPv4 peers only.
+  std::unordered_map<uint64_t, State> map;
+  std::vector<uint32_t> v4;
+  for (size_t i = 0; i < npeers; ++i)
+    if (peers[i].ss_family == AF_INET)
+      v4.push_back(i);
+
+  start = Clock::now();
+  for (auto i : v4)
+    map[v4_key(peers[i])] = State();
+  printf("unordered_map insert: %6.1f ns/peer (IPv4 only)\n",
+         ns_per(start, v4.size()));
+
+  start = Clock::now();
+  found = 0;
+  for (size_t n = 0; n < nlookups; ++n)
+    found += map.count(v4_key(peers[v4[order[n] % v4.size()]]));
+  printf("unordered_map hit:    %6.1f ns/lookup\n", ns_per(start, nlookups));
+
+  start = Clock::now();
+  found = 0;
+  for (size_t n = 0; n < nlookups; ++n) {
+    const sockaddr_storage& p = peers[v4[order[n] % v4.size()]];
+    found += table.Find(sa(p), len(p)) != nullptr;
+  }
+  printf("PeerTable hit:        %6.1f ns/lookup (same IPv4 peers)\n",
+         ns_per(start, nlookups));
+}
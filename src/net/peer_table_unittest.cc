@@ -0,0 +1,201 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstring>
+#include <set>
+#include "utils/log.h"
+#include "net/peer_table.h"
+
+using namespace net;
+
+void init_log() {
+  utils::Log::Instance()->Open("peer_table_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+sockaddr_in v4(uint32_t host, uint16_t port) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(host);
+  return sin;
+}
+
+sockaddr_in6 v6(uint8_t last, uint16_t port) {
+  sockaddr_in6 sin6;
+  memset(&sin6, 0, sizeof sin6);
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_port = htons(port);
+  sin6.sin6_addr.s6_addr[0] = 0x20;
+  sin6.sin6_addr.s6_addr[1] = 0x01;
+  sin6.sin6_addr.s6_addr[15] = last;
+  return sin6;
+}
+
+#define SA(x) reinterpret_cast<const sockaddr*>(&(x)), sizeof (x)
+
+void test_ok_lookup() {
+  PeerTable t(100);
+
+  sockaddr_in a = v4(0x0A000001, 5683);
+  sockaddr_in b = v4(0x0A000001, 5684);
+  sockaddr_in6 c = v6(1, 5683);
+
+  assert(!t.Find(SA(a)));
+  Peer* pa = t.Lookup(SA(a), 0);
+  assert(pa);
+  assert(pa->rto() == kDefaultRtoMs);
+  assert(t.Lookup(SA(a), 0) == pa);
+  assert(t.Find(SA(a)) == pa);
+  assert(t.Lookup(SA(b), 0) != pa);
+  assert(t.Lookup(SA(c), 0));
+  assert(t.size() == 3);
+
+  sockaddr un;
+  un.sa_family = AF_UNIX;
+  assert(!t.Lookup(&un, sizeof un, 0));
+}
+
+void test_ok_grow_and_full() {
+  PeerTable t(10000);
+  size_t initial = t.capacity();
+
+  for (uint32_t i = 0; i < 10000; ++i) {
+    sockaddr_in a = v4(0x0A000000 + i, 5683);
+    assert(t.Lookup(SA(a), 0));
+  }
+  assert(t.size() == 10000);
+  assert(t.capacity() > initial);
+
+  // Everything still there after growing.
+  for (uint32_t i = 0; i < 10000; ++i) {
+    sockaddr_in a = v4(0x0A000000 + i, 5683);
+    assert(t.Find(SA(a)));
+  }
+
+  // Max capacity is reached at some point past max_peers.
+  size_t extra = 0;
+  for (uint32_t i = 0; ; ++i, ++extra) {
+    sockaddr_in a = v4(0x0B000000 + i, 5683);
+    if (!t.Lookup(SA(a), 0))
+      break;
+  }
+  assert(4 * t.size() <= 3 * t.capacity());
+  assert(extra < 10000);
+}
+
+void test_ok_message_ids() {
+  PeerTable t(10);
+  sockaddr_in a = v4(0x7F000001, 5683);
+  Peer* p = t.Lookup(SA(a), 0);
+
+  std::set<uint16_t> seen;
+  uint16_t mid;
+  uint64_t now = 1000;
+
+  // 3 blocks' worth go without trouble, then at some point the block
+  // we started from comes round again and must wait.
+  size_t n = 0;
+  while (t.NextMessageId(p, now, mid)) {
+    assert(seen.insert(mid).second);
+    ++n;
+  }
+  assert(n > 3 * 16384 && n <= 4 * 16384);
+
+  // Still too early.
+  assert(!t.NextMessageId(p, now + (kExchangeLifetimeSec - 1) * 1000, mid));
+
+  // Fine once EXCHANGE_LIFETIME is over.
+  assert(t.NextMessageId(p, now + kExchangeLifetimeSec * 1000, mid));
+  assert((mid & 0x3FFF) == 0);
+
+  // Peers are independent.
+  sockaddr_in b = v4(0x7F000002, 5683);
+  Peer* q = t.Lookup(SA(b), 0);
+  assert(t.NextMessageId(q, now, mid));
+}
+
+void test_ok_rto() {
+  PeerTable t(10);
+  sockaddr_in a = v4(0x7F000001, 5683);
+  Peer* p = t.Lookup(SA(a), 0);
+
+  assert(p->backoff() == 2);
+
+  // A fast, steady path pulls the RTO down.
+  uint64_t now = 0;
+  for (int i = 0; i < 50; ++i, now += 100)
+    t.OnRtt(p, 20, 0, now);
+  assert(p->srtt() == 20);
+  assert(p->rto() < 200);
+  assert(p->backoff() == 3);
+  assert(t.Rto(p, now) == p->rto());
+
+  // Weak samples move it less than strong ones.
+  uint32_t before = p->rto();
+  t.OnRtt(p, 2000, 1, now);
+  uint32_t weak_step = p->rto() - before;
+  assert(weak_step > 0 && weak_step < (2000 - before) / 2);
+
+  // Too ambiguous: ignored.
+  before = p->rto();
+  t.OnRtt(p, 9000, 3, now);
+  assert(p->rto() == before);
+
+  // Left alone for long enough, it ages back up towards 1 s.
+  uint32_t aged = t.Rto(p, now + 100000);
+  assert(aged > before);
+  assert(aged <= 1000);
+
+  // A slow path, same story downwards.
+  for (int i = 0; i < 50; ++i)
+    t.OnRtt(p, 8000, 0, now);
+  assert(p->rto() > 3000);
+  assert(p->backoff() == 1.5);
+  uint32_t high = p->rto();
+  assert(t.Rto(p, now + 4 * high + 1000) < high);
+}
+
+void test_ok_evict() {
+  PeerTable t(1000, 10);
+
+  for (uint32_t i = 0; i < 500; ++i) {
+    sockaddr_in a = v4(0x0A000000 + i, 5683);
+    assert(t.Lookup(SA(a), 0));
+  }
+
+  // Half of them show up again later.
+  for (uint32_t i = 0; i < 500; i += 2) {
+    sockaddr_in a = v4(0x0A000000 + i, 5683);
+    assert(t.Lookup(SA(a), 8000));
+  }
+
+  // Nothing is idle yet.
+  assert(t.EvictIdle(9000, t.capacity()) == 0);
+
+  // A sweep in small steps gets rid of the other half.
+  size_t evicted = 0;
+  for (size_t n = 0; n < 2 * t.capacity(); n += 16)
+    evicted += t.EvictIdle(15000, 16);
+  assert(evicted == 250);
+  assert(t.size() == 250);
+
+  for (uint32_t i = 0; i < 500; ++i) {
+    sockaddr_in a = v4(0x0A000000 + i, 5683);
+    assert((t.Find(SA(a)) != nullptr) == (i % 2 == 0));
+  }
+}
+
+int main() {
+  init_log();
+
+  test_ok_lookup();
+  test_ok_grow_and_full();
+  test_ok_message_ids();
+  test_ok_rto();
+  test_ok_evict();
+}
@@ -0,0 +1,369 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "utils/log.h"
+#include "net/shm_ring.h"
+
+namespace net {
+
+namespace {
+
+const uint32_t kMagic = 0x434F5352;          // "COSR"
+
+// Most batches per Poll, so that a busy ring can't starve the caller.
+const size_t kMaxRounds = 4;
+
+long Futex(std::atomic<uint32_t>* word, int op, uint32_t value,
+           const timespec* timeout) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value,
+                 timeout, nullptr, 0);
+}
+
+}   // namespace
+
+// Laid out in the shared memory segment.  The producers' tail, the
+// futex words and each slot's sequence number sit on separate cache
+// lines; the consumer's head is private to the owner (ShmTransport::
+// head_).
+struct ShmTransport::Segment {
+  struct Slot {
+    std::atomic<uint64_t> seq;    // == position + 1 when full
+    uint32_t size;
+    uint32_t from_len;
+    sockaddr_un from;
+    uint8_t data[kMaxDatagramSize];
+    uint8_t pad[64 - (8 + 8 + sizeof(sockaddr_un) + kMaxDatagramSize) % 64];
+  };
+
+  uint32_t magic;
+  uint32_t slots;
+  int32_t owner;                  // pid
+  std::atomic<uint32_t> open;
+  uint8_t pad0[48];
+
+  std::atomic<uint64_t> tail;
+  uint8_t pad1[56];
+
+  std::atomic<uint32_t> signal;   // futex word, bumped to wake the owner
+  std::atomic<uint32_t> sleeping;
+  std::atomic<uint32_t> woken;    // Wake() called
+  uint32_t pad2;
+  std::atomic<uint64_t> drops;
+  uint8_t pad3[40];
+
+  Slot slot[kSlots];
+};
+
+ShmTransport::ShmTransport()
+  : own_(nullptr)
+  , addr_len_(0)
+  , head_(0) {
+  memset(&addr_, 0, sizeof addr_);
+}
+
+ShmTransport::~ShmTransport() {
+  for (auto& peer : peers_)
+    Unmap(peer.second.segment);
+
+  if (own_) {
+    own_->open.store(0, std::memory_order_release);
+    Unmap(own_);
+    shm_unlink(addr_.sun_path);
+  }
+}
+
+ShmTransport::Segment* ShmTransport::Map(const char* name, bool create) {
+  utils::Log* L = utils::Log::Instance();
+
+  int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+  int fd = shm_open(name, flags, 0600);
+  if (fd == -1) {
+    if (create || errno != ENOENT)
+      L->Debug("shm_open %s: %s", name, strerror(errno));
+    return nullptr;
+  }
+
+  if (create && ftruncate(fd, sizeof(Segment)) == -1) {
+    L->Debug("ftruncate %s: %s", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size != sizeof(Segment)) {
+    L->Debug("%s: not a ring", name);
+    close(fd);
+    return nullptr;
+  }
+
+  void* p = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    L->Debug("mmap %s: %s", name, strerror(errno));
+    if (create)
+      shm_unlink(name);
+    return nullptr;
+  }
+
+  Segment* segment = static_cast<Segment*>(p);
+
+  if (create) {
+    // Fresh pages are zero: only the slot sequence numbers need setting.
+    for (uint32_t i = 0; i < kSlots; ++i)
+      segment->slot[i].seq.store(i, std::memory_order_relaxed);
+    segment->slots = kSlots;
+    segment->owner = getpid();
+    segment->magic = kMagic;
+    segment->open.store(1, std::memory_order_release);
+  } else if (segment->open.load(std::memory_order_acquire) == 0 ||
+             segment->magic != kMagic || segment->slots != kSlots) {
+    L->Debug("%s: not a ring", name);
+    Unmap(segment);
+    return nullptr;
+  }
+
+  return segment;
+}
+
+void ShmTransport::Unmap(Segment* segment) {
+  munmap(segment, sizeof(Segment));
+}
+
+bool ShmTransport::Open(const sockaddr* addr, socklen_t addr_len) {
+  utils::Log* L = utils::Log::Instance();
+  const sockaddr_un* sun = reinterpret_cast<const sockaddr_un*>(addr);
+
+  if (own_ || addr->sa_family != AF_UNIX ||
+      addr_len <= offsetof(sockaddr_un, sun_path) ||
+      addr_len > sizeof(sockaddr_un) || sun->sun_path[0] != '/') {
+    L->Debug("shm: need an AF_UNIX address named /something");
+    return false;
+  }
+
+  memset(&addr_, 0, sizeof addr_);
+  memcpy(&addr_, addr, addr_len);
+  addr_.sun_path[sizeof addr_.sun_path - 1] = '\0';
+  addr_len_ = offsetof(sockaddr_un, sun_path) + strlen(addr_.sun_path) + 1;
+
+  // A segment left behind by a process that is gone is taken over,
+  // closed first so that peers which mapped it map the new one.
+  Segment* stale = Map(addr_.sun_path, false);
+  if (stale) {
+    pid_t owner = stale->owner;
+    if (kill(owner, 0) == 0 || errno == EPERM) {
+      L->Debug("shm: %s in use by %d", addr_.sun_path, owner);
+      Unmap(stale);
+      return false;
+    }
+    stale->open.store(0, std::memory_order_release);
+    Unmap(stale);
+    shm_unlink(addr_.sun_path);
+  }
+
+  own_ = Map(addr_.sun_path, true);
+  head_ = 0;
+  return own_ != nullptr;
+}
+
+ShmTransport::Peer* ShmTransport::Lookup(const sockaddr_un* peer,
+                                         socklen_t peer_len) {
+  if (peer->sun_family != AF_UNIX ||
+      peer_len <= offsetof(sockaddr_un, sun_path) ||
+      peer_len > sizeof(sockaddr_un))
+    return nullptr;
+
+  std::string name(peer->sun_path,
+                   strnlen(peer->sun_path,
+                           peer_len - offsetof(sockaddr_un, sun_path)));
+
+  auto it = peers_.find(name);
+  if (it != peers_.end()) {
+    if (it->second.segment->open.load(std::memory_order_acquire))
+      return &it->second;
+
+    // Closed, maybe reopened since: map it again.
+    for (size_t i = 0; i < dirty_.size(); ++i)
+      if (dirty_[i] == &it->second) {
+        dirty_.erase(dirty_.begin() + i);
+        break;
+      }
+    Unmap(it->second.segment);
+    peers_.erase(it);
+  }
+
+  Segment* segment = Map(name.c_str(), false);
+  if (!segment) {
+    utils::Log::Instance()->Debug("shm: no ring at %s", name.c_str());
+    return nullptr;
+  }
+
+  Peer& p = peers_[name];
+  p.segment = segment;
+  p.dirty = false;
+  return &p;
+}
+
+bool ShmTransport::Send(const uint8_t* data, size_t size,
+                        const sockaddr* peer, socklen_t peer_len) {
+  if (!own_ || size > kMaxDatagramSize)
+    return false;
+
+  Peer* p = Lookup(reinterpret_cast<const sockaddr_un*>(peer), peer_len);
+  if (!p)
+    return false;
+  Segment* segment = p->segment;
+
+  // Claim a slot: it is free when its sequence number equals the
+  // position we want.
+  uint64_t pos = segment->tail.load(std::memory_order_relaxed);
+  Segment::Slot* slot;
+
+  for (;;) {
+    slot = &segment->slot[pos & (kSlots - 1)];
+    int64_t diff = int64_t(slot->seq.load(std::memory_order_acquire) - pos);
+
+    if (diff == 0) {
+      if (segment->tail.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      segment->drops.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    } else {
+      pos = segment->tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  memcpy(slot->data, data, size);
+  slot->size = size;
+  memcpy(&slot->from, &addr_, addr_len_);
+  slot->from_len = addr_len_;
+  slot->seq.store(pos + 1, std::memory_order_release);
+
+  if (!p->dirty) {
+    p->dirty = true;
+    dirty_.push_back(p);
+  }
+  return true;
+}
+
+void ShmTransport::Signal(Segment* segment) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (segment->sleeping.load(std::memory_order_relaxed)) {
+    segment->signal.fetch_add(1, std::memory_order_release);
+    Futex(&segment->signal, FUTEX_WAKE, 1, nullptr);
+  }
+}
+
+bool ShmTransport::Flush() {
+  for (Peer* p : dirty_) {
+    Signal(p->segment);
+    p->dirty = false;
+  }
+  dirty_.clear();
+  return true;
+}
+
+bool ShmTransport::Wake() {
+  if (!own_)
+    return false;
+  own_->woken.store(1, std::memory_order_relaxed);
+  Signal(own_);
+  return true;
+}
+
+uint64_t ShmTransport::drops() const {
+  return own_ ? own_->drops.load(std::memory_order_relaxed) : 0;
+}
+
+bool ShmTransport::Empty() const {
+  const Segment::Slot& slot = own_->slot[head_ & (kSlots - 1)];
+  return slot.seq.load(std::memory_order_acquire) != head_ + 1;
+}
+
+void ShmTransport::Sleep(int timeout_ms) {
+  // Tell the producers to signal, then look again: either they see us
+  // sleeping, or we see what they wrote, or the futex word has moved
+  // and the wait returns at once.
+  own_->sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint32_t signal = own_->signal.load(std::memory_order_acquire);
+
+  if (Empty() && !own_->woken.load(std::memory_order_relaxed)) {
+    timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    Futex(&own_->signal, FUTEX_WAIT, signal, timeout_ms < 0 ? nullptr : &ts);
+  }
+
+  own_->sleeping.store(0, std::memory_order_relaxed);
+}
+
+int ShmTransport::Poll(Handler* handler, int timeout_ms) {
+  if (!own_)
+    return -1;
+
+  if (own_->woken.exchange(0, std::memory_order_relaxed))
+    return 0;
+  if (timeout_ms != 0 && Empty()) {
+    Sleep(timeout_ms);
+    if (own_->woken.exchange(0, std::memory_order_relaxed))
+      return 0;
+  }
+
+  int delivered = 0;
+
+  for (size_t round = 0; round < kMaxRounds; ++round) {
+    Datagram batch[kMaxBatch];
+    size_t n = 0;
+
+    for (; n < kMaxBatch; ++n) {
+      uint64_t pos = head_ + n;
+      const Segment::Slot& slot = own_->slot[pos & (kSlots - 1)];
+      if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+        break;
+
+      // The slot is writable by other processes: don't trust its sizes.
+      Datagram& dgram = batch[n];
+      dgram.data = slot.data;
+      dgram.size = std::min<size_t>(slot.size, kMaxDatagramSize);
+      dgram.peer = reinterpret_cast<const sockaddr*>(&slot.from);
+      dgram.peer_len = std::min<socklen_t>(slot.from_len, sizeof slot.from);
+    }
+
+    if (n == 0)
+      break;
+
+    handler->OnBatch(batch, n);
+
+    // Give the slots back, one lap ahead.
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t pos = head_ + i;
+      own_->slot[pos & (kSlots - 1)].seq.store(pos + kSlots,
+                                               std::memory_order_release);
+    }
+    head_ += n;
+    delivered += n;
+
+    if (n < kMaxBatch)
+      break;
+  }
+
+  return delivered;
+}
+
+}   // namespace net
@@ -0,0 +1,84 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_SHM_RING_H_
+#define NET_SHM_RING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "net/transport.h"
+
+namespace net {
+
+// Datagrams between processes on the same host, through shared memory
+// instead of the loopback stack.
+//
+// Endpoints are named by AF_UNIX addresses whose sun_path is a POSIX
+// shared memory name ("/coap-sidecar").  Open() creates a segment of
+// that name holding the endpoint's inbox: a bounded MPSC ring of
+// datagram sized slots, which any number of processes push to with a
+// CAS on the tail (Vyukov's bounded queue) and only the owner pops
+// from.  The sender's address travels in the slot, so that replies
+// work as with UDP.
+//
+// Poll() hands the ready slots to Handler::OnBatch() in place, with
+// Datagram::data and Datagram::peer pointing into the segment, and
+// frees them when the handler returns.  When the ring is empty it
+// sleeps on a futex in the segment; Flush() wakes the peers written to
+// since the last Flush(), and only if they are asleep.  A full ring
+// drops the datagram, as a full socket buffer would, and counts it.
+class ShmTransport : public Transport {
+ public:
+  ShmTransport();
+  ~ShmTransport();
+
+  bool Open(const sockaddr* addr, socklen_t addr_len);
+  int Poll(Handler* handler, int timeout_ms);
+  bool Send(const uint8_t* data, size_t size,
+            const sockaddr* peer, socklen_t peer_len);
+  bool Flush();
+  bool Wake();
+
+  Backend backend() const { return Backend::shm; }
+  int fd() const { return -1; }
+
+  // Datagrams dropped because this endpoint's ring was full.
+  uint64_t drops() const;
+
+ private:
+  static const uint32_t kSlots = 1024;     // power of 2
+
+  struct Segment;
+
+  // A peer's segment, mapped on first Send().
+  struct Peer {
+    Segment* segment;
+    bool dirty;               // written to since the last Flush()
+  };
+
+  bool Empty() const;
+  void Sleep(int timeout_ms);
+
+  static Segment* Map(const char* name, bool create);
+  static void Unmap(Segment* segment);
+  static void Signal(Segment* segment);
+
+  Peer* Lookup(const sockaddr_un* peer, socklen_t peer_len);
+
+ private:
+  Segment* own_;
+  sockaddr_un addr_;
+  socklen_t addr_len_;
+  uint64_t head_;
+  std::unordered_map<std::string, Peer> peers_;
+  std::vector<Peer*> dirty_;
+};
+
+}   // namespace net
+
+#endif  // NET_SHM_RING_H_
@@ -0,0 +1,271 @@
+// Copyleft 2013 tho@autistici.org
+
+// Round trips between two processes on the same host: shared memory
+// rings against loopback UDP (epoll backend) and AF_UNIX datagram
+// sockets.
+//
+// A child process answers each CoAP GET with an ACK, decoding it in
+// place.  The parent measures the latency of lone round trips, then
+// the throughput with a window of requests in flight.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "utils/histogram.h"
+#include "net/shm_ring.h"
+
+using namespace net;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Plain AF_UNIX datagram sockets, for comparison.
+class UnixTransport : public Transport {
+ public:
+  UnixTransport() : fd_(-1) { memset(&addr_, 0, sizeof addr_); }
+
+  ~UnixTransport() {
+    if (fd_ != -1) {
+      close(fd_);
+      unlink(addr_.sun_path);
+    }
+  }
+
+  bool Open(const sockaddr* addr, socklen_t addr_len) {
+    memcpy(&addr_, addr, addr_len);
+    unlink(addr_.sun_path);
+    fd_ = OpenSocket(addr, addr_len);
+    return fd_ != -1;
+  }
+
+  int Poll(Handler* handler, int timeout_ms) {
+    pollfd pfd = { fd_, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+      return 0;
+
+    int n = 0;
+    for (;;) {
+      sockaddr_un peer;
+      socklen_t peer_len = sizeof peer;
+      ssize_t size = recvfrom(fd_, buf_, sizeof buf_, MSG_DONTWAIT,
+                              reinterpret_cast<sockaddr*>(&peer), &peer_len);
+      if (size < 0)
+        return n;
+      Datagram dgram = { buf_, size_t(size),
+                         reinterpret_cast<sockaddr*>(&peer), peer_len };
+      handler->OnDatagram(dgram);
+      ++n;
+    }
+  }
+
+  // The receive queue is short (net.unix.max_dgram_qlen): wait for
+  // room rather than drop.
+  bool Send(const uint8_t* data, size_t size,
+            const sockaddr* peer, socklen_t peer_len) {
+    for (;;) {
+      if (sendto(fd_, data, size, 0, peer, peer_len) == ssize_t(size))
+        return true;
+      if (errno != EAGAIN)
+        return false;
+      pollfd pfd = { fd_, POLLOUT, 0 };
+      poll(&pfd, 1, -1);
+    }
+  }
+
+  bool Flush() { return true; }
+  bool Wake() { return true; }
+  Backend backend() const { return Backend::any; }
+  int fd() const { return fd_; }
+
+ private:
+  int fd_;
+  sockaddr_un addr_;
+  uint8_t buf_[kMaxDatagramSize];
+};
+
+// Answers GETs; a 1-byte datagram means stop.
+class Echo : public Handler {
+ public:
+  explicit Echo(Transport* t) : t_(t), stop(false) { }
+
+  void OnDatagram(const Datagram& dgram) {
+    if (dgram.size == 1) {
+      stop = true;
+      return;
+    }
+
+    coap::PDUView view;
+    if (!view.Decode(dgram.data, dgram.size))
+      return;
+
+    uint8_t ack[4] = { 0x60, coap::Code::Content,
+                       dgram.data[2], dgram.data[3] };
+    t_->Send(ack, sizeof ack, dgram.peer, dgram.peer_len);
+  }
+
+ private:
+  Transport* t_;
+
+ public:
+  bool stop;
+};
+
+class Counter : public Handler {
+ public:
+  Counter() : n(0) { }
+  void OnDatagram(const Datagram&) { ++n; }
+  size_t n;
+};
+
+struct Endpoints {
+  sockaddr_storage server;
+  socklen_t server_len;
+  sockaddr_storage client;
+  socklen_t client_len;
+};
+
+// Fork a child serving on e.server; return its pid once it is ready.
+pid_t spawn(const char* kind, Endpoints& e) {
+  int ready[2];
+  assert(pipe(ready) == 0);
+
+  pid_t pid = fork();
+  assert(pid != -1);
+
+  if (pid == 0) {
+    std::unique_ptr<Transport> t;
+    if (!strcmp(kind, "unix"))
+      t.reset(new UnixTransport);
+    else
+      t = NewTransport(!strcmp(kind, "shm") ? Backend::shm : Backend::epoll);
+
+    sockaddr* addr = reinterpret_cast<sockaddr*>(&e.server);
+    if (!t->Open(addr, e.server_len))
+      _exit(1);
+    if (!strcmp(kind, "udp"))
+      getsockname(t->fd(), addr, &e.server_len);
+    assert(write(ready[1], &e.server, sizeof e.server) ==
+           sizeof e.server);
+
+    Echo echo(t.get());
+    while (!echo.stop) {
+      t->Poll(&echo, -1);
+      t->Flush();
+    }
+    t.reset();
+    _exit(0);
+  }
+
+  close(ready[1]);
+  assert(read(ready[0], &e.server, sizeof e.server) == sizeof e.server);
+  close(ready[0]);
+  return pid;
+}
+
+void run(const char* kind, Endpoints e, size_t rounds, size_t window) {
+  pid_t pid = spawn(kind, e);
+
+  std::unique_ptr<Transport> t;
+  if (!strcmp(kind, "unix"))
+    t.reset(new UnixTransport);
+  else
+    t = NewTransport(!strcmp(kind, "shm") ? Backend::shm : Backend::epoll);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&e.client), e.client_len));
+
+  const sockaddr* server = reinterpret_cast<sockaddr*>(&e.server);
+  coap::PDU get;
+  get.set_code(coap::Code::GET);
+  get.set_payload(std::vector<uint8_t>(32, 'x'));
+  std::vector<uint8_t> wire;
+  assert(get.Encode(wire));
+
+  // Lone round trips.
+  utils::Histogram rtt;
+  Counter counter;
+  for (size_t i = 0; i < rounds; ++i) {
+    wire[2] = i >> 8;
+    wire[3] = i;
+    auto start = Clock::now();
+    t->Send(wire.data(), wire.size(), server, e.server_len);
+    t->Flush();
+    counter.n = 0;
+    while (counter.n == 0)
+      t->Poll(&counter, -1);
+    rtt.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count());
+  }
+
+  // Windows of requests.
+  auto start = Clock::now();
+  counter.n = 0;
+  for (size_t i = 0; i < rounds; i += window) {
+    for (size_t j = 0; j < window; ++j)
+      t->Send(wire.data(), wire.size(), server, e.server_len);
+    t->Flush();
+    size_t want = counter.n + window;
+    while (counter.n < want)
+      if (t->Poll(&counter, 1000) == 0 && counter.n < want)
+        break;            // lost some (socket buffers)
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start)
+      .count();
+
+  uint8_t stop = 0;
+  t->Send(&stop, 1, server, e.server_len);
+  t->Flush();
+  int status;
+  waitpid(pid, &status, 0);
+
+  printf("%-5s rtt p50 %6.1f us  p99 %6.1f us   window %zu: %8.0f round "
+         "trips/s\n", kind, rtt.Percentile(50) / 1e3,
+         rtt.Percentile(99) / 1e3, window, counter.n / elapsed);
+}
+
+Endpoints unix_endpoints(const char* prefix) {
+  Endpoints e;
+  memset(&e, 0, sizeof e);
+  sockaddr_un* s = reinterpret_cast<sockaddr_un*>(&e.server);
+  sockaddr_un* c = reinterpret_cast<sockaddr_un*>(&e.client);
+  s->sun_family = c->sun_family = AF_UNIX;
+  snprintf(s->sun_path, sizeof s->sun_path, "%sshm_ring_bench.%d.server",
+           prefix, getpid());
+  snprintf(c->sun_path, sizeof c->sun_path, "%sshm_ring_bench.%d.client",
+           prefix, getpid());
+  e.server_len = e.client_len = sizeof(sockaddr_un);
+  return e;
+}
+
+Endpoints udp_endpoints() {
+  Endpoints e;
+  memset(&e, 0, sizeof e);
+  sockaddr_in* s = reinterpret_cast<sockaddr_in*>(&e.server);
+  sockaddr_in* c = reinterpret_cast<sockaddr_in*>(&e.client);
+  s->sin_family = c->sin_family = AF_INET;
+  s->sin_addr.s_addr = c->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  e.server_len = e.client_len = sizeof(sockaddr_in);
+  return e;
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t rounds = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+  size_t window = argc > 2 ? strtoul(argv[2], nullptr, 10) : 8;
+
+  run("shm", unix_endpoints("/"), rounds, window);
+  run("udp", udp_endpoints(), rounds, window);
+  run("unix", unix_endpoints("/tmp/"), rounds, window);
+}
@@ -0,0 +1,306 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "utils/log.h"
+#include "net/shm_ring.h"
+
+using namespace net;
+
+void init_log() {
+  utils::Log::Instance()->Open("shm_ring_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+sockaddr_un shm_address(const char* tag) {
+  sockaddr_un sun;
+  memset(&sun, 0, sizeof sun);
+  sun.sun_family = AF_UNIX;
+  snprintf(sun.sun_path, sizeof sun.sun_path, "/shm_ring_unittest.%d.%s",
+           getpid(), tag);
+  return sun;
+}
+
+const sockaddr* sa(const sockaddr_un& sun) {
+  return reinterpret_cast<const sockaddr*>(&sun);
+}
+
+// Decode each datagram in place and answer with an ACK carrying the
+// same message ID.
+class Responder : public Handler {
+ public:
+  explicit Responder(Transport* t) : t_(t), seen_(0) { }
+
+  void OnDatagram(const Datagram& dgram) {
+    coap::PDUView view;
+    assert(view.Decode(dgram.data, dgram.size));
+    ++seen_;
+
+    uint8_t ack[4] = {
+      0x60, coap::Code::Content,
+      dgram.data[2], dgram.data[3]
+    };
+    assert(t_->Send(ack, sizeof ack, dgram.peer, dgram.peer_len));
+  }
+
+  size_t seen() const { return seen_; }
+
+ private:
+  Transport* t_;
+  size_t seen_;
+};
+
+class Collector : public Handler {
+ public:
+  void OnDatagram(const Datagram& dgram) {
+    mids.push_back(dgram.data[2] << 8 | dgram.data[3]);
+    peers.push_back(reinterpret_cast<const sockaddr_un*>(dgram.peer)
+                    ->sun_path);
+  }
+
+  void OnBatch(const Datagram* dgrams, size_t n) {
+    batches.push_back(n);
+    Handler::OnBatch(dgrams, n);
+  }
+
+  std::vector<uint16_t> mids;
+  std::vector<std::string> peers;
+  std::vector<size_t> batches;
+};
+
+std::vector<uint8_t> get(uint16_t mid) {
+  coap::PDU pdu;
+  pdu.set_code(coap::Code::GET);
+  pdu.set_message_id(mid);
+  std::vector<uint8_t> wire;
+  assert(pdu.Encode(wire));
+  return wire;
+}
+
+void test_ok_round_trip() {
+  sockaddr_un sa_ = shm_address("server"), ca = shm_address("client");
+  ShmTransport server, client;
+  assert(server.Open(sa(sa_), sizeof sa_));
+  assert(client.Open(sa(ca), sizeof ca));
+
+  for (uint16_t mid = 0; mid < 100; ++mid) {
+    std::vector<uint8_t> wire = get(mid);
+    assert(client.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+  }
+  assert(client.Flush());
+
+  // Delivered in order, in batches of kMaxBatch.
+  Responder responder(&server);
+  assert(server.Poll(&responder, 0) == 100);
+  assert(responder.seen() == 100);
+  assert(server.Flush());
+
+  Collector collector;
+  assert(client.Poll(&collector, 1000) == 100);
+  assert((collector.batches == std::vector<size_t>{ kMaxBatch, 36 }));
+  for (uint16_t mid = 0; mid < 100; ++mid) {
+    assert(collector.mids[mid] == mid);
+    assert(collector.peers[mid] == sa_.sun_path);
+  }
+
+  assert(client.Poll(&collector, 0) == 0);
+}
+
+void test_ok_full_ring() {
+  sockaddr_un sa_ = shm_address("full"), ca = shm_address("filler");
+  ShmTransport server, client;
+  assert(server.Open(sa(sa_), sizeof sa_));
+  assert(client.Open(sa(ca), sizeof ca));
+
+  std::vector<uint8_t> wire = get(1);
+  for (size_t i = 0; i < 1100; ++i)
+    assert(client.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+  assert(server.drops() == 1100 - 1024);
+
+  // Slots are reused once handed back.
+  Collector collector;
+  size_t got = 0;
+  while (size_t n = server.Poll(&collector, 0))
+    got += n;
+  assert(got == 1024);
+
+  assert(client.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+  assert(server.Poll(&collector, 0) == 1);
+}
+
+void test_ok_wake() {
+  sockaddr_un sa_ = shm_address("wake");
+  ShmTransport t;
+  assert(t.Open(sa(sa_), sizeof sa_));
+
+  Collector collector;
+  auto start = std::chrono::steady_clock::now();
+  std::thread waker([&t] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    t.Wake();
+  });
+  assert(t.Poll(&collector, 5000) == 0);
+  waker.join();
+  assert(std::chrono::steady_clock::now() - start <
+         std::chrono::milliseconds(2000));
+
+  // A Wake() with no Poll() in progress makes the next one return.
+  assert(t.Wake());
+  assert(t.Poll(&collector, 5000) == 0);
+
+  // And a timeout is a timeout.
+  start = std::chrono::steady_clock::now();
+  assert(t.Poll(&collector, 30) == 0);
+  assert(std::chrono::steady_clock::now() - start >=
+         std::chrono::milliseconds(30));
+}
+
+// A responder in another process, woken through the futex.
+void test_ok_cross_process() {
+  sockaddr_un sa_ = shm_address("child"), ca = shm_address("parent");
+  ShmTransport client;
+  assert(client.Open(sa(ca), sizeof ca));
+
+  int ready[2];
+  assert(pipe(ready) == 0);
+
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    {
+      ShmTransport server;
+      bool ok = server.Open(sa(sa_), sizeof sa_);
+      char c = ok;
+      assert(write(ready[1], &c, 1) == 1);
+      if (!ok)
+        _exit(1);
+
+      Responder responder(&server);
+      while (responder.seen() < 1000) {
+        server.Poll(&responder, -1);
+        server.Flush();
+      }
+    }
+    _exit(0);
+  }
+
+  char c;
+  assert(read(ready[0], &c, 1) == 1 && c == 1);
+  close(ready[0]);
+  close(ready[1]);
+
+  Collector collector;
+  for (uint16_t mid = 0; mid < 1000; ++mid) {
+    std::vector<uint8_t> wire = get(mid);
+    assert(client.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+    assert(client.Flush());
+    while (collector.mids.size() == mid)
+      assert(client.Poll(&collector, 5000) >= 0);
+    assert(collector.mids[mid] == mid);
+  }
+
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // The child's segment went with it.
+  std::vector<uint8_t> wire = get(0);
+  assert(!client.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+}
+
+// A segment left behind by a process that died is taken over, and
+// peers that had mapped it reach the new owner.
+void test_ok_stale() {
+  sockaddr_un sa_ = shm_address("stale"), ca = shm_address("stale_peer");
+  int opened[2], done[2];
+  assert(pipe(opened) == 0 && pipe(done) == 0);
+
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    ShmTransport* leaked = new ShmTransport;
+    char c = leaked->Open(sa(sa_), sizeof sa_) ? 1 : 0;
+    if (write(opened[1], &c, 1) != 1 || read(done[0], &c, 1) != 1)
+      _exit(1);
+    _exit(0);
+  }
+  char c = 0;
+  assert(read(opened[0], &c, 1) == 1 && c == 1);
+
+  ShmTransport peer;
+  assert(peer.Open(sa(ca), sizeof ca));
+  std::vector<uint8_t> wire = get(1);
+  assert(peer.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+
+  assert(write(done[1], &c, 1) == 1);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  for (int fd : { opened[0], opened[1], done[0], done[1] })
+    close(fd);
+
+  ShmTransport t;
+  assert(t.Open(sa(sa_), sizeof sa_));
+
+  // What went to the dead process is gone; what follows arrives.
+  wire = get(2);
+  assert(peer.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+  assert(peer.Flush());
+  Collector collector;
+  assert(t.Poll(&collector, 0) == 1);
+  assert(collector.mids[0] == 2 && collector.peers[0] == ca.sun_path);
+}
+
+void test_ok_backend() {
+  std::unique_ptr<Transport> t = NewTransport(Backend::shm);
+  assert(t && t->backend() == Backend::shm);
+  assert(std::string(BackendName(t->backend())) == "shm");
+}
+
+void test_ko_open() {
+  sockaddr_un sa_ = shm_address("taken");
+  ShmTransport a, b;
+  assert(a.Open(sa(sa_), sizeof sa_));
+  assert(!a.Open(sa(sa_), sizeof sa_));
+  assert(!b.Open(sa(sa_), sizeof sa_));       // in use
+
+  sockaddr_un relative = sa_;
+  relative.sun_path[0] = 'x';
+  assert(!b.Open(sa(relative), sizeof relative));
+
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  assert(!b.Open(reinterpret_cast<sockaddr*>(&sin), sizeof sin));
+
+  // Not open, nobody there, too big.
+  std::vector<uint8_t> wire = get(0);
+  assert(!b.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+  sockaddr_un nobody = shm_address("nobody");
+  assert(!a.Send(wire.data(), wire.size(), sa(nobody), sizeof nobody));
+  uint8_t big[kMaxDatagramSize + 1] = { 0 };
+  assert(!a.Send(big, sizeof big, sa(sa_), sizeof sa_));
+}
+
+int main() {
+  init_log();
+
+  test_ok_round_trip();
+  test_ok_full_ring();
+  test_ok_wake();
+  test_ok_cross_process();
+  test_ok_stale();
+  test_ok_backend();
+  test_ko_open();
+}
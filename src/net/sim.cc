@@ -0,0 +1,396 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <netinet/in.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "utils/log.h"
+#include "net/sim.h"
+
+namespace net {
+
+namespace {
+
+// Ports handed out for port 0, as by most kernels.
+const uint16_t kFirstEphemeralPort = 49152;
+
+uint16_t PortOf(const sockaddr* addr) {
+  if (addr->sa_family == AF_INET)
+    return ntohs(reinterpret_cast<const sockaddr_in*>(addr)->sin_port);
+  return ntohs(reinterpret_cast<const sockaddr_in6*>(addr)->sin6_port);
+}
+
+void SetPort(sockaddr* addr, uint16_t port) {
+  if (addr->sa_family == AF_INET)
+    reinterpret_cast<sockaddr_in*>(addr)->sin_port = htons(port);
+  else
+    reinterpret_cast<sockaddr_in6*>(addr)->sin6_port = htons(port);
+}
+
+// The same address with the wildcard host, to find endpoints bound to
+// INADDR_ANY / in6addr_any.
+sockaddr_storage Wildcard(const sockaddr* addr) {
+  sockaddr_storage ss;
+  memset(&ss, 0, sizeof ss);
+  ss.ss_family = addr->sa_family;
+  SetPort(reinterpret_cast<sockaddr*>(&ss), PortOf(addr));
+  return ss;
+}
+
+socklen_t AddressLength(sa_family_t family) {
+  switch (family) {
+    case AF_INET:
+      return sizeof(sockaddr_in);
+    case AF_INET6:
+      return sizeof(sockaddr_in6);
+  }
+  return 0;
+}
+
+}   // namespace
+
+SimNetwork::SimNetwork(uint64_t seed, const LinkConfig& link)
+  : link_(link)
+  , rng_(seed)
+  , now_(0)
+  , seq_(0)
+  , next_port_(kFirstEphemeralPort)
+  , sent_(0)
+  , delivered_(0)
+  , lost_(0)
+  , duplicated_(0)
+  , unreachable_(0)
+  , events_run_(0) {
+}
+
+// Endpoints left are closed, their inboxes gone with the packets.
+SimNetwork::~SimNetwork() {
+  for (SimTransport* endpoint : endpoints_) {
+    if (endpoint) {
+      endpoint->network_ = nullptr;
+      endpoint->open_ = false;
+      endpoint->inbox_.clear();
+    }
+  }
+}
+
+// splitmix64: small, fast, and good enough for link decisions.
+uint64_t SimNetwork::Random() {
+  uint64_t z = (rng_ += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+double SimNetwork::Uniform() {
+  return (Random() >> 11) * (1.0 / (1ULL << 53));
+}
+
+void SimNetwork::SetLink(const SimTransport* from, const SimTransport* to,
+                         const LinkConfig& link) {
+  links_[uint64_t(from->index_) << 32 | to->index_] = link;
+}
+
+void SimNetwork::At(uint64_t when, const std::function<void()>& fn) {
+  uint32_t timer;
+  if (free_timers_.empty()) {
+    timer = timers_.size();
+    timers_.push_back(fn);
+  } else {
+    timer = free_timers_.back();
+    free_timers_.pop_back();
+    timers_[timer] = fn;
+  }
+
+  Event event = { std::max(when, now_), seq_++, kTimer, timer };
+  events_.push(event);
+}
+
+bool SimNetwork::Step() {
+  if (events_.empty())
+    return false;
+
+  Event event = events_.top();
+  events_.pop();
+  now_ = std::max(now_, event.when);
+  ++events_run_;
+
+  if (event.packet == kTimer) {
+    std::function<void()> fn;
+    fn.swap(timers_[event.timer]);
+    free_timers_.push_back(event.timer);
+    fn();
+  } else {
+    Deliver(event.packet);
+  }
+
+  return true;
+}
+
+void SimNetwork::RunUntil(uint64_t t) {
+  while (!events_.empty() && events_.top().when <= t)
+    Step();
+  now_ = std::max(now_, t);
+}
+
+uint64_t SimNetwork::Run(uint64_t max_events) {
+  uint64_t n = 0;
+  while (n < max_events && Step())
+    ++n;
+  return n;
+}
+
+std::string SimNetwork::Key(const sockaddr* addr) {
+  std::string key(1, char(addr->sa_family));
+  uint16_t port = PortOf(addr);
+  key.append(reinterpret_cast<const char*>(&port), sizeof port);
+
+  if (addr->sa_family == AF_INET) {
+    const in_addr& a = reinterpret_cast<const sockaddr_in*>(addr)->sin_addr;
+    key.append(reinterpret_cast<const char*>(&a), sizeof a);
+  } else {
+    const in6_addr& a =
+        reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr;
+    key.append(reinterpret_cast<const char*>(&a), sizeof a);
+  }
+
+  return key;
+}
+
+bool SimNetwork::Bind(SimTransport* endpoint, const sockaddr* addr,
+                      socklen_t addr_len, sockaddr_storage& bound) {
+  utils::Log* L = utils::Log::Instance();
+
+  socklen_t len = AddressLength(addr->sa_family);
+  if (len == 0 || addr_len < len) {
+    L->Debug("sim: unsupported address family %d", addr->sa_family);
+    return false;
+  }
+
+  memset(&bound, 0, sizeof bound);
+  memcpy(&bound, addr, len);
+  sockaddr* b = reinterpret_cast<sockaddr*>(&bound);
+
+  if (PortOf(b) == 0) {
+    // Next free ephemeral port, wrapping around.
+    for (uint32_t tries = 0; ; ++tries) {
+      if (tries == 65536 - kFirstEphemeralPort) {
+        L->Debug("sim: out of ephemeral ports");
+        return false;
+      }
+      SetPort(b, next_port_);
+      next_port_ = next_port_ == 65535 ? kFirstEphemeralPort
+                                       : next_port_ + 1;
+      if (bound_.count(Key(b)) == 0)
+        break;
+    }
+  }
+
+  if (!bound_.insert(std::make_pair(Key(b), endpoint->index_)).second) {
+    L->Debug("sim: address in use");
+    return false;
+  }
+  return true;
+}
+
+void SimNetwork::Unbind(SimTransport* endpoint) {
+  bound_.erase(Key(endpoint->address()));
+}
+
+uint32_t SimNetwork::Add(SimTransport* endpoint) {
+  endpoints_.push_back(endpoint);
+  return endpoints_.size() - 1;
+}
+
+void SimNetwork::Remove(SimTransport* endpoint) {
+  endpoints_[endpoint->index_] = nullptr;
+}
+
+uint32_t SimNetwork::AllocPacket() {
+  if (free_packets_.empty()) {
+    packets_.emplace_back();
+    return packets_.size() - 1;
+  }
+  uint32_t packet = free_packets_.back();
+  free_packets_.pop_back();
+  return packet;
+}
+
+bool SimNetwork::Send(const SimTransport* from, const uint8_t* data,
+                      size_t size, const sockaddr* to, socklen_t to_len) {
+  if (size > kMaxDatagramSize) {
+    utils::Log::Instance()->Debug("sim: datagram too big (%zu bytes)", size);
+    return false;
+  }
+
+  ++sent_;
+
+  // Like UDP, sending to nobody succeeds.
+  if (to_len < AddressLength(to->sa_family)) {
+    ++unreachable_;
+    return true;
+  }
+  auto it = bound_.find(Key(to));
+  if (it == bound_.end()) {
+    sockaddr_storage any = Wildcard(to);
+    it = bound_.find(Key(reinterpret_cast<sockaddr*>(&any)));
+    if (it == bound_.end()) {
+      ++unreachable_;
+      return true;
+    }
+  }
+  uint32_t dest = it->second;
+
+  auto link_it = links_.find(uint64_t(from->index_) << 32 | dest);
+  const LinkConfig& link = link_it == links_.end() ? link_ : link_it->second;
+
+  int copies = 1;
+  if (link.duplicate > 0 && Uniform() < link.duplicate) {
+    ++duplicated_;
+    copies = 2;
+  }
+
+  for (int i = 0; i < copies; ++i) {
+    if (link.loss > 0 && Uniform() < link.loss) {
+      ++lost_;
+      continue;
+    }
+
+    uint64_t delay = link.latency_ns;
+    if (link.jitter_ns)
+      delay += Random() % link.jitter_ns;
+    if (link.reorder > 0 && Uniform() < link.reorder)
+      delay += link.reorder_delay_ns;
+
+    uint32_t packet = AllocPacket();
+    Packet& p = packets_[packet];
+    memcpy(p.data, data, size);
+    p.size = size;
+    memcpy(&p.from, &from->addr_, sizeof p.from);
+    p.from_len = from->addr_len_;
+    p.to = dest;
+
+    Event event = { now_ + delay, seq_++, packet, 0 };
+    events_.push(event);
+  }
+
+  return true;
+}
+
+void SimNetwork::Deliver(uint32_t packet) {
+  SimTransport* endpoint = endpoints_[packets_[packet].to];
+  if (!endpoint) {
+    // Closed while the datagram was in flight.
+    ++unreachable_;
+    FreePacket(packet);
+    return;
+  }
+
+  ++delivered_;
+  endpoint->Receive(packet);
+}
+
+SimTransport::SimTransport(SimNetwork* network)
+  : network_(network)
+  , index_(0)
+  , addr_len_(0)
+  , open_(false)
+  , handler_(nullptr) {
+  memset(&addr_, 0, sizeof addr_);
+  if (network_)
+    index_ = network_->Add(this);
+}
+
+SimTransport::~SimTransport() {
+  if (!network_)
+    return;
+
+  for (uint32_t packet : inbox_)
+    network_->FreePacket(packet);
+  if (open_)
+    network_->Unbind(this);
+  network_->Remove(this);
+}
+
+bool SimTransport::Open(const sockaddr* addr, socklen_t addr_len) {
+  if (open_ || !network_ || !network_->Bind(this, addr, addr_len, addr_))
+    return false;
+
+  addr_len_ = AddressLength(addr->sa_family);
+  open_ = true;
+  return true;
+}
+
+bool SimTransport::Send(const uint8_t* data, size_t size,
+                        const sockaddr* peer, socklen_t peer_len) {
+  if (!open_)
+    return false;
+  return network_->Send(this, data, size, peer, peer_len);
+}
+
+void SimTransport::Receive(uint32_t packet) {
+  if (!handler_) {
+    inbox_.push_back(packet);
+    return;
+  }
+
+  const SimNetwork::Packet& p = network_->packets_[packet];
+  Datagram dgram = { p.data, p.size,
+                     reinterpret_cast<const sockaddr*>(&p.from), p.from_len };
+  handler_->OnBatch(&dgram, 1);
+  network_->FreePacket(packet);
+}
+
+int SimTransport::Poll(Handler* handler, int timeout_ms) {
+  if (!open_)
+    return -1;
+
+  if (inbox_.empty() && timeout_ms != 0) {
+    uint64_t until = timeout_ms < 0
+        ? ~0ULL
+        : network_->now_ + uint64_t(timeout_ms) * 1000000;
+
+    while (inbox_.empty()) {
+      if (network_->idle() || network_->events_.top().when > until) {
+        if (timeout_ms > 0)
+          network_->now_ = std::max(network_->now_, until);
+        break;
+      }
+      network_->Step();
+    }
+  }
+
+  return DeliverInbox(handler);
+}
+
+int SimTransport::DeliverInbox(Handler* handler) {
+  int delivered = 0;
+  Datagram dgrams[kMaxBatch];
+  uint32_t packets[kMaxBatch];
+
+  // Handlers may send, and so get more delivered to this inbox (with
+  // Attach) or to the network: take a batch out before handing it over.
+  while (!inbox_.empty()) {
+    size_t n = std::min(inbox_.size(), kMaxBatch);
+    for (size_t i = 0; i < n; ++i) {
+      packets[i] = inbox_.front();
+      inbox_.pop_front();
+
+      const SimNetwork::Packet& p = network_->packets_[packets[i]];
+      dgrams[i].data = p.data;
+      dgrams[i].size = p.size;
+      dgrams[i].peer = reinterpret_cast<const sockaddr*>(&p.from);
+      dgrams[i].peer_len = p.from_len;
+    }
+
+    handler->OnBatch(dgrams, n);
+    for (size_t i = 0; i < n; ++i)
+      network_->FreePacket(packets[i]);
+    delivered += n;
+  }
+
+  return delivered;
+}
+
+}   // namespace net
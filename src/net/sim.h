@@ -0,0 +1,212 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_SIM_H_
+#define NET_SIM_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <deque>
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "net/transport.h"
+
+namespace net {
+
+// How a (one-way) link between two endpoints treats datagrams.  Each
+// datagram is lost with probability loss, or else delivered after
+// latency plus a uniform [0, jitter) delay, plus reorder_delay with
+// probability reorder, so that it is overtaken by later ones.  With
+// probability duplicate a second copy is delivered, delayed
+// independently.
+struct LinkConfig {
+  double loss;
+  uint64_t latency_ns;
+  uint64_t jitter_ns;
+  double reorder;
+  uint64_t reorder_delay_ns;
+  double duplicate;
+};
+
+// 100 us one way, nothing else.
+const LinkConfig kDefaultLink = { 0, 100000, 0, 0, 0, 0 };
+
+class SimTransport;
+
+// A simulated network of SimTransport endpoints, in one thread and in
+// virtual time.
+//
+// Sending schedules the delivery of a datagram; delivering it moves it
+// to the destination's inbox, or hands it straight to the endpoint's
+// handler if it has one (SimTransport::Attach).  Timers (At) run on
+// the same clock, so protocol code written against now() and At()
+// runs as fast as it can compute: time jumps from one event to the
+// next.
+//
+// Everything random comes from one generator seeded at construction,
+// and events due at the same time run in the order they were
+// scheduled: a simulation with the same seed and inputs replays
+// exactly.
+class SimNetwork {
+ public:
+  explicit SimNetwork(uint64_t seed, const LinkConfig& link = kDefaultLink);
+  ~SimNetwork();
+
+  // Override the default link from one endpoint to another (both
+  // open).
+  void SetLink(const SimTransport* from, const SimTransport* to,
+               const LinkConfig& link);
+
+  // Virtual time, ns since the start.
+  uint64_t now() const { return now_; }
+
+  // Call fn at virtual time when (now, if in the past).
+  void At(uint64_t when, const std::function<void()>& fn);
+
+  // Run the next event, moving the clock to its time.  Return false if
+  // there is none.
+  bool Step();
+
+  // Run events up to time t, then set the clock to t.
+  void RunUntil(uint64_t t);
+
+  // Run until there are no events left, or max_events have run.
+  // Return the number of events run.
+  uint64_t Run(uint64_t max_events = ~0ULL);
+
+  bool idle() const { return events_.empty(); }
+
+  // Counters
+  uint64_t sent() const { return sent_; }
+  uint64_t delivered() const { return delivered_; }
+  uint64_t lost() const { return lost_; }
+  uint64_t duplicated() const { return duplicated_; }
+  uint64_t unreachable() const { return unreachable_; }   // no endpoint
+  uint64_t events() const { return events_run_; }
+
+  // Uniform in [0, 1), and 64 random bits, from the network's
+  // generator (for protocol code that wants to stay deterministic).
+  double Uniform();
+  uint64_t Random();
+
+ private:
+  friend class SimTransport;
+
+  struct Packet {
+    uint8_t data[kMaxDatagramSize];
+    size_t size;
+    sockaddr_storage from;
+    socklen_t from_len;
+    uint32_t to;              // endpoint
+  };
+
+  struct Event {
+    uint64_t when;
+    uint64_t seq;
+    uint32_t packet;          // or kTimer
+    uint32_t timer;
+
+    bool operator> (const Event& other) const {
+      return when != other.when ? when > other.when : seq > other.seq;
+    }
+  };
+
+  static std::string Key(const sockaddr* addr);
+
+  bool Bind(SimTransport* endpoint, const sockaddr* addr,
+            socklen_t addr_len, sockaddr_storage& bound);
+  void Unbind(SimTransport* endpoint);
+  uint32_t Add(SimTransport* endpoint);
+  void Remove(SimTransport* endpoint);
+  bool Send(const SimTransport* from, const uint8_t* data, size_t size,
+            const sockaddr* to, socklen_t to_len);
+  void Deliver(uint32_t packet);
+  uint32_t AllocPacket();
+  void FreePacket(uint32_t packet) { free_packets_.push_back(packet); }
+
+ private:
+  static const uint32_t kTimer = ~0U;
+
+  const LinkConfig link_;
+  uint64_t rng_;
+  uint64_t now_;
+  uint64_t seq_;
+  uint16_t next_port_;
+
+  std::vector<SimTransport*> endpoints_;  // open or not, by index_
+  std::unordered_map<std::string, uint32_t> bound_;
+  std::unordered_map<uint64_t, LinkConfig> links_;
+
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>>
+      events_;
+  std::deque<Packet> packets_;        // stable while handlers run
+  std::vector<uint32_t> free_packets_;
+  std::vector<std::function<void()>> timers_;
+  std::vector<uint32_t> free_timers_;
+
+  uint64_t sent_;
+  uint64_t delivered_;
+  uint64_t lost_;
+  uint64_t duplicated_;
+  uint64_t unreachable_;
+  uint64_t events_run_;
+};
+
+// An endpoint of a SimNetwork, usable wherever a Transport is.
+//
+// Poll() hands over what is in the inbox.  If that is nothing and
+// timeout_ms is not 0, it first runs the network, in virtual time,
+// until something arrives or timeout_ms have passed (or, with -1,
+// until the network has nothing left to do).  Send() is immediate and
+// Flush() does nothing; there is no file descriptor.  An endpoint
+// outliving its network is closed: Open(), Send() and Poll() fail.
+class SimTransport : public Transport {
+ public:
+  explicit SimTransport(SimNetwork* network);
+  ~SimTransport();
+
+  // Any address works.  Port 0 gets an ephemeral port: see address().
+  bool Open(const sockaddr* addr, socklen_t addr_len);
+  int Poll(Handler* handler, int timeout_ms);
+  bool Send(const uint8_t* data, size_t size,
+            const sockaddr* peer, socklen_t peer_len);
+  bool Flush() { return true; }
+  bool Wake() { return true; }
+
+  Backend backend() const { return Backend::sim; }
+  int fd() const { return -1; }
+
+  // Have datagrams handed to handler as they are delivered, rather
+  // than queued until Poll().  nullptr to go back to queueing.
+  void Attach(Handler* handler) { handler_ = handler; }
+
+  const sockaddr* address() const {
+    return reinterpret_cast<const sockaddr*>(&addr_);
+  }
+  socklen_t address_len() const { return addr_len_; }
+
+  size_t pending() const { return inbox_.size(); }
+
+ private:
+  friend class SimNetwork;
+
+  void Receive(uint32_t packet);
+  int DeliverInbox(Handler* handler);
+
+ private:
+  SimNetwork* network_;
+  uint32_t index_;
+  sockaddr_storage addr_;
+  socklen_t addr_len_;
+  bool open_;
+  Handler* handler_;
+  std::deque<uint32_t> inbox_;        // packets
+};
+
+}   // namespace net
+
+#endif  // NET_SIM_H_
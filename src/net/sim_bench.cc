@@ -0,0 +1,248 @@
+// Copyleft 2013 tho@autistici.org
+
+// CoAP confirmable exchanges over a simulated lossy network.
+//
+// Thousands of clients each run a sequence of CON GETs against a few
+// servers, one at a time, with RFC 7252 retransmission (ACK_TIMEOUT 2 s
+// times a random factor in [1, 1.5), doubling, MAX_RETRANSMIT 4) driven
+// by virtual timers.  Requests and responses are coap::PDUs, encoded
+// and decoded on every hop.  Links lose, delay, jitter, reorder and
+// duplicate datagrams.  The bench reports how long the exchanges take
+// in virtual time, how long simulating them took, and what the
+// retransmissions did.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "coap/pdu.h"
+#include "utils/histogram.h"
+#include "net/sim.h"
+
+using namespace net;
+
+namespace {
+
+const uint64_t kAckTimeoutNs = 2000000000ULL;
+const int kMaxRetransmit = 4;
+
+sockaddr_in host_address(uint32_t host, uint16_t port) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(host);
+  return sin;
+}
+
+bool Decode(const Datagram& dgram, coap::PDU& pdu) {
+  return pdu.Decode(std::vector<uint8_t>(dgram.data,
+                                         dgram.data + dgram.size));
+}
+
+// Piggybacks a 2.05 with the request's token on every CON.
+class Server : public Handler {
+ public:
+  Server(SimNetwork* network, uint32_t host)
+    : transport_(network)
+    , requests_(0) {
+    sockaddr_in sin = host_address(host, 5683);
+    assert(transport_.Open(reinterpret_cast<sockaddr*>(&sin), sizeof sin));
+    transport_.Attach(this);
+  }
+
+  void OnDatagram(const Datagram& dgram) {
+    coap::PDU request;
+    if (!Decode(dgram, request) || request.type() != coap::Type::CON)
+      return;
+    ++requests_;
+
+    coap::PDU response;
+    response.set_type(coap::Type::ACK);
+    response.set_code(coap::Code::Content);
+    response.set_message_id(request.message_id());
+    response.set_token(request.token());
+    response.set_payload(std::vector<uint8_t>(16, 'x'));
+
+    std::vector<uint8_t> wire;
+    response.Encode(wire);
+    transport_.Send(wire.data(), wire.size(), dgram.peer, dgram.peer_len);
+  }
+
+  const sockaddr* address() const { return transport_.address(); }
+  socklen_t address_len() const { return transport_.address_len(); }
+  uint64_t requests() const { return requests_; }
+
+ private:
+  SimTransport transport_;
+  uint64_t requests_;
+};
+
+struct Totals {
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t retransmits;
+  uint64_t duplicates;
+  uint64_t last_done_ns;
+  utils::Histogram latency;
+};
+
+// Sends requests one after the other, retransmitting on timeout.
+class Client : public Handler {
+ public:
+  Client(SimNetwork* network, uint32_t host, const Server* server,
+         size_t requests, Totals* totals)
+    : network_(network)
+    , transport_(network)
+    , server_(server)
+    , left_(requests)
+    , mid_(network->Random())
+    , attempt_(0)
+    , started_ns_(0)
+    , totals_(totals) {
+    sockaddr_in sin = host_address(host, 0);
+    assert(transport_.Open(reinterpret_cast<sockaddr*>(&sin), sizeof sin));
+    transport_.Attach(this);
+  }
+
+  void Start() {
+    if (left_ == 0) {
+      totals_->last_done_ns = std::max(totals_->last_done_ns,
+                                       network_->now());
+      return;
+    }
+    --left_;
+    ++mid_;
+    attempt_ = 0;
+    started_ns_ = network_->now();
+
+    coap::PDU request;
+    request.set_type(coap::Type::CON);
+    request.set_code(coap::Code::GET);
+    request.set_message_id(mid_);
+    request.set_token({ uint8_t(mid_ >> 8), uint8_t(mid_) });
+    wire_.clear();
+    request.Encode(wire_);
+
+    timeout_ns_ = kAckTimeoutNs + network_->Uniform() * kAckTimeoutNs / 2;
+    Transmit();
+  }
+
+  void OnDatagram(const Datagram& dgram) {
+    coap::PDU response;
+    if (!Decode(dgram, response))
+      return;
+    if (response.message_id() != mid_ || attempt_ < 0) {
+      ++totals_->duplicates;
+      return;
+    }
+
+    attempt_ = -1;            // done: stale timers do nothing
+    ++totals_->completed;
+    totals_->latency.Record(network_->now() - started_ns_);
+    Start();
+  }
+
+ private:
+  void Transmit() {
+    transport_.Send(wire_.data(), wire_.size(), server_->address(),
+                    server_->address_len());
+
+    uint16_t mid = mid_;
+    int attempt = attempt_;
+    network_->At(network_->now() + (timeout_ns_ << attempt),
+                 [this, mid, attempt] { OnTimeout(mid, attempt); });
+  }
+
+  void OnTimeout(uint16_t mid, int attempt) {
+    if (mid != mid_ || attempt != attempt_)
+      return;
+
+    if (attempt_ == kMaxRetransmit) {
+      attempt_ = -1;
+      ++totals_->failed;
+      Start();
+      return;
+    }
+
+    ++attempt_;
+    ++totals_->retransmits;
+    Transmit();
+  }
+
+  SimNetwork* network_;
+  SimTransport transport_;
+  const Server* server_;
+  size_t left_;
+  uint16_t mid_;
+  int attempt_;
+  uint64_t started_ns_;
+  uint64_t timeout_ns_;
+  std::vector<uint8_t> wire_;
+  Totals* totals_;
+};
+
+void run(const char* label, const LinkConfig& link, size_t clients,
+         size_t servers, size_t requests) {
+  SimNetwork network(0x5EED, link);
+  Totals totals = { 0, 0, 0, 0, 0, utils::Histogram() };
+
+  std::vector<std::unique_ptr<Server>> s;
+  for (size_t i = 0; i < servers; ++i)
+    s.emplace_back(new Server(&network, 0x0A000001 + i));
+
+  std::vector<std::unique_ptr<Client>> c;
+  for (size_t i = 0; i < clients; ++i) {
+    c.emplace_back(new Client(&network, 0x0A010000 + i, s[i % servers].get(),
+                              requests, &totals));
+    Client* client = c.back().get();
+    // Start spread over the first second.
+    network.At(network.Random() % 1000000000, [client] { client->Start(); });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t events = network.Run();
+  double wall = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  double virt = totals.last_done_ns / 1e9;
+
+  printf("%s: %zu clients x %zu CON requests, %zu servers\n",
+         label, clients, requests, servers);
+  printf("  virtual %.3f s, wall %.3f s (%.0fx), %llu events "
+         "(%.0f/s)\n",
+         virt, wall, virt / wall, static_cast<unsigned long long>(events),
+         events / wall);
+  printf("  datagrams %llu sent, %llu lost, %llu duplicated\n",
+         static_cast<unsigned long long>(network.sent()),
+         static_cast<unsigned long long>(network.lost()),
+         static_cast<unsigned long long>(network.duplicated()));
+  printf("  %llu completed, %llu failed, %llu retransmits, "
+         "%llu stray responses\n",
+         static_cast<unsigned long long>(totals.completed),
+         static_cast<unsigned long long>(totals.failed),
+         static_cast<unsigned long long>(totals.retransmits),
+         static_cast<unsigned long long>(totals.duplicates));
+  totals.latency.Print(stdout, "  latency", 1e6, "ms");
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t clients = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000;
+  size_t requests = argc > 2 ? strtoul(argv[2], nullptr, 10) : 50;
+
+  LinkConfig clean = kDefaultLink;
+  clean.latency_ns = 10000000;
+
+  LinkConfig lossy = { 0.05, 10000000, 5000000, 0.01, 20000000, 0.01 };
+  LinkConfig bad = { 0.30, 50000000, 50000000, 0.05, 100000000, 0.05 };
+
+  run("clean", clean, clients, 10, requests);
+  run("lossy", lossy, clients, 10, requests);
+  run("bad", bad, clients, 10, requests);
+}
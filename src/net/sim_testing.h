@@ -0,0 +1,197 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_SIM_TESTING_H_
+#define NET_SIM_TESTING_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "coap/block.h"
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "net/sim.h"
+
+// What the unit tests of services on a SimNetwork share: addresses,
+// encoding requests, decoding what comes back, and a network with the
+// node under test and two endpoints on it.
+namespace net {
+namespace testing {
+
+typedef std::vector<uint8_t> Bytes;
+
+inline sockaddr_in address(uint32_t host, uint16_t port) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(host);
+  return sin;
+}
+
+inline const sockaddr* sa(const sockaddr_in& sin) {
+  return reinterpret_cast<const sockaddr*>(&sin);
+}
+
+// Unknown elective options kept, as a proxy relays them.
+inline coap::PDUView view(const Bytes& wire) {
+  coap::PDUView v;
+  assert(v.Decode(wire.data(), wire.size(), coap::UnknownOption::keep));
+  return v;
+}
+
+inline std::string token(const coap::PDUView& v) {
+  return std::string(reinterpret_cast<const char*>(v.token()),
+                     v.token_length());
+}
+
+inline std::string payload(const coap::PDUView& v) {
+  return std::string(reinterpret_cast<const char*>(v.payload()),
+                     v.payload_size());
+}
+
+// A message with path and query ('/' and '&' separated) as Uri-Path
+// and Uri-Query, on top of opts.
+inline Bytes Encode(coap::Type type, coap::Code code, uint16_t message_id,
+                    const std::string& token, const std::string& path,
+                    const std::string& query = "",
+                    const std::string& payload = "",
+                    coap::Options opts = coap::Options()) {
+  coap::PDU pdu;
+  pdu.set_type(type);
+  pdu.set_code(code);
+  pdu.set_message_id(message_id);
+  pdu.set_token(Bytes(token.begin(), token.end()));
+
+  for (size_t begin = 0; begin < path.size(); ) {
+    size_t end = path.find('/', begin);
+    if (end == std::string::npos)
+      end = path.size();
+    assert(opts.AddUriPath(path.substr(begin, end - begin)));
+    begin = end + 1;
+  }
+  for (size_t begin = 0; begin < query.size(); ) {
+    size_t end = query.find('&', begin);
+    if (end == std::string::npos)
+      end = query.size();
+    assert(opts.AddUriQuery(query.substr(begin, end - begin)));
+    begin = end + 1;
+  }
+  pdu.set_options(opts);
+  pdu.set_payload(Bytes(payload.begin(), payload.end()));
+
+  Bytes wire;
+  assert(pdu.Encode(wire));
+  return wire;
+}
+
+inline void SendEmpty(SimTransport& from, coap::Type type, uint16_t mid,
+                      const sockaddr_in& to) {
+  uint8_t msg[4] = { uint8_t((coap::Version::v1 << 6) | (type << 4)),
+                     coap::Code::Empty, uint8_t(mid >> 8), uint8_t(mid) };
+  assert(from.Send(msg, sizeof msg, sa(to), sizeof to));
+}
+
+// What an endpoint got, decoded.
+struct Response {
+  coap::Type type;
+  coap::Code code;
+  uint16_t message_id;
+  std::string token;
+  int64_t observe;                // -1 if none
+  int64_t content_format;         // -1 if none
+  std::string location;           // Location-Path segments, '/' joined
+  bool has_block;
+  coap::Block block;
+  std::string payload;
+  Bytes wire;
+};
+
+class Collector : public Handler {
+ public:
+  void OnDatagram(const Datagram& dgram) {
+    Response r;
+    r.wire.assign(dgram.data, dgram.data + dgram.size);
+    coap::PDUView v = view(r.wire);
+    r.type = v.type();
+    r.code = v.code();
+    r.message_id = v.message_id();
+    r.token = token(v);
+    r.observe = r.content_format = -1;
+    r.has_block = false;
+
+    coap::OptionCursor cursor = v.options();
+    size_t num;
+    const uint8_t* value;
+    size_t length;
+    while (cursor.Next(num, value, length)) {
+      int64_t n = 0;
+      for (size_t i = 0; i < length; ++i)
+        n = (n << 8) | value[i];
+      if (num == coap::OptionNumber::Observe) {
+        r.observe = n;
+      } else if (num == coap::OptionNumber::Content_Format) {
+        r.content_format = n;
+      } else if (num == coap::OptionNumber::Location_Path) {
+        if (!r.location.empty())
+          r.location += "/";
+        r.location.append(reinterpret_cast<const char*>(value), length);
+      } else if (num == coap::OptionNumber::Block2) {
+        r.has_block = coap::DecodeBlock(value, length, r.block);
+        assert(r.has_block);
+      }
+    }
+
+    r.payload = payload(v);
+    got.push_back(r);
+  }
+
+  std::vector<Response> got;
+};
+
+// The node under test at node_addr, on transport node, and two
+// endpoints, alice and bob, on at and bt.  The node's handler is the
+// derived fixture's to attach.
+struct SimFixture {
+  SimFixture()
+    : network(1)
+    , node(&network)
+    , at(&network)
+    , bt(&network)
+    , node_addr(address(0x0A000001, 5683))
+    , alice_addr(address(0x0A000002, 1000))
+    , bob_addr(address(0x0A000003, 1000)) {
+    assert(node.Open(sa(node_addr), sizeof node_addr));
+    assert(at.Open(sa(alice_addr), sizeof alice_addr));
+    assert(bt.Open(sa(bob_addr), sizeof bob_addr));
+    at.Attach(&alice);
+    bt.Attach(&bob);
+  }
+
+  // Send wire from an endpoint to the node and run the network dry.
+  void Send(SimTransport& from, const Bytes& wire) {
+    assert(from.Send(wire.data(), wire.size(), sa(node_addr),
+                     sizeof node_addr));
+    network.Run();
+  }
+
+  void SendEmpty(SimTransport& from, coap::Type type, uint16_t mid) {
+    testing::SendEmpty(from, type, mid, node_addr);
+    network.Run();
+  }
+
+  SimNetwork network;
+  SimTransport node, at, bt;
+  Collector alice, bob;
+  sockaddr_in node_addr, alice_addr, bob_addr;
+  uint16_t mid = 1;
+};
+
+}   // namespace testing
+}   // namespace net
+
+#endif  // NET_SIM_TESTING_H_
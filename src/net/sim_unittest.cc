@@ -0,0 +1,322 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "coap/pdu.h"
+#include "utils/log.h"
+#include "net/sim_testing.h"
+
+using namespace net;
+using namespace net::testing;
+
+void init_log() {
+  utils::Log::Instance()->Open("sim_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// Remember what arrived, and when.
+class Recorder : public Handler {
+ public:
+  explicit Recorder(SimNetwork* network) : network_(network) { }
+
+  void OnDatagram(const Datagram& dgram) {
+    seqs.push_back(dgram.data[0]);
+    times.push_back(network_->now());
+    peer_port = ntohs(reinterpret_cast<const sockaddr_in*>(dgram.peer)
+                      ->sin_port);
+  }
+
+  std::vector<uint8_t> seqs;
+  std::vector<uint64_t> times;
+  uint16_t peer_port;
+
+ private:
+  SimNetwork* network_;
+};
+
+// Send n one-byte datagrams, 1 us apart, from a to b; return what b
+// saw.
+std::vector<uint8_t> blast(uint64_t seed, const LinkConfig& link, size_t n,
+                           SimNetwork** stats = nullptr) {
+  static std::unique_ptr<SimNetwork> keep;
+  keep.reset(new SimNetwork(seed, link));
+  SimNetwork* network = keep.get();
+
+  SimTransport a(network), b(network);
+  sockaddr_in aa = address(0x0A000001, 1000), ba = address(0x0A000002, 2000);
+  assert(a.Open(sa(aa), sizeof aa));
+  assert(b.Open(sa(ba), sizeof ba));
+
+  Recorder recorder(network);
+  b.Attach(&recorder);
+
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t byte = i;
+    network->At(i * 1000, [&a, &ba, byte] {
+      assert(a.Send(&byte, 1, sa(ba), sizeof ba));
+    });
+  }
+  network->Run();
+
+  if (stats)
+    *stats = network;
+  return recorder.seqs;
+}
+
+void test_ok_latency() {
+  SimNetwork network(1);
+  SimTransport a(&network), b(&network);
+  sockaddr_in aa = address(0x0A000001, 1000), ba = address(0x0A000002, 2000);
+  assert(a.Open(sa(aa), sizeof aa));
+  assert(b.Open(sa(ba), sizeof ba));
+
+  uint8_t ping[4] = { 0x40, 0, 0x12, 0x34 };
+  assert(a.Send(ping, sizeof ping, sa(ba), sizeof ba));
+
+  // Nothing yet, and not blocking.
+  Recorder recorder(&network);
+  assert(b.Poll(&recorder, 0) == 0);
+  assert(network.now() == 0);
+
+  // Waiting moves the clock to the arrival.
+  assert(b.Poll(&recorder, -1) == 1);
+  assert(recorder.times[0] == kDefaultLink.latency_ns);
+  assert(recorder.peer_port == 1000);
+  assert(network.delivered() == 1 && network.sent() == 1);
+
+  // A timeout with nothing coming advances the clock by as much.
+  assert(b.Poll(&recorder, 5) == 0);
+  assert(network.now() == kDefaultLink.latency_ns + 5000000);
+  assert(b.Poll(&recorder, -1) == 0);
+}
+
+void test_ok_loss() {
+  LinkConfig link = kDefaultLink;
+  link.loss = 0.25;
+
+  SimNetwork* network;
+  std::vector<uint8_t> seen = blast(2, link, 4000, &network);
+  assert(seen.size() + network->lost() == 4000);
+  assert(seen.size() > 2800 && seen.size() < 3200);
+}
+
+void test_ok_duplicate() {
+  LinkConfig link = kDefaultLink;
+  link.duplicate = 0.1;
+
+  SimNetwork* network;
+  std::vector<uint8_t> seen = blast(3, link, 2000, &network);
+  assert(seen.size() == 2000 + network->duplicated());
+  assert(network->duplicated() > 150 && network->duplicated() < 250);
+}
+
+void test_ok_reorder() {
+  // No jitter: in order.
+  std::vector<uint8_t> seen = blast(4, kDefaultLink, 200);
+  for (size_t i = 0; i < seen.size(); ++i)
+    assert(seen[i] == uint8_t(i));
+
+  // Some datagrams are held back for 10 us, behind later ones.
+  LinkConfig link = kDefaultLink;
+  link.reorder = 0.2;
+  link.reorder_delay_ns = 10000;
+  seen = blast(4, link, 200);
+  assert(seen.size() == 200);
+
+  size_t inversions = 0;
+  for (size_t i = 1; i < seen.size(); ++i)
+    if (seen[i] < seen[i - 1])
+      ++inversions;
+  assert(inversions > 10);
+}
+
+void test_ok_deterministic() {
+  LinkConfig link = { 0.1, 50000, 20000, 0.1, 30000, 0.05 };
+  std::vector<uint8_t> first = blast(5, link, 1000);
+  assert(blast(5, link, 1000) == first);
+  assert(blast(6, link, 1000) != first);
+}
+
+void test_ok_per_link() {
+  SimNetwork network(7);
+  SimTransport a(&network), b(&network), c(&network);
+  sockaddr_in aa = address(0x0A000001, 1), ba = address(0x0A000002, 2),
+      ca = address(0x0A000003, 3);
+  assert(a.Open(sa(aa), sizeof aa));
+  assert(b.Open(sa(ba), sizeof ba));
+  assert(c.Open(sa(ca), sizeof ca));
+
+  LinkConfig slow = kDefaultLink;
+  slow.latency_ns = 1000000;
+  network.SetLink(&a, &c, slow);
+
+  uint8_t byte = 0;
+  assert(a.Send(&byte, 1, sa(ba), sizeof ba));
+  assert(a.Send(&byte, 1, sa(ca), sizeof ca));
+  assert(c.Send(&byte, 1, sa(aa), sizeof aa));
+
+  Recorder rb(&network), rc(&network), ra(&network);
+  assert(b.Poll(&rb, -1) == 1 && rb.times[0] == kDefaultLink.latency_ns);
+  assert(c.Poll(&rc, -1) == 1 && rc.times[0] == 1000000);
+  assert(a.pending() == 1 && a.Poll(&ra, 0) == 1);
+}
+
+void test_ok_ephemeral_and_unreachable() {
+  SimNetwork network(8);
+  SimTransport server(&network);
+  sockaddr_in any = address(INADDR_ANY, 5683);
+  assert(server.Open(sa(any), sizeof any));
+
+  // Clients on port 0 get distinct ports; the wildcard bind catches
+  // datagrams for any host.
+  std::vector<std::unique_ptr<SimTransport>> clients;
+  for (int i = 0; i < 3; ++i) {
+    clients.emplace_back(new SimTransport(&network));
+    sockaddr_in ca = address(0x0A000010, 0);
+    assert(clients.back()->Open(sa(ca), sizeof ca));
+  }
+  const sockaddr_in* c0 =
+      reinterpret_cast<const sockaddr_in*>(clients[0]->address());
+  const sockaddr_in* c1 =
+      reinterpret_cast<const sockaddr_in*>(clients[1]->address());
+  assert(ntohs(c0->sin_port) != 0 && c0->sin_port != c1->sin_port);
+
+  sockaddr_in target = address(0x0A000001, 5683);
+  uint8_t byte = 0;
+  for (auto& client : clients)
+    assert(client->Send(&byte, 1, sa(target), sizeof target));
+
+  // Nobody there.
+  sockaddr_in nowhere = address(0x0A000001, 9);
+  assert(clients[0]->Send(&byte, 1, sa(nowhere), sizeof nowhere));
+  assert(network.unreachable() == 1);
+
+  // Closed while in flight.
+  assert(server.Send(&byte, 1, sa(*c1), sizeof *c1));
+  clients.erase(clients.begin() + 1);
+  network.Run();
+  assert(network.unreachable() == 2);
+  assert(network.delivered() == 3);
+  assert(server.pending() == 3);
+
+  Recorder recorder(&network);
+  assert(server.Poll(&recorder, 0) == 3);
+}
+
+void test_ko_open() {
+  SimNetwork network(9);
+  SimTransport a(&network), b(&network);
+  sockaddr_in aa = address(0x0A000001, 1000);
+  assert(a.Open(sa(aa), sizeof aa));
+  assert(!a.Open(sa(aa), sizeof aa));
+  assert(!b.Open(sa(aa), sizeof aa));         // in use
+
+  sockaddr unix_addr;
+  memset(&unix_addr, 0, sizeof unix_addr);
+  unix_addr.sa_family = AF_UNIX;
+  assert(!b.Open(&unix_addr, sizeof unix_addr));
+
+  uint8_t big[kMaxDatagramSize + 1] = { 0 };
+  assert(!a.Send(big, sizeof big, sa(aa), sizeof aa));
+
+  assert(!NewTransport(Backend::sim));
+}
+
+void test_ko_network_gone() {
+  std::unique_ptr<SimNetwork> network(new SimNetwork(10));
+  SimTransport a(network.get()), b(network.get()), c(network.get());
+  sockaddr_in aa = address(0x0A000001, 1000), ba = address(0x0A000002, 2000);
+  assert(a.Open(sa(aa), sizeof aa));
+  assert(b.Open(sa(ba), sizeof ba));
+  uint8_t ping[4] = { 0x40, 0, 0x12, 0x34 };
+  assert(a.Send(ping, sizeof ping, sa(ba), sizeof ba));
+  network->Run();
+  assert(b.pending() == 1);
+
+  network.reset();
+  Recorder recorder(nullptr);
+  assert(!a.Send(ping, sizeof ping, sa(ba), sizeof ba));
+  assert(b.Poll(&recorder, 0) == -1 && b.Poll(&recorder, -1) == -1);
+  assert(b.pending() == 0 && recorder.seqs.empty());
+  assert(!c.Open(sa(aa), sizeof aa));
+}
+
+// A CON request and its piggybacked response, as PDUs.
+class PduEcho : public Handler {
+ public:
+  explicit PduEcho(Transport* t) : t_(t) { }
+
+  void OnDatagram(const Datagram& dgram) {
+    coap::PDU request;
+    assert(request.Decode(std::vector<uint8_t>(dgram.data,
+                                               dgram.data + dgram.size)));
+    coap::PDU response;
+    response.set_type(coap::Type::ACK);
+    response.set_code(coap::Code::Content);
+    response.set_message_id(request.message_id());
+    response.set_token(request.token());
+    response.set_payload(request.payload());
+
+    std::vector<uint8_t> wire;
+    assert(response.Encode(wire));
+    assert(t_->Send(wire.data(), wire.size(), dgram.peer, dgram.peer_len));
+  }
+
+ private:
+  Transport* t_;
+};
+
+void test_ok_pdu_round_trip() {
+  SimNetwork network(10);
+  SimTransport server(&network), client(&network);
+  sockaddr_in sa_ = address(0x0A000001, 5683), ca = address(0x0A000002, 0);
+  assert(server.Open(sa(sa_), sizeof sa_));
+  assert(client.Open(sa(ca), sizeof ca));
+
+  PduEcho echo(&server);
+  server.Attach(&echo);
+
+  coap::PDU request;
+  request.set_type(coap::Type::CON);
+  request.set_code(coap::Code::GET);
+  request.set_message_id(42);
+  request.set_token({ 1, 2 });
+  request.set_payload({ 'h', 'i' });
+  std::vector<uint8_t> wire;
+  assert(request.Encode(wire));
+  assert(client.Send(wire.data(), wire.size(), sa(sa_), sizeof sa_));
+
+  struct : public Handler {
+    void OnDatagram(const Datagram& dgram) {
+      assert(pdu.Decode(std::vector<uint8_t>(dgram.data,
+                                             dgram.data + dgram.size)));
+    }
+    coap::PDU pdu;
+  } received;
+
+  assert(client.Poll(&received, 1000) == 1);
+  assert(network.now() == 2 * kDefaultLink.latency_ns);
+  assert(received.pdu.message_id() == 42);
+  assert(received.pdu.code() == coap::Code::Content);
+  assert((received.pdu.payload() == std::vector<uint8_t>{ 'h', 'i' }));
+}
+
+int main() {
+  init_log();
+
+  test_ok_latency();
+  test_ok_loss();
+  test_ok_duplicate();
+  test_ok_reorder();
+  test_ok_deterministic();
+  test_ok_per_link();
+  test_ok_ephemeral_and_unreachable();
+  test_ok_pdu_round_trip();
+  test_ko_open();
+  test_ko_network_gone();
+}
@@ -0,0 +1,77 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "utils/log.h"
+#include "net/transport.h"
+#include "net/shm_ring.h"
+#include "net/udp_epoll.h"
+#include "net/udp_uring.h"
+
+namespace net {
+
+const char* BackendName(Backend backend) {
+  switch (backend) {
+    case Backend::any:
+      return "any";
+    case Backend::epoll:
+      return "epoll";
+    case Backend::uring:
+      return "io_uring";
+    case Backend::shm:
+      return "shm";
+    case Backend::sim:
+      return "sim";
+  }
+  return "unknown";
+}
+
+std::unique_ptr<Transport> NewTransport(Backend backend) {
+  utils::Log* L = utils::Log::Instance();
+
+  if (backend == Backend::sim) {
+    L->Debug("sim transports belong to a SimNetwork");
+    return nullptr;
+  }
+
+  if (backend == Backend::shm)
+    return std::unique_ptr<Transport>(new ShmTransport);
+
+  if (backend == Backend::uring || backend == Backend::any) {
+    std::unique_ptr<UringTransport> t(new UringTransport);
+    if (t->Init())
+      return std::unique_ptr<Transport>(std::move(t));
+    L->Debug("io_uring backend not available");
+    if (backend == Backend::uring)
+      return nullptr;
+  }
+
+  std::unique_ptr<EpollTransport> t(new EpollTransport);
+  if (t->Init())
+    return std::unique_ptr<Transport>(std::move(t));
+
+  return nullptr;
+}
+
+int OpenSocket(const sockaddr* addr, socklen_t addr_len) {
+  utils::Log* L = utils::Log::Instance();
+
+  int fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd == -1) {
+    L->Debug("socket: %s", strerror(errno));
+    return -1;
+  }
+
+  if (bind(fd, addr, addr_len) == -1) {
+    L->Debug("bind: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+}   // namespace net
@@ -0,0 +1,93 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_TRANSPORT_H_
+#define NET_TRANSPORT_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <memory>
+
+namespace net {
+
+// Largest datagram we are willing to receive or send.  Anything bigger
+// than this is silently dropped on ingress.
+const size_t kMaxDatagramSize = 1280;
+
+// A received datagram.  The bytes (and the peer address) are owned by
+// the transport and stay valid only until the handler returns.
+struct Datagram {
+  const uint8_t* data;
+  size_t size;
+  const sockaddr* peer;
+  socklen_t peer_len;
+};
+
+// Most datagrams handed to Handler::OnBatch() at once.
+const size_t kMaxBatch = 64;
+
+class Handler {
+ public:
+  virtual ~Handler() { }
+  virtual void OnDatagram(const Datagram& dgram) = 0;
+
+  // Up to kMaxBatch datagrams received together, so that handlers can
+  // look at all of them before processing any (see
+  // coap::PrevalidateHeaders).  Calls OnDatagram() on each by default.
+  virtual void OnBatch(const Datagram* dgrams, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      OnDatagram(dgrams[i]);
+  }
+};
+
+enum class Backend {
+  any,      // best available
+  epoll,    // epoll(7) + recvmmsg(2)/sendmmsg(2)
+  uring,    // io_uring(7) multishot recvmsg + registered buffers
+  shm,      // shared memory rings between local processes (AF_UNIX names)
+  sim       // simulated network (net/sim.h), not from NewTransport()
+};
+
+const char* BackendName(Backend backend);
+
+// A bound UDP endpoint.
+class Transport {
+ public:
+  virtual ~Transport() { }
+
+  // Create a socket and bind it to addr.
+  virtual bool Open(const sockaddr* addr, socklen_t addr_len) = 0;
+
+  // Wait up to timeout_ms (0 means don't block, -1 forever) for
+  // incoming datagrams and hand each of them to handler.  Return the
+  // number of datagrams delivered, or -1 on error.
+  virtual int Poll(Handler* handler, int timeout_ms) = 0;
+
+  // Queue a datagram for peer.  Bytes are copied, so the caller can
+  // reuse data as soon as Send returns.  Queued datagrams go out on
+  // Flush(), or earlier if the send batch fills up.
+  virtual bool Send(const uint8_t* data, size_t size,
+                    const sockaddr* peer, socklen_t peer_len) = 0;
+  virtual bool Flush() = 0;
+
+  // Make a Poll() blocked in another thread return early, or the next
+  // one if none is in progress.  This is the only method that may be
+  // called from any thread.
+  virtual bool Wake() = 0;
+
+  virtual Backend backend() const = 0;
+  virtual int fd() const = 0;
+};
+
+// Return a transport of the requested kind, or nullptr if it is not
+// available on this host.  Backend::any tries io_uring first and falls
+// back to epoll.
+std::unique_ptr<Transport> NewTransport(Backend backend);
+
+// Create a non-blocking UDP socket bound to addr (for the backends).
+// Return -1 on error.
+int OpenSocket(const sockaddr* addr, socklen_t addr_len);
+
+}   // namespace net
+
+#endif  // NET_TRANSPORT_H_
@@ -0,0 +1,145 @@
+// Copyleft 2013 tho@autistici.org
+
+// Loopback ping/RST throughput of the available transport backends.
+//
+// A client socket blasts windows of CoAP pings (empty CON) at the
+// transport, which decodes each of them in place and answers with a
+// RST; the client then collects the RSTs before sending the next
+// window.  Everything runs in one thread so that the numbers compare
+// the receive/send paths rather than the scheduler.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include "coap/view.h"
+#include "net/transport.h"
+
+using namespace net;
+
+class Pong : public Handler {
+ public:
+  explicit Pong(Transport* t) : t_(t), seen_(0) { }
+
+  void OnDatagram(const Datagram& dgram) {
+    coap::PDUView view;
+    if (!view.Decode(dgram.data, dgram.size))
+      return;
+    ++seen_;
+
+    uint8_t rst[4] = { 0x70, 0x00, dgram.data[2], dgram.data[3] };
+    t_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+  }
+
+  size_t seen() const { return seen_; }
+
+ private:
+  Transport* t_;
+  size_t seen_;
+};
+
+void run(Backend backend, size_t total, size_t window) {
+  std::unique_ptr<Transport> t = NewTransport(backend);
+
+  if (!t) {
+    printf("%-9s not available\n", BackendName(backend));
+    return;
+  }
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof addr;
+
+  assert(t->Open(reinterpret_cast<sockaddr*>(&addr), addr_len));
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&addr),
+                     &addr_len) == 0);
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(client != -1);
+  assert(connect(client, reinterpret_cast<sockaddr*>(&addr), addr_len) == 0);
+  timeval tv = { 0, 20000 };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+  std::vector<uint8_t> pings(window * 4);
+  std::vector<uint8_t> rsts(window * 16);
+  std::vector<mmsghdr> tx(window), rx(window);
+  std::vector<iovec> tx_iov(window), rx_iov(window);
+
+  for (size_t i = 0; i < window; ++i) {
+    tx_iov[i].iov_base = &pings[i * 4];
+    tx_iov[i].iov_len = 4;
+    memset(&tx[i], 0, sizeof tx[i]);
+    tx[i].msg_hdr.msg_iov = &tx_iov[i];
+    tx[i].msg_hdr.msg_iovlen = 1;
+
+    rx_iov[i].iov_base = &rsts[i * 16];
+    rx_iov[i].iov_len = 16;
+    memset(&rx[i], 0, sizeof rx[i]);
+    rx[i].msg_hdr.msg_iov = &rx_iov[i];
+    rx[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  Pong pong(t.get());
+  size_t lost = 0;
+  uint16_t mid = 0;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t done = 0; done < total; done += window) {
+    for (size_t i = 0; i < window; ++i, ++mid) {
+      uint8_t* p = &pings[i * 4];
+      p[0] = 0x40;
+      p[1] = 0x00;
+      p[2] = mid >> 8;
+      p[3] = mid & 0xFF;
+    }
+
+    assert(sendmmsg(client, tx.data(), window, 0) ==
+           static_cast<int>(window));
+
+    // Stop waiting as soon as the socket stays quiet for a while: past
+    // the socket buffer size, loopback drops like any other link.
+    size_t target = pong.seen() + window;
+    while (pong.seen() < target) {
+      int n = t->Poll(&pong, 10);
+      assert(n >= 0);
+      if (n == 0)
+        break;
+    }
+    t->Flush();
+
+    for (size_t got = 0; got < window; ) {
+      int n = recvmmsg(client, rx.data() + got, window - got,
+                       MSG_WAITFORONE, nullptr);
+      if (n <= 0) {
+        lost += window - got;
+        break;
+      }
+      got += n;
+    }
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%-9s %zu pings in %.3f s: %.0f msg/s (%zu lost)\n",
+         BackendName(t->backend()), total, elapsed.count(),
+         total / elapsed.count(), lost);
+
+  close(client);
+}
+
+int main(int argc, char* argv[]) {
+  size_t total = argc > 1 ? strtoul(argv[1], nullptr, 10) : 500000;
+  size_t window = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+
+  run(Backend::epoll, total, window);
+  run(Backend::uring, total, window);
+}
@@ -0,0 +1,238 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "net/transport.h"
+
+using namespace net;
+
+void init_log() {
+  utils::Log::Instance()->Open("transport_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+sockaddr_in loopback(uint16_t port) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return sin;
+}
+
+// Answer each GET with an ACK carrying the same message ID.
+class Responder : public Handler {
+ public:
+  explicit Responder(Transport* t) : t_(t), seen_(0) { }
+
+  void OnDatagram(const Datagram& dgram) {
+    coap::PDUView view;
+    assert(view.Decode(dgram.data, dgram.size));
+    assert(view.code() == coap::Code::GET);
+    ++seen_;
+
+    uint8_t ack[4] = {
+      0x60, coap::Code::Content,
+      dgram.data[2], dgram.data[3]
+    };
+    assert(t_->Send(ack, sizeof ack, dgram.peer, dgram.peer_len));
+  }
+
+  size_t seen() const { return seen_; }
+
+ private:
+  Transport* t_;
+  size_t seen_;
+};
+
+void test_ok_round_trip(Backend backend) {
+  std::unique_ptr<Transport> t = NewTransport(backend);
+
+  if (!t) {
+    std::cout << BackendName(backend) << ": not available, skipped\n";
+    return;
+  }
+  assert(t->backend() == backend);
+
+  sockaddr_in addr = loopback(0);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+
+  socklen_t addr_len = sizeof addr;
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&addr),
+                     &addr_len) == 0);
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(client != -1);
+  timeval tv = { 1, 0 };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+  const size_t npkts = 10;
+
+  for (size_t i = 0; i < npkts; ++i) {
+    coap::PDU pdu;
+    pdu.set_code(coap::Code::GET);
+    pdu.set_message_id(0x1000 + i);
+    coap::Options opts;
+    opts.AddUriPath("sensors");
+    pdu.set_options(opts);
+
+    std::vector<uint8_t> pkt;
+    assert(pdu.Encode(pkt));
+    assert(sendto(client, pkt.data(), pkt.size(), 0,
+                  reinterpret_cast<sockaddr*>(&addr), addr_len) ==
+           static_cast<ssize_t>(pkt.size()));
+  }
+
+  Responder responder(t.get());
+
+  for (int tries = 0; responder.seen() < npkts && tries < 100; ++tries)
+    assert(t->Poll(&responder, 10) >= 0);
+  assert(responder.seen() == npkts);
+  assert(t->Flush());
+
+  for (size_t i = 0; i < npkts; ++i) {
+    uint8_t buf[64];
+    ssize_t n = recv(client, buf, sizeof buf, 0);
+    assert(n == 4);
+
+    coap::PDU pdu;
+    assert(pdu.Decode(std::vector<uint8_t>(buf, buf + n)));
+    assert(pdu.type() == coap::Type::ACK);
+    assert(pdu.message_id() == 0x1000 + i);
+  }
+
+  // Big enough for the zero-copy path, where there is one.
+  std::vector<uint8_t> big(kMaxDatagramSize, 0xAB);
+  sockaddr_in peer;
+  socklen_t peer_len = sizeof peer;
+  assert(getsockname(client, reinterpret_cast<sockaddr*>(&peer),
+                     &peer_len) == 0);
+  assert(t->Send(big.data(), big.size(),
+                 reinterpret_cast<sockaddr*>(&peer), peer_len));
+  assert(t->Flush());
+
+  std::vector<uint8_t> buf(2 * kMaxDatagramSize);
+  assert(recv(client, buf.data(), buf.size(), 0) ==
+         static_cast<ssize_t>(big.size()));
+  assert(std::equal(big.begin(), big.end(), buf.begin()));
+
+  close(client);
+}
+
+void test_ok_wake(Backend backend) {
+  std::unique_ptr<Transport> t = NewTransport(backend);
+
+  if (!t)
+    return;
+
+  sockaddr_in addr = loopback(0);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+
+  Responder responder(t.get());
+
+  // A pending wake up makes the next Poll return straight away...
+  assert(t->Wake());
+  assert(t->Wake());
+  assert(t->Poll(&responder, -1) == 0);
+
+  // ... and it is consumed: this one times out.
+  auto start = std::chrono::steady_clock::now();
+  assert(t->Poll(&responder, 20) == 0);
+  assert(std::chrono::steady_clock::now() - start >=
+         std::chrono::milliseconds(15));
+
+  // Wake from another thread while blocked.
+  std::thread waker([&t] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(t->Wake());
+  });
+  assert(t->Poll(&responder, -1) == 0);
+  waker.join();
+
+  assert(responder.seen() == 0);
+}
+
+// Datagrams sent before polling come in batches, intact.
+class Batcher : public Handler {
+ public:
+  Batcher() : batches_(0), seen_(kBurst, false) { }
+
+  static const size_t kBurst = 200;
+
+  void OnDatagram(const Datagram&) { assert(false); }
+
+  void OnBatch(const Datagram* dgrams, size_t n) {
+    assert(n > 0 && n <= kMaxBatch);
+    ++batches_;
+    for (size_t i = 0; i < n; ++i) {
+      assert(dgrams[i].size == 2);
+      size_t k = dgrams[i].data[0] << 8 | dgrams[i].data[1];
+      assert(k < kBurst && !seen_[k]);
+      seen_[k] = true;
+    }
+  }
+
+  size_t seen() const { return std::count(seen_.begin(), seen_.end(), true); }
+
+  size_t batches_;
+  std::vector<bool> seen_;
+};
+
+void test_ok_batch(Backend backend) {
+  std::unique_ptr<Transport> t = NewTransport(backend);
+
+  if (!t)
+    return;
+
+  sockaddr_in addr = loopback(0);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+  socklen_t addr_len = sizeof addr;
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&addr),
+                     &addr_len) == 0);
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(client != -1);
+
+  for (size_t k = 0; k < Batcher::kBurst; ++k) {
+    uint8_t pkt[2] = { static_cast<uint8_t>(k >> 8), static_cast<uint8_t>(k) };
+    assert(sendto(client, pkt, sizeof pkt, 0,
+                  reinterpret_cast<sockaddr*>(&addr), addr_len) == 2);
+  }
+
+  Batcher batcher;
+  for (int tries = 0; batcher.seen() < Batcher::kBurst && tries < 100; ++tries)
+    assert(t->Poll(&batcher, 10) >= 0);
+  assert(batcher.seen() == Batcher::kBurst);
+  assert(batcher.batches_ < Batcher::kBurst / 2);
+
+  close(client);
+}
+
+void test_ok_any() {
+  std::unique_ptr<Transport> t = NewTransport(Backend::any);
+  assert(t);
+}
+
+int main() {
+  init_log();
+
+  test_ok_round_trip(Backend::epoll);
+  test_ok_round_trip(Backend::uring);
+  test_ok_wake(Backend::epoll);
+  test_ok_wake(Backend::uring);
+  test_ok_batch(Backend::epoll);
+  test_ok_batch(Backend::uring);
+  test_ok_any();
+}
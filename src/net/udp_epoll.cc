@@ -0,0 +1,212 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "utils/log.h"
+#include "net/udp_epoll.h"
+
+namespace net {
+
+EpollTransport::EpollTransport()
+  : fd_(-1)
+  , epfd_(-1)
+  , wake_fd_(-1)
+  , rx_bufs_(kBatchSize * kMaxDatagramSize)
+  , tx_bufs_(kBatchSize * kMaxDatagramSize)
+  , tx_count_(0) {
+  memset(rx_msgs_, 0, sizeof rx_msgs_);
+  memset(tx_msgs_, 0, sizeof tx_msgs_);
+
+  for (size_t i = 0; i < kBatchSize; ++i) {
+    rx_iov_[i].iov_base = &rx_bufs_[i * kMaxDatagramSize];
+    rx_iov_[i].iov_len = kMaxDatagramSize;
+    rx_msgs_[i].msg_hdr.msg_iov = &rx_iov_[i];
+    rx_msgs_[i].msg_hdr.msg_iovlen = 1;
+    rx_msgs_[i].msg_hdr.msg_name = &rx_peers_[i];
+
+    tx_iov_[i].iov_base = &tx_bufs_[i * kMaxDatagramSize];
+    tx_msgs_[i].msg_hdr.msg_iov = &tx_iov_[i];
+    tx_msgs_[i].msg_hdr.msg_iovlen = 1;
+    tx_msgs_[i].msg_hdr.msg_name = &tx_peers_[i];
+  }
+}
+
+EpollTransport::~EpollTransport() {
+  if (fd_ != -1)
+    close(fd_);
+  if (epfd_ != -1)
+    close(epfd_);
+  if (wake_fd_ != -1)
+    close(wake_fd_);
+}
+
+bool EpollTransport::Init() {
+  utils::Log* L = utils::Log::Instance();
+
+  if ((epfd_ = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    L->Debug("epoll_create1: %s", strerror(errno));
+    return false;
+  }
+
+  if ((wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    L->Debug("eventfd: %s", strerror(errno));
+    return false;
+  }
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = wake_fd_;
+
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &ev) == -1) {
+    L->Debug("epoll_ctl: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+bool EpollTransport::Open(const sockaddr* addr, socklen_t addr_len) {
+  if ((fd_ = OpenSocket(addr, addr_len)) == -1)
+    return false;
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd_;
+
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd_, &ev) == -1) {
+    utils::Log::Instance()->Debug("epoll_ctl: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+int EpollTransport::Poll(Handler* handler, int timeout_ms) {
+  utils::Log* L = utils::Log::Instance();
+
+  epoll_event evs[2];
+  int n = epoll_wait(epfd_, evs, 2, timeout_ms);
+
+  if (n == -1) {
+    if (errno == EINTR)
+      return 0;
+    L->Debug("epoll_wait: %s", strerror(errno));
+    return -1;
+  }
+
+  bool readable = false;
+
+  for (int i = 0; i < n; ++i) {
+    if (evs[i].data.fd == fd_) {
+      readable = true;
+    } else {
+      uint64_t count;
+      while (read(wake_fd_, &count, sizeof count) == -1 && errno == EINTR) { }
+    }
+  }
+
+  if (!readable)
+    return 0;
+
+  int delivered = 0;
+
+  for (size_t round = 0; round < kMaxRounds; ++round) {
+    for (size_t i = 0; i < kBatchSize; ++i)
+      rx_msgs_[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+
+    int got = recvmmsg(fd_, rx_msgs_, kBatchSize, MSG_DONTWAIT, nullptr);
+
+    if (got == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
+      L->Debug("recvmmsg: %s", strerror(errno));
+      return -1;
+    }
+
+    Datagram batch[kBatchSize];
+    size_t n = 0;
+
+    for (int i = 0; i < got; ++i) {
+      const msghdr& hdr = rx_msgs_[i].msg_hdr;
+
+      if (hdr.msg_flags & MSG_TRUNC)
+        continue;
+
+      Datagram& dgram = batch[n++];
+      dgram.data = static_cast<const uint8_t*>(rx_iov_[i].iov_base);
+      dgram.size = rx_msgs_[i].msg_len;
+      dgram.peer = static_cast<const sockaddr*>(hdr.msg_name);
+      dgram.peer_len = hdr.msg_namelen;
+    }
+
+    if (n > 0)
+      handler->OnBatch(batch, n);
+    delivered += n;
+
+    if (static_cast<size_t>(got) < kBatchSize)
+      break;
+  }
+
+  return delivered;
+}
+
+bool EpollTransport::Send(const uint8_t* data, size_t size,
+                          const sockaddr* peer, socklen_t peer_len) {
+  if (size > kMaxDatagramSize || peer_len > sizeof(sockaddr_storage))
+    return false;
+
+  if (tx_count_ == kBatchSize && !Flush())
+    return false;
+
+  memcpy(tx_iov_[tx_count_].iov_base, data, size);
+  tx_iov_[tx_count_].iov_len = size;
+  memcpy(&tx_peers_[tx_count_], peer, peer_len);
+  tx_msgs_[tx_count_].msg_hdr.msg_namelen = peer_len;
+  ++tx_count_;
+
+  return true;
+}
+
+bool EpollTransport::Flush() {
+  size_t sent = 0;
+
+  while (sent < tx_count_) {
+    int n = sendmmsg(fd_, tx_msgs_ + sent, tx_count_ - sent, 0);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      // Socket buffer is full: what is left is dropped, as the network
+      // would do.
+      utils::Log::Instance()->Debug("sendmmsg: %s (%zu dropped)",
+                                    strerror(errno), tx_count_ - sent);
+      tx_count_ = 0;
+      return false;
+    }
+
+    sent += n;
+  }
+
+  tx_count_ = 0;
+  return true;
+}
+
+bool EpollTransport::Wake() {
+  uint64_t one = 1;
+
+  // EAGAIN means the counter is saturated: a wake up is pending anyway.
+  if (write(wake_fd_, &one, sizeof one) == -1 && errno != EAGAIN) {
+    utils::Log::Instance()->Debug("eventfd write: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+}   // namespace net
@@ -0,0 +1,61 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_UDP_EPOLL_H_
+#define NET_UDP_EPOLL_H_
+
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "net/transport.h"
+
+namespace net {
+
+// Readiness based transport: epoll_wait(2) tells when the socket is
+// readable, then datagrams are pulled kBatchSize at a time with
+// recvmmsg(2) and handed to Handler::OnBatch() together.  Outgoing
+// datagrams are batched for sendmmsg(2).  Wake() writes to an
+// eventfd(2) that sits in the same epoll set.
+class EpollTransport : public Transport {
+ public:
+  EpollTransport();
+  ~EpollTransport();
+
+  bool Init();
+
+  bool Open(const sockaddr* addr, socklen_t addr_len);
+  int Poll(Handler* handler, int timeout_ms);
+  bool Send(const uint8_t* data, size_t size,
+            const sockaddr* peer, socklen_t peer_len);
+  bool Flush();
+  bool Wake();
+
+  Backend backend() const { return Backend::epoll; }
+  int fd() const { return fd_; }
+
+ private:
+  static const size_t kBatchSize = kMaxBatch;
+
+  // Max number of recvmmsg rounds per Poll, so that a busy socket
+  // can't starve the caller.
+  static const size_t kMaxRounds = 4;
+
+  int fd_;
+  int epfd_;
+  int wake_fd_;
+
+  std::vector<uint8_t> rx_bufs_;
+  mmsghdr rx_msgs_[kBatchSize];
+  iovec rx_iov_[kBatchSize];
+  sockaddr_storage rx_peers_[kBatchSize];
+
+  std::vector<uint8_t> tx_bufs_;
+  mmsghdr tx_msgs_[kBatchSize];
+  iovec tx_iov_[kBatchSize];
+  sockaddr_storage tx_peers_[kBatchSize];
+  size_t tx_count_;
+};
+
+}   // namespace net
+
+#endif  // NET_UDP_EPOLL_H_
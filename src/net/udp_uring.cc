@@ -0,0 +1,574 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "utils/log.h"
+#include "net/udp_uring.h"
+
+namespace net {
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, void* arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 arg, argsz);
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Shared ring indices are written by one side and read by the other.
+unsigned load_acquire(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename Tp>
+void store_release(Tp* p, Tp v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+void* map_anonymous(size_t len) {
+  void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+}   // namespace
+
+UringTransport::UringTransport()
+  : ring_fd_(-1)
+  , fd_(-1)
+  , batch_size_(0)
+  , ring_ptr_(nullptr)
+  , ring_len_(0)
+  , sqes_(nullptr)
+  , sqes_len_(0)
+  , sq_head_(nullptr)
+  , sq_tail_(nullptr)
+  , sq_array_(nullptr)
+  , sq_mask_(0)
+  , sq_entries_(0)
+  , sq_local_tail_(0)
+  , cq_head_(nullptr)
+  , cq_tail_(nullptr)
+  , cq_mask_(0)
+  , cqes_(nullptr)
+  , buf_ring_(nullptr)
+  , buf_ring_len_(0)
+  , rx_slab_(nullptr)
+  , buf_ring_tail_(0)
+  , recv_armed_(false)
+  , wake_fd_(-1)
+  , wake_armed_(false)
+  , tx_slab_(nullptr)
+  , tx_peers_(kSendSlots)
+  , tx_msgs_(kSendSlots)
+  , tx_iov_(kSendSlots) {
+  memset(&rx_msg_, 0, sizeof rx_msg_);
+}
+
+UringTransport::~UringTransport() {
+  if (fd_ != -1)
+    close(fd_);
+  if (ring_fd_ != -1)
+    close(ring_fd_);
+  if (wake_fd_ != -1)
+    close(wake_fd_);
+  if (ring_ptr_)
+    munmap(ring_ptr_, ring_len_);
+  if (sqes_)
+    munmap(sqes_, sqes_len_);
+  if (buf_ring_)
+    munmap(buf_ring_, buf_ring_len_);
+  if (rx_slab_)
+    munmap(rx_slab_, kRecvBuffers * kRecvBufferSize);
+  if (tx_slab_)
+    munmap(tx_slab_, kSendSlots * kMaxDatagramSize);
+}
+
+bool UringTransport::Init() {
+  if (!SetupRings() || !SupportsOps() || !SetupRecvBuffers() ||
+      !SetupSendBuffers())
+    return false;
+
+  if ((wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    utils::Log::Instance()->Debug("eventfd: %s", strerror(errno));
+    return false;
+  }
+
+  return ArmWake();
+}
+
+bool UringTransport::SetupRings() {
+  utils::Log* L = utils::Log::Instance();
+
+  // Multishot receive posts one CQE per datagram: give the CQ plenty
+  // of room with respect to the SQ.
+  io_uring_params p;
+  memset(&p, 0, sizeof p);
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = kRingEntries * 8;
+
+  if ((ring_fd_ = io_uring_setup(kRingEntries, &p)) == -1) {
+    L->Debug("io_uring_setup: %s", strerror(errno));
+    return false;
+  }
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    L->Debug("io_uring lacks required features (0x%x)", p.features);
+    return false;
+  }
+
+  ring_len_ = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                       p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+  ring_ptr_ = mmap(nullptr, ring_len_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (ring_ptr_ == MAP_FAILED) {
+    ring_ptr_ = nullptr;
+    L->Debug("mmap (rings): %s", strerror(errno));
+    return false;
+  }
+
+  sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    L->Debug("mmap (sqes): %s", strerror(errno));
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  uint8_t* base = static_cast<uint8_t*>(ring_ptr_);
+
+  sq_head_ = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+  sq_array_ = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+  sq_mask_ = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  sq_local_tail_ = *sq_tail_;
+
+  cq_head_ = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+
+  return true;
+}
+
+bool UringTransport::SupportsOps() const {
+  utils::Log* L = utils::Log::Instance();
+
+  const unsigned nops = 256;
+  std::vector<uint8_t> mem(sizeof(io_uring_probe) +
+                           nops * sizeof(io_uring_probe_op));
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(mem.data());
+
+  if (io_uring_register(ring_fd_, IORING_REGISTER_PROBE, probe, nops) == -1) {
+    L->Debug("io_uring_register (probe): %s", strerror(errno));
+    return false;
+  }
+
+  const unsigned needed[] = {
+    IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_SEND_ZC,
+    IORING_OP_POLL_ADD
+  };
+
+  for (auto op : needed) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      L->Debug("io_uring opcode %u not supported", op);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool UringTransport::SetupRecvBuffers() {
+  utils::Log* L = utils::Log::Instance();
+
+  buf_ring_len_ = kRecvBuffers * sizeof(io_uring_buf);
+  buf_ring_ = static_cast<io_uring_buf_ring*>(map_anonymous(buf_ring_len_));
+  rx_slab_ = static_cast<uint8_t*>(
+      map_anonymous(kRecvBuffers * kRecvBufferSize));
+
+  if (!buf_ring_ || !rx_slab_) {
+    L->Debug("mmap (receive buffers): %s", strerror(errno));
+    return false;
+  }
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+  reg.ring_entries = kRecvBuffers;
+  reg.bgid = kBufferGroup;
+
+  if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    L->Debug("io_uring_register (pbuf ring): %s", strerror(errno));
+    return false;
+  }
+
+  for (unsigned bid = 0; bid < kRecvBuffers; ++bid)
+    RecycleBuffer(bid);
+  store_release(&buf_ring_->tail, buf_ring_tail_);
+
+  // Template for the multishot receive.  Each buffer is laid out as:
+  // io_uring_recvmsg_out | peer address | payload.
+  rx_msg_.msg_namelen = sizeof(sockaddr_storage);
+
+  return true;
+}
+
+bool UringTransport::SetupSendBuffers() {
+  utils::Log* L = utils::Log::Instance();
+
+  iovec iov;
+  iov.iov_len = kSendSlots * kMaxDatagramSize;
+  iov.iov_base = tx_slab_ = static_cast<uint8_t*>(map_anonymous(iov.iov_len));
+
+  if (!tx_slab_) {
+    L->Debug("mmap (send buffers): %s", strerror(errno));
+    return false;
+  }
+
+  // Register the whole slab as fixed buffer 0: slots are sub-ranges.
+  if (io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+    L->Debug("io_uring_register (buffers): %s", strerror(errno));
+    return false;
+  }
+
+  for (unsigned slot = kSendSlots; slot > 0; --slot)
+    tx_free_.push_back(slot - 1);
+
+  return true;
+}
+
+bool UringTransport::Open(const sockaddr* addr, socklen_t addr_len) {
+  if ((fd_ = OpenSocket(addr, addr_len)) == -1)
+    return false;
+
+  return ArmRecv();
+}
+
+io_uring_sqe* UringTransport::GetSqe() {
+  // Make room by submitting if the kernel hasn't caught up yet.
+  if (sq_local_tail_ - load_acquire(sq_head_) >= sq_entries_ &&
+      Enter(0, 0) == -1)
+    return nullptr;
+
+  if (sq_local_tail_ - load_acquire(sq_head_) >= sq_entries_)
+    return nullptr;
+
+  unsigned idx = sq_local_tail_ & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof *sqe);
+  sq_array_[idx] = idx;
+
+  // Publishing the tail before the entry is filled in is fine: the
+  // kernel only looks at the SQ when we call io_uring_enter.
+  store_release(sq_tail_, ++sq_local_tail_);
+
+  return sqe;
+}
+
+// Submit everything queued so far and optionally wait for at least
+// min_complete completions, for no longer than timeout_ms.
+int UringTransport::Enter(unsigned min_complete, int timeout_ms) {
+  unsigned to_submit = sq_local_tail_ - load_acquire(sq_head_);
+  unsigned flags = 0;
+  void* arg = nullptr;
+  size_t argsz = 0;
+
+  __kernel_timespec ts;
+  io_uring_getevents_arg ext;
+
+  if (min_complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+      memset(&ext, 0, sizeof ext);
+      ext.ts = reinterpret_cast<uint64_t>(&ts);
+      flags |= IORING_ENTER_EXT_ARG;
+      arg = &ext;
+      argsz = sizeof ext;
+    } else {
+      argsz = _NSIG / 8;
+    }
+  }
+
+  if (to_submit == 0 && min_complete == 0)
+    return 0;
+
+  int r = io_uring_enter(ring_fd_, to_submit, min_complete, flags, arg, argsz);
+
+  if (r == -1) {
+    if (errno == ETIME || errno == EINTR || errno == EBUSY ||
+        errno == EAGAIN)
+      return 0;
+    utils::Log::Instance()->Debug("io_uring_enter: %s", strerror(errno));
+  }
+
+  return r;
+}
+
+bool UringTransport::ArmRecv() {
+  io_uring_sqe* sqe = GetSqe();
+
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&rx_msg_);
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = kRecvTag;
+
+  recv_armed_ = true;
+
+  return true;
+}
+
+bool UringTransport::ArmWake() {
+  io_uring_sqe* sqe = GetSqe();
+
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = wake_fd_;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = kWakeTag;
+
+  wake_armed_ = true;
+
+  return true;
+}
+
+int UringTransport::Poll(Handler* handler, int timeout_ms) {
+  bool ready = load_acquire(cq_tail_) != *cq_head_;
+
+  if (Enter(ready || timeout_ms == 0 ? 0 : 1, timeout_ms) == -1)
+    return -1;
+
+  int delivered = Reap(handler);
+
+  // Multishot receive stops when it runs out of buffers (or on error):
+  // buffers have just been given back, so re-arm it.
+  if (!recv_armed_ && (!ArmRecv() || Enter(0, 0) == -1))
+    return -1;
+
+  if (!wake_armed_ && (!ArmWake() || Enter(0, 0) == -1))
+    return -1;
+
+  return delivered;
+}
+
+int UringTransport::Reap(Handler* handler) {
+  int delivered = 0;
+  unsigned head = *cq_head_;
+  unsigned tail = load_acquire(cq_tail_);
+
+  for (; head != tail; ++head) {
+    const io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+
+    if (cqe->user_data == kRecvTag) {
+      OnRecv(cqe);
+      if (batch_size_ == kMaxBatch) {
+        delivered += batch_size_;
+        DeliverBatch(handler);
+      }
+    } else if (cqe->user_data == kWakeTag) {
+      OnWake(cqe);
+    } else if (cqe->user_data & kSendTag) {
+      OnSend(cqe);
+    }
+  }
+
+  delivered += batch_size_;
+  DeliverBatch(handler);
+
+  store_release(cq_head_, head);
+  store_release(&buf_ring_->tail, buf_ring_tail_);
+
+  return delivered;
+}
+
+void UringTransport::OnRecv(const io_uring_cqe* cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    recv_armed_ = false;
+
+  if (cqe->res < 0) {
+    if (cqe->res != -ENOBUFS)
+      utils::Log::Instance()->Debug("recvmsg: %s", strerror(-cqe->res));
+    return;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return;
+
+  uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  uint8_t* buf = rx_slab_ + bid * kRecvBufferSize;
+  const io_uring_recvmsg_out* out =
+      reinterpret_cast<const io_uring_recvmsg_out*>(buf);
+
+  if (out->flags & MSG_TRUNC || out->payloadlen > kMaxDatagramSize) {
+    RecycleBuffer(bid);
+    return;
+  }
+
+  // The buffer stays ours until the batch is delivered.
+  Datagram& dgram = batch_[batch_size_];
+  dgram.peer = reinterpret_cast<const sockaddr*>(buf + sizeof *out);
+  dgram.peer_len = std::min<socklen_t>(out->namelen, rx_msg_.msg_namelen);
+  dgram.data = buf + sizeof *out + rx_msg_.msg_namelen +
+               rx_msg_.msg_controllen;
+  dgram.size = out->payloadlen;
+  batch_bids_[batch_size_++] = bid;
+}
+
+void UringTransport::DeliverBatch(Handler* handler) {
+  if (batch_size_ == 0)
+    return;
+
+  handler->OnBatch(batch_, batch_size_);
+
+  for (size_t i = 0; i < batch_size_; ++i)
+    RecycleBuffer(batch_bids_[i]);
+  batch_size_ = 0;
+}
+
+void UringTransport::OnSend(const io_uring_cqe* cqe) {
+  uint16_t slot = cqe->user_data & 0xFFFF;
+
+  // A plain send completes once.  A zero-copy send completes twice:
+  // first with the result (F_MORE set), then with F_NOTIF once the
+  // kernel is done with the buffer; if it failed early there is no
+  // notification.
+  if (cqe->flags & IORING_CQE_F_NOTIF) {
+    tx_free_.push_back(slot);
+    return;
+  }
+
+  if (cqe->res < 0)
+    utils::Log::Instance()->Debug("send: %s", strerror(-cqe->res));
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    tx_free_.push_back(slot);
+}
+
+void UringTransport::OnWake(const io_uring_cqe* cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    wake_armed_ = false;
+
+  // Reset the counter, or the poll would fire again straight away.
+  uint64_t count;
+  while (read(wake_fd_, &count, sizeof count) == -1 && errno == EINTR) { }
+}
+
+void UringTransport::RecycleBuffer(uint16_t bid) {
+  // Don't go through buf_ring_->bufs: in C++ the empty struct that
+  // __DECLARE_FLEX_ARRAY puts in front of it takes up space and shifts
+  // the array by 8 bytes.  The ring is a plain io_uring_buf array whose
+  // first entry overlays the tail.
+  io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buf_ring_);
+  io_uring_buf* buf = &bufs[buf_ring_tail_ & (kRecvBuffers - 1)];
+
+  buf->addr = reinterpret_cast<uint64_t>(rx_slab_ + bid * kRecvBufferSize);
+  buf->len = kRecvBufferSize;
+  buf->bid = bid;
+
+  // Published in bulk by Reap().
+  ++buf_ring_tail_;
+}
+
+bool UringTransport::Send(const uint8_t* data, size_t size,
+                          const sockaddr* peer, socklen_t peer_len) {
+  if (size > kMaxDatagramSize || peer_len > sizeof(sockaddr_storage))
+    return false;
+
+  // All registered slots are in flight: don't wait for the kernel to
+  // hand one back, send a plain copy instead.
+  if (tx_free_.empty()) {
+    Flush();
+    return sendto(fd_, data, size, 0, peer, peer_len) ==
+           static_cast<ssize_t>(size);
+  }
+
+  io_uring_sqe* sqe = GetSqe();
+
+  if (!sqe)
+    return false;
+
+  uint16_t slot = tx_free_.back();
+  tx_free_.pop_back();
+
+  uint8_t* buf = tx_slab_ + slot * kMaxDatagramSize;
+  memcpy(buf, data, size);
+  memcpy(&tx_peers_[slot], peer, peer_len);
+
+  sqe->fd = fd_;
+  sqe->user_data = kSendTag | slot;
+
+  if (size >= kZeroCopyThreshold) {
+    sqe->opcode = IORING_OP_SEND_ZC;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = size;
+    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = 0;
+    sqe->addr2 = reinterpret_cast<uint64_t>(&tx_peers_[slot]);
+    sqe->addr_len = peer_len;
+  } else {
+    msghdr* msg = &tx_msgs_[slot];
+    tx_iov_[slot].iov_base = buf;
+    tx_iov_[slot].iov_len = size;
+    msg->msg_name = &tx_peers_[slot];
+    msg->msg_namelen = peer_len;
+    msg->msg_iov = &tx_iov_[slot];
+    msg->msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+  }
+
+  return true;
+}
+
+bool UringTransport::Flush() {
+  return Enter(0, 0) != -1;
+}
+
+bool UringTransport::Wake() {
+  uint64_t one = 1;
+
+  // EAGAIN means the counter is saturated: a wake up is pending anyway.
+  if (write(wake_fd_, &one, sizeof one) == -1 && errno != EAGAIN) {
+    utils::Log::Instance()->Debug("eventfd write: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+}   // namespace net
@@ -0,0 +1,129 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef NET_UDP_URING_H_
+#define NET_UDP_URING_H_
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "net/transport.h"
+
+namespace net {
+
+// Completion based transport on top of the raw io_uring(7) interface.
+//
+// A single multishot IORING_OP_RECVMSG stays armed on the socket and
+// the kernel writes each datagram straight into a buffer picked from a
+// registered provided-buffer ring: Datagram::data points into that
+// buffer, which is handed back to the kernel once the handler returns.
+// The datagrams found in one pass over the completion queue go to
+// Handler::OnBatch() together.
+//
+// Outgoing datagrams are copied into a slab registered with
+// IORING_REGISTER_BUFFERS.  Big ones are sent with IORING_OP_SEND_ZC
+// straight from there and their slot is recycled when the zero-copy
+// notification comes back.  Small ones go through IORING_OP_SENDMSG:
+// zero-copy skbs are charged a full page each, which makes little
+// sense for a few bytes and overruns a local receiver's buffer.
+//
+// Wake() bumps an eventfd(2) watched by a multishot IORING_OP_POLL_ADD,
+// whose completion ends the wait in Poll().
+//
+// Needs Linux 6.0 or later; Init() fails otherwise.
+class UringTransport : public Transport {
+ public:
+  UringTransport();
+  ~UringTransport();
+
+  // Set up the rings, the receive buffer ring and the send slab.
+  bool Init();
+
+  bool Open(const sockaddr* addr, socklen_t addr_len);
+  int Poll(Handler* handler, int timeout_ms);
+  bool Send(const uint8_t* data, size_t size,
+            const sockaddr* peer, socklen_t peer_len);
+  bool Flush();
+  bool Wake();
+
+  Backend backend() const { return Backend::uring; }
+  int fd() const { return fd_; }
+
+ private:
+  bool SetupRings();
+  bool SupportsOps() const;
+  bool SetupRecvBuffers();
+  bool SetupSendBuffers();
+
+  io_uring_sqe* GetSqe();
+  int Enter(unsigned min_complete, int timeout_ms);
+  bool ArmRecv();
+  bool ArmWake();
+  int Reap(Handler* handler);
+  void OnRecv(const io_uring_cqe* cqe);
+  void DeliverBatch(Handler* handler);
+  void OnSend(const io_uring_cqe* cqe);
+  void OnWake(const io_uring_cqe* cqe);
+  void RecycleBuffer(uint16_t bid);
+
+ private:
+  static const unsigned kRingEntries = 256;
+  static const unsigned kRecvBuffers = 512;         // power of two
+  static const size_t kRecvBufferSize = 2048;
+  static const unsigned kSendSlots = 512;
+  static const size_t kZeroCopyThreshold = 1024;
+  static const uint16_t kBufferGroup = 0;
+
+  static const uint64_t kRecvTag = 1ULL << 63;
+  static const uint64_t kSendTag = 1ULL << 62;
+  static const uint64_t kWakeTag = 1ULL << 61;
+
+  int ring_fd_;
+  int fd_;
+
+  // Received datagrams not yet handed over, and their buffers.
+  Datagram batch_[kMaxBatch];
+  uint16_t batch_bids_[kMaxBatch];
+  size_t batch_size_;
+
+  // Submission queue
+  void* ring_ptr_;
+  size_t ring_len_;
+  io_uring_sqe* sqes_;
+  size_t sqes_len_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_array_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned sq_local_tail_;
+
+  // Completion queue
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  // Provided receive buffers
+  io_uring_buf_ring* buf_ring_;
+  size_t buf_ring_len_;
+  uint8_t* rx_slab_;
+  uint16_t buf_ring_tail_;
+  msghdr rx_msg_;
+  bool recv_armed_;
+
+  int wake_fd_;
+  bool wake_armed_;
+
+  // Registered send buffers
+  uint8_t* tx_slab_;
+  std::vector<uint16_t> tx_free_;
+  std::vector<sockaddr_storage> tx_peers_;
+  std::vector<msghdr> tx_msgs_;
+  std::vector<iovec> tx_iov_;
+};
+
+}   // namespace net
+
+#endif  // NET_UDP_URING_H_
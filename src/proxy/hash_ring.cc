@@ -0,0 +1,44 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <algorithm>
+
+#include "proxy/hash_ring.h"
+
+namespace proxy {
+
+const uint32_t HashRing::kNoNode;
+
+uint64_t HashRing::Hash(const void* data, size_t length, uint64_t h) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < length; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t HashRing::Mix(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h;
+}
+
+void HashRing::Add(uint32_t node, uint64_t id_hash, unsigned weight) {
+  for (size_t i = 0; i < points_per_node_ * weight; ++i)
+    points_.push_back(std::make_pair(Mix(Hash(&i, sizeof i, id_hash)),
+                                     node));
+  std::sort(points_.begin(), points_.end());
+}
+
+void HashRing::Remove(uint32_t node) {
+  points_.erase(std::remove_if(points_.begin(), points_.end(),
+                               [node](const std::pair<uint64_t, uint32_t>& p) {
+                                 return p.second == node;
+                               }),
+                points_.end());
+}
+
+}   // namespace proxy
@@ -0,0 +1,80 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef PROXY_HASH_RING_H_
+#define PROXY_HASH_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace proxy {
+
+// Consistent hashing: each node owns points_per_node points (times its
+// weight) on a 64-bit ring, and a key goes to the node owning the
+// first point at or after its hash.  Adding or removing a node moves
+// only the keys on its own arcs, about 1/n of them, and the points
+// spread each node's share evenly over the others.
+//
+// Pick() skips nodes the caller doesn't want (e.g. down): their keys go
+// to the next node clockwise, and come back when they are wanted again.
+class HashRing {
+ public:
+  explicit HashRing(size_t points_per_node = 160)
+    : points_per_node_(points_per_node)
+  { }
+
+  // Add node, identified by id_hash (e.g. its address, hashed), with
+  // points_per_node * weight points.
+  void Add(uint32_t node, uint64_t id_hash, unsigned weight = 1);
+
+  void Remove(uint32_t node);
+
+  // The node for hash, going round the ring past the nodes for which
+  // wanted(node) is false.  kNoNode if none is wanted.
+  template <typename Wanted>
+  uint32_t Pick(uint64_t hash, Wanted wanted) const;
+
+  uint32_t Pick(uint64_t hash) const {
+    return Pick(hash, [](uint32_t) { return true; });
+  }
+
+  size_t points() const { return points_.size(); }
+
+  static const uint32_t kNoNode = ~0U;
+
+  // FNV-1a, to hash a key in pieces: h = Hash(a, n, Hash(b, m)).
+  static uint64_t Hash(const void* data, size_t length,
+                       uint64_t h = 14695981039346656037ULL);
+
+ private:
+  // Spread FNV's output over the ring (splitmix64's finaliser).
+  static uint64_t Mix(uint64_t h);
+
+ private:
+  const size_t points_per_node_;
+  std::vector<std::pair<uint64_t, uint32_t>> points_;   // sorted
+};
+
+template <typename Wanted>
+uint32_t HashRing::Pick(uint64_t hash, Wanted wanted) const {
+  if (points_.empty())
+    return kNoNode;
+
+  size_t i = std::lower_bound(points_.begin(), points_.end(),
+                              std::make_pair(Mix(hash), 0U)) -
+             points_.begin();
+
+  for (size_t n = 0; n < points_.size(); ++n, ++i) {
+    uint32_t node = points_[i % points_.size()].second;
+    if (wanted(node))
+      return node;
+  }
+  return kNoNode;
+}
+
+}   // namespace proxy
+
+#endif  // PROXY_HASH_RING_H_
@@ -0,0 +1,142 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <string>
+#include <vector>
+#include "utils/log.h"
+#include "proxy/hash_ring.h"
+
+using namespace proxy;
+
+void init_log() {
+  utils::Log::Instance()->Open("hash_ring_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+const size_t kKeys = 100000;
+
+uint64_t key(size_t i) {
+  std::string k = "sensors/" + std::to_string(i);
+  return HashRing::Hash(k.data(), k.size());
+}
+
+uint64_t id(uint32_t node) {
+  return HashRing::Hash(&node, sizeof node);
+}
+
+std::vector<uint32_t> place(const HashRing& ring) {
+  std::vector<uint32_t> nodes(kKeys);
+  for (size_t i = 0; i < kKeys; ++i)
+    nodes[i] = ring.Pick(key(i));
+  return nodes;
+}
+
+void test_ok_spread() {
+  HashRing ring;
+  for (uint32_t n = 0; n < 5; ++n)
+    ring.Add(n, id(n));
+  assert(ring.points() == 5 * 160);
+
+  std::vector<size_t> count(5);
+  for (uint32_t n : place(ring))
+    ++count[n];
+
+  // Within 20% of a fair share.
+  for (size_t c : count)
+    assert(c > kKeys / 5 * 8 / 10 && c < kKeys / 5 * 12 / 10);
+}
+
+void test_ok_add_remove() {
+  HashRing ring;
+  for (uint32_t n = 0; n < 4; ++n)
+    ring.Add(n, id(n));
+  std::vector<uint32_t> before = place(ring);
+
+  // A fifth node takes about a fifth of the keys, all of them to itself.
+  ring.Add(4, id(4));
+  std::vector<uint32_t> after = place(ring);
+  size_t moved = 0;
+  for (size_t i = 0; i < kKeys; ++i) {
+    if (before[i] != after[i]) {
+      assert(after[i] == 4);
+      ++moved;
+    }
+  }
+  assert(moved > kKeys / 5 * 8 / 10 && moved < kKeys / 5 * 12 / 10);
+
+  // Gone again, its keys go back where they were.
+  ring.Remove(4);
+  assert(ring.points() == 4 * 160);
+  assert(place(ring) == before);
+
+  // Another one gone: only its keys move.
+  ring.Remove(1);
+  after = place(ring);
+  for (size_t i = 0; i < kKeys; ++i)
+    assert(before[i] == 1 ? after[i] != 1 : after[i] == before[i]);
+}
+
+void test_ok_pick_wanted() {
+  HashRing ring;
+  for (uint32_t n = 0; n < 4; ++n)
+    ring.Add(n, id(n));
+  std::vector<uint32_t> before = place(ring);
+
+  // Skipping a node is the same as removing it.
+  auto not2 = [](uint32_t n) { return n != 2; };
+  HashRing without;
+  for (uint32_t n = 0; n < 4; ++n)
+    if (n != 2)
+      without.Add(n, id(n));
+  for (size_t i = 0; i < kKeys; ++i) {
+    uint32_t n = ring.Pick(key(i), not2);
+    assert(n == without.Pick(key(i)));
+    assert(before[i] == 2 || n == before[i]);
+  }
+
+  assert(ring.Pick(key(0), [](uint32_t) { return false; }) ==
+         HashRing::kNoNode);
+}
+
+void test_ok_weight() {
+  HashRing ring;
+  ring.Add(0, id(0), 1);
+  ring.Add(1, id(1), 3);
+  assert(ring.points() == 4 * 160);
+
+  size_t heavy = 0;
+  for (uint32_t n : place(ring))
+    heavy += n == 1;
+  assert(heavy > kKeys * 3 / 4 * 9 / 10 && heavy < kKeys * 3 / 4 * 11 / 10);
+}
+
+void test_ok_same_ids_same_ring() {
+  // Placement depends on the ids only, not on the order of Add().
+  HashRing a, b;
+  for (uint32_t n = 0; n < 3; ++n)
+    a.Add(n, id(n));
+  for (uint32_t n = 3; n > 0; --n)
+    b.Add(n - 1, id(n - 1));
+  assert(place(a) == place(b));
+}
+
+void test_ko_empty() {
+  HashRing ring;
+  assert(ring.Pick(key(0)) == HashRing::kNoNode);
+  ring.Add(0, id(0));
+  ring.Remove(0);
+  assert(ring.points() == 0);
+  assert(ring.Pick(key(0)) == HashRing::kNoNode);
+}
+
+int main() {
+  init_log();
+
+  test_ok_spread();
+  test_ok_add_remove();
+  test_ok_pick_wanted();
+  test_ok_weight();
+  test_ok_same_ids_same_ring();
+  test_ko_empty();
+}
@@ -0,0 +1,725 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <netinet/in.h>
+#include <string.h>
+#include <time.h>
+
+#include <random>
+
+#include "coap/header.h"
+#include "coap/registry.h"
+#include "utils/log.h"
+#include "proxy/reverse_proxy.h"
+
+namespace proxy {
+
+namespace {
+
+// The token the proxy puts on requests: exchange index and nonce.
+const size_t kTokenLength = 8;
+
+bool SameAddress(const sockaddr* a, const sockaddr* b) {
+  if (a->sa_family != b->sa_family)
+    return false;
+
+  if (a->sa_family == AF_INET) {
+    const sockaddr_in* a4 = reinterpret_cast<const sockaddr_in*>(a);
+    const sockaddr_in* b4 = reinterpret_cast<const sockaddr_in*>(b);
+    return a4->sin_port == b4->sin_port &&
+           a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+  if (a->sa_family == AF_INET6) {
+    const sockaddr_in6* a6 = reinterpret_cast<const sockaddr_in6*>(a);
+    const sockaddr_in6* b6 = reinterpret_cast<const sockaddr_in6*>(b);
+    return a6->sin6_port == b6->sin6_port &&
+           memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof a6->sin6_addr) == 0;
+  }
+  return false;
+}
+
+// The options of a GET that make its cache key.  Those that are
+// neither these nor NoCacheKey keep it from being coalesced.
+bool InCacheKey(size_t num) {
+  return num == coap::OptionNumber::Uri_Host ||
+         num == coap::OptionNumber::Uri_Port ||
+         num == coap::OptionNumber::Uri_Path ||
+         num == coap::OptionNumber::Uri_Query ||
+         num == coap::OptionNumber::Accept;
+}
+
+void AppendKey(std::string& key, size_t num, const uint8_t* value,
+               size_t length) {
+  key += static_cast<char>(num);
+  key += static_cast<char>(length >> 8);
+  key += static_cast<char>(length);
+  key.append(reinterpret_cast<const char*>(value), length);
+}
+
+const sockaddr* sa(const sockaddr_storage& ss) {
+  return reinterpret_cast<const sockaddr*>(&ss);
+}
+
+// Where a backend goes on the ring: its address, not PeerTable's
+// seeded hash, so that keys land on the same backends after a restart.
+uint64_t IdHash(const sockaddr* addr) {
+  uint64_t h = HashRing::Hash(&addr->sa_family, sizeof addr->sa_family);
+  if (addr->sa_family == AF_INET) {
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(addr);
+    h = HashRing::Hash(&sin->sin_port, sizeof sin->sin_port, h);
+    return HashRing::Hash(&sin->sin_addr, sizeof sin->sin_addr, h);
+  }
+  const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(addr);
+  h = HashRing::Hash(&sin6->sin6_port, sizeof sin6->sin6_port, h);
+  return HashRing::Hash(&sin6->sin6_addr, sizeof sin6->sin6_addr, h);
+}
+
+// Whether buf, which failed to decode, is a request that would have
+// but for critical options unknown to us.
+bool UnknownCritical(const uint8_t* buf, size_t size) {
+  if (size < 4 || buf[0] >> 6 != coap::Version::v1)
+    return false;
+  uint8_t type = (buf[0] >> 4) & 0x03;
+  uint8_t token_length = buf[0] & 0x0F;
+  if ((type != coap::Type::CON && type != coap::Type::NON) ||
+      token_length > 8 || size < 4U + token_length ||
+      buf[1] == coap::Code::Empty ||
+      buf[1] > coap::CodeBlocks::ReqMethodMax)
+    return false;
+
+  coap::OptionCursor cursor(buf + 4 + token_length, buf + size);
+  size_t num, length;
+  const uint8_t* value;
+  bool unknown = false;
+  while (cursor.Next(num, value, length))
+    unknown |= (num & 1) && !coap::FindOption(num);
+  return unknown && !cursor.failed() &&
+         !(cursor.marker() && cursor.position() == buf + size);
+}
+
+uint32_t Get32(const uint8_t* p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void Put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+}   // namespace
+
+const uint32_t ReverseProxy::kNone;
+
+ReverseProxy::ReverseProxy(net::Transport* transport,
+                           const ProxyConfig& config)
+  : transport_(transport)
+  , config_(config)
+  , peers_(1024)
+  , exchanges_(config.max_pending)
+  , oldest_(kNone)
+  , newest_(kNone)
+  , forwarded_(0)
+  , relayed_(0)
+  , rejected_(0)
+  , expired_(0)
+  , coalesced_(0) {
+  coap::OptionRegistry::Instance()->Freeze();
+
+  std::random_device rd;
+  nonce_ = (static_cast<uint64_t>(rd()) << 32) | rd();
+  next_mid_ = rd();
+
+  // Taken from the back: index 0 first.
+  free_.reserve(exchanges_.size());
+  for (size_t i = exchanges_.size(); i > 0; --i) {
+    exchanges_[i - 1].state = State::free;
+    exchanges_[i - 1].leading = false;
+    free_.push_back(i - 1);
+  }
+  by_mid_.reserve(2 * exchanges_.size());
+}
+
+uint64_t ReverseProxy::NowMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+bool ReverseProxy::AddBackend(const sockaddr* addr, socklen_t addr_len,
+                              unsigned weight) {
+  if (weight == 0 || addr_len > sizeof(sockaddr_storage) ||
+      peers_.Find(addr, addr_len))
+    return false;
+
+  if (!peers_.Lookup(addr, addr_len, NowMs())) {
+    utils::Log::Instance()->Debug("proxy: can't add backend (family %d)",
+                                  addr->sa_family);
+    return false;
+  }
+  // Lookup() may have moved the others.
+  for (Backend& other : backends_)
+    other.peer = peers_.Find(sa(other.addr), other.addr_len);
+
+  Backend b;
+  memset(&b, 0, sizeof b);
+  memcpy(&b.addr, addr, addr_len);
+  b.addr_len = addr_len;
+  b.hash = peers_.Hash(addr, addr_len);
+  b.next_mid = std::random_device()();
+  b.peer = peers_.Find(addr, addr_len);
+
+  ring_.Add(backends_.size(), IdHash(addr), weight);
+  backends_.push_back(b);
+  return true;
+}
+
+ReverseProxy::BackendStats ReverseProxy::backend(size_t i) const {
+  const Backend& b = backends_[i];
+  BackendStats stats;
+  stats.requests = b.requests;
+  stats.responses = b.responses;
+  stats.timeouts = b.timeouts;
+  stats.srtt_ms = b.peer->srtt();
+  stats.rto_ms = b.peer->rto();
+  stats.up = b.failures < config_.max_failures;
+  return stats;
+}
+
+void ReverseProxy::RunOnce(int timeout_ms) {
+  transport_->Poll(this, timeout_ms);
+  Expire(NowMs());
+  transport_->Flush();
+}
+
+void ReverseProxy::OnDatagram(const net::Datagram& dgram) {
+  switch (coap::ClassifyEmpty(dgram.data, dgram.size)) {
+    case coap::EmptyKind::other:
+      break;
+
+    case coap::EmptyKind::ping: {
+      uint8_t rst[4];
+      coap::ResetFor(dgram.data, rst);
+      transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+      return;
+    }
+
+    case coap::EmptyKind::ack:
+      OnEmpty(dgram, false, NowMs());
+      return;
+
+    case coap::EmptyKind::reset:
+      OnEmpty(dgram, true, NowMs());
+      return;
+
+    case coap::EmptyKind::bad:
+      return;
+  }
+
+  // Options newer than us go through, if elective.
+  // Requests with critical ones get a 4.02 (RFC 7252, 5.4.1).
+  coap::PDUView pdu;
+  if (!pdu.Decode(dgram.data, dgram.size, coap::UnknownOption::keep)) {
+    if (UnknownCritical(dgram.data, dgram.size)) {
+      ++rejected_;
+      Reply(dgram, coap::Code::BadOption);
+    }
+    return;
+  }
+
+  if (static_cast<int>(pdu.code()) <= coap::CodeBlocks::ReqMethodMax)
+    OnRequest(pdu, dgram, NowMs());
+  else
+    OnResponse(pdu, dgram, NowMs());
+}
+
+void ReverseProxy::OnRequest(const coap::PDUView& req,
+                             const net::Datagram& dgram, uint64_t now) {
+  if (req.type() != coap::Type::CON && req.type() != coap::Type::NON)
+    return;
+
+  // Our token may be longer than the client's.
+  if (4 + kTokenLength + req.size() - 4 - req.token_length() >
+      net::kMaxDatagramSize) {
+    ++rejected_;
+    Reply(dgram, coap::Code::RequestEntityTooLarge);
+    return;
+  }
+
+  // A retransmission: forward it again, with the same message ID, or
+  // ACK it again if the backend has.
+  uint32_t client_hash = peers_.Hash(dgram.peer, dgram.peer_len);
+  auto it = by_mid_.find(Key(kRequest, client_hash, req.message_id()));
+  if (it != by_mid_.end() &&
+      SameAddress(sa(exchanges_[it->second].client), dgram.peer)) {
+    Exchange& x = exchanges_[it->second];
+    if (x.client_type == coap::Type::CON) {
+      if (x.state == State::waiting && x.leader == kNone) {
+        ++x.retransmits;
+        Forward(it->second, req);
+      } else if (x.state == State::accepted) {
+        SendEmpty(coap::Type::ACK, x.client_mid, dgram.peer, dgram.peer_len);
+      }
+    }
+    return;
+  }
+
+  if (free_.empty()) {
+    ++rejected_;
+    Reply(dgram, coap::Code::ServiceUnavailable);
+    return;
+  }
+
+  // The values of the option to hash, each with a '/' after it, and
+  // the cache key of a GET.
+  bool coalesce = config_.coalesce && req.code() == coap::Code::GET;
+  uint64_t hash = HashRing::Hash(nullptr, 0);
+  key_.clear();
+  coap::OptionCursor cursor = req.options();
+  size_t num;
+  const uint8_t* value;
+  size_t length;
+  while (cursor.Next(num, value, length)) {
+    if (num == config_.hash_option) {
+      hash = HashRing::Hash(value, length, hash);
+      hash = HashRing::Hash("/", 1, hash);
+    }
+    if (coalesce) {
+      if (InCacheKey(num))
+        AppendKey(key_, num, value, length);
+      else if (!coap::IsNoCacheKey(num))
+        coalesce = false;
+    } else if (num > config_.hash_option) {
+      break;
+    }
+  }
+
+  // The same GET in flight: wait for its response.  (Coalesced, a GET
+  // has only key_ options but NoCacheKey ones, which is what the view's
+  // hash is over.)
+  uint64_t key_hash = 0;
+  if (coalesce) {
+    key_hash = req.cache_key();
+    auto leader = inflight_.find(key_hash);
+    if (leader != inflight_.end() &&
+        exchanges_[leader->second].key == key_) {
+      uint32_t i = free_.back();
+      free_.pop_back();
+      Exchange& x = exchanges_[i];
+      x.client_mid = req.message_id();
+      x.client_type = req.type();
+      x.token_length = req.token_length();
+      memcpy(x.token, req.token(), req.token_length());
+      x.client_hash = client_hash;
+      memcpy(&x.client, dgram.peer, dgram.peer_len);
+      x.client_len = dgram.peer_len;
+      by_mid_.emplace(Key(kRequest, client_hash, x.client_mid), i);
+      Link(i, now);
+      Wait(i, leader->second);
+      ++coalesced_;
+      return;
+    }
+  }
+
+  uint32_t b = ring_.Pick(hash, [this, now](uint32_t node) {
+    return Up(node, now);
+  });
+  if (b == HashRing::kNoNode) {
+    ++rejected_;
+    Reply(dgram, coap::Code::BadGateway);
+    return;
+  }
+  Backend& be = backends_[b];
+
+  uint32_t i = free_.back();
+  free_.pop_back();
+  Exchange& x = exchanges_[i];
+  nonce_ = nonce_ * 6364136223846793005ULL + 1442695040888963407ULL;
+  x.state = State::waiting;
+  x.nonce = nonce_ >> 32;
+  x.backend = b;
+  x.leader = kNone;
+  x.waiters = kNone;
+  x.upstream_mid = be.next_mid++;
+  x.client_mid = req.message_id();
+  x.client_type = req.type();
+  x.token_length = req.token_length();
+  memcpy(x.token, req.token(), req.token_length());
+  x.retransmits = 0;
+  x.answered = false;
+  x.client_hash = client_hash;
+  memcpy(&x.client, dgram.peer, dgram.peer_len);
+  x.client_len = dgram.peer_len;
+
+  // A hash collision leaves the exchange out of by_mid_: only its
+  // retransmissions aren't recognised.
+  by_mid_.emplace(Key(kRequest, client_hash, x.client_mid), i);
+  if (x.client_type == coap::Type::CON)
+    by_mid_.emplace(Key(kEmpty, be.hash, x.upstream_mid), i);
+  Link(i, now);
+
+  if (coalesce && inflight_.emplace(key_hash, i).second) {
+    x.leading = true;
+    x.key_hash = key_hash;
+    x.key = key_;
+  }
+
+  ++be.requests;
+  ++forwarded_;
+  Forward(i, req);
+}
+
+// Make i, a request not forwarded yet, wait for leader's response.
+void ReverseProxy::Wait(uint32_t i, uint32_t leader) {
+  Exchange& x = exchanges_[i];
+  Exchange& l = exchanges_[leader];
+
+  x.state = l.state;
+  x.nonce = 0;
+  x.backend = l.backend;
+  x.retransmits = 0;
+  x.answered = true;            // not forwarded: no RTT, no timeout
+  x.leader = leader;
+  x.waiters = kNone;
+  x.next_waiter = l.waiters;
+  l.waiters = i;
+
+  if (x.state == State::accepted && x.client_type == coap::Type::CON)
+    SendEmpty(coap::Type::ACK, x.client_mid, sa(x.client), x.client_len);
+}
+
+// Hand what leader i got to its waiters, and free them: rsp relayed
+// with their own header and token, or without one an RST if reset,
+// else a 5.04.
+void ReverseProxy::Settle(uint32_t i, const coap::PDUView* rsp,
+                          bool reset) {
+  Exchange& l = exchanges_[i];
+  Forget(i);
+
+  while (l.waiters != kNone) {
+    uint32_t w = l.waiters;
+    Exchange& x = exchanges_[w];
+    l.waiters = x.next_waiter;
+
+    bool ack = x.state == State::waiting && x.client_type == coap::Type::CON;
+    if (rsp) {
+      ++relayed_;
+      if (ack)
+        Relay(x, *rsp, coap::Type::ACK, x.client_mid);
+      else
+        Relay(x, *rsp, coap::Type::NON, next_mid_++);
+    } else if (reset) {
+      if (ack)
+        SendEmpty(coap::Type::RST, x.client_mid, sa(x.client), x.client_len);
+    } else {
+      ++expired_;
+      Reply(x, coap::Code::GatewayTimeout);
+    }
+    Free(w);
+  }
+}
+
+// Take leader i out of inflight_: GETs from now on are fetched anew.
+void ReverseProxy::Forget(uint32_t i) {
+  Exchange& x = exchanges_[i];
+  if (!x.leading)
+    return;
+
+  auto it = inflight_.find(x.key_hash);
+  if (it != inflight_.end() && it->second == i)
+    inflight_.erase(it);
+  x.leading = false;
+}
+
+// The request with our header and token in front of its own option and
+// payload bytes.
+void ReverseProxy::Forward(uint32_t i, const coap::PDUView& req) {
+  const Exchange& x = exchanges_[i];
+  const Backend& be = backends_[x.backend];
+  size_t tail = req.size() - 4 - req.token_length();
+
+  out_[0] = (coap::Version::v1 << 6) | (x.client_type << 4) | kTokenLength;
+  out_[1] = req.code();
+  out_[2] = x.upstream_mid >> 8;
+  out_[3] = x.upstream_mid;
+  Put32(out_ + 4, i);
+  Put32(out_ + 8, x.nonce);
+  memcpy(out_ + 4 + kTokenLength, req.data() + 4 + req.token_length(), tail);
+
+  transport_->Send(out_, 4 + kTokenLength + tail, sa(be.addr), be.addr_len);
+}
+
+void ReverseProxy::OnResponse(const coap::PDUView& rsp,
+                              const net::Datagram& dgram, uint64_t now) {
+  uint32_t i = kNone;
+  if (rsp.token_length() == kTokenLength) {
+    i = Get32(rsp.token());
+    if (i >= exchanges_.size() || exchanges_[i].state == State::free ||
+        exchanges_[i].nonce != Get32(rsp.token() + 4) ||
+        !SameAddress(sa(backends_[exchanges_[i].backend].addr), dgram.peer))
+      i = kNone;
+  }
+
+  if (i == kNone) {
+    // Nothing of ours, or not any more.
+    if (rsp.type() == coap::Type::CON)
+      SendEmpty(coap::Type::RST, rsp.message_id(), dgram.peer,
+                dgram.peer_len);
+    return;
+  }
+
+  Exchange& x = exchanges_[i];
+  switch (rsp.type()) {
+    case coap::Type::ACK:
+      // Piggybacked.
+      if (x.state != State::waiting || rsp.message_id() != x.upstream_mid)
+        return;
+      Answered(x, now);
+      ++relayed_;
+      if (x.client_type == coap::Type::CON)
+        Relay(x, rsp, coap::Type::ACK, x.client_mid);
+      else
+        Relay(x, rsp, coap::Type::NON, next_mid_++);
+      Settle(i, &rsp, false);
+      Free(i);
+      return;
+
+    case coap::Type::NON:
+      if (x.state == State::relaying)
+        return;
+      Answered(x, now);
+      ++relayed_;
+      Relay(x, rsp, coap::Type::NON, next_mid_++);
+      Settle(i, &rsp, false);
+      Free(i);
+      return;
+
+    case coap::Type::CON:
+      // Separate: relayed as a CON, whose ACK goes back to the backend.
+      // The backend retransmits it until then, and so do we.
+      if (x.state == State::relaying) {
+        if (rsp.message_id() == x.backend_response_mid)
+          Relay(x, rsp, coap::Type::CON, x.response_mid);
+        return;
+      }
+      Answered(x, now);
+      ++relayed_;
+      x.state = State::relaying;
+      x.backend_response_mid = rsp.message_id();
+      x.response_mid = next_mid_++;
+      by_mid_.emplace(Key(kEmpty, x.client_hash, x.response_mid), i);
+      // The client has as long as the backend had to answer.
+      Unlink(i);
+      Link(i, now);
+      Relay(x, rsp, coap::Type::CON, x.response_mid);
+      Settle(i, &rsp, false);
+      return;
+
+    case coap::Type::RST:
+      return;
+  }
+}
+
+// The response with the client's header and token in front of its own
+// option and payload bytes.
+void ReverseProxy::Relay(const Exchange& x, const coap::PDUView& rsp,
+                         uint8_t type, uint16_t mid) {
+  size_t tail = rsp.size() - 4 - kTokenLength;
+
+  out_[0] = (coap::Version::v1 << 6) | (type << 4) | x.token_length;
+  out_[1] = rsp.code();
+  out_[2] = mid >> 8;
+  out_[3] = mid;
+  memcpy(out_ + 4, x.token, x.token_length);
+  memcpy(out_ + 4 + x.token_length, rsp.data() + 4 + kTokenLength, tail);
+
+  transport_->Send(out_, 4 + x.token_length + tail, sa(x.client),
+                   x.client_len);
+}
+
+void ReverseProxy::OnEmpty(const net::Datagram& dgram, bool reset,
+                           uint64_t now) {
+  uint16_t mid = coap::HeaderMessageId(dgram.data);
+  auto it = by_mid_.find(Key(kEmpty, peers_.Hash(dgram.peer, dgram.peer_len),
+                             mid));
+  if (it == by_mid_.end())
+    return;
+
+  uint32_t i = it->second;
+  Exchange& x = exchanges_[i];
+  const Backend& be = backends_[x.backend];
+
+  // From the backend, about the request.
+  if (x.state == State::waiting && mid == x.upstream_mid &&
+      SameAddress(sa(be.addr), dgram.peer)) {
+    Answered(x, now);
+    by_mid_.erase(it);
+    if (reset) {
+      if (x.client_type == coap::Type::CON)
+        SendEmpty(coap::Type::RST, x.client_mid, sa(x.client), x.client_len);
+      Settle(i, nullptr, true);
+      Free(i);
+      return;
+    }
+
+    x.state = State::accepted;
+    if (x.client_type == coap::Type::CON)
+      SendEmpty(coap::Type::ACK, x.client_mid, sa(x.client), x.client_len);
+    for (uint32_t w = x.waiters; w != kNone; w = exchanges_[w].next_waiter) {
+      Exchange& y = exchanges_[w];
+      y.state = State::accepted;
+      if (y.client_type == coap::Type::CON)
+        SendEmpty(coap::Type::ACK, y.client_mid, sa(y.client), y.client_len);
+    }
+    return;
+  }
+
+  // From the client, about a separate response.
+  if (x.state == State::relaying && mid == x.response_mid &&
+      SameAddress(sa(x.client), dgram.peer)) {
+    SendEmpty(reset ? coap::Type::RST : coap::Type::ACK,
+              x.backend_response_mid, sa(be.addr), be.addr_len);
+    Free(i);
+  }
+}
+
+bool ReverseProxy::Up(uint32_t backend, uint64_t now) const {
+  const Backend& b = backends_[backend];
+  return b.down_until_ms == 0 || now >= b.down_until_ms;
+}
+
+// The backend answered x, one way or another: it is up.
+void ReverseProxy::Answered(Exchange& x, uint64_t now) {
+  if (x.answered)
+    return;
+  x.answered = true;
+
+  Backend& b = backends_[x.backend];
+  if (b.failures >= config_.max_failures)
+    utils::Log::Instance()->Debug("proxy: backend %u back", x.backend);
+  b.failures = 0;
+  b.down_until_ms = 0;
+  ++b.responses;
+  peers_.OnRtt(b.peer, now - x.sent_ms, x.retransmits, now);
+}
+
+void ReverseProxy::SendEmpty(uint8_t type, uint16_t mid, const sockaddr* to,
+                             socklen_t to_len) {
+  uint8_t msg[4] = {
+    static_cast<uint8_t>((coap::Version::v1 << 6) | (type << 4)),
+    coap::Code::Empty,
+    static_cast<uint8_t>(mid >> 8),
+    static_cast<uint8_t>(mid)
+  };
+  transport_->Send(msg, sizeof msg, to, to_len);
+}
+
+// An answer of the proxy's own to the request in dgram, piggybacked on
+// the ACK of a CON.
+void ReverseProxy::Reply(const net::Datagram& dgram, coap::Code code) {
+  const uint8_t* req = dgram.data;
+  uint8_t token_length = req[0] & 0x0F;
+  bool ack = ((req[0] >> 4) & 0x03) == coap::Type::CON;
+  uint16_t mid = ack ? coap::HeaderMessageId(req) : next_mid_++;
+
+  out_[0] = (coap::Version::v1 << 6) |
+            ((ack ? coap::Type::ACK : coap::Type::NON) << 4) |
+            token_length;
+  out_[1] = code;
+  out_[2] = mid >> 8;
+  out_[3] = mid;
+  memcpy(out_ + 4, req + 4, token_length);
+  transport_->Send(out_, 4 + token_length, dgram.peer, dgram.peer_len);
+}
+
+// Same, for x, on the ACK if the request is not ACKed yet.
+void ReverseProxy::Reply(const Exchange& x, coap::Code code) {
+  bool ack = x.state == State::waiting && x.client_type == coap::Type::CON;
+  uint16_t mid = ack ? x.client_mid : next_mid_++;
+
+  out_[0] = (coap::Version::v1 << 6) |
+            ((ack ? coap::Type::ACK : coap::Type::NON) << 4) |
+            x.token_length;
+  out_[1] = code;
+  out_[2] = mid >> 8;
+  out_[3] = mid;
+  memcpy(out_ + 4, x.token, x.token_length);
+  transport_->Send(out_, 4 + x.token_length, sa(x.client), x.client_len);
+}
+
+size_t ReverseProxy::Expire(uint64_t now_ms) {
+  size_t before = pending();
+
+  while (oldest_ != kNone &&
+         exchanges_[oldest_].sent_ms + config_.timeout_ms <= now_ms) {
+    uint32_t i = oldest_;
+    Exchange& x = exchanges_[i];
+
+    if (!x.answered) {
+      Backend& b = backends_[x.backend];
+      ++b.timeouts;
+      if (++b.failures >= config_.max_failures && Up(x.backend, now_ms)) {
+        b.down_until_ms = now_ms + config_.retry_ms;
+        utils::Log::Instance()->Debug("proxy: backend %u down for %u ms",
+                                      x.backend, config_.retry_ms);
+      }
+    }
+
+    if (x.state == State::waiting || x.state == State::accepted) {
+      ++expired_;
+      Reply(x, coap::Code::GatewayTimeout);
+    }
+    Settle(i, nullptr, false);
+    Free(i);
+  }
+  return before - pending();
+}
+
+// Erase key if it is still i's.
+void ReverseProxy::EraseKey(Kind kind, uint32_t hash, uint16_t mid,
+                            uint32_t i) {
+  auto it = by_mid_.find(Key(kind, hash, mid));
+  if (it != by_mid_.end() && it->second == i)
+    by_mid_.erase(it);
+}
+
+void ReverseProxy::Link(uint32_t i, uint64_t now) {
+  Exchange& x = exchanges_[i];
+  x.sent_ms = now;
+  x.prev = newest_;
+  x.next = kNone;
+  if (newest_ != kNone)
+    exchanges_[newest_].next = i;
+  else
+    oldest_ = i;
+  newest_ = i;
+}
+
+void ReverseProxy::Unlink(uint32_t i) {
+  Exchange& x = exchanges_[i];
+  if (x.prev != kNone)
+    exchanges_[x.prev].next = x.next;
+  else
+    oldest_ = x.next;
+  if (x.next != kNone)
+    exchanges_[x.next].prev = x.prev;
+  else
+    newest_ = x.prev;
+}
+
+void ReverseProxy::Free(uint32_t i) {
+  Exchange& x = exchanges_[i];
+
+  EraseKey(kRequest, x.client_hash, x.client_mid, i);
+  if (x.client_type == coap::Type::CON)
+    EraseKey(kEmpty, backends_[x.backend].hash, x.upstream_mid, i);
+  if (x.state == State::relaying)
+    EraseKey(kEmpty, x.client_hash, x.response_mid, i);
+
+  Forget(i);
+  Unlink(i);
+  x.state = State::free;
+  free_.push_back(i);
+}
+
+}   // namespace proxy
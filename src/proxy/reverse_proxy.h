@@ -0,0 +1,233 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef PROXY_REVERSE_PROXY_H_
+#define PROXY_REVERSE_PROXY_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "coap/view.h"
+#include "net/peer_table.h"
+#include "net/transport.h"
+#include "proxy/hash_ring.h"
+
+namespace proxy {
+
+struct ProxyConfig {
+  size_t max_pending;           // exchanges in flight, at most
+  uint32_t timeout_ms;          // how long a backend has to answer
+  uint16_t hash_option;         // whose values pick the backend
+  unsigned max_failures;        // timeouts in a row that take a backend out
+  uint32_t retry_ms;            // how long it is out before a retry
+  bool coalesce;                // identical GETs in flight share a fetch
+};
+
+const ProxyConfig kDefaultProxyConfig = {
+  4096, 5000, coap::OptionNumber::Uri_Path, 3, 10000, true
+};
+
+// A CoAP reverse proxy: clients talk to it as to a server, and it
+// hands each request to one of a set of backends, by consistent
+// hashing (HashRing) of the values of one option, Uri-Path by default,
+// so that the same resource always lands on the same backend while
+// that is up.
+//
+// Messages go through as they are: a request is decoded in place
+// (coap::PDUView) only to validate it and find the option to hash,
+// then forwarded with a new header and token spliced in front of its
+// option and payload bytes, which are copied verbatim.  Responses come
+// back the same way with the client's message ID and token.  Nothing
+// is re-encoded, and elective options unknown to us go through as they
+// are (coap::UnknownOption::keep); requests with critical ones get a
+// 4.02 (Bad Option).
+//
+// The token the proxy puts on a request is the index of its exchange
+// in a table of max_pending entries, and a nonce: responses find their
+// exchange without a lookup.  Empty ACKs and RSTs, which have no
+// token, are matched by sender and message ID.  The proxy keeps no
+// timers of its own besides the timeouts: retransmissions are the
+// client's (a retransmitted CON is forwarded again with the first
+// one's message ID, for the backend to deduplicate) and the backend's
+// (for separate responses, which are relayed as CONs and whose ACK
+// from the client is relayed back).
+//
+// A request with no answer after timeout_ms gets a 5.04 (Gateway
+// Timeout) and counts against its backend; after max_failures in a row
+// the backend is out for retry_ms, its keys going to the next backend
+// on the ring, then gets one more chance.  RTTs are tracked per backend
+// (net::PeerTable's estimator).  With the table full the proxy answers
+// 5.03, with no backend up 5.02.
+//
+// A GET for what another GET is being fetched for (same cache key:
+// Uri-Host, Uri-Port, Uri-Path, Uri-Query and Accept, NoCacheKey
+// options left out) is not forwarded: it waits for that one's
+// response, which is relayed to each waiter with their own header and
+// token, or its empty ACK, RST or 5.04.  GETs with other options
+// (Observe, Block2, ETag...) go on their own.
+//
+// Observe notifications after the first response are not relayed.
+//
+// Custom options are to be registered before the proxy is made: it
+// freezes the coap::OptionRegistry.
+class ReverseProxy : public net::Handler {
+ public:
+  // transport must be open and outlive the proxy.
+  ReverseProxy(net::Transport* transport,
+               const ProxyConfig& config = kDefaultProxyConfig);
+
+  // Send requests to addr too, weight times as many as to a backend of
+  // weight 1.  Before serving starts.
+  bool AddBackend(const sockaddr* addr, socklen_t addr_len,
+                  unsigned weight = 1);
+
+  // Wait up to timeout_ms for datagrams and handle them, then time out
+  // what is due.
+  void RunOnce(int timeout_ms);
+
+  void OnDatagram(const net::Datagram& dgram);
+
+  // Time out the exchanges due at now_ms (NowMs() time).  Return how
+  // many.
+  size_t Expire(uint64_t now_ms);
+
+  static uint64_t NowMs();
+
+  struct BackendStats {
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t timeouts;
+    uint32_t srtt_ms;           // 0 until the first response
+    uint32_t rto_ms;
+    bool up;                    // false from going out until it answers
+  };
+
+  size_t backends() const { return backends_.size(); }
+  BackendStats backend(size_t i) const;
+
+  size_t pending() const { return exchanges_.size() - free_.size(); }
+
+  // Counters
+  uint64_t forwarded() const { return forwarded_; }   // requests
+  uint64_t relayed() const { return relayed_; }       // responses
+  uint64_t rejected() const { return rejected_; }  // 5.0x, 4.02, 4.13
+  uint64_t expired() const { return expired_; }       // 5.04
+  uint64_t coalesced() const { return coalesced_; }   // not forwarded
+
+ private:
+  enum class State : uint8_t {
+    free,
+    waiting,      // forwarded
+    accepted,     // the backend ACKed a CON, a separate response follows
+    relaying      // a separate response is out to the client as a CON
+  };
+
+  struct Exchange {
+    State state;
+    uint32_t nonce;
+    uint32_t backend;
+    uint16_t upstream_mid;      // of the request to the backend
+    uint16_t client_mid;        // of the client's request
+    uint16_t response_mid;      // ours, of a separate response
+    uint16_t backend_response_mid;
+    uint8_t client_type;
+    uint8_t token_length;
+    uint8_t token[8];
+    uint8_t retransmits;        // of the request, by the client
+    bool answered;              // RTT taken
+    uint32_t client_hash;
+    sockaddr_storage client;
+    socklen_t client_len;
+    uint64_t sent_ms;
+    uint32_t prev;              // in sending order, for the timeouts
+    uint32_t next;
+
+    // Coalescing: a leader is forwarded, its waiters are not.
+    uint32_t leader;            // kNone if not a waiter
+    uint32_t waiters;           // first one, if a leader
+    uint32_t next_waiter;
+    bool leading;               // in inflight_
+    uint64_t key_hash;
+    std::string key;            // the cache key options, if leading
+  };
+
+  struct Backend {
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    uint32_t hash;
+    uint16_t next_mid;
+    unsigned failures;          // timeouts in a row
+    uint64_t down_until_ms;     // 0 if up
+    net::Peer* peer;            // in peers_, for the RTT
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t timeouts;
+  };
+
+  // by_mid_ keys: a request from a client, or an empty message (ACK or
+  // RST) from either side.
+  enum Kind : uint64_t { kRequest = 0, kEmpty = 1 };
+
+  static uint64_t Key(Kind kind, uint32_t hash, uint16_t mid) {
+    return (static_cast<uint64_t>(kind) << 48) |
+           (static_cast<uint64_t>(hash) << 16) | mid;
+  }
+
+  void OnRequest(const coap::PDUView& req, const net::Datagram& dgram,
+                 uint64_t now);
+  void OnResponse(const coap::PDUView& rsp, const net::Datagram& dgram,
+                  uint64_t now);
+  void OnEmpty(const net::Datagram& dgram, bool reset, uint64_t now);
+
+  bool Up(uint32_t backend, uint64_t now) const;
+  void Answered(Exchange& x, uint64_t now);
+  void Forward(uint32_t i, const coap::PDUView& req);
+  void Wait(uint32_t i, uint32_t leader);
+  void Settle(uint32_t i, const coap::PDUView* rsp, bool reset);
+  void Forget(uint32_t i);
+  void Relay(const Exchange& x, const coap::PDUView& rsp, uint8_t type,
+             uint16_t mid);
+  void SendEmpty(uint8_t type, uint16_t mid, const sockaddr* to,
+                 socklen_t to_len);
+  void Reply(const net::Datagram& dgram, coap::Code code);
+  void Reply(const Exchange& x, coap::Code code);
+  void EraseKey(Kind kind, uint32_t hash, uint16_t mid, uint32_t i);
+  void Link(uint32_t i, uint64_t now);
+  void Unlink(uint32_t i);
+  void Free(uint32_t i);
+
+  static const uint32_t kNone = ~0U;
+
+ private:
+  net::Transport* transport_;
+  const ProxyConfig config_;
+
+  std::vector<Backend> backends_;
+  HashRing ring_;
+  net::PeerTable peers_;
+
+  std::vector<Exchange> exchanges_;
+  std::vector<uint32_t> free_;
+  std::unordered_map<uint64_t, uint32_t> by_mid_;
+  std::unordered_map<uint64_t, uint32_t> inflight_;   // key hash to leader
+  std::string key_;                   // OnRequest() scratch
+  uint32_t oldest_;                   // list of those in use, by age
+  uint32_t newest_;
+  uint64_t nonce_;
+  uint16_t next_mid_;                 // to clients
+
+  uint8_t out_[net::kMaxDatagramSize];
+
+  uint64_t forwarded_;
+  uint64_t relayed_;
+  uint64_t rejected_;
+  uint64_t expired_;
+  uint64_t coalesced_;
+};
+
+}   // namespace proxy
+
+#endif  // PROXY_REVERSE_PROXY_H_
@@ -0,0 +1,204 @@
+// Copyleft 2013 tho@autistici.org
+
+// Forwarding throughput and latency on loopback.
+//
+// Backends, each a thread with its own transport, answer every request
+// with a piggybacked 2.05 echoing its options and payload.  A closed-
+// loop client keeps `window` CON GETs in flight, over 1000 paths, first
+// straight to one backend, then through the proxy spreading them over
+// all of them, so that what the proxy adds can be told apart.  Last,
+// all the requests are for one hot resource, which the proxy coalesces
+// into as few fetches as there are rounds of the window.
+//
+// Usage: reverse_proxy_bench [total [window [backends]]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "utils/histogram.h"
+#include "proxy/reverse_proxy.h"
+
+using namespace proxy;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+class Echo : public net::Handler {
+ public:
+  explicit Echo(net::Transport* transport) : transport_(transport) { }
+
+  void OnDatagram(const net::Datagram& dgram) {
+    if (dgram.size < 4 || dgram.data[1] == coap::Code::Empty)
+      return;
+    memcpy(buf_, dgram.data, dgram.size);
+    buf_[0] = (buf_[0] & 0xCF) | (coap::Type::ACK << 4);
+    buf_[1] = coap::Code::Content;
+    transport_->Send(buf_, dgram.size, dgram.peer, dgram.peer_len);
+  }
+
+ private:
+  net::Transport* transport_;
+  uint8_t buf_[net::kMaxDatagramSize];
+};
+
+// A transport on an ephemeral loopback port.
+std::unique_ptr<net::Transport> open(sockaddr_in& addr) {
+  std::unique_ptr<net::Transport> t = net::NewTransport(net::Backend::any);
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+  socklen_t len = sizeof addr;
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+  return t;
+}
+
+std::vector<uint8_t> encode(size_t path) {
+  coap::PDU pdu;
+  pdu.set_type(coap::Type::CON);
+  pdu.set_code(coap::Code::GET);
+  pdu.set_token({ 0, 0 });
+  coap::Options opts;
+  opts.AddUriPath("sensors");
+  opts.AddUriPath(std::to_string(path));
+  opts.AddUriQuery("unit=c");
+  pdu.set_options(opts);
+
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+// Run the client against addr until total requests for npaths
+// resources are answered.
+void run(const char* label, const sockaddr_in& addr, size_t total,
+         size_t window, size_t npaths) {
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(client != -1);
+  assert(connect(client, reinterpret_cast<const sockaddr*>(&addr),
+                 sizeof addr) == 0);
+  timeval tv = { 1, 0 };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+  std::vector<std::vector<uint8_t>> reqs;
+  for (size_t i = 0; i < npaths; ++i)
+    reqs.push_back(encode(i));
+
+  std::vector<Clock::time_point> sent_at(65536);
+  utils::Histogram h;
+  size_t sent = 0, done = 0, lost = 0;
+  Clock::time_point start = Clock::now();
+
+  while (done + lost < total) {
+    while (sent - done - lost < window && sent < total) {
+      uint16_t mid = sent;
+      std::vector<uint8_t>& req = reqs[(sent * 7919) % reqs.size()];
+      req[2] = req[4] = mid >> 8;
+      req[3] = req[5] = mid & 0xFF;
+      sent_at[mid] = Clock::now();
+      send(client, req.data(), req.size(), 0);
+      ++sent;
+    }
+
+    uint8_t buf[net::kMaxDatagramSize];
+    ssize_t n = recv(client, buf, sizeof buf, 0);
+    if (n < 4) {
+      lost += sent - done - lost;
+      continue;
+    }
+
+    uint16_t mid = (buf[2] << 8) | buf[3];
+    h.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - sent_at[mid]).count());
+    ++done;
+  }
+
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  close(client);
+
+  printf("%s %8.0f req/s, %zu lost\n", label, done / elapsed.count(), lost);
+  h.Print(stdout, "  latency", 1000, "us");
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t total = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+  size_t window = argc > 2 ? strtoul(argv[2], nullptr, 10) : 32;
+  size_t nbackends = argc > 3 ? strtoul(argv[3], nullptr, 10) : 4;
+
+  printf("%zu requests, window %zu, %zu backends\n", total, window,
+         nbackends);
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<net::Transport>> bt;
+  std::vector<std::unique_ptr<Echo>> echoes;
+  std::vector<sockaddr_in> backend_addr(nbackends);
+
+  for (size_t i = 0; i < nbackends; ++i) {
+    bt.push_back(open(backend_addr[i]));
+    echoes.emplace_back(new Echo(bt.back().get()));
+    net::Transport* t = bt.back().get();
+    Echo* echo = echoes.back().get();
+    threads.emplace_back([t, echo, &stop] {
+      while (!stop) {
+        t->Poll(echo, 10);
+        t->Flush();
+      }
+    });
+  }
+
+  run("direct, 1 backend:  ", backend_addr[0], total, window, 1000);
+
+  sockaddr_in proxy_addr;
+  std::unique_ptr<net::Transport> pt = open(proxy_addr);
+  ReverseProxy proxy(pt.get());
+  for (const sockaddr_in& addr : backend_addr)
+    assert(proxy.AddBackend(reinterpret_cast<const sockaddr*>(&addr),
+                            sizeof addr));
+  threads.emplace_back([&proxy, &stop] {
+    while (!stop)
+      proxy.RunOnce(10);
+  });
+
+  run("through the proxy:  ", proxy_addr, total, window, 1000);
+  uint64_t forwarded = proxy.forwarded();
+  run("one hot resource:   ", proxy_addr, total, window, 1);
+  printf("  %llu fetches for %zu requests\n",
+         static_cast<unsigned long long>(proxy.forwarded() - forwarded),
+         total);
+
+  stop = true;
+  for (auto& t : bt)
+    t->Wake();
+  pt->Wake();
+  for (std::thread& t : threads)
+    t.join();
+
+  printf("forwarded %llu, relayed %llu, coalesced %llu, rejected %llu, "
+         "expired %llu\n",
+         static_cast<unsigned long long>(proxy.forwarded()),
+         static_cast<unsigned long long>(proxy.relayed()),
+         static_cast<unsigned long long>(proxy.coalesced()),
+         static_cast<unsigned long long>(proxy.rejected()),
+         static_cast<unsigned long long>(proxy.expired()));
+  for (size_t i = 0; i < proxy.backends(); ++i) {
+    ReverseProxy::BackendStats stats = proxy.backend(i);
+    printf("  backend %zu: %llu requests, srtt %u ms\n", i,
+           static_cast<unsigned long long>(stats.requests), stats.srtt_ms);
+  }
+}
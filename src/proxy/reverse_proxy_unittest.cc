@@ -0,0 +1,620 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <time.h>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "coap/header.h"
+#include "coap/pdu.h"
+#include "coap/registry.h"
+#include "utils/log.h"
+#include "net/sim_testing.h"
+#include "proxy/reverse_proxy.h"
+
+using namespace proxy;
+using namespace net::testing;
+
+void init_log() {
+  utils::Log::Instance()->Open("reverse_proxy_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// What comes after the token: options and payload.
+Bytes tail(const Bytes& wire) {
+  return Bytes(wire.begin() + 4 + (wire[0] & 0x0F), wire.end());
+}
+
+// A backend answering with its name as payload.
+class Backend : public net::Handler {
+ public:
+  enum Mode {
+    piggyback,      // on the ACK of a CON, or a NON
+    separate,       // empty ACK, then a CON
+    silent,
+    reset
+  };
+
+  Backend(net::SimTransport* transport, const std::string& name)
+    : transport_(transport)
+    , name_(name)
+    , mode(piggyback)
+    , next_mid(0x7000)
+  { }
+
+  void OnDatagram(const net::Datagram& dgram) {
+    got.push_back(Bytes(dgram.data, dgram.data + dgram.size));
+    if (coap::ClassifyEmpty(dgram.data, dgram.size) != coap::EmptyKind::other)
+      return;
+    ++requests;
+
+    coap::PDUView req = view(got.back());
+    sockaddr_in from;
+    memcpy(&from, dgram.peer, sizeof from);
+
+    switch (mode) {
+      case piggyback:
+        Respond(req, req.type() == coap::Type::CON ? coap::Type::ACK
+                                                   : coap::Type::NON,
+                req.type() == coap::Type::CON ? req.message_id()
+                                              : next_mid++,
+                from);
+        break;
+
+      case separate:
+        SendEmpty(*transport_, coap::Type::ACK, req.message_id(), from);
+        Respond(req, coap::Type::CON, next_mid++, from);
+        break;
+
+      case silent:
+        break;
+
+      case reset:
+        SendEmpty(*transport_, coap::Type::RST, req.message_id(), from);
+        break;
+    }
+  }
+
+  void Respond(const coap::PDUView& req, coap::Type type, uint16_t mid,
+               const sockaddr_in& to) {
+    coap::PDU rsp;
+    rsp.set_type(type);
+    rsp.set_code(coap::Code::Content);
+    rsp.set_message_id(mid);
+    rsp.set_token(Bytes(req.token(), req.token() + req.token_length()));
+    coap::Options opts;
+    assert(opts.AddContentFormat(0));
+    assert(opts.AddMaxAge(60));
+    rsp.set_options(opts);
+    rsp.set_payload(Bytes(name_.begin(), name_.end()));
+
+    Bytes wire;
+    assert(rsp.Encode(wire));
+    sent.push_back(wire);
+    assert(transport_->Send(wire.data(), wire.size(), sa(to), sizeof to));
+  }
+
+ private:
+  net::SimTransport* transport_;
+  const std::string name_;
+
+ public:
+  Mode mode;
+  uint16_t next_mid;
+  size_t requests = 0;
+  std::vector<Bytes> got;
+  std::vector<Bytes> sent;
+};
+
+// A proxy on the node, alice as its client, and three backends.
+struct Fixture : SimFixture {
+  explicit Fixture(const ProxyConfig& config = kDefaultProxyConfig,
+                   size_t nbackends = 3)
+    : proxy(&node, config) {
+    node.Attach(&proxy);
+
+    for (size_t i = 0; i < nbackends; ++i) {
+      bts.emplace_back(new net::SimTransport(&network));
+      backends.emplace_back(new Backend(bts.back().get(),
+                                        "b" + std::to_string(i)));
+      sockaddr_in addr = address(0x0A000100 + i, 5683);
+      assert(bts.back()->Open(sa(addr), sizeof addr));
+      bts.back()->Attach(backends.back().get());
+      assert(proxy.AddBackend(sa(addr), sizeof addr));
+      backend_addr.push_back(addr);
+    }
+  }
+
+  // path is '/' separated.  Return the request as sent.
+  Bytes Request(coap::Type type, const std::string& path,
+                const std::string& body = "", uint16_t message_id = 0) {
+    uint16_t id = message_id ? message_id : mid++;
+    Bytes wire = Encode(type, body.empty() ? coap::Code::GET : coap::Code::PUT,
+                        id, std::string("\xCA\xFE", 2) + char(mid), path,
+                        "x=1", body);
+    Send(at, wire);
+    return wire;
+  }
+
+  void Resend(const Bytes& wire) { Send(at, wire); }
+
+  // Which backend a GET of path goes to.
+  size_t Route(const std::string& path) {
+    alice.got.clear();
+    Request(coap::Type::CON, path);
+    assert(alice.got.size() == 1);
+    std::string name = alice.got[0].payload;
+    assert(name[0] == 'b');
+    return std::stoul(name.substr(1));
+  }
+
+  std::vector<std::unique_ptr<net::SimTransport>> bts;   // backends'
+  ReverseProxy proxy;
+  std::vector<std::unique_ptr<Backend>> backends;
+  std::vector<sockaddr_in> backend_addr;
+};
+
+void sleep_ms(long ms) {
+  timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+  nanosleep(&ts, nullptr);
+}
+
+void test_ok_forward() {
+  Fixture f;
+  assert(coap::OptionRegistry::Instance()->frozen());
+
+  Bytes req = f.Request(coap::Type::CON, "sensors/temp", "21.5");
+  size_t b = f.Route("sensors/temp");
+  Backend& be = *f.backends[b];
+
+  // Only the header and the token changed on the way.
+  Bytes up = be.got[0];
+  coap::PDUView upv = view(up);
+  assert(upv.type() == coap::Type::CON);
+  assert(upv.code() == coap::Code::PUT);
+  assert(upv.token_length() == 8);
+  assert(tail(up) == tail(req));
+  assert(payload(upv) == "21.5");
+
+  // Same on the way back, with the client's message ID and token.
+  assert(f.alice.got.size() == 1);
+  f.alice.got.clear();
+  f.Request(coap::Type::CON, "sensors/temp", "", 4242);
+  assert(f.alice.got.size() == 1);
+  Bytes down = f.alice.got[0].wire;
+  coap::PDUView v = view(down);
+  assert(v.type() == coap::Type::ACK);
+  assert(v.message_id() == 4242);
+  assert(token(v) == std::string("\xCA\xFE", 2) + char(f.mid));
+  assert(v.code() == coap::Code::Content);
+  assert(tail(down) == tail(be.sent.back()));
+
+  // Every exchange went to a new upstream message ID.
+  assert(be.got.size() == 3);
+  assert(view(be.got[1]).message_id() != upv.message_id());
+  assert(view(be.got[2]).message_id() != view(be.got[1]).message_id());
+
+  // NON in, NON out.
+  f.alice.got.clear();
+  f.Request(coap::Type::NON, "sensors/temp");
+  assert(f.alice.got.size() == 1);
+  assert(view(f.alice.got[0].wire).type() == coap::Type::NON);
+  assert(view(be.got.back()).type() == coap::Type::NON);
+
+  assert(f.proxy.forwarded() == 4);
+  assert(f.proxy.relayed() == 4);
+  assert(f.proxy.pending() == 0);
+  ReverseProxy::BackendStats stats = f.proxy.backend(b);
+  assert(stats.requests == 4 && stats.responses == 4 && stats.up);
+}
+
+void test_ok_unknown_elective() {
+  Fixture f;
+  size_t b = f.Route("u");
+
+  // GET /u with option 2000, unknown and elective, then 2001, critical.
+  Bytes req {
+    0x41, coap::Code::GET, 0x12, 0x34, 0x77,
+    0xB1, 'u',
+    0xE2, 0x06, 0xB8, 0xAA, 0xBB
+  };
+  f.alice.got.clear();
+  f.Resend(req);
+  assert(f.alice.got.size() == 1);
+  assert(view(f.alice.got[0].wire).message_id() == 0x1234);
+  assert(tail(f.backends[b]->got.back()) == tail(req));
+
+  // Not forwarded: a 4.02 instead, on the ACK of a CON.
+  req[9] = 0xB9;
+  f.Resend(req);
+  assert(f.proxy.forwarded() == 2);
+  assert(f.proxy.rejected() == 1);
+  assert(f.alice.got.size() == 2);
+  coap::PDUView v = view(f.alice.got[1].wire);
+  assert(v.type() == coap::Type::ACK);
+  assert(v.code() == coap::Code::BadOption);
+  assert(v.message_id() == 0x1234);
+  assert(token(v) == "\x77");
+
+  // In a NON of its own to a NON.
+  req[0] = 0x51;
+  req[3] = 0x35;
+  f.Resend(req);
+  assert(f.proxy.forwarded() == 2);
+  assert(f.alice.got.size() == 3);
+  v = view(f.alice.got[2].wire);
+  assert(v.type() == coap::Type::NON);
+  assert(v.code() == coap::Code::BadOption);
+  assert(token(v) == "\x77");
+
+  // Badly formatted after it: dropped.
+  req.push_back(0xFF);
+  f.Resend(req);
+  assert(f.alice.got.size() == 3);
+}
+
+void test_ok_affinity() {
+  Fixture f;
+
+  std::vector<size_t> first, count(3);
+  for (int i = 0; i < 300; ++i) {
+    first.push_back(f.Route("things/" + std::to_string(i)));
+    ++count[first.back()];
+  }
+  for (size_t c : count)
+    assert(c > 50);
+  for (int i = 0; i < 300; ++i)
+    assert(f.Route("things/" + std::to_string(i)) == first[i]);
+}
+
+void test_ok_hash_option() {
+  ProxyConfig config = kDefaultProxyConfig;
+  config.hash_option = coap::OptionNumber::Uri_Query;
+  Fixture f(config);
+
+  // Every request has the same query.
+  size_t b = f.Route("a");
+  for (int i = 0; i < 50; ++i)
+    assert(f.Route("things/" + std::to_string(i)) == b);
+}
+
+void test_ok_separate() {
+  Fixture f;
+  size_t b = f.Route("slow");
+  Backend& be = *f.backends[b];
+  be.mode = Backend::separate;
+
+  f.alice.got.clear();
+  f.Request(coap::Type::CON, "slow", "", 77);
+  assert(f.alice.got.size() == 2);
+
+  // The empty ACK, then the response as a CON of ours.
+  Bytes ack = f.alice.got[0].wire;
+  assert(coap::ClassifyEmpty(ack.data(), ack.size()) == coap::EmptyKind::ack);
+  assert(coap::HeaderMessageId(ack.data()) == 77);
+
+  Bytes rsp = f.alice.got[1].wire;
+  coap::PDUView v = view(rsp);
+  assert(v.type() == coap::Type::CON);
+  assert(token(v) == std::string("\xCA\xFE", 2) + char(f.mid));
+  assert(tail(rsp) == tail(be.sent.back()));
+  assert(f.proxy.pending() == 1);
+
+  // The client's ACK goes back to the backend, as the ACK of its CON.
+  size_t before = be.got.size();
+  SendEmpty(f.at, coap::Type::ACK, v.message_id(), f.node_addr);
+  f.network.Run();
+  assert(be.got.size() == before + 1);
+  Bytes back = be.got.back();
+  assert(coap::ClassifyEmpty(back.data(), back.size()) ==
+         coap::EmptyKind::ack);
+  assert(coap::HeaderMessageId(back.data()) ==
+         view(be.sent.back()).message_id());
+  assert(f.proxy.pending() == 0);
+}
+
+void test_ok_retransmission() {
+  Fixture f;
+  size_t b = f.Route("lossy");
+  Backend& be = *f.backends[b];
+  be.mode = Backend::silent;
+
+  // The same CON twice: forwarded twice, as the same message.
+  f.alice.got.clear();
+  Bytes req = f.Request(coap::Type::CON, "lossy", "", 900);
+  f.Resend(req);
+  assert(be.got.size() == 3);
+  assert(be.got[1] == be.got[2]);
+  assert(f.proxy.forwarded() == 2);
+  assert(f.proxy.pending() == 1);
+
+  // Once accepted, a retransmission gets the ACK again.
+  coap::PDUView up = view(be.got[2]);
+  SendEmpty(*f.bts[b], coap::Type::ACK, up.message_id(), f.node_addr);
+  f.network.Run();
+  assert(f.alice.got.size() == 1);
+  f.Resend(req);
+  assert(be.got.size() == 3);
+  assert(f.alice.got.size() == 2);
+  assert(f.alice.got[0].wire == f.alice.got[1].wire);
+  assert(coap::HeaderMessageId(f.alice.got[1].wire.data()) == 900);
+}
+
+void test_ok_reset() {
+  Fixture f;
+  size_t b = f.Route("gone");
+  f.backends[b]->mode = Backend::reset;
+
+  f.alice.got.clear();
+  f.Request(coap::Type::CON, "gone", "", 31);
+  assert(f.alice.got.size() == 1);
+  Bytes rst = f.alice.got[0].wire;
+  assert(coap::ClassifyEmpty(rst.data(), rst.size()) ==
+         coap::EmptyKind::reset);
+  assert(coap::HeaderMessageId(rst.data()) == 31);
+  assert(f.proxy.pending() == 0);
+}
+
+void test_ok_timeout_down_up() {
+  ProxyConfig config = kDefaultProxyConfig;
+  config.timeout_ms = 20;
+  config.max_failures = 2;
+  config.retry_ms = 50;
+  Fixture f(config);
+
+  std::vector<size_t> first;
+  for (int i = 0; i < 100; ++i)
+    first.push_back(f.Route("k/" + std::to_string(i)));
+  size_t b = f.Route("k/0");
+  f.backends[b]->mode = Backend::silent;
+
+  // Two timeouts in a row take it out.
+  for (int n = 0; n < 2; ++n) {
+    f.alice.got.clear();
+    f.Request(coap::Type::CON, "k/0", "", 500 + n);
+    assert(f.alice.got.empty());
+    assert(f.proxy.Expire(ReverseProxy::NowMs() + 20) == 1);
+    f.network.Run();
+    assert(f.alice.got.size() == 1);
+    coap::PDUView v = view(f.alice.got[0].wire);
+    assert(v.type() == coap::Type::ACK && v.message_id() == 500 + n);
+    assert(v.code() == coap::Code::GatewayTimeout);
+  }
+  assert(f.proxy.expired() == 2);
+  ReverseProxy::BackendStats stats = f.proxy.backend(b);
+  assert(stats.timeouts == 2 && !stats.up);
+
+  // Its keys go elsewhere, the others stay.
+  for (int i = 0; i < 100; ++i) {
+    size_t now = f.Route("k/" + std::to_string(i));
+    assert(first[i] == b ? now != b : now == first[i]);
+  }
+
+  // And come back after retry_ms, if it answers.
+  f.backends[b]->mode = Backend::piggyback;
+  sleep_ms(20 + 50 + 20);
+  assert(f.Route("k/0") == b);
+  assert(f.proxy.backend(b).up);
+  for (int i = 0; i < 100; ++i)
+    assert(f.Route("k/" + std::to_string(i)) == first[i]);
+}
+
+// Five GETs of the same resource while it is being fetched: one goes
+// upstream, all get its response.
+void test_ok_coalesce() {
+  Fixture f;
+  size_t b = f.Route("hot");
+  Backend& be = *f.backends[b];
+  be.mode = Backend::silent;
+
+  f.alice.got.clear();
+  std::vector<Bytes> reqs;
+  for (int i = 0; i < 5; ++i)
+    reqs.push_back(f.Request(i % 2 ? coap::Type::NON : coap::Type::CON,
+                             "hot"));
+  assert(be.got.size() == 2);
+  assert(f.proxy.coalesced() == 4);
+  assert(f.proxy.pending() == 5);
+
+  // Not a GET: on its own.
+  f.Request(coap::Type::CON, "hot", "1");
+  assert(be.got.size() == 3);
+
+  Bytes up = be.got[1];
+  be.Respond(view(up), coap::Type::ACK, view(up).message_id(),
+             f.node_addr);
+  f.network.Run();
+  assert(f.alice.got.size() == 5);
+  for (const Response& rsp : f.alice.got) {
+    coap::PDUView v = view(rsp.wire);
+    size_t r = 0;
+    while (token(view(reqs[r])) != token(v))
+      ++r;
+    coap::PDUView req = view(reqs[r]);
+    if (req.type() == coap::Type::CON) {
+      assert(v.type() == coap::Type::ACK);
+      assert(v.message_id() == req.message_id());
+    } else {
+      assert(v.type() == coap::Type::NON);
+    }
+    assert(tail(rsp.wire) == tail(be.sent.back()));
+  }
+  assert(f.proxy.pending() == 1);
+
+  // Done with: the next one is fetched again.
+  f.Request(coap::Type::CON, "hot");
+  assert(be.got.size() == 4);
+}
+
+void test_ok_coalesce_separate() {
+  Fixture f;
+  size_t b = f.Route("hot");
+  Backend& be = *f.backends[b];
+  be.mode = Backend::silent;
+
+  f.alice.got.clear();
+  f.Request(coap::Type::CON, "hot", "", 200);
+  f.Request(coap::Type::CON, "hot", "", 201);
+  Bytes up = be.got.back();
+
+  // The backend's ACK is every CON's.
+  SendEmpty(*f.bts[b], coap::Type::ACK, view(up).message_id(), f.node_addr);
+  f.network.Run();
+  assert(f.alice.got.size() == 2);
+  for (const Response& ack : f.alice.got)
+    assert(ack.type == coap::Type::ACK && ack.code == coap::Code::Empty);
+
+  // Joining late gets it straight away.
+  f.Request(coap::Type::CON, "hot", "", 202);
+  assert(f.alice.got.size() == 3);
+  assert(coap::HeaderMessageId(f.alice.got[2].wire.data()) == 202);
+  assert(be.got.size() == 2);
+
+  // The response: a CON for the first, NONs for the others.
+  f.alice.got.clear();
+  be.Respond(view(up), coap::Type::CON, 0x7777, f.node_addr);
+  f.network.Run();
+  assert(f.alice.got.size() == 3);
+  size_t cons = 0;
+  for (const Response& rsp : f.alice.got) {
+    cons += rsp.type == coap::Type::CON;
+    assert(tail(rsp.wire) == tail(be.sent.back()));
+  }
+  assert(cons == 1);
+  assert(f.proxy.pending() == 1);
+}
+
+void test_ok_coalesce_timeout() {
+  Fixture f;
+  size_t b = f.Route("hot");
+  f.backends[b]->mode = Backend::silent;
+
+  f.alice.got.clear();
+  f.Request(coap::Type::CON, "hot", "", 300);
+  f.Request(coap::Type::NON, "hot", "", 301);
+  f.Request(coap::Type::CON, "hot", "", 302);
+  assert(f.proxy.Expire(ReverseProxy::NowMs() +
+                        kDefaultProxyConfig.timeout_ms) == 3);
+  f.network.Run();
+  assert(f.alice.got.size() == 3);
+  for (const Response& rsp : f.alice.got)
+    assert(rsp.code == coap::Code::GatewayTimeout);
+  assert(f.proxy.expired() == 3);
+  assert(f.proxy.backend(b).timeouts == 1);
+  assert(f.proxy.pending() == 0);
+}
+
+void test_ok_coalesce_off() {
+  ProxyConfig config = kDefaultProxyConfig;
+  config.coalesce = false;
+  Fixture f(config);
+  size_t b = f.Route("hot");
+  f.backends[b]->mode = Backend::silent;
+
+  f.Request(coap::Type::CON, "hot");
+  f.Request(coap::Type::CON, "hot");
+  assert(f.backends[b]->got.size() == 3);
+  assert(f.proxy.coalesced() == 0);
+}
+
+void test_ko_full() {
+  ProxyConfig config = kDefaultProxyConfig;
+  config.max_pending = 2;
+  Fixture f(config);
+  for (auto& be : f.backends)
+    be->mode = Backend::silent;
+
+  f.Request(coap::Type::CON, "a");
+  f.Request(coap::Type::CON, "b");
+  assert(f.alice.got.empty() && f.proxy.pending() == 2);
+  f.Request(coap::Type::NON, "c");
+  assert(f.alice.got.size() == 1);
+  coap::PDUView v = view(f.alice.got[0].wire);
+  assert(v.type() == coap::Type::NON);
+  assert(v.code() == coap::Code::ServiceUnavailable);
+  assert(f.proxy.rejected() == 1);
+
+  // Room again once they time out.
+  assert(f.proxy.Expire(ReverseProxy::NowMs() + config.timeout_ms) == 2);
+  assert(f.proxy.pending() == 0);
+}
+
+void test_ko_no_backend() {
+  Fixture f(kDefaultProxyConfig, 0);
+  f.Request(coap::Type::CON, "a", "", 12);
+  assert(f.alice.got.size() == 1);
+  coap::PDUView v = view(f.alice.got[0].wire);
+  assert(v.type() == coap::Type::ACK && v.message_id() == 12);
+  assert(v.code() == coap::Code::BadGateway);
+  assert(f.proxy.forwarded() == 0);
+}
+
+void test_ko_add_backend() {
+  Fixture f(kDefaultProxyConfig, 1);
+  assert(!f.proxy.AddBackend(sa(f.backend_addr[0]),
+                             sizeof f.backend_addr[0]));
+  sockaddr_in other = address(0x0A000200, 5683);
+  assert(!f.proxy.AddBackend(sa(other), sizeof other, 0));
+  sockaddr unix_addr;
+  memset(&unix_addr, 0, sizeof unix_addr);
+  unix_addr.sa_family = AF_UNIX;
+  assert(!f.proxy.AddBackend(&unix_addr, sizeof unix_addr));
+  assert(f.proxy.backends() == 1);
+}
+
+void test_ko_stray() {
+  Fixture f(kDefaultProxyConfig, 1);
+  Backend& be = *f.backends[0];
+
+  // A CON response nobody asked for gets a RST, a ping too.
+  coap::PDU rsp;
+  rsp.set_type(coap::Type::CON);
+  rsp.set_code(coap::Code::Content);
+  rsp.set_message_id(99);
+  rsp.set_token(Bytes(8, 0xEE));
+  Bytes wire;
+  assert(rsp.Encode(wire));
+  assert(f.bts[0]->Send(wire.data(), wire.size(), sa(f.node_addr),
+                       sizeof f.node_addr));
+  SendEmpty(*f.bts[0], coap::Type::CON, 100, f.node_addr);
+  f.network.Run();
+  assert(be.got.size() == 2);
+  assert(coap::ClassifyEmpty(be.got[0].data(), be.got[0].size()) ==
+         coap::EmptyKind::reset);
+  assert(coap::HeaderMessageId(be.got[0].data()) == 99);
+  assert(coap::HeaderMessageId(be.got[1].data()) == 100);
+
+  // A response with a good token from someone else is not the backend's.
+  be.mode = Backend::silent;
+  f.Request(coap::Type::CON, "a");
+  Bytes up = be.got.back();
+  wire = up;
+  wire[0] = (coap::Version::v1 << 6) | (coap::Type::ACK << 4) | 8;
+  wire[1] = coap::Code::Content;
+  f.Send(f.at, wire);
+  assert(f.alice.got.empty());
+  assert(f.proxy.pending() == 1);
+}
+
+int main() {
+  init_log();
+
+  test_ok_forward();
+  test_ok_unknown_elective();
+  test_ok_affinity();
+  test_ok_hash_option();
+  test_ok_separate();
+  test_ok_retransmission();
+  test_ok_reset();
+  test_ok_timeout_down_up();
+  test_ok_coalesce();
+  test_ok_coalesce_separate();
+  test_ok_coalesce_timeout();
+  test_ok_coalesce_off();
+  test_ko_full();
+  test_ko_no_backend();
+  test_ko_add_backend();
+  test_ko_stray();
+}
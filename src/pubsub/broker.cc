@@ -0,0 +1,722 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "coap/header.h"
+#include "utils/log.h"
+#include "pubsub/broker.h"
+
+namespace pubsub {
+
+namespace {
+
+const uint32_t kNone = TopicTrie::kNone;
+
+// Room before a publication's encoded tail in Broker::scratch_: the
+// header and the longest token.
+const size_t kHeadRoom = 4 + 8;
+
+// Most option bytes a publication's tail carries: Observe (1 + 3) and
+// Content-Format (1 + 2), plus the payload marker.
+const size_t kMaxTailOverhead = 4 + 3 + 1;
+
+// Append an option with a minimal uint value.  Deltas here are small
+// (Observe, Content-Format): 0-12 fit the header nibble, and anything
+// up to 268 the 1-byte extended form.
+void AppendUint(std::vector<uint8_t>& buf, size_t delta, uint64_t value) {
+  uint8_t bytes[8];
+  size_t length = 0;
+  for (uint64_t v = value; v > 0; v >>= 8)
+    ++length;
+  for (size_t i = 0; i < length; ++i)
+    bytes[i] = value >> (8 * (length - 1 - i));
+
+  if (delta < 13) {
+    buf.push_back((delta << 4) | length);
+  } else {
+    buf.push_back((13 << 4) | length);
+    buf.push_back(delta - 13);
+  }
+  buf.insert(buf.end(), bytes, bytes + length);
+}
+
+uint64_t DecodeUint(const uint8_t* value, size_t length) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < length; ++i)
+    v = (v << 8) | value[i];
+  return v;
+}
+
+}   // namespace
+
+Broker::Broker(net::Transport* transport, const BrokerConfig& config)
+  : transport_(transport)
+  , config_(config)
+  , lru_head_(kNone)
+  , lru_tail_(kNone)
+  , notified_(65536, kNone)
+  , next_mid_(0)
+  , scratch_(net::kMaxDatagramSize)
+  , retained_bytes_(0)
+  , publications_(0)
+  , notifications_(0)
+  , evictions_(0)
+  , expirations_(0)
+  , lapsed_(0) {
+  response_.reserve(net::kMaxDatagramSize);
+
+  std::random_device rd;
+  rng_.seed(rd());
+}
+
+uint64_t Broker::NowMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void Broker::RunOnce(int timeout_ms) {
+  transport_->Poll(this, NextTimeout(timeout_ms));
+  Expire(NowMs());
+  transport_->Flush();
+}
+
+// timeout_ms, or less if a retransmission is due before.
+int Broker::NextTimeout(int timeout_ms) const {
+  if (timers_.empty())
+    return timeout_ms;
+
+  uint64_t now = NowMs();
+  uint64_t at = timers_.top().at_ms;
+  int due = at > now ? static_cast<int>(std::min<uint64_t>(at - now,
+                                                           INT32_MAX)) : 0;
+  return timeout_ms < 0 ? due : std::min(timeout_ms, due);
+}
+
+void Broker::Parse(const coap::PDUView& req, bool create, Request& r) {
+  r.node = TopicTrie::kRoot;
+  r.too_long = false;
+  r.observe = -1;
+  r.content_format = kNoContentFormat;
+  r.max_age = -1;
+
+  coap::OptionCursor cursor = req.options();
+  size_t num;
+  const uint8_t* value;
+  size_t length;
+
+  while (cursor.Next(num, value, length)) {
+    switch (num) {
+      case coap::OptionNumber::Observe:
+        r.observe = DecodeUint(value, length);
+        break;
+
+      case coap::OptionNumber::Uri_Path:
+        if (r.node == kNone)
+          break;
+        if (length > TopicTrie::kMaxLabel) {
+          // Nor anything created on the way.
+          if (create)
+            trie_.Prune(r.node);
+          r.too_long = true;
+          r.node = kNone;
+          break;
+        }
+        r.node = create
+            ? trie_.AddChild(r.node, reinterpret_cast<const char*>(value),
+                             length)
+            : trie_.Child(r.node, reinterpret_cast<const char*>(value),
+                          length);
+        break;
+
+      case coap::OptionNumber::Content_Format:
+        r.content_format = DecodeUint(value, length);
+        break;
+
+      case coap::OptionNumber::Max_Age:
+        r.max_age = DecodeUint(value, length);
+        break;
+    }
+  }
+}
+
+uint32_t Broker::TopicFor(uint32_t node, bool create) {
+  if (node_topic_.size() < trie_.capacity())
+    node_topic_.resize(trie_.capacity(), kNone);
+
+  if (node_topic_[node] != kNone || !create)
+    return node_topic_[node];
+
+  if (topics() >= config_.max_topics)
+    return kNone;
+
+  uint32_t topic;
+  if (free_topics_.empty()) {
+    topic = topics_.size();
+    topics_.emplace_back();
+  } else {
+    topic = free_topics_.back();
+    free_topics_.pop_back();
+  }
+
+  Topic& t = topics_[topic];
+  t.node = node;
+  t.observe = 0;
+  t.expires_ms = 0;
+  t.content_format = kNoContentFormat;
+  t.payload_offset = 0;
+  t.lru_prev = t.lru_next = kNone;
+  t.subs = kNone;
+  t.nsubs = 0;
+
+  node_topic_[node] = topic;
+  trie_.Ref(node);
+  return topic;
+}
+
+void Broker::FreeTopic(uint32_t topic) {
+  Topic& t = topics_[topic];
+
+  while (t.subs != kNone)
+    Unsubscribe(t.subs);
+  DropPublication(topic);
+
+  // Its nodes go too, up to those still leading to other topics.
+  node_topic_[t.node] = kNone;
+  trie_.Unref(t.node);
+  free_topics_.push_back(topic);
+}
+
+void Broker::LruUnlink(uint32_t topic) {
+  Topic& t = topics_[topic];
+
+  if (t.lru_prev != kNone)
+    topics_[t.lru_prev].lru_next = t.lru_next;
+  else
+    lru_head_ = t.lru_next;
+
+  if (t.lru_next != kNone)
+    topics_[t.lru_next].lru_prev = t.lru_prev;
+  else
+    lru_tail_ = t.lru_prev;
+
+  t.lru_prev = t.lru_next = kNone;
+}
+
+void Broker::LruPushFront(uint32_t topic) {
+  Topic& t = topics_[topic];
+
+  t.lru_prev = kNone;
+  t.lru_next = lru_head_;
+  if (lru_head_ != kNone)
+    topics_[lru_head_].lru_prev = topic;
+  else
+    lru_tail_ = topic;
+  lru_head_ = topic;
+}
+
+void Broker::DropPublication(uint32_t topic) {
+  Topic& t = topics_[topic];
+  if (t.expires_ms == 0)
+    return;
+
+  LruUnlink(topic);
+  retained_bytes_ -= t.tail.size();
+  std::vector<uint8_t>().swap(t.tail);
+  t.expires_ms = 0;
+}
+
+bool Broker::Retained(uint32_t topic) {
+  Topic& t = topics_[topic];
+  if (t.expires_ms == 0)
+    return false;
+
+  if (NowMs() >= t.expires_ms) {
+    DropPublication(topic);
+    ++expirations_;
+    return false;
+  }
+
+  return true;
+}
+
+coap::Code Broker::DoPublish(uint32_t topic, const uint8_t* data,
+                             size_t size, int content_format,
+                             int64_t max_age) {
+  if (kHeadRoom + kMaxTailOverhead + size > net::kMaxDatagramSize ||
+      size + kMaxTailOverhead > config_.memory_budget)
+    return coap::Code::RequestEntityTooLarge;
+
+  // The previous publication's buffer is reused.
+  Topic& t = topics_[topic];
+  if (t.expires_ms != 0) {
+    LruUnlink(topic);
+    retained_bytes_ -= t.tail.size();
+    t.expires_ms = 0;
+  }
+  t.tail.clear();
+
+  // Encoded once: Observe, Content-Format (delta from Observe), payload.
+  t.observe = (t.observe + 1) & 0xFFFFFF;
+  t.content_format = content_format;
+  AppendUint(t.tail, coap::OptionNumber::Observe, t.observe);
+  if (content_format != kNoContentFormat)
+    AppendUint(t.tail,
+               coap::OptionNumber::Content_Format - coap::OptionNumber::Observe,
+               content_format);
+  t.payload_offset = t.tail.size();
+  if (size > 0) {
+    t.tail.push_back(0xFF);
+    t.tail.insert(t.tail.end(), data, data + size);
+  }
+
+  uint64_t retention = max_age < 0
+      ? config_.default_retention_s
+      : std::min<uint64_t>(max_age, config_.max_retention_s);
+
+  t.expires_ms = NowMs() + retention * 1000;
+  retained_bytes_ += t.tail.size();
+  LruPushFront(topic);
+
+  // Over budget: the least recently published go.
+  while (retained_bytes_ > config_.memory_budget && lru_tail_ != topic) {
+    DropPublication(lru_tail_);
+    ++evictions_;
+  }
+
+  Fanout(topic);
+  ++publications_;
+
+  if (retention == 0)
+    DropPublication(topic);
+
+  return coap::Code::Changed;
+}
+
+bool Broker::Publish(const std::string& topic, const uint8_t* data,
+                     size_t size, int content_format) {
+  uint32_t node = trie_.Find(topic);
+
+  if (node == kNone) {
+    if (topics() >= config_.max_topics)
+      return false;
+    node = trie_.Insert(topic);
+  }
+  if (node == kNone || node == TopicTrie::kRoot)
+    return false;
+
+  uint32_t t = TopicFor(node, false);
+  bool created = t == kNone;
+  if (created)
+    t = TopicFor(node, true);
+  if (t == kNone) {
+    trie_.Prune(node);
+    return false;
+  }
+
+  if (DoPublish(t, data, size, content_format, -1) == coap::Code::Changed)
+    return true;
+  if (created)
+    FreeTopic(t);
+  return false;
+}
+
+void Broker::Fanout(uint32_t topic) {
+  const Topic& t = topics_[topic];
+  if (t.nsubs == 0)
+    return;
+
+  // The tail goes in once; each notification is its header and token
+  // written right in front of it.
+  uint8_t* tail = scratch_.data() + kHeadRoom;
+  memcpy(tail, t.tail.data(), t.tail.size());
+
+  uint64_t now = NowMs();
+  uint64_t interval = config_.confirm_interval_s * 1000ULL;
+
+  for (uint32_t s = t.subs; s != kNone; s = subs_[s].next) {
+    const Subscriber& sub = subs_[s];
+    uint8_t* p = tail - 4 - sub.token_length;
+    uint16_t mid = next_mid_++;
+
+    // A CON if one is due, or in flight already (this one replaces it).
+    uint32_t c = kNone;
+    if (sub.confirm != kNone || now - sub.confirmed_ms >= interval)
+      c = Confirm(s, now);
+
+    p[0] = (coap::Version::v1 << 6) |
+           ((c == kNone ? coap::Type::NON : coap::Type::CON) << 4) |
+           sub.token_length;
+    p[1] = coap::Code::Content;
+    p[2] = mid >> 8;
+    p[3] = mid;
+    memcpy(p + 4, sub.token, sub.token_length);
+
+    size_t size = tail + t.tail.size() - p;
+    if (c != kNone) {
+      confirms_[c].mid = mid;
+      confirms_[c].wire.assign(p, p + size);
+    }
+
+    transport_->Send(p, size, reinterpret_cast<const sockaddr*>(&sub.peer),
+                     sub.peer_len);
+    notified_[mid] = s;
+    ++notifications_;
+  }
+}
+
+// The confirmation in flight for sub, or a new one, timer set.  Those
+// replaced keep their retransmission count and timeout (RFC 7641,
+// 4.5.2).  kNone if there are too many in flight.
+uint32_t Broker::Confirm(uint32_t s, uint64_t now_ms) {
+  Subscriber& sub = subs_[s];
+  if (sub.confirm != kNone)
+    return sub.confirm;
+
+  if (confirming() >= kMaxConfirmations)
+    return kNone;
+
+  uint32_t c;
+  if (free_confirms_.empty()) {
+    c = confirms_.size();
+    confirms_.emplace_back();
+    confirms_[c].serial = 0;
+  } else {
+    c = free_confirms_.back();
+    free_confirms_.pop_back();
+  }
+
+  std::uniform_real_distribution<double> factor(1, kAckRandomFactor);
+  Confirmation& conf = confirms_[c];
+  conf.sub = s;
+  conf.retransmits = 0;
+  conf.timeout_ms = kAckTimeoutMs * factor(rng_);
+  conf.retransmit_ms = now_ms + conf.timeout_ms;
+  timers_.push({ conf.retransmit_ms, c, conf.serial });
+
+  sub.confirm = c;
+  return c;
+}
+
+void Broker::FreeConfirmation(uint32_t c) {
+  Confirmation& conf = confirms_[c];
+  subs_[conf.sub].confirm = kNone;
+  conf.sub = kNone;
+  ++conf.serial;
+  conf.wire.clear();
+  free_confirms_.push_back(c);
+}
+
+size_t Broker::Expire(uint64_t now_ms) {
+  size_t lapsed = 0;
+
+  while (!timers_.empty() && timers_.top().at_ms <= now_ms) {
+    Timer timer = timers_.top();
+    timers_.pop();
+
+    Confirmation& conf = confirms_[timer.confirm];
+    if (conf.serial != timer.serial)
+      continue;
+
+    if (conf.retransmits == kMaxRetransmit) {
+      // Gone, or no longer interested.
+      Unsubscribe(conf.sub);
+      ++lapsed;
+      continue;
+    }
+
+    ++conf.retransmits;
+    conf.timeout_ms *= 2;
+    conf.retransmit_ms = now_ms + conf.timeout_ms;
+    timers_.push({ conf.retransmit_ms, timer.confirm, conf.serial });
+
+    const Subscriber& sub = subs_[conf.sub];
+    transport_->Send(conf.wire.data(), conf.wire.size(),
+                     reinterpret_cast<const sockaddr*>(&sub.peer),
+                     sub.peer_len);
+  }
+
+  lapsed_ += lapsed;
+  return lapsed;
+}
+
+// The subscriber the notification that dgram (an empty ACK or RST)
+// answers went to, if it is still the one at that message ID and
+// dgram comes from it.  kNone if not.
+uint32_t Broker::Notified(const net::Datagram& dgram) const {
+  uint32_t s = notified_[coap::HeaderMessageId(dgram.data)];
+  if (s == kNone || subs_[s].topic == kNone ||
+      subs_[s].peer_len != dgram.peer_len ||
+      memcmp(&subs_[s].peer, dgram.peer, dgram.peer_len) != 0)
+    return kNone;
+  return s;
+}
+
+std::string Broker::SubscriberKey(const sockaddr* peer, socklen_t peer_len,
+                                  const uint8_t* token, size_t length) {
+  std::string key(reinterpret_cast<const char*>(peer), peer_len);
+  key.append(reinterpret_cast<const char*>(token), length);
+  return key;
+}
+
+uint32_t Broker::Subscribe(uint32_t topic, const coap::PDUView& req,
+                           const net::Datagram& dgram) {
+  if (dgram.peer_len > sizeof(sockaddr_storage))
+    return kNone;
+
+  std::string key = SubscriberKey(dgram.peer, dgram.peer_len, req.token(),
+                                  req.token_length());
+
+  // Registering again with the same token replaces the subscription.
+  auto it = sub_index_.find(key);
+  if (it != sub_index_.end()) {
+    if (subs_[it->second].topic == topic) {
+      subs_[it->second].confirmed_ms = NowMs();
+      return it->second;
+    }
+    Unsubscribe(it->second);
+  }
+
+  Topic& t = topics_[topic];
+  if (t.nsubs >= config_.max_subscribers)
+    return kNone;
+
+  uint32_t s;
+  if (free_subs_.empty()) {
+    s = subs_.size();
+    subs_.emplace_back();
+  } else {
+    s = free_subs_.back();
+    free_subs_.pop_back();
+  }
+
+  Subscriber& sub = subs_[s];
+  memcpy(&sub.peer, dgram.peer, dgram.peer_len);
+  sub.peer_len = dgram.peer_len;
+  memcpy(sub.token, req.token(), req.token_length());
+  sub.token_length = req.token_length();
+  sub.topic = topic;
+  sub.confirmed_ms = NowMs();
+  sub.confirm = kNone;
+  sub.prev = kNone;
+  sub.next = t.subs;
+  if (t.subs != kNone)
+    subs_[t.subs].prev = s;
+  t.subs = s;
+  ++t.nsubs;
+
+  sub_index_[key] = s;
+  return s;
+}
+
+void Broker::Unsubscribe(uint32_t s) {
+  Subscriber& sub = subs_[s];
+  Topic& t = topics_[sub.topic];
+
+  if (sub.prev != kNone)
+    subs_[sub.prev].next = sub.next;
+  else
+    t.subs = sub.next;
+  if (sub.next != kNone)
+    subs_[sub.next].prev = sub.prev;
+  --t.nsubs;
+
+  if (sub.confirm != kNone)
+    FreeConfirmation(sub.confirm);
+
+  sub_index_.erase(SubscriberKey(reinterpret_cast<const sockaddr*>(&sub.peer),
+                                 sub.peer_len, sub.token, sub.token_length));
+  sub.topic = kNone;
+  free_subs_.push_back(s);
+}
+
+void Broker::Respond(const coap::PDUView& req, const net::Datagram& dgram,
+                     coap::Code code, uint32_t topic, bool observe) {
+  std::vector<uint8_t>& rsp = response_;
+  rsp.clear();
+
+  // Piggyback on the ACK if confirmable.
+  coap::Type type = coap::Type::ACK;
+  uint16_t mid = req.message_id();
+  if (req.type() == coap::Type::NON) {
+    type = coap::Type::NON;
+    mid = next_mid_++;
+    notified_[mid] = kNone;
+  }
+
+  rsp.push_back((coap::Version::v1 << 6) | (type << 4) | req.token_length());
+  rsp.push_back(code);
+  rsp.push_back(mid >> 8);
+  rsp.push_back(mid);
+  rsp.insert(rsp.end(), req.token(), req.token() + req.token_length());
+
+  if (topic != kNone) {
+    const Topic& t = topics_[topic];
+
+    if (t.expires_ms != 0 && observe) {
+      rsp.insert(rsp.end(), t.tail.begin(), t.tail.end());
+    } else {
+      if (observe)
+        AppendUint(rsp, coap::OptionNumber::Observe, t.observe);
+      if (t.expires_ms != 0) {
+        size_t base = observe ? coap::OptionNumber::Observe : 0;
+        if (t.content_format != kNoContentFormat)
+          AppendUint(rsp, coap::OptionNumber::Content_Format - base,
+                     t.content_format);
+        rsp.insert(rsp.end(), t.tail.begin() + t.payload_offset,
+                   t.tail.end());
+      }
+    }
+  }
+
+  transport_->Send(rsp.data(), rsp.size(), dgram.peer, dgram.peer_len);
+}
+
+void Broker::OnDatagram(const net::Datagram& dgram) {
+  switch (coap::ClassifyEmpty(dgram.data, dgram.size)) {
+    case coap::EmptyKind::other:
+      break;
+
+    case coap::EmptyKind::ping: {
+      uint8_t rst[4];
+      coap::ResetFor(dgram.data, rst);
+      transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+      return;
+    }
+
+    case coap::EmptyKind::reset: {
+      // "Not interested".
+      uint32_t s = Notified(dgram);
+      if (s != kNone)
+        Unsubscribe(s);
+      return;
+    }
+
+    case coap::EmptyKind::ack: {
+      // Still there: confirmed if it was the CON in flight.
+      uint32_t s = Notified(dgram);
+      uint32_t c = s == kNone ? kNone : subs_[s].confirm;
+      if (c != kNone &&
+          confirms_[c].mid == coap::HeaderMessageId(dgram.data)) {
+        FreeConfirmation(c);
+        subs_[s].confirmed_ms = NowMs();
+      }
+      return;
+    }
+
+    case coap::EmptyKind::bad:
+      return;
+  }
+
+  coap::PDUView req;
+  if (!req.Decode(dgram.data, dgram.size))
+    return;
+
+  if (static_cast<int>(req.code()) > coap::CodeBlocks::ReqMethodMax ||
+      (req.type() != coap::Type::CON && req.type() != coap::Type::NON))
+    return;
+
+  Request r;
+
+  switch (req.code()) {
+    case coap::Code::GET: {
+      Parse(req, false, r);
+      uint32_t topic = r.node == kNone ? kNone : TopicFor(r.node, false);
+      if (topic == kNone) {
+        Respond(req, dgram, coap::Code::NotFound, kNone, false);
+        return;
+      }
+
+      bool retained = Retained(topic);
+      bool observing = false;
+
+      if (r.observe == 0) {
+        observing = Subscribe(topic, req, dgram) != kNone;
+      } else if (r.observe == 1) {
+        auto it = sub_index_.find(SubscriberKey(dgram.peer, dgram.peer_len,
+                                                req.token(),
+                                                req.token_length()));
+        if (it != sub_index_.end())
+          Unsubscribe(it->second);
+      }
+
+      if (!retained && !observing)
+        Respond(req, dgram, coap::Code::NotFound, kNone, false);
+      else
+        Respond(req, dgram, coap::Code::Content, topic, observing);
+      return;
+    }
+
+    case coap::Code::PUT:
+    case coap::Code::POST: {
+      Parse(req, false, r);
+      if (r.node == kNone && topics() < config_.max_topics)
+        Parse(req, true, r);
+
+      if (r.too_long || r.node == TopicTrie::kRoot) {
+        Respond(req, dgram, coap::Code::BadRequest, kNone, false);
+        return;
+      }
+
+      uint32_t topic = r.node == kNone ? kNone : TopicFor(r.node, false);
+      bool created = topic == kNone;
+      if (created)
+        topic = r.node == kNone ? kNone : TopicFor(r.node, true);
+      if (topic == kNone) {
+        trie_.Prune(r.node);
+        Respond(req, dgram, coap::Code::Forbidden, kNone, false);
+        return;
+      }
+
+      coap::Code code = DoPublish(topic, req.payload(), req.payload_size(),
+                                  r.content_format, r.max_age);
+      if (code == coap::Code::Changed && created)
+        code = coap::Code::Created;
+      else if (code != coap::Code::Changed && created)
+        FreeTopic(topic);
+
+      Respond(req, dgram, code, kNone, false);
+      return;
+    }
+
+    case coap::Code::DELETE: {
+      Parse(req, false, r);
+      uint32_t topic = r.node == kNone ? kNone : TopicFor(r.node, false);
+      if (topic == kNone) {
+        Respond(req, dgram, coap::Code::NotFound, kNone, false);
+        return;
+      }
+
+      // Subscribers get a last word: 4.04, without Observe.
+      Topic& t = topics_[topic];
+      for (uint32_t s = t.subs; s != kNone; s = subs_[s].next) {
+        const Subscriber& sub = subs_[s];
+        uint8_t gone[4 + 8];
+        uint16_t mid = next_mid_++;
+        notified_[mid] = kNone;
+        gone[0] = (coap::Version::v1 << 6) | (coap::Type::NON << 4) |
+                  sub.token_length;
+        gone[1] = coap::Code::NotFound;
+        gone[2] = mid >> 8;
+        gone[3] = mid;
+        memcpy(gone + 4, sub.token, sub.token_length);
+        transport_->Send(gone, 4 + sub.token_length,
+                         reinterpret_cast<const sockaddr*>(&sub.peer),
+                         sub.peer_len);
+      }
+
+      FreeTopic(topic);
+      Respond(req, dgram, coap::Code::Deleted, kNone, false);
+      return;
+    }
+
+    default:
+      Respond(req, dgram, coap::Code::MethodNotAllowed, kNone, false);
+      return;
+  }
+}
+
+}   // namespace pubsub
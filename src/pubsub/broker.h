@@ -0,0 +1,230 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef PUBSUB_BROKER_H_
+#define PUBSUB_BROKER_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "coap/view.h"
+#include "net/transport.h"
+#include "pubsub/topic_trie.h"
+
+namespace pubsub {
+
+struct BrokerConfig {
+  size_t max_topics;
+  size_t max_subscribers;       // per topic
+  size_t memory_budget;         // bytes of retained publications
+  uint32_t default_retention_s; // if the publisher sends no Max-Age
+  uint32_t max_retention_s;
+  uint32_t confirm_interval_s;  // at least a CON notification this often
+};
+
+const BrokerConfig kDefaultBrokerConfig = {
+  1 << 20, 1 << 16, 64 << 20, 3600, 86400, 86400
+};
+
+// CON notifications in flight at most, per broker: past that they wait
+// for the next publication.
+const size_t kMaxConfirmations = 4096;
+
+// Transmission parameters of CON notifications (RFC 7252, 4.8).
+const uint32_t kAckTimeoutMs = 2000;
+const double kAckRandomFactor = 1.5;
+const unsigned kMaxRetransmit = 4;
+
+// No Content-Format.
+const int kNoContentFormat = -1;
+
+// A CoAP publish/subscribe broker, after draft-ietf-core-coap-pubsub,
+// driven by a single thread:
+//
+//   PUT or POST <topic>      publish: 2.01 (topic created) or 2.04
+//   GET <topic>              the latest publication: 2.05, or 4.04
+//   GET <topic>, Observe: 0  the same, and subscribe (RFC 7641)
+//   GET <topic>, Observe: 1  unsubscribe
+//   DELETE <topic>           remove topic and subscriptions: 2.02
+//
+// Topics are Uri-Path segments, kept in a TopicTrie.  A publication is
+// encoded once, Observe and Content-Format options and payload; each
+// subscriber's notification is a NON with its token in front of that,
+// and goes out through the transport's send batches (sendmmsg(2) with
+// the epoll backend).  A RST answering a notification unsubscribes.
+//
+// Subscribers that go away without a word would be notified forever,
+// so once confirm_interval_s has gone by since a subscriber last
+// acknowledged one (or subscribed), its next notification is a CON
+// (RFC 7641, 4.5).  It is retransmitted as RFC 7252 says, replaced by
+// newer notifications as they come, and if it is never acknowledged
+// the subscriber is removed.
+//
+// Each publication is retained for the Max-Age it came with (up to
+// max_retention_s), or default_retention_s.  When retained
+// publications would go over memory_budget, the least recently
+// published are dropped; their topics and subscribers stay.
+class Broker : public net::Handler {
+ public:
+  // transport must be open and outlive the broker.
+  Broker(net::Transport* transport,
+         const BrokerConfig& config = kDefaultBrokerConfig);
+
+  // Wait up to timeout_ms for requests and handle them, then
+  // retransmit what is due.
+  void RunOnce(int timeout_ms);
+
+  void OnDatagram(const net::Datagram& dgram);
+
+  // Retransmit the CON notifications due at now_ms (NowMs() time), and
+  // remove the subscribers of those that ran out of retransmissions.
+  // Return how many.
+  size_t Expire(uint64_t now_ms);
+
+  static uint64_t NowMs();
+
+  // Publish from within the process, as a PUT would.
+  bool Publish(const std::string& topic, const uint8_t* data, size_t size,
+               int content_format = kNoContentFormat);
+
+  size_t topics() const { return topics_.size() - free_topics_.size(); }
+  size_t subscribers() const { return subs_.size() - free_subs_.size(); }
+  size_t confirming() const {
+    return confirms_.size() - free_confirms_.size();
+  }
+  size_t retained_bytes() const { return retained_bytes_; }
+  const TopicTrie& trie() const { return trie_; }
+
+  // Counters
+  uint64_t publications() const { return publications_; }
+  uint64_t notifications() const { return notifications_; }
+  uint64_t evictions() const { return evictions_; }   // over budget
+  uint64_t expirations() const { return expirations_; }
+  uint64_t lapsed() const { return lapsed_; }         // CONs unanswered
+
+ private:
+  struct Topic {
+    uint32_t node;
+    uint32_t observe;             // sequence number of the publication
+    uint64_t expires_ms;          // 0 if nothing retained
+    int content_format;
+    std::vector<uint8_t> tail;    // Observe, Content-Format, payload
+    size_t payload_offset;        // in tail, marker included
+    uint32_t lru_prev;            // among topics with a publication
+    uint32_t lru_next;
+    uint32_t subs;                // first subscriber
+    uint32_t nsubs;
+  };
+
+  struct Subscriber {
+    sockaddr_storage peer;
+    socklen_t peer_len;
+    uint8_t token[8];
+    uint8_t token_length;
+    uint32_t topic;
+    uint32_t prev;
+    uint32_t next;
+    uint64_t confirmed_ms;        // subscribed, or last ACKed a CON
+    uint32_t confirm;             // CON in flight, kNone if none
+  };
+
+  // A CON notification in flight, as sent last.
+  struct Confirmation {
+    uint32_t sub;                 // kNone if free
+    uint32_t serial;              // bumped when freed, for Timers
+    uint16_t mid;
+    uint8_t retransmits;
+    uint32_t timeout_ms;
+    uint64_t retransmit_ms;
+    std::vector<uint8_t> wire;
+  };
+
+  struct Timer {
+    uint64_t at_ms;
+    uint32_t confirm;
+    uint32_t serial;
+
+    bool operator>(const Timer& other) const { return at_ms > other.at_ms; }
+  };
+
+  // What a request carries, in one pass over its options.
+  struct Request {
+    uint32_t node;                // kNone if the topic isn't there
+    bool too_long;                // a segment over TopicTrie::kMaxLabel
+    int64_t observe;              // -1 if none
+    int content_format;
+    int64_t max_age;              // -1 if none
+  };
+
+  void Parse(const coap::PDUView& req, bool create, Request& r);
+  uint32_t TopicFor(uint32_t node, bool create);
+  void FreeTopic(uint32_t topic);
+
+  coap::Code DoPublish(uint32_t topic, const uint8_t* data, size_t size,
+                       int content_format, int64_t max_age);
+  void Fanout(uint32_t topic);
+  uint32_t Confirm(uint32_t sub, uint64_t now_ms);
+  void FreeConfirmation(uint32_t confirm);
+  uint32_t Notified(const net::Datagram& dgram) const;
+  bool Retained(uint32_t topic);
+  void DropPublication(uint32_t topic);
+  void LruUnlink(uint32_t topic);
+  void LruPushFront(uint32_t topic);
+
+  uint32_t Subscribe(uint32_t topic, const coap::PDUView& req,
+                     const net::Datagram& dgram);
+  void Unsubscribe(uint32_t sub);
+  static std::string SubscriberKey(const sockaddr* peer, socklen_t peer_len,
+                                   const uint8_t* token, size_t length);
+
+  void Respond(const coap::PDUView& req, const net::Datagram& dgram,
+               coap::Code code, uint32_t topic, bool observe);
+
+  int NextTimeout(int timeout_ms) const;
+
+ private:
+  net::Transport* transport_;
+  const BrokerConfig config_;
+
+  TopicTrie trie_;
+  std::vector<uint32_t> node_topic_;    // by trie node, kNone if none
+  std::vector<Topic> topics_;
+  std::vector<uint32_t> free_topics_;
+  uint32_t lru_head_;                   // most recently published
+  uint32_t lru_tail_;
+
+  std::vector<Subscriber> subs_;
+  std::vector<uint32_t> free_subs_;
+  std::unordered_map<std::string, uint32_t> sub_index_;
+
+  // Subscriber each recent notification went to, by message ID: so
+  // that a RST can be traced back.
+  std::vector<uint32_t> notified_;
+  uint16_t next_mid_;
+
+  std::vector<Confirmation> confirms_;
+  std::vector<uint32_t> free_confirms_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>>
+      timers_;
+  std::minstd_rand rng_;          // for ACK_RANDOM_FACTOR
+
+  std::vector<uint8_t> scratch_;
+  std::vector<uint8_t> response_;
+  size_t retained_bytes_;
+
+  uint64_t publications_;
+  uint64_t notifications_;
+  uint64_t evictions_;
+  uint64_t expirations_;
+  uint64_t lapsed_;
+};
+
+}   // namespace pubsub
+
+#endif  // PUBSUB_BROKER_H_
@@ -0,0 +1,202 @@
+// Copyleft 2013 tho@autistici.org
+
+// The broker at scale: 1M topics, 100k subscribers spread over them,
+// publications on random topics, and one hot topic fanned out to 100k
+// subscribers.  Requests are handed to Broker::OnDatagram() as a
+// transport would; responses go to a transport that copies them into
+// send batches of kMaxBatch and drops them, so what is measured is the
+// broker.
+//
+// Usage: broker_bench [topics [subscribers [publications]]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "coap/pdu.h"
+#include "pubsub/broker.h"
+
+using namespace pubsub;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+class NullTransport : public net::Transport {
+ public:
+  NullTransport() : queued_(0), sent(0), batches(0) { }
+
+  bool Open(const sockaddr*, socklen_t) { return true; }
+  int Poll(net::Handler*, int) { return 0; }
+
+  bool Send(const uint8_t* data, size_t size, const sockaddr*, socklen_t) {
+    memcpy(batch_[queued_], data, size);
+    if (++queued_ == net::kMaxBatch)
+      Flush();
+    ++sent;
+    return true;
+  }
+
+  bool Flush() {
+    if (queued_ > 0)
+      ++batches;
+    queued_ = 0;
+    return true;
+  }
+
+  bool Wake() { return true; }
+  net::Backend backend() const { return net::Backend::any; }
+  int fd() const { return -1; }
+
+ private:
+  uint8_t batch_[net::kMaxBatch][net::kMaxDatagramSize];
+  size_t queued_;
+
+ public:
+  uint64_t sent;
+  uint64_t batches;
+};
+
+std::string topic_name(size_t i) {
+  char name[48];
+  snprintf(name, sizeof name, "sensors/%zu/%zu", i / 1000, i);
+  return name;
+}
+
+std::vector<uint8_t> request(coap::Code code, const std::string& topic,
+                             uint16_t mid, uint32_t token, int observe,
+                             const std::string& payload) {
+  coap::PDU pdu;
+  pdu.set_type(coap::Type::NON);
+  pdu.set_code(code);
+  pdu.set_message_id(mid);
+  pdu.set_token(std::vector<uint8_t>(reinterpret_cast<uint8_t*>(&token),
+                                     reinterpret_cast<uint8_t*>(&token) + 4));
+
+  coap::Options opts;
+  if (observe >= 0)
+    assert(opts.AddObserve(observe));
+  for (size_t begin = 0; begin < topic.size(); ) {
+    size_t end = topic.find('/', begin);
+    if (end == std::string::npos)
+      end = topic.size();
+    assert(opts.AddUriPath(topic.substr(begin, end - begin)));
+    begin = end + 1;
+  }
+  assert(opts.AddContentFormat(0));
+  pdu.set_options(opts);
+  pdu.set_payload(std::vector<uint8_t>(payload.begin(), payload.end()));
+
+  std::vector<uint8_t> wire;
+  assert(pdu.Encode(wire));
+  return wire;
+}
+
+void deliver(Broker& broker, const std::vector<uint8_t>& wire,
+             const sockaddr_in& peer) {
+  net::Datagram dgram = { wire.data(), wire.size(),
+                          reinterpret_cast<const sockaddr*>(&peer),
+                          sizeof peer };
+  broker.OnDatagram(dgram);
+}
+
+sockaddr_in peer_address(size_t i) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(5683 + (i & 0xFF));
+  sin.sin_addr.s_addr = htonl(0x0A000000 + (i >> 8));
+  return sin;
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t ntopics = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t nsubs = argc > 2 ? strtoul(argv[2], nullptr, 10) : 100000;
+  size_t npubs = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000000;
+
+  BrokerConfig config = kDefaultBrokerConfig;
+  config.max_topics = ntopics + 1;
+  config.max_subscribers = nsubs;
+
+  static NullTransport transport;
+  Broker broker(&transport, config);
+  std::mt19937_64 rng(42);
+  const uint8_t value[] = "21.5";
+
+  // Topics, each with a retained publication.
+  auto start = Clock::now();
+  for (size_t i = 0; i < ntopics; ++i)
+    assert(broker.Publish(topic_name(i), value, sizeof value - 1, 0));
+  double t = seconds_since(start);
+  printf("create %zu topics:      %7.0f ns/topic   trie %zu nodes, %.1f MB "
+         "(%.1f bytes/topic)\n", ntopics, t * 1e9 / ntopics,
+         broker.trie().size(), broker.trie().memory() / 1e6,
+         double(broker.trie().memory()) / ntopics);
+
+  // Subscribers on random topics, by GET with Observe.
+  std::vector<std::vector<uint8_t>> gets;
+  for (size_t i = 0; i < nsubs; ++i)
+    gets.push_back(request(coap::Code::GET, topic_name(rng() % ntopics), i,
+                           i, 0, ""));
+  start = Clock::now();
+  for (size_t i = 0; i < nsubs; ++i)
+    deliver(broker, gets[i], peer_address(i));
+  transport.Flush();
+  t = seconds_since(start);
+  printf("subscribe %zu:          %7.0f ns/subscription\n",
+         broker.subscribers(), t * 1e9 / nsubs);
+
+  // Publications by PUT on random topics.
+  std::vector<std::vector<uint8_t>> puts;
+  for (size_t i = 0; i < 4096; ++i)
+    puts.push_back(request(coap::Code::PUT, topic_name(rng() % ntopics), i,
+                           i, -1, "22.0"));
+  uint64_t notified = broker.notifications();
+  sockaddr_in publisher = peer_address(~0U);
+  start = Clock::now();
+  for (size_t i = 0; i < npubs; ++i)
+    deliver(broker, puts[i % puts.size()], publisher);
+  transport.Flush();
+  t = seconds_since(start);
+  printf("publish (PUT) x %zu:   %7.0f ns/publication  %.2fM "
+         "publications/s, %.2fM notifications/s\n", npubs, t * 1e9 / npubs,
+         npubs / t / 1e6, (broker.notifications() - notified) / t / 1e6);
+
+  // One hot topic, everyone on it.
+  std::string hot = "sensors/hot";
+  assert(broker.Publish(hot, value, sizeof value - 1, 0));
+  for (size_t i = 0; i < nsubs; ++i)
+    deliver(broker, request(coap::Code::GET, hot, i, i, 0, ""),
+            peer_address(i));
+  transport.Flush();
+
+  const size_t rounds = 20;
+  notified = broker.notifications();
+  uint64_t batches = transport.batches;
+  start = Clock::now();
+  for (size_t i = 0; i < rounds; ++i) {
+    assert(broker.Publish(hot, value, sizeof value - 1, 0));
+    transport.Flush();
+  }
+  t = seconds_since(start);
+  notified = broker.notifications() - notified;
+  printf("fan-out to %zu:        %7.2f ms/publication  %.2fM "
+         "notifications/s in %.0f batches/publication\n", nsubs,
+         t * 1e3 / rounds, notified / t / 1e6,
+         double(transport.batches - batches) / rounds);
+
+  printf("retained %.1f MB, %llu evictions\n", broker.retained_bytes() / 1e6,
+         static_cast<unsigned long long>(broker.evictions()));
+}
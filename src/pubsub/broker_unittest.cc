@@ -0,0 +1,422 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <unistd.h>
+#include <cassert>
+#include <string>
+#include <vector>
+#include "utils/log.h"
+#include "net/sim_testing.h"
+#include "pubsub/broker.h"
+
+using namespace pubsub;
+using namespace net::testing;
+
+void init_log() {
+  utils::Log::Instance()->Open("broker_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// A broker on the node.
+struct Fixture : SimFixture {
+  explicit Fixture(const BrokerConfig& config = kDefaultBrokerConfig)
+    : broker(&node, config) {
+    node.Attach(&broker);
+  }
+
+  Bytes Encode(coap::Type type, coap::Code code, const std::string& topic,
+               const std::string& token, int64_t observe = -1,
+               const std::string& payload = "", int64_t content_format = -1,
+               int64_t max_age = -1) {
+    coap::Options opts;
+    if (observe >= 0)
+      assert(opts.AddObserve(observe));
+    if (content_format >= 0)
+      assert(opts.AddContentFormat(content_format));
+    if (max_age >= 0)
+      assert(opts.AddMaxAge(max_age));
+    return net::testing::Encode(type, code, mid++, token, topic, "", payload,
+                                opts);
+  }
+
+  void Request(net::SimTransport& from, coap::Type type, coap::Code code,
+               const std::string& topic, const std::string& token,
+               int64_t observe = -1, const std::string& payload = "",
+               int64_t content_format = -1, int64_t max_age = -1) {
+    Send(from, Encode(type, code, topic, token, observe, payload,
+                      content_format, max_age));
+  }
+
+  void Publish(const std::string& topic, const std::string& payload) {
+    assert(broker.Publish(topic,
+                          reinterpret_cast<const uint8_t*>(payload.data()),
+                          payload.size()));
+    network.Run();
+  }
+
+  Broker broker;
+};
+
+void test_ok_publish_get() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t1", -1,
+            "21.5", 0);
+  assert(f.alice.got.size() == 1);
+  assert(f.alice.got[0].type == coap::Type::ACK);
+  assert(f.alice.got[0].code == coap::Code::Created);
+  assert(f.alice.got[0].message_id == 1);
+  assert(f.alice.got[0].token == "t1");
+  assert(f.broker.topics() == 1);
+
+  f.Request(f.at, coap::Type::NON, coap::Code::POST, "ps/temp", "t2", -1,
+            "22.0", 0);
+  assert(f.alice.got.size() == 2);
+  assert(f.alice.got[1].type == coap::Type::NON);
+  assert(f.alice.got[1].code == coap::Code::Changed);
+  assert(f.broker.publications() == 2);
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "g");
+  assert(f.bob.got.size() == 1);
+  assert(f.bob.got[0].code == coap::Code::Content);
+  assert(f.bob.got[0].observe == -1);
+  assert(f.bob.got[0].content_format == 0);
+  assert(f.bob.got[0].payload == "22.0");
+
+  // Published from within the process.
+  const uint8_t data[] = { '2', '3' };
+  assert(f.broker.Publish("ps/temp", data, sizeof data));
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "g");
+  assert(f.bob.got[1].payload == "23");
+  assert(f.bob.got[1].content_format == -1);
+}
+
+void test_ok_observe() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "1");
+
+  // Subscribe: the retained publication, with Observe.
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "obs", 0);
+  assert(f.broker.subscribers() == 1);
+  assert(f.bob.got.size() == 1);
+  assert(f.bob.got[0].code == coap::Code::Content);
+  assert(f.bob.got[0].observe == 1);
+  assert(f.bob.got[0].payload == "1");
+
+  // Registering again changes nothing.
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "obs", 0);
+  assert(f.broker.subscribers() == 1);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "2", 50);
+  assert(f.bob.got.size() == 3);
+  const Response& n = f.bob.got[2];
+  assert(n.type == coap::Type::NON);
+  assert(n.code == coap::Code::Content);
+  assert(n.token == "obs");
+  assert(n.observe == 2);
+  assert(n.content_format == 50);
+  assert(n.payload == "2");
+  assert(f.broker.notifications() == 1);
+
+  // Deregister.
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "obs", 1);
+  assert(f.broker.subscribers() == 0);
+  assert(f.bob.got.size() == 4 && f.bob.got[3].observe == -1);
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "3");
+  assert(f.bob.got.size() == 4);
+}
+
+void test_ok_observe_before_publish() {
+  Fixture f;
+
+  // A topic with nothing retained: created by a publication that
+  // expired at once.
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/x", "t", -1, "0",
+            -1, 0);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/x", "g");
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/x", "obs", 0);
+  assert(f.bob.got.back().code == coap::Code::Content);
+  assert(f.bob.got.back().observe == 1);
+  assert(f.bob.got.back().payload.empty());
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/x", "t", -1, "1");
+  assert(f.bob.got.back().type == coap::Type::NON);
+  assert(f.bob.got.back().observe == 2);
+  assert(f.bob.got.back().payload == "1");
+}
+
+void test_ok_rst_unsubscribes() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "1");
+  f.Request(f.bt, coap::Type::NON, coap::Code::GET, "ps/temp", "obs", 0);
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "2");
+  assert(f.bob.got.size() == 2);
+
+  // A RST from someone else is ignored.
+  f.SendEmpty(f.at, coap::Type::RST, f.bob.got[1].message_id);
+  assert(f.broker.subscribers() == 1);
+
+  f.SendEmpty(f.bt, coap::Type::RST, f.bob.got[1].message_id);
+  assert(f.broker.subscribers() == 0);
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "3");
+  assert(f.bob.got.size() == 2);
+}
+
+void test_ok_confirmable_notifications() {
+  BrokerConfig config = kDefaultBrokerConfig;
+  config.confirm_interval_s = 0;
+  Fixture f(config);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "1");
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "ps/temp", "a", 0);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "b", 0);
+  f.alice.got.clear();
+  f.bob.got.clear();
+
+  // Due at once: CONs, retransmitted as they are.
+  f.Publish("ps/temp", "2");
+  f.alice.got.clear();
+  assert(f.bob.got.back().type == coap::Type::CON);
+  assert(f.broker.confirming() == 2);
+  Response first = f.bob.got.back();
+  f.bob.got.clear();
+
+  uint64_t now = Broker::NowMs();
+  assert(f.broker.Expire(now + kAckTimeoutMs - 100) == 0);
+  f.network.Run();
+  assert(f.alice.got.empty() && f.bob.got.empty());
+
+  now += 3000;
+  assert(f.broker.Expire(now) == 0);
+  f.network.Run();
+  assert(f.alice.got.size() == 1 && f.bob.got.size() == 1);
+  assert(f.bob.got[0].message_id == first.message_id);
+  assert(f.bob.got[0].payload == "2");
+
+  // Bob acknowledges, alice stays silent.
+  f.SendEmpty(f.bt, coap::Type::ACK, first.message_id);
+  assert(f.broker.confirming() == 1);
+
+  // A newer notification replaces the one in flight, not its timer.
+  f.Publish("ps/temp", "3");
+  assert(f.alice.got.back().type == coap::Type::CON);
+  assert(f.alice.got.back().payload == "3");
+  assert(f.broker.confirming() == 2);
+  f.SendEmpty(f.bt, coap::Type::ACK, f.bob.got.back().message_id);
+  f.alice.got.clear();
+
+  uint64_t timeout = 3000;
+  for (unsigned i = 2; i <= kMaxRetransmit; ++i) {
+    assert(f.broker.Expire(now += (timeout *= 2)) == 0);
+    f.network.Run();
+    assert(f.alice.got.size() == i - 1);
+    assert(f.alice.got.back().payload == "3");
+  }
+
+  // Never acknowledged: unsubscribed.
+  assert(f.broker.Expire(now += (timeout *= 2)) == 1);
+  assert(f.broker.subscribers() == 1 && f.broker.confirming() == 0);
+  assert(f.broker.lapsed() == 1);
+  f.alice.got.clear();
+  f.Publish("ps/temp", "4");
+  assert(f.alice.got.empty());
+  assert(f.bob.got.back().payload == "4");
+}
+
+void test_ok_ping() {
+  Fixture f;
+
+  uint8_t ping[4] = { 0x40, 0, 0x12, 0x34 };
+  f.Send(f.at, Bytes(ping, ping + sizeof ping));
+  assert(f.alice.got.size() == 1);
+  assert(f.alice.got[0].type == coap::Type::RST);
+  assert(f.alice.got[0].message_id == 0x1234);
+}
+
+void test_ok_delete() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "1");
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "obs", 0);
+  f.Request(f.at, coap::Type::CON, coap::Code::DELETE, "ps/temp", "d");
+
+  assert(f.alice.got.back().code == coap::Code::Deleted);
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+  assert(f.bob.got.back().token == "obs");
+  assert(f.bob.got.back().observe == -1);
+  assert(f.broker.topics() == 0);
+  assert(f.broker.subscribers() == 0);
+  assert(f.broker.retained_bytes() == 0);
+  assert(f.broker.trie().size() == 1);
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "g");
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+
+  // The topic can come back.
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "2");
+  assert(f.alice.got.back().code == coap::Code::Created);
+}
+
+void test_ok_eviction() {
+  BrokerConfig config = kDefaultBrokerConfig;
+  config.memory_budget = 100;
+  Fixture f(config);
+
+  std::string payload(40, 'x');
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "a", "t", -1, payload);
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "b", "t", -1, payload);
+  assert(f.broker.evictions() == 0);
+  assert(f.broker.retained_bytes() <= 100);
+
+  // "a" is the least recently published.
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "c", "t", -1, payload);
+  assert(f.broker.evictions() == 1);
+  assert(f.broker.retained_bytes() <= 100);
+  assert(f.broker.topics() == 3);
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "a", "g");
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "b", "g");
+  assert(f.bob.got.back().payload == payload);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "c", "g");
+  assert(f.bob.got.back().payload == payload);
+}
+
+void test_ok_expiry() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/temp", "t", -1,
+            "1", -1, 1);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "g");
+  assert(f.bob.got.back().code == coap::Code::Content);
+
+  usleep(1100000);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/temp", "g");
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+  assert(f.broker.expirations() == 1);
+  assert(f.broker.retained_bytes() == 0);
+  assert(f.broker.topics() == 1);
+}
+
+void test_ko_not_found() {
+  Fixture f;
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/none", "g");
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/none", "g", 0);
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+  f.Request(f.bt, coap::Type::CON, coap::Code::DELETE, "ps/none", "d");
+  assert(f.bob.got.back().code == coap::Code::NotFound);
+  assert(f.broker.subscribers() == 0);
+}
+
+void test_ko_max_topics() {
+  BrokerConfig config = kDefaultBrokerConfig;
+  config.max_topics = 2;
+  Fixture f(config);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "a", "t", -1, "1");
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "b", "t", -1, "1");
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "c", "t", -1, "1");
+  assert(f.alice.got.back().code == coap::Code::Forbidden);
+  assert(f.broker.topics() == 2);
+  assert(f.broker.trie().size() == 3);
+
+  // Existing topics still take publications.
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "a", "t", -1, "2");
+  assert(f.alice.got.back().code == coap::Code::Changed);
+
+  const uint8_t data[] = { '1' };
+  assert(!f.broker.Publish("d", data, sizeof data));
+  assert(f.broker.trie().size() == 3);
+}
+
+void test_ko_max_subscribers() {
+  BrokerConfig config = kDefaultBrokerConfig;
+  config.max_subscribers = 1;
+  Fixture f(config);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "a", "t", -1, "1");
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "a", "o", 0);
+  assert(f.alice.got.back().observe == 1);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "a", "o", 0);
+  assert(f.bob.got.back().code == coap::Code::Content);
+  assert(f.bob.got.back().observe == -1);
+  assert(f.broker.subscribers() == 1);
+}
+
+void test_ko_bad_publications() {
+  Fixture f;
+
+  // No topic.
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "", "t", -1, "1");
+  assert(f.alice.got.back().code == coap::Code::BadRequest);
+
+  // Too big to notify with a token in front: past what coap::PDU
+  // encodes, so appended by hand.
+  Bytes big = f.Encode(coap::Type::NON, coap::Code::PUT, "a", "t");
+  big.push_back(0xFF);
+  big.resize(net::kMaxDatagramSize - 2, 'x');
+  f.Send(f.at, big);
+  assert(f.alice.got.back().code == coap::Code::RequestEntityTooLarge);
+  assert(f.broker.topics() == 0);
+  assert(f.broker.trie().size() == 1);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "a", "t", -1, "1");
+  f.Send(f.at, big);
+  assert(f.alice.got.back().code == coap::Code::RequestEntityTooLarge);
+  assert(f.broker.publications() == 1);
+}
+
+// Topics created and deleted under fresh names don't pile up nodes.
+void test_ok_churn() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "ps/kept", "t", -1,
+            "1");
+  for (int i = 0; i < 10000; ++i) {
+    std::string topic = "ps/" + std::to_string(i) + "/value";
+    f.Request(f.at, coap::Type::CON, coap::Code::PUT, topic, "t", -1, "1");
+    assert(f.alice.got.back().code == coap::Code::Created);
+    f.Request(f.at, coap::Type::CON, coap::Code::DELETE, topic, "d");
+    assert(f.alice.got.back().code == coap::Code::Deleted);
+    f.alice.got.clear();
+  }
+
+  assert(f.broker.topics() == 1 && f.broker.trie().size() == 3);
+  assert(f.broker.trie().memory() < 64 * 1024);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "ps/kept", "g");
+  assert(f.bob.got.back().payload == "1");
+}
+
+int main() {
+  init_log();
+
+  test_ok_publish_get();
+  test_ok_observe();
+  test_ok_observe_before_publish();
+  test_ok_rst_unsubscribes();
+  test_ok_confirmable_notifications();
+  test_ok_ping();
+  test_ok_delete();
+  test_ok_eviction();
+  test_ok_expiry();
+  test_ko_not_found();
+  test_ko_max_topics();
+  test_ko_max_subscribers();
+  test_ko_bad_publications();
+  test_ok_churn();
+}
@@ -0,0 +1,217 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include "pubsub/topic_trie.h"
+
+namespace pubsub {
+
+namespace {
+
+const size_t kInitialTable = 1024;      // power of 2
+
+// Labels of removed nodes the arena may hold before it is compacted,
+// at least.
+const size_t kMinGarbage = 4096;
+
+}   // namespace
+
+const uint32_t TopicTrie::kRoot;
+const uint32_t TopicTrie::kNone;
+const size_t TopicTrie::kMaxLabel;
+
+TopicTrie::TopicTrie()
+  : garbage_(0)
+  , table_(kInitialTable, kNone) {
+  Node root = { kNone, 0, 0, 0, 0 };
+  nodes_.push_back(root);
+}
+
+// FNV-1a over the label, seeded with the parent.
+uint32_t TopicTrie::Hash(uint32_t parent, const char* label, size_t length) {
+  uint32_t h = 2166136261U ^ (parent * 0x9E3779B9U);
+  for (size_t i = 0; i < length; ++i) {
+    h ^= static_cast<uint8_t>(label[i]);
+    h *= 16777619U;
+  }
+  return h;
+}
+
+bool TopicTrie::Matches(uint32_t node, uint32_t parent, uint32_t hash,
+                        const char* label, size_t length) const {
+  const Node& n = nodes_[node];
+  return n.hash == hash && n.parent == parent && n.length == length &&
+         memcmp(labels_.data() + n.label, label, length) == 0;
+}
+
+uint32_t TopicTrie::Child(uint32_t parent, const char* label,
+                          size_t length) const {
+  uint32_t hash = Hash(parent, label, length);
+  size_t mask = table_.size() - 1;
+
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    uint32_t node = table_[i];
+    if (node == kNone || Matches(node, parent, hash, label, length))
+      return node;
+  }
+}
+
+uint32_t TopicTrie::AddChild(uint32_t parent, const char* label,
+                             size_t length) {
+  if (length > kMaxLabel)
+    return kNone;
+
+  uint32_t hash = Hash(parent, label, length);
+  size_t mask = table_.size() - 1;
+  size_t i = hash & mask;
+
+  for (; table_[i] != kNone; i = (i + 1) & mask)
+    if (Matches(table_[i], parent, hash, label, length))
+      return table_[i];
+
+  Node n = { parent, static_cast<uint32_t>(labels_.size()),
+             static_cast<uint32_t>(length), hash, 0 };
+  uint32_t node;
+  if (free_.empty()) {
+    node = nodes_.size();
+    nodes_.push_back(n);
+  } else {
+    node = free_.back();
+    free_.pop_back();
+    nodes_[node] = n;
+  }
+  labels_.append(label, length);
+  table_[i] = node;
+  ++nodes_[parent].refs;
+
+  // Keep the load under 1/2.
+  if (size() * 2 > table_.size())
+    Grow();
+
+  return node;
+}
+
+void TopicTrie::Grow() {
+  std::vector<uint32_t> table(table_.size() * 2, kNone);
+  size_t mask = table.size() - 1;
+
+  for (uint32_t node = 1; node < nodes_.size(); ++node) {
+    if (nodes_[node].parent == kNone)
+      continue;
+    size_t i = nodes_[node].hash & mask;
+    while (table[i] != kNone)
+      i = (i + 1) & mask;
+    table[i] = node;
+  }
+
+  table_.swap(table);
+}
+
+// Take node out of the table, moving those after it in its cluster
+// back where their probe sequence allows (no tombstones).
+void TopicTrie::Unlink(uint32_t node) {
+  size_t mask = table_.size() - 1;
+  size_t i = nodes_[node].hash & mask;
+  while (table_[i] != node)
+    i = (i + 1) & mask;
+
+  for (size_t j = (i + 1) & mask; table_[j] != kNone; j = (j + 1) & mask) {
+    size_t home = nodes_[table_[j]].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table_[i] = table_[j];
+      i = j;
+    }
+  }
+  table_[i] = kNone;
+}
+
+void TopicTrie::Unref(uint32_t node) {
+  --nodes_[node].refs;
+  Prune(node);
+}
+
+void TopicTrie::Prune(uint32_t node) {
+  while (node != kRoot && node != kNone && nodes_[node].refs == 0) {
+    Node& n = nodes_[node];
+    uint32_t parent = n.parent;
+
+    Unlink(node);
+    garbage_ += n.length;
+    n.parent = kNone;
+    free_.push_back(node);
+
+    --nodes_[parent].refs;
+    node = parent;
+  }
+
+  if (garbage_ > kMinGarbage && garbage_ * 2 > labels_.size())
+    Compact();
+}
+
+void TopicTrie::Compact() {
+  std::string labels;
+  labels.reserve(labels_.size() - garbage_);
+
+  for (Node& n : nodes_) {
+    if (n.parent == kNone)
+      continue;
+    uint32_t offset = labels.size();
+    labels.append(labels_, n.label, n.length);
+    n.label = offset;
+  }
+
+  labels_.swap(labels);
+  garbage_ = 0;
+}
+
+uint32_t TopicTrie::Find(const std::string& path) const {
+  uint32_t node = kRoot;
+
+  for (size_t begin = 0; begin < path.size() && node != kNone; ) {
+    size_t end = path.find('/', begin);
+    if (end == std::string::npos)
+      end = path.size();
+    node = Child(node, path.data() + begin, end - begin);
+    begin = end + 1;
+  }
+
+  return node;
+}
+
+uint32_t TopicTrie::Insert(const std::string& path) {
+  uint32_t node = kRoot;
+
+  for (size_t begin = 0; begin < path.size(); ) {
+    size_t end = path.find('/', begin);
+    if (end == std::string::npos)
+      end = path.size();
+    uint32_t child = AddChild(node, path.data() + begin, end - begin);
+    if (child == kNone) {
+      Prune(node);
+      return kNone;
+    }
+    node = child;
+    begin = end + 1;
+  }
+
+  return node;
+}
+
+std::string TopicTrie::Path(uint32_t node) const {
+  std::string path;
+
+  for (; node != kRoot; node = nodes_[node].parent) {
+    const Node& n = nodes_[node];
+    std::string segment(labels_, n.label, n.length);
+    path = path.empty() ? segment : segment + '/' + path;
+  }
+
+  return path;
+}
+
+size_t TopicTrie::memory() const {
+  return nodes_.capacity() * sizeof(Node) + labels_.capacity() +
+         (free_.capacity() + table_.capacity()) * sizeof(uint32_t);
+}
+
+}   // namespace pubsub
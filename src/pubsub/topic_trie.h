@@ -0,0 +1,94 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef PUBSUB_TOPIC_TRIE_H_
+#define PUBSUB_TOPIC_TRIE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace pubsub {
+
+// Topic names, one edge per Uri-Path segment.
+//
+// Nodes are numbered in order of creation and stored in one vector,
+// their labels back to back in one arena.  Edges are not stored per
+// node but in a single open addressing table keyed by (parent, label):
+// a child is found in O(1) however many siblings it has (a million
+// topics under a handful of parents is the common case), and a node
+// costs 20 bytes plus its label plus a table slot.
+//
+// A node is counted a reference by each of its children and each
+// Ref() to it.  Prune() removes those nobody references, up the chain
+// of their parents: their numbers are reused, and the arena is
+// compacted once half of it is labels of nodes gone.
+class TopicTrie {
+ public:
+  static const uint32_t kRoot = 0;
+  static const uint32_t kNone = ~0U;
+
+  TopicTrie();
+
+  // The child of parent labelled label, or kNone.
+  uint32_t Child(uint32_t parent, const char* label, size_t length) const;
+
+  // The same, created if missing.  kNone if the label is too long.
+  uint32_t AddChild(uint32_t parent, const char* label, size_t length);
+
+  // Whole paths, segments joined by '/' ("" is the root).  If a label
+  // is too long, Insert() prunes what it got to.
+  uint32_t Find(const std::string& path) const;
+  uint32_t Insert(const std::string& path);
+  std::string Path(uint32_t node) const;
+
+  // Keep node, and so its parents, from being pruned, or let it go
+  // (and prune it).
+  void Ref(uint32_t node) { ++nodes_[node].refs; }
+  void Unref(uint32_t node);
+
+  // Remove node if unreferenced, then its parent if that leaves it
+  // unreferenced, and so on.  Nothing for the root or kNone.
+  void Prune(uint32_t node);
+
+  uint32_t parent(uint32_t node) const { return nodes_[node].parent; }
+
+  // Nodes, the root included.
+  size_t size() const { return nodes_.size() - free_.size(); }
+
+  // Node numbers are below this.
+  size_t capacity() const { return nodes_.size(); }
+
+  // Bytes allocated.
+  size_t memory() const;
+
+  static const size_t kMaxLabel = 255;    // as Uri-Path
+
+ private:
+  struct Node {
+    uint32_t parent;          // kNone if free (or the root)
+    uint32_t label;           // offset in labels_
+    uint32_t length;
+    uint32_t hash;
+    uint32_t refs;            // children and Ref()s
+  };
+
+  static uint32_t Hash(uint32_t parent, const char* label, size_t length);
+  bool Matches(uint32_t node, uint32_t parent, uint32_t hash,
+               const char* label, size_t length) const;
+  void Grow();
+  void Unlink(uint32_t node);
+  void Compact();
+
+ private:
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> free_;
+  std::string labels_;
+  size_t garbage_;                // bytes of labels_ no node has
+  std::vector<uint32_t> table_;   // nodes, kNone where empty
+};
+
+}   // namespace pubsub
+
+#endif  // PUBSUB_TOPIC_TRIE_H_
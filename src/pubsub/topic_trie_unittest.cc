@@ -0,0 +1,153 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "utils/log.h"
+#include "pubsub/topic_trie.h"
+
+using namespace pubsub;
+
+void init_log() {
+  utils::Log::Instance()->Open("topic_trie_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+void test_ok_insert_find() {
+  TopicTrie trie;
+  assert(trie.size() == 1);
+  assert(trie.Find("") == TopicTrie::kRoot);
+  assert(trie.Find("ps/temp") == TopicTrie::kNone);
+
+  uint32_t temp = trie.Insert("ps/temp");
+  uint32_t ps = trie.Find("ps");
+  assert(temp != TopicTrie::kNone && ps != TopicTrie::kNone);
+  assert(trie.size() == 3);
+  assert(trie.parent(temp) == ps);
+  assert(trie.parent(ps) == TopicTrie::kRoot);
+  assert(trie.Find("ps/temp") == temp);
+  assert(trie.Insert("ps/temp") == temp);
+  assert(trie.size() == 3);
+  assert(trie.Path(temp) == "ps/temp");
+
+  // A prefix of a label is another label.
+  assert(trie.Find("ps/tem") == TopicTrie::kNone);
+  assert(trie.Find("ps/temp/x") == TopicTrie::kNone);
+
+  // Same label under different parents.
+  uint32_t a = trie.Insert("a/temp");
+  assert(a != temp && trie.Path(a) == "a/temp");
+  assert(trie.Child(ps, "temp", 4) == temp);
+  assert(trie.Child(trie.Find("a"), "temp", 4) == a);
+}
+
+void test_ok_many_siblings() {
+  TopicTrie trie;
+  size_t before = trie.memory();
+
+  for (int i = 0; i < 100000; ++i) {
+    char name[32];
+    snprintf(name, sizeof name, "ps/%d", i);
+    assert(trie.Insert(name) == uint32_t(i + 2));
+  }
+  assert(trie.size() == 100002);
+  assert(trie.memory() > before);
+
+  for (int i = 0; i < 100000; ++i) {
+    char name[32];
+    snprintf(name, sizeof name, "ps/%d", i);
+    assert(trie.Find(name) == uint32_t(i + 2));
+    assert(trie.Path(i + 2) == name);
+  }
+  assert(trie.Find("ps/100000") == TopicTrie::kNone);
+}
+
+void test_ok_empty_segment() {
+  TopicTrie trie;
+  uint32_t n = trie.AddChild(TopicTrie::kRoot, "", 0);
+  assert(n != TopicTrie::kNone && n != TopicTrie::kRoot);
+  assert(trie.Child(TopicTrie::kRoot, "", 0) == n);
+}
+
+void test_ko_label_too_long() {
+  TopicTrie trie;
+  std::string label(TopicTrie::kMaxLabel + 1, 'x');
+  assert(trie.AddChild(TopicTrie::kRoot, label.data(), label.size()) ==
+         TopicTrie::kNone);
+  assert(trie.Insert("ps/" + label) == TopicTrie::kNone);
+  assert(trie.Child(TopicTrie::kRoot, label.data(), label.size()) ==
+         TopicTrie::kNone);
+
+  label.resize(TopicTrie::kMaxLabel);
+  assert(trie.AddChild(TopicTrie::kRoot, label.data(), label.size()) !=
+         TopicTrie::kNone);
+}
+
+void test_ok_prune() {
+  TopicTrie trie;
+  uint32_t c = trie.Insert("a/b/c");
+  uint32_t d = trie.Insert("a/d");
+  trie.Ref(c);
+  trie.Ref(d);
+
+  // Referenced, or leading to something referenced.
+  trie.Prune(trie.Find("a/b"));
+  trie.Prune(TopicTrie::kRoot);
+  trie.Prune(TopicTrie::kNone);
+  assert(trie.size() == 5);
+
+  trie.Unref(c);
+  assert(trie.size() == 3);
+  assert(trie.Find("a/b") == TopicTrie::kNone);
+  assert(trie.Find("a/d") == d && trie.Path(d) == "a/d");
+
+  // Numbers are reused, labels aren't mixed up.
+  uint32_t e = trie.Insert("a/e");
+  assert(e < 5);
+  assert(trie.Path(e) == "a/e" && trie.Find("a/e") == e);
+
+  trie.Unref(d);
+  trie.Prune(e);
+  assert(trie.size() == 1);
+  assert(trie.Find("a") == TopicTrie::kNone);
+}
+
+// Nodes inserted and pruned, over and over: memory stays put, the
+// labels left get compacted, and the table keeps finding them.
+void test_ok_churn() {
+  TopicTrie trie;
+  std::vector<uint32_t> kept;
+  for (int i = 0; i < 1000; ++i) {
+    kept.push_back(trie.Insert("kept/" + std::to_string(i)));
+    trie.Ref(kept.back());
+  }
+
+  size_t memory = 0;
+  for (int i = 0; i < 200000; ++i) {
+    uint32_t node = trie.Insert("gone/" + std::to_string(i) + "/x");
+    assert(node != TopicTrie::kNone);
+    trie.Prune(node);
+    if (i == 1000)
+      memory = trie.memory();
+  }
+
+  assert(trie.size() == 1002);
+  assert(trie.memory() <= memory + TopicTrie::kMaxLabel);
+  for (int i = 0; i < 1000; ++i) {
+    std::string path = "kept/" + std::to_string(i);
+    assert(trie.Find(path) == kept[i] && trie.Path(kept[i]) == path);
+  }
+}
+
+int main() {
+  init_log();
+
+  test_ok_insert_find();
+  test_ok_many_siblings();
+  test_ok_empty_segment();
+  test_ko_label_too_long();
+  test_ok_prune();
+  test_ok_churn();
+}
@@ -0,0 +1,899 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "coap/link_format.h"
+#include "utils/log.h"
+#include "rd/directory.h"
+
+namespace rd {
+
+namespace {
+
+const uint32_t kNone = Interner::kNone;
+
+// Timer wheel: 1 s ticks, 4096 buckets (68 minutes).  Lifetimes
+// further out wait in their bucket for the turns to come round.
+const size_t kWheelSize = 4096;
+
+// Garbage (link columns, stale postings) is only worth collecting past
+// this much.
+const size_t kMinGarbage = 4096;
+
+bool Is(const std::string& s, const char* literal) {
+  return s == literal;
+}
+
+bool ParseNumber(const char* p, size_t length, uint64_t& n) {
+  if (length == 0 || length > 10)
+    return false;
+  n = 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (p[i] < '0' || p[i] > '9')
+      return false;
+    n = n * 10 + (p[i] - '0');
+  }
+  return true;
+}
+
+}   // namespace
+
+bool Query::Add(const char* q, size_t length) {
+  const char* eq = static_cast<const char*>(memchr(q, '=', length));
+  size_t name_length = eq ? eq - q : length;
+  if (name_length == 0)
+    return false;
+
+  Filter f;
+  f.name.assign(q, name_length);
+  f.has_value = eq != nullptr;
+  if (eq)
+    f.value.assign(eq + 1, q + length - eq - 1);
+
+  uint64_t n;
+  if (Is(f.name, "page") || Is(f.name, "count")) {
+    if (!ParseNumber(f.value.data(), f.value.size(), n))
+      return false;
+    (Is(f.name, "page") ? page : count) = n;
+    return true;
+  }
+
+  filters.push_back(f);
+  return true;
+}
+
+// Collects the bytes [begin, end) of a link-format document written
+// one link at a time.
+class Directory::Sink {
+ public:
+  Sink(size_t offset, size_t size, std::string& out)
+    : begin_(offset)
+    , end_(offset + size)
+    , out_(out)
+    , pos_(0)
+    , first_(true)
+    , more_(false)
+  { }
+
+  // Add the link in line.
+  void Write() {
+    if (!first_)
+      Put(",", 1);
+    first_ = false;
+    Put(line.data(), line.size());
+  }
+
+  // Past end: nothing more to write.
+  bool done() const { return more_; }
+
+  std::string line;
+
+ private:
+  void Put(const char* p, size_t n) {
+    if (more_ || n == 0)
+      return;
+    if (pos_ >= end_) {
+      more_ = true;
+      return;
+    }
+
+    size_t from = pos_ < begin_ ? std::min(begin_ - pos_, n) : 0;
+    size_t to = std::min(n, end_ - pos_);
+    if (from < to)
+      out_.append(p + from, to - from);
+
+    pos_ += n;
+    if (pos_ > end_)
+      more_ = true;
+  }
+
+ private:
+  const size_t begin_;
+  const size_t end_;
+  std::string& out_;
+  size_t pos_;
+  bool first_;
+  bool more_;
+};
+
+Directory::Directory(const DirectoryConfig& config)
+  : config_(config)
+  , interned_(0)
+  , live_(0)
+  , dead_links_(0)
+  , dead_params_(0)
+  , live_postings_(0)
+  , stale_postings_(0)
+  , wheel_(kWheelSize, kNone)
+  , wheel_tick_(0)
+  , expirations_(0)
+  , compactions_(0)
+  , reinterns_(0)
+  , sweeps_(0) {
+  empty_ = strings_.Intern("", 0);
+  rt_ = strings_.Intern("rt", 2);
+  if_ = strings_.Intern("if", 2);
+}
+
+bool Directory::Valid(uint32_t handle) const {
+  uint32_t slot = Slot(handle);
+  return slot < expires_.size() && expires_[slot] != 0 &&
+         reuse_[slot] == handle >> 24;
+}
+
+bool Directory::ParseLinks(const uint8_t* links, size_t size) {
+  parsed_links_.clear();
+  parsed_params_.clear();
+
+  const char* target;
+  const char* name;
+  const char* value;
+  size_t length, name_length, value_length;
+
+  // Check it all first: nothing gets interned from a bad document.
+  coap::LinkCursor check(links, size);
+  while (check.NextLink(target, length))
+    while (check.NextParam(name, name_length, value, value_length)) { }
+  if (check.failed())
+    return false;
+
+  coap::LinkCursor cursor(links, size);
+  while (cursor.NextLink(target, length)) {
+    ParsedLink link = { strings_.Intern(target, length),
+                        static_cast<uint32_t>(parsed_params_.size()), 0 };
+    while (cursor.NextParam(name, name_length, value, value_length)) {
+      parsed_params_.push_back(std::make_pair(
+          strings_.Intern(name, name_length),
+          value ? strings_.Intern(value, value_length) : kNone));
+      ++link.params_count;
+    }
+    parsed_links_.push_back(link);
+  }
+
+  return true;
+}
+
+void Directory::StoreLinks(uint32_t slot) {
+  links_begin_[slot] = link_target_.size();
+  links_count_[slot] = parsed_links_.size();
+
+  for (const ParsedLink& link : parsed_links_) {
+    link_target_.push_back(link.target);
+    link_params_begin_.push_back(param_name_.size());
+    link_params_count_.push_back(link.params_count);
+    for (uint32_t i = 0; i < link.params_count; ++i) {
+      param_name_.push_back(parsed_params_[link.params_begin + i].first);
+      param_value_.push_back(parsed_params_[link.params_begin + i].second);
+    }
+  }
+}
+
+void Directory::StoreExtra(uint32_t slot, const RegistrationParams& params) {
+  extra_begin_[slot] = param_name_.size();
+  extra_count_[slot] = params.extra.size();
+
+  for (const auto& p : params.extra) {
+    param_name_.push_back(strings_.Intern(p.first.data(), p.first.size()));
+    param_value_.push_back(strings_.Intern(p.second.data(),
+                                           p.second.size()));
+  }
+}
+
+void Directory::DropLinks(uint32_t slot) {
+  uint32_t begin = links_begin_[slot];
+  for (uint32_t l = begin; l < begin + links_count_[slot]; ++l)
+    dead_params_ += link_params_count_[l];
+  dead_links_ += links_count_[slot];
+  links_count_[slot] = 0;
+}
+
+void Directory::Index(uint32_t slot) {
+  keys_.clear();
+  keys_.push_back(std::make_pair(kEp, ep_[slot]));
+  keys_.push_back(std::make_pair(kD, d_[slot]));
+
+  uint32_t begin = links_begin_[slot];
+  for (uint32_t l = begin; l < begin + links_count_[slot]; ++l) {
+    uint32_t p = link_params_begin_[l];
+    for (uint32_t end = p + link_params_count_[l]; p < end; ++p) {
+      uint32_t name = param_name_[p];
+      uint32_t value = param_value_[p];
+      if ((name != rt_ && name != if_) || value == kNone)
+        continue;
+
+      // Each of the space separated values.
+      const char* v = strings_.data(value);
+      const char* v_end = v + strings_.length(value);
+      while (v < v_end) {
+        const char* space = static_cast<const char*>(
+            memchr(v, ' ', v_end - v));
+        if (!space)
+          space = v_end;
+        if (space > v)
+          keys_.push_back(std::make_pair(name == rt_ ? kRt : kIf,
+                                         strings_.Intern(v, space - v)));
+        v = space + 1;
+      }
+    }
+  }
+
+  std::sort(keys_.begin(), keys_.end());
+  keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+
+  Posting posting = { slot, generation_[slot] };
+  for (const auto& key : keys_)
+    index_[key.first][key.second].push_back(posting);
+
+  postings_[slot] = keys_.size();
+  live_postings_ += keys_.size();
+}
+
+void Directory::Unindex(uint32_t slot) {
+  ++generation_[slot];
+  live_postings_ -= postings_[slot];
+  stale_postings_ += postings_[slot];
+  postings_[slot] = 0;
+}
+
+void Directory::Link(uint32_t slot) {
+  uint64_t tick = std::max(expires_[slot], wheel_tick_);
+  uint32_t bucket = tick & (kWheelSize - 1);
+
+  wheel_bucket_[slot] = bucket;
+  wheel_prev_[slot] = kNone;
+  wheel_next_[slot] = wheel_[bucket];
+  if (wheel_[bucket] != kNone)
+    wheel_prev_[wheel_[bucket]] = slot;
+  wheel_[bucket] = slot;
+}
+
+void Directory::Unlink(uint32_t slot) {
+  uint32_t prev = wheel_prev_[slot];
+  uint32_t next = wheel_next_[slot];
+
+  if (prev != kNone)
+    wheel_next_[prev] = next;
+  else
+    wheel_[wheel_bucket_[slot]] = next;
+
+  if (next != kNone)
+    wheel_prev_[next] = prev;
+}
+
+coap::Code Directory::Register(const RegistrationParams& params,
+                               const uint8_t* links, size_t size,
+                               uint64_t now_s, uint32_t& handle) {
+  if (params.ep.empty()) {
+    utils::Log::Instance()->Debug("rd: registration without ep");
+    return coap::Code::BadRequest;
+  }
+  if (params.lifetime_s == 0 || params.lifetime_s > UINT32_MAX) {
+    utils::Log::Instance()->Debug("rd: lifetime out of range: %lld",
+                                  static_cast<long long>(params.lifetime_s));
+    return coap::Code::BadRequest;
+  }
+  if (!ParseLinks(links, size)) {
+    utils::Log::Instance()->Debug("rd: bad link-format from %s",
+                                  params.ep.c_str());
+    return coap::Code::BadRequest;
+  }
+
+  uint32_t ep = strings_.Intern(params.ep.data(), params.ep.size());
+  uint32_t d = strings_.Intern(params.d.data(), params.d.size());
+  uint64_t key = (static_cast<uint64_t>(ep) << 32) | d;
+
+  coap::Code code;
+  uint32_t slot;
+  auto it = by_name_.find(key);
+
+  if (it != by_name_.end()) {
+    // Registering again replaces the registration.
+    slot = it->second;
+    Unindex(slot);
+    DropLinks(slot);
+    dead_params_ += extra_count_[slot];
+    Unlink(slot);
+    code = coap::Code::Changed;
+  } else {
+    if (live_ >= std::min(config_.max_registrations, kMaxRegistrations)) {
+      utils::Log::Instance()->Debug("rd: full, %s turned away",
+                                    params.ep.c_str());
+      return coap::Code::ServiceUnavailable;
+    }
+
+    // Only once every slot number has been handed out are the retired
+    // ones used again, their handles then those of 2^32 registrations
+    // ago.
+    if (free_.empty() && expires_.size() == kMaxRegistrations)
+      free_.swap(retired_);
+
+    if (free_.empty()) {
+      slot = expires_.size();
+      ep_.push_back(0);
+      d_.push_back(0);
+      base_.push_back(0);
+      lifetime_.push_back(0);
+      expires_.push_back(0);
+      generation_.push_back(0);
+      reuse_.push_back(0);
+      links_begin_.push_back(0);
+      links_count_.push_back(0);
+      extra_begin_.push_back(0);
+      extra_count_.push_back(0);
+      postings_.push_back(0);
+      wheel_next_.push_back(kNone);
+      wheel_prev_.push_back(kNone);
+      wheel_bucket_.push_back(0);
+    } else {
+      slot = free_.back();
+      free_.pop_back();
+      ++reuse_[slot];
+    }
+
+    ep_[slot] = ep;
+    d_[slot] = d;
+    by_name_[key] = slot;
+    ++live_;
+    code = coap::Code::Created;
+  }
+
+  base_[slot] = strings_.Intern(params.base.data(), params.base.size());
+  lifetime_[slot] = params.lifetime_s < 0 ? config_.default_lifetime_s
+                                          : params.lifetime_s;
+  expires_[slot] = now_s + lifetime_[slot];
+  StoreLinks(slot);
+  StoreExtra(slot, params);
+  Index(slot);
+  Link(slot);
+
+  handle = Handle(slot);
+  MaybeCompact();
+  MaybeSweep();
+  return code;
+}
+
+coap::Code Directory::Update(uint32_t handle,
+                             const RegistrationParams& params,
+                             const uint8_t* links, size_t size,
+                             uint64_t now_s) {
+  if (!Valid(handle))
+    return coap::Code::NotFound;
+  if (params.lifetime_s == 0 || params.lifetime_s > UINT32_MAX)
+    return coap::Code::BadRequest;
+  if (links && !ParseLinks(links, size))
+    return coap::Code::BadRequest;
+
+  uint32_t slot = Slot(handle);
+
+  if (!params.base.empty())
+    base_[slot] = strings_.Intern(params.base.data(), params.base.size());
+  if (params.lifetime_s > 0)
+    lifetime_[slot] = params.lifetime_s;
+  if (!params.extra.empty()) {
+    dead_params_ += extra_count_[slot];
+    StoreExtra(slot, params);
+  }
+  if (links) {
+    Unindex(slot);
+    DropLinks(slot);
+    StoreLinks(slot);
+    Index(slot);
+  }
+
+  Unlink(slot);
+  expires_[slot] = now_s + lifetime_[slot];
+  Link(slot);
+
+  MaybeCompact();
+  MaybeSweep();
+  return coap::Code::Changed;
+}
+
+void Directory::Free(uint32_t slot) {
+  Unindex(slot);
+  DropLinks(slot);
+  dead_params_ += extra_count_[slot];
+  extra_count_[slot] = 0;
+  Unlink(slot);
+
+  by_name_.erase((static_cast<uint64_t>(ep_[slot]) << 32) | d_[slot]);
+  expires_[slot] = 0;
+  // Reused any further, the slot would hand out stale handles again.
+  if (reuse_[slot] == UINT8_MAX)
+    retired_.push_back(slot);
+  else
+    free_.push_back(slot);
+  --live_;
+}
+
+bool Directory::Remove(uint32_t handle) {
+  if (!Valid(handle))
+    return false;
+
+  Free(Slot(handle));
+  MaybeCompact();
+  MaybeSweep();
+  return true;
+}
+
+size_t Directory::Expire(uint64_t now_s) {
+  if (now_s < wheel_tick_)
+    return 0;
+
+  uint64_t first = wheel_tick_;
+  if (now_s - first >= kWheelSize)
+    first = now_s - kWheelSize + 1;
+
+  size_t n = 0;
+  for (uint64_t t = first; t <= now_s; ++t) {
+    uint32_t slot = wheel_[t & (kWheelSize - 1)];
+    while (slot != kNone) {
+      uint32_t next = wheel_next_[slot];
+      if (expires_[slot] <= now_s) {
+        Free(slot);
+        ++n;
+      }
+      slot = next;
+    }
+  }
+  wheel_tick_ = now_s + 1;
+
+  if (n > 0) {
+    expirations_ += n;
+    MaybeCompact();
+    MaybeSweep();
+  }
+  return n;
+}
+
+void Directory::MaybeCompact() {
+  // Strings are never freed one by one: once there are twice as many
+  // as live registrations used last time, only those still used stay.
+  if (strings_.size() >= 2 * interned_ + kMinGarbage) {
+    Reintern();
+    return;
+  }
+
+  size_t dead = dead_links_ + dead_params_;
+  size_t live = link_target_.size() + param_name_.size() - dead;
+  if (dead < kMinGarbage || dead < live)
+    return;
+
+  Compact();
+}
+
+void Directory::Compact() {
+  std::vector<uint32_t> target, params_begin, params_count, name, value;
+  target.reserve(link_target_.size() - dead_links_);
+  params_begin.reserve(target.capacity());
+  params_count.reserve(target.capacity());
+  name.reserve(param_name_.size() - dead_params_);
+  value.reserve(name.capacity());
+
+  for (uint32_t slot = 0; slot < expires_.size(); ++slot) {
+    if (expires_[slot] == 0)
+      continue;
+
+    uint32_t begin = links_begin_[slot];
+    links_begin_[slot] = target.size();
+    for (uint32_t l = begin; l < begin + links_count_[slot]; ++l) {
+      target.push_back(link_target_[l]);
+      params_begin.push_back(name.size());
+      params_count.push_back(link_params_count_[l]);
+      uint32_t p = link_params_begin_[l];
+      for (uint32_t end = p + link_params_count_[l]; p < end; ++p) {
+        name.push_back(param_name_[p]);
+        value.push_back(param_value_[p]);
+      }
+    }
+
+    uint32_t p = extra_begin_[slot];
+    extra_begin_[slot] = name.size();
+    for (uint32_t end = p + extra_count_[slot]; p < end; ++p) {
+      name.push_back(param_name_[p]);
+      value.push_back(param_value_[p]);
+    }
+  }
+
+  link_target_.swap(target);
+  link_params_begin_.swap(params_begin);
+  link_params_count_.swap(params_count);
+  param_name_.swap(name);
+  param_value_.swap(value);
+  dead_links_ = dead_params_ = 0;
+  ++compactions_;
+}
+
+// Intern again what live registrations use, compacted first, and
+// rebuild what is keyed by string: the (ep, d) map and the indexes,
+// without their stale postings.
+void Directory::Reintern() {
+  Compact();
+
+  Interner strings;
+  std::vector<uint32_t> ids(strings_.size(), kNone);
+  auto keep = [&](uint32_t& id) {
+    if (id == kNone)
+      return;
+    if (ids[id] == kNone)
+      ids[id] = strings.Intern(strings_.data(id), strings_.length(id));
+    id = ids[id];
+  };
+
+  keep(empty_);
+  keep(rt_);
+  keep(if_);
+
+  by_name_.clear();
+  for (uint32_t slot = 0; slot < expires_.size(); ++slot) {
+    if (expires_[slot] == 0)
+      continue;
+    keep(ep_[slot]);
+    keep(d_[slot]);
+    keep(base_[slot]);
+    by_name_[(static_cast<uint64_t>(ep_[slot]) << 32) | d_[slot]] = slot;
+  }
+
+  for (uint32_t& id : link_target_)
+    keep(id);
+  for (uint32_t& id : param_name_)
+    keep(id);
+  for (uint32_t& id : param_value_)
+    keep(id);
+
+  strings_ = std::move(strings);
+
+  for (auto& index : index_)
+    index.clear();
+  live_postings_ = stale_postings_ = 0;
+  for (uint32_t slot = 0; slot < expires_.size(); ++slot) {
+    if (expires_[slot] != 0)
+      Index(slot);
+  }
+
+  interned_ = strings_.size();
+  ++reinterns_;
+}
+
+void Directory::MaybeSweep() {
+  if (stale_postings_ < kMinGarbage || stale_postings_ < live_postings_)
+    return;
+
+  for (auto& index : index_) {
+    for (auto it = index.begin(); it != index.end(); ) {
+      std::vector<Posting>& postings = it->second;
+      postings.erase(std::remove_if(postings.begin(), postings.end(),
+                                    [this](const Posting& p) {
+                                      return generation_[p.slot] !=
+                                             p.generation;
+                                    }),
+                     postings.end());
+      if (postings.empty())
+        it = index.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  stale_postings_ = 0;
+  ++sweeps_;
+}
+
+// The shortest posting list that covers the query, or nullptr if
+// there is none to go by.  none is set if nothing can match.
+const std::vector<Directory::Posting>* Directory::Postings(
+    const Query& query, bool& none) const {
+  const std::vector<Posting>* best = nullptr;
+  none = false;
+
+  for (const Query::Filter& f : query.filters) {
+    if (!f.has_value || (!f.value.empty() && f.value.back() == '*'))
+      continue;
+
+    int index;
+    if (Is(f.name, "ep"))
+      index = kEp;
+    else if (Is(f.name, "d"))
+      index = kD;
+    else if (Is(f.name, "rt"))
+      index = kRt;
+    else if (Is(f.name, "if"))
+      index = kIf;
+    else
+      continue;
+
+    uint32_t id = strings_.Find(f.value.data(), f.value.size());
+    auto it = id == kNone ? index_[index].end() : index_[index].find(id);
+    if (it == index_[index].end()) {
+      none = true;
+      return nullptr;
+    }
+    if (!best || it->second.size() < best->size())
+      best = &it->second;
+  }
+
+  return best;
+}
+
+bool Directory::MatchesEndpoint(uint32_t slot,
+                                const Query::Filter& f) const {
+  uint32_t id;
+  if (Is(f.name, "ep"))
+    id = ep_[slot];
+  else if (Is(f.name, "d"))
+    id = d_[slot];
+  else if (Is(f.name, "base"))
+    id = base_[slot];
+  else
+    id = kNone;
+
+  if (id != kNone)
+    return !f.has_value ||
+           coap::MatchLinkParam(f.name.data(), f.name.size(),
+                                strings_.data(id), strings_.length(id),
+                                f.value.data(), f.value.size());
+
+  if (Is(f.name, "lt")) {
+    std::string lt = std::to_string(lifetime_[slot]);
+    return !f.has_value ||
+           coap::MatchLinkParam("lt", 2, lt.data(), lt.size(),
+                                f.value.data(), f.value.size());
+  }
+
+  uint32_t p = extra_begin_[slot];
+  for (uint32_t end = p + extra_count_[slot]; p < end; ++p) {
+    uint32_t name = param_name_[p];
+    uint32_t value = param_value_[p];
+    if (strings_.length(name) == f.name.size() &&
+        memcmp(strings_.data(name), f.name.data(), f.name.size()) == 0 &&
+        (!f.has_value ||
+         coap::MatchLinkParam(f.name.data(), f.name.size(),
+                              strings_.data(value), strings_.length(value),
+                              f.value.data(), f.value.size())))
+      return true;
+  }
+  return false;
+}
+
+bool Directory::MatchesLink(uint32_t link, const Query::Filter& f) const {
+  if (Is(f.name, "href")) {
+    uint32_t target = link_target_[link];
+    return !f.has_value ||
+           coap::MatchLinkParam("href", 4, strings_.data(target),
+                                strings_.length(target), f.value.data(),
+                                f.value.size());
+  }
+
+  uint32_t p = link_params_begin_[link];
+  for (uint32_t end = p + link_params_count_[link]; p < end; ++p) {
+    uint32_t name = param_name_[p];
+    if (strings_.length(name) != f.name.size() ||
+        memcmp(strings_.data(name), f.name.data(), f.name.size()) != 0)
+      continue;
+    if (!f.has_value)
+      return true;
+
+    uint32_t value = param_value_[p] == kNone ? empty_ : param_value_[p];
+    if (coap::MatchLinkParam(f.name.data(), f.name.size(),
+                             strings_.data(value), strings_.length(value),
+                             f.value.data(), f.value.size()))
+      return true;
+  }
+  return false;
+}
+
+bool Directory::MatchesAnyLink(uint32_t slot, const Query::Filter& f) const {
+  uint32_t begin = links_begin_[slot];
+  for (uint32_t l = begin; l < begin + links_count_[slot]; ++l)
+    if (MatchesLink(l, f))
+      return true;
+  return false;
+}
+
+// ep, d, base and lt are the registration's own; anything else may be
+// one of its extra parameters or one of its links'.
+bool Directory::Matches(LookupKind kind, uint32_t slot,
+                        const Query& query) const {
+  for (const Query::Filter& f : query.filters) {
+    bool matched;
+
+    if (Is(f.name, "ep") || Is(f.name, "d") || Is(f.name, "base") ||
+        Is(f.name, "lt")) {
+      matched = MatchesEndpoint(slot, f);
+    } else if (kind == LookupKind::resource) {
+      continue;           // per link, see MatchesResource
+    } else if (Is(f.name, "href")) {
+      std::string href = "/rd/" + std::to_string(Handle(slot));
+      matched = !f.has_value ||
+                coap::MatchLinkParam("href", 4, href.data(), href.size(),
+                                     f.value.data(), f.value.size());
+    } else {
+      matched = MatchesEndpoint(slot, f) || MatchesAnyLink(slot, f);
+    }
+
+    if (!matched)
+      return false;
+  }
+  return true;
+}
+
+bool Directory::MatchesResource(uint32_t slot, uint32_t link,
+                                const Query& query) const {
+  for (const Query::Filter& f : query.filters) {
+    if (Is(f.name, "ep") || Is(f.name, "d") || Is(f.name, "base") ||
+        Is(f.name, "lt"))
+      continue;           // see Matches
+    if (!MatchesLink(link, f) &&
+        (Is(f.name, "href") || !MatchesEndpoint(slot, f)))
+      return false;
+  }
+  return true;
+}
+
+bool Directory::Emit(LookupKind kind, const Query& query, uint32_t slot,
+                     size_t& skip, size_t& left, Sink& sink) const {
+  if (!Matches(kind, slot, query))
+    return true;
+
+  std::string& line = sink.line;
+  uint32_t base = base_[slot];
+
+  if (kind == LookupKind::endpoint) {
+    if (skip > 0) {
+      --skip;
+      return true;
+    }
+
+    line = "</rd/" + std::to_string(Handle(slot)) + ">";
+    coap::AppendLinkParam(line, "ep", 2, strings_.data(ep_[slot]),
+                          strings_.length(ep_[slot]));
+    if (d_[slot] != empty_)
+      coap::AppendLinkParam(line, "d", 1, strings_.data(d_[slot]),
+                            strings_.length(d_[slot]));
+    if (base != empty_)
+      coap::AppendLinkParam(line, "base", 4, strings_.data(base),
+                            strings_.length(base));
+    std::string lt = std::to_string(lifetime_[slot]);
+    coap::AppendLinkParam(line, "lt", 2, lt.data(), lt.size());
+
+    uint32_t p = extra_begin_[slot];
+    for (uint32_t end = p + extra_count_[slot]; p < end; ++p)
+      coap::AppendLinkParam(line, strings_.data(param_name_[p]),
+                            strings_.length(param_name_[p]),
+                            strings_.data(param_value_[p]),
+                            strings_.length(param_value_[p]));
+
+    sink.Write();
+    return !sink.done() && --left > 0;
+  }
+
+  // Resources: absolute, against the registration's base, with it as
+  // anchor.
+  const char* base_data = strings_.data(base);
+  size_t base_length = strings_.length(base);
+  if (base_length > 0 && base_data[base_length - 1] == '/')
+    --base_length;
+
+  uint32_t begin = links_begin_[slot];
+  for (uint32_t l = begin; l < begin + links_count_[slot]; ++l) {
+    if (!MatchesResource(slot, l, query))
+      continue;
+    if (skip > 0) {
+      --skip;
+      continue;
+    }
+
+    uint32_t target = link_target_[l];
+    const char* t = strings_.data(target);
+    size_t t_length = strings_.length(target);
+
+    line = '<';
+    if (t_length > 0 && t[0] == '/')
+      line.append(base_data, base_length);
+    line.append(t, t_length);
+    line += '>';
+
+    bool anchor = false;
+    uint32_t p = link_params_begin_[l];
+    for (uint32_t end = p + link_params_count_[l]; p < end; ++p) {
+      uint32_t name = param_name_[p];
+      uint32_t value = param_value_[p];
+      anchor = anchor || (strings_.length(name) == 6 &&
+                          memcmp(strings_.data(name), "anchor", 6) == 0);
+      coap::AppendLinkParam(line, strings_.data(name), strings_.length(name),
+                            value == kNone ? nullptr : strings_.data(value),
+                            value == kNone ? 0 : strings_.length(value));
+    }
+    if (!anchor && base_length > 0)
+      coap::AppendLinkParam(line, "anchor", 6, base_data, base_length);
+
+    sink.Write();
+    if (sink.done() || --left == 0)
+      return false;
+  }
+
+  return true;
+}
+
+void Directory::Lookup(LookupKind kind, const Query& query, size_t offset,
+                       size_t size, std::string& out, bool& more) const {
+  out.clear();
+  Sink sink(offset, size, out);
+  size_t skip = query.page * query.count;
+  size_t left = query.count > 0 ? query.count : ~size_t(0);
+
+  if (query.handle != kNoRegistration) {
+    if (Valid(query.handle))
+      Emit(kind, query, Slot(query.handle), skip, left, sink);
+    more = sink.done();
+    return;
+  }
+
+  bool none;
+  const std::vector<Posting>* postings = Postings(query, none);
+
+  if (postings) {
+    for (const Posting& p : *postings)
+      if (generation_[p.slot] == p.generation &&
+          !Emit(kind, query, p.slot, skip, left, sink))
+        break;
+  } else if (!none) {
+    for (uint32_t slot = 0; slot < expires_.size(); ++slot)
+      if (expires_[slot] != 0 && !Emit(kind, query, slot, skip, left, sink))
+        break;
+  }
+
+  more = sink.done();
+}
+
+size_t Directory::memory() const {
+  size_t bytes = strings_.memory();
+
+  bytes += (ep_.capacity() + d_.capacity() + base_.capacity() +
+            lifetime_.capacity() + generation_.capacity() +
+            links_begin_.capacity() + links_count_.capacity() +
+            extra_begin_.capacity() + extra_count_.capacity() +
+            postings_.capacity() + wheel_next_.capacity() +
+            wheel_prev_.capacity() + free_.capacity() +
+            retired_.capacity()) * sizeof(uint32_t);
+  bytes += expires_.capacity() * sizeof(uint64_t);
+  bytes += reuse_.capacity() + wheel_bucket_.capacity() * sizeof(uint16_t);
+
+  bytes += (link_target_.capacity() + link_params_begin_.capacity() +
+            link_params_count_.capacity() + param_name_.capacity() +
+            param_value_.capacity()) * sizeof(uint32_t);
+
+  // Hash nodes roughly: key, value, next pointer and hash.
+  bytes += by_name_.size() * 32 + by_name_.bucket_count() * sizeof(void*);
+  for (const auto& index : index_) {
+    bytes += index.size() * 48 + index.bucket_count() * sizeof(void*);
+    for (const auto& postings : index)
+      bytes += postings.second.capacity() * sizeof(Posting);
+  }
+
+  return bytes;
+}
+
+}   // namespace rd
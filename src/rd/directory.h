@@ -0,0 +1,250 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef RD_DIRECTORY_H_
+#define RD_DIRECTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "coap/proto.h"
+#include "rd/interner.h"
+
+namespace rd {
+
+const uint32_t kNoRegistration = ~0U;
+
+// Most registrations a directory holds: handles keep the slot in 24
+// bits.
+const size_t kMaxRegistrations = 1 << 24;
+
+struct DirectoryConfig {
+  size_t max_registrations;
+  uint32_t default_lifetime_s;  // if the endpoint sends no lt
+};
+
+// RFC 9176 5.3: lt defaults to 90000 s (25 hours).
+const DirectoryConfig kDefaultDirectoryConfig = { 1 << 20, 90000 };
+
+// The Uri-Query parameters of a registration (or of an update, where
+// only what is set changes).
+struct RegistrationParams {
+  std::string ep;
+  std::string d;
+  std::string base;
+  int64_t lifetime_s;           // -1 if not set
+  std::vector<std::pair<std::string, std::string>> extra;   // e.g. et
+
+  RegistrationParams() : lifetime_s(-1) { }
+};
+
+// Filters of a lookup, from its Uri-Query options (RFC 9176 7.2).
+struct Query {
+  struct Filter {
+    std::string name;
+    std::string value;          // a trailing '*' matches a prefix
+    bool has_value;
+  };
+
+  std::vector<Filter> filters;
+  size_t page;
+  size_t count;                 // results per page, 0 for all
+  uint32_t handle;              // only this registration, if set
+
+  Query() : page(0), count(0), handle(kNoRegistration) { }
+
+  // Add a Uri-Query value: name=value or name alone.  page and count
+  // go to their fields.
+  bool Add(const char* q, size_t length);
+};
+
+enum class LookupKind {
+  endpoint,                     // /rd-lookup/ep
+  resource                      // /rd-lookup/res
+};
+
+// A resource directory (RFC 9176): what endpoints register, and the
+// lookups on it.
+//
+// Everything is interned (see Interner) and stored by column: per
+// registration slot the endpoint name, domain, base and expiry; the
+// links of all registrations back to back in one set of columns, and
+// their parameters in another.  A registration's links are a range of
+// those.  Replaced ranges are left behind and the columns compacted
+// once there is more garbage than live data.  Interned strings are
+// never freed either: once there are twice as many as there were
+// live, everything is interned again from the live registrations.
+//
+// Inverted indexes map each endpoint name, domain, rt and if value
+// (each space separated value of rt and if on its own) to the
+// registrations that have it, as (slot, generation) postings.  A
+// registration that goes away or changes its links bumps its
+// generation, which makes its postings stale; stale postings are
+// skipped by lookups and swept out when they outnumber live ones.
+//
+// A lookup starts from the shortest posting list among its exact
+// filters on indexed attributes, checks each registration on the way
+// against all filters, and writes out the link-format result only up
+// to the bytes asked for: a Block2 of a large result costs what comes
+// before it, not the whole.  Without such a filter it scans the
+// registrations.
+//
+// Lifetimes run on a timer wheel of 1 s ticks.
+class Directory {
+ public:
+  explicit Directory(const DirectoryConfig& config = kDefaultDirectoryConfig);
+
+  // Register links (a link-format document) under params.  Created
+  // with a new handle, or Changed if (ep, d) was registered already,
+  // which replaces it under the same handle.  BadRequest if ep is
+  // missing or links don't parse, ServiceUnavailable if full.
+  coap::Code Register(const RegistrationParams& params, const uint8_t* links,
+                      size_t size, uint64_t now_s, uint32_t& handle);
+
+  // Refresh the registration's lifetime and change what params set;
+  // links, if not nullptr, replace its links.  Changed, NotFound or
+  // BadRequest.
+  coap::Code Update(uint32_t handle, const RegistrationParams& params,
+                    const uint8_t* links, size_t size, uint64_t now_s);
+
+  bool Remove(uint32_t handle);
+
+  // Remove the registrations whose lifetime is over at now_s.
+  size_t Expire(uint64_t now_s);
+
+  // Write bytes [offset, offset + size) of the link-format result to
+  // out (cleared first).  more is set if the result goes on.
+  void Lookup(LookupKind kind, const Query& query, size_t offset,
+              size_t size, std::string& out, bool& more) const;
+
+  // Whether handle is that of a registration.
+  bool Valid(uint32_t handle) const;
+
+  size_t registrations() const { return live_; }
+  size_t links() const { return link_target_.size() - dead_links_; }
+  size_t strings() const { return strings_.size(); }
+
+  // Bytes allocated, indexes included.
+  size_t memory() const;
+
+  // Counters
+  uint64_t expirations() const { return expirations_; }
+  uint64_t compactions() const { return compactions_; }
+  uint64_t reinterns() const { return reinterns_; }
+  uint64_t sweeps() const { return sweeps_; }
+
+ private:
+  enum Index { kEp, kD, kRt, kIf, kIndexes };
+
+  struct Posting {
+    uint32_t slot;
+    uint32_t generation;
+  };
+
+  class Sink;
+
+  static uint32_t Slot(uint32_t handle) { return handle & 0xFFFFFF; }
+
+  bool ParseLinks(const uint8_t* links, size_t size);
+  void StoreLinks(uint32_t slot);
+  void StoreExtra(uint32_t slot, const RegistrationParams& params);
+  void DropLinks(uint32_t slot);
+  void Index(uint32_t slot);
+  void Unindex(uint32_t slot);
+  void Free(uint32_t slot);
+  void MaybeCompact();
+  void Compact();
+  void Reintern();
+  void MaybeSweep();
+
+  void Link(uint32_t slot);
+  void Unlink(uint32_t slot);
+
+  const std::vector<Posting>* Postings(const Query& query,
+                                       bool& none) const;
+  bool MatchesEndpoint(uint32_t slot, const Query::Filter& filter) const;
+  bool MatchesLink(uint32_t link, const Query::Filter& filter) const;
+  bool MatchesAnyLink(uint32_t slot, const Query::Filter& filter) const;
+  bool Matches(LookupKind kind, uint32_t slot, const Query& query) const;
+  bool MatchesResource(uint32_t slot, uint32_t link,
+                       const Query& query) const;
+  bool Emit(LookupKind kind, const Query& query, uint32_t slot,
+            size_t& skip, size_t& left, Sink& sink) const;
+
+  uint32_t Handle(uint32_t slot) const {
+    return (static_cast<uint32_t>(reuse_[slot]) << 24) | slot;
+  }
+
+ private:
+  const DirectoryConfig config_;
+  Interner strings_;
+  size_t interned_;                     // strings live, last Reintern()
+  uint32_t empty_;                      // ""
+
+  // By slot
+  std::vector<uint32_t> ep_;
+  std::vector<uint32_t> d_;
+  std::vector<uint32_t> base_;
+  std::vector<uint32_t> lifetime_;
+  std::vector<uint64_t> expires_;       // 0 if the slot is free
+  std::vector<uint32_t> generation_;
+  std::vector<uint8_t> reuse_;          // handle = reuse << 24 | slot
+  std::vector<uint32_t> links_begin_;
+  std::vector<uint32_t> links_count_;
+  std::vector<uint32_t> extra_begin_;   // in the parameter columns
+  std::vector<uint32_t> extra_count_;
+  std::vector<uint32_t> postings_;      // how many this generation has
+  std::vector<uint32_t> wheel_next_;
+  std::vector<uint32_t> wheel_prev_;
+  std::vector<uint16_t> wheel_bucket_;
+  std::vector<uint32_t> free_;
+  std::vector<uint32_t> retired_;       // reuse_ ran out, not reused
+  size_t live_;
+
+  // By link
+  std::vector<uint32_t> link_target_;
+  std::vector<uint32_t> link_params_begin_;
+  std::vector<uint32_t> link_params_count_;
+  size_t dead_links_;
+
+  // By link parameter (and registration extra parameter)
+  std::vector<uint32_t> param_name_;
+  std::vector<uint32_t> param_value_;   // kNone if valueless
+  size_t dead_params_;
+
+  // (ep, d) to slot
+  std::unordered_map<uint64_t, uint32_t> by_name_;
+
+  std::unordered_map<uint32_t, std::vector<Posting>> index_[kIndexes];
+  size_t live_postings_;
+  size_t stale_postings_;
+  uint32_t rt_;                         // "rt" and "if", interned
+  uint32_t if_;
+
+  // Registrations by expiry: 1 s ticks, one turn of kWheelSize.
+  std::vector<uint32_t> wheel_;
+  uint64_t wheel_tick_;
+
+  // ParseLinks output: targets, then (name, value) per parameter.
+  struct ParsedLink {
+    uint32_t target;
+    uint32_t params_begin;
+    uint32_t params_count;
+  };
+  std::vector<ParsedLink> parsed_links_;
+  std::vector<std::pair<uint32_t, uint32_t>> parsed_params_;
+  std::vector<std::pair<uint32_t, uint32_t>> keys_;   // Index scratch
+
+  uint64_t expirations_;
+  uint64_t compactions_;
+  uint64_t reinterns_;
+  uint64_t sweeps_;
+};
+
+}   // namespace rd
+
+#endif  // RD_DIRECTORY_H_
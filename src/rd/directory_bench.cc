@@ -0,0 +1,166 @@
+// Copyleft 2013 tho@autistici.org
+
+// The directory at scale: 1M endpoints in 1000 domains, each with a
+// few links, then lookups by endpoint name, by rt within a domain, and
+// blocks of a lookup whose result runs to megabytes, with the latency
+// of each.  Then re-registrations with new links, to churn the
+// columns and indexes.
+//
+// Usage: directory_bench [endpoints [lookups]]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <string>
+#include "utils/histogram.h"
+#include "rd/directory.h"
+
+using namespace rd;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+uint64_t ns_since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count();
+}
+
+const uint64_t kNow = 1000000;
+
+RegistrationParams params(size_t i) {
+  RegistrationParams p;
+  p.ep = "node-" + std::to_string(i);
+  p.d = "sector-" + std::to_string(i % 1000);
+  p.base = "coap://[2001:db8::" + std::to_string(i) + "]";
+  return p;
+}
+
+// One in ten endpoints has a temperature sensor.
+std::string links(size_t i, size_t round) {
+  std::string s = "</light>;rt=\"light-lux\";if=\"core.s\","
+                  "</fw>;rt=\"firmware\";sz=" + std::to_string(round);
+  if (i % 10 == 0)
+    s += ",</temp>;rt=\"temperature\";if=\"core.s\";obs";
+  return s;
+}
+
+void lookup(const Directory& dir, LookupKind kind, const char* label,
+            const std::string& filters, size_t block, size_t nlookups,
+            std::mt19937_64& rng, size_t nendpoints) {
+  utils::Histogram h;
+  std::string out;
+  bool more;
+  size_t bytes = 0;
+
+  for (size_t n = 0; n < nlookups; ++n) {
+    // "%" in the filters is a random endpoint number.
+    std::string f = filters;
+    size_t pct = f.find('%');
+    if (pct != std::string::npos)
+      f.replace(pct, 1, std::to_string(rng() % nendpoints));
+
+    auto start = Clock::now();
+    Query q;
+    for (size_t begin = 0; begin < f.size(); ) {
+      size_t end = f.find('&', begin);
+      if (end == std::string::npos)
+        end = f.size();
+      assert(q.Add(f.data() + begin, end - begin));
+      begin = end + 1;
+    }
+    dir.Lookup(kind, q, block * 1024, 1024, out, more);
+    h.Record(ns_since(start));
+    bytes += out.size();
+  }
+  assert(bytes > 0);
+  h.Print(stdout, label, 1000, "us");
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t nlookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+
+  DirectoryConfig config = kDefaultDirectoryConfig;
+  config.max_registrations = n;
+  Directory dir(config);
+  std::mt19937_64 rng(42);
+
+  std::vector<std::string> docs;
+  for (size_t i = 0; i < 1000; ++i)
+    docs.push_back(links(i, 0));
+
+  auto start = Clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    const std::string& doc = docs[i % docs.size()];
+    uint32_t handle;
+    coap::Code code = dir.Register(params(i),
+        reinterpret_cast<const uint8_t*>(doc.data()), doc.size(), kNow,
+        handle);
+    assert(code == coap::Code::Created);
+  }
+  double t = seconds_since(start);
+  printf("register %zu endpoints: %7.0f ns/registration  %zu links, "
+         "%.1f MB (%.0f bytes/endpoint)\n", n, t * 1e9 / n, dir.links(),
+         dir.memory() / 1e6, double(dir.memory()) / n);
+
+  // Whole results, or first blocks of them.
+  lookup(dir, LookupKind::endpoint, "ep=node-X            ", "ep=node-%", 0,
+         nlookups, rng, n);
+  lookup(dir, LookupKind::resource, "res ep=node-X        ", "ep=node-%", 0,
+         nlookups, rng, n);
+  lookup(dir, LookupKind::resource, "rt=temp&d=sector-40  ",
+         "rt=temperature&d=sector-40", 0, nlookups, rng, n);
+  lookup(dir, LookupKind::endpoint, "d=sector-40 block 0  ", "d=sector-40",
+         0, nlookups, rng, n);
+
+  // rt=temperature alone is 100k links, megabytes of link-format: its
+  // blocks cost what precedes them.
+  lookup(dir, LookupKind::resource, "rt=temp block 0      ",
+         "rt=temperature", 0, nlookups, rng, n);
+  lookup(dir, LookupKind::resource, "rt=temp block 100    ",
+         "rt=temperature", 100, nlookups / 10, rng, n);
+  lookup(dir, LookupKind::resource, "rt=temp&page=500     ",
+         "rt=temperature&count=10&page=500", 0, nlookups / 10, rng, n);
+
+  // Unindexed: a scan until the block is full.
+  lookup(dir, LookupKind::resource, "sz=0 block 0         ", "sz=0", 0,
+         nlookups, rng, n);
+
+  // Re-registrations, links changed every time.
+  size_t rounds = 3;
+  start = Clock::now();
+  for (size_t round = 1; round <= rounds; ++round) {
+    for (size_t i = 0; i < n; ++i) {
+      std::string doc = links(i, round);
+      uint32_t handle;
+      coap::Code code = dir.Register(params(i),
+          reinterpret_cast<const uint8_t*>(doc.data()), doc.size(),
+          kNow + round, handle);
+      assert(code == coap::Code::Changed);
+    }
+  }
+  t = seconds_since(start);
+  printf("re-register x %zu:      %7.0f ns/registration  %.1f MB, "
+         "%llu compactions, %llu sweeps\n", rounds, t * 1e9 / (n * rounds),
+         dir.memory() / 1e6,
+         static_cast<unsigned long long>(dir.compactions()),
+         static_cast<unsigned long long>(dir.sweeps()));
+  lookup(dir, LookupKind::resource, "rt=temp&d=sector-40  ",
+         "rt=temperature&d=sector-40", 0, nlookups, rng, n);
+
+  // Everything expires at once.
+  start = Clock::now();
+  size_t expired = dir.Expire(kNow + rounds + 90000);
+  t = seconds_since(start);
+  printf("expire %zu:             %7.0f ns/registration\n", expired,
+         t * 1e9 / expired);
+}
@@ -0,0 +1,371 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstring>
+#include <set>
+#include <string>
+#include "utils/log.h"
+#include "rd/directory.h"
+
+using namespace rd;
+
+void init_log() {
+  utils::Log::Instance()->Open("directory_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+const uint64_t kNow = 1000000;
+
+RegistrationParams params(const std::string& ep, const std::string& d = "",
+                          int64_t lt = -1) {
+  RegistrationParams p;
+  p.ep = ep;
+  p.d = d;
+  p.base = "coap://" + ep;
+  p.lifetime_s = lt;
+  return p;
+}
+
+const uint8_t* bytes(const std::string& s) {
+  return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+uint32_t reg(Directory& dir, const RegistrationParams& p,
+             const std::string& links, coap::Code expect = coap::Code::Created,
+             uint64_t now = kNow) {
+  uint32_t handle = kNoRegistration;
+  assert(dir.Register(p, bytes(links), links.size(), now, handle) == expect);
+  return handle;
+}
+
+// The whole result of a lookup, filters joined by '&'.
+std::string lookup(const Directory& dir, LookupKind kind,
+                   const std::string& filters, uint32_t handle =
+                   kNoRegistration) {
+  Query q;
+  q.handle = handle;
+  for (size_t begin = 0; begin < filters.size(); ) {
+    size_t end = filters.find('&', begin);
+    if (end == std::string::npos)
+      end = filters.size();
+    assert(q.Add(filters.data() + begin, end - begin));
+    begin = end + 1;
+  }
+
+  std::string out;
+  bool more;
+  dir.Lookup(kind, q, 0, 1 << 20, out, more);
+  assert(!more);
+  return out;
+}
+
+std::string res(const Directory& dir, const std::string& filters) {
+  return lookup(dir, LookupKind::resource, filters);
+}
+
+std::string ep(const Directory& dir, const std::string& filters) {
+  return lookup(dir, LookupKind::endpoint, filters);
+}
+
+void test_ok_register_lookup() {
+  Directory dir;
+
+  uint32_t a = reg(dir, params("node1", "sector1", 600),
+                   "</temp>;rt=\"temperature\";if=\"sensor\","
+                   "</light>;rt=\"light-lux\";ct=0");
+  RegistrationParams p = params("node2", "sector2");
+  p.extra.push_back(std::make_pair("et", "oic.d.sensor"));
+  uint32_t b = reg(dir, p, "</temp>;rt=\"temperature humidity\"");
+
+  assert(a != b && dir.Valid(a) && dir.Valid(b));
+  assert(dir.registrations() == 2 && dir.links() == 3);
+
+  assert(ep(dir, "ep=node1") ==
+         "</rd/" + std::to_string(a) + ">;ep=\"node1\";d=\"sector1\";"
+         "base=\"coap://node1\";lt=600");
+  assert(ep(dir, "et=oic.d.sensor") ==
+         "</rd/" + std::to_string(b) + ">;ep=\"node2\";d=\"sector2\";"
+         "base=\"coap://node2\";lt=90000;et=\"oic.d.sensor\"");
+
+  // Resources come out absolute, anchored at their base.
+  assert(res(dir, "rt=temperature") ==
+         "<coap://node1/temp>;rt=\"temperature\";if=\"sensor\";"
+         "anchor=\"coap://node1\","
+         "<coap://node2/temp>;rt=\"temperature humidity\";"
+         "anchor=\"coap://node2\"");
+  assert(res(dir, "rt=humidity") ==
+         "<coap://node2/temp>;rt=\"temperature humidity\";"
+         "anchor=\"coap://node2\"");
+
+  // Endpoint filters apply to resource lookups too, and link filters
+  // to endpoint lookups.
+  assert(res(dir, "rt=temperature&d=sector2") ==
+         res(dir, "rt=humidity"));
+  assert(ep(dir, "rt=light-lux") == ep(dir, "ep=node1"));
+  assert(ep(dir, "if=sensor&d=sector2") == "");
+
+  // The registration's own links.
+  assert(lookup(dir, LookupKind::resource, "", b) == res(dir, "rt=humidity"));
+  assert(lookup(dir, LookupKind::resource, "ct=0", a) ==
+         "<coap://node1/light>;rt=\"light-lux\";ct=0;"
+         "anchor=\"coap://node1\"");
+}
+
+void test_ok_filters() {
+  Directory dir;
+  reg(dir, params("n1", "d1"), "</a>;rt=\"temp-c\";obs,</b>;rt=\"temp-f\"");
+  reg(dir, params("n2", "d1"), "</a>;rt=\"light\"");
+  reg(dir, params("n3", "d2"), "</c>;rt=\"temp-c\";title=\"Roof\"");
+
+  assert(ep(dir, "d=d1") == ep(dir, "ep=n1") + "," + ep(dir, "ep=n2"));
+  assert(ep(dir, "ep=n*") == ep(dir, "d=d1") + "," + ep(dir, "ep=n3"));
+  assert(ep(dir, "ep=nope") == "");
+  assert(ep(dir, "rt=nope") == "");
+  assert(res(dir, "rt=temp-*&d=d1") ==
+         "<coap://n1/a>;rt=\"temp-c\";obs;anchor=\"coap://n1\","
+         "<coap://n1/b>;rt=\"temp-f\";anchor=\"coap://n1\"");
+  assert(res(dir, "obs") ==
+         "<coap://n1/a>;rt=\"temp-c\";obs;anchor=\"coap://n1\"");
+  assert(res(dir, "title=Roof") == res(dir, "ep=n3"));
+  assert(res(dir, "href=/c") == res(dir, "ep=n3"));
+  assert(res(dir, "href=/*&ep=n2") == res(dir, "ep=n2"));
+
+  // Pages of count results.
+  assert(ep(dir, "count=2") == ep(dir, "d=d1"));
+  assert(ep(dir, "count=2&page=1") == ep(dir, "ep=n3"));
+  assert(ep(dir, "count=2&page=2") == "");
+  assert(res(dir, "count=1&page=1") ==
+         "<coap://n1/b>;rt=\"temp-f\";anchor=\"coap://n1\"");
+}
+
+void test_ok_blocks() {
+  Directory dir;
+  for (int i = 0; i < 200; ++i)
+    reg(dir, params("node" + std::to_string(i), "d"),
+        "</s/" + std::to_string(i) + ">;rt=\"temperature\"");
+
+  std::string all = res(dir, "rt=temperature");
+  assert(all.size() > 5000);
+
+  // Blocks of 64 bytes put back together.
+  Query q;
+  assert(q.Add("rt=temperature", 14));
+  std::string joined, block;
+  bool more = true;
+  size_t n = 0;
+  for (size_t offset = 0; more; offset += 64, ++n) {
+    dir.Lookup(LookupKind::resource, q, offset, 64, block, more);
+    assert(block.size() == (more ? 64 : all.size() - offset));
+    joined += block;
+  }
+  assert(joined == all);
+  assert(n == (all.size() + 63) / 64);
+
+  // Right up to the end.
+  dir.Lookup(LookupKind::resource, q, 0, all.size(), block, more);
+  assert(block == all && !more);
+  dir.Lookup(LookupKind::resource, q, all.size(), 64, block, more);
+  assert(block.empty() && !more);
+}
+
+void test_ok_reregister() {
+  Directory dir;
+  uint32_t h = reg(dir, params("n", "d"), "</a>;rt=\"old\"");
+
+  // Same (ep, d): replaced under the same handle.
+  assert(reg(dir, params("n", "d"), "</b>;rt=\"new\"", coap::Code::Changed) ==
+         h);
+  assert(dir.registrations() == 1 && dir.links() == 1);
+  assert(res(dir, "rt=old") == "");
+  assert(res(dir, "rt=new") ==
+         "<coap://n/b>;rt=\"new\";anchor=\"coap://n\"");
+
+  // Another domain is another registration.
+  assert(reg(dir, params("n", "d2"), "</a>") != h);
+  assert(dir.registrations() == 2);
+}
+
+void test_ok_update() {
+  Directory dir;
+  uint32_t h = reg(dir, params("n", "d", 100), "</a>;rt=\"x\"");
+
+  RegistrationParams p;
+  p.base = "coap://elsewhere";
+  p.lifetime_s = 200;
+  p.extra.push_back(std::make_pair("et", "thing"));
+  assert(dir.Update(h, p, nullptr, 0, kNow) == coap::Code::Changed);
+  assert(res(dir, "rt=x") ==
+         "<coap://elsewhere/a>;rt=\"x\";anchor=\"coap://elsewhere\"");
+  assert(ep(dir, "et=thing&lt=200") != "");
+
+  std::string links = "</b>;rt=\"y\"";
+  assert(dir.Update(h, RegistrationParams(), bytes(links), links.size(),
+                    kNow) == coap::Code::Changed);
+  assert(res(dir, "rt=x") == "");
+  assert(res(dir, "rt=y") != "");
+  assert(ep(dir, "et=thing") != "");
+
+  // Refreshed: 200 s from the update.
+  assert(dir.Update(h, RegistrationParams(), nullptr, 0, kNow + 150) ==
+         coap::Code::Changed);
+  assert(dir.Expire(kNow + 300) == 0);
+  assert(dir.Expire(kNow + 350) == 1);
+  assert(dir.Update(h, RegistrationParams(), nullptr, 0, kNow + 351) ==
+         coap::Code::NotFound);
+}
+
+void test_ok_remove() {
+  Directory dir;
+  uint32_t h = reg(dir, params("n"), "</a>;rt=\"x\"");
+  assert(dir.Remove(h));
+  assert(!dir.Valid(h) && !dir.Remove(h));
+  assert(dir.registrations() == 0);
+  assert(res(dir, "rt=x") == "" && ep(dir, "") == "");
+
+  // The slot is reused under another handle.
+  uint32_t h2 = reg(dir, params("n"), "</a>;rt=\"x\"");
+  assert(h2 != h && (h2 & 0xFFFFFF) == (h & 0xFFFFFF));
+  assert(!dir.Valid(h) && dir.Valid(h2));
+  assert(res(dir, "rt=x") == "<coap://n/a>;rt=\"x\";anchor=\"coap://n\"");
+}
+
+void test_ok_handles_unique() {
+  Directory dir;
+  std::set<uint32_t> handles;
+  uint32_t first = reg(dir, params("n"), "</a>");
+  handles.insert(first);
+  assert(dir.Remove(first));
+
+  // Past 256 reuses of the slot: retired rather than wrapped.
+  for (int i = 0; i < 300; ++i) {
+    uint32_t h = reg(dir, params("n"), "</a>");
+    assert(handles.insert(h).second);
+    assert(!dir.Valid(first) && dir.Valid(h));
+    assert(dir.Remove(h));
+  }
+  assert(dir.registrations() == 0);
+}
+
+void test_ok_expire() {
+  Directory dir;
+  reg(dir, params("short", "", 10), "</a>");
+  reg(dir, params("long", "", 10000), "</a>");   // more than a turn
+
+  assert(dir.Expire(kNow) == 0);
+  assert(dir.Expire(kNow + 9) == 0);
+  assert(dir.Expire(kNow + 10) == 1);
+  assert(ep(dir, "") == ep(dir, "ep=long"));
+
+  // The wheel comes round to it twice first.
+  for (uint64_t t = kNow + 11; t < kNow + 10000; t += 7)
+    assert(dir.Expire(t) == 0);
+  assert(dir.Expire(kNow + 10000) == 1);
+  assert(dir.registrations() == 0 && dir.expirations() == 2);
+
+  // A jump further than a turn.
+  reg(dir, params("a", "", 50), "</a>", coap::Code::Created, kNow + 20000);
+  assert(dir.Expire(kNow + 90000) == 1);
+}
+
+void test_ok_garbage() {
+  Directory dir;
+  std::string links = "</a>;rt=\"one\";if=\"x\",</b>;rt=\"two\"";
+  for (int i = 0; i < 100; ++i)
+    reg(dir, params("n" + std::to_string(i)), links);
+
+  for (int round = 0; round < 200; ++round)
+    for (int i = 0; i < 100; ++i)
+      reg(dir, params("n" + std::to_string(i)),
+          "</c>;rt=\"r" + std::to_string(round) + "\"", coap::Code::Changed);
+
+  assert(dir.compactions() > 0);
+  assert(dir.sweeps() > 0);
+  assert(dir.links() == 100);
+  assert(res(dir, "rt=one") == "");
+  assert(res(dir, "rt=r198") == "");
+  std::string last = res(dir, "rt=r199");
+  std::string first = "<coap://n0/c>;rt=\"r199\";anchor=\"coap://n0\",";
+  assert(last.compare(0, first.size(), first) == 0);
+  assert(ep(dir, "rt=r199") == ep(dir, ""));
+}
+
+void test_ok_strings_churn() {
+  Directory dir;
+  reg(dir, params("other"), "</x>;rt=\"kept\"");
+
+  // A new source port every time: a new base to intern.
+  RegistrationParams p = params("n", "d");
+  size_t memory = 0;
+  for (int i = 0; i < 50000; ++i) {
+    p.base = "coap://[2001:db8::1]:" + std::to_string(i);
+    reg(dir, p, "</a>;rt=\"t" + std::to_string(i % 7) + "\"",
+        i == 0 ? coap::Code::Created : coap::Code::Changed);
+    if (i == 10000)
+      memory = dir.memory();
+  }
+
+  assert(dir.reinterns() > 0);
+  assert(dir.strings() < 3 * 4096);
+  assert(dir.memory() <= memory * 2);
+  assert(res(dir, "rt=kept") ==
+         "<coap://other/x>;rt=\"kept\";anchor=\"coap://other\"");
+  assert(res(dir, "rt=t5") == "<coap://[2001:db8::1]:49999/a>;rt=\"t5\";"
+         "anchor=\"coap://[2001:db8::1]:49999\"");
+  assert(res(dir, "rt=t4") == "");
+  assert(ep(dir, "ep=n&d=d") != "" && ep(dir, "ep=other") != "");
+  assert(reg(dir, p, "</b>", coap::Code::Changed) != kNoRegistration);
+  assert(dir.registrations() == 2);
+}
+
+void test_ko_register() {
+  DirectoryConfig config = kDefaultDirectoryConfig;
+  config.max_registrations = 2;
+  Directory dir(config);
+
+  reg(dir, params(""), "</a>", coap::Code::BadRequest);
+  reg(dir, params("n", "", 0), "</a>", coap::Code::BadRequest);
+  reg(dir, params("n"), "</a>;", coap::Code::BadRequest);
+  reg(dir, params("n"), "/a", coap::Code::BadRequest);
+  assert(dir.registrations() == 0);
+
+  reg(dir, params("a"), "");
+  uint32_t b = reg(dir, params("b"), "");
+  reg(dir, params("c"), "", coap::Code::ServiceUnavailable);
+  reg(dir, params("b"), "</x>", coap::Code::Changed);
+  assert(dir.Remove(b));
+  reg(dir, params("c"), "");
+
+  std::string bad = "<a";
+  assert(dir.Update(b, RegistrationParams(), nullptr, 0, kNow) ==
+         coap::Code::NotFound);
+  uint32_t c = reg(dir, params("c"), "", coap::Code::Changed);
+  assert(dir.Update(c, RegistrationParams(), bytes(bad), bad.size(), kNow) ==
+         coap::Code::BadRequest);
+}
+
+void test_ko_query() {
+  Query q;
+  assert(!q.Add("=x", 2));
+  assert(!q.Add("page=x", 6));
+  assert(!q.Add("count=", 6));
+  assert(q.Add("count=3", 7) && q.count == 3);
+  assert(q.filters.empty());
+}
+
+int main() {
+  init_log();
+
+  test_ok_register_lookup();
+  test_ok_filters();
+  test_ok_blocks();
+  test_ok_reregister();
+  test_ok_update();
+  test_ok_remove();
+  test_ok_handles_unique();
+  test_ok_expire();
+  test_ok_garbage();
+  test_ok_strings_churn();
+  test_ko_register();
+  test_ko_query();
+}
@@ -0,0 +1,90 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include "rd/interner.h"
+
+namespace rd {
+
+namespace {
+
+const size_t kInitialTable = 1024;      // power of 2
+
+}   // namespace
+
+const uint32_t Interner::kNone;
+
+Interner::Interner()
+  : table_(kInitialTable, kNone) {
+}
+
+// FNV-1a
+uint32_t Interner::Hash(const char* data, size_t length) {
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < length; ++i) {
+    h ^= static_cast<uint8_t>(data[i]);
+    h *= 16777619U;
+  }
+  return h;
+}
+
+// Where the string is in table_, or the empty slot it would go to.
+size_t Interner::Slot(const char* data, size_t length, uint32_t hash) const {
+  size_t mask = table_.size() - 1;
+
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    uint32_t id = table_[i];
+    if (id == kNone)
+      return i;
+
+    const String& s = strings_[id];
+    if (s.hash == hash && s.length == length &&
+        memcmp(arena_.data() + s.offset, data, length) == 0)
+      return i;
+  }
+}
+
+uint32_t Interner::Intern(const char* data, size_t length) {
+  uint32_t hash = Hash(data, length);
+  size_t i = Slot(data, length, hash);
+  if (table_[i] != kNone)
+    return table_[i];
+
+  uint32_t id = strings_.size();
+  String s = { static_cast<uint32_t>(arena_.size()),
+               static_cast<uint32_t>(length), hash };
+  strings_.push_back(s);
+  arena_.append(data, length);
+  table_[i] = id;
+
+  // Keep the load under 1/2.
+  if (strings_.size() * 2 > table_.size())
+    Grow();
+
+  return id;
+}
+
+uint32_t Interner::Find(const char* data, size_t length) const {
+  return table_[Slot(data, length, Hash(data, length))];
+}
+
+void Interner::Grow() {
+  std::vector<uint32_t> table(table_.size() * 2, kNone);
+  size_t mask = table.size() - 1;
+
+  for (uint32_t id = 0; id < strings_.size(); ++id) {
+    size_t i = strings_[id].hash & mask;
+    while (table[i] != kNone)
+      i = (i + 1) & mask;
+    table[i] = id;
+  }
+
+  table_.swap(table);
+}
+
+size_t Interner::memory() const {
+  return strings_.capacity() * sizeof(String) + arena_.capacity() +
+         table_.capacity() * sizeof(uint32_t);
+}
+
+}   // namespace rd
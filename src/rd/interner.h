@@ -0,0 +1,64 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef RD_INTERNER_H_
+#define RD_INTERNER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace rd {
+
+// Strings numbered in order of first sight, so that the directory can
+// store and compare 4-byte ids.  The bytes sit back to back in one
+// arena, found through an open addressing table of ids; nothing is
+// ever removed (the strings a fleet registers with, endpoint names
+// aside, repeat a lot).  The directory builds a new one from its live
+// registrations when the dead strings pile up.
+class Interner {
+ public:
+  static const uint32_t kNone = ~0U;
+
+  Interner();
+
+  // The id of the string, assigned if new.
+  uint32_t Intern(const char* data, size_t length);
+
+  // The id of the string, or kNone if it has never been interned.
+  uint32_t Find(const char* data, size_t length) const;
+
+  const char* data(uint32_t id) const {
+    return arena_.data() + strings_[id].offset;
+  }
+  size_t length(uint32_t id) const { return strings_[id].length; }
+  std::string str(uint32_t id) const {
+    return std::string(data(id), length(id));
+  }
+
+  size_t size() const { return strings_.size(); }
+
+  // Bytes allocated.
+  size_t memory() const;
+
+ private:
+  struct String {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t hash;
+  };
+
+  static uint32_t Hash(const char* data, size_t length);
+  size_t Slot(const char* data, size_t length, uint32_t hash) const;
+  void Grow();
+
+ private:
+  std::vector<String> strings_;
+  std::string arena_;
+  std::vector<uint32_t> table_;     // ids, kNone where empty
+};
+
+}   // namespace rd
+
+#endif  // RD_INTERNER_H_
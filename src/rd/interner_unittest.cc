@@ -0,0 +1,59 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include "utils/log.h"
+#include "rd/interner.h"
+
+using namespace rd;
+
+void init_log() {
+  utils::Log::Instance()->Open("interner_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+void test_ok_intern() {
+  Interner strings;
+  assert(strings.size() == 0);
+  assert(strings.Find("temperature", 11) == Interner::kNone);
+
+  uint32_t t = strings.Intern("temperature", 11);
+  uint32_t e = strings.Intern("", 0);
+  assert(t != e);
+  assert(strings.Intern("temperature", 11) == t);
+  assert(strings.Find("temperature", 11) == t);
+  assert(strings.Find("temp", 4) == Interner::kNone);
+  assert(strings.Find("", 0) == e);
+  assert(strings.str(t) == "temperature");
+  assert(strings.length(e) == 0);
+  assert(strings.size() == 2);
+}
+
+void test_ok_many() {
+  Interner strings;
+  size_t before = strings.memory();
+
+  for (int i = 0; i < 100000; ++i) {
+    char s[32];
+    int n = snprintf(s, sizeof s, "node-%d", i);
+    assert(strings.Intern(s, n) == uint32_t(i));
+  }
+  assert(strings.size() == 100000);
+  assert(strings.memory() > before);
+
+  for (int i = 0; i < 100000; ++i) {
+    char s[32];
+    int n = snprintf(s, sizeof s, "node-%d", i);
+    assert(strings.Find(s, n) == uint32_t(i));
+    assert(strings.str(i) == s);
+  }
+}
+
+int main() {
+  init_log();
+
+  test_ok_intern();
+  test_ok_many();
+}
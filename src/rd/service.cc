@@ -0,0 +1,415 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <random>
+
+#include "coap/block.h"
+#include "coap/header.h"
+#include "coap/link_format.h"
+#include "coap/pdu.h"
+#include "utils/log.h"
+#include "rd/service.h"
+
+namespace rd {
+
+namespace {
+
+// What /.well-known/core lists (RFC 9176 4.3).
+const char kInterfaces[] =
+    "</rd>;rt=\"core.rd\";ct=40,"
+    "</rd-lookup/ep>;rt=\"core.rd-lookup-ep\";ct=40,"
+    "</rd-lookup/res>;rt=\"core.rd-lookup-res\";ct=40";
+
+bool Segment(const std::vector<std::string>& path, size_t i,
+             const char* literal) {
+  return path.size() > i && path[i] == literal;
+}
+
+}   // namespace
+
+Service::Service(net::Transport* transport, const DirectoryConfig& config)
+  : transport_(transport)
+  , directory_(config)
+  , registrations_(0)
+  , updates_(0)
+  , lookups_(0) {
+  std::random_device rd;
+  next_mid_ = rd();
+  scratch_.reserve(net::kMaxDatagramSize);
+}
+
+uint64_t Service::NowS() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+void Service::RunOnce(int timeout_ms) {
+  transport_->Poll(this, timeout_ms);
+  directory_.Expire(NowS());
+  transport_->Flush();
+}
+
+bool Service::Parse(const coap::PDUView& req, Request& r) {
+  r.block_num = 0;
+  r.block_szx = coap::SzxFor(kBlockSize);
+  r.content_format = -1;
+  r.bad_option = false;
+
+  coap::OptionCursor cursor = req.options();
+  size_t num;
+  const uint8_t* value;
+  size_t length;
+
+  while (cursor.Next(num, value, length)) {
+    switch (num) {
+      case coap::OptionNumber::Uri_Path:
+        r.path.push_back(std::string(reinterpret_cast<const char*>(value),
+                                     length));
+        break;
+
+      case coap::OptionNumber::Uri_Query:
+        r.query.push_back(std::string(reinterpret_cast<const char*>(value),
+                                      length));
+        break;
+
+      case coap::OptionNumber::Content_Format:
+        r.content_format = 0;
+        for (size_t i = 0; i < length; ++i)
+          r.content_format = (r.content_format << 8) | value[i];
+        break;
+
+      case coap::OptionNumber::Block2: {
+        coap::Block block;
+        if (!coap::DecodeBlock(value, length, block)) {
+          r.bad_option = true;
+          break;
+        }
+        r.block_num = block.num;
+        r.block_szx = std::min(block.szx, r.block_szx);
+        break;
+      }
+    }
+  }
+
+  return !cursor.failed();
+}
+
+bool Service::ParseParams(const Request& r, RegistrationParams& params) {
+  for (const std::string& q : r.query) {
+    size_t eq = q.find('=');
+    std::string name = q.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : q.substr(eq + 1);
+
+    if (name == "ep") {
+      params.ep = value;
+    } else if (name == "d") {
+      params.d = value;
+    } else if (name == "base") {
+      params.base = value;
+    } else if (name == "lt") {
+      if (value.empty() || value.size() > 10 ||
+          value.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+      params.lifetime_s = std::stoll(value);
+    } else if (!name.empty()) {
+      params.extra.push_back(std::make_pair(name, value));
+    }
+  }
+  return true;
+}
+
+uint32_t Service::ParseHandle(const std::string& segment) {
+  if (segment.empty() || segment.size() > 10 ||
+      segment.find_first_not_of("0123456789") != std::string::npos)
+    return kNoRegistration;
+
+  uint64_t handle = std::stoull(segment);
+  return handle < kNoRegistration ? handle : kNoRegistration;
+}
+
+// coap://address:port of the peer, for registrations without base.
+std::string Service::SourceBase(const net::Datagram& dgram) {
+  char host[INET6_ADDRSTRLEN];
+  uint16_t port;
+
+  if (dgram.peer->sa_family == AF_INET) {
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(dgram.peer);
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof host);
+    port = ntohs(sin->sin_port);
+    return "coap://" + std::string(host) + ":" + std::to_string(port);
+  }
+
+  if (dgram.peer->sa_family == AF_INET6) {
+    const sockaddr_in6* sin6 =
+        reinterpret_cast<const sockaddr_in6*>(dgram.peer);
+    inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof host);
+    port = ntohs(sin6->sin6_port);
+    return "coap://[" + std::string(host) + "]:" + std::to_string(port);
+  }
+
+  return "";
+}
+
+void Service::Respond(const coap::PDUView& req, const net::Datagram& dgram,
+                      coap::Code code, uint32_t location) {
+  coap::PDU rsp;
+
+  // Piggyback on the ACK if confirmable.
+  if (req.type() == coap::Type::CON) {
+    rsp.set_type(coap::Type::ACK);
+    rsp.set_message_id(req.message_id());
+  } else {
+    rsp.set_type(coap::Type::NON);
+    rsp.set_message_id(next_mid_++);
+  }
+  rsp.set_token(std::vector<uint8_t>(req.token(),
+                                     req.token() + req.token_length()));
+  rsp.set_code(code);
+
+  if (location != kNoRegistration) {
+    coap::Options opts;
+    opts.AddLocationPath("rd");
+    opts.AddLocationPath(std::to_string(location));
+    rsp.set_options(opts);
+  }
+
+  scratch_.clear();
+  if (rsp.Encode(scratch_))
+    transport_->Send(scratch_.data(), scratch_.size(), dgram.peer,
+                     dgram.peer_len);
+}
+
+// Send block num (of 2^(szx + 4) bytes) of a lookup result, which is
+// in block_.
+void Service::RespondBlock(const coap::PDUView& req,
+                           const net::Datagram& dgram, uint32_t num,
+                           uint8_t szx, bool more) {
+  coap::PDU rsp;
+
+  if (req.type() == coap::Type::CON) {
+    rsp.set_type(coap::Type::ACK);
+    rsp.set_message_id(req.message_id());
+  } else {
+    rsp.set_type(coap::Type::NON);
+    rsp.set_message_id(next_mid_++);
+  }
+  rsp.set_token(std::vector<uint8_t>(req.token(),
+                                     req.token() + req.token_length()));
+  rsp.set_code(coap::Code::Content);
+
+  coap::Options opts;
+  opts.AddContentFormat(coap::kLinkFormat);
+  if (more || num > 0) {
+    coap::Block block = { num, more, szx };
+    opts.AddBlock2(coap::EncodeBlock(block));
+  }
+  rsp.set_options(opts);
+  rsp.set_payload(std::vector<uint8_t>(block_.begin(), block_.end()));
+
+  scratch_.clear();
+  if (rsp.Encode(scratch_))
+    transport_->Send(scratch_.data(), scratch_.size(), dgram.peer,
+                     dgram.peer_len);
+}
+
+void Service::HandleLookup(const coap::PDUView& req,
+                           const net::Datagram& dgram, const Request& r,
+                           LookupKind kind, uint32_t handle) {
+  Query query;
+  query.handle = handle;
+  for (const std::string& q : r.query) {
+    if (!query.Add(q.data(), q.size())) {
+      Respond(req, dgram, coap::Code::BadRequest);
+      return;
+    }
+  }
+
+  coap::Block block = { r.block_num, false, r.block_szx };
+  if (block.num > coap::kMaxBlockNum) {
+    Respond(req, dgram, coap::Code::BadOption);
+    return;
+  }
+
+  bool more;
+  directory_.Lookup(kind, query, block.offset(), block.size(), block_, more);
+  ++lookups_;
+  RespondBlock(req, dgram, block.num, block.szx, more);
+}
+
+void Service::HandleRd(const coap::PDUView& req, const net::Datagram& dgram,
+                       const Request& r) {
+  RegistrationParams params;
+  if (!ParseParams(r, params)) {
+    Respond(req, dgram, coap::Code::BadRequest);
+    return;
+  }
+
+  if (r.content_format != -1 && r.content_format != coap::kLinkFormat &&
+      req.payload_size() > 0) {
+    Respond(req, dgram, coap::Code::UnsupportedContentFormat);
+    return;
+  }
+
+  uint64_t now = NowS();
+
+  // Registration: /rd
+  if (r.path.size() == 1) {
+    if (req.code() != coap::Code::POST) {
+      Respond(req, dgram, coap::Code::MethodNotAllowed);
+      return;
+    }
+
+    if (params.base.empty())
+      params.base = SourceBase(dgram);
+
+    uint32_t handle;
+    coap::Code code = directory_.Register(params, req.payload(),
+                                          req.payload_size(), now, handle);
+    if (code == coap::Code::Created || code == coap::Code::Changed) {
+      ++registrations_;
+      Respond(req, dgram, code, handle);
+    } else {
+      Respond(req, dgram, code);
+    }
+    return;
+  }
+
+  // Registration resource: /rd/<handle>
+  uint32_t handle = r.path.size() == 2 ? ParseHandle(r.path[1])
+                                       : kNoRegistration;
+  if (!directory_.Valid(handle)) {
+    Respond(req, dgram, coap::Code::NotFound);
+    return;
+  }
+
+  switch (req.code()) {
+    case coap::Code::POST: {
+      coap::Code code = directory_.Update(
+          handle, params, req.payload_size() > 0 ? req.payload() : nullptr,
+          req.payload_size(), now);
+      if (code == coap::Code::Changed)
+        ++updates_;
+      Respond(req, dgram, code);
+      return;
+    }
+
+    case coap::Code::DELETE:
+      directory_.Remove(handle);
+      Respond(req, dgram, coap::Code::Deleted);
+      return;
+
+    case coap::Code::GET:
+      HandleLookup(req, dgram, r, LookupKind::resource, handle);
+      return;
+
+    default:
+      Respond(req, dgram, coap::Code::MethodNotAllowed);
+      return;
+  }
+}
+
+void Service::OnDatagram(const net::Datagram& dgram) {
+  switch (coap::ClassifyEmpty(dgram.data, dgram.size)) {
+    case coap::EmptyKind::other:
+      break;
+
+    case coap::EmptyKind::ping: {
+      uint8_t rst[4];
+      coap::ResetFor(dgram.data, rst);
+      transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+      return;
+    }
+
+    default:
+      return;
+  }
+
+  coap::PDUView req;
+  if (!req.Decode(dgram.data, dgram.size))
+    return;
+
+  if (static_cast<int>(req.code()) > coap::CodeBlocks::ReqMethodMax ||
+      (req.type() != coap::Type::CON && req.type() != coap::Type::NON))
+    return;
+
+  directory_.Expire(NowS());
+
+  Request r;
+  if (!Parse(req, r)) {
+    Respond(req, dgram, coap::Code::BadRequest);
+    return;
+  }
+  if (r.bad_option) {
+    Respond(req, dgram, coap::Code::BadOption);
+    return;
+  }
+
+  if (Segment(r.path, 0, "rd")) {
+    HandleRd(req, dgram, r);
+    return;
+  }
+
+  if (Segment(r.path, 0, "rd-lookup") && r.path.size() == 2) {
+    if (req.code() != coap::Code::GET)
+      Respond(req, dgram, coap::Code::MethodNotAllowed);
+    else if (r.path[1] == "ep")
+      HandleLookup(req, dgram, r, LookupKind::endpoint, kNoRegistration);
+    else if (r.path[1] == "res")
+      HandleLookup(req, dgram, r, LookupKind::resource, kNoRegistration);
+    else
+      Respond(req, dgram, coap::Code::NotFound);
+    return;
+  }
+
+  if (r.path.size() == 2 && Segment(r.path, 0, ".well-known") &&
+      Segment(r.path, 1, "core")) {
+    if (req.code() != coap::Code::GET) {
+      Respond(req, dgram, coap::Code::MethodNotAllowed);
+      return;
+    }
+
+    // Filtered like any link-format document (RFC 6690 4.1): each
+    // name=value must match one of the link's parameters.
+    block_.clear();
+    const uint8_t* doc = reinterpret_cast<const uint8_t*>(kInterfaces);
+    coap::LinkCursor cursor(doc, sizeof kInterfaces - 1);
+    const char* target;
+    size_t length;
+    while (cursor.NextLink(target, length)) {
+      std::string link = "<" + std::string(target, length) + ">";
+      std::vector<bool> matched(r.query.size(), false);
+      const char* name;
+      const char* value;
+      size_t name_length, value_length;
+      while (cursor.NextParam(name, name_length, value, value_length)) {
+        coap::AppendLinkParam(link, name, name_length, value, value_length);
+        for (size_t i = 0; i < r.query.size(); ++i) {
+          const std::string& q = r.query[i];
+          size_t eq = std::min(q.find('='), q.size());
+          matched[i] = matched[i] ||
+              (eq == name_length && q.compare(0, eq, name, eq) == 0 &&
+               coap::MatchLinkParam(name, name_length, value, value_length,
+                                    q.data() + std::min(eq + 1, q.size()),
+                                    q.size() - std::min(eq + 1, q.size())));
+        }
+      }
+      if (std::count(matched.begin(), matched.end(), false) == 0) {
+        if (!block_.empty())
+          block_ += ',';
+        block_ += link;
+      }
+    }
+    RespondBlock(req, dgram, 0, coap::kMaxSzx, false);
+    return;
+  }
+
+  Respond(req, dgram, coap::Code::NotFound);
+}
+
+}   // namespace rd
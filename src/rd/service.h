@@ -0,0 +1,101 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef RD_SERVICE_H_
+#define RD_SERVICE_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <vector>
+
+#include "coap/view.h"
+#include "net/transport.h"
+#include "rd/directory.h"
+
+namespace rd {
+
+// Lookup results go out in blocks of at most this many bytes (SZX 6),
+// or smaller if the client asks with a Block2 option.
+const size_t kBlockSize = 1024;
+
+// A resource directory on a transport, driven by a single thread:
+//
+//   POST /rd?ep=...&d=...&lt=...&base=...   register: 2.01 (2.04 if
+//                                           already), Location-Path
+//                                           rd/<handle>
+//   POST /rd/<handle>?lt=...&base=...       update; a payload, if any,
+//                                           replaces the links: 2.04
+//   GET /rd/<handle>                        the registration's links
+//   DELETE /rd/<handle>                     2.02
+//   GET /rd-lookup/ep?<filters>             endpoint lookup
+//   GET /rd-lookup/res?<filters>            resource lookup
+//   GET /.well-known/core                   the interfaces above
+//
+// Without base, a registration's base is the address it came from.
+// Lookup results are application/link-format in Block2 blocks, each
+// one written by the Directory straight from its columns: a client
+// reading a long result block by block costs no more than the blocks.
+// Lifetimes are checked on each request and each RunOnce().
+class Service : public net::Handler {
+ public:
+  // transport must be open and outlive the service.
+  Service(net::Transport* transport,
+          const DirectoryConfig& config = kDefaultDirectoryConfig);
+
+  // Wait up to timeout_ms for requests and handle them.
+  void RunOnce(int timeout_ms);
+
+  void OnDatagram(const net::Datagram& dgram);
+
+  Directory& directory() { return directory_; }
+
+  // Counters
+  uint64_t registrations() const { return registrations_; }
+  uint64_t updates() const { return updates_; }
+  uint64_t lookups() const { return lookups_; }
+
+ private:
+  // What a request carries, in one pass over its options.
+  struct Request {
+    std::vector<std::string> path;
+    std::vector<std::string> query;
+    uint32_t block_num;
+    uint8_t block_szx;
+    int content_format;             // -1 if none
+    bool bad_option;
+  };
+
+  bool Parse(const coap::PDUView& req, Request& r);
+  static bool ParseParams(const Request& r, RegistrationParams& params);
+  static uint32_t ParseHandle(const std::string& segment);
+  static std::string SourceBase(const net::Datagram& dgram);
+
+  void HandleRd(const coap::PDUView& req, const net::Datagram& dgram,
+                const Request& r);
+  void HandleLookup(const coap::PDUView& req, const net::Datagram& dgram,
+                    const Request& r, LookupKind kind, uint32_t handle);
+
+  void Respond(const coap::PDUView& req, const net::Datagram& dgram,
+               coap::Code code, uint32_t location = kNoRegistration);
+  void RespondBlock(const coap::PDUView& req, const net::Datagram& dgram,
+                    uint32_t num, uint8_t szx, bool more);
+
+  static uint64_t NowS();
+
+ private:
+  net::Transport* transport_;
+  Directory directory_;
+  uint16_t next_mid_;
+
+  std::string block_;               // lookup scratch
+  std::vector<uint8_t> scratch_;    // encoded response
+
+  uint64_t registrations_;
+  uint64_t updates_;
+  uint64_t lookups_;
+};
+
+}   // namespace rd
+
+#endif  // RD_SERVICE_H_
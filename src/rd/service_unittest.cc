@@ -0,0 +1,244 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <string>
+#include "coap/block.h"
+#include "coap/link_format.h"
+#include "utils/log.h"
+#include "net/sim_testing.h"
+#include "rd/service.h"
+
+using namespace rd;
+using namespace net::testing;
+
+void init_log() {
+  utils::Log::Instance()->Open("service_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// A directory on the node.
+struct Fixture : SimFixture {
+  explicit Fixture(const DirectoryConfig& config = kDefaultDirectoryConfig)
+    : service(&node, config) {
+    node.Attach(&service);
+  }
+
+  // path and query are '/' and '&' separated.
+  void Request(net::SimTransport& from, coap::Type type, coap::Code code,
+               const std::string& path, const std::string& query = "",
+               const std::string& payload = "",
+               int64_t content_format = -1, int64_t block2 = -1) {
+    coap::Options opts;
+    if (content_format >= 0)
+      assert(opts.AddContentFormat(content_format));
+    if (block2 >= 0)
+      assert(opts.AddBlock2(block2));
+    uint16_t id = mid++;
+    Send(from, Encode(type, code, id, std::string(1, char(mid)), path, query,
+                      payload, opts));
+  }
+
+  Service service;
+};
+
+const char kLinks[] =
+    "</temp>;rt=\"temperature\";if=\"sensor\","
+    "</light>;rt=\"light-lux\";if=\"sensor\"";
+
+void test_ok_register() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd",
+            "ep=node1&d=home&lt=600", kLinks, coap::kLinkFormat);
+  assert(f.alice.got.size() == 1);
+  Response r = f.alice.got[0];
+  assert(r.type == coap::Type::ACK);
+  assert(r.message_id == 1);
+  assert(r.code == coap::Code::Created);
+  assert(r.location.compare(0, 3, "rd/") == 0);
+  assert(f.service.registrations() == 1);
+
+  // The base is where the registration came from.
+  f.Request(f.bt, coap::Type::NON, coap::Code::GET, "rd-lookup/res",
+            "rt=temperature");
+  assert(f.bob.got.size() == 1);
+  assert(f.bob.got[0].type == coap::Type::NON);
+  assert(f.bob.got[0].code == coap::Code::Content);
+  assert(f.bob.got[0].content_format == coap::kLinkFormat);
+  assert(!f.bob.got[0].has_block);
+  assert(f.bob.got[0].payload ==
+         "<coap://10.0.0.2:1000/temp>;rt=\"temperature\";if=\"sensor\";"
+         "anchor=\"coap://10.0.0.2:1000\"");
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/ep",
+            "d=home");
+  assert(f.bob.got[1].payload ==
+         "</" + r.location +
+         ">;ep=\"node1\";d=\"home\";base=\"coap://10.0.0.2:1000\";lt=600");
+
+  // The registration resource.
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, r.location, "rt=light*");
+  assert(f.bob.got[2].payload ==
+         "<coap://10.0.0.2:1000/light>;rt=\"light-lux\";if=\"sensor\";"
+         "anchor=\"coap://10.0.0.2:1000\"");
+
+  // Again: same resource.
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd",
+            "ep=node1&d=home&base=coap://node1", "</x>");
+  assert(f.alice.got[1].code == coap::Code::Changed);
+  assert(f.alice.got[1].location == r.location);
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/res",
+            "ep=node1");
+  assert(f.bob.got[3].payload ==
+         "<coap://node1/x>;anchor=\"coap://node1\"");
+  assert(f.service.lookups() == 4);
+}
+
+void test_ok_update_remove() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd", "ep=n", kLinks);
+  std::string location = f.alice.got[0].location;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, location, "lt=60",
+            "</new>;rt=\"new\"", coap::kLinkFormat);
+  assert(f.alice.got[1].code == coap::Code::Changed);
+  assert(f.service.updates() == 1);
+
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/res",
+            "rt=temperature");
+  assert(f.bob.got[0].payload.empty());
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/ep", "lt=60");
+  assert(f.bob.got[1].payload.find("ep=\"n\"") != std::string::npos);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::DELETE, location);
+  assert(f.alice.got[2].code == coap::Code::Deleted);
+  assert(f.service.directory().registrations() == 0);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::DELETE, location);
+  assert(f.alice.got[3].code == coap::Code::NotFound);
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, location);
+  assert(f.alice.got[4].code == coap::Code::NotFound);
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, location);
+  assert(f.alice.got[5].code == coap::Code::NotFound);
+}
+
+void test_ok_blocks() {
+  Fixture f;
+
+  for (int i = 0; i < 100; ++i)
+    f.Request(f.at, coap::Type::NON, coap::Code::POST, "rd",
+              "ep=node" + std::to_string(i), kLinks);
+  assert(f.service.directory().registrations() == 100);
+
+  Query q;
+  assert(q.Add("if=sensor", 9));
+  std::string all;
+  bool more;
+  f.service.directory().Lookup(LookupKind::resource, q, 0, 1 << 20, all,
+                               more);
+  assert(all.size() > 4 * kBlockSize);
+
+  // No Block2 asked: the first block of kBlockSize.
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/res",
+            "if=sensor");
+  Response first = f.bob.got[0];
+  assert(first.has_block && first.block.num == 0 && first.block.more);
+  assert(first.block.size() == kBlockSize);
+  assert(first.payload == all.substr(0, kBlockSize));
+
+  // The rest, in blocks of 256.
+  std::string joined;
+  for (uint32_t num = 0; ; ++num) {
+    coap::Block block = { num, false, 4 };
+    f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/res",
+              "if=sensor", "", -1, coap::EncodeBlock(block));
+    const Response& r = f.bob.got.back();
+    assert(r.code == coap::Code::Content && r.has_block);
+    assert(r.block.num == num && r.block.szx == 4);
+    joined += r.payload;
+    if (!r.block.more)
+      break;
+    assert(r.payload.size() == 256);
+  }
+  assert(joined == all);
+
+  // Asking for blocks bigger than ours gets ours.
+  coap::Block big = { 1, false, 6 };
+  f.Request(f.bt, coap::Type::CON, coap::Code::GET, "rd-lookup/res",
+            "if=sensor", "", -1, coap::EncodeBlock(big));
+  assert(f.bob.got.back().block.szx == coap::SzxFor(kBlockSize));
+  assert(f.bob.got.back().payload == all.substr(kBlockSize, kBlockSize));
+}
+
+void test_ok_well_known_core() {
+  Fixture f;
+
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, ".well-known/core");
+  assert(f.alice.got[0].code == coap::Code::Content);
+  assert(f.alice.got[0].content_format == coap::kLinkFormat);
+  assert(f.alice.got[0].payload.find("</rd>;rt=\"core.rd\"") == 0);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, ".well-known/core",
+            "rt=core.rd-lookup-*");
+  assert(f.alice.got[1].payload ==
+         "</rd-lookup/ep>;rt=\"core.rd-lookup-ep\";ct=40,"
+         "</rd-lookup/res>;rt=\"core.rd-lookup-res\";ct=40");
+
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, ".well-known/core",
+            "rt=core.rd&ct=40");
+  assert(f.alice.got[2].payload == "</rd>;rt=\"core.rd\";ct=40");
+
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, ".well-known/core",
+            "title=x");
+  assert(f.alice.got[3].payload.empty());
+}
+
+void test_ko_requests() {
+  DirectoryConfig config = kDefaultDirectoryConfig;
+  config.max_registrations = 1;
+  Fixture f(config);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd", "d=x", kLinks);
+  assert(f.alice.got[0].code == coap::Code::BadRequest);
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd", "ep=a&lt=x");
+  assert(f.alice.got[1].code == coap::Code::BadRequest);
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd", "ep=a", "<a",
+            coap::kLinkFormat);
+  assert(f.alice.got[2].code == coap::Code::BadRequest);
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd", "ep=a", "{}", 50);
+  assert(f.alice.got[3].code == coap::Code::UnsupportedContentFormat);
+  f.Request(f.at, coap::Type::CON, coap::Code::PUT, "rd", "ep=a");
+  assert(f.alice.got[4].code == coap::Code::MethodNotAllowed);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd", "ep=a");
+  assert(f.alice.got[5].code == coap::Code::Created);
+  f.Request(f.bt, coap::Type::CON, coap::Code::POST, "rd", "ep=b");
+  assert(f.bob.got[0].code == coap::Code::ServiceUnavailable);
+
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "rd-lookup/res",
+            "page=x");
+  assert(f.alice.got[6].code == coap::Code::BadRequest);
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "rd-lookup/res", "", "",
+            -1, 0x07);
+  assert(f.alice.got[7].code == coap::Code::BadOption);
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "rd-lookup/other");
+  assert(f.alice.got[8].code == coap::Code::NotFound);
+  f.Request(f.at, coap::Type::CON, coap::Code::POST, "rd-lookup/ep");
+  assert(f.alice.got[9].code == coap::Code::MethodNotAllowed);
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "rd/x");
+  assert(f.alice.got[10].code == coap::Code::NotFound);
+  f.Request(f.at, coap::Type::CON, coap::Code::GET, "elsewhere");
+  assert(f.alice.got[11].code == coap::Code::NotFound);
+}
+
+int main() {
+  init_log();
+
+  test_ok_register();
+  test_ok_update_remove();
+  test_ok_blocks();
+  test_ok_well_known_core();
+  test_ko_requests();
+}
@@ -0,0 +1,128 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+
+#include <algorithm>
+#include <system_error>
+
+#include "utils/log.h"
+#include "server/executor.h"
+
+namespace server {
+
+Executor::Executor(size_t nworkers)
+  : next_(0)
+  , pending_(0)
+  , steals_(0)
+  , sleepers_(0)
+  , stopping_(false) {
+  for (size_t i = 0; i < std::max<size_t>(nworkers, 1); ++i)
+    queues_.push_back(new WorkQueue);
+}
+
+Executor::~Executor() {
+  Stop();
+
+  for (auto q : queues_)
+    delete q;
+}
+
+bool Executor::Start() {
+  try {
+    for (size_t i = 0; i < queues_.size(); ++i)
+      threads_.push_back(std::thread(&Executor::Work, this, i));
+  } catch (const std::system_error& e) {
+    utils::Log::Instance()->Debug("executor: %s", e.what());
+    Stop();
+    return false;
+  }
+
+  return true;
+}
+
+void Executor::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(idle_mu_);
+    stopping_ = true;
+  }
+  idle_cv_.notify_all();
+
+  for (auto& t : threads_)
+    t.join();
+  threads_.clear();
+}
+
+void Executor::Submit(Job* job) {
+  size_t i = next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+
+  // Pairs with the sleepers_/pending_ dance in Work(): either the
+  // worker going to sleep sees the job, or we see the sleeper.
+  pending_.fetch_add(1);
+
+  {
+    std::lock_guard<std::mutex> lock(queues_[i]->mu);
+    queues_[i]->jobs.push_back(job);
+  }
+
+  if (sleepers_.load() > 0) {
+    std::lock_guard<std::mutex> lock(idle_mu_);
+    idle_cv_.notify_one();
+  }
+}
+
+Job* Executor::Take(size_t worker) {
+  WorkQueue* q = queues_[worker];
+  std::lock_guard<std::mutex> lock(q->mu);
+
+  if (q->jobs.empty())
+    return nullptr;
+
+  Job* job = q->jobs.front();
+  q->jobs.pop_front();
+  return job;
+}
+
+Job* Executor::Steal(size_t worker) {
+  for (size_t k = 1; k < queues_.size(); ++k) {
+    WorkQueue* q = queues_[(worker + k) % queues_.size()];
+    std::lock_guard<std::mutex> lock(q->mu);
+
+    if (!q->jobs.empty()) {
+      // The back has waited the least: leave the front to the owner.
+      Job* job = q->jobs.back();
+      q->jobs.pop_back();
+      steals_.fetch_add(1, std::memory_order_relaxed);
+      return job;
+    }
+  }
+
+  return nullptr;
+}
+
+void Executor::Work(size_t worker) {
+  for (;;) {
+    Job* job = Take(worker);
+
+    if (!job)
+      job = Steal(worker);
+
+    if (job) {
+      pending_.fetch_sub(1);
+      job->Run(worker);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idle_mu_);
+
+    if (stopping_ && pending_.load() == 0)
+      return;
+
+    sleepers_.fetch_add(1);
+    idle_cv_.wait(lock, [this] {
+      return pending_.load() > 0 || stopping_;
+    });
+    sleepers_.fetch_sub(1);
+  }
+}
+
+}   // namespace server
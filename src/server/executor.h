@@ -0,0 +1,88 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef SERVER_EXECUTOR_H_
+#define SERVER_EXECUTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace server {
+
+// A unit of work for the Executor.
+class Job {
+ public:
+  virtual ~Job() { }
+
+  // Called on one of the executor threads; worker is its index, in
+  // [0, Executor::size()).
+  virtual void Run(size_t worker) = 0;
+};
+
+// A pool of worker threads, each with its own deque of jobs.
+//
+// Submit() spreads jobs round-robin across the deques.  A worker takes
+// jobs from the front of its own deque; when that is empty it steals
+// from the back of somebody else's, so that one slow job only holds up
+// the jobs queued right behind it until another worker gets idle.
+// Workers with nothing to do at all park on a condition variable.
+//
+// Deques are guarded by a mutex each: the only contention is between
+// a submitter, the owner and the occasional thief, which is cheap next
+// to the handlers this is meant for (the cheap ones shouldn't come
+// here in the first place, see Resource::inline_safe()).
+class Executor {
+ public:
+  explicit Executor(size_t nworkers);
+  ~Executor();
+
+  bool Start();
+
+  // Let the workers finish what is queued, then join them.
+  void Stop();
+
+  // Thread safe.  The job must stay alive until it has run.
+  void Submit(Job* job);
+
+  size_t size() const { return queues_.size(); }
+
+  // Jobs submitted but not picked up yet.
+  size_t pending() const { return pending_.load(std::memory_order_relaxed); }
+
+  // Jobs run by a worker other than the one they were queued to.
+  uint64_t steals() const { return steals_.load(std::memory_order_relaxed); }
+
+ private:
+  struct WorkQueue {
+    std::mutex mu;
+    std::deque<Job*> jobs;
+  };
+
+  void Work(size_t worker);
+  Job* Take(size_t worker);
+  Job* Steal(size_t worker);
+
+ private:
+  std::vector<WorkQueue*> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_;
+
+  std::atomic<size_t> pending_;
+  std::atomic<uint64_t> steals_;
+
+  // Parking
+  std::mutex idle_mu_;
+  std::condition_variable idle_cv_;
+  std::atomic<size_t> sleepers_;
+  bool stopping_;
+};
+
+}   // namespace server
+
+#endif  // SERVER_EXECUTOR_H_
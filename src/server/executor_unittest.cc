@@ -0,0 +1,152 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "utils/log.h"
+#include "server/executor.h"
+#include "server/spsc_queue.h"
+
+using namespace server;
+
+void init_log() {
+  utils::Log::Instance()->Open("executor_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+class Counter : public Job {
+ public:
+  explicit Counter(std::atomic<size_t>* count) : count_(count) { }
+  void Run(size_t) { ++*count_; }
+
+ private:
+  std::atomic<size_t>* count_;
+};
+
+// Hold the worker until released.
+class Blocker : public Job {
+ public:
+  Blocker() : running_(false), release_(false) { }
+
+  void Run(size_t) {
+    running_ = true;
+    while (!release_)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::atomic<bool> running_;
+  std::atomic<bool> release_;
+};
+
+void wait_for(const std::atomic<size_t>& count, size_t n) {
+  for (int i = 0; i < 5000 && count < n; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  assert(count == n);
+}
+
+void test_ok_spsc() {
+  SpscQueue<int> q(5);
+  assert(q.capacity() == 8);
+
+  int v;
+  assert(!q.TryPop(v));
+
+  // Go round a few times.
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 8; ++i)
+      assert(q.TryPush(round * 8 + i));
+    assert(!q.TryPush(-1));
+
+    for (int i = 0; i < 8; ++i) {
+      assert(q.TryPop(v));
+      assert(v == round * 8 + i);
+    }
+    assert(!q.TryPop(v));
+  }
+}
+
+void test_ok_spsc_threads() {
+  const size_t n = 1000000;
+  SpscQueue<size_t> q(64);
+
+  std::thread producer([&q, n] {
+    for (size_t i = 0; i < n; ++i)
+      while (!q.TryPush(i))
+        std::this_thread::yield();
+  });
+
+  for (size_t i = 0; i < n; ++i) {
+    size_t v;
+    while (!q.TryPop(v))
+      std::this_thread::yield();
+    assert(v == i);
+  }
+
+  producer.join();
+}
+
+void test_ok_run_all() {
+  const size_t n = 10000;
+  std::atomic<size_t> count(0);
+  Counter job(&count);
+
+  Executor ex(4);
+  assert(ex.size() == 4);
+  assert(ex.Start());
+
+  for (size_t i = 0; i < n; ++i)
+    ex.Submit(&job);
+
+  wait_for(count, n);
+  ex.Stop();
+  assert(ex.pending() == 0);
+}
+
+void test_ok_steal() {
+  std::atomic<size_t> count(0);
+  Counter job(&count);
+  Blocker blocker;
+
+  Executor ex(2);
+  assert(ex.Start());
+
+  // The blocker lands on one worker; everything queued behind it must
+  // be stolen by the other one.
+  ex.Submit(&blocker);
+  while (!blocker.running_)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  for (size_t i = 0; i < 100; ++i)
+    ex.Submit(&job);
+
+  wait_for(count, 100);
+  assert(ex.steals() > 0);
+
+  blocker.release_ = true;
+  ex.Stop();
+}
+
+void test_ok_stop_drains() {
+  std::atomic<size_t> count(0);
+  Counter job(&count);
+
+  Executor ex(1);
+  assert(ex.Start());
+  for (size_t i = 0; i < 1000; ++i)
+    ex.Submit(&job);
+  ex.Stop();
+
+  assert(count == 1000);
+}
+
+int main() {
+  init_log();
+
+  test_ok_spsc();
+  test_ok_spsc_threads();
+  test_ok_run_all();
+  test_ok_steal();
+  test_ok_stop_drains();
+}
@@ -0,0 +1,272 @@
+// Copyleft 2013 tho@autistici.org
+
+// Datagrams and latency of CON requests, with responses always
+// piggybacked (the ACK held however long the handler takes), always
+// separate (an empty ACK right away), or piggybacked within the window
+// adapted to the measured latency (the default).
+//
+// Handlers sleep for as long as each request asks, by distribution:
+// all fast, mostly fast with a slow tail, or all slower than
+// ACK_TIMEOUT.  The client plays by RFC 7252: it retransmits requests
+// nothing has come back for (ACK_TIMEOUT, doubled each time) and
+// acknowledges separate responses.  Every datagram, both ways, is
+// counted up to the last response; so is every handler run,
+// retransmitted requests being run again.
+//
+// Usage: piggyback_bench [requests [per_second]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "server/server.h"
+
+using namespace server;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Sleeps for the milliseconds in the payload.
+class Sleeper : public Resource {
+ public:
+  Sleeper() : runs_(0) { }
+
+  void Handle(const coap::PDUView& req, coap::PDU& rsp) {
+    ++runs_;
+    uint32_t ms = 0;
+    for (size_t i = 0; i < req.payload_size(); ++i)
+      ms = (ms << 8) | req.payload()[i];
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    rsp.set_code(coap::Code::Content);
+  }
+
+  std::atomic<size_t> runs_;
+};
+
+struct Distribution {
+  const char* name;
+  uint32_t fast_ms;
+  uint32_t slow_ms;
+  double slow_share;
+};
+
+struct Result {
+  double datagrams;     // per request, both ways
+  size_t retransmits;   // of requests, by the client
+  size_t runs;          // of the handler
+  size_t lost;
+  double p50_ms;
+  double p99_ms;
+};
+
+struct Exchange {
+  std::vector<uint8_t> req;
+  Clock::time_point sent_at;
+  Clock::time_point retransmit_at;
+  std::chrono::milliseconds timeout;
+  unsigned retransmits;
+  bool acked;
+  bool done;
+};
+
+std::vector<uint8_t> request(uint16_t id, uint32_t ms) {
+  coap::PDU pdu;
+  pdu.set_type(coap::Type::CON);
+  pdu.set_code(coap::Code::GET);
+  pdu.set_message_id(id);
+  pdu.set_token({ uint8_t(id >> 8), uint8_t(id) });
+  coap::Options opts;
+  opts.AddUriPath("sleep");
+  pdu.set_options(opts);
+  pdu.set_payload({ uint8_t(ms >> 8), uint8_t(ms) });
+
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+double percentile(std::vector<double>& v, double p) {
+  if (v.empty())
+    return 0;
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+Result run(const Distribution& dist, const Piggyback& policy, size_t n,
+           double per_second) {
+  std::unique_ptr<net::Transport> transport(
+      net::NewTransport(net::Backend::any));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(transport->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+  socklen_t len = sizeof addr;
+  assert(getsockname(transport->fd(), reinterpret_cast<sockaddr*>(&addr),
+                     &len) == 0);
+
+  // Sleepers, not spinners: enough threads for all of them at once.
+  Executor executor(128);
+  assert(executor.Start());
+  Sleeper sleeper;
+  Server server(transport.get(), &executor);
+  server.Add("sleep", &sleeper);
+  server.set_piggyback(policy);
+  // Slow handlers aren't overload here.
+  LoadShedding never = { kMaxInProgress + 1, kMaxInProgress, UINT32_MAX };
+  server.set_load_shedding(never);
+
+  std::atomic<bool> stop(false);
+  std::thread io([&] {
+    while (!stop)
+      server.RunOnce(5);
+  });
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(connect(fd, reinterpret_cast<const sockaddr*>(&addr),
+                 sizeof addr) == 0);
+
+  std::mt19937 rng(7);
+  std::bernoulli_distribution slow(dist.slow_share);
+  std::uniform_real_distribution<double> factor(1, kAckRandomFactor);
+
+  std::vector<Exchange> ex(n);
+  for (size_t i = 0; i < n; ++i) {
+    ex[i].req = request(i, slow(rng) ? dist.slow_ms : dist.fast_ms);
+    ex[i].retransmits = 0;
+    ex[i].acked = ex[i].done = false;
+  }
+
+  size_t datagrams = 0, retransmits = 0, next = 0, done = 0;
+  std::vector<double> ms;
+  Clock::time_point start = Clock::now();
+  Clock::time_point give_up = start + std::chrono::seconds(30);
+
+  while (done < n && Clock::now() < give_up) {
+    Clock::time_point now = Clock::now();
+
+    // Requests, on schedule.
+    while (next < n && now >= start + std::chrono::microseconds(
+               static_cast<int64_t>(next * 1e6 / per_second))) {
+      Exchange& e = ex[next++];
+      e.sent_at = now;
+      e.timeout = std::chrono::milliseconds(
+          static_cast<int>(kAckTimeoutMs * factor(rng)));
+      e.retransmit_at = now + e.timeout;
+      send(fd, e.req.data(), e.req.size(), 0);
+      ++datagrams;
+    }
+
+    // Retransmissions.
+    for (size_t i = 0; i < next; ++i) {
+      Exchange& e = ex[i];
+      if (e.acked || e.done || now < e.retransmit_at)
+        continue;
+      if (e.retransmits == kMaxRetransmit) {
+        e.done = true;
+        ++done;
+        continue;
+      }
+      ++e.retransmits;
+      e.timeout *= 2;
+      e.retransmit_at = now + e.timeout;
+      send(fd, e.req.data(), e.req.size(), 0);
+      ++datagrams;
+      ++retransmits;
+    }
+
+    uint8_t buf[net::kMaxDatagramSize];
+    ssize_t got = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+    if (got < 4) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+      continue;
+    }
+    ++datagrams;
+
+    unsigned type = (buf[0] >> 4) & 0x03;
+    uint16_t mid = (buf[2] << 8) | buf[3];
+
+    if (buf[1] == coap::Code::Empty) {
+      if (type == coap::Type::ACK && mid < n)
+        ex[mid].acked = true;
+      continue;
+    }
+
+    if (type == coap::Type::CON) {
+      uint8_t ack[4] = { 0x60, 0x00, buf[2], buf[3] };
+      send(fd, ack, sizeof ack, 0);
+      ++datagrams;
+    }
+
+    if (got < 6 || (buf[0] & 0x0F) != 2 || buf[1] != coap::Code::Content)
+      continue;
+    uint16_t id = (buf[4] << 8) | buf[5];
+    if (id < n && !ex[id].done) {
+      ex[id].done = true;
+      ++done;
+      ms.push_back(std::chrono::duration<double, std::milli>(
+          Clock::now() - ex[id].sent_at).count());
+    }
+  }
+  close(fd);
+
+  stop = true;
+  transport->Wake();
+  io.join();
+
+  Result r;
+  r.datagrams = static_cast<double>(datagrams) / n;
+  r.retransmits = retransmits;
+  r.runs = sleeper.runs_;
+  r.lost = n - ms.size();
+  r.p50_ms = percentile(ms, 0.5);
+  r.p99_ms = percentile(ms, 0.99);
+  return r;
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100;
+  double per_second = argc > 2 ? atof(argv[2]) : 50;
+
+  const Distribution dists[] = {
+    { "fast", 5, 5, 0 },
+    { "tail", 5, 1500, 0.1 },
+    { "slow", 3000, 3000, 1 },
+  };
+
+  struct {
+    const char* name;
+    Piggyback policy;
+  } modes[] = {
+    { "piggyback", kAlwaysPiggyback },
+    { "separate", { 0, 0 } },
+    { "adaptive", kDefaultPiggyback },
+  };
+
+  printf("%zu CON requests at %.0f/s\n", n, per_second);
+  printf("%-5s %-10s %10s %8s %6s %5s %8s %8s\n", "dist", "mode",
+         "dgrams/req", "retrans", "runs", "lost", "p50 ms", "p99 ms");
+
+  for (const Distribution& dist : dists) {
+    for (const auto& mode : modes) {
+      Result r = run(dist, mode.policy, n, per_second);
+      printf("%-5s %-10s %10.2f %8zu %6zu %5zu %8.1f %8.1f\n", dist.name,
+             mode.name, r.datagrams, r.retransmits, r.runs, r.lost,
+             r.p50_ms, r.p99_ms);
+    }
+  }
+}
@@ -0,0 +1,234 @@
+// Copyleft 2013 tho@autistici.org
+
+// CON latency under a flood of NONs, first come first served against
+// the default priorities.
+//
+// The server's only resource burns service_us of CPU per request, on
+// an executor of `workers` threads, with load shedding off so that
+// everything queues.  One client floods it with NONs at `load` times
+// its nominal capacity (workers / service_us) while another sends a
+// CON every 5 ms and times the responses.  CONs that get none within
+// a second count as lost: the peer would have retransmitted by then.
+//
+// Usage: priority_bench [service_us [workers [seconds [load]]]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "server/server.h"
+
+using namespace server;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+class Work : public Resource {
+ public:
+  explicit Work(int us) : us_(us) { }
+
+  void Handle(const coap::PDUView&, coap::PDU& rsp) {
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us_);
+    while (Clock::now() < until) { }
+    rsp.set_code(coap::Code::Content);
+  }
+
+ private:
+  int us_;
+};
+
+struct Params {
+  int service_us;
+  size_t workers;
+  double seconds;
+  double load;
+};
+
+struct Result {
+  size_t sent;
+  size_t answered;
+  double p50_ms;
+  double p99_ms;
+  double max_ms;
+  double non_per_s;     // NONs served
+  uint64_t preempted;
+};
+
+std::vector<uint8_t> request(coap::Type type) {
+  coap::PDU pdu;
+  pdu.set_type(type);
+  pdu.set_code(coap::Code::GET);
+  pdu.set_token({ 0, 0, 0, 0 });
+  coap::Options opts;
+  opts.AddUriPath("work");
+  pdu.set_options(opts);
+
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+void stamp(std::vector<uint8_t>& req, uint32_t seq) {
+  req[2] = seq >> 8;
+  req[3] = seq;
+  req[4] = seq >> 24;
+  req[5] = seq >> 16;
+  req[6] = seq >> 8;
+  req[7] = seq;
+}
+
+int client_socket(const sockaddr_in& addr) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(fd != -1);
+  assert(connect(fd, reinterpret_cast<const sockaddr*>(&addr),
+                 sizeof addr) == 0);
+  timeval tv = { 0, 10000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  return fd;
+}
+
+double percentile(std::vector<double>& v, double p) {
+  if (v.empty())
+    return 0;
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+Result run(const Params& params, const Priorities& priorities) {
+  std::unique_ptr<net::Transport> transport(
+      net::NewTransport(net::Backend::any));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(transport->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+  socklen_t len = sizeof addr;
+  assert(getsockname(transport->fd(), reinterpret_cast<sockaddr*>(&addr),
+                     &len) == 0);
+
+  Executor executor(params.workers);
+  assert(executor.Start());
+  Work work(params.service_us);
+  Server server(transport.get(), &executor);
+  server.Add("work", &work);
+  LoadShedding never = { kMaxInProgress + 1, kMaxInProgress, UINT32_MAX };
+  server.set_load_shedding(never);
+  server.set_priorities(priorities);
+
+  std::atomic<bool> stop(false);
+  std::thread io([&] {
+    while (!stop)
+      server.RunOnce(10);
+  });
+
+  double rate = params.load * params.workers * 1e6 / params.service_us;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(params.seconds));
+
+  std::thread flood([&] {
+    int fd = client_socket(addr);
+    std::vector<uint8_t> req = request(coap::Type::NON);
+    size_t sent = 0;
+
+    // A millisecond's worth at a time.
+    for (Clock::time_point t = start; t < end;
+         t += std::chrono::milliseconds(1)) {
+      std::this_thread::sleep_until(t);
+      double due = rate * std::chrono::duration<double>(t - start).count();
+      for (; sent < due; ++sent) {
+        stamp(req, sent);
+        send(fd, req.data(), req.size(), 0);
+      }
+    }
+    close(fd);
+  });
+
+  int fd = client_socket(addr);
+  std::vector<uint8_t> req = request(coap::Type::CON);
+  std::vector<Clock::time_point> sent_at;
+  std::vector<double> ms;
+  Clock::time_point next = start;
+
+  // Until a second after the last CON.
+  while (Clock::now() < end + std::chrono::seconds(1)) {
+    if (Clock::now() >= next && Clock::now() < end) {
+      stamp(req, sent_at.size());
+      sent_at.push_back(Clock::now());
+      send(fd, req.data(), req.size(), 0);
+      next += std::chrono::milliseconds(5);
+    }
+
+    uint8_t buf[net::kMaxDatagramSize];
+    ssize_t n = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+    if (n < 8) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      continue;
+    }
+
+    uint32_t seq = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+    double t = std::chrono::duration<double, std::milli>(
+        Clock::now() - sent_at[seq]).count();
+    if (t <= 1000)
+      ms.push_back(t);
+  }
+  close(fd);
+
+  flood.join();
+  stop = true;
+  transport->Wake();
+  io.join();
+
+  Result r;
+  r.sent = sent_at.size();
+  r.answered = ms.size();
+  r.p50_ms = percentile(ms, 0.5);
+  r.p99_ms = percentile(ms, 0.99);
+  r.max_ms = ms.empty() ? 0 : *std::max_element(ms.begin(), ms.end());
+  r.non_per_s = (server.offloaded() - server.queued() - ms.size()) /
+                (params.seconds + 1);
+  r.preempted = server.preempted();
+  return r;
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  Params params;
+  params.service_us = argc > 1 ? atoi(argv[1]) : 200;
+  params.workers = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1;
+  params.seconds = argc > 3 ? atof(argv[3]) : 2;
+  params.load = argc > 4 ? atof(argv[4]) : 2;
+
+  printf("service %d us, %zu workers, NONs at %.1fx capacity for %.1f s\n",
+         params.service_us, params.workers, params.load, params.seconds);
+  printf("%-12s %6s %9s %8s %8s %8s %8s %10s\n", "dispatch", "CONs",
+         "answered", "p50 ms", "p99 ms", "max ms", "NON/s", "preempted");
+
+  struct {
+    const char* name;
+    Priorities priorities;
+  } modes[] = {
+    { "fcfs", kFirstComeFirstServed },
+    { "priorities", kDefaultPriorities },
+  };
+
+  for (const auto& mode : modes) {
+    Result r = run(params, mode.priorities);
+    printf("%-12s %6zu %9zu %8.1f %8.1f %8.1f %8.0f %10llu\n", mode.name,
+           r.sent, r.answered, r.p50_ms, r.p99_ms, r.max_ms, r.non_per_s,
+           static_cast<unsigned long long>(r.preempted));
+  }
+}
@@ -0,0 +1,200 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <netinet/in.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+
+#include "server/rate_limiter.h"
+
+namespace server {
+
+namespace {
+
+const uint32_t kToken = 1000;       // in thousandths
+const uint16_t kSaturated = 0xFFFF;
+
+}   // namespace
+
+RateLimiter::RateLimiter(const RateLimit& policy)
+  : policy_(policy)
+  , sketch_(kSketchDepth * (kSketchWidth + 32))
+  , buckets_(kMaxHeavyHitters)
+  , window_start_(0)
+  , flagged_(0)
+  , limited_(0) {
+  // The counters saturate.
+  policy_.threshold = std::min<uint32_t>(policy_.threshold, kSaturated);
+  policy_.window_ms = std::max<uint32_t>(policy_.window_ms, 1);
+
+  std::random_device rd;
+  seed_ = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+  memset(buckets_.data(), 0, buckets_.size() * sizeof buckets_[0]);
+}
+
+Limit RateLimiter::Check(const sockaddr* peer, socklen_t peer_len,
+                         uint64_t now_ms) {
+  if (now_ms - window_start_ >= policy_.window_ms)
+    Decay(now_ms);
+
+  uint64_t key = Hash(peer, peer_len);
+  if (!key)
+    return Limit::pass;
+
+  uint32_t now = static_cast<uint32_t>(now_ms);
+  Bucket* bucket = Find(key);
+
+  if (!bucket) {
+    if (Count(key) < policy_.threshold)
+      return Limit::pass;
+
+    bucket = Victim(key, now);
+    bucket->key = key;
+    bucket->tokens = 0;
+    bucket->last_ms = now;
+    ++flagged_;
+  }
+
+  if (Take(bucket, now))
+    return Limit::pass;
+
+  ++limited_;
+  return policy_.reset ? Limit::reset : Limit::drop;
+}
+
+uint32_t RateLimiter::Estimate(const sockaddr* peer,
+                               socklen_t peer_len) const {
+  uint64_t key = Hash(peer, peer_len);
+  if (!key)
+    return 0;
+
+  uint16_t min = kSaturated;
+  for (size_t row = 0; row < kSketchDepth; ++row)
+    min = std::min(min, sketch_[Counter(key, row)]);
+  return min;
+}
+
+size_t RateLimiter::heavy_hitters() const {
+  size_t n = 0;
+  for (const Bucket& b : buckets_)
+    n += b.key != 0;
+  return n;
+}
+
+// Seeded hash of the address alone (of its /64 prefix for native
+// IPv6), never 0.  IPv4-mapped addresses, as a dual-stack socket gets
+// them, hash as the IPv4 address they carry.
+uint64_t RateLimiter::Hash(const sockaddr* peer, socklen_t peer_len) const {
+  uint64_t a = 0, b = 0;
+
+  if (peer->sa_family == AF_INET && peer_len >= sizeof(sockaddr_in)) {
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(peer);
+    uint32_t addr;
+    memcpy(&addr, &sin->sin_addr, sizeof addr);
+    a = addr;
+  } else if (peer->sa_family == AF_INET6 &&
+             peer_len >= sizeof(sockaddr_in6)) {
+    const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(peer);
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+      uint32_t addr;
+      memcpy(&addr, sin6->sin6_addr.s6_addr + 12, sizeof addr);
+      a = addr;
+    } else {
+      // The /64 prefix: a host is free to pick the rest.
+      memcpy(&a, &sin6->sin6_addr, 8);
+      b = AF_INET6;
+    }
+  } else {
+    return 0;
+  }
+
+  uint64_t h = (seed_ ^ a) * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 32;
+  h ^= b;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 29;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 32;
+
+  return h ? h : 1;
+}
+
+// Count key in, with the conservative update (only the counters at the
+// minimum go up), and return its estimate.
+uint32_t RateLimiter::Count(uint64_t key) {
+  uint16_t* c[kSketchDepth];
+  uint16_t min = kSaturated;
+
+  for (size_t row = 0; row < kSketchDepth; ++row) {
+    c[row] = &sketch_[Counter(key, row)];
+    min = std::min(min, *c[row]);
+  }
+
+  if (min == kSaturated)
+    return min;
+
+  ++min;
+  for (size_t row = 0; row < kSketchDepth; ++row)
+    *c[row] = std::max(*c[row], min);
+  return min;
+}
+
+// Halve the counters once per window gone by.
+void RateLimiter::Decay(uint64_t now_ms) {
+  uint64_t windows = (now_ms - window_start_) / policy_.window_ms;
+  window_start_ = now_ms;
+
+  if (windows >= 16) {
+    std::fill(sketch_.begin(), sketch_.end(), 0);
+    return;
+  }
+
+  for (uint16_t& c : sketch_)
+    c >>= windows;
+}
+
+RateLimiter::Bucket* RateLimiter::Find(uint64_t key) {
+  Bucket* set = Set(key);
+
+  // Not there, most of the time: no early exit to mispredict.
+  size_t found = kWays;
+  for (size_t i = 0; i < kWays; ++i)
+    found = set[i].key == key ? i : found;
+
+  return found < kWays ? &set[found] : nullptr;
+}
+
+// The bucket to give key: a free way of its set, or else the least
+// recently seen.
+RateLimiter::Bucket* RateLimiter::Victim(uint64_t key, uint32_t now) {
+  Bucket* set = Set(key);
+  Bucket* victim = set;
+
+  for (size_t i = 0; i < kWays; ++i) {
+    if (!set[i].key)
+      return &set[i];
+    if (now - set[i].last_ms > now - victim->last_ms)
+      victim = &set[i];
+  }
+
+  return victim;
+}
+
+bool RateLimiter::Take(Bucket* bucket, uint32_t now) {
+  uint64_t tokens = bucket->tokens +
+                    static_cast<uint64_t>(now - bucket->last_ms) *
+                    policy_.rate;
+  bucket->tokens = std::min<uint64_t>(tokens,
+                                      uint64_t(policy_.burst) * kToken);
+  bucket->last_ms = now;
+
+  if (bucket->tokens < kToken)
+    return false;
+
+  bucket->tokens -= kToken;
+  return true;
+}
+
+}   // namespace server
@@ -0,0 +1,128 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef SERVER_RATE_LIMITER_H_
+#define SERVER_RATE_LIMITER_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+namespace server {
+
+// What to do with a datagram, according to RateLimiter::Check().
+enum class Limit : uint8_t {
+  pass,
+  drop,
+  reset     // over the limit, and the policy says to RST confirmables
+};
+
+// Who gets rate limited, and how much.  A source (an IPv4 address,
+// IPv4-mapped ones included, or an IPv6 /64 prefix: the port, and the
+// rest of an IPv6 address, are left out so that they can't be changed
+// to dodge the limit) is a heavy hitter once its count of datagrams,
+// halved every window_ms, reaches threshold (at a steady rate,
+// threshold / 2 per window will do); from then on it gets a token
+// bucket of burst datagrams, refilled at rate per second and empty to
+// start with: what it sent up to the threshold was its burst.
+// Datagrams over it are dropped, or CONs answered with a RST if reset
+// is set, so that the peer gives up on them rather than
+// retransmitting.
+struct RateLimit {
+  uint32_t threshold;
+  uint32_t window_ms;
+  uint32_t rate;
+  uint32_t burst;
+  bool reset;
+};
+
+const RateLimit kDefaultRateLimit = { 1000, 1000, 500, 100, false };
+
+// Ingress rate limiter, to be run on datagrams before anything is
+// decoded, in constant memory whatever the number of sources:
+//
+//  - datagrams from sources without a bucket are counted in a
+//    count-min sketch (kSketchDepth rows of kSketchWidth saturating
+//    counters, conservative update), halved every window_ms so that it
+//    forgets;
+//  - a source whose estimate reaches threshold goes into a table of
+//    kMaxHeavyHitters token buckets (4-way set associative, the least
+//    recently seen way evicted), and only those are limited.
+//
+// Everyone else costs a hash and kSketchDepth counter updates, all in
+// 48 KB.  A source evicted comes back with an empty bucket, so that
+// heavy hitters fighting over a set gain nothing by it.  Count-min
+// estimates only ever err upwards: a light source sharing counters
+// with heavy ones may get a bucket too, but is then held to the rate,
+// which it keeps to anyway.  Sources are hashed with a random seed, so
+// that they can't be picked to collide.
+//
+// Not thread safe: one per I/O thread.
+class RateLimiter {
+ public:
+  static const size_t kSketchDepth = 4;
+  static const size_t kSketchWidth = 4096;
+  static const size_t kMaxHeavyHitters = 1024;
+
+  explicit RateLimiter(const RateLimit& policy = kDefaultRateLimit);
+
+  // Count a datagram from peer, received at now_ms (any monotonic
+  // clock), and say whether it is over its source's limit.  Unsupported
+  // address families pass.
+  Limit Check(const sockaddr* peer, socklen_t peer_len, uint64_t now_ms);
+
+  const RateLimit& policy() const { return policy_; }
+
+  // How many times the source of peer was counted, give or take the
+  // decay (an overestimate).  Sources with a bucket aren't counted.
+  uint32_t Estimate(const sockaddr* peer, socklen_t peer_len) const;
+
+  // Sources with a bucket now.
+  size_t heavy_hitters() const;
+
+  // Counters
+  uint64_t flagged() const { return flagged_; }   // buckets handed out
+  uint64_t limited() const { return limited_; }   // datagrams not passed
+
+ private:
+  struct Bucket {
+    uint64_t key;         // 0 if free
+    uint32_t tokens;      // thousandths
+    uint32_t last_ms;
+  };
+
+  static const size_t kWays = 4;
+
+  uint64_t Hash(const sockaddr* peer, socklen_t peer_len) const;
+  uint32_t Count(uint64_t key);
+  void Decay(uint64_t now_ms);
+  Bucket* Find(uint64_t key);
+  Bucket* Victim(uint64_t key, uint32_t now);
+  bool Take(Bucket* bucket, uint32_t now);
+
+  Bucket* Set(uint64_t key) {
+    return &buckets_[((key >> 48) % (kMaxHeavyHitters / kWays)) * kWays];
+  }
+
+  // Index of the counter of key in row.  Rows are a cache line more
+  // than 8 KB apart, or loads from one would wait on stores to another
+  // at the same offset (4K aliasing).
+  static size_t Counter(uint64_t key, size_t row) {
+    return row * (kSketchWidth + 32) +
+           ((key >> (row * 12)) & (kSketchWidth - 1));
+  }
+
+ private:
+  RateLimit policy_;
+  uint64_t seed_;
+  std::vector<uint16_t> sketch_;    // kSketchDepth rows, padded
+  std::vector<Bucket> buckets_;     // sets of kWays
+  uint64_t window_start_;
+
+  uint64_t flagged_;
+  uint64_t limited_;
+};
+
+}   // namespace server
+
+#endif  // SERVER_RATE_LIMITER_H_
@@ -0,0 +1,234 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "utils/log.h"
+#include "server/rate_limiter.h"
+
+using namespace server;
+
+void init_log() {
+  utils::Log::Instance()->Open("rate_limiter_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+sockaddr_in source(uint32_t n, uint16_t port = 5683) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x0A000000 | n);
+  sin.sin_port = htons(port);
+  return sin;
+}
+
+const sockaddr* sa(const sockaddr_in& sin) {
+  return reinterpret_cast<const sockaddr*>(&sin);
+}
+
+Limit check(RateLimiter& rl, const sockaddr_in& sin, uint64_t now_ms) {
+  return rl.Check(sa(sin), sizeof sin, now_ms);
+}
+
+void test_ok_light_sources_pass() {
+  RateLimiter rl;
+
+  // 10000 sources, 100 datagrams each in a second.
+  for (uint64_t ms = 0; ms < 1000; ++ms) {
+    for (uint32_t i = 0; i < 1000; ++i)
+      assert(check(rl, source(ms % 10 * 1000 + i), ms) == Limit::pass);
+  }
+  assert(rl.flagged() == 0 && rl.limited() == 0);
+  assert(rl.heavy_hitters() == 0);
+}
+
+void test_ok_bucket() {
+  RateLimit policy = { 10, 1000, 500, 20, false };
+  RateLimiter rl(policy);
+  sockaddr_in peer = source(1);
+
+  // Counted up to the threshold, then the bucket starts empty.
+  for (int i = 0; i < 9; ++i)
+    assert(check(rl, peer, 0) == Limit::pass);
+  assert(check(rl, peer, 0) == Limit::drop);
+  assert(rl.flagged() == 1 && rl.heavy_hitters() == 1);
+
+  // The port makes no difference, the clock does: 500/s is 5 in 10 ms.
+  for (uint16_t port = 1; port <= 5; ++port)
+    assert(check(rl, source(1, port), 10) == Limit::pass);
+  assert(check(rl, peer, 10) == Limit::drop);
+  assert(rl.limited() == 2);
+
+  // Up to the burst, however long it has been.
+  for (int i = 0; i < 20; ++i)
+    assert(check(rl, peer, 500) == Limit::pass);
+  assert(check(rl, peer, 500) == Limit::drop);
+
+  // Another source is untouched.
+  assert(check(rl, source(2), 500) == Limit::pass);
+  assert(rl.heavy_hitters() == 1);
+}
+
+void test_ok_reset_and_families() {
+  RateLimit policy = { 2, 1000, 0, 1, true };
+  RateLimiter rl(policy);
+
+  sockaddr_in6 sin6;
+  memset(&sin6, 0, sizeof sin6);
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_addr.s6_addr[15] = 1;
+  const sockaddr* peer = reinterpret_cast<const sockaddr*>(&sin6);
+
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::pass);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::reset);
+  assert(rl.Check(peer, sizeof sin6, 5000) == Limit::reset);
+
+  // Nothing to key unknown families (or short addresses) by.
+  sockaddr unix_peer;
+  memset(&unix_peer, 0, sizeof unix_peer);
+  unix_peer.sa_family = AF_UNIX;
+  for (int i = 0; i < 10; ++i)
+    assert(rl.Check(&unix_peer, sizeof unix_peer, 0) == Limit::pass);
+  assert(rl.Check(peer, sizeof(sockaddr_in), 0) == Limit::pass);
+}
+
+void test_ok_ipv6_prefix() {
+  RateLimit policy = { 2, 1000, 0, 1, false };
+  RateLimiter rl(policy);
+
+  sockaddr_in6 sin6;
+  memset(&sin6, 0, sizeof sin6);
+  sin6.sin6_family = AF_INET6;
+  assert(inet_pton(AF_INET6, "2001:db8:0:1::1", &sin6.sin6_addr) == 1);
+  const sockaddr* peer = reinterpret_cast<const sockaddr*>(&sin6);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::pass);
+
+  // Another address of the same /64 shares the count and the bucket.
+  assert(inet_pton(AF_INET6, "2001:db8:0:1:dead:beef:1:2",
+                   &sin6.sin6_addr) == 1);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::drop);
+  assert(rl.heavy_hitters() == 1);
+
+  // The next /64 does not.
+  assert(inet_pton(AF_INET6, "2001:db8:0:2::1", &sin6.sin6_addr) == 1);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::pass);
+  assert(rl.heavy_hitters() == 1);
+}
+
+void test_ok_ipv4_mapped() {
+  RateLimit policy = { 2, 1000, 0, 1, false };
+  RateLimiter rl(policy);
+
+  // IPv4 clients of a dual-stack socket: one of them heavy.
+  sockaddr_in6 sin6;
+  memset(&sin6, 0, sizeof sin6);
+  sin6.sin6_family = AF_INET6;
+  assert(inet_pton(AF_INET6, "::ffff:10.0.0.1", &sin6.sin6_addr) == 1);
+  const sockaddr* peer = reinterpret_cast<const sockaddr*>(&sin6);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::pass);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::drop);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::drop);
+
+  // Another is not throttled with it.
+  assert(inet_pton(AF_INET6, "::ffff:10.0.0.2", &sin6.sin6_addr) == 1);
+  assert(rl.Check(peer, sizeof sin6, 0) == Limit::pass);
+  assert(rl.heavy_hitters() == 1);
+
+  // Keyed as over AF_INET.
+  assert(check(rl, source(1), 0) == Limit::drop);
+  assert(check(rl, source(2), 0) == Limit::drop);
+  assert(rl.heavy_hitters() == 2);
+}
+
+void test_ok_decay() {
+  RateLimit policy = { 100, 100, 1000, 10, false };
+  RateLimiter rl(policy);
+  sockaddr_in peer = source(7);
+
+  // 40 a window stays under 100, halved every window.
+  for (uint64_t ms = 0; ms < 10000; ms += 2) {
+    if (ms % 100 < 80)
+      assert(check(rl, peer, ms) == Limit::pass);
+  }
+  assert(rl.Estimate(sa(peer), sizeof peer) < 100);
+  assert(rl.flagged() == 0);
+
+  // Long gone, forgotten.
+  assert(check(rl, peer, 20000) == Limit::pass);
+  assert(rl.Estimate(sa(peer), sizeof peer) == 1);
+}
+
+// 2 million datagrams over 2 s from 10000 sources, by a Zipf law with
+// exponent 1.2: the top source sends about a fifth of them, the top 60
+// way over their limit (about 2000), most send a handful.
+void test_ok_skewed() {
+  const size_t kSources = 10000;
+  const size_t kPerMs = 1000;
+  const uint64_t kMs = 2000;
+  RateLimit policy = { 1000, 1000, 500, 100, false };
+  RateLimiter rl(policy);
+
+  std::vector<double> cdf(kSources);
+  double sum = 0;
+  for (size_t k = 0; k < kSources; ++k)
+    cdf[k] = sum += 1 / std::pow(k + 1, 1.2);
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> u(0, sum);
+
+  std::vector<sockaddr_in> peers(kSources);
+  for (size_t k = 0; k < kSources; ++k)
+    peers[k] = source(k, 1024 + k);
+
+  std::vector<uint64_t> sent(kSources), passed(kSources);
+  for (uint64_t ms = 0; ms < kMs; ++ms) {
+    for (size_t i = 0; i < kPerMs; ++i) {
+      size_t k = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) -
+                 cdf.begin();
+      ++sent[k];
+      if (check(rl, peers[k], ms) == Limit::pass)
+        ++passed[k];
+    }
+  }
+
+  // Worst case for a heavy hitter: counted up to twice the threshold
+  // (the decay), then the rate.
+  const uint64_t allowed = 2 * policy.threshold + policy.rate * kMs / 1000;
+  uint64_t heavy = 0, light = 0, heavy_sent = 0;
+
+  for (size_t k = 0; k < kSources; ++k) {
+    if (sent[k] > allowed) {
+      assert(passed[k] <= allowed);
+      ++heavy;
+      heavy_sent += sent[k];
+    } else if (sent[k] < policy.rate * kMs / 2000) {
+      // Well under the rate: never limited.
+      assert(passed[k] == sent[k]);
+      ++light;
+    }
+  }
+
+  assert(heavy >= 40 && heavy <= kSources / 100);
+  assert(light >= kSources * 9 / 10);
+  assert(rl.flagged() < RateLimiter::kMaxHeavyHitters);
+  // Most of the flood was turned away.
+  assert(rl.limited() > heavy_sent * 3 / 4);
+}
+
+int main() {
+  init_log();
+
+  test_ok_light_sources_pass();
+  test_ok_bucket();
+  test_ok_reset_and_families();
+  test_ok_ipv6_prefix();
+  test_ok_ipv4_mapped();
+  test_ok_decay();
+  test_ok_skewed();
+}
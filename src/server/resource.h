@@ -0,0 +1,37 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef SERVER_RESOURCE_H_
+#define SERVER_RESOURCE_H_
+
+#include "coap/pdu.h"
+#include "coap/view.h"
+
+namespace server {
+
+// Application logic behind a Uri-Path.
+class Resource {
+ public:
+  virtual ~Resource() { }
+
+  // Fill in the code, options and payload of rsp for req.  Type,
+  // message ID and token of rsp are already set by the server and must
+  // be left alone.  A response without a response code goes out as a
+  // 5.00 (Internal Server Error).
+  //
+  // Unless inline_safe(), this is called on an executor thread, and
+  // possibly on several of them at the same time.
+  virtual void Handle(const coap::PDUView& req, coap::PDU& rsp) = 0;
+
+  // Handlers that are quick and never block can say so: they are run
+  // straight on the I/O thread, which saves two queue hops and a
+  // wake up.
+  virtual bool inline_safe() const { return false; }
+
+  // Requests to bulk resources (telemetry uploads, say) wait behind the
+  // others for the executor, confirmable or not (see Lane).
+  virtual bool bulk() const { return false; }
+};
+
+}   // namespace server
+
+#endif  // SERVER_RESOURCE_H_
@@ -0,0 +1,863 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include "utils/log.h"
+#include "coap/header.h"
+#include "coap/prevalidate.h"
+#include "coap/registry.h"
+#include "server/server.h"
+
+namespace server {
+
+namespace {
+
+const char kWellKnownCore[] = ".well-known/core";
+
+// For queueing and rate limiting, where a few ms don't matter.
+uint64_t CoarseNowMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+uint64_t NowUs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Run resource on req and encode its response to out.  type and
+// message_id are those of the response.
+void Respond(Resource* resource, const coap::PDUView& req,
+             coap::Type type, uint16_t message_id,
+             std::vector<uint8_t>& out) {
+  coap::PDU rsp;
+  rsp.set_type(type);
+  rsp.set_message_id(message_id);
+  rsp.set_token(std::vector<uint8_t>(req.token(),
+                                     req.token() + req.token_length()));
+  rsp.set_code(coap::Code::InternalServerError);
+
+  if (resource)
+    resource->Handle(req, rsp);
+  else
+    rsp.set_code(coap::Code::NotFound);
+
+  if (static_cast<int>(rsp.code()) < coap::CodeBlocks::RespSuccessMin)
+    rsp.set_code(coap::Code::InternalServerError);
+
+  out.clear();
+  if (rsp.Encode(out))
+    return;
+
+  // Whatever the handler put in doesn't fit: send the bare header.
+  utils::Log::Instance()->Debug("response encoding failed, sending 5.00");
+  out.clear();
+  coap::PDU err;
+  err.set_type(type);
+  err.set_message_id(message_id);
+  err.set_token(std::vector<uint8_t>(req.token(),
+                                     req.token() + req.token_length()));
+  err.set_code(coap::Code::InternalServerError);
+  err.Encode(out);
+}
+
+}   // namespace
+
+// A request on its way through the executor.  The datagram is copied
+// in, since the transport recycles its buffer as soon as OnDatagram
+// returns.
+class Server::Call : public Job {
+ public:
+  // Where a CON request's ACK is at (I/O thread only).
+  enum class Ack : uint8_t {
+    none,     // NON request
+    held,     // for the response to piggyback on
+    sent,     // empty: the response goes separate
+    awaited   // separate response sent, ACK awaited
+  };
+
+  explicit Call(Server* server)
+    : server_(server)
+    , resource_(nullptr)
+    , size_(0)
+    , peer_len_(0)
+    , type_(coap::Type::ACK)
+    , message_id_(0)
+    , lane_(Lane::confirmable)
+    , queued_ms_(0)
+    , ack_(Ack::none)
+    , serial_(0)
+    , dispatched_us_(0)
+    , retransmits_(0)
+    , timeout_ms_(0)
+    , retransmit_at_ms_(0)
+    , service_us_(0)
+  { }
+
+  void Run(size_t worker) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    coap::PDUView req;
+
+    // Validated by the I/O thread already, this only finds the offsets.
+    if (req.Decode(data_, size_))
+      Respond(resource_, req, type_, message_id_, response_);
+    else
+      response_.clear();
+
+    service_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - start).count();
+
+    server_->Return(worker, this);
+  }
+
+ private:
+  friend class Server;
+
+  Server* server_;
+  Resource* resource_;
+
+  uint8_t data_[net::kMaxDatagramSize];
+  size_t size_;
+  sockaddr_storage peer_;
+  socklen_t peer_len_;
+
+  coap::Type type_;
+  uint16_t message_id_;
+  Lane lane_;
+  uint64_t queued_ms_;
+
+  Ack ack_;
+  uint32_t serial_;               // bumped on release, for Timers
+  uint64_t dispatched_us_;
+  unsigned retransmits_;
+  uint32_t timeout_ms_;
+  uint64_t retransmit_at_ms_;
+
+  std::vector<uint8_t> response_;
+  uint32_t service_us_;
+};
+
+Server::Server(net::Transport* transport, Executor* executor)
+  : transport_(transport)
+  , executor_(executor)
+  , trace_(nullptr)
+  , limiter_(nullptr)
+  , priorities_(kDefaultPriorities)
+  , on_executor_(0)
+  , piggyback_(kDefaultPiggyback)
+  , wake_pending_(false)
+  , shedding_(kDefaultLoadShedding)
+  , overloaded_(false)
+  , service_us_(0)
+  , max_age_(0)
+  , max_age_option_len_(0)
+  , handled_inline_(0)
+  , offloaded_(0)
+  , dropped_(0)
+  , preempted_(0)
+  , rejected_(0)
+  , empties_(0)
+  , piggybacked_(0)
+  , separated_(0)
+  , retransmitted_(0)
+  , unconfirmed_(0)
+  , malformed_(0) {
+  coap::OptionRegistry::Instance()->Freeze();
+
+  if (executor_) {
+    for (size_t i = 0; i < kMaxInProgress; ++i) {
+      calls_.push_back(std::unique_ptr<Call>(new Call(this)));
+      free_calls_.push_back(calls_.back().get());
+    }
+
+    // Can't fill up: there are no more calls than slots in any queue.
+    for (size_t i = 0; i < executor_->size(); ++i)
+      returns_.push_back(std::unique_ptr<SpscQueue<Call*>>(
+          new SpscQueue<Call*>(kMaxInProgress)));
+  }
+
+  for (size_t i = 0; i < kLanes; ++i)
+    credits_[i] = 0;
+
+  resources_[kWellKnownCore] = &core_;
+
+  std::random_device rd;
+  next_mid_ = rd();
+  rng_.seed(rd());
+}
+
+Server::~Server() {
+  // Those not started yet never will be.
+  for (auto& lane : lanes_) {
+    for (Call* call : lane)
+      Release(call);
+    lane.clear();
+  }
+
+  // Nor are ACKs to separate responses waited for.
+  while (in_progress() > 0) {
+    DrainReturns();
+    for (auto& unacked : unacked_)
+      Release(unacked.second);
+    unacked_.clear();
+    std::this_thread::yield();
+  }
+}
+
+bool Server::Add(const std::string& path, Resource* resource,
+                 const std::string& attributes) {
+  if (!resource)
+    return false;
+
+  if (!resources_.insert(std::make_pair(path, resource)).second)
+    return false;
+
+  if (path != kWellKnownCore && !core_.Add(path, attributes)) {
+    resources_.erase(path);
+    return false;
+  }
+
+  latency_.insert(std::make_pair(resource, Latency{ 0, 0 }));
+  return true;
+}
+
+bool Server::Remove(const std::string& path) {
+  auto it = resources_.find(path);
+  if (it == resources_.end())
+    return false;
+
+  // Calls to it still in progress won't put it back.
+  Resource* resource = it->second;
+  resources_.erase(it);
+
+  bool served = false;
+  for (const auto& other : resources_)
+    served |= other.second == resource;
+  if (!served)
+    latency_.erase(resource);
+
+  core_.Remove(path);
+  return true;
+}
+
+Resource* Server::Find(const coap::PDUView& req) {
+  path_.clear();
+
+  coap::OptionCursor cursor = req.options();
+  size_t num;
+  const uint8_t* value;
+  size_t length;
+
+  while (cursor.Next(num, value, length)) {
+    if (num == coap::OptionNumber::Uri_Path) {
+      if (!path_.empty())
+        path_ += '/';
+      path_.append(reinterpret_cast<const char*>(value), length);
+    } else if (num > coap::OptionNumber::Uri_Path) {
+      break;
+    }
+  }
+
+  auto it = resources_.find(path_);
+  return it == resources_.end() ? nullptr : it->second;
+}
+
+void Server::OnDatagram(const net::Datagram& dgram) {
+  if (limiter_ && Limited(dgram)) {
+    Trace(dgram, trace::Verdict::rejected);
+    return;
+  }
+
+  // Pings, empty ACKs and RSTs are told apart from the header alone.
+  switch (coap::ClassifyEmpty(dgram.data, dgram.size)) {
+    case coap::EmptyKind::other:
+      break;
+
+    case coap::EmptyKind::ping: {
+      Trace(dgram, trace::Verdict::decoded);
+      uint8_t rst[4];
+      coap::ResetFor(dgram.data, rst);
+      transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+      ++empties_;
+      return;
+    }
+
+    case coap::EmptyKind::ack:
+    case coap::EmptyKind::reset:
+      // Only separate responses are confirmable of ours.
+      Acknowledged(dgram);
+      Trace(dgram, trace::Verdict::decoded);
+      ++empties_;
+      return;
+
+    case coap::EmptyKind::bad:
+      Trace(dgram, trace::Verdict::rejected);
+      return;
+  }
+
+  if (overloaded_ && Shed(dgram)) {
+    Trace(dgram, trace::Verdict::decoded);
+    return;
+  }
+
+  coap::PDUView req;
+
+  if (!req.Decode(dgram.data, dgram.size)) {
+    Trace(dgram, trace::Verdict::rejected);
+    return;
+  }
+
+  Trace(dgram, trace::Verdict::decoded);
+
+  // We are not a client: responses (to nothing) are not for us.
+  if (static_cast<int>(req.code()) > coap::CodeBlocks::ReqMethodMax)
+    return;
+
+  if (req.type() != coap::Type::CON && req.type() != coap::Type::NON)
+    return;
+
+  Dispatch(Find(req), req, dgram);
+}
+
+void Server::OnBatch(const net::Datagram* dgrams, size_t n) {
+  const uint8_t* bufs[net::kMaxBatch];
+  size_t sizes[net::kMaxBatch];
+
+  for (size_t base = 0; base < n; base += net::kMaxBatch) {
+    size_t m = std::min(n - base, net::kMaxBatch);
+
+    for (size_t i = 0; i < m; ++i) {
+      bufs[i] = dgrams[base + i].data;
+      sizes[i] = dgrams[base + i].size;
+    }
+
+    uint64_t ok = coap::PrevalidateHeaders(bufs, sizes, m);
+    malformed_ += m - __builtin_popcountll(ok);
+
+    if (trace_) {
+      for (uint64_t ko = ~ok & (~0ULL >> (64 - m)); ko; ko &= ko - 1)
+        Trace(dgrams[base + __builtin_ctzll(ko)], trace::Verdict::rejected);
+    }
+
+    while (ok) {
+      OnDatagram(dgrams[base + __builtin_ctzll(ok)]);
+      ok &= ok - 1;
+    }
+  }
+}
+
+void Server::Dispatch(Resource* resource, const coap::PDUView& req,
+                      const net::Datagram& dgram) {
+  // Piggyback on the ACK if confirmable.
+  coap::Type type = coap::Type::ACK;
+  uint16_t mid = req.message_id();
+
+  if (req.type() == coap::Type::NON) {
+    type = coap::Type::NON;
+    mid = next_mid_++;
+  }
+
+  if (!executor_ || !resource || resource->inline_safe()) {
+    Respond(resource, req, type, mid, scratch_);
+    transport_->Send(scratch_.data(), scratch_.size(),
+                     dgram.peer, dgram.peer_len);
+    ++handled_inline_;
+    return;
+  }
+
+  Lane lane = LaneFor(resource, req);
+
+  if (dgram.peer_len > sizeof(sockaddr_storage) ||
+      (free_calls_.empty() && !Preempt(lane))) {
+    // Too much on the executor already: if it was confirmable, the
+    // peer will retry.
+    ++dropped_;
+    return;
+  }
+
+  Call* call = free_calls_.back();
+  free_calls_.pop_back();
+
+  call->resource_ = resource;
+  memcpy(call->data_, dgram.data, dgram.size);
+  call->size_ = dgram.size;
+  memcpy(&call->peer_, dgram.peer, dgram.peer_len);
+  call->peer_len_ = dgram.peer_len;
+  call->type_ = type;
+  call->message_id_ = mid;
+  call->lane_ = lane;
+  call->queued_ms_ = CoarseNowMs();
+  call->dispatched_us_ = NowUs();
+  call->ack_ = Call::Ack::none;
+
+  if (req.type() == coap::Type::CON) {
+    uint32_t window = PiggybackWindow(resource);
+
+    if (window == 0) {
+      SendAck(call);
+    } else {
+      call->ack_ = Call::Ack::held;
+      // Not a moment early, so that a response later than that has
+      // taken longer than the window.
+      if (window != UINT32_MAX) {
+        uint64_t at = (call->dispatched_us_ + window * 1000ULL + 999) / 1000;
+        timers_.push({ at, call->serial_, call });
+      }
+    }
+  }
+
+  lanes_[static_cast<size_t>(lane)].push_back(call);
+  Feed();
+
+  if (!overloaded_)
+    UpdateLoad();
+}
+
+Lane Server::LaneFor(Resource* resource, const coap::PDUView& req) const {
+  if (resource->bulk())
+    return Lane::non_confirmable;
+
+  if (req.code() == coap::Code::GET) {
+    coap::OptionCursor cursor = req.options();
+    size_t num;
+    const uint8_t* value;
+    size_t length;
+
+    while (cursor.Next(num, value, length) &&
+           num <= coap::OptionNumber::Observe) {
+      if (num == coap::OptionNumber::Observe)
+        return Lane::observe;
+    }
+  }
+
+  return req.type() == coap::Type::CON ? Lane::confirmable :
+                                         Lane::non_confirmable;
+}
+
+// Make room for a request in lane: the last one to come into the least
+// urgent lane behind it loses its Call.  Not if it was acknowledged
+// already, though: its peer won't retry it.  False if there is none.
+bool Server::Preempt(Lane lane) {
+  for (size_t i = kLanes - 1; i > static_cast<size_t>(lane); --i) {
+    std::deque<Call*>& waiting = lanes_[i];
+
+    for (auto it = waiting.rbegin(); it != waiting.rend(); ++it) {
+      if ((*it)->ack_ == Call::Ack::sent)
+        continue;
+      Release(*it);
+      waiting.erase(std::next(it).base());
+      ++preempted_;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Hand the executor what its window has room for.
+void Server::Feed() {
+  size_t window = priorities_.window ? priorities_.window :
+                                       2 * executor_->size();
+
+  while (on_executor_ < window) {
+    Call* call = Next();
+    if (!call)
+      break;
+
+    executor_->Submit(call);
+    ++on_executor_;
+    ++offloaded_;
+  }
+}
+
+// The call to start next: the one that has waited longest, if over
+// max_wait_ms, or else the front of the most urgent lane with credits
+// left this round.
+Server::Call* Server::Next() {
+  size_t pick = kLanes;
+  uint64_t now = 0;
+
+  for (size_t i = 0; i < kLanes; ++i) {
+    if (lanes_[i].empty())
+      continue;
+    if (!now)
+      now = CoarseNowMs();
+    uint64_t queued = lanes_[i].front()->queued_ms_;
+    if (now - queued >= priorities_.max_wait_ms &&
+        (pick == kLanes || queued < lanes_[pick].front()->queued_ms_))
+      pick = i;
+  }
+
+  if (!now)
+    return nullptr;
+
+  for (int round = 0; round < 2 && pick == kLanes; ++round) {
+    for (size_t i = 0; i < kLanes; ++i) {
+      if (!lanes_[i].empty() && credits_[i] > 0) {
+        pick = i;
+        break;
+      }
+    }
+    if (pick == kLanes)
+      std::copy(priorities_.weights, priorities_.weights + kLanes, credits_);
+  }
+
+  // All weights 0 for those waiting: most urgent first.
+  for (size_t i = 0; i < kLanes && pick == kLanes; ++i) {
+    if (!lanes_[i].empty())
+      pick = i;
+  }
+
+  if (credits_[pick] > 0)
+    --credits_[pick];
+
+  Call* call = lanes_[pick].front();
+  lanes_[pick].pop_front();
+  return call;
+}
+
+size_t Server::queued() const {
+  size_t n = 0;
+  for (const auto& lane : lanes_)
+    n += lane.size();
+  return n;
+}
+
+uint32_t Server::ExpectedDelayMs() const {
+  return static_cast<uint64_t>(in_progress() - unacked_.size()) *
+         service_us_ / (1000 * executor_->size());
+}
+
+// Flip in and out of shedding mode and keep the prepared Max-Age in
+// line with the backlog.
+void Server::UpdateLoad() {
+  if (!executor_)
+    return;
+
+  uint32_t delay = ExpectedDelayMs();
+
+  if (!overloaded_) {
+    overloaded_ = in_progress() >= shedding_.high_watermark ||
+                  delay > shedding_.max_delay_ms;
+  } else {
+    overloaded_ = in_progress() > shedding_.low_watermark ||
+                  delay > shedding_.max_delay_ms / 2;
+  }
+
+  if (!overloaded_)
+    return;
+
+  // Come back when the backlog is gone: round up to whole seconds.
+  uint32_t max_age = std::max<uint32_t>(1, (delay + 999) / 1000);
+
+  if (max_age == max_age_)
+    return;
+
+  max_age_ = max_age;
+
+  // Max-Age (14) is the only option: delta 14 takes the 1-byte
+  // extended form (13 + 1), and the value is a minimal uint.
+  size_t len = 0;
+  uint8_t value[4];
+  for (uint32_t v = max_age; v > 0; v >>= 8)
+    ++len;
+  for (size_t i = 0; i < len; ++i)
+    value[i] = max_age >> (8 * (len - 1 - i));
+
+  max_age_option_[0] = (13 << 4) | len;
+  max_age_option_[1] = coap::OptionNumber::Max_Age - 13;
+  memcpy(max_age_option_ + 2, value, len);
+  max_age_option_len_ = 2 + len;
+}
+
+// Turn dgram away, looking at nothing but its header.  Return false if
+// it is not a request, which then goes the normal way.
+bool Server::Shed(const net::Datagram& dgram) {
+  if (dgram.size < 4)
+    return false;
+
+  const uint8_t* h = dgram.data;
+  unsigned type = (h[0] >> 4) & 0x03;
+  size_t tkl = h[0] & 0x0F;
+
+  if ((h[0] >> 6) != coap::Version::v1 || tkl > 8 ||
+      dgram.size < 4 + tkl ||
+      h[1] < coap::CodeBlocks::ReqMethodMin ||
+      h[1] > coap::CodeBlocks::ReqMethodMax)
+    return false;
+
+  if (type == coap::Type::CON) {
+    uint8_t rsp[4 + 8 + sizeof max_age_option_];
+    rsp[0] = (coap::Version::v1 << 6) | (coap::Type::ACK << 4) | tkl;
+    rsp[1] = coap::Code::ServiceUnavailable;
+    rsp[2] = h[2];
+    rsp[3] = h[3];
+    memcpy(rsp + 4, h + 4, tkl);
+    memcpy(rsp + 4 + tkl, max_age_option_, max_age_option_len_);
+
+    transport_->Send(rsp, 4 + tkl + max_age_option_len_,
+                     dgram.peer, dgram.peer_len);
+    ++rejected_;
+  } else {
+    ++dropped_;
+  }
+
+  return true;
+}
+
+// Whether dgram's source is over its limit.  If so, and the limiter
+// says so, a CON request gets an RST with its message ID, looking at
+// nothing but the header.
+bool Server::Limited(const net::Datagram& dgram) {
+  Limit limit = limiter_->Check(dgram.peer, dgram.peer_len,
+                                 CoarseNowMs());
+
+  if (limit == Limit::pass)
+    return false;
+
+  const uint8_t* h = dgram.data;
+  if (limit == Limit::reset && dgram.size >= 4 &&
+      (h[0] >> 6) == coap::Version::v1 &&
+      ((h[0] >> 4) & 0x03) == coap::Type::CON &&
+      h[1] != coap::Code::Empty) {
+    uint8_t rst[4] = {
+      (coap::Version::v1 << 6) | (coap::Type::RST << 4),
+      coap::Code::Empty, h[2], h[3]
+    };
+    transport_->Send(rst, sizeof rst, dgram.peer, dgram.peer_len);
+  }
+
+  return true;
+}
+
+// On a worker thread.
+void Server::Return(size_t worker, Call* call) {
+  while (!returns_[worker]->TryPush(call))
+    std::this_thread::yield();
+
+  // One wake up per batch is enough: the I/O thread clears the flag
+  // before it looks at the queues.
+  if (!wake_pending_.exchange(true))
+    transport_->Wake();
+}
+
+void Server::DrainReturns() {
+  wake_pending_.store(false);
+
+  Call* call;
+  uint64_t now_us = returns_.empty() ? 0 : NowUs();
+
+  for (auto& q : returns_) {
+    while (q->TryPop(call)) {
+      --on_executor_;
+      Reply(call, now_us);
+
+      // EWMA, 1/8 gain.
+      service_us_ = service_us_ == 0 ? call->service_us_ :
+          (7 * static_cast<uint64_t>(service_us_) + call->service_us_) / 8;
+    }
+  }
+
+  if (executor_)
+    Feed();
+
+  UpdateLoad();
+}
+
+uint32_t Server::PiggybackWindow(const Resource* resource) const {
+  auto it = latency_.find(resource);
+  if (it == latency_.end() ||
+      (it->second.avg_us == 0 && it->second.dev_us == 0))
+    return piggyback_.max_window_ms;
+
+  const Latency& latency = it->second;
+  if (latency.avg_us > piggyback_.max_window_ms * 1000ULL)
+    return 0;
+
+  uint64_t window = (latency.avg_us + 4ULL * latency.dev_us + 999) / 1000;
+  window = std::max<uint64_t>(window, piggyback_.min_window_ms);
+  return std::min<uint64_t>(window, piggyback_.max_window_ms);
+}
+
+void Server::Release(Call* call) {
+  call->ack_ = Call::Ack::none;
+  ++call->serial_;
+  free_calls_.push_back(call);
+}
+
+// Send back the response of call, on the ACK held for it or in a CON
+// of its own if the ACK went without it, and learn from its latency.
+void Server::Reply(Call* call, uint64_t now_us) {
+  uint32_t sample = std::min<uint64_t>(now_us - call->dispatched_us_,
+                                       UINT32_MAX);
+
+  // Not if its resource has been removed since.
+  auto it = latency_.find(call->resource_);
+  if (it != latency_.end()) {
+    Latency& latency = it->second;
+    if (latency.avg_us == 0 && latency.dev_us == 0) {
+      latency.avg_us = sample;
+      latency.dev_us = sample / 2;
+    } else {
+      uint32_t error = sample > latency.avg_us ? sample - latency.avg_us :
+                                                 latency.avg_us - sample;
+      latency.dev_us = (3ULL * latency.dev_us + error) / 4;
+      latency.avg_us = (7ULL * latency.avg_us + sample) / 8;
+    }
+  }
+
+  std::vector<uint8_t>& rsp = call->response_;
+
+  if (rsp.empty()) {
+    Release(call);
+    return;
+  }
+
+  if (call->ack_ == Call::Ack::sent) {
+    // Same token, but a message ID of ours, not in use.
+    uint16_t mid = next_mid_++;
+    while (unacked_.count(mid))
+      mid = next_mid_++;
+
+    rsp[2] = mid >> 8;
+    rsp[3] = mid;
+
+    if (unacked_.size() >= kMaxUnacked) {
+      rsp[0] = (rsp[0] & 0xCF) | (coap::Type::NON << 4);
+      transport_->Send(rsp.data(), rsp.size(),
+                       reinterpret_cast<const sockaddr*>(&call->peer_),
+                       call->peer_len_);
+      ++unconfirmed_;
+      Release(call);
+      return;
+    }
+
+    rsp[0] = (rsp[0] & 0xCF) | (coap::Type::CON << 4);
+
+    std::uniform_real_distribution<double> factor(1, kAckRandomFactor);
+    call->message_id_ = mid;
+    call->ack_ = Call::Ack::awaited;
+    call->retransmits_ = 0;
+    call->timeout_ms_ = kAckTimeoutMs * factor(rng_);
+    unacked_[mid] = call;
+    Transmit(call, now_us / 1000);
+    return;
+  }
+
+  if (call->ack_ == Call::Ack::held)
+    ++piggybacked_;
+
+  transport_->Send(rsp.data(), rsp.size(),
+                   reinterpret_cast<const sockaddr*>(&call->peer_),
+                   call->peer_len_);
+  Release(call);
+}
+
+// Acknowledge call's request with an empty ACK: the response will be
+// separate.
+void Server::SendAck(Call* call) {
+  uint8_t ack[4] = {
+    (coap::Version::v1 << 6) | (coap::Type::ACK << 4),
+    coap::Code::Empty,
+    static_cast<uint8_t>(call->message_id_ >> 8),
+    static_cast<uint8_t>(call->message_id_)
+  };
+  transport_->Send(ack, sizeof ack,
+                   reinterpret_cast<const sockaddr*>(&call->peer_),
+                   call->peer_len_);
+  call->ack_ = Call::Ack::sent;
+  ++separated_;
+}
+
+// (Re)transmit the separate response of call, and set the timer for
+// the next time.
+void Server::Transmit(Call* call, uint64_t now_ms) {
+  transport_->Send(call->response_.data(), call->response_.size(),
+                   reinterpret_cast<const sockaddr*>(&call->peer_),
+                   call->peer_len_);
+  call->retransmit_at_ms_ = now_ms + call->timeout_ms_;
+  timers_.push({ call->retransmit_at_ms_, call->serial_, call });
+}
+
+// An empty ACK or RST: if it is for one of our separate responses, and
+// from the peer it went to, that one is done.
+void Server::Acknowledged(const net::Datagram& dgram) {
+  auto it = unacked_.find(coap::HeaderMessageId(dgram.data));
+  if (it == unacked_.end())
+    return;
+
+  Call* call = it->second;
+  if (call->peer_len_ != dgram.peer_len ||
+      memcmp(&call->peer_, dgram.peer, dgram.peer_len) != 0)
+    return;
+
+  unacked_.erase(it);
+  Release(call);
+}
+
+uint64_t Server::NowMs() {
+  return NowUs() / 1000;
+}
+
+void Server::Tick(uint64_t now_ms) {
+  while (!timers_.empty() && timers_.top().at_ms <= now_ms) {
+    Timer timer = timers_.top();
+    timers_.pop();
+
+    Call* call = timer.call;
+    if (timer.serial != call->serial_)
+      continue;
+
+    if (call->ack_ == Call::Ack::held) {
+      SendAck(call);
+    } else if (call->ack_ == Call::Ack::awaited &&
+               timer.at_ms == call->retransmit_at_ms_) {
+      if (call->retransmits_ == kMaxRetransmit) {
+        // The peer is gone, or doesn't care.
+        unacked_.erase(call->message_id_);
+        Release(call);
+        continue;
+      }
+
+      ++call->retransmits_;
+      call->timeout_ms_ *= 2;
+      ++retransmitted_;
+      Transmit(call, now_ms);
+    }
+  }
+}
+
+// timeout_ms, or less if a timer is due before.
+int Server::NextTimeout(int timeout_ms) const {
+  if (timers_.empty())
+    return timeout_ms;
+
+  uint64_t now = NowMs();
+  uint64_t at = timers_.top().at_ms;
+  int due = at > now ? static_cast<int>(std::min<uint64_t>(at - now,
+                                                           INT32_MAX)) : 0;
+  return timeout_ms < 0 ? due : std::min(timeout_ms, due);
+}
+
+void Server::RunOnce(int timeout_ms) {
+  DrainReturns();
+  Tick(NowMs());
+  transport_->Flush();
+
+  transport_->Poll(this, NextTimeout(timeout_ms));
+
+  DrainReturns();
+  Tick(NowMs());
+  transport_->Flush();
+}
+
+}   // namespace server
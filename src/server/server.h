@@ -0,0 +1,346 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef SERVER_SERVER_H_
+#define SERVER_SERVER_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "coap/view.h"
+#include "net/transport.h"
+#include "server/executor.h"
+#include "server/rate_limiter.h"
+#include "server/resource.h"
+#include "server/spsc_queue.h"
+#include "server/well_known_core.h"
+#include "trace/trace.h"
+
+namespace server {
+
+// Max number of requests handed to the executor and not answered yet,
+// or answered separately and not acknowledged yet, per server.
+const size_t kMaxInProgress = 1024;
+
+// When to turn requests away.  Shedding starts when either the number
+// of requests in progress reaches high_watermark or the queueing delay
+// expected from the handlers' average service time goes over
+// max_delay_ms, and stops once both are back down to low_watermark
+// and half of max_delay_ms.
+struct LoadShedding {
+  size_t high_watermark;
+  size_t low_watermark;
+  uint32_t max_delay_ms;
+};
+
+// Answer well before the peer's first retransmission (ACK_TIMEOUT is
+// 2 s) or not at all.
+const LoadShedding kDefaultLoadShedding = {
+  kMaxInProgress * 3 / 4, kMaxInProgress / 2, 1000
+};
+
+// Lanes that requests for the executor wait in, most urgent first.
+// Exchange completions (empty ACKs and RSTs) and pings never wait:
+// they are dealt with on the I/O thread as they come.
+enum class Lane : uint8_t {
+  confirmable,        // CON requests: the peer is waiting, then retries
+  non_confirmable,    // NON requests, and any request to a bulk resource
+  observe             // GETs with an Observe option: (re-)registrations
+};
+
+const size_t kLanes = 3;
+
+// How the executor is shared out between lanes.  No more than window
+// requests are on the executor at a time (0 for twice its threads),
+// the others wait in their lane.  Lanes take turns by weight, up to
+// weights[i] requests from lane i per round, but a request that has
+// waited max_wait_ms goes next, whatever its lane, so that none
+// starves.
+struct Priorities {
+  uint32_t weights[kLanes];
+  uint32_t max_wait_ms;
+  size_t window;
+};
+
+const Priorities kDefaultPriorities = { { 8, 2, 1 }, 500, 0 };
+
+// Every request straight to the executor, as it comes.
+const Priorities kFirstComeFirstServed = { { 1, 1, 1 }, 0, kMaxInProgress };
+
+// When to answer a CON request in two (RFC 7252, 5.2.2): an empty ACK
+// first, the response later in a CON of its own.  A response
+// piggybacked on the ACK saves two datagrams (the separate response is
+// acknowledged too), but holding the ACK back too long has the peer
+// retransmit the request.
+//
+// Requests to the executor are held for a window, and the empty ACK
+// only goes if the response isn't in by then.  The window follows the
+// latency seen for each resource, from dispatch to response: its
+// average plus four mean deviations (as RFC 6298 does for RTTs), no
+// less than min_window_ms and no more than max_window_ms, well under
+// ACK_TIMEOUT.  Resources that take more than max_window_ms on average
+// aren't waited for at all.
+struct Piggyback {
+  uint32_t min_window_ms;
+  uint32_t max_window_ms;
+};
+
+const Piggyback kDefaultPiggyback = { 20, 1000 };
+
+// Hold the ACK until the response is in, however long that takes.
+const Piggyback kAlwaysPiggyback = { UINT32_MAX, UINT32_MAX };
+
+// Transmission parameters of separate responses (RFC 7252, 4.8).
+const uint32_t kAckTimeoutMs = 2000;
+const double kAckRandomFactor = 1.5;
+const unsigned kMaxRetransmit = 4;
+
+// Separate responses awaiting their ACK, at most, each holding its
+// Call for up to 93 s.  Past that they go in a NON, once, so that
+// peers that never acknowledge can't take the Calls from everybody
+// else.
+const size_t kMaxUnacked = kMaxInProgress / 4;
+
+// CoAP server bound to one transport, to be driven by a single I/O
+// thread:
+//
+//   Server s(transport, &executor);
+//   s.Add("sensors/temp", &temp);
+//   while (...)
+//     s.RunOnce(100);
+//
+// The I/O thread decodes each request in place (coap::PDUView) and
+// looks up its resource.  Inline-safe resources are answered on the
+// spot.  For the others the datagram is copied into a Call, which is
+// queued to the executor; the worker runs the handler, encodes the
+// response and hands the Call back through a lock-free SPSC queue (one
+// per worker, so that each has a single producer), waking the I/O
+// thread up if it is blocked in the transport.
+//
+// Several servers, each with its own I/O thread, can share the same
+// executor.  Custom options are to be registered before the first
+// server is made: it freezes the coap::OptionRegistry the I/O threads
+// then read without locking.
+//
+// Requests for the executor go through lanes by type, code and
+// resource (see Lane and Priorities): when it falls behind, CONs are
+// started before NONs and observe registrations, and take the place of
+// those still waiting when no Call is left.
+//
+// Offloaded CON requests get their response piggybacked on the ACK if
+// it is in soon enough (see Piggyback); otherwise an empty ACK goes
+// first and the response follows in a CON, retransmitted until the
+// peer acknowledges it.
+//
+// If the executor can't keep up, the server sheds load (see
+// LoadShedding): requests are told apart from the 4 header bytes only,
+// NONs are dropped and CONs get a prepared 5.03 (Service Unavailable)
+// whose Max-Age says how long the backlog should take to clear.
+//
+// With set_rate_limiter(), sources sending more than their share are
+// throttled before anything of theirs is decoded (see RateLimiter).
+//
+// Datagrams received together are pre-validated as a batch first
+// (coap::PrevalidateHeaders), so that floods of garbage are thrown
+// away without being decoded one by one.
+//
+// Resources are listed at /.well-known/core (see WellKnownCore), with
+// the link attributes they were added with.
+//
+// With set_trace(), every datagram received is recorded to a trace,
+// with whether it could be decoded (see trace::TraceWriter).
+class Server : public net::Handler {
+ public:
+  // transport must be open.  With no executor every resource is run
+  // inline.  Both must outlive the server.
+  Server(net::Transport* transport, Executor* executor);
+
+  // Wait for the calls already on the executor, drop those waiting in
+  // a lane.
+  ~Server();
+
+  // Serve resource at path, Uri-Path segments joined by '/' (e.g.
+  // "sensors/temp"), and list it in /.well-known/core with attributes
+  // (e.g. rt="temperature";ct=0, no leading ';').  False if path is
+  // served already or attributes don't parse.
+  //
+  // Before serving starts, or on the I/O thread; the same goes for
+  // Remove(), and a resource removed must outlive the calls to it in
+  // progress.
+  bool Add(const std::string& path, Resource* resource,
+           const std::string& attributes = "");
+  bool Remove(const std::string& path);
+
+  const WellKnownCore& well_known_core() const { return core_; }
+
+  void set_load_shedding(const LoadShedding& policy) { shedding_ = policy; }
+  void set_priorities(const Priorities& policy) { priorities_ = policy; }
+  void set_piggyback(const Piggyback& policy) { piggyback_ = policy; }
+
+  // How long a CON request to resource is held for its response to be
+  // piggybacked (ms, 0 if it isn't).
+  uint32_t PiggybackWindow(const Resource* resource) const;
+
+  // Record received datagrams to trace (open, or nullptr to stop).  It
+  // must outlive the server, or be unset first.
+  void set_trace(trace::TraceWriter* trace) { trace_ = trace; }
+
+  // Check every datagram's source against limiter first (or nullptr to
+  // stop).  It must outlive the server, or be unset first.
+  void set_rate_limiter(RateLimiter* limiter) { limiter_ = limiter; }
+
+  // Send back what the executor has finished, then wait up to
+  // timeout_ms for requests and dispatch them.
+  void RunOnce(int timeout_ms);
+
+  void OnDatagram(const net::Datagram& dgram);
+  void OnBatch(const net::Datagram* dgrams, size_t n);
+
+  // Send the empty ACKs held and retransmit the separate responses due
+  // at now_ms (NowMs() time), as RunOnce() does.
+  void Tick(uint64_t now_ms);
+
+  // The clock piggyback windows and retransmissions run on, the same
+  // as latencies are measured with.
+  static uint64_t NowMs();
+
+  size_t in_progress() const {
+    return calls_.size() - free_calls_.size();
+  }
+
+  // Of those, waiting in a lane for the executor.
+  size_t queued() const;
+
+  // Of those, separate responses sent and not acknowledged yet.
+  size_t unacked() const { return unacked_.size(); }
+
+  bool overloaded() const { return overloaded_; }
+
+  // Average time spent in offloaded handlers (us).
+  uint32_t service_time() const { return service_us_; }
+
+  // Counters
+  uint64_t handled_inline() const { return handled_inline_; }
+  uint64_t offloaded() const { return offloaded_; }
+  uint64_t dropped() const { return dropped_; }
+  uint64_t preempted() const { return preempted_; } // lost their place
+  uint64_t rejected() const { return rejected_; }   // 5.03 sent
+  uint64_t empties() const { return empties_; }     // pings, ACKs, RSTs
+  uint64_t piggybacked() const { return piggybacked_; }
+  uint64_t separated() const { return separated_; } // empty ACKs sent
+  uint64_t retransmitted() const { return retransmitted_; }
+  uint64_t unconfirmed() const { return unconfirmed_; } // separate NONs
+  uint64_t malformed() const { return malformed_; } // failed pre-validation
+
+ private:
+  class Call;
+
+  Resource* Find(const coap::PDUView& req);
+  void Dispatch(Resource* resource, const coap::PDUView& req,
+                const net::Datagram& dgram);
+  Lane LaneFor(Resource* resource, const coap::PDUView& req) const;
+  bool Preempt(Lane lane);
+  void Feed();
+  Call* Next();
+  void Release(Call* call);
+  void Return(size_t worker, Call* call);
+  void DrainReturns();
+  void Reply(Call* call, uint64_t now_us);
+  void SendAck(Call* call);
+  void Transmit(Call* call, uint64_t now_ms);
+  void Acknowledged(const net::Datagram& dgram);
+  int NextTimeout(int timeout_ms) const;
+  uint32_t ExpectedDelayMs() const;
+  void UpdateLoad();
+  bool Shed(const net::Datagram& dgram);
+  bool Limited(const net::Datagram& dgram);
+
+  void Trace(const net::Datagram& dgram, trace::Verdict verdict) {
+    if (trace_)
+      trace_->Record(dgram, verdict);
+  }
+
+ private:
+  net::Transport* transport_;
+  Executor* executor_;
+  trace::TraceWriter* trace_;
+  RateLimiter* limiter_;
+
+  std::unordered_map<std::string, Resource*> resources_;
+  std::string path_;      // scratch for Find
+  WellKnownCore core_;
+
+  std::vector<std::unique_ptr<Call>> calls_;
+  std::vector<Call*> free_calls_;
+
+  // Calls waiting for the executor, and how many are on it.
+  Priorities priorities_;
+  std::deque<Call*> lanes_[kLanes];
+  uint32_t credits_[kLanes];      // left this round
+  size_t on_executor_;
+
+  // Latency of each resource served's calls, dispatch to response, for
+  // the piggyback window ({ 0, 0 } until the first).
+  struct Latency {
+    uint32_t avg_us;
+    uint32_t dev_us;
+  };
+
+  // Held ACKs and separate response retransmissions, due at at_ms.  A
+  // timer is stale if its call has been released since it was set.
+  struct Timer {
+    uint64_t at_ms;
+    uint32_t serial;
+    Call* call;
+
+    bool operator>(const Timer& other) const { return at_ms > other.at_ms; }
+  };
+
+  Piggyback piggyback_;
+  std::unordered_map<const Resource*, Latency> latency_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>>
+      timers_;
+  std::unordered_map<uint16_t, Call*> unacked_;   // by message ID
+
+  // Finished calls, one queue per worker.
+  std::vector<std::unique_ptr<SpscQueue<Call*>>> returns_;
+  std::atomic<bool> wake_pending_;
+
+  std::vector<uint8_t> scratch_;  // inline responses
+  uint16_t next_mid_;
+  std::minstd_rand rng_;          // for ACK_RANDOM_FACTOR
+
+  LoadShedding shedding_;
+  bool overloaded_;
+  uint32_t service_us_;           // EWMA
+
+  // Max-Age option of the prepared 5.03, encoded.
+  uint32_t max_age_;
+  uint8_t max_age_option_[6];
+  size_t max_age_option_len_;
+
+  uint64_t handled_inline_;
+  uint64_t offloaded_;
+  uint64_t dropped_;
+  uint64_t preempted_;
+  uint64_t rejected_;
+  uint64_t empties_;
+  uint64_t piggybacked_;
+  uint64_t separated_;
+  uint64_t retransmitted_;
+  uint64_t unconfirmed_;
+  uint64_t malformed_;
+};
+
+}   // namespace server
+
+#endif  // SERVER_SERVER_H_
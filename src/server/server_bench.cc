@@ -0,0 +1,211 @@
+// Copyleft 2013 tho@autistici.org
+
+// Request latency with a mix of slow and fast handlers.
+//
+// A closed-loop client keeps `window` requests in flight against a
+// server on loopback.  Some requests (slow_pct %) go to a handler that
+// burns slow_us of CPU, the rest to one that answers straight away.
+// The same load is run with every handler on the I/O thread, with
+// every handler on the executor, and with the fast handler declared
+// inline-safe, and latency percentiles are reported for each class.
+//
+// Usage: server_bench [total [window [workers [slow_pct [slow_us]]]]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "server/server.h"
+
+using namespace server;
+
+typedef std::chrono::steady_clock Clock;
+
+class Fast : public Resource {
+ public:
+  explicit Fast(bool inline_safe) : inline_safe_(inline_safe) { }
+
+  void Handle(const coap::PDUView&, coap::PDU& rsp) {
+    rsp.set_code(coap::Code::Content);
+  }
+
+  bool inline_safe() const { return inline_safe_; }
+
+ private:
+  bool inline_safe_;
+};
+
+// Stands for compressing a batch of samples or the like.
+class Slow : public Resource {
+ public:
+  explicit Slow(int us) : us_(us) { }
+
+  void Handle(const coap::PDUView&, coap::PDU& rsp) {
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us_);
+    while (Clock::now() < until) { }
+    rsp.set_code(coap::Code::Changed);
+  }
+
+ private:
+  int us_;
+};
+
+struct Config {
+  const char* name;
+  bool executor;
+  bool fast_inline;
+};
+
+struct Params {
+  size_t total;
+  size_t window;
+  size_t workers;
+  unsigned slow_pct;
+  int slow_us;
+};
+
+std::vector<uint8_t> encode(coap::Code code, const char* path) {
+  coap::PDU pdu;
+  pdu.set_code(code);
+  pdu.set_token({ 0, 0 });
+  coap::Options opts;
+  opts.AddUriPath(path);
+  pdu.set_options(opts);
+
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+double percentile(std::vector<double>& v, double p) {
+  if (v.empty())
+    return 0;
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+void report(const char* what, std::vector<double>& us) {
+  printf("  %-5s n=%-7zu p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us\n",
+         what, us.size(), percentile(us, 0.5), percentile(us, 0.99),
+         percentile(us, 0.999));
+}
+
+void run(const Config& config, const Params& params) {
+  std::unique_ptr<net::Transport> t = net::NewTransport(net::Backend::any);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert(t->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+  socklen_t len = sizeof addr;
+  assert(getsockname(t->fd(), reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+
+  Executor executor(params.workers);
+  assert(executor.Start());
+
+  Fast fast(config.fast_inline);
+  Slow slow(params.slow_us);
+
+  Server server(t.get(), config.executor ? &executor : nullptr);
+  server.Add("fast", &fast);
+  server.Add("slow", &slow);
+
+  std::atomic<bool> stop(false);
+  std::thread io([&server, &stop] {
+    while (!stop)
+      server.RunOnce(10);
+  });
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(client != -1);
+  assert(connect(client, reinterpret_cast<sockaddr*>(&addr), len) == 0);
+  timeval tv = { 1, 0 };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+  std::vector<uint8_t> req_fast = encode(coap::Code::GET, "fast");
+  std::vector<uint8_t> req_slow = encode(coap::Code::PUT, "slow");
+
+  std::vector<Clock::time_point> sent_at(65536);
+  std::vector<bool> is_slow(65536);
+  std::vector<double> lat_fast, lat_slow;
+
+  size_t sent = 0, done = 0, lost = 0;
+  Clock::time_point start = Clock::now();
+
+  while (done + lost < params.total) {
+    while (sent - done - lost < params.window && sent < params.total) {
+      uint16_t mid = sent;
+      bool s = (sent * 37) % 100 < params.slow_pct;   // spread them out
+      std::vector<uint8_t>& req = s ? req_slow : req_fast;
+
+      req[2] = req[4] = mid >> 8;
+      req[3] = req[5] = mid & 0xFF;
+      sent_at[mid] = Clock::now();
+      is_slow[mid] = s;
+      send(client, req.data(), req.size(), 0);
+      ++sent;
+    }
+
+    uint8_t buf[net::kMaxDatagramSize];
+    ssize_t n = recv(client, buf, sizeof buf, 0);
+
+    if (n < 4) {
+      // Give up on whatever is outstanding.
+      lost += sent - done - lost;
+      continue;
+    }
+
+    uint16_t mid = (buf[2] << 8) | buf[3];
+    double us = std::chrono::duration<double, std::micro>(
+        Clock::now() - sent_at[mid]).count();
+    (is_slow[mid] ? lat_slow : lat_fast).push_back(us);
+    ++done;
+  }
+
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  stop = true;
+  t->Wake();
+  io.join();
+  close(client);
+
+  printf("%s: %.0f req/s, %zu lost, %llu stolen\n", config.name,
+         done / elapsed.count(), lost,
+         static_cast<unsigned long long>(executor.steals()));
+  report("fast", lat_fast);
+  report("slow", lat_slow);
+}
+
+int main(int argc, char* argv[]) {
+  Params params;
+  params.total = argc > 1 ? strtoul(argv[1], nullptr, 10) : 50000;
+  params.window = argc > 2 ? strtoul(argv[2], nullptr, 10) : 32;
+  params.workers = argc > 3 ? strtoul(argv[3], nullptr, 10) : 4;
+  params.slow_pct = argc > 4 ? strtoul(argv[4], nullptr, 10) : 5;
+  params.slow_us = argc > 5 ? atoi(argv[5]) : 500;
+
+  printf("%zu requests, window %zu, %zu workers, %u%% slow (%d us)\n",
+         params.total, params.window, params.workers, params.slow_pct,
+         params.slow_us);
+
+  const Config configs[] = {
+    { "all inline", false, true },
+    { "all on executor", true, false },
+    { "fast inline, slow on executor", true, true },
+  };
+
+  for (auto& config : configs)
+    run(config, params);
+}
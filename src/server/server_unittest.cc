@@ -0,0 +1,803 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "coap/pdu.h"
+#include "coap/registry.h"
+#include "server/server.h"
+
+using namespace server;
+
+void init_log() {
+  utils::Log::Instance()->Open("server_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+class Echo : public Resource {
+ public:
+  explicit Echo(bool inline_safe) : inline_safe_(inline_safe), calls_(0) { }
+
+  void Handle(const coap::PDUView& req, coap::PDU& rsp) {
+    ++calls_;
+    rsp.set_code(coap::Code::Content);
+    rsp.set_payload(std::vector<uint8_t>(req.payload(),
+                                         req.payload() + req.payload_size()));
+  }
+
+  bool inline_safe() const { return inline_safe_; }
+
+  bool inline_safe_;
+  std::atomic<size_t> calls_;
+};
+
+class Slow : public Resource {
+ public:
+  void Handle(const coap::PDUView&, coap::PDU& rsp) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    rsp.set_code(coap::Code::Changed);
+  }
+};
+
+// Holds its worker until released.
+class Stuck : public Resource {
+ public:
+  Stuck() : release_(false) { }
+
+  void Handle(const coap::PDUView&, coap::PDU& rsp) {
+    while (!release_)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    rsp.set_code(coap::Code::Content);
+  }
+
+  std::atomic<bool> release_;
+};
+
+// Notes down the message IDs of the requests, in the order run, or
+// has log do it.
+class Recorder : public Resource {
+ public:
+  explicit Recorder(bool bulk = false, Recorder* log = nullptr)
+    : bulk_(bulk), log_(log ? log : this) { }
+
+  void Handle(const coap::PDUView& req, coap::PDU& rsp) {
+    std::lock_guard<std::mutex> lock(log_->mu_);
+    log_->order_.push_back(req.message_id());
+    rsp.set_code(coap::Code::Content);
+  }
+
+  bool bulk() const { return bulk_; }
+
+  std::vector<uint16_t> order() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return order_;
+  }
+
+ private:
+  bool bulk_;
+  Recorder* log_;
+  std::mutex mu_;
+  std::vector<uint16_t> order_;
+};
+
+// Forgets to set a response code.
+class Lazy : public Resource {
+ public:
+  void Handle(const coap::PDUView&, coap::PDU&) { }
+  bool inline_safe() const { return true; }
+};
+
+struct Fixture {
+  Fixture()
+    : transport(net::NewTransport(net::Backend::epoll))
+    , executor(2) {
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(transport->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr));
+
+    socklen_t len = sizeof addr;
+    assert(getsockname(transport->fd(), reinterpret_cast<sockaddr*>(&addr),
+                       &len) == 0);
+
+    client = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(client != -1);
+    timeval tv = { 0, 10000 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    assert(executor.Start());
+  }
+
+  ~Fixture() {
+    close(client);
+  }
+
+  void Request(coap::Type type, coap::Code code, uint16_t mid,
+               const std::string& path, const std::string& payload = "") {
+    coap::PDU pdu;
+    pdu.set_type(type);
+    pdu.set_code(code);
+    pdu.set_message_id(mid);
+    pdu.set_token({ uint8_t(mid >> 8), uint8_t(mid), 0xAA });
+
+    coap::Options opts;
+    size_t start = 0, slash;
+    while (!path.empty() && start <= path.size()) {
+      slash = path.find('/', start);
+      if (slash == std::string::npos)
+        slash = path.size();
+      assert(opts.AddUriPath(path.substr(start, slash - start)));
+      start = slash + 1;
+    }
+    pdu.set_options(opts);
+    pdu.set_payload(std::vector<uint8_t>(payload.begin(), payload.end()));
+
+    std::vector<uint8_t> buf;
+    if (code == coap::Code::Empty)
+      buf = { uint8_t(0x40 | (type << 4)), 0, uint8_t(mid >> 8),
+              uint8_t(mid) };
+    else
+      assert(pdu.Encode(buf));
+
+    assert(sendto(client, buf.data(), buf.size(), 0,
+                  reinterpret_cast<sockaddr*>(&addr), sizeof addr) ==
+           static_cast<ssize_t>(buf.size()));
+  }
+
+  void Raw(const std::vector<uint8_t>& buf) {
+    assert(sendto(client, buf.data(), buf.size(), 0,
+                  reinterpret_cast<sockaddr*>(&addr), sizeof addr) ==
+           static_cast<ssize_t>(buf.size()));
+  }
+
+  // Drive the server until a response shows up on the client.
+  bool Response(Server& server, coap::PDU& rsp) {
+    for (int i = 0; i < 100; ++i) {
+      server.RunOnce(5);
+
+      uint8_t buf[net::kMaxDatagramSize];
+      ssize_t n = recv(client, buf, sizeof buf, MSG_DONTWAIT);
+
+      if (n > 0)
+        return rsp.Decode(std::vector<uint8_t>(buf, buf + n));
+    }
+    return false;
+  }
+
+  std::unique_ptr<net::Transport> transport;
+  Executor executor;
+  sockaddr_in addr;
+  int client;
+};
+
+void test_ok_inline_and_offloaded() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  assert(coap::OptionRegistry::Instance()->frozen());
+
+  Echo fast(true), slow(false);
+  assert(s.Add("fast", &fast));
+  assert(s.Add("a/b", &slow));
+  assert(!s.Add("fast", &slow));
+
+  coap::PDU rsp;
+
+  f.Request(coap::Type::CON, coap::Code::GET, 0x1234, "fast", "hi");
+  assert(f.Response(s, rsp));
+  assert(rsp.type() == coap::Type::ACK);
+  assert(rsp.code() == coap::Code::Content);
+  assert(rsp.message_id() == 0x1234);
+  assert((rsp.token() == std::vector<uint8_t>{ 0x12, 0x34, 0xAA }));
+  assert((rsp.payload() == std::vector<uint8_t>{ 'h', 'i' }));
+  assert(s.handled_inline() == 1 && s.offloaded() == 0);
+
+  coap::PDU rsp2;
+  f.Request(coap::Type::CON, coap::Code::POST, 0x4321, "a/b", "yo");
+  assert(f.Response(s, rsp2));
+  assert(rsp2.type() == coap::Type::ACK);
+  assert(rsp2.message_id() == 0x4321);
+  assert((rsp2.payload() == std::vector<uint8_t>{ 'y', 'o' }));
+  assert(s.offloaded() == 1);
+  assert(s.in_progress() == 0);
+  assert(fast.calls_ == 1 && slow.calls_ == 1);
+}
+
+void test_ok_non() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Echo echo(false);
+  assert(s.Add("e", &echo));
+
+  coap::PDU rsp;
+  f.Request(coap::Type::NON, coap::Code::GET, 0x0101, "e");
+  assert(f.Response(s, rsp));
+  assert(rsp.type() == coap::Type::NON);
+  assert((rsp.token() == std::vector<uint8_t>{ 0x01, 0x01, 0xAA }));
+}
+
+void test_ok_slow_handlers_dont_block() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Slow slow;
+  Echo fast(true);
+  assert(s.Add("slow", &slow));
+  assert(s.Add("fast", &fast));
+
+  // Fill both workers, then a fast request overtakes them all.
+  for (uint16_t i = 0; i < 10; ++i)
+    f.Request(coap::Type::CON, coap::Code::PUT, 0x100 + i, "slow");
+  f.Request(coap::Type::CON, coap::Code::GET, 0x200, "fast");
+
+  coap::PDU first;
+  assert(f.Response(s, first));
+  assert(first.message_id() == 0x200);
+
+  size_t got = 0;
+  for (int i = 0; i < 100 && got < 10; ++i) {
+    coap::PDU rsp;
+    if (f.Response(s, rsp)) {
+      assert(rsp.code() == coap::Code::Changed);
+      ++got;
+    }
+  }
+  assert(got == 10);
+}
+
+void test_ok_errors_and_ping() {
+  Fixture f;
+  Server s(f.transport.get(), nullptr);
+  Lazy lazy;
+  assert(s.Add("lazy", &lazy));
+
+  coap::PDU nf;
+  f.Request(coap::Type::CON, coap::Code::GET, 1, "nope");
+  assert(f.Response(s, nf));
+  assert(nf.code() == coap::Code::NotFound);
+
+  coap::PDU ise;
+  f.Request(coap::Type::CON, coap::Code::GET, 2, "lazy");
+  assert(f.Response(s, ise));
+  assert(ise.code() == coap::Code::InternalServerError);
+
+  coap::PDU rst;
+  f.Request(coap::Type::CON, coap::Code::Empty, 3, "");
+  assert(f.Response(s, rst));
+  assert(rst.type() == coap::Type::RST);
+  assert(rst.message_id() == 3);
+  assert(s.empties() == 1);
+
+  // Empty ACKs and RSTs are taken in and dropped: no exchanges here.
+  f.Request(coap::Type::ACK, coap::Code::Empty, 4, "");
+  f.Request(coap::Type::RST, coap::Code::Empty, 5, "");
+  coap::PDU none;
+  assert(!f.Response(s, none));
+  assert(s.empties() == 3);
+}
+
+void test_ok_garbage() {
+  Fixture f;
+  Server s(f.transport.get(), nullptr);
+  Echo echo(true);
+  assert(s.Add("echo", &echo));
+
+  // Arrive in the same batch as the request, and never get decoded.
+  f.Raw({ 0x40, 0x01 });                          // short
+  f.Raw({ 0xC0, 0x01, 0x00, 0x01 });              // version 3
+  f.Raw({ 0x4F, 0x01, 0x00, 0x02 });              // TKL 15
+  f.Raw({ 0x40, 0xE0, 0x00, 0x03 });              // 7.00
+  f.Request(coap::Type::CON, coap::Code::GET, 4, "echo", "hi");
+
+  coap::PDU rsp;
+  assert(f.Response(s, rsp));
+  assert(rsp.message_id() == 4);
+  assert(s.malformed() == 4);
+  assert(s.handled_inline() == 1);
+}
+
+void test_ok_rate_limited() {
+  Fixture f;
+  Server s(f.transport.get(), nullptr);
+  Echo echo(true);
+  assert(s.Add("echo", &echo));
+
+  // Flagged on the second, with no tokens coming: RSTs from then on.
+  RateLimit policy = { 2, 1000, 0, 1, true };
+  RateLimiter limiter(policy);
+  s.set_rate_limiter(&limiter);
+
+  f.Request(coap::Type::CON, coap::Code::GET, 1, "echo", "hi");
+  f.Request(coap::Type::CON, coap::Code::GET, 2, "echo", "hi");
+  f.Request(coap::Type::NON, coap::Code::GET, 3, "echo", "hi");
+
+  coap::PDU ok, rst, none;
+  assert(f.Response(s, ok));
+  assert(ok.code() == coap::Code::Content && ok.message_id() == 1);
+  assert(f.Response(s, rst));
+  assert(rst.type() == coap::Type::RST && rst.message_id() == 2);
+  assert(rst.token().empty());
+
+  // NONs just go.
+  assert(!f.Response(s, none));
+  assert(limiter.limited() == 2);
+  assert(echo.calls_ == 1);
+
+  s.set_rate_limiter(nullptr);
+  f.Request(coap::Type::CON, coap::Code::GET, 4, "echo", "hi");
+  assert(f.Response(s, ok));
+  assert(ok.message_id() == 4);
+}
+
+void test_ok_trace() {
+  Fixture f;
+  Server s(f.transport.get(), nullptr);
+  Echo echo(true);
+  assert(s.Add("echo", &echo));
+
+  std::string path = "/tmp/server_unittest." + std::to_string(getpid());
+  trace::TraceWriter writer;
+  assert(writer.Open(path, reinterpret_cast<sockaddr*>(&f.addr)));
+  s.set_trace(&writer);
+
+  f.Raw({ 0xC0, 0x01, 0x00, 0x01 });              // version 3
+  f.Request(coap::Type::CON, coap::Code::GET, 2, "echo", "hi");
+
+  coap::PDU rsp;
+  assert(f.Response(s, rsp));
+  s.set_trace(nullptr);
+  assert(writer.Close());
+  assert(writer.recorded() == 2);
+
+  trace::TraceReader reader;
+  assert(reader.Open(path));
+  assert(reader.header().local_port == ntohs(f.addr.sin_port));
+
+  trace::Record rec;
+  size_t decoded = 0, rejected = 0;
+  while (reader.Next(rec)) {
+    if (rec.verdict == trace::Verdict::decoded) {
+      ++decoded;
+      assert(rec.size > 4 && rec.data[3] == 2);
+    } else {
+      ++rejected;
+      assert(rec.size == 4 && rec.data[0] == 0xC0);
+    }
+    assert(rec.peer.ss_family == AF_INET);
+  }
+  assert(decoded == 1 && rejected == 1);
+  unlink(path.c_str());
+}
+
+void test_ok_load_shedding() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Stuck stuck;
+  assert(s.Add("stuck", &stuck));
+
+  LoadShedding policy = { 4, 1, 100000 };
+  s.set_load_shedding(policy);
+  s.set_piggyback(kAlwaysPiggyback);
+
+  for (uint16_t i = 0; i < 4; ++i)
+    f.Request(coap::Type::CON, coap::Code::GET, 0x10 + i, "stuck");
+  for (int i = 0; i < 10 && s.in_progress() < 4; ++i)
+    s.RunOnce(5);
+  assert(s.in_progress() == 4);
+  assert(s.overloaded());
+
+  // CONs are rejected with a 5.03 and a Max-Age.
+  coap::PDU rsp;
+  f.Request(coap::Type::CON, coap::Code::GET, 0x20, "stuck");
+  assert(f.Response(s, rsp));
+  assert(rsp.type() == coap::Type::ACK);
+  assert(rsp.code() == coap::Code::ServiceUnavailable);
+  assert(rsp.message_id() == 0x20);
+  assert((rsp.token() == std::vector<uint8_t>{ 0x00, 0x20, 0xAA }));
+  std::vector<coap::Option> max_age;
+  assert(rsp.options().LookUp(coap::OptionNumber::Max_Age, max_age));
+  uint64_t secs;
+  assert(max_age.size() == 1 && max_age[0].value_uint(secs) && secs >= 1);
+  assert(s.rejected() == 1);
+
+  // NONs are dropped.
+  f.Request(coap::Type::NON, coap::Code::GET, 0x21, "stuck");
+  coap::PDU none;
+  assert(!f.Response(s, none));
+  assert(s.dropped() == 1);
+
+  // Pings are still answered.
+  coap::PDU rst;
+  f.Request(coap::Type::CON, coap::Code::Empty, 0x22, "");
+  assert(f.Response(s, rst));
+  assert(rst.type() == coap::Type::RST);
+
+  // Once the backlog is gone, so is the overload.
+  stuck.release_ = true;
+  for (int i = 0; i < 4; ++i) {
+    coap::PDU ok;
+    assert(f.Response(s, ok));
+    assert(ok.code() == coap::Code::Content);
+  }
+  assert(s.in_progress() == 0);
+  assert(!s.overloaded());
+
+  coap::PDU ok;
+  f.Request(coap::Type::CON, coap::Code::GET, 0x23, "stuck");
+  assert(f.Response(s, ok));
+  assert(ok.code() == coap::Code::Content);
+}
+
+void test_ok_priorities() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Stuck stuck;
+  Recorder rec, bulk(true, &rec);
+  assert(s.Add("stuck", &stuck));
+  assert(s.Add("rec", &rec));
+  assert(s.Add("bulk", &bulk));
+
+  // One at a time on the executor, held up by the first.
+  Priorities policy = { { 2, 1, 1 }, 100000, 1 };
+  s.set_priorities(policy);
+  f.Request(coap::Type::CON, coap::Code::GET, 1, "stuck");
+  for (int i = 0; i < 10 && s.in_progress() < 1; ++i)
+    s.RunOnce(5);
+
+  f.Request(coap::Type::NON, coap::Code::GET, 10, "rec");
+  f.Request(coap::Type::NON, coap::Code::GET, 11, "rec");
+  f.Request(coap::Type::CON, coap::Code::POST, 12, "bulk");
+  f.Request(coap::Type::CON, coap::Code::GET, 13, "rec");
+  f.Request(coap::Type::CON, coap::Code::GET, 14, "rec");
+  f.Request(coap::Type::CON, coap::Code::GET, 15, "rec");
+  for (int i = 0; i < 10 && s.queued() < 6; ++i)
+    s.RunOnce(5);
+  assert(s.queued() == 6 && s.in_progress() == 7);
+
+  stuck.release_ = true;
+  for (int i = 0; i < 7; ++i) {
+    coap::PDU rsp;
+    assert(f.Response(s, rsp));
+  }
+
+  // Two CONs a round (the first round began with the stuck one), then
+  // one NON or bulk request.
+  std::vector<uint16_t> want = { 13, 10, 14, 15, 11, 12 };
+  assert(rec.order() == want);
+  assert(s.offloaded() == 7 && s.queued() == 0);
+}
+
+void test_ok_max_wait() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Stuck stuck;
+  Recorder rec;
+  assert(s.Add("stuck", &stuck));
+  assert(s.Add("rec", &rec));
+
+  // Everybody has waited long enough: first come, first served.
+  Priorities policy = { { 8, 2, 1 }, 0, 1 };
+  s.set_priorities(policy);
+  f.Request(coap::Type::CON, coap::Code::GET, 1, "stuck");
+  for (int i = 0; i < 10 && s.in_progress() < 1; ++i)
+    s.RunOnce(5);
+
+  f.Request(coap::Type::NON, coap::Code::GET, 10, "rec");
+  for (int i = 0; i < 10 && s.queued() < 1; ++i)
+    s.RunOnce(5);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  f.Request(coap::Type::CON, coap::Code::GET, 11, "rec");
+  for (int i = 0; i < 10 && s.queued() < 2; ++i)
+    s.RunOnce(5);
+
+  stuck.release_ = true;
+  for (int i = 0; i < 3; ++i) {
+    coap::PDU rsp;
+    assert(f.Response(s, rsp));
+  }
+  assert((rec.order() == std::vector<uint16_t>{ 10, 11 }));
+}
+
+void test_ok_preempt() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Stuck stuck;
+  Recorder rec;
+  assert(s.Add("stuck", &stuck));
+  assert(s.Add("rec", &rec));
+
+  Priorities policy = kDefaultPriorities;
+  policy.window = 1;
+  s.set_priorities(policy);
+  LoadShedding never = { kMaxInProgress + 1, kMaxInProgress, UINT32_MAX };
+  s.set_load_shedding(never);
+  s.set_piggyback(kAlwaysPiggyback);
+
+  // Every Call taken, the last ones by NONs waiting.
+  f.Request(coap::Type::CON, coap::Code::GET, 0, "stuck");
+  for (int i = 0; i < 10 && s.in_progress() < 1; ++i)
+    s.RunOnce(5);
+  for (uint16_t i = 1; i < kMaxInProgress; ++i) {
+    f.Request(coap::Type::NON, coap::Code::GET, i, "rec");
+    if (i % 64 == 0)
+      s.RunOnce(0);
+  }
+  for (int i = 0; i < 10 && s.in_progress() < kMaxInProgress; ++i)
+    s.RunOnce(5);
+  assert(s.in_progress() == kMaxInProgress);
+
+  // A CON takes the place of the last NON, another NON is dropped.
+  f.Request(coap::Type::CON, coap::Code::GET, 5000, "rec");
+  f.Request(coap::Type::NON, coap::Code::GET, 5001, "rec");
+  for (int i = 0; i < 10 && s.dropped() < 1; ++i)
+    s.RunOnce(5);
+  assert(s.preempted() == 1 && s.dropped() == 1);
+
+  stuck.release_ = true;
+  coap::PDU rsp;
+  while (f.Response(s, rsp) && s.in_progress() > 0) { }
+  std::vector<uint16_t> order = rec.order();
+  assert(order.size() == kMaxInProgress - 1);
+  assert(order[0] == 5000);
+  assert(std::find(order.begin(), order.end(), kMaxInProgress - 1) ==
+         order.end());
+}
+
+void test_ok_preempt_acknowledged() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Stuck stuck;
+  Recorder rec, bulk(true, &rec);
+  assert(s.Add("stuck", &stuck));
+  assert(s.Add("rec", &rec));
+  assert(s.Add("bulk", &bulk));
+
+  Priorities policy = kDefaultPriorities;
+  policy.window = 1;
+  s.set_priorities(policy);
+  LoadShedding never = { kMaxInProgress + 1, kMaxInProgress, UINT32_MAX };
+  s.set_load_shedding(never);
+  Piggyback separate = { 0, 0 };
+  s.set_piggyback(separate);
+
+  // Every Call taken, the last ones by CONs waiting in a lane behind,
+  // but acknowledged already.
+  f.Request(coap::Type::CON, coap::Code::GET, 0, "stuck");
+  for (int i = 0; i < 10 && s.in_progress() < 1; ++i)
+    s.RunOnce(5);
+  for (uint16_t i = 1; i < kMaxInProgress; ++i) {
+    f.Request(coap::Type::CON, coap::Code::POST, i, "bulk");
+    if (i % 64 == 0)
+      s.RunOnce(0);
+  }
+  for (int i = 0; i < 10 && s.in_progress() < kMaxInProgress; ++i)
+    s.RunOnce(5);
+  assert(s.in_progress() == kMaxInProgress);
+  assert(s.separated() == kMaxInProgress);
+
+  // Their peer won't retry them: the newcomer is the one dropped.
+  f.Request(coap::Type::CON, coap::Code::GET, 5000, "rec");
+  for (int i = 0; i < 10 && s.dropped() < 1; ++i)
+    s.RunOnce(5);
+  assert(s.preempted() == 0 && s.dropped() == 1);
+  stuck.release_ = true;
+}
+
+void test_ok_piggyback() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Slow slow;
+  Stuck stuck;
+  assert(s.Add("slow", &slow));
+  assert(s.Add("stuck", &stuck));
+
+  Piggyback policy = { 20, 100 };
+  s.set_piggyback(policy);
+  assert(s.PiggybackWindow(&slow) == 100);
+
+  // In time: on the ACK.
+  coap::PDU rsp;
+  f.Request(coap::Type::CON, coap::Code::PUT, 1, "slow");
+  assert(f.Response(s, rsp));
+  assert(rsp.type() == coap::Type::ACK && rsp.code() == coap::Code::Changed);
+  assert(rsp.message_id() == 1);
+  assert(s.piggybacked() == 1 && s.separated() == 0);
+
+  // Learnt: 5 ms or so, give or take.
+  uint32_t window = s.PiggybackWindow(&slow);
+  assert(window >= 20 && window < 100);
+
+  // Too late: an empty ACK first, then a CON of its own.
+  coap::PDU ack;
+  f.Request(coap::Type::CON, coap::Code::GET, 2, "stuck");
+  assert(f.Response(s, ack));
+  assert(ack.type() == coap::Type::ACK && ack.code() == coap::Code::Empty);
+  assert(ack.message_id() == 2);
+  assert(s.separated() == 1);
+
+  // Well over the window by the time it's done.
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  stuck.release_ = true;
+  coap::PDU con;
+  assert(f.Response(s, con));
+  assert(con.type() == coap::Type::CON && con.code() == coap::Code::Content);
+  assert((con.token() == std::vector<uint8_t>{ 0x00, 0x02, 0xAA }));
+  assert(s.unacked() == 1 && s.in_progress() == 1);
+
+  f.Raw({ 0x60, 0x00, uint8_t(con.message_id() >> 8),
+          uint8_t(con.message_id()) });
+  for (int i = 0; i < 10 && s.unacked() > 0; ++i)
+    s.RunOnce(5);
+  assert(s.unacked() == 0);
+
+  // Over 100 ms on average: acknowledged right away.
+  assert(s.PiggybackWindow(&stuck) == 0);
+  f.Request(coap::Type::CON, coap::Code::GET, 3, "stuck");
+  assert(f.Response(s, ack));
+  assert(ack.code() == coap::Code::Empty && ack.message_id() == 3);
+  assert(f.Response(s, con));
+  assert(con.type() == coap::Type::CON && con.message_id() != 3);
+  assert(s.separated() == 2 && s.piggybacked() == 1);
+
+  // A RST does as well as an ACK.
+  f.Raw({ 0x70, 0x00, uint8_t(con.message_id() >> 8),
+          uint8_t(con.message_id()) });
+  for (int i = 0; i < 10 && s.unacked() > 0; ++i)
+    s.RunOnce(5);
+  assert(s.unacked() == 0);
+}
+
+void test_ok_separate_retransmitted() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Slow slow;
+  assert(s.Add("slow", &slow));
+
+  Piggyback never = { 0, 0 };
+  s.set_piggyback(never);
+
+  coap::PDU ack, con;
+  uint64_t sent = Server::NowMs();
+  f.Request(coap::Type::CON, coap::Code::PUT, 1, "slow");
+  assert(f.Response(s, ack));
+  assert(ack.code() == coap::Code::Empty);
+  assert(f.Response(s, con));
+  assert(con.type() == coap::Type::CON);
+
+  // Not acknowledged: again after ACK_TIMEOUT to ACK_TIMEOUT *
+  // ACK_RANDOM_FACTOR, then twice as long each time.
+  s.Tick(sent + kAckTimeoutMs - 1);
+  assert(s.retransmitted() == 0);
+
+  uint64_t now = Server::NowMs();
+  uint64_t timeout = kAckTimeoutMs * kAckRandomFactor;
+  for (unsigned i = 1; i <= kMaxRetransmit; ++i) {
+    s.Tick(now += timeout);
+    assert(s.retransmitted() == i && s.unacked() == 1);
+    coap::PDU again;
+    assert(f.Response(s, again));
+    assert(again.message_id() == con.message_id());
+    timeout *= 2;
+  }
+
+  // Then given up on.
+  s.Tick(now += timeout);
+  assert(s.retransmitted() == kMaxRetransmit);
+  assert(s.unacked() == 0 && s.in_progress() == 0);
+}
+
+void test_ok_unacked_capped() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Echo echo(false);
+  assert(s.Add("echo", &echo));
+
+  Piggyback never = { 0, 0 };
+  s.set_piggyback(never);
+
+  // Never acknowledged: up to kMaxUnacked hold their Call, in progress
+  // as far as load shedding goes, the rest go NON.
+  const size_t n = kMaxUnacked + 10;
+  for (uint16_t i = 0; i < n; ++i) {
+    f.Request(coap::Type::CON, coap::Code::GET, i, "echo");
+    if (i % 64 == 0)
+      s.RunOnce(0);
+  }
+  for (int i = 0; i < 100 && s.unacked() + s.unconfirmed() < n; ++i)
+    s.RunOnce(5);
+  assert(s.separated() == n);
+  assert(s.unacked() == kMaxUnacked && s.unconfirmed() == 10);
+  assert(s.in_progress() == kMaxUnacked);
+}
+
+void test_ok_removed_latency_forgotten() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Stuck stuck;
+  assert(s.Add("stuck", &stuck));
+  assert(s.Add("also/stuck", &stuck));
+
+  // Removed from one path, still served at the other.
+  coap::PDU rsp;
+  stuck.release_ = true;
+  f.Request(coap::Type::CON, coap::Code::GET, 1, "stuck");
+  assert(f.Response(s, rsp));
+  assert(s.Remove("stuck"));
+  assert(s.PiggybackWindow(&stuck) != kDefaultPiggyback.max_window_ms);
+
+  // Removed while a call to it was in progress: not learnt from.
+  stuck.release_ = false;
+  f.Request(coap::Type::CON, coap::Code::GET, 2, "also/stuck");
+  for (int i = 0; i < 10 && s.in_progress() < 1; ++i)
+    s.RunOnce(5);
+  assert(s.Remove("also/stuck"));
+  assert(s.PiggybackWindow(&stuck) == kDefaultPiggyback.max_window_ms);
+  stuck.release_ = true;
+  assert(f.Response(s, rsp));
+  assert(rsp.code() == coap::Code::Content);
+  assert(s.PiggybackWindow(&stuck) == kDefaultPiggyback.max_window_ms);
+}
+
+void test_ok_well_known_core() {
+  Fixture f;
+  Server s(f.transport.get(), &f.executor);
+  Echo temp(false), light(true);
+  assert(s.Add("sensors/temp", &temp, "rt=\"temperature\";ct=0"));
+  assert(s.Add("sensors/light", &light));
+  assert(!s.Add("fw", &light, "rt=\"unterminated"));
+
+  coap::PDU rsp;
+  f.Request(coap::Type::CON, coap::Code::GET, 0x40, ".well-known/core");
+  assert(f.Response(s, rsp));
+  assert(rsp.code() == coap::Code::Content);
+  std::string doc = "</sensors/temp>;rt=\"temperature\";ct=0,</sensors/light>";
+  assert(rsp.payload() == std::vector<uint8_t>(doc.begin(), doc.end()));
+  assert(s.well_known_core().document() == doc);
+
+  // Not served, not listed.
+  coap::PDU fw;
+  f.Request(coap::Type::CON, coap::Code::GET, 0x41, "fw");
+  assert(f.Response(s, fw));
+  assert(fw.code() == coap::Code::NotFound);
+
+  assert(s.Remove("sensors/temp"));
+  assert(!s.Remove("sensors/temp"));
+  coap::PDU gone;
+  f.Request(coap::Type::CON, coap::Code::GET, 0x42, "sensors/temp");
+  assert(f.Response(s, gone));
+  assert(gone.code() == coap::Code::NotFound);
+  assert(s.well_known_core().document() == "</sensors/light>");
+
+  coap::PDU post;
+  f.Request(coap::Type::CON, coap::Code::POST, 0x43, ".well-known/core");
+  assert(f.Response(s, post));
+  assert(post.code() == coap::Code::MethodNotAllowed);
+}
+
+int main() {
+  init_log();
+
+  test_ok_inline_and_offloaded();
+  test_ok_non();
+  test_ok_slow_handlers_dont_block();
+  test_ok_errors_and_ping();
+  test_ok_garbage();
+  test_ok_rate_limited();
+  test_ok_trace();
+  test_ok_load_shedding();
+  test_ok_priorities();
+  test_ok_max_wait();
+  test_ok_preempt();
+  test_ok_preempt_acknowledged();
+  test_ok_piggyback();
+  test_ok_separate_retransmitted();
+  test_ok_unacked_capped();
+  test_ok_removed_latency_forgotten();
+  test_ok_well_known_core();
+}
@@ -0,0 +1,292 @@
+// Copyleft 2013 tho@autistici.org
+
+// Goodput under overload, with and without load shedding.
+//
+// The server's only resource burns service_us of CPU per request, on
+// an executor of `workers` threads.  Capacity is first measured with a
+// closed-loop client; then an open-loop client offers 0.5x to 3x that
+// rate for a few seconds.  A response is good if it is a 2.05 that
+// arrives within the client's deadline: anything later is as useless
+// as no answer, since the client has retransmitted or given up.
+//
+// Usage: shed_bench [service_us [workers [seconds [deadline_ms]]]]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "coap/pdu.h"
+#include "server/server.h"
+
+using namespace server;
+
+typedef std::chrono::steady_clock Clock;
+
+class Work : public Resource {
+ public:
+  explicit Work(int us) : us_(us) { }
+
+  void Handle(const coap::PDUView&, coap::PDU& rsp) {
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us_);
+    while (Clock::now() < until) { }
+    rsp.set_code(coap::Code::Content);
+  }
+
+ private:
+  int us_;
+};
+
+struct Params {
+  int service_us;
+  size_t workers;
+  double seconds;
+  int deadline_ms;
+};
+
+struct Result {
+  double offered;     // req/s
+  double goodput;     // good responses/s
+  double rejected;    // 5.03/s
+  size_t late;
+  double p99_ms;      // of the good ones
+};
+
+// A server with its own I/O thread, for the duration of one run.
+class Harness {
+ public:
+  Harness(const Params& params, bool shed)
+    : transport_(net::NewTransport(net::Backend::any))
+    , executor_(params.workers)
+    , work_(params.service_us)
+    , stop_(false) {
+    memset(&addr_, 0, sizeof addr_);
+    addr_.sin_family = AF_INET;
+    addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(transport_->Open(reinterpret_cast<sockaddr*>(&addr_),
+                            sizeof addr_));
+    socklen_t len = sizeof addr_;
+    assert(getsockname(transport_->fd(), reinterpret_cast<sockaddr*>(&addr_),
+                       &len) == 0);
+
+    assert(executor_.Start());
+    server_.reset(new Server(transport_.get(), &executor_));
+    server_->Add("work", &work_);
+
+    if (shed) {
+      // Keep the queueing delay well inside the client's deadline.
+      LoadShedding policy = kDefaultLoadShedding;
+      policy.max_delay_ms = params.deadline_ms / 4;
+      server_->set_load_shedding(policy);
+    } else {
+      LoadShedding never = { kMaxInProgress + 1, kMaxInProgress, UINT32_MAX };
+      server_->set_load_shedding(never);
+    }
+
+    io_ = std::thread([this] {
+      while (!stop_)
+        server_->RunOnce(10);
+    });
+  }
+
+  ~Harness() {
+    stop_ = true;
+    transport_->Wake();
+    io_.join();
+    server_.reset();
+    executor_.Stop();
+  }
+
+  const sockaddr_in& addr() const { return addr_; }
+
+ private:
+  std::unique_ptr<net::Transport> transport_;
+  Executor executor_;
+  Work work_;
+  std::unique_ptr<Server> server_;
+  sockaddr_in addr_;
+  std::atomic<bool> stop_;
+  std::thread io_;
+};
+
+std::vector<uint8_t> request() {
+  coap::PDU pdu;
+  pdu.set_code(coap::Code::GET);
+  pdu.set_token({ 0, 0, 0, 0 });
+  coap::Options opts;
+  opts.AddUriPath("work");
+  pdu.set_options(opts);
+
+  std::vector<uint8_t> buf;
+  assert(pdu.Encode(buf));
+  return buf;
+}
+
+void stamp(std::vector<uint8_t>& req, uint32_t seq) {
+  req[2] = seq >> 8;
+  req[3] = seq;
+  req[4] = seq >> 24;
+  req[5] = seq >> 16;
+  req[6] = seq >> 8;
+  req[7] = seq;
+}
+
+uint32_t seq_of(const uint8_t* rsp) {
+  return (rsp[4] << 24) | (rsp[5] << 16) | (rsp[6] << 8) | rsp[7];
+}
+
+int client_socket(const sockaddr_in& addr) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(fd != -1);
+  assert(connect(fd, reinterpret_cast<const sockaddr*>(&addr),
+                 sizeof addr) == 0);
+  int rcvbuf = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  timeval tv = { 0, 100000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  return fd;
+}
+
+// Closed loop, enough requests in flight to keep the workers busy.
+double capacity(const Params& params) {
+  Harness h(params, false);
+  int fd = client_socket(h.addr());
+  std::vector<uint8_t> req = request();
+
+  size_t window = 2 * params.workers, sent = 0, done = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + std::chrono::seconds(1);
+
+  while (Clock::now() < end) {
+    while (sent - done < window) {
+      stamp(req, sent++);
+      send(fd, req.data(), req.size(), 0);
+    }
+
+    uint8_t buf[net::kMaxDatagramSize];
+    if (recv(fd, buf, sizeof buf, 0) >= 4)
+      ++done;
+    else
+      done = sent;
+  }
+
+  close(fd);
+
+  return done / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+Result run(const Params& params, bool shed, double rate) {
+  Harness h(params, shed);
+  int fd = client_socket(h.addr());
+
+  size_t total = rate * params.seconds;
+  std::vector<Clock::time_point> sent_at(total);
+  std::atomic<bool> sending(true);
+
+  Clock::time_point start = Clock::now();
+
+  std::thread sender([&] {
+    std::vector<uint8_t> req = request();
+
+    for (size_t i = 0; i < total; ++i) {
+      Clock::time_point when =
+          start + std::chrono::nanoseconds(static_cast<int64_t>(i * 1e9 / rate));
+      std::this_thread::sleep_until(when);
+      stamp(req, i);
+      sent_at[i] = Clock::now();
+      send(fd, req.data(), req.size(), 0);
+    }
+    sending = false;
+  });
+
+  std::vector<double> good_ms;
+  size_t rejected = 0, late = 0;
+  Clock::time_point quiet_since = Clock::now();
+  Clock::time_point last = start;
+
+  // Until the sender is done and nothing has come back for a while.
+  while (sending ||
+         Clock::now() - quiet_since <
+             std::chrono::milliseconds(2 * params.deadline_ms)) {
+    uint8_t buf[net::kMaxDatagramSize];
+    ssize_t n = recv(fd, buf, sizeof buf, 0);
+
+    if (n < 8 || (buf[0] & 0x0F) != 4)
+      continue;
+
+    last = quiet_since = Clock::now();
+    uint32_t seq = seq_of(buf);
+    if (seq >= total)
+      continue;
+
+    if (buf[1] == coap::Code::ServiceUnavailable) {
+      ++rejected;
+      continue;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(
+        Clock::now() - sent_at[seq]).count();
+
+    if (ms <= params.deadline_ms)
+      good_ms.push_back(ms);
+    else
+      ++late;
+  }
+
+  sender.join();
+  close(fd);
+
+  // Rates over the whole run, backlog included.
+  double elapsed = std::chrono::duration<double>(last - start).count();
+  elapsed = std::max(elapsed, params.seconds);
+
+  Result r;
+  r.offered = rate;
+  r.goodput = good_ms.size() / elapsed;
+  r.rejected = rejected / elapsed;
+  r.late = late;
+  r.p99_ms = 0;
+
+  if (!good_ms.empty()) {
+    size_t i = std::min(good_ms.size() - 1,
+                        static_cast<size_t>(0.99 * good_ms.size()));
+    std::nth_element(good_ms.begin(), good_ms.begin() + i, good_ms.end());
+    r.p99_ms = good_ms[i];
+  }
+
+  return r;
+}
+
+int main(int argc, char* argv[]) {
+  Params params;
+  params.service_us = argc > 1 ? atoi(argv[1]) : 1000;
+  params.workers = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2;
+  params.seconds = argc > 3 ? atof(argv[3]) : 2;
+  params.deadline_ms = argc > 4 ? atoi(argv[4]) : 500;
+
+  double cap = capacity(params);
+
+  printf("service %d us, %zu workers, deadline %d ms: capacity %.0f req/s\n",
+         params.service_us, params.workers, params.deadline_ms, cap);
+  printf("%-6s %-9s %10s %10s %10s %8s %8s\n", "load", "shedding",
+         "offered/s", "good/s", "5.03/s", "late", "p99 ms");
+
+  const double loads[] = { 0.5, 1, 2, 3 };
+
+  for (double load : loads) {
+    for (int shed = 0; shed < 2; ++shed) {
+      Result r = run(params, shed, load * cap);
+      printf("%-6.1f %-9s %10.0f %10.0f %10.0f %8zu %8.1f\n", load,
+             shed ? "on" : "off", r.offered, r.goodput, r.rejected, r.late,
+             r.p99_ms);
+    }
+  }
+}
@@ -0,0 +1,93 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef SERVER_SPSC_QUEUE_H_
+#define SERVER_SPSC_QUEUE_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <vector>
+
+namespace server {
+
+// Bounded lock-free queue for exactly one producer thread and one
+// consumer thread.  Capacity is rounded up to a power of two.
+//
+// Head and tail are padded apart onto cache lines of their own (no
+// alignas: pre-C++17 operator new ignores over-alignment), and each
+// side keeps a private copy of the other side's index, so that the
+// shared lines only move between cores when the queue looks full
+// (producer) or empty (consumer).
+template <typename Tp>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity)
+    : mask_(RoundUp(capacity) - 1)
+    , slots_(mask_ + 1)
+    , head_(0)
+    , cached_tail_(0)
+    , tail_(0)
+    , cached_head_(0)
+  { }
+
+  // Producer side.  Return false if the queue is full.
+  bool TryPush(const Tp& v) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_)
+        return false;
+    }
+
+    slots_[tail & mask_] = v;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.  Return false if the queue is empty.
+  bool TryPop(Tp& v) {
+    size_t head = head_.load(std::memory_order_relaxed);
+
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_)
+        return false;
+    }
+
+    v = slots_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+ private:
+  static size_t RoundUp(size_t n) {
+    size_t p = 1;
+    while (p < n)
+      p <<= 1;
+    return p;
+  }
+
+ private:
+  static const size_t kCacheLine = 64;
+
+  const size_t mask_;
+  std::vector<Tp> slots_;
+  char pad0_[kCacheLine];
+
+  // Consumer
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+  char pad1_[kCacheLine];
+
+  // Producer
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  char pad2_[kCacheLine];
+};
+
+}   // namespace server
+
+#endif  // SERVER_SPSC_QUEUE_H_
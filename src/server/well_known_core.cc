@@ -0,0 +1,364 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "coap/block.h"
+#include "coap/link_format.h"
+#include "utils/log.h"
+#include "server/well_known_core.h"
+
+namespace server {
+
+namespace {
+
+// Filters a request may carry, one bit each in Matches().
+const size_t kMaxFilters = 32;
+
+// "/" and path, percent-encoded where a link target needs it.
+std::string Target(const std::string& path) {
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string target = "/";
+
+  for (unsigned char c : path) {
+    if (isalnum(c) || strchr("-._~!$&'()*+=:@/", c)) {
+      target += c;
+    } else {
+      target += '%';
+      target += kHex[c >> 4];
+      target += kHex[c & 0x0F];
+    }
+  }
+  return target;
+}
+
+bool Equal(const char* a, size_t a_length, const char* b, size_t b_length) {
+  return a_length == b_length && memcmp(a, b, a_length) == 0;
+}
+
+}   // namespace
+
+WellKnownCore::WellKnownCore()
+  : version_(0) {
+}
+
+bool WellKnownCore::Add(const std::string& path,
+                        const std::string& attributes) {
+  if (by_path_.count(path))
+    return false;
+
+  std::string link = "<" + Target(path) + ">";
+  if (!attributes.empty())
+    link += ";" + attributes;
+
+  // One link that parses, and what to index it under: each parameter
+  // by name and by name=value.
+  Link l;
+  coap::LinkCursor cursor(reinterpret_cast<const uint8_t*>(link.data()),
+                          link.size());
+  const char* target;
+  size_t target_length;
+  if (!cursor.NextLink(target, target_length)) {
+    utils::Log::Instance()->Debug("/.well-known/core: bad link for %s",
+                                  path.c_str());
+    return false;
+  }
+  l.keys.push_back("href=" + std::string(target, target_length));
+
+  const char* name;
+  const char* value;
+  size_t name_length, value_length;
+  while (cursor.NextParam(name, name_length, value, value_length)) {
+    std::string key(name, name_length);
+    l.keys.push_back(key);
+    key += '=';
+
+    if (!value) {
+      l.keys.push_back(key);
+    } else if (!coap::IsMultiValueParam(name, name_length)) {
+      l.keys.push_back(key + std::string(value, value_length));
+    } else {
+      for (size_t begin = 0; begin <= value_length; ) {
+        const char* space = static_cast<const char*>(
+            memchr(value + begin, ' ', value_length - begin));
+        size_t end = space ? space - value : value_length;
+        l.keys.push_back(key + std::string(value + begin, end - begin));
+        begin = end + 1;
+      }
+    }
+  }
+  if (cursor.failed() || cursor.NextLink(target, target_length) ||
+      cursor.failed()) {
+    utils::Log::Instance()->Debug("/.well-known/core: bad attributes for %s",
+                                  path.c_str());
+    return false;
+  }
+
+  std::sort(l.keys.begin(), l.keys.end());
+  l.keys.erase(std::unique(l.keys.begin(), l.keys.end()), l.keys.end());
+
+  // Patch the document: append.
+  if (!order_.empty())
+    document_ += ',';
+  l.offset = document_.size();
+  l.length = link.size();
+  document_ += link;
+
+  uint32_t id;
+  if (!free_.empty()) {
+    id = free_.back();
+    free_.pop_back();
+    links_[id] = std::move(l);
+  } else {
+    id = links_.size();
+    links_.push_back(std::move(l));
+  }
+
+  for (const std::string& key : links_[id].keys)
+    index_[key].push_back(id);
+  order_.push_back(id);
+  by_path_[path] = id;
+  ++version_;
+  return true;
+}
+
+bool WellKnownCore::Remove(const std::string& path) {
+  auto it = by_path_.find(path);
+  if (it == by_path_.end())
+    return false;
+
+  uint32_t id = it->second;
+  Link& l = links_[id];
+  auto pos = std::lower_bound(order_.begin(), order_.end(), l.offset,
+      [this](uint32_t other, uint32_t offset) {
+        return links_[other].offset < offset;
+      });
+
+  // Patch the document: cut the link out with the ',' after it, or
+  // before it if it is the last.
+  size_t begin = l.offset;
+  size_t length = l.length;
+  if (pos + 1 != order_.end()) {
+    ++length;
+  } else if (begin > 0) {
+    --begin;
+    ++length;
+  }
+  document_.erase(begin, length);
+
+  for (auto next = pos + 1; next != order_.end(); ++next)
+    links_[*next].offset -= length;
+  order_.erase(pos);
+
+  for (const std::string& key : l.keys) {
+    auto posting = index_.find(key);
+    std::vector<uint32_t>& ids = posting->second;
+    ids.erase(std::find(ids.begin(), ids.end(), id));
+    if (ids.empty())
+      index_.erase(posting);
+  }
+  l.keys.clear();
+
+  free_.push_back(id);
+  by_path_.erase(it);
+  ++version_;
+  return true;
+}
+
+bool WellKnownCore::ParseFilter(const std::string& query, Filter& f) {
+  size_t eq = query.find('=');
+
+  f.name = query.data();
+  f.name_length = std::min(eq, query.size());
+  f.value = eq == std::string::npos ? nullptr : query.data() + eq + 1;
+  f.value_length = f.value ? query.size() - eq - 1 : 0;
+  return f.name_length > 0;
+}
+
+// The shortest list of ids among the filters that are exact, or
+// nullptr if there are none.  none is set if some exact filter has no
+// link at all.
+const std::vector<uint32_t>* WellKnownCore::Candidates(
+    const std::vector<Filter>& filters, bool& none) const {
+  const std::vector<uint32_t>* shortest = nullptr;
+  std::string key;
+  none = false;
+
+  for (const Filter& f : filters) {
+    if (f.value_length > 0 && f.value[f.value_length - 1] == '*')
+      continue;
+
+    key.assign(f.name, f.name_length);
+    if (f.value) {
+      key += '=';
+      key.append(f.value, f.value_length);
+    }
+
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      none = true;
+      return nullptr;
+    }
+    if (!shortest || it->second.size() < shortest->size())
+      shortest = &it->second;
+  }
+  return shortest;
+}
+
+// Whether link id matches all filters, read in place.
+bool WellKnownCore::Matches(uint32_t id,
+                            const std::vector<Filter>& filters) const {
+  const Link& l = links_[id];
+  coap::LinkCursor cursor(
+      reinterpret_cast<const uint8_t*>(document_.data()) + l.offset,
+      l.length);
+  uint32_t matched = 0;
+  const uint32_t all = filters.size() == kMaxFilters
+                           ? ~0U : (1U << filters.size()) - 1;
+
+  const char* target;
+  size_t target_length;
+  cursor.NextLink(target, target_length);
+  for (size_t i = 0; i < filters.size(); ++i) {
+    const Filter& f = filters[i];
+    if (Equal(f.name, f.name_length, "href", 4) &&
+        (!f.value || coap::MatchLinkParam("href", 4, target, target_length,
+                                          f.value, f.value_length)))
+      matched |= 1U << i;
+  }
+
+  const char* name;
+  const char* value;
+  size_t name_length, value_length;
+  while (matched != all &&
+         cursor.NextParam(name, name_length, value, value_length)) {
+    if (!value) {
+      value = "";
+      value_length = 0;
+    }
+
+    for (size_t i = 0; i < filters.size(); ++i) {
+      const Filter& f = filters[i];
+      if (!(matched & (1U << i)) &&
+          Equal(f.name, f.name_length, name, name_length) &&
+          (!f.value || coap::MatchLinkParam(name, name_length, value,
+                                            value_length, f.value,
+                                            f.value_length)))
+        matched |= 1U << i;
+    }
+  }
+
+  return matched == all;
+}
+
+bool WellKnownCore::Read(const std::vector<std::string>& queries,
+                         size_t offset, size_t size, std::string& out,
+                         bool& more) const {
+  out.clear();
+  more = false;
+
+  if (queries.size() > kMaxFilters)
+    return false;
+
+  std::vector<Filter> filters(queries.size());
+  for (size_t i = 0; i < queries.size(); ++i)
+    if (!ParseFilter(queries[i], filters[i]))
+      return false;
+
+  // The document as it is.
+  if (filters.empty()) {
+    if (offset < document_.size())
+      out.assign(document_, offset, size);
+    more = offset + size < document_.size();
+    return true;
+  }
+
+  bool none;
+  const std::vector<uint32_t>* candidates = Candidates(filters, none);
+  if (none)
+    return true;
+  if (!candidates)
+    candidates = &order_;
+
+  // The matching links back to back, of which only the bytes in
+  // [offset, end) are copied.
+  const size_t end = offset + size;
+  size_t pos = 0;
+  auto put = [&](const char* p, size_t n) {
+    if (pos < end && pos + n > offset) {
+      size_t from = pos < offset ? offset - pos : 0;
+      out.append(p + from, std::min(n, end - pos) - from);
+    }
+    pos += n;
+  };
+
+  for (uint32_t id : *candidates) {
+    if (!Matches(id, filters))
+      continue;
+    if (pos >= end) {
+      more = true;
+      break;
+    }
+
+    if (pos > 0)
+      put(",", 1);
+    put(document_.data() + links_[id].offset, links_[id].length);
+  }
+
+  more = more || pos > end;
+  return true;
+}
+
+void WellKnownCore::Handle(const coap::PDUView& req, coap::PDU& rsp) {
+  if (req.code() != coap::Code::GET) {
+    rsp.set_code(coap::Code::MethodNotAllowed);
+    return;
+  }
+
+  std::vector<std::string> queries;
+  coap::Block block = { 0, false, coap::kMaxSzx };
+
+  coap::OptionCursor cursor = req.options();
+  size_t num;
+  const uint8_t* value;
+  size_t length;
+  while (cursor.Next(num, value, length)) {
+    if (num == coap::OptionNumber::Uri_Query) {
+      queries.push_back(std::string(reinterpret_cast<const char*>(value),
+                                    length));
+    } else if (num == coap::OptionNumber::Block2) {
+      coap::Block asked;
+      if (!coap::DecodeBlock(value, length, asked)) {
+        rsp.set_code(coap::Code::BadOption);
+        return;
+      }
+      block.num = asked.num;
+      block.szx = std::min(asked.szx, block.szx);
+    }
+  }
+
+  bool more;
+  if (!Read(queries, block.offset(), block.size(), block_, more)) {
+    rsp.set_code(coap::Code::BadRequest);
+    return;
+  }
+
+  coap::Options opts;
+  opts.AddETag(std::vector<uint8_t>{ uint8_t(version_ >> 24),
+                                     uint8_t(version_ >> 16),
+                                     uint8_t(version_ >> 8),
+                                     uint8_t(version_) });
+  opts.AddContentFormat(coap::kLinkFormat);
+  if (more || block.num > 0) {
+    block.more = more;
+    opts.AddBlock2(coap::EncodeBlock(block));
+  }
+
+  rsp.set_code(coap::Code::Content);
+  rsp.set_options(opts);
+  rsp.set_payload(std::vector<uint8_t>(block_.begin(), block_.end()));
+}
+
+}   // namespace server
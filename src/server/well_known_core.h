@@ -0,0 +1,100 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef SERVER_WELL_KNOWN_CORE_H_
+#define SERVER_WELL_KNOWN_CORE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "server/resource.h"
+
+namespace server {
+
+// /.well-known/core (RFC 6690): the link-format document listing a
+// server's resources, with query filtering and Block2.
+//
+// The document is kept serialised, one link per resource, and patched
+// in place as resources come and go: Add() appends a link, Remove()
+// cuts one out.  An unfiltered GET sends a slice of it as is.
+//
+// Filters (RFC 6690 4.1, several of them must all match) are answered
+// from an index of each attribute value to the links that have it
+// (each space separated value of rt, if and rel on its own): the
+// shortest list among the exact filters gives the candidates, which are
+// checked against the rest by walking their links in place.  Without an
+// exact filter (e.g. rt=temp*) every link is a candidate.  Matching
+// links are copied from the document, never rendered again, and only
+// those bytes that fall into the block asked for.
+//
+// Responses carry the document's version as ETag, so that a client
+// reading block by block can tell if it changed in between.
+//
+// Not thread-safe: Add() and Remove() belong to the thread that serves
+// the requests (Handle() is inline safe).
+class WellKnownCore : public Resource {
+ public:
+  WellKnownCore();
+
+  // List path (Uri-Path segments joined by '/') with link attributes,
+  // e.g. rt="temperature";if="sensor";ct=0 (no leading ';').  False if
+  // the path is listed already or the attributes don't parse.
+  bool Add(const std::string& path, const std::string& attributes);
+
+  bool Remove(const std::string& path);
+
+  // Write bytes [offset, offset + size) of the document, filtered by
+  // queries (Uri-Query values, name=value or name alone), to out.  more
+  // is set if the result goes on.  False if a query is malformed.
+  bool Read(const std::vector<std::string>& queries, size_t offset,
+            size_t size, std::string& out, bool& more) const;
+
+  void Handle(const coap::PDUView& req, coap::PDU& rsp);
+  bool inline_safe() const { return true; }
+
+  const std::string& document() const { return document_; }
+  size_t links() const { return order_.size(); }
+
+  // Changes on every Add() and Remove().
+  uint32_t version() const { return version_; }
+
+ private:
+  struct Link {
+    uint32_t offset;                // in document_, of its '<'
+    uint32_t length;
+    std::vector<std::string> keys;  // in index_
+  };
+
+  struct Filter {
+    const char* name;
+    size_t name_length;
+    const char* value;              // nullptr if name alone
+    size_t value_length;
+  };
+
+  static bool ParseFilter(const std::string& query, Filter& f);
+  bool Matches(uint32_t id, const std::vector<Filter>& filters) const;
+  const std::vector<uint32_t>* Candidates(const std::vector<Filter>& filters,
+                                          bool& none) const;
+
+ private:
+  std::string document_;
+
+  std::vector<Link> links_;         // by id
+  std::vector<uint32_t> free_;      // ids
+  std::vector<uint32_t> order_;     // ids, in document order
+  std::unordered_map<std::string, uint32_t> by_path_;
+
+  // name '=' value to ids, in document order.
+  std::unordered_map<std::string, std::vector<uint32_t>> index_;
+
+  uint32_t version_;
+  std::string block_;               // Handle() scratch
+};
+
+}   // namespace server
+
+#endif  // SERVER_WELL_KNOWN_CORE_H_
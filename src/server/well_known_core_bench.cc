@@ -0,0 +1,132 @@
+// Copyleft 2013 tho@autistici.org
+
+// /.well-known/core of a server with many resources: what rendering
+// the document on every request would cost, against blocks of the
+// kept one, filtered by an indexed attribute or by prefix, and what
+// adding and removing resources costs once the document is kept.
+//
+// Usage: well_known_core_bench [resources [reads]]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "coap/link_format.h"
+#include "server/well_known_core.h"
+
+using namespace server;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::string path(size_t i) {
+  return "devices/" + std::to_string(i / 100) + "/" + std::to_string(i);
+}
+
+// 50 resource types, 5 interfaces.
+std::string attributes(size_t i) {
+  return "rt=\"type-" + std::to_string(i % 50) + "\";if=\"if-" +
+         std::to_string(i % 5) + "\";ct=" + std::to_string(i % 3 ? 0 : 50);
+}
+
+// What a server without a kept document does on each request.
+void render(const std::vector<std::pair<std::string, std::string>>& all,
+            std::string& out) {
+  out.clear();
+  for (const auto& r : all) {
+    if (!out.empty())
+      out += ',';
+    out += "</" + r.first + ">";
+
+    std::string link = "<x>;" + r.second;
+    coap::LinkCursor params(reinterpret_cast<const uint8_t*>(link.data()),
+                            link.size());
+    const char* target;
+    size_t target_length;
+    params.NextLink(target, target_length);
+    const char* name;
+    const char* value;
+    size_t name_length, value_length;
+    while (params.NextParam(name, name_length, value, value_length))
+      coap::AppendLinkParam(out, name, name_length, value, value_length);
+  }
+}
+
+void read(const WellKnownCore& core, const char* label,
+          const std::vector<std::string>& queries, size_t block,
+          size_t nreads) {
+  std::string out;
+  bool more;
+  size_t bytes = 0;
+
+  auto start = Clock::now();
+  for (size_t i = 0; i < nreads; ++i) {
+    assert(core.Read(queries, block * 1024, 1024, out, more));
+    bytes += out.size();
+  }
+  double t = seconds_since(start);
+  assert(bytes > 0);
+  printf("%s %7.2f us/read\n", label, t * 1e6 / nreads);
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+  size_t nreads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+
+  WellKnownCore core;
+  std::vector<std::pair<std::string, std::string>> all;
+  for (size_t i = 0; i < n; ++i)
+    all.push_back(std::make_pair(path(i), attributes(i)));
+
+  auto start = Clock::now();
+  for (const auto& r : all)
+    assert(core.Add(r.first, r.second));
+  double t = seconds_since(start);
+  printf("add %zu resources:       %7.2f us/add   document %.1f KB\n", n,
+         t * 1e6 / n, core.document().size() / 1e3);
+
+  // Rendering it all, as without the kept document, even for a first
+  // block.
+  std::string out;
+  size_t rounds = std::max<size_t>(1, nreads / 100);
+  start = Clock::now();
+  for (size_t i = 0; i < rounds; ++i)
+    render(all, out);
+  t = seconds_since(start);
+  assert(out == core.document());
+  printf("render:                  %7.2f us/read\n", t * 1e6 / rounds);
+
+  std::vector<std::string> none;
+  std::vector<std::string> exact(1, "rt=type-7");
+  std::vector<std::string> two = { "if=if-2", "rt=type-7" };
+  std::vector<std::string> prefix(1, "rt=type-4*");
+  read(core, "block 0:                ", none, 0, nreads);
+  read(core, "block 10:               ", none, 10, nreads);
+  read(core, "rt=type-7 block 0:      ", exact, 0, nreads);
+  read(core, "if=if-2&rt=type-7:      ", two, 0, nreads);
+  read(core, "rt=type-4* block 0:     ", prefix, 0, nreads);
+  read(core, "rt=type-4* block 10:    ", prefix, 10, nreads / 10);
+
+  // Churn: a resource goes away and another comes.
+  std::mt19937_64 rng(42);
+  start = Clock::now();
+  for (size_t i = 0; i < nreads; ++i) {
+    size_t r = rng() % n;
+    assert(core.Remove(all[r].first));
+    assert(core.Add(all[r].first, all[r].second));
+  }
+  t = seconds_since(start);
+  printf("remove + add:            %7.2f us\n", t * 1e6 / nreads);
+}
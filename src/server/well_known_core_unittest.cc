@@ -0,0 +1,241 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <string>
+#include <vector>
+#include "coap/block.h"
+#include "coap/link_format.h"
+#include "utils/log.h"
+#include "server/well_known_core.h"
+
+using namespace server;
+
+void init_log() {
+  utils::Log::Instance()->Open("well_known_core_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+// The whole result, queries joined by '&'.
+std::string read(const WellKnownCore& core, const std::string& query) {
+  std::vector<std::string> queries;
+  for (size_t begin = 0; begin < query.size(); ) {
+    size_t end = query.find('&', begin);
+    if (end == std::string::npos)
+      end = query.size();
+    queries.push_back(query.substr(begin, end - begin));
+    begin = end + 1;
+  }
+
+  std::string out;
+  bool more;
+  assert(core.Read(queries, 0, 1 << 20, out, more));
+  assert(!more);
+  return out;
+}
+
+void test_ok_add_remove() {
+  WellKnownCore core;
+  assert(core.document().empty() && core.links() == 0);
+
+  uint32_t version = core.version();
+  assert(core.Add("sensors/temp", "rt=\"temperature-c\";if=\"sensor\""));
+  assert(core.version() != version);
+  assert(core.Add("sensors/light", "rt=\"light-lux\";if=\"sensor\";ct=0"));
+  assert(core.Add("fw", ""));
+  assert(core.document() ==
+         "</sensors/temp>;rt=\"temperature-c\";if=\"sensor\","
+         "</sensors/light>;rt=\"light-lux\";if=\"sensor\";ct=0,"
+         "</fw>");
+  assert(core.links() == 3);
+
+  // Cut out of the middle, the end and the start.
+  version = core.version();
+  assert(core.Remove("sensors/light"));
+  assert(core.version() != version);
+  assert(core.document() ==
+         "</sensors/temp>;rt=\"temperature-c\";if=\"sensor\",</fw>");
+  assert(core.Remove("fw"));
+  assert(core.document() ==
+         "</sensors/temp>;rt=\"temperature-c\";if=\"sensor\"");
+  assert(core.Add("a", "ct=40"));
+  assert(core.Remove("sensors/temp"));
+  assert(core.document() == "</a>;ct=40");
+  assert(core.Remove("a"));
+  assert(core.document().empty());
+
+  // Back again.
+  assert(core.Add("a", "ct=40"));
+  assert(core.Add("b", "ct=40"));
+  assert(read(core, "ct=40") == "</a>;ct=40,</b>;ct=40");
+
+  // Odd characters are escaped in the target.
+  assert(core.Add("x y/<z>", ""));
+  assert(read(core, "href=/x*") == "</x%20y/%3Cz%3E>");
+}
+
+void test_ok_filters() {
+  WellKnownCore core;
+  assert(core.Add("s/1", "rt=\"temperature-c humidity\";if=\"sensor\";obs"));
+  assert(core.Add("s/2", "rt=\"temperature-f\";if=\"sensor\";ct=0"));
+  assert(core.Add("a/1", "rt=\"switch\";if=\"actuator\";title=\"Lamp\""));
+
+  const std::string s1 =
+      "</s/1>;rt=\"temperature-c humidity\";if=\"sensor\";obs";
+  const std::string s2 = "</s/2>;rt=\"temperature-f\";if=\"sensor\";ct=0";
+  const std::string a1 = "</a/1>;rt=\"switch\";if=\"actuator\";title=\"Lamp\"";
+
+  assert(read(core, "") == core.document());
+  assert(read(core, "if=sensor") == s1 + "," + s2);
+  assert(read(core, "rt=humidity") == s1);
+  assert(read(core, "rt=temperature-c") == s1);
+  assert(read(core, "rt=temperature*") == s1 + "," + s2);
+  assert(read(core, "rt=temp") == "");
+  assert(read(core, "rt=*") == core.document());
+  assert(read(core, "obs") == s1);
+  assert(read(core, "ct") == s2);
+  assert(read(core, "ct=0") == s2);
+  assert(read(core, "title=Lamp") == a1);
+  assert(read(core, "title=L*") == a1);
+  assert(read(core, "href=/a/1") == a1);
+  assert(read(core, "href=/s*") == s1 + "," + s2);
+  assert(read(core, "href=/s*&ct=0") == s2);
+  assert(read(core, "if=sensor&rt=humidity") == s1);
+  assert(read(core, "if=sensor&rt=switch") == "");
+  assert(read(core, "nope=1") == "");
+
+  // The indexes follow removals.
+  assert(core.Remove("s/1"));
+  assert(read(core, "if=sensor") == s2);
+  assert(read(core, "rt=humidity") == "");
+  assert(read(core, "obs") == "");
+  assert(core.Add("s/1", "rt=\"humidity\";if=\"sensor\""));
+  assert(read(core, "if=sensor") ==
+         s2 + ",</s/1>;rt=\"humidity\";if=\"sensor\"");
+}
+
+void test_ok_blocks() {
+  WellKnownCore core;
+  for (int i = 0; i < 500; ++i)
+    assert(core.Add("sensors/" + std::to_string(i),
+                    i % 2 ? "rt=\"odd\";ct=0" : "rt=\"even\";ct=0"));
+
+  std::vector<std::string> filters[] = {
+    std::vector<std::string>(),
+    std::vector<std::string>(1, "rt=odd"),
+    std::vector<std::string>(1, "rt=o*"),
+  };
+
+  for (const std::vector<std::string>& queries : filters) {
+    std::string all;
+    bool more;
+    assert(core.Read(queries, 0, 1 << 20, all, more) && !more);
+    assert(all.size() > 4096);
+
+    for (size_t size = 16; size <= 1024; size *= 4) {
+      std::string joined, block;
+      more = true;
+      for (size_t offset = 0; more; offset += size) {
+        assert(core.Read(queries, offset, size, block, more));
+        assert(block.size() == (more ? size : all.size() - offset));
+        joined += block;
+      }
+      assert(joined == all);
+    }
+
+    // Right up to the end, and past it.
+    std::string block;
+    assert(core.Read(queries, 0, all.size(), block, more));
+    assert(block == all && !more);
+    assert(core.Read(queries, all.size(), 64, block, more));
+    assert(block.empty() && !more);
+  }
+}
+
+void test_ok_handle() {
+  WellKnownCore core;
+  for (int i = 0; i < 100; ++i)
+    assert(core.Add("sensors/" + std::to_string(i), "rt=\"temperature\""));
+
+  coap::PDU pdu;
+  pdu.set_type(coap::Type::CON);
+  pdu.set_code(coap::Code::GET);
+  coap::Options opts;
+  assert(opts.AddUriPath(".well-known"));
+  assert(opts.AddUriPath("core"));
+  assert(opts.AddUriQuery("rt=temperature"));
+  coap::Block asked = { 2, false, 2 };
+  assert(opts.AddBlock2(coap::EncodeBlock(asked)));
+  pdu.set_options(opts);
+  std::vector<uint8_t> wire;
+  assert(pdu.Encode(wire));
+
+  coap::PDUView req;
+  assert(req.Decode(wire.data(), wire.size()));
+  coap::PDU rsp;
+  core.Handle(req, rsp);
+  assert(rsp.code() == coap::Code::Content);
+
+  std::vector<uint8_t> out;
+  assert(rsp.Encode(out));
+  coap::PDUView view;
+  assert(view.Decode(out.data(), out.size()));
+
+  uint32_t etag = 0;
+  int64_t content_format = -1;
+  coap::Block block = { 0, false, 0 };
+  coap::OptionCursor cursor = view.options();
+  size_t num;
+  const uint8_t* value;
+  size_t length;
+  while (cursor.Next(num, value, length)) {
+    if (num == coap::OptionNumber::ETag) {
+      for (size_t i = 0; i < length; ++i)
+        etag = (etag << 8) | value[i];
+    } else if (num == coap::OptionNumber::Content_Format) {
+      content_format = length ? value[0] : 0;
+    } else if (num == coap::OptionNumber::Block2) {
+      assert(coap::DecodeBlock(value, length, block));
+    }
+  }
+  assert(etag == core.version());
+  assert(content_format == coap::kLinkFormat);
+  assert(block.num == 2 && block.szx == 2 && block.more);
+
+  std::string all = read(core, "rt=temperature");
+  assert(std::string(reinterpret_cast<const char*>(view.payload()),
+                     view.payload_size()) == all.substr(128, 64));
+}
+
+void test_ko_add() {
+  WellKnownCore core;
+  assert(core.Add("a", ""));
+  assert(!core.Add("a", "ct=0"));
+  assert(!core.Add("b", ";ct=0"));
+  assert(!core.Add("b", "rt=\"x"));
+  assert(!core.Add("b", "ct=0,</c>"));
+  assert(!core.Add("b", "ct=0;"));
+  assert(core.document() == "</a>");
+  assert(!core.Remove("b"));
+}
+
+void test_ko_read() {
+  WellKnownCore core;
+  assert(core.Add("a", ""));
+
+  std::string out;
+  bool more;
+  assert(!core.Read(std::vector<std::string>(1, "=x"), 0, 64, out, more));
+  assert(!core.Read(std::vector<std::string>(33, "ct=0"), 0, 64, out, more));
+}
+
+int main() {
+  init_log();
+
+  test_ok_add_remove();
+  test_ok_filters();
+  test_ok_blocks();
+  test_ok_handle();
+  test_ko_add();
+  test_ko_read();
+}
@@ -0,0 +1,176 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils/log.h"
+#include "trace/trace.h"
+
+namespace trace {
+
+namespace {
+
+const uint32_t kPcapMagicNs = 0xa1b23c4d;
+const uint32_t kLinktypeRaw = 101;
+const size_t kIp4Header = 20;
+const size_t kIp6Header = 40;
+const size_t kUdpHeader = 8;
+
+void Put16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+// One's complement sum of 16 bit words, not folded.
+uint32_t Sum(const uint8_t* p, size_t n, uint32_t sum = 0) {
+  for (; n > 1; p += 2, n -= 2)
+    sum += (p[0] << 8) | p[1];
+  if (n)
+    sum += p[0] << 8;
+  return sum;
+}
+
+uint16_t Fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum;
+}
+
+// IP and UDP headers for a datagram of size bytes from peer to local.
+// Return the header length.
+size_t Headers(const Record& rec, const sockaddr_storage& local,
+               uint8_t* out) {
+  uint16_t sport = 0, dport = 0;
+  const uint8_t* src = nullptr;
+  const uint8_t* dst = nullptr;
+  static const uint8_t kAny[16] = { 0 };
+
+  if (rec.peer.ss_family == AF_INET) {
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(&rec.peer);
+    sport = ntohs(sin->sin_port);
+    src = reinterpret_cast<const uint8_t*>(&sin->sin_addr);
+    dst = kAny;
+    if (local.ss_family == AF_INET) {
+      const sockaddr_in* l = reinterpret_cast<const sockaddr_in*>(&local);
+      dport = ntohs(l->sin_port);
+      dst = reinterpret_cast<const uint8_t*>(&l->sin_addr);
+    }
+
+    uint8_t* ip = out;
+    memset(ip, 0, kIp4Header);
+    ip[0] = 0x45;
+    Put16(ip + 2, kIp4Header + kUdpHeader + rec.size);
+    Put16(ip + 6, 0x4000);            // DF
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, src, 4);
+    memcpy(ip + 16, dst, 4);
+    Put16(ip + 10, Fold(Sum(ip, kIp4Header)));
+
+    // A zero UDP checksum is fine over IPv4.
+    uint8_t* udp = out + kIp4Header;
+    Put16(udp, sport);
+    Put16(udp + 2, dport);
+    Put16(udp + 4, kUdpHeader + rec.size);
+    Put16(udp + 6, 0);
+
+    return kIp4Header + kUdpHeader;
+  }
+
+  const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(&rec.peer);
+  sport = ntohs(sin6->sin6_port);
+  src = reinterpret_cast<const uint8_t*>(&sin6->sin6_addr);
+  dst = kAny;
+  if (local.ss_family == AF_INET6) {
+    const sockaddr_in6* l = reinterpret_cast<const sockaddr_in6*>(&local);
+    dport = ntohs(l->sin6_port);
+    dst = reinterpret_cast<const uint8_t*>(&l->sin6_addr);
+  }
+
+  uint8_t* ip = out;
+  memset(ip, 0, kIp6Header);
+  ip[0] = 0x60;
+  Put16(ip + 4, kUdpHeader + rec.size);
+  ip[6] = IPPROTO_UDP;
+  ip[7] = 64;
+  memcpy(ip + 8, src, 16);
+  memcpy(ip + 24, dst, 16);
+
+  uint8_t* udp = out + kIp6Header;
+  Put16(udp, sport);
+  Put16(udp + 2, dport);
+  Put16(udp + 4, kUdpHeader + rec.size);
+  Put16(udp + 6, 0);
+
+  // Mandatory over IPv6: pseudo-header, UDP header, payload.
+  uint32_t sum = Sum(ip + 8, 32);
+  sum += kUdpHeader + rec.size;
+  sum += IPPROTO_UDP;
+  sum = Sum(udp, kUdpHeader, sum);
+  sum = Sum(rec.data, rec.size, sum);
+  uint16_t check = Fold(sum);
+  Put16(udp + 6, check ? check : 0xFFFF);
+
+  return kIp6Header + kUdpHeader;
+}
+
+}   // namespace
+
+bool ExportPcap(TraceReader& reader, const std::string& path) {
+  utils::Log* L = utils::Log::Instance();
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f == nullptr) {
+    L->Debug("fopen %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // The pcap header is in host byte order, readers swap as needed.
+  uint32_t global[6] = {
+    kPcapMagicNs,
+    2 | (4 << 16),      // version 2.4
+    0,                  // thiszone
+    0,                  // sigfigs
+    65535,              // snaplen
+    kLinktypeRaw
+  };
+  bool ok = fwrite(global, sizeof global, 1, f) == 1;
+
+  sockaddr_storage local;
+  socklen_t local_len;
+  reader.local(local, local_len);
+
+  reader.Rewind();
+
+  Record rec;
+  uint8_t headers[kIp6Header + kUdpHeader];
+
+  while (ok && reader.Next(rec)) {
+    if (rec.peer_len == 0)
+      continue;
+
+    size_t n = Headers(rec, local, headers);
+    uint32_t packet[4] = {
+      static_cast<uint32_t>(rec.time_ns / 1000000000),
+      static_cast<uint32_t>(rec.time_ns % 1000000000),
+      static_cast<uint32_t>(n + rec.size),
+      static_cast<uint32_t>(n + rec.size)
+    };
+
+    ok = fwrite(packet, sizeof packet, 1, f) == 1 &&
+         fwrite(headers, n, 1, f) == 1 &&
+         (rec.size == 0 || fwrite(rec.data, rec.size, 1, f) == 1);
+  }
+
+  if (fclose(f) != 0)
+    ok = false;
+
+  if (!ok)
+    L->Debug("writing %s: %s", path.c_str(), strerror(errno));
+
+  return ok;
+}
+
+}   // namespace trace
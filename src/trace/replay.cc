@@ -0,0 +1,440 @@
+// Copyleft 2013 tho@autistici.org
+
+// Replay a trace recorded with trace::TraceWriter (e.g. through
+// server::Server::set_trace).
+//
+//   trace_replay decode TRACE [--max] [--loops N]
+//
+//     Feed every datagram to coap::PDU::Decode, and report throughput
+//     and the distribution of decoding times.
+//
+//   trace_replay server TRACE [--max] [--loops N]
+//
+//     Send every datagram, garbage included, to a server::Server on
+//     loopback serving an echo resource at each Uri-Path found in the
+//     trace.  Message IDs are rewritten to tell the answers apart.
+//     Report throughput and the distribution of round-trip times.
+//
+//   trace_replay pcap TRACE OUT
+//
+//     Export the trace to a pcap file.
+//
+// Datagrams are sent at the pace they were recorded, or back to back
+// with --max.  --loops (with --max only) goes through the trace N
+// times.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "coap/pdu.h"
+#include "coap/view.h"
+#include "server/server.h"
+#include "trace/trace.h"
+#include "utils/histogram.h"
+
+namespace {
+
+struct Args {
+  std::string mode;
+  std::string trace;
+  std::string out;
+  bool max;
+  size_t loops;
+};
+
+uint64_t Now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// When each record is due, counting from the first one.  Everything
+// is due at once with --max.
+class Pacer {
+ public:
+  explicit Pacer(bool max) : max_(max), first_(0), start_(0) { }
+
+  uint64_t Due(const trace::Record& rec) {
+    if (max_)
+      return 0;
+
+    if (start_ == 0) {
+      first_ = rec.time_ns;
+      start_ = Now();
+    }
+    return start_ + (rec.time_ns - first_);
+  }
+
+ private:
+  bool max_;
+  uint64_t first_;
+  uint64_t start_;
+};
+
+void Usage() {
+  fprintf(stderr,
+          "usage: trace_replay decode TRACE [--max] [--loops N]\n"
+          "       trace_replay server TRACE [--max] [--loops N]\n"
+          "       trace_replay pcap TRACE OUT\n");
+  exit(2);
+}
+
+bool ParseArgs(int argc, char* argv[], Args& args) {
+  args.max = false;
+  args.loops = 1;
+
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--max") {
+      args.max = true;
+    } else if (arg == "--loops" && i + 1 < argc) {
+      args.loops = strtoul(argv[++i], nullptr, 10);
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return false;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() < 2)
+    return false;
+
+  args.mode = positional[0];
+  args.trace = positional[1];
+
+  if (args.mode == "pcap") {
+    if (positional.size() != 3)
+      return false;
+    args.out = positional[2];
+  } else if (positional.size() != 2) {
+    return false;
+  }
+
+  return args.loops > 0 && (args.max || args.loops == 1);
+}
+
+void PrintRate(const char* label, uint64_t n, uint64_t bytes, uint64_t ns) {
+  double s = ns / 1e9;
+  printf("%-12s %llu in %.3f s: %.0f/s, %.1f MB/s\n", label,
+         static_cast<unsigned long long>(n), s, n / s, bytes / s / 1e6);
+}
+
+//
+// decode
+//
+int Decode(trace::TraceReader& reader, const Args& args) {
+  utils::Histogram latency;
+  uint64_t ok = 0, failed = 0, bytes = 0, busy = 0;
+  std::vector<uint8_t> buf;
+  trace::Record rec;
+  Pacer pacer(args.max);
+
+  uint64_t start = Now();
+
+  for (size_t loop = 0; loop < args.loops; ++loop) {
+    reader.Rewind();
+
+    while (reader.Next(rec)) {
+      uint64_t due = pacer.Due(rec);
+      while (Now() < due) { }
+
+      buf.assign(rec.data, rec.data + rec.size);
+
+      coap::PDU pdu;
+      uint64_t t0 = Now();
+      bool decoded = pdu.Decode(buf);
+      uint64_t t1 = Now();
+
+      latency.Record(t1 - t0);
+      busy += t1 - t0;
+      bytes += rec.size;
+      decoded ? ++ok : ++failed;
+    }
+  }
+
+  uint64_t elapsed = Now() - start;
+
+  printf("decoded:     %llu, failed: %llu\n",
+         static_cast<unsigned long long>(ok),
+         static_cast<unsigned long long>(failed));
+  PrintRate("wall clock:", ok + failed, bytes, elapsed);
+  PrintRate("in Decode:", ok + failed, bytes, busy);
+  latency.Print(stdout, "Decode", 1, "ns");
+
+  return 0;
+}
+
+//
+// server
+//
+class Echo : public server::Resource {
+ public:
+  void Handle(const coap::PDUView& req, coap::PDU& rsp) {
+    rsp.set_code(coap::Code::Content);
+    rsp.set_payload(std::vector<uint8_t>(req.payload(),
+                                         req.payload() + req.payload_size()));
+  }
+
+  bool inline_safe() const { return true; }
+};
+
+std::set<std::string> Paths(trace::TraceReader& reader) {
+  std::set<std::string> paths;
+  trace::Record rec;
+
+  reader.Rewind();
+  while (reader.Next(rec)) {
+    coap::PDUView view;
+    if (!view.Decode(rec.data, rec.size))
+      continue;
+
+    std::string path;
+    coap::OptionCursor cursor = view.options();
+    size_t num;
+    const uint8_t* value;
+    size_t length;
+
+    while (cursor.Next(num, value, length)) {
+      if (num == coap::OptionNumber::Uri_Path) {
+        if (!path.empty())
+          path += '/';
+        path.append(reinterpret_cast<const char*>(value), length);
+      } else if (num > coap::OptionNumber::Uri_Path) {
+        break;
+      }
+    }
+    paths.insert(path);
+  }
+
+  return paths;
+}
+
+// The client side of a server replay: sends datagrams, matches
+// answers (ACKs and RSTs by message ID, NON responses by token) and
+// times them.
+class Replayer {
+ public:
+  explicit Replayer(int fd)
+    : fd_(fd)
+    , slots_(1 << 16)
+    , sent_(0)
+    , expected_(0)
+    , answered_(0)
+    , bytes_(0) { }
+
+  void Send(const trace::Record& rec, const sockaddr_in& server) {
+    uint8_t buf[net::kMaxDatagramSize];
+    size_t size = std::min(rec.size, sizeof buf);
+    memcpy(buf, rec.data, size);
+
+    uint16_t mid = sent_;
+    bool expect = false;
+
+    if (size >= 4) {
+      buf[2] = mid >> 8;
+      buf[3] = mid;
+
+      // Well-formed CONs (pings included) and NON requests get an
+      // answer; the rest may not.
+      int type = (buf[0] >> 4) & 0x03;
+      int code = buf[1];
+      expect = rec.verdict == trace::Verdict::decoded &&
+               (type == coap::Type::CON ||
+                (type == coap::Type::NON && code > 0 &&
+                 code <= coap::CodeBlocks::ReqMethodMax));
+
+      if (expect && type == coap::Type::NON) {
+        size_t tkl = std::min<size_t>(buf[0] & 0x0F, size - 4);
+        tokens_[std::string(buf + 4, buf + 4 + tkl)] = mid;
+      }
+    }
+
+    Slot& slot = slots_[mid];
+    slot.pending = expect;
+    slot.sent_at = Now();
+
+    if (sendto(fd_, buf, size, 0, reinterpret_cast<const sockaddr*>(&server),
+               sizeof server) == static_cast<ssize_t>(size)) {
+      bytes_ += size;
+    }
+
+    ++sent_;
+    expected_ += expect;
+  }
+
+  // Handle answers for up to timeout_ms.
+  void Receive(int timeout_ms) {
+    pollfd pfd = { fd_, POLLIN, 0 };
+    if (timeout_ms > 0 && poll(&pfd, 1, timeout_ms) <= 0)
+      return;
+
+    uint8_t buf[net::kMaxDatagramSize];
+    ssize_t n;
+
+    while ((n = recv(fd_, buf, sizeof buf, MSG_DONTWAIT)) >= 4) {
+      uint64_t now = Now();
+      int type = (buf[0] >> 4) & 0x03;
+      uint16_t mid = (buf[2] << 8) | buf[3];
+
+      if (type == coap::Type::NON || type == coap::Type::CON) {
+        size_t tkl = std::min<size_t>(buf[0] & 0x0F, n - 4);
+        auto it = tokens_.find(std::string(buf + 4, buf + 4 + tkl));
+        if (it == tokens_.end())
+          continue;
+        mid = it->second;
+        tokens_.erase(it);
+      }
+
+      Slot& slot = slots_[mid];
+      if (slot.pending) {
+        slot.pending = false;
+        rtt_.Record(now - slot.sent_at);
+        ++answered_;
+      }
+    }
+  }
+
+  uint64_t sent() const { return sent_; }
+  uint64_t expected() const { return expected_; }
+  uint64_t answered() const { return answered_; }
+  uint64_t bytes() const { return bytes_; }
+  const utils::Histogram& rtt() const { return rtt_; }
+
+ private:
+  struct Slot {
+    bool pending;
+    uint64_t sent_at;
+  };
+
+  int fd_;
+  std::vector<Slot> slots_;
+  std::unordered_map<std::string, uint16_t> tokens_;
+  utils::Histogram rtt_;
+  uint64_t sent_;
+  uint64_t expected_;
+  uint64_t answered_;
+  uint64_t bytes_;
+};
+
+int Serve(trace::TraceReader& reader, const Args& args) {
+  std::unique_ptr<net::Transport> transport =
+      net::NewTransport(net::Backend::any);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t len = sizeof addr;
+  if (!transport->Open(reinterpret_cast<sockaddr*>(&addr), sizeof addr) ||
+      getsockname(transport->fd(), reinterpret_cast<sockaddr*>(&addr),
+                  &len) == -1) {
+    fprintf(stderr, "can't open the server socket\n");
+    return 1;
+  }
+
+  server::Server s(transport.get(), nullptr);
+  Echo echo;
+  std::set<std::string> paths = Paths(reader);
+  for (const std::string& path : paths)
+    s.Add(path, &echo);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int rcvbuf = 8 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+  std::atomic<bool> stop(false);
+  std::thread io([&] {
+    while (!stop)
+      s.RunOnce(1);
+  });
+
+  Replayer replayer(fd);
+  Pacer pacer(args.max);
+  trace::Record rec;
+
+  uint64_t start = Now();
+
+  for (size_t loop = 0; loop < args.loops; ++loop) {
+    reader.Rewind();
+
+    while (reader.Next(rec)) {
+      uint64_t due = pacer.Due(rec);
+      for (uint64_t now = Now(); now < due; now = Now())
+        replayer.Receive(std::max<int>(1, (due - now) / 1000000));
+
+      replayer.Send(rec, addr);
+      replayer.Receive(0);
+    }
+  }
+
+  uint64_t sent = Now();
+
+  // Stragglers, for up to a second of silence.
+  for (uint64_t answered = replayer.answered(), idle = 0;
+       replayer.answered() < replayer.expected() && idle < 100; ) {
+    replayer.Receive(10);
+    idle = replayer.answered() == answered ? idle + 1 : 0;
+    answered = replayer.answered();
+  }
+
+  stop = true;
+  io.join();
+  close(fd);
+
+  printf("paths:       %zu\n", paths.size());
+  printf("sent:        %llu, answers expected: %llu, answered: %llu, "
+         "lost: %llu\n",
+         static_cast<unsigned long long>(replayer.sent()),
+         static_cast<unsigned long long>(replayer.expected()),
+         static_cast<unsigned long long>(replayer.answered()),
+         static_cast<unsigned long long>(replayer.expected() -
+                                         replayer.answered()));
+  printf("server:      %llu inline, %llu empties, %llu malformed, "
+         "%llu dropped\n",
+         static_cast<unsigned long long>(s.handled_inline()),
+         static_cast<unsigned long long>(s.empties()),
+         static_cast<unsigned long long>(s.malformed()),
+         static_cast<unsigned long long>(s.dropped()));
+  PrintRate("sending:", replayer.sent(), replayer.bytes(), sent - start);
+  replayer.rtt().Print(stdout, "RTT", 1000, "us");
+
+  return 0;
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  Args args;
+  if (!ParseArgs(argc, argv, args))
+    Usage();
+
+  trace::TraceReader reader;
+  if (!reader.Open(args.trace)) {
+    fprintf(stderr, "can't read %s\n", args.trace.c_str());
+    return 1;
+  }
+
+  if (args.mode == "decode")
+    return Decode(reader, args);
+  if (args.mode == "server")
+    return Serve(reader, args);
+  if (args.mode == "pcap")
+    return ExportPcap(reader, args.out) ? 0 : 1;
+
+  Usage();
+}
@@ -0,0 +1,444 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "utils/log.h"
+#include "trace/trace.h"
+
+namespace trace {
+
+namespace {
+
+const uint16_t kPadding = 0xFFFF;
+
+// The file is mapped and grown this much at a time.
+const uint64_t kGrowBytes = 16 << 20;
+
+uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+size_t RoundUp(size_t n) {
+  size_t p = 4096;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+// Address and port of a sockaddr, in trace form.  Return the family (4
+// or 6), 0 if neither.
+uint8_t Pack(const sockaddr* sa, socklen_t len, uint8_t addr[16],
+             uint16_t& port) {
+  memset(addr, 0, 16);
+  port = 0;
+
+  if (sa == nullptr)
+    return 0;
+
+  if (sa->sa_family == AF_INET && len >= sizeof(sockaddr_in)) {
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(sa);
+    memcpy(addr, &sin->sin_addr, 4);
+    port = ntohs(sin->sin_port);
+    return 4;
+  }
+
+  if (sa->sa_family == AF_INET6 && len >= sizeof(sockaddr_in6)) {
+    const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(sa);
+    memcpy(addr, &sin6->sin6_addr, 16);
+    port = ntohs(sin6->sin6_port);
+    return 6;
+  }
+
+  return 0;
+}
+
+void Unpack(uint8_t family, const uint8_t addr[16], uint16_t port,
+            sockaddr_storage& ss, socklen_t& len) {
+  memset(&ss, 0, sizeof ss);
+  len = 0;
+
+  if (family == 4) {
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    memcpy(&sin->sin_addr, addr, 4);
+    len = sizeof *sin;
+  } else if (family == 6) {
+    sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    memcpy(&sin6->sin6_addr, addr, 16);
+    len = sizeof *sin6;
+  }
+}
+
+}   // namespace
+
+//
+// class TraceWriter
+//
+TraceWriter::TraceWriter(const TraceConfig& config)
+  : config_(config)
+  , fd_(-1)
+  , map_(nullptr)
+  , mapped_(0)
+  , header_(nullptr)
+  , written_(0)
+  , ring_(nullptr)
+  , ring_mask_(0)
+  , head_(0)
+  , cached_tail_(0)
+  , tail_(0)
+  , cached_head_(0)
+  , seen_(0)
+  , recorded_(0)
+  , dropped_(0)
+  , running_(false)
+{ }
+
+TraceWriter::~TraceWriter() {
+  Close();
+}
+
+bool TraceWriter::Open(const std::string& path, const sockaddr* local) {
+  utils::Log* L = utils::Log::Instance();
+
+  if (fd_ != -1)
+    return false;
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    L->Debug("open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  mapped_ = sizeof(FileHeader) + std::min(kGrowBytes, config_.max_file_bytes);
+
+  if (ftruncate(fd_, mapped_) == -1) {
+    L->Debug("ftruncate: %s", strerror(errno));
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  void* p = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (p == MAP_FAILED) {
+    L->Debug("mmap: %s", strerror(errno));
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  map_ = static_cast<uint8_t*>(p);
+  header_ = reinterpret_cast<FileHeader*>(map_);
+  memset(header_, 0, sizeof *header_);
+  memcpy(header_->magic, kMagic, sizeof kMagic);
+  header_->version = kVersion;
+  header_->header_size = sizeof(FileHeader);
+  header_->start_ns = NowNs();
+
+  socklen_t local_len = 0;
+  if (local)
+    local_len = local->sa_family == AF_INET6 ? sizeof(sockaddr_in6)
+                                             : sizeof(sockaddr_in);
+  header_->local_family = Pack(local, local_len, header_->local_addr,
+                               header_->local_port);
+
+  size_t ring_size = RoundUp(config_.ring_bytes);
+  ring_ = new uint8_t[ring_size];
+  ring_mask_ = ring_size - 1;
+  head_ = tail_ = cached_head_ = cached_tail_ = 0;
+  written_ = 0;
+
+  running_ = true;
+  thread_ = std::thread(&TraceWriter::Run, this);
+
+  return true;
+}
+
+bool TraceWriter::Close() {
+  if (fd_ == -1)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  cond_.notify_one();
+  thread_.join();
+
+  bool ok = true;
+  uint64_t size = sizeof(FileHeader) + written_;
+
+  if (msync(map_, size, MS_ASYNC) == -1 || munmap(map_, mapped_) == -1 ||
+      ftruncate(fd_, size) == -1) {
+    utils::Log::Instance()->Debug("closing trace: %s", strerror(errno));
+    ok = false;
+  }
+
+  close(fd_);
+  fd_ = -1;
+  map_ = nullptr;
+  header_ = nullptr;
+  delete[] ring_;
+  ring_ = nullptr;
+
+  return ok;
+}
+
+bool TraceWriter::Record(const net::Datagram& dgram, Verdict verdict) {
+  if (ring_ == nullptr)
+    return false;
+
+  if (config_.sample_every > 1 && seen_++ % config_.sample_every != 0)
+    return false;
+
+  const size_t size = ring_mask_ + 1;
+  size_t len = RecordLength(dgram.size);
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  size_t offset = tail & ring_mask_;
+  size_t skip = size - offset < len ? size - offset : 0;
+
+  if (dgram.size >= kPadding || len > size) {
+    ++dropped_;
+    return false;
+  }
+
+  if (tail + skip + len - cached_head_ > size) {
+    cached_head_ = head_.load(std::memory_order_acquire);
+    if (tail + skip + len - cached_head_ > size) {
+      ++dropped_;
+      return false;
+    }
+  }
+
+  if (skip) {
+    if (skip >= sizeof(RecordHeader))
+      reinterpret_cast<RecordHeader*>(ring_ + offset)->size = kPadding;
+    tail += skip;
+    offset = 0;
+  }
+
+  RecordHeader* h = reinterpret_cast<RecordHeader*>(ring_ + offset);
+  h->time_ns = NowNs();
+  h->size = dgram.size;
+  h->verdict = verdict;
+  h->family = Pack(dgram.peer, dgram.peer_len, h->addr, h->port);
+  h->reserved = 0;
+  memcpy(h + 1, dgram.data, dgram.size);
+
+  tail_.store(tail + len, std::memory_order_release);
+  ++recorded_;
+
+  return true;
+}
+
+void TraceWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (running_) {
+    lock.unlock();
+    size_t n = Drain();
+    lock.lock();
+
+    // Nobody signals new records, so as to keep Record() free of
+    // system calls: poll instead.
+    if (n == 0 && running_)
+      cond_.wait_for(lock, std::chrono::milliseconds(1));
+  }
+
+  lock.unlock();
+  Drain();
+}
+
+// Move what is in the ring to the file.  Return the number of records.
+size_t TraceWriter::Drain() {
+  const size_t size = ring_mask_ + 1;
+  size_t head = head_.load(std::memory_order_relaxed);
+  size_t n = 0;
+
+  cached_tail_ = tail_.load(std::memory_order_acquire);
+
+  uint64_t written = written_.load(std::memory_order_relaxed);
+
+  while (head != cached_tail_) {
+    size_t offset = head & ring_mask_;
+    size_t left = size - offset;
+    const RecordHeader* h = reinterpret_cast<const RecordHeader*>(
+        ring_ + offset);
+
+    if (left < sizeof(RecordHeader) || h->size == kPadding) {
+      head += left;
+      continue;
+    }
+
+    size_t len = RecordLength(h->size);
+
+    if (Reserve(written + len)) {
+      memcpy(map_ + sizeof(FileHeader) + written, h, len);
+      written += len;
+    } else {
+      ++dropped_;
+    }
+
+    head += len;
+    ++n;
+  }
+
+  header_->length = written;
+  written_.store(written, std::memory_order_release);
+  head_.store(head, std::memory_order_release);
+
+  return n;
+}
+
+// Make room for bytes of records in the mapping.
+bool TraceWriter::Reserve(uint64_t bytes) {
+  uint64_t need = sizeof(FileHeader) + bytes;
+
+  if (need <= mapped_)
+    return true;
+
+  if (bytes > config_.max_file_bytes)
+    return false;
+
+  uint64_t size = std::min(std::max(mapped_ + kGrowBytes, need),
+                           sizeof(FileHeader) + config_.max_file_bytes);
+
+  if (ftruncate(fd_, size) == -1) {
+    utils::Log::Instance()->Debug("ftruncate: %s", strerror(errno));
+    return false;
+  }
+
+  void* p = mremap(map_, mapped_, size, MREMAP_MAYMOVE);
+  if (p == MAP_FAILED) {
+    utils::Log::Instance()->Debug("mremap: %s", strerror(errno));
+    return false;
+  }
+
+  map_ = static_cast<uint8_t*>(p);
+  header_ = reinterpret_cast<FileHeader*>(map_);
+  mapped_ = size;
+
+  return true;
+}
+
+//
+// class TraceReader
+//
+TraceReader::TraceReader()
+  : fd_(-1)
+  , map_(nullptr)
+  , mapped_(0)
+  , header_(nullptr)
+  , length_(0)
+  , offset_(0)
+{ }
+
+TraceReader::~TraceReader() {
+  Close();
+}
+
+bool TraceReader::Open(const std::string& path) {
+  utils::Log* L = utils::Log::Instance();
+
+  Close();
+
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ == -1) {
+    L->Debug("open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+    L->Debug("%s: not a trace", path.c_str());
+    Close();
+    return false;
+  }
+
+  mapped_ = st.st_size;
+  void* p = mmap(nullptr, mapped_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (p == MAP_FAILED) {
+    L->Debug("mmap: %s", strerror(errno));
+    mapped_ = 0;
+    Close();
+    return false;
+  }
+
+  map_ = static_cast<const uint8_t*>(p);
+  header_ = reinterpret_cast<const FileHeader*>(map_);
+
+  if (memcmp(header_->magic, kMagic, sizeof kMagic) != 0 ||
+      header_->version != kVersion ||
+      header_->header_size != sizeof(FileHeader)) {
+    L->Debug("%s: not a trace, or an unsupported version", path.c_str());
+    Close();
+    return false;
+  }
+
+  // A trace still being written is read up to where it was.
+  length_ = std::min<uint64_t>(header_->length,
+                               mapped_ - sizeof(FileHeader));
+  offset_ = 0;
+
+  return true;
+}
+
+void TraceReader::Close() {
+  if (map_)
+    munmap(const_cast<uint8_t*>(map_), mapped_);
+  if (fd_ != -1)
+    close(fd_);
+
+  fd_ = -1;
+  map_ = nullptr;
+  mapped_ = 0;
+  header_ = nullptr;
+  length_ = 0;
+  offset_ = 0;
+}
+
+bool TraceReader::Next(Record& rec) {
+  if (offset_ + sizeof(RecordHeader) > length_)
+    return false;
+
+  const uint8_t* p = map_ + sizeof(FileHeader) + offset_;
+  const RecordHeader* h = reinterpret_cast<const RecordHeader*>(p);
+  size_t len = RecordLength(h->size);
+
+  if (offset_ + len > length_) {
+    utils::Log::Instance()->Debug("truncated record at %llu",
+                                  static_cast<unsigned long long>(offset_));
+    return false;
+  }
+
+  rec.time_ns = h->time_ns;
+  rec.verdict = h->verdict;
+  Unpack(h->family, h->addr, h->port, rec.peer, rec.peer_len);
+  rec.data = p + sizeof(RecordHeader);
+  rec.size = h->size;
+
+  offset_ += len;
+  return true;
+}
+
+void TraceReader::local(sockaddr_storage& addr, socklen_t& len) const {
+  Unpack(header_->local_family, header_->local_addr, header_->local_port,
+         addr, len);
+}
+
+}   // namespace trace
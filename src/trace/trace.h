@@ -0,0 +1,203 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef TRACE_TRACE_H_
+#define TRACE_TRACE_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "net/transport.h"
+
+namespace trace {
+
+// On-disk format, host byte order:
+//
+//   FileHeader
+//   RecordHeader, datagram bytes, padding to 8 bytes
+//   RecordHeader, ...
+//
+// FileHeader::length says how many bytes of records follow, and is
+// kept up to date while the trace is being written, so that a trace
+// can be read while it grows.
+const char kMagic[8] = { 'w', 't', '2', 't', 'r', 'a', 'c', 'e' };
+const uint32_t kVersion = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;       // sizeof(FileHeader)
+  uint64_t start_ns;          // CLOCK_REALTIME, when opened
+  uint64_t length;            // bytes of records
+  uint8_t local_addr[16];     // where datagrams were received, if known
+  uint16_t local_port;
+  uint8_t local_family;       // 0 (unknown), 4 or 6
+  uint8_t reserved[13];
+};
+
+static_assert(sizeof(FileHeader) == 64, "FileHeader is 64 bytes");
+
+enum class Verdict : uint8_t {
+  decoded,    // passed decoding (or header-only classification)
+  rejected    // failed pre-validation or decoding, or rate limited
+};
+
+struct RecordHeader {
+  uint64_t time_ns;           // CLOCK_REALTIME, when recorded
+  uint16_t size;              // datagram bytes that follow
+  Verdict verdict;
+  uint8_t family;             // 4 or 6
+  uint16_t port;
+  uint16_t reserved;
+  uint8_t addr[16];           // IPv4 in the first 4 bytes
+};
+
+static_assert(sizeof(RecordHeader) == 32, "RecordHeader is 32 bytes");
+
+inline size_t RecordLength(size_t size) {
+  return (sizeof(RecordHeader) + size + 7) & ~static_cast<size_t>(7);
+}
+
+struct TraceConfig {
+  uint32_t sample_every;      // record 1 datagram in this many
+  size_t ring_bytes;          // hand-off buffer to the writer thread
+  uint64_t max_file_bytes;    // then recording stops
+};
+
+const TraceConfig kDefaultTraceConfig = { 1, 4 << 20, 1ULL << 30 };
+
+// Captures datagrams to a trace file, at little cost to the thread
+// that receives them.
+//
+// Record() is meant to be called from a single I/O thread: it copies
+// the datagram, a timestamp and the peer address into a lock-free ring
+// and returns.  A background thread moves records from the ring into
+// the file, which is mmap(2)ed and grown (ftruncate(2) and mremap(2))
+// as it fills up, so the I/O thread never blocks on the file system
+// or takes a page fault on the file.  If the ring is full the record
+// is dropped and counted.
+class TraceWriter {
+ public:
+  explicit TraceWriter(const TraceConfig& config = kDefaultTraceConfig);
+
+  // Close() if still open.
+  ~TraceWriter();
+
+  // Create (or truncate) the trace at path and start the writer
+  // thread.  local, if given, is where the datagrams are received: it
+  // ends up in the file header, for pcap export.
+  bool Open(const std::string& path, const sockaddr* local = nullptr);
+
+  // Flush what is in the ring, stop the writer thread and cut the
+  // file to size.
+  bool Close();
+
+  // I/O thread only.  Return true if the datagram was recorded, false
+  // if it was sampled out or dropped.
+  bool Record(const net::Datagram& dgram, Verdict verdict);
+
+  // Datagrams recorded and dropped so far.  The writer thread may not
+  // have written all recorded ones yet, and drops those that would
+  // take the file past max_file_bytes: they count as both.
+  uint64_t recorded() const { return recorded_; }
+  uint64_t dropped() const { return dropped_.load(); }
+
+  // Bytes of records in the file.
+  uint64_t length() const { return written_.load(); }
+
+ private:
+  void Run();
+  size_t Drain();
+  bool Reserve(uint64_t bytes);
+
+ private:
+  static constexpr size_t kCacheLine = 64;
+
+  const TraceConfig config_;
+
+  int fd_;
+  uint8_t* map_;
+  uint64_t mapped_;
+  FileHeader* header_;
+  std::atomic<uint64_t> written_;
+
+  // Ring: records don't wrap around.  One that wouldn't fit before the
+  // end is preceded by a padding record (size 0xFFFF), or nothing if
+  // there is no room for a header.
+  uint8_t* ring_;
+  size_t ring_mask_;
+  char pad0_[kCacheLine];
+
+  // Consumer (writer thread)
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+  char pad1_[kCacheLine];
+
+  // Producer (I/O thread)
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  uint64_t seen_;
+  uint64_t recorded_;
+  char pad2_[kCacheLine];
+
+  std::atomic<uint64_t> dropped_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool running_;
+};
+
+// A record read back from a trace.
+struct Record {
+  uint64_t time_ns;
+  Verdict verdict;
+  sockaddr_storage peer;
+  socklen_t peer_len;
+  const uint8_t* data;
+  size_t size;
+};
+
+// Reads a trace (possibly still being written) through a read-only
+// mapping: Record::data points into it.
+class TraceReader {
+ public:
+  TraceReader();
+  ~TraceReader();
+
+  bool Open(const std::string& path);
+  void Close();
+
+  // Return false at the end of the trace, or on a corrupt record.
+  bool Next(Record& rec);
+
+  // Back to the first record.
+  void Rewind() { offset_ = 0; }
+
+  const FileHeader& header() const { return *header_; }
+
+  // Where the datagrams were received (family 0 if unknown).
+  void local(sockaddr_storage& addr, socklen_t& len) const;
+
+ private:
+  int fd_;
+  const uint8_t* map_;
+  size_t mapped_;
+  const FileHeader* header_;
+  uint64_t length_;
+  uint64_t offset_;
+};
+
+// Export a trace to a pcap file (LINKTYPE_RAW, ns timestamps): each
+// datagram gets IP and UDP headers, from its peer to the trace's local
+// address.  Rejected datagrams are included too.
+bool ExportPcap(TraceReader& reader, const std::string& path);
+
+}   // namespace trace
+
+#endif  // TRACE_TRACE_H_
@@ -0,0 +1,60 @@
+// Copyleft 2013 tho@autistici.org
+
+// What recording costs the I/O thread: TraceWriter::Record() per
+// datagram, for a few datagram sizes, with the writer thread draining
+// the ring to a file in /tmp at the same time.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "trace/trace.h"
+#include "utils/log.h"
+
+using namespace trace;
+
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  std::string path = "/tmp/trace_bench." + std::to_string(getpid());
+
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(5683);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  const size_t sizes[] = { 16, 64, 256, 1024 };
+
+  printf("%8s %12s %12s %12s %10s\n",
+         "size", "ns/record", "recorded", "dropped", "MB/s");
+
+  for (size_t size : sizes) {
+    std::vector<uint8_t> buf(size, 0x42);
+    net::Datagram dgram = { buf.data(), size,
+                            reinterpret_cast<sockaddr*>(&sin), sizeof sin };
+
+    TraceWriter writer;
+    assert(writer.Open(path));
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i)
+      writer.Record(dgram, Verdict::decoded);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    assert(writer.Close());
+
+    printf("%8zu %12.1f %12llu %12llu %10.0f\n", size,
+           1e9 * elapsed.count() / n,
+           static_cast<unsigned long long>(writer.recorded()),
+           static_cast<unsigned long long>(writer.dropped()),
+           writer.length() / elapsed.count() / 1e6);
+  }
+
+  unlink(path.c_str());
+}
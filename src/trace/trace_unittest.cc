@@ -0,0 +1,351 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace/trace.h"
+#include "utils/log.h"
+
+using namespace trace;
+
+void init_log() {
+  utils::Log::Instance()->Open("trace_unittest",
+                               LOG_PERROR | LOG_NDELAY,
+                               LOG_LOCAL0);
+}
+
+std::string temp_path(const char* name) {
+  return std::string("/tmp/trace_unittest.") + name + "." +
+         std::to_string(getpid());
+}
+
+sockaddr_in peer4(const char* addr, uint16_t port) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  assert(inet_pton(AF_INET, addr, &sin.sin_addr) == 1);
+  return sin;
+}
+
+sockaddr_in6 peer6(const char* addr, uint16_t port) {
+  sockaddr_in6 sin6;
+  memset(&sin6, 0, sizeof sin6);
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_port = htons(port);
+  assert(inet_pton(AF_INET6, addr, &sin6.sin6_addr) == 1);
+  return sin6;
+}
+
+// Datagram i: size bytes, each (i + j) & 0xFF.
+std::vector<uint8_t> payload(size_t i, size_t size) {
+  std::vector<uint8_t> buf(size);
+  for (size_t j = 0; j < size; ++j)
+    buf[j] = (i + j) & 0xFF;
+  return buf;
+}
+
+net::Datagram datagram(const std::vector<uint8_t>& buf, const void* peer,
+                       socklen_t peer_len) {
+  net::Datagram dgram;
+  dgram.data = buf.data();
+  dgram.size = buf.size();
+  dgram.peer = static_cast<const sockaddr*>(peer);
+  dgram.peer_len = peer_len;
+  return dgram;
+}
+
+// Write sizes.size() datagrams, alternating IPv4 and IPv6 peers and
+// verdicts.  Retry when the ring is full.
+void write(TraceWriter& writer, const std::vector<size_t>& sizes) {
+  sockaddr_in sin = peer4("192.0.2.1", 1000);
+  sockaddr_in6 sin6 = peer6("2001:db8::1", 2000);
+
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    std::vector<uint8_t> buf = payload(i, sizes[i]);
+    net::Datagram dgram = i % 2
+        ? datagram(buf, &sin6, sizeof sin6)
+        : datagram(buf, &sin, sizeof sin);
+    Verdict verdict = i % 3 ? Verdict::decoded : Verdict::rejected;
+
+    while (!writer.Record(dgram, verdict))
+      std::this_thread::yield();
+  }
+}
+
+void check(TraceReader& reader, const std::vector<size_t>& sizes) {
+  Record rec;
+  uint64_t last = 0;
+
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    assert(reader.Next(rec));
+    assert(rec.size == sizes[i]);
+    assert(rec.size == 0 || memcmp(rec.data, payload(i, sizes[i]).data(),
+                                   rec.size) == 0);
+    assert(rec.verdict == (i % 3 ? Verdict::decoded : Verdict::rejected));
+    assert(rec.time_ns >= last);
+    last = rec.time_ns;
+
+    if (i % 2) {
+      const sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&rec.peer);
+      assert(rec.peer_len == sizeof *sin6);
+      assert(sin6->sin6_family == AF_INET6);
+      assert(ntohs(sin6->sin6_port) == 2000);
+      assert(sin6->sin6_addr.s6_addr[0] == 0x20);
+      assert(sin6->sin6_addr.s6_addr[15] == 0x01);
+    } else {
+      const sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&rec.peer);
+      assert(rec.peer_len == sizeof *sin);
+      assert(sin->sin_family == AF_INET);
+      assert(ntohs(sin->sin_port) == 1000);
+      assert(ntohl(sin->sin_addr.s_addr) == 0xC0000201);
+    }
+  }
+
+  assert(!reader.Next(rec));
+}
+
+void test_ok_roundtrip() {
+  std::string path = temp_path("roundtrip");
+  sockaddr_in local = peer4("127.0.0.1", 5683);
+
+  std::vector<size_t> sizes = { 4, 0, 1, 7, 8, 9, 100, 1280, 1152, 4 };
+
+  TraceWriter writer;
+  assert(writer.Open(path, reinterpret_cast<sockaddr*>(&local)));
+  write(writer, sizes);
+  assert(writer.Close());
+  assert(writer.recorded() == sizes.size());
+  assert(writer.dropped() == 0);
+
+  size_t length = 0;
+  for (size_t size : sizes)
+    length += RecordLength(size);
+  assert(writer.length() == length);
+
+  TraceReader reader;
+  assert(reader.Open(path));
+  assert(reader.header().version == kVersion);
+  assert(reader.header().length == length);
+  assert(reader.header().local_family == 4);
+  assert(reader.header().local_port == 5683);
+  check(reader, sizes);
+
+  // Again.
+  reader.Rewind();
+  check(reader, sizes);
+
+  sockaddr_storage ss;
+  socklen_t len;
+  reader.local(ss, len);
+  assert(ss.ss_family == AF_INET && len == sizeof(sockaddr_in));
+
+  unlink(path.c_str());
+}
+
+void test_ok_read_while_writing() {
+  std::string path = temp_path("live");
+  std::vector<size_t> sizes(50, 64);
+
+  TraceWriter writer;
+  assert(writer.Open(path));
+  write(writer, sizes);
+
+  // Wait for the writer thread.
+  while (writer.length() < sizes.size() * RecordLength(64))
+    std::this_thread::yield();
+
+  TraceReader reader;
+  assert(reader.Open(path));
+  check(reader, sizes);
+
+  assert(writer.Close());
+  unlink(path.c_str());
+}
+
+void test_ok_sampling() {
+  std::string path = temp_path("sampling");
+  TraceConfig config = kDefaultTraceConfig;
+  config.sample_every = 4;
+
+  TraceWriter writer(config);
+  assert(writer.Open(path));
+
+  sockaddr_in sin = peer4("192.0.2.1", 1000);
+  std::vector<uint8_t> buf = payload(0, 16);
+  net::Datagram dgram = datagram(buf, &sin, sizeof sin);
+
+  size_t n = 0;
+  for (size_t i = 0; i < 100; ++i)
+    n += writer.Record(dgram, Verdict::decoded);
+
+  assert(writer.Close());
+  assert(n == 25 && writer.recorded() == 25);
+  assert(writer.length() == 25 * RecordLength(16));
+
+  unlink(path.c_str());
+}
+
+void test_ok_grow() {
+  // Past the first mapping of the file, through a small ring.
+  std::string path = temp_path("grow");
+  TraceConfig config = kDefaultTraceConfig;
+  config.ring_bytes = 64 << 10;
+
+  std::vector<size_t> sizes(20000, 1024);
+
+  TraceWriter writer(config);
+  assert(writer.Open(path));
+  write(writer, sizes);
+  assert(writer.Close());
+  assert(writer.recorded() == sizes.size());
+  assert(writer.length() == sizes.size() * RecordLength(1024));
+  assert(writer.length() > 16 << 20);
+
+  TraceReader reader;
+  assert(reader.Open(path));
+  check(reader, sizes);
+
+  unlink(path.c_str());
+}
+
+void test_ok_file_limit() {
+  std::string path = temp_path("limit");
+  TraceConfig config = kDefaultTraceConfig;
+  config.max_file_bytes = 10000;
+
+  std::vector<size_t> sizes(100, 100);
+
+  TraceWriter writer(config);
+  assert(writer.Open(path));
+  write(writer, sizes);
+  assert(writer.Close());
+
+  size_t fit = 10000 / RecordLength(100);
+  assert(writer.recorded() == 100);
+  assert(writer.dropped() == 100 - fit);
+  assert(writer.length() == fit * RecordLength(100));
+
+  TraceReader reader;
+  assert(reader.Open(path));
+  sizes.resize(fit);
+  check(reader, sizes);
+
+  unlink(path.c_str());
+}
+
+uint16_t checksum(const uint8_t* p, size_t n, uint32_t sum = 0) {
+  for (; n > 1; p += 2, n -= 2)
+    sum += (p[0] << 8) | p[1];
+  if (n)
+    sum += p[0] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return sum;
+}
+
+void test_ok_pcap() {
+  std::string path = temp_path("pcap");
+  std::string pcap = path + ".pcap";
+  sockaddr_in6 local = peer6("2001:db8::2", 5683);
+
+  std::vector<size_t> sizes = { 4, 13, 0 };
+
+  TraceWriter writer;
+  assert(writer.Open(path, reinterpret_cast<sockaddr*>(&local)));
+  write(writer, sizes);
+  assert(writer.Close());
+
+  TraceReader reader;
+  assert(reader.Open(path));
+  assert(ExportPcap(reader, pcap));
+
+  FILE* f = fopen(pcap.c_str(), "rb");
+  assert(f);
+  std::vector<uint8_t> file(1 << 16);
+  file.resize(fread(file.data(), 1, file.size(), f));
+  fclose(f);
+
+  uint32_t global[6];
+  assert(file.size() > sizeof global);
+  memcpy(global, file.data(), sizeof global);
+  assert(global[0] == 0xa1b23c4d);
+  assert(global[5] == 101);
+
+  size_t offset = sizeof global;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    uint32_t packet[4];
+    memcpy(packet, &file[offset], sizeof packet);
+    offset += sizeof packet;
+    const uint8_t* ip = &file[offset];
+
+    if (i % 2) {
+      // IPv6 from 2001:db8::1 port 2000 to the local address.
+      assert(packet[2] == 48 + sizes[i]);
+      assert(ip[0] == 0x60 && ip[6] == IPPROTO_UDP);
+      assert(ip[8] == 0x20 && ip[23] == 0x01 && ip[39] == 0x02);
+
+      const uint8_t* udp = ip + 40;
+      assert(((udp[0] << 8) | udp[1]) == 2000);
+      assert(((udp[2] << 8) | udp[3]) == 5683);
+
+      uint32_t pseudo = checksum(ip + 8, 32) + 8 + sizes[i] + IPPROTO_UDP;
+      assert(checksum(udp, 8 + sizes[i], pseudo) == 0xFFFF);
+    } else {
+      // IPv4 from 192.0.2.1 port 1000; the local address is IPv6.
+      assert(packet[2] == 28 + sizes[i]);
+      assert(ip[0] == 0x45 && ip[9] == IPPROTO_UDP);
+      assert(checksum(ip, 20) == 0xFFFF);
+      assert(ip[12] == 192 && ip[15] == 1);
+      assert(((ip[20] << 8) | ip[21]) == 1000);
+    }
+    assert(packet[2] == packet[3]);
+    assert(memcmp(&file[offset + packet[2] - sizes[i]],
+                  payload(i, sizes[i]).data(), sizes[i]) == 0);
+    offset += packet[2];
+  }
+  assert(offset == file.size());
+
+  unlink(pcap.c_str());
+  unlink(path.c_str());
+}
+
+void test_ko_open() {
+  TraceWriter writer;
+  assert(!writer.Open("/nonexistent/trace"));
+  assert(!writer.Close());
+
+  net::Datagram dgram;
+  memset(&dgram, 0, sizeof dgram);
+  assert(!writer.Record(dgram, Verdict::decoded));
+
+  std::string path = temp_path("garbage");
+  FILE* f = fopen(path.c_str(), "wb");
+  assert(f);
+  fputs("this is not a trace, but it is long enough to hold a header....\n", f);
+  fclose(f);
+
+  TraceReader reader;
+  assert(!reader.Open(path));
+  assert(!reader.Open("/nonexistent/trace"));
+
+  unlink(path.c_str());
+}
+
+int main() {
+  init_log();
+
+  test_ok_roundtrip();
+  test_ok_read_while_writing();
+  test_ok_sampling();
+  test_ok_grow();
+  test_ok_file_limit();
+  test_ok_pcap();
+  test_ko_open();
+}
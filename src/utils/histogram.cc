@@ -0,0 +1,95 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <algorithm>
+
+#include "utils/histogram.h"
+
+namespace utils {
+
+Histogram::Histogram()
+  : counts_(kBuckets, 0)
+  , count_(0)
+  , min_(UINT64_MAX)
+  , max_(0)
+  , sum_(0)
+{ }
+
+// Values below 2 * kSubBuckets have a bucket each.  Above, [2^m,
+// 2^(m+1)) is split in kSubBuckets buckets of 2^(m - kSubBits).
+size_t Histogram::Index(uint64_t value) {
+  if (value < 2 * kSubBuckets)
+    return value;
+
+  unsigned msb = 63 - __builtin_clzll(value);
+  unsigned shift = msb - kSubBits;
+
+  return (shift + 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+}
+
+uint64_t Histogram::UpperBound(size_t index) {
+  if (index < 2 * kSubBuckets)
+    return index;
+
+  unsigned shift = index / kSubBuckets - 1;
+  uint64_t sub = index % kSubBuckets;
+
+  return ((sub + kSubBuckets + 1) << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value, uint64_t count) {
+  if (count == 0)
+    return;
+
+  counts_[Index(value)] += count;
+  count_ += count;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  sum_ += static_cast<double>(value) * count;
+}
+
+void Histogram::Merge(const Histogram& other) {
+  for (size_t i = 0; i < kBuckets; ++i)
+    counts_[i] += other.counts_[i];
+
+  count_ += other.count_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+}
+
+void Histogram::Reset() {
+  std::fill(counts_.begin(), counts_.end(), 0);
+  count_ = 0;
+  min_ = UINT64_MAX;
+  max_ = 0;
+  sum_ = 0;
+}
+
+uint64_t Histogram::Percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  // Rank of the value wanted, 1-based.
+  uint64_t rank = std::max<uint64_t>(1, p / 100 * count_ + 0.5);
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += counts_[i];
+    if (seen >= rank)
+      return std::min(UpperBound(i), max_);
+  }
+
+  return max_;
+}
+
+void Histogram::Print(FILE* out, const char* label, double scale,
+                      const char* unit) const {
+  fprintf(out, "%s: n=%llu min=%.1f p50=%.1f p90=%.1f p99=%.1f "
+          "p99.9=%.1f p99.99=%.1f max=%.1f %s\n",
+          label, static_cast<unsigned long long>(count_),
+          min() / scale, Percentile(50) / scale, Percentile(90) / scale,
+          Percentile(99) / scale, Percentile(99.9) / scale,
+          Percentile(99.99) / scale, max() / scale, unit);
+}
+
+}   // namespace utils
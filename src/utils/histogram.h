@@ -0,0 +1,63 @@
+// Copyleft 2013 tho@autistici.org
+
+#ifndef UTILS_HISTOGRAM_H_
+#define UTILS_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+namespace utils {
+
+// HDR-style histogram of non-negative integer values (e.g. latencies
+// in ns): buckets are linear within each power of two, 128 of them,
+// so that any value is reported to within 1% over the whole 64-bit
+// range.  Recording is a couple of shifts and an increment; the
+// counts take 58KB.
+//
+// Not thread-safe: give each thread its own and Merge() them.
+class Histogram {
+ public:
+  Histogram();
+
+  void Record(uint64_t value) { Record(value, 1); }
+  void Record(uint64_t value, uint64_t count);
+
+  void Merge(const Histogram& other);
+  void Reset();
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? sum_ / count_ : 0; }
+
+  // Smallest value v such that at least p% of the recorded values are
+  // no greater than v (to within a bucket: the bucket's upper bound is
+  // returned, capped at max()).
+  uint64_t Percentile(double p) const;
+
+  // One line of percentiles, values divided by scale (e.g. 1000 to
+  // print ns as us) and followed by unit.
+  void Print(FILE* out, const char* label, double scale,
+             const char* unit) const;
+
+ private:
+  static const unsigned kSubBits = 7;
+  static const uint64_t kSubBuckets = 1 << kSubBits;
+  static const size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  static size_t Index(uint64_t value);
+  static uint64_t UpperBound(size_t index);
+
+ private:
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t min_;
+  uint64_t max_;
+  double sum_;
+};
+
+}   // namespace utils
+
+#endif  // UTILS_HISTOGRAM_H_
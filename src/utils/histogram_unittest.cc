@@ -0,0 +1,71 @@
+// Copyleft 2013 tho@autistici.org
+
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include "utils/histogram.h"
+
+using utils::Histogram;
+
+void test_ok_exact_small_values() {
+  Histogram h;
+  for (uint64_t v = 1; v <= 100; ++v)
+    h.Record(v);
+
+  assert(h.count() == 100);
+  assert(h.min() == 1 && h.max() == 100);
+  assert(h.mean() == 50.5);
+  assert(h.Percentile(50) == 50);
+  assert(h.Percentile(99) == 99);
+  assert(h.Percentile(100) == 100);
+}
+
+// Against sorted samples, over a wide range: within 1%.
+void test_ok_precision() {
+  Histogram h;
+  std::vector<uint64_t> samples;
+
+  srand(42);
+  for (int i = 0; i < 100000; ++i) {
+    uint64_t v = static_cast<uint64_t>(rand()) << (rand() % 30);
+    samples.push_back(v);
+    h.Record(v);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  const double ps[] = { 1, 10, 50, 90, 99, 99.9 };
+  for (double p : ps) {
+    uint64_t exact = samples[static_cast<size_t>(p / 100 * samples.size() +
+                                                 0.5) - 1];
+    uint64_t approx = h.Percentile(p);
+    assert(approx >= exact);
+    assert(approx - exact <= exact / 100 + 1);
+  }
+
+  assert(h.max() == samples.back());
+  assert(h.Percentile(100) == samples.back());
+}
+
+void test_ok_merge() {
+  Histogram a, b;
+  a.Record(10, 3);
+  b.Record(1000000);
+  b.Record(UINT64_MAX);
+  a.Merge(b);
+
+  assert(a.count() == 5);
+  assert(a.min() == 10);
+  assert(a.max() == UINT64_MAX);
+  assert(a.Percentile(60) == 10);
+  assert(a.Percentile(80) >= 1000000 && a.Percentile(80) < 1010000);
+
+  a.Reset();
+  assert(a.count() == 0 && a.Percentile(50) == 0 && a.min() == 0);
+}
+
+int main() {
+  test_ok_exact_small_values();
+  test_ok_precision();
+  test_ok_merge();
+}